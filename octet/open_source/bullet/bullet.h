@@ -1,4 +1,6 @@
 
+// the Bullet profiler is not thread safe and octet can solve islands on many threads.
+#define BT_NO_PROFILE 1
 #include "LinearMath/btMatrix3x3.h"
 
 inline btMatrix3x3 get_btMatrix3x3(const octet::mat4t &m) {
@@ -1,63 +1,89 @@
 //////////////////////////////////////////////////////////////////////////////////////////
 //
-// raycast shader example
+// raycast molecule shader
+//
+// Draws atoms as spheres by tracing a ray through a bounding volume hierarchy (see sphere_bvh.h).
+// The box around the molecule is drawn with back faces so that the ray starts at the camera.
 //
 
 // inputs
 varying vec3 model_pos_;
 
+// camera position in model space
 uniform vec3 camera_pos;
 
-uniform vec4 spheres[200];
-uniform int num_spheres;
+// number of nodes, 1/texture width, 1/height of the nodes texture, 1/height of the atoms textures
+uniform vec4 bvh_size;
 
-uniform sampler1D data;
+// two texels per node: (min, escape or -count) (max, first atom)
+uniform sampler2D nodes;
 
-float squared(vec3 v) { return dot(v, v); }
+// one texel per atom: (centre, radius) and colour
+uniform sampler2D atoms;
+uniform sampler2D colours;
 
-float calc_value(vec3 pos, inout vec4 v) {
-  float sum = 0;
-  for (int i = 0; i != num_spheres; ++i) {
-    sum += exp(squared(vec3(spheres[i*2+0]) - pos) * spheres[i*2+0].w);
-  }
-  return sum;
-  /*v[0] = exp(squared(vec3(spheres[0*2+0]) - pos) * spheres[0*2+0].w);
-  v[1] = exp(squared(vec3(spheres[1*2+0]) - pos) * spheres[1*2+0].w);
-  v[2] = exp(squared(vec3(spheres[2*2+0]) - pos) * spheres[2*2+0].w);
-  v[3] = exp(squared(vec3(spheres[3*2+0]) - pos) * spheres[3*2+0].w);
-  return v[0] + v[1] + v[2] + v[3];*/
+vec2 texel(float index, float inv_height) {
+  float y = floor(index * bvh_size.y);
+  float x = index - y / bvh_size.y;
+  return vec2((x + 0.5) * bvh_size.y, (y + 0.5) * inv_height);
 }
 
-// note that a more sophisticated system might pick the four closest spheres
-// to the ray and hence be able to use many more spheres. A BVH will make this
-// much faster.
 void main() {
-  vec3 ray_start = model_pos_;
+  vec3 ray_start = camera_pos;
   vec3 ray_direction = normalize(model_pos_ - camera_pos);
-  vec3 pos = ray_start;
-  vec3 best_pos = ray_start;
-  vec3 delta = ray_direction * 0.5;
-  vec4 v;
-  float prev_value = calc_value(pos, v);
-  const float threshold = 0.5;
-  bool done = false;
-  for (int i = 0; i != 40; ++i) {
-    pos += delta;
-    float value = calc_value(pos, v);
-    if (value > threshold && !done) {
-      best_pos = pos - delta * (value - threshold) / (value - prev_value);
-      // note that it is tempting to add a "break" here. Some GPUs may go faster others will go slower
-      // because some CUs will have to still run.
-      done = true;
+  vec3 inv_direction = 1.0 / ray_direction;
+  float max_t = length(model_pos_ - camera_pos);
+  float best_atom = -1.0;
+  vec3 best_centre = vec3(0.0);
+
+  float node = 0.0;
+  for (int i = 0; i != 65536; ++i) {
+    if (node >= bvh_size.x) break;
+    vec4 lo = texture2D(nodes, texel(node * 2.0, bvh_size.z));
+    vec4 hi = texture2D(nodes, texel(node * 2.0 + 1.0, bvh_size.z));
+
+    // slab test
+    vec3 t0 = (lo.xyz - ray_start) * inv_direction;
+    vec3 t1 = (hi.xyz - ray_start) * inv_direction;
+    vec3 tmin = min(t0, t1);
+    vec3 tmax = max(t0, t1);
+    float enter = max(max(tmin.x, tmin.y), max(tmin.z, 0.0));
+    float leave = min(min(tmax.x, tmax.y), min(tmax.z, max_t));
+
+    if (enter <= leave) {
+      if (lo.w < 0.0) {
+        // leaf: up to four atoms
+        for (int j = 0; j != 4; ++j) {
+          if (float(j) < -lo.w) {
+            float atom = hi.w + float(j);
+            vec4 sphere = texture2D(atoms, texel(atom, bvh_size.w));
+            vec3 oc = ray_start - sphere.xyz;
+            float b = dot(oc, ray_direction);
+            vec3 miss = oc - ray_direction * b;
+            float disc = sphere.w * sphere.w - dot(miss, miss);
+            if (disc >= 0.0) {
+              float t = -b - sqrt(disc);
+              if (t >= 0.0 && t < max_t) {
+                max_t = t;
+                best_atom = atom;
+                best_centre = sphere.xyz;
+              }
+            }
+          }
+        }
+      }
+      node += 1.0;
+    } else {
+      node = lo.w < 0.0 ? node + 1.0 : lo.w;
     }
-    prev_value = value;
   }
 
-  float value = calc_value(best_pos, v);
-  v = normalize(v);
-  //gl_FragColor = v[0] * spheres[0*2+1] + v[1] * spheres[1*2+1] + v[2] * spheres[2*2+1] + v[3] * spheres[3*2+1];
-  gl_FragColor = vec4(1, 0, 0, 1);
+  if (best_atom < 0.0) discard;
 
-  if (!done) discard;
+  // light from the camera
+  vec3 pos = ray_start + ray_direction * max_t;
+  vec3 normal = normalize(pos - best_centre);
+  float diffuse = max(dot(normal, -ray_direction), 0.0);
+  vec3 colour = texture2D(colours, texel(best_atom, bvh_size.w)).xyz;
+  gl_FragColor = vec4(colour * (0.2 + 0.8 * diffuse), 1.0);
 }
-
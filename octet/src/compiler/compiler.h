@@ -29,6 +29,7 @@
   #include "../compiler/cpp_error.h"
   #include "../compiler/cpp_tokens.h"
   #include "../compiler/cpp_lexer.h"
+  #include "../compiler/cpp_define_matrix.h"
   #include "../compiler/cpp_preprocessor.h"
   #include "../compiler/cpp_value.h"
   #include "../compiler/cpp_expr.h"
@@ -36,5 +37,6 @@
   #include "../compiler/cpp_statement.h"
   #include "../compiler/cpp_scope.h"
   #include "../compiler/cpp_parser.h"
+  #include "../compiler/cpp_kernel.h"
 
 #endif
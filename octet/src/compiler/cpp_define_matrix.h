@@ -0,0 +1,67 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Sets of #defines for making shader variants
+//
+
+namespace octet
+{
+  namespace compiler
+  {
+    /// A list of axes, each with a set of alternative #defines.
+    /// Every combination of one choice per axis is a variant.
+    ///
+    /// Example:
+    ///
+    ///     cpp_define_matrix matrix;
+    ///     const char *skin[] = { "", "SKINNED" };
+    ///     const char *lights[] = { "NUM_LIGHTS=1", "NUM_LIGHTS=2", "NUM_LIGHTS=4" };
+    ///     matrix.add_axis(skin, 2);
+    ///     matrix.add_axis(lights, 3);
+    ///     // matrix.get_num_variants() == 6
+    class cpp_define_matrix {
+      dynarray<const char *> choices;
+      dynarray<unsigned> axis_start;
+
+    public:
+      cpp_define_matrix() {
+        axis_start.push_back(0);
+      }
+
+      /// Add an axis. "" defines nothing, "NAME" defines NAME as 1 and "NAME=value" defines NAME as value.
+      /// The strings must outlive the matrix.
+      void add_axis(const char *const *values, unsigned num_values) {
+        for (unsigned i = 0; i != num_values; ++i) {
+          choices.push_back(values[i]);
+        }
+        axis_start.push_back(choices.size());
+      }
+
+      unsigned get_num_axes() const {
+        return axis_start.size() - 1;
+      }
+
+      unsigned get_num_variants() const {
+        unsigned result = 1;
+        for (unsigned i = 0; i != get_num_axes(); ++i) {
+          result *= axis_start[i+1] - axis_start[i];
+        }
+        return result;
+      }
+
+      /// get the defines of one variant. The first axis changes fastest.
+      void get_variant(dynarray<const char *> &defines, unsigned index) const {
+        defines.resize(0);
+        for (unsigned i = 0; i != get_num_axes(); ++i) {
+          unsigned size = axis_start[i+1] - axis_start[i];
+          const char *choice = choices[axis_start[i] + index % size];
+          index /= size;
+          if (choice[0]) defines.push_back(choice);
+        }
+      }
+    };
+  }
+}
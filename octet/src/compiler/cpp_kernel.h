@@ -0,0 +1,2352 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Compiler for GLSL compute kernels that run on the CPU
+//
+
+namespace octet
+{
+  namespace compiler
+  {
+    /// Compiles a GLSL compute shader to vector code for the CPU.
+    ///
+    /// Every register holds one variable for a batch of up to 64 invocations, so each instruction
+    /// is one pass over the batch: SSE or AVX2 for the common instructions, lane loops for the rest.
+    /// Control flow uses lane masks: both sides of an if run with a mask and loops run until no lane is active.
+    ///
+    /// Supported: structs in buffers (std140 and std430), uniforms, float/int/uint/bool scalars
+    /// and vectors, swizzles, if/else, for, while, break, continue, return, inlined functions
+    /// and the common built in functions. Not supported: shared memory, barriers, images,
+    /// matrices, atomics and local arrays.
+    ///
+    /// Example:
+    ///
+    ///     cpp_kernel kernel;
+    ///     if (kernel.compile(source, "helix.cs")) {
+    ///       // see shaders::cpu_compute_shader for running the kernel
+    ///     }
+    class cpp_kernel {
+    public:
+      enum { lanes = 8, max_batch = 64 };
+
+      /// one register: the same variable in eight invocations.
+      struct lane_reg {
+        union {
+          float f[lanes];
+          int32_t i[lanes];
+          uint32_t u[lanes];
+        };
+      };
+
+      /// memory for a buffer block.
+      struct buffer_binding {
+        uint32_t *data;
+        uint32_t num_words;
+      };
+
+      enum base_type {
+        base_void,
+        base_float,
+        base_int,
+        base_uint,
+        base_bool,
+      };
+
+      /// registers filled in for each batch of invocations.
+      enum builtin_register {
+        reg_mask,
+        reg_global_id,
+        reg_local_id = reg_global_id + 3,
+        reg_group_id = reg_local_id + 3,
+        reg_local_index = reg_group_id + 3,
+        reg_group_size,
+        reg_num_groups = reg_group_size + 3,
+        num_builtin_regs = reg_num_groups + 3,
+      };
+
+      struct uniform_info {
+        uint8_t base;
+        uint8_t size;
+        uint16_t reg;
+      };
+
+    private:
+      enum opcode {
+        op_end,
+        op_mov,
+        op_select,  // dst = c ? a : b
+
+        op_fadd, op_fsub, op_fmul, op_fdiv, op_fmin, op_fmax, op_fneg, op_fabs, op_fsign,
+        op_floor, op_ceil, op_sqrt, op_rsqrt, op_sin, op_cos, op_tan, op_asin, op_acos,
+        op_atan, op_atan2, op_pow, op_exp, op_log, op_exp2, op_log2, op_fmod,
+        op_flt, op_fle, op_feq, op_fne,
+
+        op_iadd, op_isub, op_imul, op_idiv, op_imod, op_udiv, op_umod, op_ineg, op_iabs,
+        op_imin, op_imax, op_umin, op_umax,
+        op_ilt, op_ile, op_ieq, op_ine, op_ult, op_ule,
+
+        op_and, op_andn, op_or, op_xor, op_not, op_shl, op_shr, op_ushr,
+        op_itof, op_utof, op_ftoi, op_ftou,
+
+        op_load,   // dst = buffer[a + imm]
+        op_store,  // buffer[a + imm] = dst in lanes of mask c
+        op_store4, // an op_store followed by three more to the next words, which may run as one
+        op_jump,   // goto imm
+        op_branch_none, // goto imm if no lane of c is set
+        op_branch_any,  // goto imm if a lane of c is set
+
+        op_last,
+      };
+
+      struct instruction {
+        uint16_t op;
+        uint16_t dst, a, b, c;
+        uint16_t imm;
+        uint16_t buffer;
+      };
+
+      enum {
+        fixed_reg = 0x8000,
+        max_inline_depth = 32,
+        max_kept_results = 16, // registers temp() steps over to keep reusable results
+      };
+
+      enum keyword {
+        kw_struct = cpp_tokens::tok_last, kw_uniform, kw_buffer, kw_layout, kw_in, kw_out, kw_inout,
+        kw_const, kw_if, kw_else, kw_for, kw_while, kw_break, kw_continue, kw_return, kw_true,
+        kw_false, kw_precision, kw_qualifier,
+      };
+
+      enum value_kind {
+        v_none,
+        v_rvalue, // registers that can not be assigned
+        v_var,    // registers of a variable
+        v_buffer, // scalar or vector in a buffer; comps are word offsets
+        v_struct, // struct in a buffer
+        v_array,  // array in a buffer
+      };
+
+      struct value {
+        uint8_t kind;
+        uint8_t base;
+        uint8_t size;
+        uint16_t comps[4];
+        int depth;    // control depth of a variable's declaration
+        int type;     // struct of v_struct or array element
+        int buffer;   // buffer slot
+        uint16_t addr; // register with the word index in the buffer
+        int offset;   // word offset of a v_struct or v_array
+        int stride;   // words between array elements
+        int length;   // array length or -1
+      };
+
+      struct struct_member {
+        int name;
+        uint8_t base;
+        uint8_t size;
+        int type;     // struct or -1
+        int length;   // 0: not an array, -1: runtime sized
+        unsigned offset, stride;
+      };
+
+      struct struct_type {
+        int name;
+        dynarray<struct_member> members;
+        unsigned size, align;
+        bool std140;
+        int other_layout; // the same struct in the other layout or -1
+      };
+
+      struct function {
+        int name;
+        uint8_t base;
+        uint8_t size;
+        unsigned first_param;
+        unsigned body;
+      };
+
+      enum symbol_kind { sym_value, sym_function, sym_struct };
+
+      struct symbol {
+        int name;
+        int kind;
+        int index;
+        value v;
+      };
+
+      struct token {
+        int tok;
+        int line;
+        int name;
+        double dvalue;
+        uint64_t ivalue;
+      };
+
+      struct loop_info {
+        unsigned loop_mask; // index in masks
+        unsigned body_mask;
+      };
+
+      // program
+      dynarray<instruction> code;
+      dynarray<instruction> uniform_code; // values that depend only on uniforms, run once per dispatch
+      dynarray<uint32_t> fixed_bits;
+      dynarray<bool> fixed_is_constant;
+      unsigned num_dynamic_regs;
+      unsigned local_size[3];
+      unsigned batch_chunks;  // lane_regs per register in a frame
+      dictionary<int> uniform_index;
+      dynarray<uniform_info> uniforms;
+      dynarray<unsigned> buffer_bindings; // binding of each buffer slot
+      dynarray<lane_reg> image;
+      string error_text;
+
+      // compiler state
+      cpp_preprocessor preprocessor;
+      dynarray<token> tokens;
+      unsigned pos;
+      bool failed;
+      dictionary<int> name_index;
+      dynarray<char> name_text;
+      dynarray<symbol> symbols;
+      unsigned num_globals;   // symbols visible in functions
+      unsigned frame_base;    // first symbol of the current function
+      value return_value;     // of the current function
+      unsigned return_mask;   // index in masks
+      dynarray<struct_type*> structs;
+      dynarray<function> functions;
+      dynarray<uint16_t> masks;
+      dynarray<loop_info> loops;
+      dynarray<instruction> available; // pure operations whose results can be reused
+      unsigned reg_top;
+      unsigned vars_top;
+      int inline_depth;
+      int name_main;
+
+      static unsigned get_arity(unsigned op) {
+        switch (op) {
+          case op_end: case op_load: case op_store: case op_store4: case op_jump: case op_branch_none: case op_branch_any: return 0;
+          case op_select: return 3;
+          case op_mov: case op_fneg: case op_fabs: case op_fsign: case op_floor: case op_ceil: case op_sqrt: case op_rsqrt:
+          case op_sin: case op_cos: case op_tan: case op_asin: case op_acos: case op_atan: case op_exp: case op_log:
+          case op_exp2: case op_log2: case op_ineg: case op_iabs: case op_not: case op_itof: case op_utof: case op_ftoi:
+          case op_ftou: return 1;
+        }
+        return 2;
+      }
+
+      ////////////////////////////////////////////////////////////////////////////////
+      //
+      // execution
+      //
+
+      // sin or cos of the lanes, accurate to about 1e-7 for small angles.
+      static float sin_cos(float x, int quadrant) {
+        // q = floor(x * 2/pi + 0.5) without branches, so that the lane loops vectorize.
+        float fq = x * 0.636619772f + 0.5f;
+        int q = (int)fq;
+        q -= (float)q > fq;
+        float r = x - (float)q * 1.5703125f - (float)q * 4.83751297e-4f - (float)q * 7.54978995e-8f;
+        q += quadrant;
+        float r2 = r * r;
+        float s = r + r * r2 * (-1.6666654611e-1f + r2 * (8.3321608736e-3f + r2 * -1.9515295891e-4f));
+        float c = 1.0f - 0.5f * r2 + r2 * r2 * (4.166664568298827e-2f + r2 * (-1.388731625493765e-3f + r2 * 2.443315711809948e-5f));
+        float odd = (float)(q & 1);
+        return (s + (c - s) * odd) * (float)(1 - (q & 2));
+      }
+
+      #if OCTET_SSE
+        // Common instructions on a whole batch with SIMD code. Returns false for the lane loops.
+        typedef bool (*simd_fn)(const instruction *ip, lane_reg *rd, const lane_reg *ra, const lane_reg *rb, const lane_reg *rc, unsigned chunks);
+
+        // sin_cos of four lanes, in the same order so that every path gives the same answer.
+        static __m128 sin_cos_sse(__m128 x, int quadrant) {
+          __m128 fq = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(0.636619772f)), _mm_set1_ps(0.5f));
+          __m128i q = _mm_cvttps_epi32(fq);
+          q = _mm_add_epi32(q, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(q), fq)));
+          __m128 fqi = _mm_cvtepi32_ps(q);
+          __m128 r = _mm_sub_ps(x, _mm_mul_ps(fqi, _mm_set1_ps(1.5703125f)));
+          r = _mm_sub_ps(r, _mm_mul_ps(fqi, _mm_set1_ps(4.83751297e-4f)));
+          r = _mm_sub_ps(r, _mm_mul_ps(fqi, _mm_set1_ps(7.54978995e-8f)));
+          q = _mm_add_epi32(q, _mm_set1_epi32(quadrant));
+          __m128 r2 = _mm_mul_ps(r, r);
+          __m128 ps = _mm_add_ps(_mm_set1_ps(8.3321608736e-3f), _mm_mul_ps(r2, _mm_set1_ps(-1.9515295891e-4f)));
+          ps = _mm_add_ps(_mm_set1_ps(-1.6666654611e-1f), _mm_mul_ps(r2, ps));
+          __m128 s = _mm_add_ps(r, _mm_mul_ps(_mm_mul_ps(r, r2), ps));
+          __m128 pc = _mm_add_ps(_mm_set1_ps(-1.388731625493765e-3f), _mm_mul_ps(r2, _mm_set1_ps(2.443315711809948e-5f)));
+          pc = _mm_add_ps(_mm_set1_ps(4.166664568298827e-2f), _mm_mul_ps(r2, pc));
+          __m128 c = _mm_add_ps(_mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(_mm_set1_ps(0.5f), r2)), _mm_mul_ps(_mm_mul_ps(r2, r2), pc));
+          __m128 odd = _mm_cvtepi32_ps(_mm_and_si128(q, _mm_set1_epi32(1)));
+          __m128 sign = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_set1_epi32(1), _mm_and_si128(q, _mm_set1_epi32(2))));
+          return _mm_mul_ps(_mm_add_ps(s, _mm_mul_ps(_mm_sub_ps(c, s), odd)), sign);
+        }
+
+        // SSE2 has no 32 bit multiply, so multiply the even and odd lanes separately.
+        static __m128i mullo_sse(__m128i a, __m128i b) {
+          __m128i even = _mm_mul_epu32(a, b);
+          __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+          return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+        }
+
+        static __m128i select_sse(__m128i mask, __m128i a, __m128i b) {
+          return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+        }
+
+        // both halves convert exactly, so the sum is rounded once like (float)u.
+        static __m128 utof_sse(__m128i a) {
+          __m128 hi = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(a, 16)), _mm_set1_ps(65536.0f));
+          return _mm_add_ps(hi, _mm_cvtepi32_ps(_mm_and_si128(a, _mm_set1_epi32(0xffff))));
+        }
+
+        static bool simd_sse(const instruction *ip, lane_reg *rd, const lane_reg *ra, const lane_reg *rb, const lane_reg *rc, unsigned chunks) {
+          // a, b and c are four lanes of the sources; two steps for each lane_reg.
+          #define OCTET_KERNEL_PS4(k, ...) { \
+              __m128 a = _mm_loadu_ps(fa + (k)), b = _mm_loadu_ps(fb + (k)), c = _mm_loadu_ps(fc + (k)); \
+              (void)a; (void)b; (void)c; \
+              _mm_storeu_ps(fd + (k), __VA_ARGS__); \
+            }
+          #define OCTET_KERNEL_EPI4(k, ...) { \
+              __m128i a = _mm_loadu_si128((const __m128i*)(fa + (k))), b = _mm_loadu_si128((const __m128i*)(fb + (k))); \
+              (void)a; (void)b; \
+              _mm_storeu_si128((__m128i*)(fd + (k)), __VA_ARGS__); \
+            }
+          #define OCTET_KERNEL_PS(...) for (unsigned k = 0; k != batch; k += 8) { OCTET_KERNEL_PS4(k, __VA_ARGS__) OCTET_KERNEL_PS4(k + 4, __VA_ARGS__) } return true
+          #define OCTET_KERNEL_EPI(...) for (unsigned k = 0; k != batch; k += 8) { OCTET_KERNEL_EPI4(k, __VA_ARGS__) OCTET_KERNEL_EPI4(k + 4, __VA_ARGS__) } return true
+
+          unsigned batch = chunks * lanes;
+          float *fd = rd->f;
+          const float *fa = ra->f, *fb = rb->f, *fc = rc->f;
+          __m128 sign = _mm_set1_ps(-0.0f), one = _mm_set1_ps(1.0f), zero = _mm_setzero_ps();
+          __m128i ones = _mm_set1_epi32(-1), top = _mm_set1_epi32((int)0x80000000);
+          switch (ip->op) {
+            case op_mov: OCTET_KERNEL_PS(a);
+            case op_select: OCTET_KERNEL_PS(_mm_or_ps(_mm_and_ps(c, a), _mm_andnot_ps(c, b)));
+
+            case op_fadd: OCTET_KERNEL_PS(_mm_add_ps(a, b));
+            case op_fsub: OCTET_KERNEL_PS(_mm_sub_ps(a, b));
+            case op_fmul: OCTET_KERNEL_PS(_mm_mul_ps(a, b));
+            case op_fdiv: OCTET_KERNEL_PS(_mm_div_ps(a, b));
+            case op_fmin: OCTET_KERNEL_PS(_mm_min_ps(a, b));
+            case op_fmax: OCTET_KERNEL_PS(_mm_max_ps(a, b));
+            case op_fneg: OCTET_KERNEL_PS(_mm_xor_ps(a, sign));
+            case op_fabs: OCTET_KERNEL_PS(_mm_andnot_ps(sign, a));
+            case op_fsign: OCTET_KERNEL_PS(_mm_sub_ps(_mm_and_ps(_mm_cmpgt_ps(a, zero), one), _mm_and_ps(_mm_cmplt_ps(a, zero), one)));
+            case op_floor: OCTET_KERNEL_PS(_mm_sub_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(a)), _mm_and_ps(_mm_cmpgt_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(a)), a), one)));
+            case op_ceil: OCTET_KERNEL_PS(_mm_add_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(a)), _mm_and_ps(_mm_cmplt_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(a)), a), one)));
+            case op_sqrt: OCTET_KERNEL_PS(_mm_sqrt_ps(a));
+            case op_rsqrt: OCTET_KERNEL_PS(_mm_div_ps(one, _mm_sqrt_ps(a)));
+            case op_sin: OCTET_KERNEL_PS(sin_cos_sse(a, 0));
+            case op_cos: OCTET_KERNEL_PS(sin_cos_sse(a, 1));
+            case op_flt: OCTET_KERNEL_PS(_mm_cmplt_ps(a, b));
+            case op_fle: OCTET_KERNEL_PS(_mm_cmple_ps(a, b));
+            case op_feq: OCTET_KERNEL_PS(_mm_cmpeq_ps(a, b));
+            case op_fne: OCTET_KERNEL_PS(_mm_cmpneq_ps(a, b));
+
+            case op_iadd: OCTET_KERNEL_EPI(_mm_add_epi32(a, b));
+            case op_isub: OCTET_KERNEL_EPI(_mm_sub_epi32(a, b));
+            case op_imul: OCTET_KERNEL_EPI(mullo_sse(a, b));
+            case op_ineg: OCTET_KERNEL_EPI(_mm_sub_epi32(_mm_setzero_si128(), a));
+            case op_iabs: OCTET_KERNEL_EPI(_mm_sub_epi32(_mm_xor_si128(a, _mm_srai_epi32(a, 31)), _mm_srai_epi32(a, 31)));
+            case op_imin: OCTET_KERNEL_EPI(select_sse(_mm_cmplt_epi32(a, b), a, b));
+            case op_imax: OCTET_KERNEL_EPI(select_sse(_mm_cmpgt_epi32(a, b), a, b));
+            case op_umin: OCTET_KERNEL_EPI(select_sse(_mm_cmplt_epi32(_mm_xor_si128(a, top), _mm_xor_si128(b, top)), a, b));
+            case op_umax: OCTET_KERNEL_EPI(select_sse(_mm_cmpgt_epi32(_mm_xor_si128(a, top), _mm_xor_si128(b, top)), a, b));
+            case op_ilt: OCTET_KERNEL_EPI(_mm_cmplt_epi32(a, b));
+            case op_ile: OCTET_KERNEL_EPI(_mm_xor_si128(_mm_cmpgt_epi32(a, b), ones));
+            case op_ieq: OCTET_KERNEL_EPI(_mm_cmpeq_epi32(a, b));
+            case op_ine: OCTET_KERNEL_EPI(_mm_xor_si128(_mm_cmpeq_epi32(a, b), ones));
+            case op_ult: OCTET_KERNEL_EPI(_mm_cmplt_epi32(_mm_xor_si128(a, top), _mm_xor_si128(b, top)));
+            case op_ule: OCTET_KERNEL_EPI(_mm_xor_si128(_mm_cmpgt_epi32(_mm_xor_si128(a, top), _mm_xor_si128(b, top)), ones));
+
+            case op_and: OCTET_KERNEL_EPI(_mm_and_si128(a, b));
+            case op_andn: OCTET_KERNEL_EPI(_mm_andnot_si128(b, a));
+            case op_or: OCTET_KERNEL_EPI(_mm_or_si128(a, b));
+            case op_xor: OCTET_KERNEL_EPI(_mm_xor_si128(a, b));
+            case op_not: OCTET_KERNEL_EPI(_mm_xor_si128(a, ones));
+            case op_itof: OCTET_KERNEL_EPI(_mm_castps_si128(_mm_cvtepi32_ps(a)));
+            case op_utof: OCTET_KERNEL_EPI(_mm_castps_si128(utof_sse(a)));
+            case op_ftoi: OCTET_KERNEL_PS(_mm_castsi128_ps(_mm_cvttps_epi32(a)));
+          }
+          return false;
+
+          #undef OCTET_KERNEL_PS4
+          #undef OCTET_KERNEL_EPI4
+          #undef OCTET_KERNEL_PS
+          #undef OCTET_KERNEL_EPI
+        }
+      #endif
+
+      #if OCTET_AVX
+        // the same with eight lanes in a register. FMA would change the rounding, so it is not used.
+        __attribute__((target("avx2"))) static __m256 sin_cos_avx(__m256 x, int quadrant) {
+          __m256 fq = _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(0.636619772f)), _mm256_set1_ps(0.5f));
+          __m256i q = _mm256_cvttps_epi32(fq);
+          q = _mm256_add_epi32(q, _mm256_castps_si256(_mm256_cmp_ps(_mm256_cvtepi32_ps(q), fq, _CMP_GT_OQ)));
+          __m256 fqi = _mm256_cvtepi32_ps(q);
+          __m256 r = _mm256_sub_ps(x, _mm256_mul_ps(fqi, _mm256_set1_ps(1.5703125f)));
+          r = _mm256_sub_ps(r, _mm256_mul_ps(fqi, _mm256_set1_ps(4.83751297e-4f)));
+          r = _mm256_sub_ps(r, _mm256_mul_ps(fqi, _mm256_set1_ps(7.54978995e-8f)));
+          q = _mm256_add_epi32(q, _mm256_set1_epi32(quadrant));
+          __m256 r2 = _mm256_mul_ps(r, r);
+          __m256 ps = _mm256_add_ps(_mm256_set1_ps(8.3321608736e-3f), _mm256_mul_ps(r2, _mm256_set1_ps(-1.9515295891e-4f)));
+          ps = _mm256_add_ps(_mm256_set1_ps(-1.6666654611e-1f), _mm256_mul_ps(r2, ps));
+          __m256 s = _mm256_add_ps(r, _mm256_mul_ps(_mm256_mul_ps(r, r2), ps));
+          __m256 pc = _mm256_add_ps(_mm256_set1_ps(-1.388731625493765e-3f), _mm256_mul_ps(r2, _mm256_set1_ps(2.443315711809948e-5f)));
+          pc = _mm256_add_ps(_mm256_set1_ps(4.166664568298827e-2f), _mm256_mul_ps(r2, pc));
+          __m256 c = _mm256_add_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(_mm256_set1_ps(0.5f), r2)), _mm256_mul_ps(_mm256_mul_ps(r2, r2), pc));
+          __m256 odd = _mm256_cvtepi32_ps(_mm256_and_si256(q, _mm256_set1_epi32(1)));
+          __m256 sign = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_set1_epi32(1), _mm256_and_si256(q, _mm256_set1_epi32(2))));
+          return _mm256_mul_ps(_mm256_add_ps(s, _mm256_mul_ps(_mm256_sub_ps(c, s), odd)), sign);
+        }
+
+        __attribute__((target("avx2"))) static __m256 utof_avx(__m256i a) {
+          __m256 hi = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(a, 16)), _mm256_set1_ps(65536.0f));
+          return _mm256_add_ps(hi, _mm256_cvtepi32_ps(_mm256_and_si256(a, _mm256_set1_epi32(0xffff))));
+        }
+
+        __attribute__((target("avx2"))) static bool simd_avx(const instruction *ip, lane_reg *rd, const lane_reg *ra, const lane_reg *rb, const lane_reg *rc, unsigned chunks) {
+          // a, b and c are the lane_regs of the sources.
+          #define OCTET_KERNEL_PS(...) \
+            for (unsigned k = 0; k != chunks; ++k) { \
+              __m256 a = _mm256_loadu_ps(ra[k].f), b = _mm256_loadu_ps(rb[k].f), c = _mm256_loadu_ps(rc[k].f); \
+              (void)a; (void)b; (void)c; \
+              _mm256_storeu_ps(rd[k].f, __VA_ARGS__); \
+            } return true
+          #define OCTET_KERNEL_EPI(...) \
+            for (unsigned k = 0; k != chunks; ++k) { \
+              __m256i a = _mm256_loadu_si256((const __m256i*)ra[k].i), b = _mm256_loadu_si256((const __m256i*)rb[k].i); \
+              (void)a; (void)b; \
+              _mm256_storeu_si256((__m256i*)rd[k].i, __VA_ARGS__); \
+            } return true
+
+          __m256 sign = _mm256_set1_ps(-0.0f), one = _mm256_set1_ps(1.0f), zero = _mm256_setzero_ps();
+          __m256i ones = _mm256_set1_epi32(-1), top = _mm256_set1_epi32((int)0x80000000), shift = _mm256_set1_epi32(31);
+          switch (ip->op) {
+            case op_mov: OCTET_KERNEL_PS(a);
+            case op_select: OCTET_KERNEL_PS(_mm256_or_ps(_mm256_and_ps(c, a), _mm256_andnot_ps(c, b)));
+
+            case op_fadd: OCTET_KERNEL_PS(_mm256_add_ps(a, b));
+            case op_fsub: OCTET_KERNEL_PS(_mm256_sub_ps(a, b));
+            case op_fmul: OCTET_KERNEL_PS(_mm256_mul_ps(a, b));
+            case op_fdiv: OCTET_KERNEL_PS(_mm256_div_ps(a, b));
+            case op_fmin: OCTET_KERNEL_PS(_mm256_min_ps(a, b));
+            case op_fmax: OCTET_KERNEL_PS(_mm256_max_ps(a, b));
+            case op_fneg: OCTET_KERNEL_PS(_mm256_xor_ps(a, sign));
+            case op_fabs: OCTET_KERNEL_PS(_mm256_andnot_ps(sign, a));
+            case op_fsign: OCTET_KERNEL_PS(_mm256_sub_ps(_mm256_and_ps(_mm256_cmp_ps(a, zero, _CMP_GT_OQ), one), _mm256_and_ps(_mm256_cmp_ps(a, zero, _CMP_LT_OQ), one)));
+            case op_floor: OCTET_KERNEL_PS(_mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_cvttps_epi32(a)), _mm256_and_ps(_mm256_cmp_ps(_mm256_cvtepi32_ps(_mm256_cvttps_epi32(a)), a, _CMP_GT_OQ), one)));
+            case op_ceil: OCTET_KERNEL_PS(_mm256_add_ps(_mm256_cvtepi32_ps(_mm256_cvttps_epi32(a)), _mm256_and_ps(_mm256_cmp_ps(_mm256_cvtepi32_ps(_mm256_cvttps_epi32(a)), a, _CMP_LT_OQ), one)));
+            case op_sqrt: OCTET_KERNEL_PS(_mm256_sqrt_ps(a));
+            case op_rsqrt: OCTET_KERNEL_PS(_mm256_div_ps(one, _mm256_sqrt_ps(a)));
+            case op_sin: OCTET_KERNEL_PS(sin_cos_avx(a, 0));
+            case op_cos: OCTET_KERNEL_PS(sin_cos_avx(a, 1));
+            case op_flt: OCTET_KERNEL_PS(_mm256_cmp_ps(a, b, _CMP_LT_OQ));
+            case op_fle: OCTET_KERNEL_PS(_mm256_cmp_ps(a, b, _CMP_LE_OQ));
+            case op_feq: OCTET_KERNEL_PS(_mm256_cmp_ps(a, b, _CMP_EQ_OQ));
+            case op_fne: OCTET_KERNEL_PS(_mm256_cmp_ps(a, b, _CMP_NEQ_UQ));
+
+            case op_iadd: OCTET_KERNEL_EPI(_mm256_add_epi32(a, b));
+            case op_isub: OCTET_KERNEL_EPI(_mm256_sub_epi32(a, b));
+            case op_imul: OCTET_KERNEL_EPI(_mm256_mullo_epi32(a, b));
+            case op_ineg: OCTET_KERNEL_EPI(_mm256_sub_epi32(_mm256_setzero_si256(), a));
+            case op_iabs: OCTET_KERNEL_EPI(_mm256_abs_epi32(a));
+            case op_imin: OCTET_KERNEL_EPI(_mm256_min_epi32(a, b));
+            case op_imax: OCTET_KERNEL_EPI(_mm256_max_epi32(a, b));
+            case op_umin: OCTET_KERNEL_EPI(_mm256_min_epu32(a, b));
+            case op_umax: OCTET_KERNEL_EPI(_mm256_max_epu32(a, b));
+            case op_ilt: OCTET_KERNEL_EPI(_mm256_cmpgt_epi32(b, a));
+            case op_ile: OCTET_KERNEL_EPI(_mm256_xor_si256(_mm256_cmpgt_epi32(a, b), ones));
+            case op_ieq: OCTET_KERNEL_EPI(_mm256_cmpeq_epi32(a, b));
+            case op_ine: OCTET_KERNEL_EPI(_mm256_xor_si256(_mm256_cmpeq_epi32(a, b), ones));
+            case op_ult: OCTET_KERNEL_EPI(_mm256_cmpgt_epi32(_mm256_xor_si256(b, top), _mm256_xor_si256(a, top)));
+            case op_ule: OCTET_KERNEL_EPI(_mm256_xor_si256(_mm256_cmpgt_epi32(_mm256_xor_si256(a, top), _mm256_xor_si256(b, top)), ones));
+
+            case op_and: OCTET_KERNEL_EPI(_mm256_and_si256(a, b));
+            case op_andn: OCTET_KERNEL_EPI(_mm256_andnot_si256(b, a));
+            case op_or: OCTET_KERNEL_EPI(_mm256_or_si256(a, b));
+            case op_xor: OCTET_KERNEL_EPI(_mm256_xor_si256(a, b));
+            case op_not: OCTET_KERNEL_EPI(_mm256_xor_si256(a, ones));
+            case op_shl: OCTET_KERNEL_EPI(_mm256_sllv_epi32(a, _mm256_and_si256(b, shift)));
+            case op_shr: OCTET_KERNEL_EPI(_mm256_srav_epi32(a, _mm256_and_si256(b, shift)));
+            case op_ushr: OCTET_KERNEL_EPI(_mm256_srlv_epi32(a, _mm256_and_si256(b, shift)));
+            case op_itof: OCTET_KERNEL_EPI(_mm256_castps_si256(_mm256_cvtepi32_ps(a)));
+            case op_utof: OCTET_KERNEL_EPI(_mm256_castps_si256(utof_avx(a)));
+            case op_ftoi: OCTET_KERNEL_PS(_mm256_castsi256_ps(_mm256_cvttps_epi32(a)));
+          }
+          return false;
+
+          #undef OCTET_KERNEL_PS
+          #undef OCTET_KERNEL_EPI
+        }
+      #endif
+
+      #if OCTET_SSE
+        // op_store4: four stores to consecutive words with the same index and mask, a vec4 at a time.
+        static void store4_sse(const instruction *ip, const lane_reg *r, const buffer_binding *buffers, unsigned chunks) {
+          uint32_t *data = buffers[ip->buffer].data, num_words = buffers[ip->buffer].num_words, imm = ip->imm;
+          const uint32_t *d[4] = { r[ip[0].dst * chunks].u, r[ip[1].dst * chunks].u, r[ip[2].dst * chunks].u, r[ip[3].dst * chunks].u };
+          const uint32_t *a = r[ip->a * chunks].u;
+          const int32_t *c = r[ip->c * chunks].i;
+          // a vec4 fits if index < limit; the unsigned compare is a signed one with the top bit flipped.
+          __m128i top = _mm_set1_epi32((int)0x80000000);
+          __m128i limit = _mm_xor_si128(_mm_set1_epi32((int)(num_words < 4 ? 0 : num_words - 3)), top);
+          for (unsigned l = 0; l != chunks * lanes; l += 4) {
+            __m128i index = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(a + l)), _mm_set1_epi32((int)imm));
+            __m128i fits = _mm_and_si128(_mm_loadu_si128((const __m128i*)(c + l)), _mm_cmplt_epi32(_mm_xor_si128(index, top), limit));
+            if (_mm_movemask_ps(_mm_castsi128_ps(fits)) == 15) {
+              __m128 v0 = _mm_loadu_ps((const float*)d[0] + l), v1 = _mm_loadu_ps((const float*)d[1] + l);
+              __m128 v2 = _mm_loadu_ps((const float*)d[2] + l), v3 = _mm_loadu_ps((const float*)d[3] + l);
+              _MM_TRANSPOSE4_PS(v0, v1, v2, v3);
+              _mm_storeu_ps((float*)(data + a[l] + imm), v0);
+              _mm_storeu_ps((float*)(data + a[l + 1] + imm), v1);
+              _mm_storeu_ps((float*)(data + a[l + 2] + imm), v2);
+              _mm_storeu_ps((float*)(data + a[l + 3] + imm), v3);
+            } else {
+              for (unsigned j = l; j != l + 4; ++j) {
+                for (uint32_t k = 0; k != 4; ++k) {
+                  uint32_t word = a[j] + imm + k;
+                  if (c[j] && word < num_words) data[word] = d[k][j];
+                }
+              }
+            }
+          }
+        }
+
+        static simd_fn choose_simd(bool allow_avx) {
+          #if OCTET_AVX
+            if (allow_avx && __builtin_cpu_supports("avx2")) return simd_avx;
+          #endif
+          return simd_sse;
+        }
+
+        static simd_fn &get_simd() {
+          static simd_fn fn = choose_simd(true);
+          return fn;
+        }
+      #endif
+
+      // Run the code on a batch of invocations. Register n of chunk k is r[n * chunks + k], so the
+      // lanes of a register are in a row and each instruction is one loop over the whole batch.
+      // The common instructions use SSE or AVX2; the rest use the lane loops.
+      static void execute(const instruction *code, lane_reg *r, const buffer_binding *buffers, unsigned chunks) {
+        unsigned batch = chunks * lanes;
+        for (const instruction *ip = code;; ++ip) {
+          lane_reg *rd = r + ip->dst * chunks;
+          const lane_reg *ra = r + ip->a * chunks, *rb = r + ip->b * chunks, *rc = r + ip->c * chunks;
+          switch (ip->op) {
+            case op_end: return;
+            case op_jump: {
+              ip = code + ip->imm - 1;
+            } continue;
+            case op_branch_none: case op_branch_any: {
+              const uint32_t *c = (const uint32_t*)rc;
+              uint32_t any = 0;
+              for (unsigned l = 0; l != batch; ++l) any |= c[l];
+              if ((any != 0) == (ip->op == op_branch_any)) ip = code + ip->imm - 1;
+            } continue;
+            case op_store4: {
+              #if OCTET_SSE
+                store4_sse(ip, r, buffers, chunks);
+                ip += 3;
+                continue;
+              #endif
+            } // otherwise it is an op_store and so are the next three.
+            case op_store: {
+              // locals, because the stores could alias the binding and the registers.
+              uint32_t *data = buffers[ip->buffer].data, num_words = buffers[ip->buffer].num_words, imm = ip->imm;
+              const uint32_t *d = (const uint32_t*)rd, *a = (const uint32_t*)ra;
+              const int32_t *c = (const int32_t*)rc;
+              for (unsigned l = 0; l != batch; ++l) {
+                uint32_t index = a[l] + imm;
+                if (c[l] && index < num_words) data[index] = d[l];
+              }
+            } continue;
+            case op_load: {
+              // the destination may be the index register, so read each lane before writing it.
+              const uint32_t *data = buffers[ip->buffer].data;
+              uint32_t num_words = buffers[ip->buffer].num_words, imm = ip->imm;
+              uint32_t *d = (uint32_t*)rd;
+              const uint32_t *a = (const uint32_t*)ra;
+              for (unsigned l = 0; l != batch; ++l) {
+                uint32_t index = a[l] + imm;
+                d[l] = index < num_words ? data[index] : 0;
+              }
+            } continue;
+          }
+
+          #if OCTET_SSE
+            if (get_simd()(ip, rd, ra, rb, rc, chunks)) continue;
+          #endif
+
+          // t is the result for one chunk, so that the loops do not worry about the destination being a source.
+          #define OCTET_KERNEL_LANES(...) \
+            for (unsigned k = 0; k != chunks; ++k) { \
+              const lane_reg &a = ra[k], &b = rb[k], &c = rc[k]; \
+              lane_reg t; \
+              (void)a; (void)b; (void)c; \
+              for (int l = 0; l != lanes; ++l) { __VA_ARGS__; } \
+              rd[k] = t; \
+            } continue
+
+          switch (ip->op) {
+            case op_mov: OCTET_KERNEL_LANES(t.u[l] = a.u[l]);
+            case op_select: OCTET_KERNEL_LANES(t.u[l] = (c.u[l] & a.u[l]) | (~c.u[l] & b.u[l]));
+
+            case op_fadd: OCTET_KERNEL_LANES(t.f[l] = a.f[l] + b.f[l]);
+            case op_fsub: OCTET_KERNEL_LANES(t.f[l] = a.f[l] - b.f[l]);
+            case op_fmul: OCTET_KERNEL_LANES(t.f[l] = a.f[l] * b.f[l]);
+            case op_fdiv: OCTET_KERNEL_LANES(t.f[l] = a.f[l] / b.f[l]);
+            case op_fmin: OCTET_KERNEL_LANES(t.f[l] = a.f[l] < b.f[l] ? a.f[l] : b.f[l]);
+            case op_fmax: OCTET_KERNEL_LANES(t.f[l] = a.f[l] > b.f[l] ? a.f[l] : b.f[l]);
+            case op_fneg: OCTET_KERNEL_LANES(t.u[l] = a.u[l] ^ 0x80000000);
+            case op_fabs: OCTET_KERNEL_LANES(t.u[l] = a.u[l] & 0x7fffffff);
+            case op_fsign: OCTET_KERNEL_LANES(t.f[l] = (float)(a.f[l] > 0) - (float)(a.f[l] < 0));
+            case op_floor: OCTET_KERNEL_LANES({ float n = (float)(int)a.f[l]; t.f[l] = n - (float)(n > a.f[l]); });
+            case op_ceil: OCTET_KERNEL_LANES({ float n = (float)(int)a.f[l]; t.f[l] = n + (float)(n < a.f[l]); });
+            case op_sqrt: OCTET_KERNEL_LANES(t.f[l] = sqrtf(a.f[l]));
+            case op_rsqrt: OCTET_KERNEL_LANES(t.f[l] = 1.0f / sqrtf(a.f[l]));
+            case op_sin: OCTET_KERNEL_LANES(t.f[l] = sin_cos(a.f[l], 0));
+            case op_cos: OCTET_KERNEL_LANES(t.f[l] = sin_cos(a.f[l], 1));
+            case op_tan: OCTET_KERNEL_LANES(t.f[l] = tanf(a.f[l]));
+            case op_asin: OCTET_KERNEL_LANES(t.f[l] = asinf(a.f[l]));
+            case op_acos: OCTET_KERNEL_LANES(t.f[l] = acosf(a.f[l]));
+            case op_atan: OCTET_KERNEL_LANES(t.f[l] = atanf(a.f[l]));
+            case op_atan2: OCTET_KERNEL_LANES(t.f[l] = atan2f(a.f[l], b.f[l]));
+            case op_pow: OCTET_KERNEL_LANES(t.f[l] = powf(a.f[l], b.f[l]));
+            case op_exp: OCTET_KERNEL_LANES(t.f[l] = expf(a.f[l]));
+            case op_log: OCTET_KERNEL_LANES(t.f[l] = logf(a.f[l]));
+            case op_exp2: OCTET_KERNEL_LANES(t.f[l] = exp2f(a.f[l]));
+            case op_log2: OCTET_KERNEL_LANES(t.f[l] = log2f(a.f[l]));
+            case op_fmod: OCTET_KERNEL_LANES({ float q = a.f[l] / b.f[l], n = (float)(int)q; t.f[l] = a.f[l] - b.f[l] * (n - (float)(n > q)); });
+            case op_flt: OCTET_KERNEL_LANES(t.i[l] = -(a.f[l] < b.f[l]));
+            case op_fle: OCTET_KERNEL_LANES(t.i[l] = -(a.f[l] <= b.f[l]));
+            case op_feq: OCTET_KERNEL_LANES(t.i[l] = -(a.f[l] == b.f[l]));
+            case op_fne: OCTET_KERNEL_LANES(t.i[l] = -(a.f[l] != b.f[l]));
+
+            case op_iadd: OCTET_KERNEL_LANES(t.u[l] = a.u[l] + b.u[l]);
+            case op_isub: OCTET_KERNEL_LANES(t.u[l] = a.u[l] - b.u[l]);
+            case op_imul: OCTET_KERNEL_LANES(t.u[l] = a.u[l] * b.u[l]);
+            case op_idiv: OCTET_KERNEL_LANES(t.i[l] = b.i[l] && !(b.i[l] == -1 && a.i[l] == (int32_t)0x80000000) ? a.i[l] / b.i[l] : 0);
+            case op_imod: OCTET_KERNEL_LANES(t.i[l] = b.i[l] && b.i[l] != -1 ? a.i[l] % b.i[l] : 0);
+            case op_udiv: OCTET_KERNEL_LANES(t.u[l] = b.u[l] ? a.u[l] / b.u[l] : 0);
+            case op_umod: OCTET_KERNEL_LANES(t.u[l] = b.u[l] ? a.u[l] % b.u[l] : 0);
+            case op_ineg: OCTET_KERNEL_LANES(t.u[l] = 0 - a.u[l]);
+            case op_iabs: OCTET_KERNEL_LANES(t.i[l] = a.i[l] < 0 ? -a.i[l] : a.i[l]);
+            case op_imin: OCTET_KERNEL_LANES(t.i[l] = a.i[l] < b.i[l] ? a.i[l] : b.i[l]);
+            case op_imax: OCTET_KERNEL_LANES(t.i[l] = a.i[l] > b.i[l] ? a.i[l] : b.i[l]);
+            case op_umin: OCTET_KERNEL_LANES(t.u[l] = a.u[l] < b.u[l] ? a.u[l] : b.u[l]);
+            case op_umax: OCTET_KERNEL_LANES(t.u[l] = a.u[l] > b.u[l] ? a.u[l] : b.u[l]);
+            case op_ilt: OCTET_KERNEL_LANES(t.i[l] = -(a.i[l] < b.i[l]));
+            case op_ile: OCTET_KERNEL_LANES(t.i[l] = -(a.i[l] <= b.i[l]));
+            case op_ieq: OCTET_KERNEL_LANES(t.i[l] = -(a.i[l] == b.i[l]));
+            case op_ine: OCTET_KERNEL_LANES(t.i[l] = -(a.i[l] != b.i[l]));
+            case op_ult: OCTET_KERNEL_LANES(t.i[l] = -(a.u[l] < b.u[l]));
+            case op_ule: OCTET_KERNEL_LANES(t.i[l] = -(a.u[l] <= b.u[l]));
+
+            case op_and: OCTET_KERNEL_LANES(t.u[l] = a.u[l] & b.u[l]);
+            case op_andn: OCTET_KERNEL_LANES(t.u[l] = a.u[l] & ~b.u[l]);
+            case op_or: OCTET_KERNEL_LANES(t.u[l] = a.u[l] | b.u[l]);
+            case op_xor: OCTET_KERNEL_LANES(t.u[l] = a.u[l] ^ b.u[l]);
+            case op_not: OCTET_KERNEL_LANES(t.u[l] = ~a.u[l]);
+            case op_shl: OCTET_KERNEL_LANES(t.u[l] = a.u[l] << (b.u[l] & 31));
+            case op_shr: OCTET_KERNEL_LANES(t.i[l] = a.i[l] >> (b.u[l] & 31));
+            case op_ushr: OCTET_KERNEL_LANES(t.u[l] = a.u[l] >> (b.u[l] & 31));
+            case op_itof: OCTET_KERNEL_LANES(t.f[l] = (float)a.i[l]);
+            case op_utof: OCTET_KERNEL_LANES(t.f[l] = (float)a.u[l]);
+            case op_ftoi: OCTET_KERNEL_LANES(t.i[l] = (int32_t)a.f[l]);
+            case op_ftou: OCTET_KERNEL_LANES(t.u[l] = a.f[l] > 0 ? (uint32_t)a.f[l] : 0);
+          }
+          #undef OCTET_KERNEL_LANES
+        }
+      }
+
+      ////////////////////////////////////////////////////////////////////////////////
+      //
+      // registers and code
+      //
+
+      void error(const char *fmt, const char *arg = "") {
+        if (failed) return;
+        char tmp[256];
+        snprintf(tmp, sizeof(tmp), fmt, arg);
+        cpp_log("kernel(%d): error: %s\n", tokens.size() ? tokens[pos].line : 0, tmp);
+        failed = true;
+        // stop parsing
+        pos = tokens.size() - 1;
+      }
+
+      const char *get_name(int name) {
+        return name >= 0 ? &name_text[name] : "";
+      }
+
+      int intern(const char *text) {
+        int index = name_index.get_index(text);
+        if (index >= 0) return name_index.get_value(index);
+        int name = (int)name_text.size();
+        unsigned len = (unsigned)strlen(text) + 1;
+        name_text.resize(name + len);
+        memcpy(&name_text[name], text, len);
+        name_index[text] = name;
+        return name;
+      }
+
+      uint16_t temp() {
+        // step over results of finished statements, which may be reused.
+        for (unsigned skip = 0; skip != max_kept_results && holds_result(reg_top); ++skip) ++reg_top;
+        if (reg_top >= fixed_reg) {
+          error("kernel too large");
+          return 0;
+        }
+        num_dynamic_regs = std::max(num_dynamic_regs, reg_top + 1);
+        forget(reg_top);
+        return (uint16_t)reg_top++;
+      }
+
+      bool holds_result(unsigned reg) const {
+        for (unsigned i = 0; i != available.size(); ++i) {
+          if (available[i].dst == reg) return true;
+        }
+        return false;
+      }
+
+      // a register is about to change, so results computed from it are no longer available.
+      void forget(unsigned reg) {
+        for (unsigned i = 0; i != available.size(); ) {
+          const instruction &ins = available[i];
+          if (ins.dst == reg || ins.a == reg || ins.b == reg || ins.c == reg) {
+            available[i] = available.back();
+            available.pop_back();
+          } else {
+            ++i;
+          }
+        }
+      }
+
+      // a place that can be jumped to. Nothing is known about the registers here.
+      unsigned label() {
+        available.resize(0);
+        return code.size();
+      }
+
+      uint16_t fixed(uint32_t bits, bool is_constant) {
+        fixed_bits.push_back(bits);
+        fixed_is_constant.push_back(is_constant);
+        return (uint16_t)(fixed_reg | (fixed_bits.size() - 1));
+      }
+
+      uint16_t constant_bits(uint32_t bits) {
+        for (unsigned i = num_builtin_regs; i != fixed_bits.size(); ++i) {
+          if (fixed_is_constant[i] && fixed_bits[i] == bits) return (uint16_t)(fixed_reg | i);
+        }
+        return fixed(bits, true);
+      }
+
+      uint16_t constant_f(float value) {
+        uint32_t bits;
+        memcpy(&bits, &value, 4);
+        return constant_bits(bits);
+      }
+
+      bool is_constant(uint16_t reg) {
+        return (reg & fixed_reg) && fixed_is_constant[reg & ~fixed_reg];
+      }
+
+      // constants and uniforms have the same value in every invocation.
+      bool is_uniform(uint16_t reg) {
+        return (reg & fixed_reg) && (reg & ~fixed_reg) >= num_builtin_regs;
+      }
+
+      unsigned emit(unsigned op, uint16_t dst, uint16_t a = 0, uint16_t b = 0, uint16_t c = 0, uint16_t imm = 0, uint16_t buffer = 0) {
+        instruction i = { (uint16_t)op, dst, a, b, c, imm, buffer };
+        if (op != op_store && op != op_jump && op != op_branch_none && op != op_branch_any) forget(dst);
+        code.push_back(i);
+        if (code.size() >= 0xffff) error("kernel too large");
+        return code.size() - 1;
+      }
+
+      // a pure operation. If the inputs are constants, so is the result.
+      uint16_t op(unsigned opcode, uint16_t a, uint16_t b = 0, uint16_t c = 0) {
+        unsigned arity = get_arity(opcode);
+        if (is_constant(a) && (arity < 2 || is_constant(b)) && (arity < 3 || is_constant(c))) {
+          lane_reg r[4];
+          uint16_t in[3] = { a, b, c };
+          for (unsigned i = 0; i != arity; ++i) {
+            for (int l = 0; l != lanes; ++l) r[i+1].u[l] = fixed_bits[in[i] & ~fixed_reg];
+          }
+          instruction fold[2] = { { (uint16_t)opcode, 0, 1, 2, 3, 0, 0 }, { op_end, 0, 0, 0, 0, 0, 0 } };
+          execute(fold, r, nullptr, 1);
+          return constant_bits(r[0].u[0]);
+        }
+        // x + 0 and x * 1 are common in buffer indexing.
+        if (opcode == op_iadd || opcode == op_isub || opcode == op_or || opcode == op_xor || opcode == op_shl || opcode == op_ushr) {
+          if (is_constant(b) && fixed_bits[b & ~fixed_reg] == 0) return a;
+        }
+        if (opcode == op_iadd && is_constant(a) && fixed_bits[a & ~fixed_reg] == 0) return b;
+        if (opcode == op_imul && is_constant(b) && fixed_bits[b & ~fixed_reg] == 1) return a;
+        if (opcode == op_imul && is_constant(a) && fixed_bits[a & ~fixed_reg] == 1) return b;
+        if (is_uniform(a) && (arity < 2 || is_uniform(b)) && (arity < 3 || is_uniform(c))) {
+          // hoist out of the kernel. Unused inputs point at the result to keep them in the image.
+          for (unsigned i = 0; i != uniform_code.size(); ++i) {
+            const instruction &ins = uniform_code[i];
+            if (ins.op == opcode && ins.a == a && (arity < 2 || ins.b == b) && (arity < 3 || ins.c == c)) return ins.dst;
+          }
+          uint16_t dst = fixed(0, false);
+          instruction ins = { (uint16_t)opcode, dst, a, arity < 2 ? dst : b, arity < 3 ? dst : c, 0, 0 };
+          uniform_code.push_back(ins);
+          return dst;
+        }
+        for (unsigned i = 0; i != available.size(); ++i) {
+          const instruction &ins = available[i];
+          if (ins.op == opcode && ins.a == a && (arity < 2 || ins.b == b) && (arity < 3 || ins.c == c)) {
+            // temporaries above reg_top belong to finished statements; keep this one until the end of the statement.
+            if (ins.dst >= reg_top) reg_top = ins.dst + 1u;
+            return ins.dst;
+          }
+        }
+        uint16_t dst = temp();
+        emit(opcode, dst, a, b, c);
+        available.push_back(code.back());
+        return dst;
+      }
+
+      uint16_t cur_mask() {
+        return masks.back();
+      }
+
+      int control_depth() {
+        return (int)masks.size() - 1;
+      }
+
+      ////////////////////////////////////////////////////////////////////////////////
+      //
+      // tokens
+      //
+
+      void tokenise(const char *text) {
+        cpp_lexer lexer;
+        static const char *const keywords[] = {
+          "struct", "uniform", "buffer", "layout", "in", "out", "inout", "const", "if", "else", "for",
+          "while", "break", "continue", "return", "true", "false", "precision",
+        };
+        for (unsigned i = 0; i != sizeof(keywords)/sizeof(keywords[0]); ++i) {
+          lexer.add_identifier(keywords[i], kw_struct + i);
+        }
+        static const char *const qualifiers[] = {
+          "highp", "mediump", "lowp", "readonly", "writeonly", "restrict", "coherent", "volatile", "flat", "smooth",
+        };
+        for (unsigned i = 0; i != sizeof(qualifiers)/sizeof(qualifiers[0]); ++i) {
+          lexer.add_identifier(qualifiers[i], kw_qualifier);
+        }
+
+        tokens.resize(0);
+        int line = 1;
+        dynarray<char> buf;
+        for (const char *p = text; *p; ) {
+          const char *end = strchr(p, '\n');
+          if (!end) end = p + strlen(p);
+          buf.resize((unsigned)(end - p) + 1);
+          memcpy(buf.data(), p, end - p);
+          buf[(unsigned)(end - p)] = 0;
+          p = *end ? end + 1 : end;
+
+          lexer.start(buf.data());
+          lexer.lex_token();
+          if (lexer.type() == cpp_tokens::tok_hash) {
+            // # 10 "file" from the preprocessor, or #version
+            lexer.lex_token();
+            if (lexer.type() == cpp_tokens::tok_int_constant) line = (int)lexer.value();
+            continue;
+          }
+
+          for (; lexer.type() != cpp_tokens::tok_newline; lexer.lex_token()) {
+            token t = { lexer.type(), line, -1, 0, 0 };
+            switch (t.tok) {
+              case cpp_tokens::tok_identifier: t.name = intern(lexer.id()); break;
+              case cpp_tokens::tok_float_constant: case cpp_tokens::tok_double_constant: case cpp_tokens::tok_long_double_constant: t.dvalue = lexer.double_value(); break;
+              case cpp_tokens::tok_int_constant: case cpp_tokens::tok_uint_constant: case cpp_tokens::tok_int64_constant: case cpp_tokens::tok_uint64_constant: t.ivalue = lexer.value(); break;
+              case cpp_tokens::tok_bad_character: {
+                cpp_log("kernel(%d): error: bad character\n", line);
+                failed = true;
+              } break;
+            }
+            if (t.tok != kw_qualifier) tokens.push_back(t);
+          }
+          line++;
+        }
+        token end = { cpp_tokens::tok_end_of_source, line, -1, 0, 0 };
+        tokens.push_back(end);
+      }
+
+      int cur() {
+        return tokens[pos].tok;
+      }
+
+      void next() {
+        if (pos + 1 < tokens.size()) pos++;
+      }
+
+      bool accept(int tok) {
+        if (cur() != tok) return false;
+        next();
+        return true;
+      }
+
+      void expect(int tok, const char *what) {
+        if (!accept(tok)) error("expected %s", what);
+      }
+
+      int expect_name() {
+        int name = tokens[pos].name;
+        if (cur() != cpp_tokens::tok_identifier) {
+          error("expected a name");
+          return -1;
+        }
+        next();
+        return name;
+      }
+
+      // skip to the token after the matching } ) or ].
+      void skip_balanced() {
+        int level = 0;
+        do {
+          int tok = cur();
+          level += tok == cpp_tokens::tok_lbrace || tok == cpp_tokens::tok_lparen || tok == cpp_tokens::tok_lbracket;
+          level -= tok == cpp_tokens::tok_rbrace || tok == cpp_tokens::tok_rparen || tok == cpp_tokens::tok_rbracket;
+          if (tok == cpp_tokens::tok_end_of_source) {
+            error("unexpected end of kernel");
+            return;
+          }
+          next();
+        } while (level > 0);
+      }
+
+      ////////////////////////////////////////////////////////////////////////////////
+      //
+      // symbols and types
+      //
+
+      // locals of the current function, then globals.
+      symbol *find_symbol(int name) {
+        for (unsigned i = symbols.size(); i-- != frame_base; ) {
+          if (symbols[i].name == name) return &symbols[i];
+        }
+        for (unsigned i = std::min(num_globals, frame_base); i-- != 0; ) {
+          if (symbols[i].name == name) return &symbols[i];
+        }
+        return nullptr;
+      }
+
+      void add_symbol(int name, int kind, int index, const value &v) {
+        symbol s = { name, kind, index, v };
+        symbols.push_back(s);
+      }
+
+      static bool get_builtin_type(const char *name, uint8_t &base, uint8_t &size) {
+        static const struct { const char *name; uint8_t base, size; } types[] = {
+          { "void", base_void, 0 }, { "float", base_float, 1 }, { "int", base_int, 1 }, { "uint", base_uint, 1 }, { "bool", base_bool, 1 },
+          { "vec2", base_float, 2 }, { "vec3", base_float, 3 }, { "vec4", base_float, 4 },
+          { "ivec2", base_int, 2 }, { "ivec3", base_int, 3 }, { "ivec4", base_int, 4 },
+          { "uvec2", base_uint, 2 }, { "uvec3", base_uint, 3 }, { "uvec4", base_uint, 4 },
+          { "bvec2", base_bool, 2 }, { "bvec3", base_bool, 3 }, { "bvec4", base_bool, 4 },
+        };
+        for (unsigned i = 0; i != sizeof(types)/sizeof(types[0]); ++i) {
+          if (!strcmp(name, types[i].name)) {
+            base = types[i].base;
+            size = types[i].size;
+            return true;
+          }
+        }
+        return false;
+      }
+
+      // builtin type or struct at the current token.
+      bool is_type() {
+        uint8_t base, size;
+        if (cur() != cpp_tokens::tok_identifier) return false;
+        int name = tokens[pos].name;
+        if (get_builtin_type(get_name(name), base, size)) return true;
+        symbol *s = find_symbol(name);
+        return s && s->kind == sym_struct;
+      }
+
+      // type name; type is -1 for builtin types.
+      void parse_type(uint8_t &base, uint8_t &size, int &type) {
+        while (accept(kw_const) || accept(kw_in)) {
+        }
+        type = -1;
+        int name = expect_name();
+        if (failed) return;
+        if (get_builtin_type(get_name(name), base, size)) return;
+        symbol *s = find_symbol(name);
+        if (s && s->kind == sym_struct) {
+          base = base_void;
+          size = 0;
+          type = s->index;
+          return;
+        }
+        error("%s is not a type", get_name(name));
+      }
+
+      static unsigned round_up(unsigned value, unsigned align) {
+        return (value + align - 1) & ~(align - 1);
+      }
+
+      // std140 and std430 layout of struct members.
+      void layout_struct(struct_type *st, bool std140) {
+        unsigned offset = 0, align = 4;
+        for (unsigned i = 0; i != st->members.size(); ++i) {
+          struct_member &m = st->members[i];
+          unsigned m_align, m_size;
+          if (m.type >= 0) {
+            m_align = structs[m.type]->align;
+            m_size = structs[m.type]->size;
+          } else {
+            m_align = m.size == 1 ? 4 : m.size == 2 ? 8 : 16;
+            m_size = m.size * 4;
+          }
+          if (m.length != 0) {
+            if (std140) m_align = round_up(m_align, 16);
+            m.stride = round_up(m_size, m_align);
+            m_size = m.length > 0 ? m.stride * m.length : 0;
+          }
+          m.offset = offset = round_up(offset, m_align);
+          offset += m_size;
+          align = std::max(align, m_align);
+        }
+        if (std140) align = round_up(align, 16);
+        st->align = align;
+        st->size = round_up(offset, align);
+        st->std140 = std140;
+      }
+
+      struct_type *new_struct() {
+        struct_type *st = new struct_type();
+        st->name = -1;
+        st->size = 0;
+        st->align = 4;
+        st->std140 = true;
+        st->other_layout = -1;
+        structs.push_back(st);
+        return st;
+      }
+
+      // structs used in std140 and std430 buffers have different layouts.
+      int struct_for_layout(int type, bool std140) {
+        if (structs[type]->std140 == std140) return type;
+        if (structs[type]->other_layout >= 0) return structs[type]->other_layout;
+
+        struct_type *copy = new_struct();
+        int result = structs.size() - 1;
+        copy->name = structs[type]->name;
+        for (unsigned i = 0; i != structs[type]->members.size(); ++i) {
+          struct_member m = structs[type]->members[i];
+          if (m.type >= 0) m.type = struct_for_layout(m.type, std140);
+          copy->members.push_back(m);
+        }
+        layout_struct(copy, std140);
+        copy->other_layout = type;
+        structs[type]->other_layout = result;
+        return result;
+      }
+
+      // members of a struct or buffer block.
+      void parse_members(struct_type *st) {
+        expect(cpp_tokens::tok_lbrace, "{");
+        while (!failed && !accept(cpp_tokens::tok_rbrace)) {
+          struct_member m;
+          parse_type(m.base, m.size, m.type);
+          do {
+            m.name = expect_name();
+            m.length = 0;
+            if (accept(cpp_tokens::tok_lbracket)) {
+              m.length = -1;
+              if (cur() == cpp_tokens::tok_int_constant || cur() == cpp_tokens::tok_uint_constant) {
+                m.length = (int)tokens[pos].ivalue;
+                next();
+              }
+              expect(cpp_tokens::tok_rbracket, "]");
+            }
+            if (m.base == base_bool) error("bool is not supported in buffers");
+            st->members.push_back(m);
+          } while (accept(cpp_tokens::tok_comma));
+          expect(cpp_tokens::tok_semicolon, ";");
+        }
+      }
+
+      // the value of a member of a struct in a buffer.
+      value member_value(const value &v, const struct_member &m) {
+        value result = v;
+        result.base = m.base;
+        result.size = m.size;
+        result.type = m.type;
+        unsigned offset = v.offset + m.offset / 4;
+        if (m.length != 0) {
+          result.kind = v_array;
+          result.offset = offset;
+          result.stride = m.stride / 4;
+          result.length = m.length;
+        } else if (m.type >= 0) {
+          result.kind = v_struct;
+          result.offset = offset;
+        } else {
+          result.kind = v_buffer;
+          for (unsigned i = 0; i != m.size; ++i) result.comps[i] = (uint16_t)(offset + i);
+        }
+        return result;
+      }
+
+      ////////////////////////////////////////////////////////////////////////////////
+      //
+      // values
+      //
+
+      value make_value(uint8_t kind, uint8_t base, uint8_t size) {
+        value v;
+        memset(&v, 0, sizeof(v));
+        v.kind = kind;
+        v.base = base;
+        v.size = size;
+        v.type = -1;
+        return v;
+      }
+
+      value new_var(uint8_t base, uint8_t size) {
+        value v = make_value(v_var, base, size);
+        for (unsigned i = 0; i != size; ++i) v.comps[i] = temp();
+        v.depth = control_depth();
+        vars_top = reg_top;
+        return v;
+      }
+
+      // a variable in the registers of a temporary value.
+      value adopt_var(const value &init) {
+        value v = make_value(v_var, init.base, init.size);
+        for (unsigned i = 0; i != init.size; ++i) {
+          v.comps[i] = init.comps[i];
+          reg_top = std::max(reg_top, init.comps[i] + 1u);
+        }
+        v.depth = control_depth();
+        vars_top = reg_top;
+        return v;
+      }
+
+      value constant(uint8_t base, uint32_t bits) {
+        value v = make_value(v_rvalue, base, 1);
+        v.comps[0] = constant_bits(bits);
+        return v;
+      }
+
+      value float_constant(float f) {
+        value v = make_value(v_rvalue, base_float, 1);
+        v.comps[0] = constant_f(f);
+        return v;
+      }
+
+      // load from a buffer if needed.
+      value rvalue(const value &v) {
+        if (v.kind == v_buffer) {
+          value result = make_value(v_rvalue, v.base, v.size);
+          for (unsigned i = 0; i != v.size; ++i) {
+            result.comps[i] = temp();
+            emit(op_load, result.comps[i], v.addr, 0, 0, v.comps[i], (uint16_t)v.buffer);
+          }
+          return result;
+        } else if (v.kind == v_struct || v.kind == v_array) {
+          error("can not use a whole struct or array here");
+        } else if (v.kind == v_none || v.base == base_void) {
+          error("expected a value");
+        }
+        value result = v;
+        result.kind = v_rvalue;
+        return result;
+      }
+
+      uint16_t convert_comp(uint16_t reg, uint8_t from, uint8_t to) {
+        if (from == to) return reg;
+        switch (to) {
+          case base_float: {
+            if (from == base_bool) return op(op_and, reg, constant_f(1.0f));
+            return op(from == base_int ? op_itof : op_utof, reg);
+          }
+          case base_int: case base_uint: {
+            if (from == base_bool) return op(op_and, reg, constant_bits(1));
+            if (from == base_float) return op(to == base_int ? op_ftoi : op_ftou, reg);
+            return reg;
+          }
+          case base_bool: {
+            return op(from == base_float ? op_fne : op_ine, reg, constant_bits(0));
+          }
+        }
+        error("bad conversion");
+        return reg;
+      }
+
+      // convert to a type, broadcasting scalars.
+      value convert(const value &in, uint8_t base, uint8_t size) {
+        value v = rvalue(in);
+        if (v.size != size && v.size != 1) {
+          error("vector sizes do not match");
+          return v;
+        }
+        value result = make_value(v_rvalue, base, size);
+        for (unsigned i = 0; i != size; ++i) {
+          result.comps[i] = convert_comp(v.comps[v.size == 1 ? 0 : i], v.base, base);
+        }
+        return result;
+      }
+
+      // store in a variable or a buffer and return the value stored.
+      value assign(const value &lhs, const value &rhs_in) {
+        if (lhs.kind != v_var && lhs.kind != v_buffer) {
+          error("can not assign to this");
+          return rhs_in;
+        }
+        value rhs = convert(rhs_in, lhs.base, lhs.size);
+        if (lhs.kind == v_buffer) {
+          unsigned first = code.size();
+          for (unsigned i = 0; i != lhs.size; ++i) {
+            emit(op_store, rhs.comps[i], lhs.addr, 0, cur_mask(), lhs.comps[i], (uint16_t)lhs.buffer);
+          }
+          // a whole vec4 can be written a lane at a time.
+          bool in_order = lhs.size == 4;
+          for (unsigned i = 1; i < lhs.size; ++i) in_order = in_order && lhs.comps[i] == lhs.comps[0] + i;
+          if (in_order && !failed) code[first].op = op_store4;
+          return rhs;
+        }
+
+        // v = v.yx needs a copy.
+        for (unsigned i = 0; i != lhs.size; ++i) {
+          for (unsigned j = 0; j < i; ++j) {
+            if (rhs.comps[i] == lhs.comps[j]) {
+              uint16_t t = temp();
+              emit(op_mov, t, rhs.comps[i]);
+              rhs.comps[i] = t;
+            }
+          }
+        }
+
+        // variables from outside an if or loop only change in active lanes.
+        bool masked = lhs.depth < control_depth();
+        for (unsigned i = 0; i != lhs.size; ++i) {
+          if (masked) {
+            emit(op_select, lhs.comps[i], rhs.comps[i], lhs.comps[i], cur_mask());
+          } else {
+            emit(op_mov, lhs.comps[i], rhs.comps[i]);
+          }
+        }
+        return rvalue(lhs);
+      }
+
+      static uint8_t common_base(uint8_t a, uint8_t b) {
+        if (a == base_float || b == base_float) return base_float;
+        if (a == base_uint || b == base_uint) return base_uint;
+        if (a == base_int || b == base_int) return base_int;
+        return base_bool;
+      }
+
+      value binary(int tok, const value &lhs_in, const value &rhs_in) {
+        value lhs = rvalue(lhs_in), rhs = rvalue(rhs_in);
+        uint8_t size = std::max(lhs.size, rhs.size);
+        uint8_t base = common_base(lhs.base, rhs.base);
+        if (failed) return lhs;
+
+        if (tok == cpp_tokens::tok_and_and || tok == cpp_tokens::tok_or_or) {
+          if (lhs.size != 1 || rhs.size != 1) error("expected a bool");
+          lhs = convert(lhs, base_bool, 1);
+          rhs = convert(rhs, base_bool, 1);
+          value result = make_value(v_rvalue, base_bool, 1);
+          result.comps[0] = op(tok == cpp_tokens::tok_and_and ? op_and : op_or, lhs.comps[0], rhs.comps[0]);
+          return result;
+        }
+
+        lhs = convert(lhs, base, size);
+        rhs = convert(rhs, base, size);
+
+        if (tok == cpp_tokens::tok_eq || tok == cpp_tokens::tok_ne) {
+          unsigned opc = base == base_float ? op_feq : op_ieq;
+          value result = make_value(v_rvalue, base_bool, 1);
+          for (unsigned i = 0; i != size; ++i) {
+            uint16_t eq = op(opc, lhs.comps[i], rhs.comps[i]);
+            result.comps[0] = i == 0 ? eq : op(op_and, result.comps[0], eq);
+          }
+          if (tok == cpp_tokens::tok_ne) result.comps[0] = op(op_not, result.comps[0]);
+          return result;
+        }
+
+        if (tok == cpp_tokens::tok_lt || tok == cpp_tokens::tok_gt || tok == cpp_tokens::tok_le || tok == cpp_tokens::tok_ge) {
+          if (size != 1) error("use lessThan() etc. for vectors");
+          bool swap = tok == cpp_tokens::tok_gt || tok == cpp_tokens::tok_ge;
+          bool equal = tok == cpp_tokens::tok_le || tok == cpp_tokens::tok_ge;
+          unsigned opc = base == base_float ? (equal ? op_fle : op_flt) : base == base_uint ? (equal ? op_ule : op_ult) : (equal ? op_ile : op_ilt);
+          value result = make_value(v_rvalue, base_bool, 1);
+          result.comps[0] = swap ? op(opc, rhs.comps[0], lhs.comps[0]) : op(opc, lhs.comps[0], rhs.comps[0]);
+          return result;
+        }
+
+        unsigned opc = op_end;
+        bool is_float = base == base_float, is_uint = base == base_uint, is_int = base == base_int || is_uint;
+        switch (tok) {
+          case cpp_tokens::tok_plus: opc = is_float ? op_fadd : op_iadd; break;
+          case cpp_tokens::tok_minus: opc = is_float ? op_fsub : op_isub; break;
+          case cpp_tokens::tok_star: opc = is_float ? op_fmul : op_imul; break;
+          case cpp_tokens::tok_divide: opc = is_float ? op_fdiv : is_uint ? op_udiv : op_idiv; break;
+          case cpp_tokens::tok_mod: opc = is_int ? (is_uint ? op_umod : op_imod) : op_end; break;
+          case cpp_tokens::tok_and: opc = is_int ? op_and : op_end; break;
+          case cpp_tokens::tok_or: opc = is_int ? op_or : op_end; break;
+          case cpp_tokens::tok_xor: opc = is_int || base == base_bool ? op_xor : op_end; break;
+          case cpp_tokens::tok_shift_left: opc = is_int ? op_shl : op_end; break;
+          case cpp_tokens::tok_shift_right: opc = is_int ? (is_uint ? op_ushr : op_shr) : op_end; break;
+        }
+        if (opc == op_end || (base == base_bool && tok != cpp_tokens::tok_xor)) {
+          error("bad types for operator %s", cpp_tokens::token_name((cpp_tokens::token_type)tok));
+          return lhs;
+        }
+        value result = make_value(v_rvalue, base, size);
+        for (unsigned i = 0; i != size; ++i) result.comps[i] = op(opc, lhs.comps[i], rhs.comps[i]);
+        return result;
+      }
+
+      value bool_value(const value &v) {
+        value r = rvalue(v);
+        if (r.size != 1) error("expected a bool");
+        return convert(r, base_bool, 1);
+      }
+
+      ////////////////////////////////////////////////////////////////////////////////
+      //
+      // expressions
+      //
+
+      void parse_args(dynarray<value> &args) {
+        expect(cpp_tokens::tok_lparen, "(");
+        if (accept(cpp_tokens::tok_rparen)) return;
+        do {
+          args.push_back(rvalue(parse_assignment()));
+        } while (!failed && accept(cpp_tokens::tok_comma));
+        expect(cpp_tokens::tok_rparen, ")");
+      }
+
+      // vec4(x, y, z, w), float(i) etc.
+      value construct(uint8_t base, uint8_t size) {
+        dynarray<value> args;
+        parse_args(args);
+        value result = make_value(v_rvalue, base, size);
+        if (args.size() == 1 && args[0].size == 1) {
+          return convert(args[0], base, size);
+        }
+        unsigned n = 0;
+        for (unsigned i = 0; i != args.size() && n != size; ++i) {
+          const value &a = args[i];
+          for (unsigned j = 0; j != a.size && n != size; ++j) {
+            result.comps[n++] = convert_comp(a.comps[j], a.base, base);
+          }
+        }
+        if (n != size) error("not enough values for constructor");
+        return result;
+      }
+
+      value unary_float(unsigned opc, const value &a) {
+        value v = convert(a, base_float, a.size);
+        for (unsigned i = 0; i != v.size; ++i) v.comps[i] = op(opc, v.comps[i]);
+        return v;
+      }
+
+      value dot(const value &a, const value &b) {
+        value va = convert(a, base_float, a.size), vb = convert(b, base_float, va.size);
+        value result = make_value(v_rvalue, base_float, 1);
+        for (unsigned i = 0; i != va.size; ++i) {
+          uint16_t p = op(op_fmul, va.comps[i], vb.comps[i]);
+          result.comps[0] = i == 0 ? p : op(op_fadd, result.comps[0], p);
+        }
+        return result;
+      }
+
+      value min_max(bool is_max, const value &a, const value &b) {
+        value ra = rvalue(a), rb = rvalue(b);
+        uint8_t base = common_base(ra.base, rb.base), size = std::max(ra.size, rb.size);
+        ra = convert(ra, base, size);
+        rb = convert(rb, base, size);
+        unsigned opc = base == base_float ? (is_max ? op_fmax : op_fmin) : base == base_uint ? (is_max ? op_umax : op_umin) : (is_max ? op_imax : op_imin);
+        for (unsigned i = 0; i != size; ++i) ra.comps[i] = op(opc, ra.comps[i], rb.comps[i]);
+        return ra;
+      }
+
+      value builtin_call(const char *name, dynarray<value> &args) {
+        static const struct { const char *name; unsigned opc; } unary[] = {
+          { "sin", op_sin }, { "cos", op_cos }, { "tan", op_tan }, { "asin", op_asin }, { "acos", op_acos },
+          { "sqrt", op_sqrt }, { "inversesqrt", op_rsqrt }, { "exp", op_exp }, { "log", op_log },
+          { "exp2", op_exp2 }, { "log2", op_log2 }, { "floor", op_floor }, { "ceil", op_ceil }, { "sign", op_fsign },
+        };
+        unsigned n = args.size();
+        for (unsigned i = 0; i != sizeof(unary)/sizeof(unary[0]); ++i) {
+          if (!strcmp(name, unary[i].name) && n == 1) return unary_float(unary[i].opc, args[0]);
+        }
+
+        if (!strcmp(name, "abs") && n == 1) {
+          value v = args[0];
+          for (unsigned i = 0; i != v.size; ++i) v.comps[i] = op(v.base == base_float ? op_fabs : op_iabs, v.comps[i]);
+          return v;
+        } else if (!strcmp(name, "atan") && (n == 1 || n == 2)) {
+          if (n == 1) return unary_float(op_atan, args[0]);
+          value y = convert(args[0], base_float, args[0].size), x = convert(args[1], base_float, y.size);
+          for (unsigned i = 0; i != y.size; ++i) y.comps[i] = op(op_atan2, y.comps[i], x.comps[i]);
+          return y;
+        } else if ((!strcmp(name, "pow") || !strcmp(name, "mod")) && n == 2) {
+          value a = convert(args[0], base_float, args[0].size), b = convert(args[1], base_float, a.size);
+          for (unsigned i = 0; i != a.size; ++i) a.comps[i] = op(name[0] == 'p' ? op_pow : op_fmod, a.comps[i], b.comps[i]);
+          return a;
+        } else if (!strcmp(name, "fract") && n == 1) {
+          value a = convert(args[0], base_float, args[0].size);
+          for (unsigned i = 0; i != a.size; ++i) a.comps[i] = op(op_fsub, a.comps[i], op(op_floor, a.comps[i]));
+          return a;
+        } else if ((!strcmp(name, "radians") || !strcmp(name, "degrees")) && n == 1) {
+          return binary(cpp_tokens::tok_star, args[0], float_constant(name[0] == 'r' ? 0.0174532925f : 57.2957795f));
+        } else if (!strcmp(name, "min") && n == 2) {
+          return min_max(false, args[0], args[1]);
+        } else if (!strcmp(name, "max") && n == 2) {
+          return min_max(true, args[0], args[1]);
+        } else if (!strcmp(name, "clamp") && n == 3) {
+          return min_max(false, min_max(true, args[0], args[1]), args[2]);
+        } else if (!strcmp(name, "mix") && n == 3) {
+          value a = convert(args[0], base_float, args[0].size);
+          return binary(cpp_tokens::tok_plus, a, binary(cpp_tokens::tok_star, binary(cpp_tokens::tok_minus, args[1], a), args[2]));
+        } else if (!strcmp(name, "step") && n == 2) {
+          value x = convert(args[1], base_float, args[1].size), edge = convert(args[0], base_float, x.size);
+          for (unsigned i = 0; i != x.size; ++i) x.comps[i] = op(op_and, op(op_fle, edge.comps[i], x.comps[i]), constant_f(1.0f));
+          return x;
+        } else if (!strcmp(name, "smoothstep") && n == 3) {
+          value x = convert(args[2], base_float, args[2].size);
+          value e0 = convert(args[0], base_float, x.size), e1 = convert(args[1], base_float, x.size);
+          for (unsigned i = 0; i != x.size; ++i) {
+            uint16_t t = op(op_fdiv, op(op_fsub, x.comps[i], e0.comps[i]), op(op_fsub, e1.comps[i], e0.comps[i]));
+            t = op(op_fmin, op(op_fmax, t, constant_f(0)), constant_f(1));
+            x.comps[i] = op(op_fmul, op(op_fmul, t, t), op(op_fsub, constant_f(3), op(op_fadd, t, t)));
+          }
+          return x;
+        } else if (!strcmp(name, "dot") && n == 2) {
+          return dot(args[0], args[1]);
+        } else if (!strcmp(name, "length") && n == 1) {
+          value d = dot(args[0], args[0]);
+          d.comps[0] = op(op_sqrt, d.comps[0]);
+          return d;
+        } else if (!strcmp(name, "distance") && n == 2) {
+          value diff = binary(cpp_tokens::tok_minus, args[0], args[1]);
+          value d = dot(diff, diff);
+          d.comps[0] = op(op_sqrt, d.comps[0]);
+          return d;
+        } else if (!strcmp(name, "normalize") && n == 1) {
+          value d = dot(args[0], args[0]);
+          d.comps[0] = op(op_rsqrt, d.comps[0]);
+          return binary(cpp_tokens::tok_star, args[0], d);
+        } else if (!strcmp(name, "cross") && n == 2) {
+          value a = convert(args[0], base_float, 3), b = convert(args[1], base_float, 3);
+          value result = make_value(v_rvalue, base_float, 3);
+          for (unsigned i = 0; i != 3; ++i) {
+            unsigned j = (i + 1) % 3, k = (i + 2) % 3;
+            result.comps[i] = op(op_fsub, op(op_fmul, a.comps[j], b.comps[k]), op(op_fmul, a.comps[k], b.comps[j]));
+          }
+          return result;
+        }
+        error("unknown function %s", name);
+        return make_value(v_none, base_void, 0);
+      }
+
+      // functions are inlined. The body is parsed again at each call.
+      value call(const function &fn, dynarray<value> &args) {
+        if (inline_depth >= max_inline_depth) {
+          error("%s is recursive or nested too deeply", get_name(fn.name));
+          return make_value(v_none, base_void, 0);
+        }
+
+        unsigned save_pos = pos, save_frame = frame_base, save_return_mask = return_mask;
+        value save_return = return_value;
+        frame_base = symbols.size();
+        value result = fn.base != base_void ? new_var(fn.base, fn.size) : make_value(v_none, base_void, 0);
+
+        // parameters
+        pos = fn.first_param;
+        unsigned num_params = 0;
+        while (!failed && cur() != cpp_tokens::tok_rparen) {
+          if (accept(kw_out) || accept(kw_inout)) error("out parameters are not supported");
+          uint8_t base, size;
+          int type;
+          parse_type(base, size, type);
+          if (base == base_void && cur() == cpp_tokens::tok_rparen) break;
+          int name = expect_name();
+          if (num_params < args.size()) {
+            value p = new_var(base, size);
+            assign(p, args[num_params]);
+            add_symbol(name, sym_value, 0, p);
+          }
+          num_params++;
+          if (!accept(cpp_tokens::tok_comma)) break;
+        }
+        if (num_params != args.size()) error("wrong number of arguments for %s", get_name(fn.name));
+
+        // returns clear lanes from this mask.
+        uint16_t mask = temp();
+        emit(op_mov, mask, cur_mask());
+        masks.push_back(mask);
+        return_mask = masks.size() - 1;
+        return_value = result;
+
+        inline_depth++;
+        pos = fn.body;
+        parse_statement();
+        inline_depth--;
+
+        masks.pop_back();
+        symbols.resize(frame_base);
+        frame_base = save_frame;
+        return_mask = save_return_mask;
+        return_value = save_return;
+        pos = save_pos;
+        if (result.kind == v_var) result.kind = v_rvalue;
+        return result;
+      }
+
+      value swizzle(const value &v, int name) {
+        const char *s = get_name(name);
+        unsigned len = (unsigned)strlen(s);
+        if (len == 0 || len > 4) {
+          error("bad swizzle %s", s);
+          return v;
+        }
+        value result = v;
+        result.size = (uint8_t)len;
+        for (unsigned i = 0; i != len; ++i) {
+          const char *sets[] = { "xyzw", "rgba", "stpq" };
+          int index = -1;
+          for (unsigned j = 0; j != 3 && index < 0; ++j) {
+            const char *p = strchr(sets[j], s[i]);
+            if (p) index = (int)(p - sets[j]);
+          }
+          if (index < 0 || index >= v.size) {
+            error("bad swizzle %s", s);
+            return v;
+          }
+          result.comps[i] = v.comps[index];
+        }
+        return result;
+      }
+
+      value parse_primary() {
+        token t = tokens[pos];
+        switch (t.tok) {
+          case cpp_tokens::tok_lparen: {
+            next();
+            value v = parse_expression();
+            expect(cpp_tokens::tok_rparen, ")");
+            return v;
+          }
+          case cpp_tokens::tok_float_constant: case cpp_tokens::tok_double_constant: case cpp_tokens::tok_long_double_constant: {
+            next();
+            return float_constant((float)t.dvalue);
+          }
+          case cpp_tokens::tok_int_constant: case cpp_tokens::tok_int64_constant: {
+            next();
+            return constant(base_int, (uint32_t)t.ivalue);
+          }
+          case cpp_tokens::tok_uint_constant: case cpp_tokens::tok_uint64_constant: {
+            next();
+            return constant(base_uint, (uint32_t)t.ivalue);
+          }
+          case kw_true: case kw_false: {
+            next();
+            return constant(base_bool, t.tok == kw_true ? ~0u : 0);
+          }
+          case cpp_tokens::tok_identifier: {
+            next();
+            uint8_t base, size;
+            const char *name = get_name(t.name);
+            if (get_builtin_type(name, base, size) && base != base_void) {
+              return construct(base, size);
+            }
+            symbol *s = find_symbol(t.name);
+            if (cur() == cpp_tokens::tok_lparen && (!s || s->kind != sym_value)) {
+              // parsing the arguments may move the symbols.
+              int fn = s && s->kind == sym_function ? s->index : -1;
+              dynarray<value> args;
+              parse_args(args);
+              if (fn >= 0) return call(functions[fn], args);
+              return builtin_call(name, args);
+            }
+            if (!s || s->kind != sym_value) {
+              error("%s is not defined", name);
+              return make_value(v_none, base_void, 0);
+            }
+            return s->v;
+          }
+        }
+        error("expected a value");
+        return make_value(v_none, base_void, 0);
+      }
+
+      value parse_postfix() {
+        value v = parse_primary();
+        for (;;) {
+          if (accept(cpp_tokens::tok_dot)) {
+            int name = expect_name();
+            if (v.kind == v_struct) {
+              struct_type *st = structs[v.type];
+              unsigned i = 0;
+              while (i != st->members.size() && st->members[i].name != name) ++i;
+              if (i == st->members.size()) {
+                error("no member %s", get_name(name));
+                return v;
+              }
+              v = member_value(v, st->members[i]);
+            } else {
+              if (v.kind == v_array) error("arrays have no members");
+              v = swizzle(v, name);
+            }
+          } else if (accept(cpp_tokens::tok_lbracket)) {
+            value index = parse_expression();
+            expect(cpp_tokens::tok_rbracket, "]");
+            if (v.kind != v_array) {
+              error("only buffer arrays can be indexed");
+              return v;
+            }
+            index = convert(index, base_uint, 1);
+            value element = v;
+            uint16_t offset = op(op_imul, index.comps[0], constant_bits((uint32_t)v.stride));
+            element.addr = op(op_iadd, v.addr, offset);
+            element.length = 0;
+            if (v.type >= 0) {
+              element.kind = v_struct;
+            } else {
+              element.kind = v_buffer;
+              for (unsigned i = 0; i != v.size; ++i) element.comps[i] = (uint16_t)(v.offset + i);
+            }
+            v = element;
+          } else if (cur() == cpp_tokens::tok_plus_plus || cur() == cpp_tokens::tok_minus_minus) {
+            int tok = cur() == cpp_tokens::tok_plus_plus ? cpp_tokens::tok_plus : cpp_tokens::tok_minus;
+            next();
+            value old = rvalue(v);
+            // keep the old value
+            value copy = make_value(v_rvalue, old.base, old.size);
+            for (unsigned i = 0; i != old.size; ++i) {
+              copy.comps[i] = temp();
+              emit(op_mov, copy.comps[i], old.comps[i]);
+            }
+            assign(v, binary(tok, old, constant(base_int, 1)));
+            return copy;
+          } else {
+            return v;
+          }
+        }
+      }
+
+      value parse_unary() {
+        int tok = cur();
+        switch (tok) {
+          case cpp_tokens::tok_minus: {
+            next();
+            value v = rvalue(parse_unary());
+            if (v.base == base_bool) error("can not negate a bool");
+            for (unsigned i = 0; i != v.size; ++i) v.comps[i] = op(v.base == base_float ? op_fneg : op_ineg, v.comps[i]);
+            return v;
+          }
+          case cpp_tokens::tok_plus: {
+            next();
+            return rvalue(parse_unary());
+          }
+          case cpp_tokens::tok_not: {
+            next();
+            value v = bool_value(parse_unary());
+            v.comps[0] = op(op_not, v.comps[0]);
+            return v;
+          }
+          case cpp_tokens::tok_tilda: {
+            next();
+            value v = rvalue(parse_unary());
+            if (v.base != base_int && v.base != base_uint) error("~ needs an int");
+            for (unsigned i = 0; i != v.size; ++i) v.comps[i] = op(op_not, v.comps[i]);
+            return v;
+          }
+          case cpp_tokens::tok_plus_plus: case cpp_tokens::tok_minus_minus: {
+            next();
+            value v = parse_unary();
+            return assign(v, binary(tok == cpp_tokens::tok_plus_plus ? cpp_tokens::tok_plus : cpp_tokens::tok_minus, v, constant(base_int, 1)));
+          }
+        }
+        return parse_postfix();
+      }
+
+      static int precedence(int tok) {
+        switch (tok) {
+          case cpp_tokens::tok_or_or: return 1;
+          case cpp_tokens::tok_and_and: return 2;
+          case cpp_tokens::tok_or: return 3;
+          case cpp_tokens::tok_xor: return 4;
+          case cpp_tokens::tok_and: return 5;
+          case cpp_tokens::tok_eq: case cpp_tokens::tok_ne: return 6;
+          case cpp_tokens::tok_lt: case cpp_tokens::tok_gt: case cpp_tokens::tok_le: case cpp_tokens::tok_ge: return 7;
+          case cpp_tokens::tok_shift_left: case cpp_tokens::tok_shift_right: return 8;
+          case cpp_tokens::tok_plus: case cpp_tokens::tok_minus: return 9;
+          case cpp_tokens::tok_star: case cpp_tokens::tok_divide: case cpp_tokens::tok_mod: return 10;
+        }
+        return 0;
+      }
+
+      value parse_binary(int min_precedence) {
+        value lhs = parse_unary();
+        for (;;) {
+          int tok = cur();
+          int prec = precedence(tok);
+          if (prec == 0 || prec < min_precedence || failed) return lhs;
+          next();
+          value rhs = parse_binary(prec + 1);
+          lhs = binary(tok, lhs, rhs);
+        }
+      }
+
+      static int compound_op(int tok) {
+        switch (tok) {
+          case cpp_tokens::tok_plus_equals: return cpp_tokens::tok_plus;
+          case cpp_tokens::tok_minus_equals: return cpp_tokens::tok_minus;
+          case cpp_tokens::tok_times_equals: return cpp_tokens::tok_star;
+          case cpp_tokens::tok_divide_equals: return cpp_tokens::tok_divide;
+          case cpp_tokens::tok_mod_equals: return cpp_tokens::tok_mod;
+          case cpp_tokens::tok_shift_left_equals: return cpp_tokens::tok_shift_left;
+          case cpp_tokens::tok_shift_right_equals: return cpp_tokens::tok_shift_right;
+          case cpp_tokens::tok_and_equals: return cpp_tokens::tok_and;
+          case cpp_tokens::tok_xor_equals: return cpp_tokens::tok_xor;
+          case cpp_tokens::tok_or_equals: return cpp_tokens::tok_or;
+        }
+        return 0;
+      }
+
+      value parse_assignment() {
+        value lhs = parse_binary(1);
+        int tok = cur();
+        if (tok == cpp_tokens::tok_question) {
+          // both sides are evaluated and the lanes selected.
+          next();
+          value cond = bool_value(lhs);
+          value a = rvalue(parse_assignment());
+          expect(cpp_tokens::tok_colon, ":");
+          value b = rvalue(parse_assignment());
+          uint8_t base = common_base(a.base, b.base), size = std::max(a.size, b.size);
+          a = convert(a, base, size);
+          b = convert(b, base, size);
+          for (unsigned i = 0; i != size; ++i) a.comps[i] = op(op_select, a.comps[i], b.comps[i], cond.comps[0]);
+          return a;
+        } else if (tok == cpp_tokens::tok_equals) {
+          next();
+          value rhs = parse_assignment();
+          return assign(lhs, rhs);
+        } else if (int binop = compound_op(tok)) {
+          next();
+          value rhs = parse_assignment();
+          return assign(lhs, binary(binop, lhs, rhs));
+        }
+        return lhs;
+      }
+
+      value parse_expression() {
+        value v = parse_assignment();
+        while (!failed && accept(cpp_tokens::tok_comma)) v = parse_assignment();
+        return v;
+      }
+
+      ////////////////////////////////////////////////////////////////////////////////
+      //
+      // statements
+      //
+
+      void parse_declaration() {
+        uint8_t base, size;
+        int type;
+        parse_type(base, size, type);
+        if (type >= 0 || base == base_void) {
+          error("only scalar and vector variables are supported");
+          return;
+        }
+        do {
+          int name = expect_name();
+          if (cur() == cpp_tokens::tok_lbracket) error("local arrays are not supported");
+          value init = make_value(v_none, base_void, 0);
+          bool has_init = accept(cpp_tokens::tok_equals);
+          unsigned first_temp = reg_top;
+          if (has_init) init = convert(parse_assignment(), base, size);
+          // temporaries made by the initializer can become the variable, saving a copy.
+          bool adopt = has_init && !failed;
+          for (unsigned i = 0; adopt && i != size; ++i) {
+            adopt = init.comps[i] >= first_temp && init.comps[i] < fixed_reg;
+            for (unsigned j = 0; j != i; ++j) adopt = adopt && init.comps[j] != init.comps[i];
+          }
+          value v = adopt ? adopt_var(init) : new_var(base, size);
+          if (has_init && !adopt) assign(v, init);
+          add_symbol(name, sym_value, 0, v);
+        } while (!failed && accept(cpp_tokens::tok_comma));
+        expect(cpp_tokens::tok_semicolon, ";");
+      }
+
+      // clear the active lanes from the masks down to masks[level].
+      void kill_lanes(unsigned level) {
+        uint16_t active = temp();
+        emit(op_mov, active, cur_mask());
+        for (unsigned i = masks.size(); i-- > level; ) {
+          emit(op_andn, masks[i], masks[i], active);
+        }
+      }
+
+      void parse_if() {
+        expect(cpp_tokens::tok_lparen, "(");
+        value cond = bool_value(parse_expression());
+        expect(cpp_tokens::tok_rparen, ")");
+
+        // the current mask is never constant, so this is a new register.
+        masks.push_back(op(op_and, cur_mask(), cond.comps[0]));
+        unsigned skip = emit(op_branch_none, 0, 0, 0, masks.back());
+        parse_statement();
+        masks.pop_back();
+        code[skip].imm = (uint16_t)label();
+
+        if (accept(kw_else)) {
+          uint16_t else_mask = temp();
+          emit(op_andn, else_mask, cur_mask(), cond.comps[0]);
+          masks.push_back(else_mask);
+          unsigned skip_else = emit(op_branch_none, 0, 0, 0, else_mask);
+          parse_statement();
+          masks.pop_back();
+          code[skip_else].imm = (uint16_t)label();
+        }
+      }
+
+      // for (init; cond; step) body and while (cond) body
+      void parse_loop(bool is_for) {
+        unsigned scope = symbols.size();
+        expect(cpp_tokens::tok_lparen, "(");
+        if (is_for) {
+          if (is_type() || cur() == kw_const) {
+            parse_declaration();
+          } else {
+            if (cur() != cpp_tokens::tok_semicolon) parse_expression();
+            expect(cpp_tokens::tok_semicolon, ";");
+          }
+        }
+
+        uint16_t loop_mask = temp();
+        emit(op_mov, loop_mask, cur_mask());
+        masks.push_back(loop_mask);
+        unsigned top = label();
+
+        if (cur() != cpp_tokens::tok_semicolon) {
+          value cond = bool_value(parse_expression());
+          emit(op_and, loop_mask, loop_mask, cond.comps[0]);
+        }
+        unsigned exit = emit(op_branch_none, 0, 0, 0, loop_mask);
+
+        unsigned step = pos;
+        if (is_for) {
+          expect(cpp_tokens::tok_semicolon, ";");
+          step = pos;
+          while (!failed && cur() != cpp_tokens::tok_rparen) skip_balanced();
+        }
+        expect(cpp_tokens::tok_rparen, ")");
+
+        uint16_t body_mask = temp();
+        emit(op_mov, body_mask, loop_mask);
+        masks.push_back(body_mask);
+        loop_info info = { masks.size() - 2, masks.size() - 1 };
+        loops.push_back(info);
+        parse_statement();
+        loops.pop_back();
+        masks.pop_back();
+
+        if (is_for && !failed) {
+          unsigned end = pos;
+          pos = step;
+          if (cur() != cpp_tokens::tok_rparen) parse_expression();
+          pos = end;
+        }
+        emit(op_jump, 0, 0, 0, 0, (uint16_t)top);
+        code[exit].imm = (uint16_t)label();
+        masks.pop_back();
+        symbols.resize(scope);
+      }
+
+      void parse_return() {
+        if (cur() != cpp_tokens::tok_semicolon) {
+          value v = parse_expression();
+          if (return_value.kind != v_var) {
+            error("return with a value in a void function");
+          } else {
+            assign(return_value, v);
+          }
+        }
+        expect(cpp_tokens::tok_semicolon, ";");
+        kill_lanes(return_mask);
+      }
+
+      void parse_statement() {
+        unsigned save_top = reg_top;
+        switch (cur()) {
+          case cpp_tokens::tok_lbrace: {
+            next();
+            unsigned scope = symbols.size(), save_vars = vars_top;
+            while (!failed && !accept(cpp_tokens::tok_rbrace)) {
+              if (cur() == cpp_tokens::tok_end_of_source) error("expected }");
+              parse_statement();
+            }
+            symbols.resize(scope);
+            vars_top = save_vars;
+          } break;
+          case cpp_tokens::tok_semicolon: {
+            next();
+          } break;
+          case kw_if: {
+            next();
+            parse_if();
+          } break;
+          case kw_for: case kw_while: {
+            bool is_for = cur() == kw_for;
+            next();
+            parse_loop(is_for);
+          } break;
+          case kw_break: case kw_continue: {
+            bool is_break = cur() == kw_break;
+            next();
+            expect(cpp_tokens::tok_semicolon, ";");
+            if (loops.size() == 0) {
+              error("break or continue outside a loop");
+            } else {
+              kill_lanes(is_break ? loops.back().loop_mask : loops.back().body_mask);
+            }
+          } break;
+          case kw_return: {
+            next();
+            parse_return();
+          } break;
+          case kw_const: {
+            parse_declaration();
+          } break;
+          default: {
+            if (is_type() && tokens[pos+1].tok == cpp_tokens::tok_identifier) {
+              parse_declaration();
+            } else {
+              parse_expression();
+              expect(cpp_tokens::tok_semicolon, ";");
+            }
+          } break;
+        }
+        reg_top = std::max(save_top, vars_top);
+      }
+
+      ////////////////////////////////////////////////////////////////////////////////
+      //
+      // declarations
+      //
+
+      // layout(std140, binding = 0) or layout(local_size_x = 64) in;
+      void parse_layout(bool &std140, int &binding) {
+        expect(cpp_tokens::tok_lparen, "(");
+        while (!failed && !accept(cpp_tokens::tok_rparen)) {
+          const char *name = get_name(expect_name());
+          int value = 0;
+          if (accept(cpp_tokens::tok_equals)) {
+            value = (int)tokens[pos].ivalue;
+            next();
+          }
+          if (!strcmp(name, "std140")) std140 = true;
+          else if (!strcmp(name, "std430")) std140 = false;
+          else if (!strcmp(name, "binding")) binding = value;
+          else if (!strcmp(name, "local_size_x")) local_size[0] = value;
+          else if (!strcmp(name, "local_size_y")) local_size[1] = value;
+          else if (!strcmp(name, "local_size_z")) local_size[2] = value;
+          accept(cpp_tokens::tok_comma);
+        }
+      }
+
+      void parse_buffer(bool std140, int binding) {
+        struct_type *st = new_struct();
+        int type = structs.size() - 1;
+        st->name = expect_name();
+        parse_members(st);
+        for (unsigned i = 0; i != st->members.size(); ++i) {
+          int &member_type = structs[type]->members[i].type;
+          if (member_type >= 0) member_type = struct_for_layout(member_type, std140);
+        }
+        st = structs[type];
+        layout_struct(st, std140);
+
+        int slot = (int)buffer_bindings.size();
+        buffer_bindings.push_back(binding >= 0 ? (unsigned)binding : (unsigned)slot);
+
+        value v = make_value(v_struct, base_void, 0);
+        v.type = type;
+        v.buffer = slot;
+        v.addr = constant_bits(0);
+        if (cur() == cpp_tokens::tok_identifier) {
+          add_symbol(expect_name(), sym_value, 0, v);
+        } else {
+          // members are global names
+          for (unsigned i = 0; i != st->members.size(); ++i) {
+            add_symbol(st->members[i].name, sym_value, 0, member_value(v, st->members[i]));
+          }
+        }
+        expect(cpp_tokens::tok_semicolon, ";");
+      }
+
+      void parse_uniform() {
+        uint8_t base, size;
+        int type;
+        parse_type(base, size, type);
+        if (type >= 0 || base == base_void) error("only scalar and vector uniforms are supported");
+        int name = expect_name();
+        value v = make_value(v_rvalue, base, size);
+        for (unsigned i = 0; i != size; ++i) v.comps[i] = fixed(0, false);
+        if (accept(cpp_tokens::tok_equals)) {
+          value init = convert(parse_assignment(), base, size);
+          for (unsigned i = 0; i != size; ++i) {
+            if (!is_constant(init.comps[i])) error("uniform initialisers must be constant");
+            fixed_bits[v.comps[i] & ~fixed_reg] = fixed_bits[init.comps[i] & ~fixed_reg];
+          }
+        }
+        expect(cpp_tokens::tok_semicolon, ";");
+        add_symbol(name, sym_value, 0, v);
+
+        uniform_info info = { base, size, (uint16_t)(v.comps[0] & ~fixed_reg) };
+        uniform_index[get_name(name)] = (int)uniforms.size();
+        uniforms.push_back(info);
+      }
+
+      void parse_function(uint8_t base, uint8_t size, int name) {
+        function fn = { name, base, size, pos + 1, 0 };
+        skip_balanced();
+        fn.body = pos;
+        if (cur() == cpp_tokens::tok_semicolon) {
+          // prototype
+          next();
+          return;
+        }
+        skip_balanced();
+        functions.push_back(fn);
+        value none = make_value(v_none, base_void, 0);
+        add_symbol(name, sym_function, functions.size() - 1, none);
+      }
+
+      void parse_global() {
+        bool std140 = false;
+        int binding = -1;
+        if (accept(kw_layout)) {
+          parse_layout(std140, binding);
+          if (accept(kw_in) || accept(kw_out)) {
+            expect(cpp_tokens::tok_semicolon, ";");
+            return;
+          }
+        }
+
+        if (accept(kw_precision)) {
+          while (!failed && !accept(cpp_tokens::tok_semicolon)) next();
+        } else if (accept(kw_struct)) {
+          struct_type *st = new_struct();
+          int type = structs.size() - 1;
+          st->name = expect_name();
+          parse_members(st);
+          layout_struct(st, true);
+          add_symbol(st->name, sym_struct, type, make_value(v_none, base_void, 0));
+          expect(cpp_tokens::tok_semicolon, ";");
+        } else if (accept(kw_buffer)) {
+          parse_buffer(std140, binding);
+        } else if (accept(kw_uniform)) {
+          parse_uniform();
+        } else if (accept(cpp_tokens::tok_semicolon)) {
+        } else {
+          uint8_t base, size;
+          int type;
+          bool is_const = cur() == kw_const;
+          parse_type(base, size, type);
+          int name = expect_name();
+          if (cur() == cpp_tokens::tok_lparen) {
+            parse_function(base, size, name);
+          } else if (is_const && accept(cpp_tokens::tok_equals)) {
+            value v = convert(parse_assignment(), base, size);
+            for (unsigned i = 0; i != size; ++i) {
+              if (!is_constant(v.comps[i])) error("global constants must be constant");
+            }
+            add_symbol(name, sym_value, 0, v);
+            expect(cpp_tokens::tok_semicolon, ";");
+          } else {
+            error("global variables must be const or uniform");
+          }
+        }
+      }
+
+      void add_builtin(const char *name, uint8_t base, uint8_t size, unsigned reg) {
+        value v = make_value(v_rvalue, base, size);
+        for (unsigned i = 0; i != size; ++i) v.comps[i] = (uint16_t)(fixed_reg | (reg + i));
+        add_symbol(intern(name), sym_value, 0, v);
+      }
+
+      void reset() {
+        code.reset();
+        uniform_code.reset();
+        fixed_bits.reset();
+        fixed_is_constant.reset();
+        num_dynamic_regs = 0;
+        local_size[0] = local_size[1] = local_size[2] = 1;
+        batch_chunks = 1;
+        uniform_index.reset();
+        uniforms.reset();
+        buffer_bindings.reset();
+        image.reset();
+        tokens.reset();
+        pos = 0;
+        failed = false;
+        symbols.reset();
+        num_globals = frame_base = 0;
+        return_value = make_value(v_none, base_void, 0);
+        return_mask = 0;
+        for (unsigned i = 0; i != structs.size(); ++i) delete structs[i];
+        structs.reset();
+        functions.reset();
+        masks.reset();
+        loops.reset();
+        available.reset();
+        reg_top = vars_top = 0;
+        inline_depth = 0;
+      }
+
+      uint16_t remap(uint16_t reg) {
+        return (uint16_t)(reg & fixed_reg ? reg & ~fixed_reg : reg + fixed_bits.size());
+      }
+
+      bool compile_source(const char *source, const char *file_name, const char *const *defines, unsigned num_defines) {
+        reset();
+        string text;
+        preprocessor.add_source(file_name, source);
+        if (!preprocessor.preprocess(text, file_name, defines, num_defines)) return false;
+        tokenise(text.c_str());
+
+        for (unsigned i = 0; i != num_builtin_regs; ++i) fixed(0, false);
+        add_builtin("gl_GlobalInvocationID", base_uint, 3, reg_global_id);
+        add_builtin("gl_LocalInvocationID", base_uint, 3, reg_local_id);
+        add_builtin("gl_WorkGroupID", base_uint, 3, reg_group_id);
+        add_builtin("gl_LocalInvocationIndex", base_uint, 1, reg_local_index);
+        add_builtin("gl_WorkGroupSize", base_uint, 3, reg_group_size);
+        add_builtin("gl_NumWorkGroups", base_uint, 3, reg_num_groups);
+
+        while (!failed && cur() != cpp_tokens::tok_end_of_source) {
+          parse_global();
+        }
+
+        num_globals = symbols.size();
+        symbol *s = find_symbol(name_main);
+        if (!failed && (!s || s->kind != sym_function)) error("no main function");
+        if (failed) return false;
+
+        // main is inlined like the other functions.
+        masks.push_back((uint16_t)(fixed_reg | reg_mask));
+        dynarray<value> args;
+        call(functions[s->index], args);
+        emit(op_end, 0);
+        if (failed) return false;
+
+        // fixed registers go first.
+        num_dynamic_regs = std::max(num_dynamic_regs, 1u);
+        instruction end = { op_end, 0, 0, 0, 0, 0, 0 };
+        uniform_code.push_back(end);
+        for (unsigned i = 0; i != code.size() + uniform_code.size(); ++i) {
+          instruction &ins = i < code.size() ? code[i] : uniform_code[i - code.size()];
+          ins.dst = remap(ins.dst);
+          ins.a = remap(ins.a);
+          ins.b = remap(ins.b);
+          ins.c = remap(ins.c);
+        }
+
+        image.resize(fixed_bits.size());
+        for (unsigned i = 0; i != fixed_bits.size(); ++i) {
+          for (int l = 0; l != lanes; ++l) image[i].u[l] = fixed_bits[i];
+        }
+        for (unsigned i = 0; i != 3; ++i) {
+          for (int l = 0; l != lanes; ++l) image[reg_group_size + i].u[l] = local_size[i];
+        }
+        update_image(image.data());
+
+        unsigned group_size = local_size[0] * local_size[1] * local_size[2];
+        batch_chunks = std::min((group_size + lanes - 1) / lanes, (unsigned)max_batch / lanes);
+        return true;
+      }
+
+    public:
+      cpp_kernel() {
+        name_main = intern("main");
+        reset();
+      }
+
+      ~cpp_kernel() {
+        reset();
+      }
+
+      /// Add a directory to look in for #include.
+      void add_include_path(const char *path) {
+        preprocessor.add_include_path(path);
+      }
+
+      /// Compile a kernel. Errors go to cpp_log and get_error().
+      bool compile(const char *source, const char *file_name = "kernel.cs", const char *const *defines = nullptr, unsigned num_defines = 0) {
+        unsigned log_start = cpp_log_text().size();
+        bool ok = compile_source(source, file_name, defines, num_defines);
+
+        // keep the messages from this compile; they are separated by nuls.
+        const dynarray<char> &log_text = cpp_log_text();
+        error_text = "";
+        for (unsigned i = log_start; i < log_text.size(); i += (unsigned)strlen(&log_text[i]) + 1) {
+          error_text += &log_text[i];
+        }
+        return ok;
+      }
+
+      /// The errors from the last compile, or an empty string.
+      const char *get_error() const {
+        return error_text.c_str();
+      }
+
+      /// Number of lane_regs in a frame: every register for a batch of up to max_batch invocations.
+      unsigned get_frame_size() const {
+        return (fixed_bits.size() + num_dynamic_regs) * batch_chunks;
+      }
+
+      /// One lane_reg for each constant and uniform, holding the defaults.
+      const dynarray<lane_reg> &get_image() const {
+        return image;
+      }
+
+      /// Recalculate the values that depend on uniforms after changing uniforms in a copy of the image.
+      void update_image(lane_reg *dest_image) const {
+        execute(uniform_code.data(), dest_image, nullptr, 1);
+      }
+
+      /// Set up a frame from an image, which may have new uniform values.
+      void init_frame(lane_reg *frame, const lane_reg *src_image) const {
+        for (unsigned i = 0; i != image.size(); ++i) {
+          for (unsigned k = 0; k != batch_chunks; ++k) {
+            frame[i * batch_chunks + k] = src_image[i];
+          }
+        }
+      }
+
+      /// Size of a work group from layout(local_size_x = ...) in.
+      const unsigned *get_local_size() const {
+        return local_size;
+      }
+
+      unsigned get_num_instructions() const {
+        return code.size();
+      }
+
+      /// True if the common instructions run with AVX2 rather than SSE.
+      static bool using_avx() {
+        #if OCTET_AVX
+          return get_simd() == simd_avx;
+        #else
+          return false;
+        #endif
+      }
+
+      /// Turn the AVX2 code off or back on, eg. to compare it with SSE.
+      static void enable_avx(bool value) {
+        #if OCTET_SSE
+          get_simd() = choose_simd(value);
+        #else
+          (void)value;
+        #endif
+      }
+
+      /// Find a uniform, or return null.
+      const uniform_info *get_uniform(const char *name) {
+        int index = uniform_index.get_index(name);
+        return index >= 0 ? &uniforms[uniform_index.get_value(index)] : nullptr;
+      }
+
+      /// Number of buffer blocks; each has a slot in the buffer_binding array.
+      unsigned get_num_buffers() const {
+        return buffer_bindings.size();
+      }
+
+      /// binding = n of a buffer slot.
+      unsigned get_buffer_binding(unsigned slot) const {
+        return buffer_bindings[slot];
+      }
+
+      /// Run one work group. The frame has get_frame_size() registers and was set up by init_frame.
+      void run_group(lane_reg *frame, const buffer_binding *buffers, const unsigned group_id[3], const unsigned num_groups[3]) const {
+        unsigned sx = local_size[0], sy = local_size[1], sz = local_size[2];
+        unsigned group_size = sx * sy * sz;
+        unsigned chunks = batch_chunks;
+        // the registers are built in temporaries so that the loops vectorize.
+        lane_reg ids[6];
+        for (unsigned i = 0; i != 3; ++i) {
+          for (int l = 0; l != lanes; ++l) {
+            ids[i].u[l] = group_id[i];
+            ids[i+3].u[l] = num_groups[i];
+          }
+        }
+        for (unsigned k = 0; k != chunks; ++k) {
+          for (unsigned i = 0; i != 3; ++i) {
+            frame[(reg_group_id + i) * chunks + k] = ids[i];
+            frame[(reg_num_groups + i) * chunks + k] = ids[i+3];
+          }
+        }
+
+        // in one dimensional groups the y and z ids are the same for every batch.
+        bool flat = sy == 1 && sz == 1;
+        if (flat) {
+          for (int l = 0; l != lanes; ++l) {
+            ids[0].u[l] = 0;
+            ids[1].u[l] = group_id[1];
+            ids[2].u[l] = group_id[2];
+          }
+          for (unsigned k = 0; k != chunks; ++k) {
+            frame[(reg_local_id + 1) * chunks + k] = frame[(reg_local_id + 2) * chunks + k] = ids[0];
+            frame[(reg_global_id + 1) * chunks + k] = ids[1];
+            frame[(reg_global_id + 2) * chunks + k] = ids[2];
+          }
+        }
+
+        // step the local id instead of dividing for every invocation.
+        unsigned x = 0, y = 0, z = 0;
+        for (unsigned first = 0; first < group_size; first += chunks * lanes) {
+          for (unsigned k = 0; k != chunks; ++k) {
+            lane_reg mask, index;
+            for (int l = 0; l != lanes; ++l) {
+              index.u[l] = first + k * lanes + l;
+              mask.i[l] = -(index.u[l] < group_size);
+            }
+            frame[reg_mask * chunks + k] = mask;
+            frame[reg_local_index * chunks + k] = index;
+            if (flat) {
+              for (int l = 0; l != lanes; ++l) ids[0].u[l] = group_id[0] * sx + index.u[l];
+              frame[reg_local_id * chunks + k] = index;
+              frame[reg_global_id * chunks + k] = ids[0];
+            } else {
+              for (int l = 0; l != lanes; ++l) {
+                ids[0].u[l] = x;
+                ids[1].u[l] = y;
+                ids[2].u[l] = z;
+                ids[3].u[l] = group_id[0] * sx + x;
+                ids[4].u[l] = group_id[1] * sy + y;
+                ids[5].u[l] = group_id[2] * sz + z;
+                if (++x == sx) {
+                  x = 0;
+                  if (++y == sy) { y = 0; ++z; }
+                }
+              }
+              for (unsigned i = 0; i != 3; ++i) {
+                frame[(reg_local_id + i) * chunks + k] = ids[i];
+                frame[(reg_global_id + i) * chunks + k] = ids[i+3];
+              }
+            }
+          }
+          execute(code.data(), frame, buffers, chunks);
+        }
+      }
+    };
+  }
+}
@@ -11,14 +11,21 @@ namespace octet
 {
   namespace compiler
   {
-    inline const char *cpp_log(const char *fmt, ...) {
+    /// Every message logged by cpp_log, each followed by a nul.
+    inline dynarray<char> &cpp_log_text() {
       static dynarray<char> log_text;
+      return log_text;
+    }
+
+    /// Add a message to the log. Returns the first message.
+    inline const char *cpp_log(const char *fmt, ...) {
+      dynarray<char> &log_text = cpp_log_text();
       va_list list;
       va_start(list, fmt);
       unsigned size = log_text.size();
       log_text.resize(size + 256);
       int bytes = vsnprintf(&log_text[size], 256-1, fmt, list);
-      log_text.resize(size + bytes + 1);
+      log_text.resize(size + std::min(std::max(bytes, 0), 256-2) + 1);
       va_end(list);
       return &log_text[0];
     }
@@ -93,6 +100,7 @@ namespace octet
               src++;
             }
             if( *src != '.' ) {
+              value_ = value;
               goto after_int;
             }
           }
@@ -142,6 +150,7 @@ namespace octet
             }
           }
           if( *src == 'u' || *src == 'U' ) {
+            src++;
             type_ = type_ == tok_int_constant ? tok_uint_constant : tok_uint64_constant;
           }
         }
@@ -240,7 +249,7 @@ namespace octet
             
               is_punct('*') ? tok_dot_star :
               ( src_[0] == '.' && src_[1] == '.' ) ? ( src_ += 2, tok_ellipsis ) :
-              tok_star
+              tok_dot
             ;
             break;
           case '/': type_ = is_punct('=') ? tok_divide_equals : tok_divide; break;
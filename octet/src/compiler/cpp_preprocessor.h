@@ -12,1122 +12,1428 @@ namespace octet
 {
   namespace compiler
   {
-    class cpp_preprocessor : public cpp_token_enum {
-      enum {
-        max_chars_ = 65536,
-        max_stack_depth_ = 256,
-        max_output_queue_ = 256, // 2^n
-        max_define_params_ = 256,
-        def_exp_stack_max_ = 128,
+    /// C preprocessor used as the front end for shader variants and the C++ subset parser.
+    ///
+    /// Each source file is split into lines of tokens the first time it is used and kept,
+    /// so running the same file again with different #defines only walks the cached tokens.
+    /// Identifiers are interned when the file is tokenised and macros are found by name index.
+    /// Files with #pragma once or an include guard are skipped when they are included again.
+    ///
+    /// Example:
+    ///
+    ///     cpp_preprocessor pp;
+    ///     const char *defines[] = { "SKINNED", "NUM_LIGHTS=4" };
+    ///     string text;
+    ///     pp.preprocess(text, "shaders/default.vs", defines, 2);
+    class cpp_preprocessor {
+    public:
+      /// how to mark a jump in line numbers in the output.
+      enum marker_style {
+        markers_gcc,   // # 10 "file.h"
+        markers_glsl,  // #line 10
       };
 
-      typedef int error_;
-      typedef char char_type;
-    
-      typedef string name_type;
+      /// function to read a whole file, for example from a zip or an asset store.
+      typedef bool (*file_loader)(dynarray<uint8_t> &buffer, const char *path);
 
-      typedef cpp_tokens::token_type token_type;
-    
+    private:
       enum {
-        debug_ifs = 0,
-        debug_expressions = 0,
+        max_include_depth = 64,
+        max_expand_depth = 128,
+        max_params = 64,
+        max_blank_lines = 8,
+        arena_block_size = 65536,
+      };
+
+      enum token_kind {
+        tk_identifier,
+        tk_number,
+        tk_string,
+        tk_punct,
+        tk_other,
+
+        // in macro bodies only
+        tk_param,
+        tk_stringise,
+        tk_paste,
 
-        stringise_escape = 253,
-        param_escape = 254,
-        stringise_param_escape = 255,
+        // marks the end of a macro expansion
+        tk_end_macro,
       };
-    
-      struct include_stack_entry_ {
-        const char *current_;
-        const char *end_;
-        const char *file_name_;
-        string currentPath;
-        unsigned line_number_;
-        bool is_wchar_;
+
+      enum directive_kind {
+        dir_text,
+        dir_null,
+        dir_define,
+        dir_undef,
+        dir_include,
+        dir_if,
+        dir_ifdef,
+        dir_ifndef,
+        dir_elif,
+        dir_else,
+        dir_endif,
+        dir_pragma,
+        dir_error,
+        dir_other, // passed through to the output, eg. #version and #extension
       };
-    
-      struct if_stack_entry_ {
-        bool is_true_ : 1;
-        bool had_true_ : 1;
-        bool bottom_level_ : 1;
-        bool had_if_ : 1;
+
+      struct token {
+        const char *text;
+        unsigned len;
+        int name;          // interned identifier, parameter number or -1
+        uint8_t kind;
+        uint8_t space;     // whitespace before this token
+        uint8_t no_expand; // macro name found inside its own expansion
       };
-    
-      struct queue_entry_type {
-        unsigned flags_;
-        unsigned line_number_;
-        const char *file_name_;
-        const char_type *text_;
+
+      struct line {
+        unsigned first_token; // after the directive name
+        unsigned num_tokens;
+        unsigned line_number;
+        unsigned directive;
       };
 
-      struct map_file_result {
-        string filename_;
-        const char *source_;
-        const char *source_end_;
+      // a file split into lines of tokens. Kept between runs.
+      struct source_file {
+        string name;
+        string dir;
+        dynarray<char> text;   // comments and line continuations removed
+        dynarray<token> tokens;
+        dynarray<line> lines;
+        int guard;             // include guard macro or -1
+        bool pragma_once;
+        unsigned last_run;
       };
-    
-      struct define_type {
-        string text_;
-        bool has_params_; // check for ()
+
+      struct macro {
+        dynarray<token> body;
+        unsigned num_params;
+        bool defined;
+        bool function_like;
+        bool variadic;
+        bool disabled;
       };
 
-      struct define_expansion_type {
-        string name_;                   // avoid recursive defines
-        const char_type *src_;          // saved value of previous lexer_.get_src()
+      // a define() that is applied at the start of every run.
+      struct predefine {
+        int name;
+        dynarray<char> text;
+        dynarray<token> tokens;
       };
 
-      dictionary< define_type > defines_;
-
-      const char_type *cur_line_;
-      if_stack_entry_ *if_stack_ptr_;
-      unsigned def_exp_stack_depth_;
-
-      unsigned queue_in_;
-      unsigned queue_out_;
-
-      unsigned read_line_number_;
-      const char *read_file_name_;
-
-      unsigned last_line_number_;
-      const char *last_file_name_;
-
-      unsigned num_skipped_;
-  
-      if_stack_entry_ if_;
-    
-      cpp_lexer lexer_;
-    
-      dynarray<include_stack_entry_> include_stack_;
-      bitset< tok_last > unary_op_;
-
-      unsigned char precidence_[ tok_last ];
-    
-      // special symbol for #undef
-      char_type undefined_[ 1 ];
-
-      char_type read_line_[ max_chars_ ];
-      char_type write_line_[ max_chars_ ];
-      char_type number_line_[ max_chars_ ];
-      char_type expand_line_[ max_chars_ ];
-      char_type params_[ max_chars_ ];
-    
-      dynarray<if_stack_entry_> if_stack_;
-      queue_entry_type queue_[max_output_queue_];
-      const char_type *param_starts_[max_define_params_];
-      define_expansion_type def_exp_stack_[def_exp_stack_max_];
-
-      dynarray<char> log_text;
-
-      include_stack_entry_ &include() {
-        return include_stack_.back();
-      }
+      struct if_state {
+        bool active;  // this branch is being output
+        bool taken;   // a branch of this #if has been output
+        bool parent;  // the enclosing branch is being output
+      };
 
-      bool map_file(map_file_result &result, const char *filename, const char *first_path) {
-        result.filename_.format("%s%s", first_path, filename);
-        result.source_ = result.source_end_ = 0;
-        return true;
-      }
-  
-      unsigned line_number() {
-        return read_line_number_;
-      }
-  
-      const char *file_name() {
-        return read_file_name_;
-      }
-    
-      static bool strcmp( char_type *s1, char *s2 ) {
-        while( *s1 != 0 && *s2 != 0 && *s1 == *s2 ) {
-          s1++;
-          s2++;
-        }
-        return *s1 != 0 || *s2 != 0;
+      // names are interned forever: the index is also the index of the macro.
+      dictionary<int> names;
+      dynarray<macro*> macros;
+      dynarray<char> name_buffer;
+      int name_defined;
+      int name_va_args;
+      int name_once;
+
+      dictionary<source_file*> files;
+      dynarray<string*> include_paths;
+      file_loader loader;
+
+      dynarray<predefine*> predefines;
+      dynarray<int> defined_this_run;
+
+      // scratch token arrays, used as a stack.
+      dynarray<dynarray<token>*> pool;
+      unsigned pool_used;
+
+      // text of pasted and stringised tokens, freed at the start of each run.
+      dynarray<dynarray<char>*> arena;
+      unsigned arena_block;
+
+      dynarray<if_state> if_stack;
+      unsigned run;
+      unsigned num_errors;
+      const source_file *cur_file;
+      unsigned cur_line_number;
+
+      marker_style markers;
+      dynarray<char> out;
+      const source_file *out_file;
+      unsigned out_line;
+
+      // lines for next_line()
+      dynarray<unsigned> out_lines;
+      unsigned next_out_line;
+      const char *cur_line_;
+
+      static bool is_whitespace(char chr) {
+        return chr > 0 && chr <= ' ' && chr != '\n';
       }
-    
-      void push_include( const char *current, const char *end, const char *file_name, unsigned line_number ) {
-        //size_t length = strlen( file_name );
-        string currentPath = file_name;
-        int pos = currentPath.filename_pos();
-        currentPath.truncate(pos);
-      
-        {
-          include_stack_.resize(include_stack_.size() + 1);
-          include_stack_entry_ &entry = include();
-          entry.current_ = current;
-          entry.end_ = end;
-          entry.file_name_ = file_name;
-          entry.line_number_ = line_number;
-          entry.currentPath = currentPath;
-        }
-      }
-    
-      void push_if( bool is_true ) {
-        if_stack_.push_back(if_);
-
-        if_.is_true_ = is_true;
-        if_.had_true_ = is_true;
-        if_.bottom_level_ = false;
-        if_.had_if_ = false;
+
+      static bool is_digit(char chr) {
+        return chr >= '0' && chr <= '9';
       }
-    
-      void pop_if() {
-        if_ = if_stack_.back();
-        if_stack_.pop_back();
+
+      static bool is_id_start(char chr) {
+        return (chr >= 'a' && chr <= 'z') || (chr >= 'A' && chr <= 'Z') || chr == '_' || chr == '$';
       }
-  
-      void output( unsigned flags, unsigned line_number, const char *file_name, const char_type *text ) {
-        queue_entry_type *entry = queue_ + queue_in_;
-      
-        queue_in_ = ( queue_in_ + 1 ) & ( max_output_queue_ - 1);
-        entry->flags_ = flags;
-        entry->line_number_ = line_number;
-        entry->file_name_ = file_name;
-        entry->text_ = text;
-        //context_.debug( "o %d %d [%s]\n", queue_in_, queue_out_, text ? (char*)text : "" );
+
+      static bool is_id_middle(char chr) {
+        return is_id_start(chr) || is_digit(chr);
       }
-    
-      static void format_number( char_type *dest, unsigned line_number, const char *file_name, unsigned flags ) {
-        sprintf(
-          (char*)dest,
-          "# %d \"%s\"%s%s%s%s",
-          line_number,
-          file_name,
-          flags & 1 ? " 1" : "",
-          flags & 2 ? " 2" : "",
-          flags & 4 ? " 3" : "",
-          flags & 8 ? " 4" : ""
-        );
+
+      static bool is_punct(const token &t, char chr) {
+        return t.kind == tk_punct && t.len == 1 && t.text[0] == chr;
       }
 
-      bool is_whitespace( char_type chr ) {
-        return ( chr > 0 && chr <= ' ' );
+      static bool is_punct(const token &t, const char *str) {
+        return t.kind == tk_punct && t.len == strlen(str) && !memcmp(t.text, str, t.len);
       }
-    
-      bool is_digit( char_type chr ) {
-        return ( chr >= '0' && chr <= '9' );
+
+      static bool default_loader(dynarray<uint8_t> &buffer, const char *path) {
+        FILE *file = fopen(path, "rb");
+        if (!file) return false;
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        buffer.resize((unsigned)size);
+        bool ok = size == 0 || fread(buffer.data(), 1, (size_t)size, file) == (size_t)size;
+        fclose(file);
+        return ok;
       }
-    
-      bool is_id_start( char_type chr ) {
-        return ( chr >= 'a' && chr <= 'z' ) || ( chr >= 'A' && chr <= 'Z' ) || chr == '_';
+
+      void error(const char *fmt, const char *arg = "") {
+        char tmp[256];
+        snprintf(tmp, sizeof(tmp), fmt, arg);
+        cpp_log("%s(%d): error: %s\n", cur_file ? cur_file->name.c_str() : "", cur_line_number, tmp);
+        num_errors++;
       }
-    
-      bool is_id_middle( char_type chr ) {
-        return is_id_start( chr ) || is_digit( chr );
+
+      int intern(const char *text, unsigned len) {
+        name_buffer.resize(len + 1);
+        memcpy(name_buffer.data(), text, len);
+        name_buffer[len] = 0;
+        int index = names.get_index(name_buffer.data());
+        if (index >= 0) return names.get_value(index);
+        int name = (int)macros.size();
+        names[name_buffer.data()] = name;
+        macros.push_back(nullptr);
+        return name;
       }
-    
-      char_type *define_expansion( int index ) {
-        define_type &define = defines_.get_value(index);
-        if( define.has_params_ ) {
-          unsigned num_params = 0;
-          char_type *dest = params_;
-          char_type *dest_max = params_ + max_chars_ - 1;
-          //context_.debug( "define_expansion: [%s] [%s]\n", lexer_.get_src(), define.text_ );
-          lexer_.lex_token();
-          if( lexer_.type() != tok_lparen ) {
-            cpp_log("expected '('\n");
-          } else {
-            const char_type *start = lexer_.get_src();
-            lexer_.lex_token();
-            for(;;) // for each parameter
-            {
-              int level = 0;
-              param_starts_[ num_params ] = dest;
-
-              while( is_whitespace( *start ) ) {
-                start++;
-              }
 
-              bool fail = false;
-              while( !fail && ( level != 0 || (lexer_.type() != tok_comma && lexer_.type() != tok_rparen) ) ) {
-                while( start != lexer_.get_src() ) {
-                  *dest = *start++;
-                  dest += dest != dest_max;
-                }
-                *dest = 0;
-                level += lexer_.type() == tok_lparen;
-                level -= lexer_.type() == tok_rparen;
-                //printf( "%d [%s] %s\n", level, token_name( lexer_.type() ), param_starts_[ num_params ] );
-                if( lexer_.type() == tok_newline ) {
-                  if( def_exp_stack_depth_ != 0 ) {
-                    cpp_log("error: no ) in define expansion\n");
-                    fail = true;
-                    break;
-                  }
-                  do
-                  {
-                    if( include().current_ == include().end_ ) {
-                      cpp_log("error: end of file in define expansion\n");
-                      fail = true;
-                      break;
-                    }
-                    read_some_text();
-                    //printf( "rst: %s\n", read_line_ );
-                    start = read_line_;
-                    while( is_whitespace( *start ) ) {
-                      start++;
-                    }
-                    lexer_.start( start );
-                    lexer_.lex_token();
-                    //printf( "..[%s] %s\n", token_name( lexer_.type() ), param_starts_[ num_params ] );
-                  } while( lexer_.type() == tok_newline );
-                  *dest = ' ';
-                  dest += dest != dest_max;
-                } else {
-                  lexer_.lex_token();
-                }
-              }
+      macro *get_macro(int name) {
+        return name >= 0 && macros[name] && macros[name]->defined ? macros[name] : nullptr;
+      }
 
-              *dest = 0;
-               dest += dest != dest_max;
+      dynarray<token> &acquire() {
+        if (pool_used == pool.size()) pool.push_back(new dynarray<token>());
+        dynarray<token> &result = *pool[pool_used++];
+        result.resize(0);
+        return result;
+      }
 
-              //context_.debug( "p: %s\n", param_starts_[ num_params ] );
-              num_params++;
-              if( num_params == max_define_params_ ) {
-                cpp_log("error: too many define parameters\n");
-              }
+      void release() {
+        pool_used--;
+      }
 
-              if( lexer_.type() == tok_comma ) {
-                start = lexer_.get_src();
-                lexer_.lex_token();
-              } else {
-                break;
-              }
-            }
+      char *arena_alloc(unsigned size) {
+        while (arena_block < arena.size()) {
+          dynarray<char> &block = *arena[arena_block];
+          unsigned used = block.size();
+          if (used + size <= block.capacity()) {
+            block.resize(used + size);
+            return block.data() + used;
           }
-        
-          //context_.debug( "expand: %d params\n", num_params );
-          char_type *src = (char_type *)define.text_.c_str();
-          dest = expand_line_;
-          dest_max = expand_line_ + max_chars_ - 1;
-          for( ; *src; ) {
-            if( (*src & 255) == param_escape ) {
-              unsigned param = src[ 1 ] - '0';
-              if( param < num_params ) {
-                const char_type *psrc = param_starts_[ param ];
-                while( *psrc ) {
-                  *dest = *psrc++;
-                  dest += dest != dest_max;
-                }
-              }
-              src += 2;
-            } else if( (*src & 255) == stringise_param_escape ) {
-              unsigned param = src[ 1 ] - '0';
-              if( param < num_params ) {
-                const char_type *psrc = param_starts_[ param ];
-                *dest = (char)stringise_escape;
-                dest += dest != dest_max;
-              
-                while( *psrc ) {
-                  *dest = *psrc++;
-                  dest += dest != dest_max;
-                }
+          arena_block++;
+        }
+        arena.push_back(new dynarray<char>());
+        arena.back()->reserve(std::max((unsigned)arena_block_size, size));
+        arena_block = arena.size() - 1;
+        arena.back()->resize(size);
+        return arena.back()->data();
+      }
 
-                *dest = (char)stringise_escape;
-                dest += dest != dest_max;
-              }
-              src += 2;
-            } else if( src[ 0 ] == '\'' || src[ 0 ] == '"' ) {
-              char_type quote = src[ 0 ];
-              *dest = *src++;
-              dest += dest != dest_max;
-              while( !( src[ 0 ] == quote && src[ -1 ] != '\\' ) && *src ) {
-                *dest = *src++;
-                dest += dest != dest_max;
-              }
-              *dest = *src;
-              dest += dest != dest_max;
-              src += *src != 0;
-            } else {
-              *dest = *src++;
-              dest += dest != dest_max;
-            }
-          }
-        
-          char_type *text = (char_type *)allocator::malloc( ( dest - expand_line_ + 1 ) * sizeof( char_type ) );
-          char_type *text_dest = text;
-          for( src = expand_line_; src != dest; ++src ) {
-            *text_dest++ = *src;
-          }
-          *text_dest = 0;
-          //context_.debug( "result: %s\n\n", text );
-          return text;
-        } else {
-          //context_.debug( "result: %s\n\n", define.text_ );
-          return (char_type*)define.text_.c_str();
+      void write(const char *text, unsigned len) {
+        unsigned size = out.size();
+        if (size + len > out.capacity()) {
+          out.reserve(std::max(out.capacity() * 2, size + len + 1024));
         }
+        out.resize(size + len);
+        memcpy(out.data() + size, text, len);
       }
-    
-      void expand_defines() {
-        //context_.debug( "expand_defines(): %s\n", read_line_ );
-        lexer_.start( read_line_ );
-        const char_type *src = read_line_;
-        char_type *dest = write_line_;
-        char_type *dest_max = write_line_ + max_chars_ - 1;
-        for(;;) {
-          const char_type *prev = lexer_.get_src();
-
-          while( is_whitespace( *prev ) ) {
-            prev++;
+
+      ////////////////////////////////////////////////////////////////////////////////
+      //
+      // tokenising
+      //
+
+      // lex one line of cleaned text into tokens.
+      const char *lex_line(const char *p, const char *end, dynarray<token> &tokens, bool include) {
+        uint8_t space = 0;
+        while (p != end && *p != '\n') {
+          char chr = *p;
+          if (is_whitespace(chr)) {
+            space = 1;
+            ++p;
+            continue;
           }
 
-          lexer_.lex_token();
-
-          if( lexer_.type() == tok_newline ) {
-            const char_type *cur = lexer_.get_src();
-            if( def_exp_stack_depth_ ) {
-              // reached end of line or end of define expansion.
-              while( src != cur ) {
-                if( (*src & 255) == stringise_escape ) {
-                  *dest = '"';
-                  src++;
-                  dest += dest != dest_max;
-                } else {
-                  *dest = *src++;
-                  dest += dest != dest_max;
-                }
-              }
-              define_expansion_type &exp = def_exp_stack_[ --def_exp_stack_depth_ ];
-              lexer_.start( exp.src_ );
-              src = lexer_.get_src();
-              //context_.debug( "pop: %s\n", src );
-            } else {
-              while( src != cur ) {
-                *dest = *src++;
-                dest += dest != dest_max;
-              }
-              break;
+          token t;
+          t.text = p;
+          t.name = -1;
+          t.space = space;
+          t.no_expand = 0;
+          space = 0;
+
+          if (is_id_start(chr)) {
+            while (p != end && is_id_middle(*p)) ++p;
+            t.kind = tk_identifier;
+            t.name = intern(t.text, (unsigned)(p - t.text));
+          } else if (is_digit(chr) || (chr == '.' && p + 1 != end && is_digit(p[1]))) {
+            // pp-number
+            for (++p; p != end; ++p) {
+              if ((*p == '+' || *p == '-') && (p[-1] == 'e' || p[-1] == 'E' || p[-1] == 'p' || p[-1] == 'P')) continue;
+              if (!is_id_middle(*p) && *p != '.') break;
             }
-          }
-        
-          if( lexer_.type() == tok_identifier ) {
-            //string name( lexer_.id() );
-            //context_.debug( "\nexpand: [%s] %s\n", lexer_.id(), lexer_.get_src() );
-            const char *name = (const char*)lexer_.id();
-            int index = defines_.get_index( name );
-
-            for( unsigned i = 0; i != def_exp_stack_depth_; ++i ) {
-              if( def_exp_stack_[ i ].name_ != name ) {
-                index = -1; // already expanding this define
-                break;
-              }
+            t.kind = tk_number;
+          } else if (chr == '"' || chr == '\'' || (include && chr == '<')) {
+            char terminator = chr == '<' ? '>' : chr;
+            for (++p; p != end && *p != '\n' && *p != terminator; ++p) {
+              if (*p == '\\' && terminator != '>' && p + 1 != end && p[1] != '\n') ++p;
             }
-
-            if( index != -1 ) {
-              if( def_exp_stack_depth_ ) {
-                while( src != prev ) {
-                  if( (*src & 255) == stringise_escape ) {
-                    *dest = '"';
-                    src++;
-                    dest += dest != dest_max;
-                  } else {
-                    *dest = *src++;
-                    dest += dest != dest_max;
-                  }
-                }
-              } else {
-                while( src != prev ) {
-                  *dest = *src++;
-                  dest += dest != dest_max;
-                }
-              }
-
-              /*if( dest != write_line_ && dest[ -1 ] != ' ' ) {
-                *dest = ' ';
-                dest += dest != dest_max;
-              }*/
-            
-
-              const char_type *expansion = define_expansion( index );
-
-              define_expansion_type &exp = def_exp_stack_[ def_exp_stack_depth_ ];
-              exp.src_ = lexer_.get_src();
-              exp.name_ = name;
-              lexer_.start( expansion );
-              if( def_exp_stack_depth_ == def_exp_stack_max_ - 1 ) {
-                cpp_log("error: define expansion stack overflow\n");
+            p += p != end && *p == terminator;
+            t.kind = tk_string;
+          } else {
+            static const char *const puncts[] = {
+              "...", "<<=", ">>=", "##", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", "++", "--",
+              "->", "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=", "::",
+            };
+            unsigned len = 1;
+            for (unsigned i = 0; i != sizeof(puncts)/sizeof(puncts[0]); ++i) {
+              unsigned plen = (unsigned)strlen(puncts[i]);
+              if ((unsigned)(end - p) >= plen && !memcmp(p, puncts[i], plen)) {
+                len = plen;
                 break;
               }
-              def_exp_stack_depth_++;
-              src = lexer_.get_src();
             }
+            p += len;
+            t.kind = chr > ' ' && chr < 127 ? tk_punct : tk_other;
           }
+          t.len = (unsigned)(p - t.text);
+          include = false;
+          tokens.push_back(t);
         }
+        return p;
+      }
 
-        const char_type *cur = lexer_.get_src();
-        while( src != cur ) {
-          *dest = *src++;
-          dest += dest != dest_max;
+      // remove comments, carriage returns and line continuations. Record the first line of each logical line.
+      static void clean_text(dynarray<char> &text, dynarray<unsigned> &line_numbers, const char *src, const char *end) {
+        text.resize((unsigned)(end - src) + 1);
+        char *dest = text.data();
+        unsigned line_number = 1, start_line = 1;
+        line_numbers.resize(0);
+
+        while (src != end) {
+          char chr = *src++;
+          if (chr == '\\' && src != end && (*src == '\n' || (*src == '\r' && src + 1 != end && src[1] == '\n'))) {
+            src += *src == '\r' ? 2 : 1;
+            line_number++;
+          } else if (chr == '\r') {
+          } else if (chr == '\n') {
+            *dest++ = '\n';
+            line_numbers.push_back(start_line);
+            start_line = ++line_number;
+          } else if (chr == '/' && src != end && *src == '/') {
+            while (src != end && *src != '\n') ++src;
+          } else if (chr == '/' && src != end && *src == '*') {
+            for (++src; src != end && !(src[0] == '*' && src + 1 != end && src[1] == '/'); ++src) {
+              line_number += *src == '\n';
+            }
+            src += src == end ? 0 : 2;
+            *dest++ = ' ';
+          } else if (chr == '"' || chr == '\'') {
+            *dest++ = chr;
+            while (src != end && *src != chr && *src != '\n') {
+              if (*src == '\\' && src + 1 != end && src[1] != '\n') *dest++ = *src++;
+              *dest++ = *src++;
+            }
+            if (src != end && *src == chr) *dest++ = *src++;
+          } else {
+            *dest++ = chr;
+          }
         }
-        *dest = 0;
-      
-        //context_.debug( "  result %s\n", write_line_ );
 
-        output( 0x00, line_number(), file_name(), write_line_ );
-        def_exp_stack_depth_ = 0;
+        if (dest == text.data() || dest[-1] != '\n') {
+          *dest++ = '\n';
+          line_numbers.push_back(start_line);
+        }
+        text.resize((unsigned)(dest - text.data()));
       }
 
-      void next() {
-        for(;;) {
-          lexer_.lex_token();
-          while( lexer_.type() == tok_newline && def_exp_stack_depth_ ) {
-            // reached end of line or end of define expansion.
-            define_expansion_type &exp = def_exp_stack_[ --def_exp_stack_depth_ ];
-            lexer_.start( exp.src_ );
-            lexer_.lex_token();
+      static unsigned get_directive(const token &t) {
+        static const struct { const char *name; unsigned directive; } directives[] = {
+          { "define", dir_define }, { "undef", dir_undef }, { "include", dir_include },
+          { "if", dir_if }, { "ifdef", dir_ifdef }, { "ifndef", dir_ifndef }, { "elif", dir_elif },
+          { "else", dir_else }, { "endif", dir_endif }, { "pragma", dir_pragma }, { "error", dir_error },
+        };
+        for (unsigned i = 0; i != sizeof(directives)/sizeof(directives[0]); ++i) {
+          if (t.len == strlen(directives[i].name) && !memcmp(t.text, directives[i].name, t.len)) {
+            return directives[i].directive;
           }
-        
-          if( lexer_.type() != tok_identifier ) {
-            break;
+        }
+        return dir_other;
+      }
+
+      // find #ifndef X / #define X ... #endif around the whole file.
+      void find_guard(source_file *f) {
+        f->guard = -1;
+        unsigned num_lines = f->lines.size();
+        if (num_lines < 3) return;
+        const line &l0 = f->lines[0], &l1 = f->lines[1];
+        if (l0.directive != dir_ifndef || l0.num_tokens == 0 || l1.directive != dir_define || l1.num_tokens == 0) return;
+        const token &name0 = f->tokens[l0.first_token], &name1 = f->tokens[l1.first_token];
+        if (name0.kind != tk_identifier || name0.name != name1.name) return;
+
+        int depth = 0;
+        for (unsigned i = 0; i != num_lines; ++i) {
+          unsigned d = f->lines[i].directive;
+          depth += d == dir_if || d == dir_ifdef || d == dir_ifndef;
+          depth -= d == dir_endif;
+          if (depth == 0) {
+            if (i == num_lines - 1) f->guard = name0.name;
+            return;
           }
+        }
+      }
 
-          const char *name = (const char*)lexer_.id();
-          int index = defines_.get_index(name);
+      void tokenise(source_file *f, const char *src, const char *end) {
+        dynarray<unsigned> line_numbers;
+        clean_text(f->text, line_numbers, src, end);
+        f->tokens.resize(0);
+        f->lines.resize(0);
+        f->pragma_once = false;
+        f->last_run = 0;
+
+        const char *p = f->text.data(), *text_end = p + f->text.size();
+        for (unsigned i = 0; p != text_end; ++i) {
+          while (is_whitespace(*p)) ++p;
+          if (*p == '\n') {
+            ++p;
+            continue;
+          }
 
-          for( unsigned i = 0; i != def_exp_stack_depth_; ++i ) {
-            if( def_exp_stack_[ i ].name_ == name ) {
-              index = -1; // already expanding this define
-              break;
+          line l;
+          l.line_number = line_numbers[i];
+          l.directive = dir_text;
+          bool include = false;
+          if (*p == '#') {
+            ++p;
+            unsigned first = f->tokens.size();
+            const char *q = p;
+            while (is_whitespace(*q)) ++q;
+            const char *name_end = q;
+            while (is_id_middle(*name_end)) ++name_end;
+            l.directive = dir_null;
+            if (name_end != q) {
+              p = lex_line(p, name_end, f->tokens, false);
+              l.directive = get_directive(f->tokens[first]);
+              include = l.directive == dir_include;
             }
           }
+          l.first_token = f->tokens.size();
+          p = lex_line(p, text_end, f->tokens, include) + 1;
+          l.num_tokens = f->tokens.size() - l.first_token;
 
-          if( index != -1 ) {
-            char_type *expansion = define_expansion( index );
-            define_expansion_type &exp = def_exp_stack_[ def_exp_stack_depth_ ];
-            exp.src_ = lexer_.get_src();
-            exp.name_ = name;
-            lexer_.start( expansion );
-            if( def_exp_stack_depth_ == def_exp_stack_max_ - 1 ) {
-              cpp_log("error: define expansion stack overflow\n");
-              break;
-            }
-            def_exp_stack_depth_++;
-          } else {
-            break;
+          if (l.directive == dir_pragma && l.num_tokens && f->tokens[l.first_token].name == name_once) {
+            f->pragma_once = true;
           }
+          f->lines.push_back(l);
         }
-        //context_.debug( "[%s]\n", token_name( lexer_.type() ) );
-      }
-  
-      void next_raw() {
-        lexer_.lex_token();
-        //context_.debug( "[%s]\n", token_name( lexer_.type() ) );
+
+        find_guard(f);
       }
-  
-      void expect( token_type tok ) {
-        if( lexer_.type() != tok ) {
-          cpp_log("error: expected %s got %s\n", cpp_tokens::token_name( lexer_.type() ), cpp_tokens::token_name( tok ));
-        } else {
-          next();
+
+      source_file *make_file(const char *path) {
+        source_file *&f = files[path];
+        if (!f) {
+          f = new source_file();
+          f->name = path;
+          string dir = path;
+          dir.truncate(dir.filename_pos());
+          f->dir = dir;
         }
+        return f;
       }
-    
-      int64_t expression( unsigned precidence=0 ) {
-        int64_t result = 0;
-        //if( debug_expressions ) context_.debug_push( "expression %s %s\n", token_name( lexer_.type() ), lexer_.get_src() );
-        if( unary_op_[ lexer_.type() ] ) {
-          token_type op = lexer_.type();
-          next();
-          result = expression( 100 );
-          if( op == tok_minus ) {
-            result = -result;
-          } else if( op == tok_not ) {
-            result = !result;
-          } else if( op == tok_tilda ) {
-            result = ~result;
-          }
-        } else if( lexer_.type() == tok_identifier ) {
-          result = 0;
-          if( !strcmp( lexer_.id(), (char*)"defined" ) ) {
-            next_raw();
-            const char *name = 0;
-            if( lexer_.type() == tok_lparen ) {
-              next_raw();
-              name = (const char*)lexer_.id();
-              next_raw();
-              expect( tok_rparen );
-            } else {
-              name = (const char*)lexer_.id();
-              next_raw();
-            }
-            result = defines_.get_index( name ) != -1;
-          } else {
-            // unknown define, return 0
-            next();
-          }
-        } else if( lexer_.type() == tok_int_constant || lexer_.type() == tok_int64_constant || lexer_.type() == tok_uint_constant || lexer_.type() == tok_uint64_constant ) {
-          result = (int64_t)lexer_.value();
-          next();
-        } else if( lexer_.type() == tok_lparen ) {
-          next();
-          result = expression();
-          expect( tok_rparen );
-        } else if( lexer_.type() == tok_rparen ) {
-          cpp_log("error: missing '(' in expression\n");
-        } else {
-          cpp_log("error: expected primary-expression before '%s' token\n", cpp_tokens::token_name( lexer_.type() ) );
-        }
-      
-        unsigned thisPrecidence = precidence_[ lexer_.type() ];
-        //if( debug_expressions ) context_.debug( "thisPrecidence=%d precidence=%d tok=%s %s\n", thisPrecidence, precidence, token_name( lexer_.type() ), lexer_.get_src() );
-        while( thisPrecidence && precidence <= thisPrecidence ) {
-          token_type op = lexer_.type();
-          next();
-          int64_t rhs = expression( thisPrecidence );
-          switch( op ) {
-            case tok_comma: result = rhs; break;
-            case tok_or: result = result | rhs; break;
-            case tok_and: result = result & rhs; break;
-            case tok_xor: result = result ^ rhs; break;
-            case tok_lt: result = result < rhs; break;
-            case tok_gt: result = result > rhs; break;
-            case tok_le: result = result <= rhs; break;
-            case tok_ge: result = result >= rhs; break;
-            case tok_eq: result = result == rhs; break;
-            case tok_ne: result = result != rhs; break;
-            case tok_shift_left: result = result << rhs; break;
-            case tok_shift_right: result = result >> rhs; break;
-            case tok_plus: result = result + rhs; break;
-            case tok_minus: result = result - rhs; break;
-            case tok_star: result = result * rhs; break;
-            case tok_divide: result = result / rhs; break;
-            case tok_mod: result = result % rhs; break;
-            case tok_or_or: result = result || rhs; break;
-            case tok_and_and: result = result && rhs; break;
-            default: break;
-          }
-          thisPrecidence = precidence_[ lexer_.type() ];
-          //if( debug_expressions ) context_.debug( "..thisPrecidence=%d precidence=%d tok=%s %s\n", thisPrecidence, precidence, token_name( lexer_.type() ), lexer_.get_src() );
-        }
-        //if( debug_expressions ) context_.debug_pop( "/expression (%d) %s %s\n", result, token_name( lexer_.type() ), lexer_.get_src() );
-        return result;
+
+      // find a file in the cache or load it.
+      source_file *get_file(const char *path) {
+        int index = files.get_index(path);
+        if (index >= 0) return files.get_value(index);
+
+        dynarray<uint8_t> buffer;
+        if (!loader(buffer, path)) return nullptr;
+        source_file *f = make_file(path);
+        tokenise(f, (const char*)buffer.data(), (const char*)buffer.data() + buffer.size());
+        return f;
       }
-    
-      bool find_param( name_type *params, unsigned num_define_params, unsigned *param ) {
-        for( unsigned i = 0; i != num_define_params; ++i ) {
-          if( params[ i ] == (const char*)lexer_.id() ) {
-            *param = i;
-            return true;
-          }
+
+      source_file *find_include(const char *name, const char *dir) {
+        string path;
+        if (dir) {
+          path.format("%s%s", dir, name);
+          if (source_file *f = get_file(path)) return f;
+        }
+        for (unsigned i = 0; i != include_paths.size(); ++i) {
+          path.format("%s%s", include_paths[i]->c_str(), name);
+          if (source_file *f = get_file(path)) return f;
         }
-        return false;
+        return nullptr;
       }
 
-      void hash_define() {
-        next_raw();
-        if( lexer_.type() != tok_identifier ) {
-          cpp_log("error: expected name after #define\n");
+      ////////////////////////////////////////////////////////////////////////////////
+      //
+      // macros
+      //
+
+      void define_macro(const token *b, const token *e) {
+        if (b == e || b->kind != tk_identifier) {
+          error("expected name after #define");
           return;
         }
 
-        define_type &define = defines_[(const char*)lexer_.id()];
-
-        name_type params[ max_define_params_ ];
-        unsigned num_define_params = 0;
-      
-        const char_type *start = lexer_.get_src();
-      
-        bool has_params = false;
-      
-        if( *start == '(' ) {
-          // #define VALUE( xxx ) 
-          next_raw();
-          next_raw();
-          has_params = true;
-          while( lexer_.type() == tok_identifier ) {
-            if( num_define_params == max_define_params_ ) {
-              cpp_log("error: too many #define parameters\n");
+        int name = b++->name;
+        if (!macros[name]) macros[name] = new macro();
+        macro *m = macros[name];
+        if (!m->defined) defined_this_run.push_back(name);
+        m->defined = true;
+        m->disabled = false;
+        m->function_like = false;
+        m->variadic = false;
+        m->num_params = 0;
+        m->body.resize(0);
+
+        int params[max_params];
+        if (b != e && is_punct(*b, '(') && !b->space) {
+          m->function_like = true;
+          for (++b; b != e && !is_punct(*b, ')'); ++b) {
+            if (m->num_params == max_params) {
+              error("too many #define parameters");
               return;
+            } else if (b->kind == tk_identifier) {
+              params[m->num_params++] = b->name;
+            } else if (is_punct(*b, "...")) {
+              params[m->num_params++] = name_va_args;
+              m->variadic = true;
+            } else if (!is_punct(*b, ',')) {
+              error("bad #define parameter");
             }
-            params[ num_define_params++ ] = (const char*)lexer_.id();
-            next_raw();
-            if( lexer_.type() != tok_comma ) {
-              break;
-            }
-            next_raw();
           }
-
-          if( lexer_.type() != tok_rparen ) {
-            cpp_log("error: no ) in #define\n");
+          if (b == e) {
+            error("no ) in #define");
             return;
           }
-          start = lexer_.get_src();
-          next_raw();
+          ++b;
+        }
+
+        for (; b != e; ++b) {
+          token t = *b;
+          int param = -1;
+          const token *arg = b;
+          if (m->function_like && is_punct(t, '#') && b + 1 != e) arg = b + 1;
+          for (unsigned i = 0; i != m->num_params && arg->kind == tk_identifier; ++i) {
+            if (params[i] == arg->name) param = (int)i;
+          }
+          if (param >= 0) {
+            if (arg != b) {
+              t.kind = tk_stringise;
+              b = arg;
+            } else {
+              t.kind = tk_param;
+            }
+            t.name = param;
+          } else if (is_punct(t, "##")) {
+            t.kind = tk_paste;
+          }
+          m->body.push_back(t);
+        }
+        if (m->body.size()) m->body[0].space = 0;
+      }
+
+      // NAME or NAME=value
+      void define_string(const char *str) {
+        unsigned len = (unsigned)strlen(str);
+        const char *eq = strchr(str, '=');
+        char *text = arena_alloc(len + 3);
+        memcpy(text, str, len);
+        if (eq) {
+          text[eq - str] = ' ';
         } else {
-          next_raw();
+          text[len++] = ' ';
+          text[len++] = '1';
         }
+        text[len] = '\n';
 
-        char_type *dest = write_line_;
+        dynarray<token> &tokens = acquire();
+        lex_line(text, text + len + 1, tokens, false);
+        define_macro(tokens.data(), tokens.data() + tokens.size());
+        release();
+      }
 
-        while( is_whitespace( *start ) ) {
-          start++;
+      void stringise(const token *b, const token *e, token &result) {
+        unsigned len = 2;
+        for (const token *t = b; t != e; ++t) {
+          len += t->len * 2 + (t != b && t->space);
         }
+        char *text = arena_alloc(len);
+        char *dest = text;
+        *dest++ = '"';
+        for (const token *t = b; t != e; ++t) {
+          if (t != b && t->space) *dest++ = ' ';
+          for (unsigned i = 0; i != t->len; ++i) {
+            char chr = t->text[i];
+            if (t->kind == tk_string && (chr == '"' || chr == '\\')) *dest++ = '\\';
+            *dest++ = chr;
+          }
+        }
+        *dest++ = '"';
+        result.text = text;
+        result.len = (unsigned)(dest - text);
+        result.kind = tk_string;
+        result.name = -1;
+      }
 
-        bool hash = false;
-        while( lexer_.type() != tok_newline ) {
-          unsigned param;
-          if( lexer_.type() == tok_identifier && find_param( params, num_define_params, &param ) ) {
-            *dest++ = hash ? stringise_param_escape : param_escape;
-            *dest++ = param + '0';
-            hash = false;
-          } else if( lexer_.type() == tok_hash ) {
-            hash = true;
-          } else if( lexer_.type() == tok_hash_hash ) {
-            hash = false;
-          } else {
-            while( start != lexer_.get_src() ) {
-              *dest++ = *start++;
+      void paste(token &lhs, const token &rhs) {
+        char *text = arena_alloc(lhs.len + rhs.len + 1);
+        memcpy(text, lhs.text, lhs.len);
+        memcpy(text + lhs.len, rhs.text, rhs.len);
+        text[lhs.len + rhs.len] = '\n';
+
+        dynarray<token> &tokens = acquire();
+        lex_line(text, text + lhs.len + rhs.len + 1, tokens, false);
+        if (tokens.size() == 1) {
+          uint8_t space = lhs.space;
+          lhs = tokens[0];
+          lhs.space = space;
+        } else {
+          error("pasting does not give a valid token");
+        }
+        release();
+      }
+
+      // replace the parameters of a macro body with the arguments.
+      void substitute(macro *m, const token *args, const unsigned *bounds, unsigned num_args, dynarray<token> &result, unsigned depth) {
+        const token *body = m->body.data();
+        unsigned body_size = m->body.size();
+        int paste_at = -1;
+        for (unsigned i = 0; i != body_size; ++i) {
+          const token &b = body[i];
+          if (b.kind == tk_paste) {
+            paste_at = result.size() ? (int)result.size() - 1 : -1;
+            continue;
+          }
+
+          unsigned first = result.size();
+          if (b.kind == tk_param || b.kind == tk_stringise) {
+            const token *ab = args, *ae = args;
+            if ((unsigned)b.name < num_args) {
+              ab = args + bounds[b.name];
+              ae = args + bounds[b.name + 1];
+            }
+            if (b.kind == tk_stringise) {
+              token t = b;
+              stringise(ab, ae, t);
+              result.push_back(t);
+            } else if (paste_at >= 0 || (i + 1 != body_size && body[i+1].kind == tk_paste)) {
+              // arguments next to ## are not expanded
+              for (const token *t = ab; t != ae; ++t) result.push_back(*t);
+            } else {
+              expand(ab, ae, result, depth + 1);
             }
-            hash = false;
+            if (result.size() != first) result[first].space = b.space;
+          } else {
+            result.push_back(b);
           }
 
-          start = lexer_.get_src();
-          next_raw();
+          if (paste_at >= 0 && result.size() != first) {
+            paste(result[paste_at], result[first]);
+            for (unsigned j = first + 1; j != result.size(); ++j) result[j-1] = result[j];
+            result.resize(result.size() - 1);
+          }
+          paste_at = -1;
         }
+      }
 
-        while( start != lexer_.get_src() ) {
-          *dest++ = *start++;
+      // expand the macros in [begin, end) and add the result to dest.
+      void expand(const token *begin, const token *end, dynarray<token> &dest, unsigned depth) {
+        if (depth >= max_expand_depth) {
+          error("macros nested too deeply");
+          return;
         }
 
-        *dest = 0;
+        // the input, reversed so that expansions can be pushed on the end.
+        dynarray<token> &stack = acquire();
+        for (const token *t = end; t != begin; ) stack.push_back(*--t);
 
-        unsigned num_chars = (unsigned)( dest - write_line_ + 1 );
-        define.text_.set((const char*)write_line_, num_chars);
-        define.has_params_ = has_params;
-        //context_.debug( "#define %s [%s] %d\n", name.text(), define.text_, define.has_params_ );
-      
-        //context_.debug( "index=%d\n", defines_.index( name ) );
-      }
-    
-      void hash_directive( const char_type *src ) {
-        //if( debug_ifs ) context_.debug( "[%d%d%d%d]# %s\n", if_.is_true_, if_.had_true_, if_.bottom_level_, if_.had_if_, src );
+        while (stack.size()) {
+          token t = stack.back();
+          stack.pop_back();
+          if (t.kind == tk_end_macro) {
+            macros[t.name]->disabled = false;
+            continue;
+          }
 
-        while( is_whitespace( *src ) ) {
-          ++src;
-        }
-      
-        if( is_id_start( *src ) ) {
-          //const char_type *src0 = src;
-          long long name = *src++;
-          while( is_id_middle( *src ) ) {
-            name = name * 256 + *src++;
+          macro *m = t.kind == tk_identifier && !t.no_expand ? get_macro(t.name) : nullptr;
+          if (!m) {
+            dest.push_back(t);
+            continue;
+          } else if (m->disabled) {
+            t.no_expand = 1;
+            dest.push_back(t);
+            continue;
           }
 
-          lexer_.start( src );
+          dynarray<token> &args = acquire();
+          dynarray<token> &result = acquire();
+          bool ok = true;
+          if (m->function_like) {
+            unsigned i = stack.size();
+            while (i && stack[i-1].kind == tk_end_macro) --i;
+            if (!i || !is_punct(stack[i-1], '(')) {
+              // a function-like macro name without ( is just a name.
+              dest.push_back(t);
+              release();
+              release();
+              continue;
+            }
 
-          //context_.debug( "else if( name == 0x%LxL ) // %s\n", name, src0 );
-          if( name == 0x69666e646566ll || name == 0x6966646566ll ) { // ifdef/ifndef
-            if( if_.is_true_ ) {
-              next_raw();
-            
-              bool result = false;
-              if( lexer_.type() != tok_identifier ) {
-                expect( tok_identifier );
+            unsigned bounds[max_params + 1];
+            unsigned num_args = 0, level = 0;
+            bounds[0] = 0;
+            ok = false;
+            while (stack.size() > i - 1) {
+              token a = stack.back();
+              stack.pop_back();
+              if (a.kind == tk_end_macro) macros[a.name]->disabled = false;
+            }
+            while (stack.size()) {
+              token a = stack.back();
+              stack.pop_back();
+              if (a.kind == tk_end_macro) {
+                macros[a.name]->disabled = false;
+              } else if (is_punct(a, ')') && level == 0) {
+                ok = true;
+                break;
+              } else if (is_punct(a, ',') && level == 0 && !(m->variadic && num_args + 1 >= m->num_params) && num_args + 1 < max_params) {
+                bounds[++num_args] = args.size();
               } else {
-                result = defines_.get_index((const char *)lexer_.id()) != -1;
-                if( name == 0x69666e646566ll ) // #ifdef
-                {
-                  result = !result;
-                }
-                //context_.debug( "#ifdef %s %lld\n", def_name.text(), result );
-                next();
+                level += is_punct(a, '(');
+                level -= is_punct(a, ')');
+                args.push_back(a);
               }
-              push_if( result );
-              if_.had_if_ = true;
-            } else {
-              push_if( false );
             }
-          } else if( name == 0x6966ll ) // if
-          {
-            if( if_.is_true_ ) {
-              next();
-              int64_t result = expression();
-              //context_.debug( "if %d\n", result != 0 );
-              push_if( result != 0 );
-              if_.had_if_ = true;
+            bounds[++num_args] = args.size();
+            if (m->num_params == 0 && args.size() == 0) num_args = 0;
+
+            if (!ok) {
+              error("unterminated macro call");
             } else {
-              push_if( false );
+              substitute(m, args.data(), bounds, num_args, result, depth);
             }
+          } else {
+            for (unsigned i = 0; i != m->body.size(); ++i) result.push_back(m->body[i]);
           }
-          else if( name == 0x656e646966ll ) // endif
-          {
-            if( if_.bottom_level_ ) {
-              cpp_log("error: too many endifs\n");
-            } else {
-              pop_if();
-            }
-          } else if( name == 0x656c6966ll ) // elif
-          {
-            if( if_.bottom_level_ ) {
-              cpp_log("error: elif withot if\n");
-            } else if( if_.had_if_ ) {
-              if( !if_.had_true_ ) {
-                next();
-                int64_t result = expression();
-                //context_.debug( "elif %d\n", result != 0 );
-                if_.is_true_ = result != 0;
-              } else {
-                if_.is_true_ = false;
-              }
-              if_.had_true_ |= if_.is_true_;
+
+          if (ok) {
+            token marker = { "", 0, t.name, tk_end_macro, 0, 0 };
+            stack.push_back(marker);
+            m->disabled = true;
+            for (unsigned i = result.size(); i-- != 0; ) {
+              stack.push_back(result[i]);
+              if (i == 0) stack.back().space = t.space;
             }
           }
-          else if( name == 0x656c7365ll ) { // else
-            if( if_.bottom_level_ ) {
-              cpp_log("error: else without if\n");
-            } else if( if_.had_if_ ) {
-              if_.is_true_ = !if_.had_true_;
-              if_.had_true_ = true;
-            }
-          } else if( name == 0x696e636c756465ll ) { // include
-            if( if_.is_true_ ) {
-              while( is_whitespace( *src ) ) {
-                ++src;
-              }
-    
-              if( *src != '"' && *src != '<' ) {
-                cpp_log("error: sytnax error in #include");
-                return;
-              }
-      
-              char_type terminator = *src++ == '<' ? '>' : '"';
-              char filename[ 256 ];
-              char *dest = filename;
-              while( *src && *src != terminator ) {
-                *dest = *src++;
-                dest += dest != filename + sizeof( filename ) - 1;
-              }
-              *dest = 0;
-              //context_.debug( "%s\n", filename );
-              if( *src != terminator ) {
-                cpp_log("error: sytnax error in #include");
-                return;
-              }
-              src++;
-  
-              while( is_whitespace( *src ) ) {
-                ++src;
-              }
-    
-              if( *src != 0 ) {
-                cpp_log("error: sytnax error in #include");
-              }
-  
-              map_file_result file;
-              if (!map_file( file, filename, include().currentPath.c_str() )) {
-                cpp_log("error: include file %s not found", filename);
-                return;
-              }
-
-              output( 0x0c, line_number(), file_name(), 0 );
+          release();
+          release();
+        }
 
-              push_include( file.source_, file.source_end_, file.filename_, 1 );
+        release();
+      }
 
-              output( 0x0d, 1, file.filename_, 0 );
+      ////////////////////////////////////////////////////////////////////////////////
+      //
+      // #if expressions
+      //
 
-              push_if( true );
-              if_.bottom_level_ = true;
-  
-              while( is_whitespace( *src ) ) {
-                ++src;
-              }
-    
-              if( *src != 0 ) {
-                cpp_log("error: syntax error in #include\n");
-              }
-            }
-          } else if( name == 0x6572726f72ll ) { // error
-            if( if_.is_true_ ) {
-            }
-          } else if( name == 0x707261676d61ll ) { // pragma
-            if( if_.is_true_ ) {
-            }
+      static int64_t parse_number(const token &t) {
+        const char *p = t.text, *end = t.text + t.len;
+        if (t.kind == tk_string && t.text[0] == '\'') {
+          return t.len > 2 ? (p[1] == '\\' && t.len > 3 ? p[2] : p[1]) : 0;
+        }
+        int64_t result = 0;
+        if (t.len > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+          for (p += 2; p != end; ++p) {
+            char c = *p;
+            int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (digit < 0) break;
+            result = result * 16 + digit;
           }
-          else if( name == 0x7761726e696e67ll ) // warning
-          {
-            if( if_.is_true_ ) {
-            }
+        } else {
+          int base = p[0] == '0' ? 8 : 10;
+          for (; p != end && is_digit(*p); ++p) result = result * base + (*p - '0');
+        }
+        return result;
+      }
+
+      static int precedence(const token &t) {
+        static const struct { const char *op; int prec; } ops[] = {
+          { "?", 1 }, { "||", 2 }, { "&&", 3 }, { "|", 4 }, { "^", 5 }, { "&", 6 },
+          { "==", 7 }, { "!=", 7 }, { "<", 8 }, { ">", 8 }, { "<=", 8 }, { ">=", 8 },
+          { "<<", 9 }, { ">>", 9 }, { "+", 10 }, { "-", 10 }, { "*", 11 }, { "/", 11 }, { "%", 11 },
+        };
+        if (t.kind != tk_punct) return 0;
+        for (unsigned i = 0; i != sizeof(ops)/sizeof(ops[0]); ++i) {
+          if (is_punct(t, ops[i].op)) return ops[i].prec;
+        }
+        return 0;
+      }
+
+      int64_t primary(const token *&p, const token *e) {
+        if (p == e) {
+          error("expected a value in #if");
+          return 0;
+        }
+        const token &t = *p++;
+        if (is_punct(t, '(')) {
+          int64_t result = expression(p, e, 1);
+          if (p == e || !is_punct(*p, ')')) {
+            error("missing ) in #if");
+          } else {
+            ++p;
           }
-          else if( name == 0x646566696e65ll ) // define
-          {
-            if( if_.is_true_ ) {
-              hash_define();
+          return result;
+        } else if (is_punct(t, '-')) {
+          return -primary(p, e);
+        } else if (is_punct(t, '+')) {
+          return primary(p, e);
+        } else if (is_punct(t, '!')) {
+          return !primary(p, e);
+        } else if (is_punct(t, '~')) {
+          return ~primary(p, e);
+        } else if (t.kind == tk_number || t.kind == tk_string) {
+          return parse_number(t);
+        } else if (t.kind == tk_identifier) {
+          // names that are not macros are zero.
+          return 0;
+        }
+        error("unexpected token in #if");
+        return 0;
+      }
+
+      int64_t expression(const token *&p, const token *e, int min_precedence) {
+        int64_t lhs = primary(p, e);
+        for (;;) {
+          int prec = p == e ? 0 : precedence(*p);
+          if (prec == 0 || prec < min_precedence) return lhs;
+          const token &op = *p++;
+          if (prec == 1) {
+            int64_t a = expression(p, e, 1);
+            if (p == e || !is_punct(*p, ':')) {
+              error("missing : in #if");
+              return 0;
             }
+            ++p;
+            int64_t b = expression(p, e, 1);
+            lhs = lhs ? a : b;
+            continue;
           }
-          else if( name == 0x756e646566ll ) // undef
-          {
-            if( if_.is_true_ ) {
-              next_raw();
-            
-              if( lexer_.type() != tok_identifier ) {
-                expect( tok_identifier );
+
+          int64_t rhs = expression(p, e, prec + 1);
+          char c0 = op.text[0], c1 = op.len > 1 ? op.text[1] : 0;
+          switch (c0) {
+            case '|': lhs = c1 ? lhs || rhs : lhs | rhs; break;
+            case '&': lhs = c1 ? lhs && rhs : lhs & rhs; break;
+            case '^': lhs = lhs ^ rhs; break;
+            case '=': lhs = lhs == rhs; break;
+            case '!': lhs = lhs != rhs; break;
+            case '<': lhs = c1 == '<' ? lhs << rhs : c1 == '=' ? lhs <= rhs : lhs < rhs; break;
+            case '>': lhs = c1 == '>' ? lhs >> rhs : c1 == '=' ? lhs >= rhs : lhs > rhs; break;
+            case '+': lhs = lhs + rhs; break;
+            case '-': lhs = lhs - rhs; break;
+            case '*': lhs = lhs * rhs; break;
+            case '/': case '%': {
+              if (rhs == 0) {
+                error("division by zero in #if");
+                lhs = 0;
               } else {
-                int index = defines_.get_index( (const char*)lexer_.id() );
-                if( index != -1 ) {
-                  defines_[(const char*)lexer_.id()].text_ = "";
-                }
+                lhs = c0 == '/' ? lhs / rhs : lhs % rhs;
               }
-            }
-          } else {
-            cpp_log("error: unknown # directive\n");
+            } break;
           }
         }
       }
-    
-      void read_some_text() {
-        char_type *dest = read_line_;
-        char_type *dest_max = read_line_ + max_chars_ - 1;
-        const char *current = include().current_;
-        const char *end = include().end_;
-        unsigned line_num = include().line_number_;
-
-        //context_.debug( "%s line %d %d\n", include().file_name_, line_num, end - current );
-        while( current != end ) {
-          char_type chr = *current++;
-          if( chr == '\n' ) {
-            // newline
-            line_num++;
-            break;
-          } else if( chr == '/' ) {
-            if( current != end && *current == '/' ) {
-              // c++ comment
-              current++;
-              while( (current != end && current[ 0 ] != '\n') || current[ -1 ] == '\\' ) {
-                line_num += current[ 0 ] == '\n';
-                current++;
-              }
-              break;
-            } else if( current != end && *current == '*' ) {
-              // c comment
-              current++;
-              while( current != end && ( current[ 0 ] != '/' || current[ -1 ] != '*' ) ) {
-                line_num += current[ 0 ] == '\n';
-                current++;
-              }
-              if( current == end ) {
-                cpp_log("error: unterminated comment\n");
-                break;
-              }
 
-              current++;
-              chr = ' ';
-              *dest = chr;
-              dest += dest != dest_max;
-            } else {
-              *dest = chr;
-              dest += dest != dest_max;
-            }
-          } else if( chr == '\\' ) {
-            // \ escape
-            if( current == end ) {
-              *dest = chr;
-              dest += dest != dest_max;
-            } else {
-              if( *current == '\n' ) {
-                current++;
-                line_num++;
-              } else {
-                *dest = chr;
-                dest += dest != dest_max;
-              }
-            }
-          } else if( chr != '\r' ) {
-            *dest = chr;
-            dest += dest != dest_max;
+      bool evaluate(const token *b, const token *e) {
+        // replace defined(X) before expanding the macros.
+        dynarray<token> &tokens = acquire();
+        for (const token *t = b; t != e; ++t) {
+          if (t->kind != tk_identifier || t->name != name_defined) {
+            tokens.push_back(*t);
+            continue;
           }
+          bool paren = t + 1 != e && is_punct(t[1], '(');
+          const token *name = t + 1 + paren;
+          if (name >= e || name->kind != tk_identifier) {
+            error("expected a name after defined");
+            break;
+          }
+          token value = *name;
+          value.kind = tk_number;
+          value.text = get_macro(name->name) ? "1" : "0";
+          value.len = 1;
+          tokens.push_back(value);
+          t = name + (paren && name + 1 != e && is_punct(name[1], ')'));
         }
 
-        if( dest == dest_max ) {
-          cpp_log("error: line too long\n");
-          cur_line_ = 0;
+        dynarray<token> &expanded = acquire();
+        expand(tokens.data(), tokens.data() + tokens.size(), expanded, 0);
+        const token *p = expanded.data(), *pe = p + expanded.size();
+        int64_t result = expression(p, pe, 1);
+        if (p != pe) error("unexpected token in #if");
+        release();
+        release();
+        return result != 0;
+      }
+
+      ////////////////////////////////////////////////////////////////////////////////
+      //
+      // output
+      //
+
+      // get the output to the right line, with blank lines or a marker.
+      void sync_line(const source_file *f, unsigned line_number) {
+        char tmp[64];
+        if (f == out_file && line_number >= out_line && line_number <= out_line + max_blank_lines) {
+          for (; out_line != line_number; ++out_line) write("\n", 1);
           return;
+        } else if (markers == markers_gcc) {
+          write(tmp, (unsigned)snprintf(tmp, sizeof(tmp), "# %d \"", line_number));
+          write(f->name.c_str(), (unsigned)strlen(f->name.c_str()));
+          write("\"\n", 2);
+        } else if (out.size()) {
+          // #line must not come before #version
+          write(tmp, (unsigned)snprintf(tmp, sizeof(tmp), "#line %d\n", line_number));
         }
-        *dest++ = 0;
+        out_file = f;
+        out_line = line_number;
+      }
 
-        include().current_ = current;
-        include().line_number_ = line_num;
-      
-        if( current == end ) {
-          //context_.debug( "%s END! line %d %d\n", include().file_name_, line_num, end - current );
+      void write_tokens(const token *b, const token *e) {
+        for (const token *t = b; t != e; ++t) {
+          if (t != b && t->space) write(" ", 1);
+          write(t->text, t->len);
         }
-        //context_.debug( "[%s]\n", read_line_ );
+        write("\n", 1);
+        out_line++;
       }
-    
-      void read_line() {
-        //context_.debug( "read_line() qi=%d qo=%d\n", queue_in_, queue_out_ );
-        while( queue_in_ == queue_out_ ) {
-          if( include().current_ == include().end_ ) {
-            //context_.debug( "read_line() qi=%d qo=%d END!\n", queue_in_, queue_out_ );
-            if( include_stack_.size() == 0 ) {
-              cur_line_ = 0;
-              return;
-            } else {
-              if( !if_.bottom_level_ ) {
-                cpp_log("error: if without endif\n");
-                while( !if_.bottom_level_ ) {
-                  pop_if();
+
+      // function-like macro calls can go on to the next lines.
+      bool needs_more_lines(const token *b, const token *e) {
+        int level = 0;
+        bool has_call = false;
+        for (const token *t = b; t != e; ++t) {
+          level += is_punct(*t, '(');
+          level -= is_punct(*t, ')');
+          has_call |= t->kind == tk_identifier && get_macro(t->name) && macros[t->name]->function_like;
+        }
+        return has_call && level > 0;
+      }
+
+      void include(const token *b, const token *e, unsigned depth) {
+        if (b == e || b->kind != tk_string || b->len < 2) {
+          error("expected \"file\" or <file> after #include");
+          return;
+        }
+
+        string name(b->text + 1, b->len - 2);
+        source_file *f = find_include(name, b->text[0] == '"' ? cur_file->dir.c_str() : nullptr);
+        if (!f) {
+          error("include file %s not found", name.c_str());
+          return;
+        }
+
+        if ((f->pragma_once && f->last_run == run) || (f->guard >= 0 && get_macro(f->guard))) {
+          return;
+        }
+
+        if (depth >= max_include_depth) {
+          error("#include nested too deeply");
+          return;
+        }
+
+        const source_file *from = cur_file;
+        f->last_run = run;
+        process_file(f, depth + 1);
+        cur_file = from;
+      }
+
+      void process_file(const source_file *f, unsigned depth) {
+        unsigned if_base = if_stack.size();
+        const token *tokens = f->tokens.data();
+        cur_file = f;
+
+        for (unsigned li = 0; li != f->lines.size(); ++li) {
+          const line &l = f->lines[li];
+          const token *b = tokens + l.first_token, *e = b + l.num_tokens;
+          bool active = if_stack.size() == 0 || if_stack.back().active;
+          cur_line_number = l.line_number;
+
+          switch (l.directive) {
+            case dir_if: case dir_ifdef: case dir_ifndef: {
+              if_state s = { false, true, active };
+              if (active) {
+                if (l.directive == dir_if) {
+                  s.active = evaluate(b, e);
+                } else if (b != e && b->kind == tk_identifier) {
+                  s.active = (get_macro(b->name) != nullptr) == (l.directive == dir_ifdef);
+                } else {
+                  error("expected a name after #ifdef");
                 }
+                s.taken = s.active;
               }
-  
-              pop_if();
-
-              include_stack_.pop_back();
-              /*if( include_stack_ptr_ != include_stack_ ) {
-                output( 0x0e, line_number(), file_name(), 0 );
-              }*/
-              continue;
-            }
+              if_stack.push_back(s);
+            } break;
+            case dir_elif: {
+              if (if_stack.size() == if_base) {
+                error("#elif without #if");
+              } else {
+                if_state &s = if_stack.back();
+                s.active = s.parent && !s.taken && evaluate(b, e);
+                s.taken |= s.active;
+              }
+            } break;
+            case dir_else: {
+              if (if_stack.size() == if_base) {
+                error("#else without #if");
+              } else {
+                if_state &s = if_stack.back();
+                s.active = s.parent && !s.taken;
+                s.taken = true;
+              }
+            } break;
+            case dir_endif: {
+              if (if_stack.size() == if_base) {
+                error("#endif without #if");
+              } else {
+                if_stack.pop_back();
+              }
+            } break;
+            default: {
+              if (!active) break;
+              switch (l.directive) {
+                case dir_text: {
+                  dynarray<token> &expanded = acquire();
+                  if (needs_more_lines(b, e)) {
+                    dynarray<token> &joined = acquire();
+                    for (const token *t = b; t != e; ++t) joined.push_back(*t);
+                    while (needs_more_lines(joined.data(), joined.data() + joined.size()) && li + 1 != f->lines.size() && f->lines[li+1].directive == dir_text) {
+                      const line &next = f->lines[++li];
+                      for (unsigned i = 0; i != next.num_tokens; ++i) joined.push_back(tokens[next.first_token + i]);
+                    }
+                    expand(joined.data(), joined.data() + joined.size(), expanded, 0);
+                    release();
+                  } else {
+                    expand(b, e, expanded, 0);
+                  }
+                  sync_line(f, l.line_number);
+                  write_tokens(expanded.data(), expanded.data() + expanded.size());
+                  release();
+                } break;
+                case dir_define: {
+                  define_macro(b, e);
+                } break;
+                case dir_undef: {
+                  if (b != e && get_macro(b->name)) macros[b->name]->defined = false;
+                } break;
+                case dir_include: {
+                  include(b, e, depth);
+                  cur_file = f;
+                } break;
+                case dir_pragma: {
+                  if (b != e && b->name == name_once) break;
+                } // fall through: other pragmas go to the compiler
+                case dir_other: {
+                  sync_line(f, l.line_number);
+                  write("#", 1);
+                  write_tokens(b - 1, e);
+                } break;
+                case dir_error: {
+                  error("#error");
+                } break;
+              }
+            } break;
           }
+        }
 
-          read_line_number_ = include().line_number_;
-          read_file_name_ = include().file_name_;
-          read_some_text();
- 
-          char_type *src = read_line_;
-          def_exp_stack_depth_ = 0;
-        
-          while( is_whitespace( *src ) ) {
-            ++src;
-          }
-        
-          if( *src == '#' ) {
-            hash_directive( src + 1 );
-            num_skipped_++;
-          } else if( *src == 0 || !if_.is_true_ ) {
-            num_skipped_++;
-          } else if( if_.is_true_ ) {
-            if( num_skipped_ >= 8 ) {
-              // avoid too many blank lines
-              output( 0x0e, line_number(), file_name(), 0 );
-            } 
-            expand_defines();
-            num_skipped_ = 0;
-          }
+        if (if_stack.size() != if_base) {
+          error("#if without #endif");
+          if_stack.resize(if_base);
         }
       }
 
+      void begin_run(const char *const *defines, unsigned num_defines) {
+        run++;
+        num_errors = 0;
+        cur_file = nullptr;
+        cur_line_number = 0;
+        pool_used = 0;
+        for (unsigned i = 0; i != arena.size(); ++i) arena[i]->resize(0);
+        arena_block = 0;
+        if_stack.resize(0);
+        out.resize(0);
+        out_file = nullptr;
+        out_line = 1;
+
+        for (unsigned i = 0; i != defined_this_run.size(); ++i) {
+          macro *m = macros[defined_this_run[i]];
+          m->defined = m->disabled = false;
+        }
+        defined_this_run.resize(0);
+
+        for (unsigned i = 0; i != predefines.size(); ++i) {
+          dynarray<token> &tokens = predefines[i]->tokens;
+          define_macro(tokens.data(), tokens.data() + tokens.size());
+        }
+        for (unsigned i = 0; i != num_defines; ++i) {
+          define_string(defines[i]);
+        }
+      }
+
+      bool run_file(source_file *f, const char *const *defines, unsigned num_defines) {
+        begin_run(defines, num_defines);
+        f->last_run = run;
+        process_file(f, 0);
+        write("", 1);
+        return num_errors == 0;
+      }
+
     public:
       cpp_preprocessor() {
-        for( int i = 0; i != tok_last; ++i ) {
-          precidence_[ i ] = 0;
+        name_defined = intern("defined", 7);
+        name_va_args = intern("__VA_ARGS__", 11);
+        name_once = intern("once", 4);
+        loader = default_loader;
+        pool_used = 0;
+        arena_block = 0;
+        run = 0;
+        num_errors = 0;
+        cur_file = nullptr;
+        cur_line_number = 0;
+        markers = markers_gcc;
+        out_file = nullptr;
+        out_line = 1;
+        next_out_line = 0;
+        cur_line_ = nullptr;
+      }
+
+      ~cpp_preprocessor() {
+        for (unsigned i = 0; i != macros.size(); ++i) delete macros[i];
+        for (unsigned i = 0; i != files.get_num_indices(); ++i) {
+          if (files.get_key(i)) delete files.get_value(i);
         }
+        for (unsigned i = 0; i != include_paths.size(); ++i) delete include_paths[i];
+        for (unsigned i = 0; i != predefines.size(); ++i) delete predefines[i];
+        for (unsigned i = 0; i != pool.size(); ++i) delete pool[i];
+        for (unsigned i = 0; i != arena.size(); ++i) delete arena[i];
+      }
 
-        precidence_[ tok_comma ] = 1;
-        precidence_[ tok_equals ] = 2;
-        precidence_[ tok_times_equals ] = 2;
-        precidence_[ tok_divide_equals ] = 2;
-        precidence_[ tok_mod_equals ] = 2;
-        precidence_[ tok_plus_equals ] = 2;
-        precidence_[ tok_minus_equals ] = 2;
-        precidence_[ tok_shift_left_equals ] = 2;
-        precidence_[ tok_shift_right_equals ] = 2;
-        precidence_[ tok_and_equals ] = 2;
-        precidence_[ tok_xor_equals ] = 2;
-        precidence_[ tok_or_equals ] = 2;
-        precidence_[ tok_question ] = 3;
-        precidence_[ tok_or_or ] = 4;
-        precidence_[ tok_and_and ] = 5;
-        precidence_[ tok_or ] = 6;
-        precidence_[ tok_and ] = 7;
-        precidence_[ tok_xor ] = 8;
-        precidence_[ tok_lt ] = 9;
-        precidence_[ tok_gt ] = 9;
-        precidence_[ tok_le ] = 9;
-        precidence_[ tok_ge ] = 9;
-        precidence_[ tok_eq ] = 9;
-        precidence_[ tok_ne ] = 9;
-        precidence_[ tok_shift_left ] = 10;
-        precidence_[ tok_shift_right ] = 10;
-        precidence_[ tok_plus ] = 11;
-        precidence_[ tok_minus ] = 11;
-        precidence_[ tok_star ] = 12;
-        precidence_[ tok_divide ] = 12;
-        precidence_[ tok_mod ] = 12;
-        precidence_[ tok_dot_star ] = 13;
-        precidence_[ tok_arrow_star ] = 13;
-      
-        static short const unary_ops[] = { tok_minus, tok_plus, tok_and, tok_star, tok_not, tok_tilda, tok_plus_plus, tok_minus_minus, -1 };
-        unary_op_ = unary_ops;
+      /// Use a different function to read files.
+      void set_file_loader(file_loader value) {
+        loader = value;
       }
 
-      void begin( const char *source ) {
-        const char *end = source;
-        while( *end ) {
-          end++;
-        }
+      /// Choose "# 10 "file"" (the default) or "#line 10" line markers.
+      void set_marker_style(marker_style value) {
+        markers = value;
+      }
 
-        include_stack_.reset();
-        include_stack_.reserve(32);
-        if_stack_.reset();
-        if_stack_.reserve(32);
-
-        cur_line_ = 0;
-        queue_in_ = queue_out_ = 0;
-        undefined_[ 0 ] = 0;
-      
-        last_file_name_ = 0;
-        last_line_number_ = 1;
-        num_skipped_ = 0;
-      
-        // output( 0x00, 1, "test.c", 0 );
-        // output( 0x00, 1, "<built-in>", 0 );
-        // output( 0x00, 1, "<command line>", 0 );
-        // output( 0x00, 1, "test.c", 0 );
-
-        push_include( source, end, "?", 1 );
-
-        if_.bottom_level_ = true;
-        if_.is_true_ = true;
+      /// Add a directory to look in for #include. Use a trailing /.
+      void add_include_path(const char *path) {
+        include_paths.push_back(new string(path));
+      }
 
-        next_line();
+      /// Add or replace a file held in memory. It is found by name, before any file is read.
+      void add_source(const char *name, const char *text, const char *end = nullptr) {
+        source_file *f = make_file(name);
+        tokenise(f, text, end ? end : text + strlen(text));
       }
-    
-      const char_type *cur_line() {
-        return cur_line_;
+
+      /// Forget the cached files so that they are read again.
+      void flush_files() {
+        for (unsigned i = 0; i != files.get_num_indices(); ++i) {
+          if (files.get_key(i)) delete files.get_value(i);
+        }
+        files.reset();
       }
 
-      const char_type *next_line() {
-        //context_.debug( "%d %d\n", queue_in_, queue_out_ );
-        if( queue_in_ == queue_out_ ) {
-          read_line();
-          //context_.debug( "..%d %d\n", queue_in_, queue_out_ );
-          if( queue_in_ == queue_out_ ) {
-            cur_line_ = 0;
-            return cur_line_;
+      /// Define a macro for every run. value is the text of the macro, eg. define("MAX(a, b)", "((a) > (b) ? (a) : (b))")
+      void define(const char *name, const char *value = "1") {
+        predefine *p = new predefine();
+        unsigned name_len = (unsigned)strlen(name), value_len = (unsigned)strlen(value);
+        p->text.resize(name_len + value_len + 2);
+        memcpy(p->text.data(), name, name_len);
+        p->text[name_len] = ' ';
+        memcpy(p->text.data() + name_len + 1, value, value_len);
+        p->text[name_len + value_len + 1] = '\n';
+        lex_line(p->text.data(), p->text.data() + p->text.size(), p->tokens, false);
+        p->name = p->tokens.size() ? p->tokens[0].name : -1;
+        for (unsigned i = 0; i != predefines.size(); ++i) {
+          if (predefines[i]->name == p->name) {
+            delete predefines[i];
+            predefines[i] = p;
+            return;
           }
         }
+        predefines.push_back(p);
+      }
 
-        // read text queue and output one line at a time
-        queue_entry_type *entry = queue_ + queue_out_;
-
-        //context_.debug( "i %s\n", entry->text_ );
-        if( !entry->text_ ) {
-          // this queue entry is a line number only.
-          format_number( number_line_, entry->line_number_, entry->file_name_, entry->flags_ );
-          cur_line_ = number_line_;
-          last_line_number_ = entry->line_number_;
-          last_file_name_ = entry->file_name_;
-           queue_out_ = ( queue_out_ + 1 ) & ( max_output_queue_ - 1);
-        } else if( last_line_number_ + 10 < entry->line_number_ || last_line_number_ > entry->line_number_ ) {
-          // this queue entry contains text, but output the line number record first.
-          format_number( number_line_, entry->line_number_, entry->file_name_, entry->flags_ );
-          cur_line_ = number_line_;
-          last_line_number_ = entry->line_number_;
-          last_file_name_ = entry->file_name_;
-        } else if( entry->line_number_ != last_line_number_ ) {
-          // this queue entry contains text, but output a blank line to make up the line number
-          number_line_[ 0 ] = 0;
-          cur_line_ = number_line_;
-          last_line_number_++;
-        } else {
-          // this queue entry contains text and the line number is in sync. So output the text.
-          cur_line_ = entry->text_;
-          last_line_number_++;
-           queue_out_ = ( queue_out_ + 1 ) & ( max_output_queue_ - 1);
+      /// Remove a macro defined with define().
+      void undefine(const char *name) {
+        int n = intern(name, (unsigned)strlen(name));
+        for (unsigned i = 0; i != predefines.size(); ++i) {
+          if (predefines[i]->name == n) {
+            delete predefines[i];
+            predefines.erase(i);
+            return;
+          }
+        }
+      }
+
+      /// Preprocess a file with some extra defines like "SKINNED" or "NUM_LIGHTS=4".
+      /// Returns false if there were errors; these go to cpp_log.
+      bool preprocess(string &result, const char *file_name, const char *const *defines = nullptr, unsigned num_defines = 0) {
+        source_file *f = get_file(file_name);
+        if (!f) {
+          cpp_log("error: file %s not found\n", file_name);
+          result = "";
+          return false;
         }
+        bool ok = run_file(f, defines, num_defines);
+        result = out.data();
+        return ok;
+      }
+
+      /// Preprocess a file once for each variant of a define matrix.
+      /// Returns the number of variants without errors.
+      unsigned preprocess_variants(dynarray<string> &results, const char *file_name, const cpp_define_matrix &matrix) {
+        unsigned num_variants = matrix.get_num_variants();
+        results.resize(num_variants);
+        dynarray<const char *> defines;
+        unsigned num_ok = 0;
+        for (unsigned i = 0; i != num_variants; ++i) {
+          matrix.get_variant(defines, i);
+          num_ok += preprocess(results[i], file_name, defines.data(), defines.size());
+        }
+        return num_ok;
+      }
+
+      /// Start preprocessing some text. Read the result a line at a time with cur_line() and next_line().
+      void begin(const char *source) {
+        add_source("?", source);
+        run_file(files["?"], nullptr, 0);
+
+        // split the output into lines
+        out_lines.resize(0);
+        unsigned start = 0;
+        for (unsigned i = 0; i + 1 < out.size(); ++i) {
+          if (out[i] == '\n') {
+            out[i] = 0;
+            out_lines.push_back(start);
+            start = i + 1;
+          }
+        }
+        next_out_line = 0;
+        next_line();
+      }
+
+      const char *cur_line() {
+        return cur_line_;
+      }
+
+      const char *next_line() {
+        cur_line_ = next_out_line < out_lines.size() ? out.data() + out_lines[next_out_line++] : nullptr;
         return cur_line_;
       }
     };
-  
+
+    #if OCTET_UNIT_TEST
+      /// Run some small files held in memory and look for what should and should not be in the output.
+      class cpp_preprocessor_unit_test {
+        static unsigned count(const string &text, const char *str) {
+          unsigned n = 0;
+          for (const char *p = text.c_str(); (p = strstr(p, str)) != nullptr; p += strlen(str)) ++n;
+          return n;
+        }
+
+      public:
+        cpp_preprocessor_unit_test() {
+          cpp_preprocessor pp;
+          pp.set_marker_style(cpp_preprocessor::markers_glsl);
+          pp.add_source("test/guard.h", "#ifndef GUARD_H\n#define GUARD_H\nint guarded;\n#endif\n");
+          pp.add_source("test/once.h", "#pragma once\nint once;\n");
+          pp.add_source("test/main.c",
+            "#include \"guard.h\"\n"
+            "#include \"guard.h\"\n"
+            "#include \"once.h\"\n"
+            "#include \"once.h\"\n"
+            "#define STR(x) #x\n"
+            "#define CAT(a, b) a ## b\n"
+            "#define LOG(fmt, ...) printf(fmt, __VA_ARGS__)\n"
+            "const char *s = STR(hello world);\n"
+            "int CAT(foo, 42);\n"
+            "LOG(\"%d\", 1, 2);\n"
+            "#if (1 + 2) * 3 == 9 && -4 / 2 == -2 && 7 % 4 == 3 && (1 << 4) == 16 && !defined(NOPE)\n"
+            "int arithmetic_ok;\n"
+            "#else\n"
+            "int arithmetic_wrong;\n"
+            "#endif\n"
+            "#if NUM_LIGHTS > 2\n"
+            "int many_lights;\n"
+            "#elif NUM_LIGHTS\n"
+            "int few_lights;\n"
+            "#endif\n"
+          );
+          pp.add_source("test/missing.c", "#include \"nowhere.h\"\nint after;\n");
+
+          string out;
+          const char *many[] = { "NUM_LIGHTS=4" };
+          bool ok = pp.preprocess(out, "test/main.c", many, 1);
+          assert(ok);
+          assert(count(out, "int guarded;") == 1);
+          assert(count(out, "int once;") == 1);
+          assert(count(out, "const char *s = \"hello world\";") == 1);
+          assert(count(out, "int foo42;") == 1);
+          assert(count(out, "printf(\"%d\", 1, 2);") == 1);
+          assert(count(out, "arithmetic_ok") == 1 && count(out, "arithmetic_wrong") == 0);
+          assert(count(out, "many_lights") == 1 && count(out, "few_lights") == 0);
+
+          // the cached tokens are run again with different defines.
+          const char *few[] = { "NUM_LIGHTS=1" };
+          ok = pp.preprocess(out, "test/main.c", few, 1);
+          assert(ok && count(out, "many_lights") == 0 && count(out, "few_lights") == 1);
+          ok = pp.preprocess(out, "test/main.c");
+          assert(ok && count(out, "many_lights") == 0 && count(out, "few_lights") == 0);
+          assert(count(out, "int guarded;") == 1);
+
+          ok = pp.preprocess(out, "test/missing.c");
+          assert(!ok);
+          ok = pp.preprocess(out, "test/no_such_file.c");
+          assert(!ok);
+        }
+      };
+      static cpp_preprocessor_unit_test cpp_preprocessor_unit_test;
+    #endif
+
+    #if OCTET_BENCHMARK
+      /// Variants per second for a shader with two headers, run over an 8 variant cpp_define_matrix,
+      /// with the cached tokens and with the files tokenised again for each set of variants.
+      class cpp_preprocessor_benchmark {
+        enum { num_passes = 2000 };
+
+        static void add_sources(cpp_preprocessor &pp) {
+          pp.add_source("bench/common.h",
+            "#ifndef COMMON_H\n"
+            "#define COMMON_H\n"
+            "#define SATURATE(x) clamp(x, 0.0, 1.0)\n"
+            "#define LERP(a, b, t) ((a) + ((b) - (a)) * (t))\n"
+            "uniform mat4 modelToProjection;\n"
+            "uniform mat4 modelToCamera;\n"
+            "varying vec2 uv_;\n"
+            "varying vec3 normal_;\n"
+            "varying vec3 pos_;\n"
+            "#endif\n"
+          );
+          pp.add_source("bench/lighting.h",
+            "#pragma once\n"
+            "#include \"common.h\"\n"
+            "#ifndef NUM_LIGHTS\n"
+            "  #define NUM_LIGHTS 1\n"
+            "#endif\n"
+            "uniform vec4 light_uniforms[1 + NUM_LIGHTS * 4];\n"
+            "vec3 light(vec3 normal, vec3 pos, vec3 diffuse) {\n"
+            "  vec3 result = light_uniforms[0].xyz * diffuse;\n"
+            "  for (int i = 0; i != NUM_LIGHTS; ++i) {\n"
+            "    vec3 dir = light_uniforms[i * 4 + 1].xyz;\n"
+            "    vec3 colour = light_uniforms[i * 4 + 3].xyz;\n"
+            "    result += SATURATE(dot(normal, dir)) * colour * diffuse;\n"
+            "  }\n"
+            "  return result;\n"
+            "}\n"
+          );
+          pp.add_source("bench/shader.fs",
+            "#include \"common.h\"\n"
+            "#include \"lighting.h\"\n"
+            "#include \"common.h\"\n"
+            "uniform sampler2D diffuse_sampler;\n"
+            "#if defined(FOG) && NUM_LIGHTS > 1\n"
+            "  uniform vec4 fog_colour;\n"
+            "  #define APPLY_FOG(c) LERP(c, fog_colour.xyz, SATURATE(-pos_.z * fog_colour.w))\n"
+            "#else\n"
+            "  #define APPLY_FOG(c) (c)\n"
+            "#endif\n"
+            "void main() {\n"
+            "  vec4 diffuse = texture2D(diffuse_sampler, uv_);\n"
+            "  #ifdef SKINNED\n"
+            "    vec3 normal = normalize(normal_ * 2.0 - 1.0);\n"
+            "  #else\n"
+            "    vec3 normal = normalize(normal_);\n"
+            "  #endif\n"
+            "  vec3 colour = light(normal, pos_, diffuse.xyz);\n"
+            "  gl_FragColor = vec4(APPLY_FOG(colour), diffuse.w);\n"
+            "}\n"
+          );
+        }
+
+      public:
+        cpp_preprocessor_benchmark() {
+          const char *skin[] = { "", "SKINNED" };
+          const char *lights[] = { "NUM_LIGHTS=1", "NUM_LIGHTS=4" };
+          const char *fog[] = { "", "FOG" };
+          cpp_define_matrix matrix;
+          matrix.add_axis(skin, 2);
+          matrix.add_axis(lights, 2);
+          matrix.add_axis(fog, 2);
+          double num_variants = (double)num_passes * matrix.get_num_variants();
+          printf("cpp_preprocessor_benchmark: %d variants, %d passes\n", matrix.get_num_variants(), num_passes);
+
+          cpp_preprocessor pp;
+          pp.set_marker_style(cpp_preprocessor::markers_glsl);
+          dynarray<string> results;
+          unsigned num_ok = 0;
+          {
+            benchmark_timer timer;
+            for (unsigned i = 0; i != num_passes; ++i) {
+              add_sources(pp);
+              num_ok += pp.preprocess_variants(results, "bench/shader.fs", matrix);
+            }
+            timer.report("tokenise + preprocess_variants", num_variants, "variants");
+          }
+
+          {
+            add_sources(pp);
+            benchmark_timer timer;
+            for (unsigned i = 0; i != num_passes; ++i) {
+              num_ok += pp.preprocess_variants(results, "bench/shader.fs", matrix);
+            }
+            timer.report("preprocess_variants, cached tokens", num_variants, "variants");
+          }
+
+          if (num_ok != num_variants * 2) {
+            printf("warning: %d variants failed\n", (int)(num_variants * 2 - num_ok));
+          }
+        }
+      };
+      static cpp_preprocessor_benchmark cpp_preprocessor_benchmark;
+    #endif
   }
 }
-
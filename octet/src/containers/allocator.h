@@ -52,7 +52,8 @@ namespace octet { namespace containers {
   class allocator {
     // singleton state, a bit like an old-world global variable
     struct state_t {
-      size_t num_bytes;
+      std::atomic<size_t> num_bytes; // allocations may come from worker threads
+      std::atomic<size_t> peak_bytes; // high water mark of num_bytes
     };
 
     static state_t &state() {
@@ -60,14 +61,20 @@ namespace octet { namespace containers {
       return instance;
     }
 
+    static void update_peak(size_t bytes) {
+      size_t peak = state().peak_bytes.load(std::memory_order_relaxed);
+      while (bytes > peak && !state().peak_bytes.compare_exchange_weak(peak, bytes, std::memory_order_relaxed)) {
+      }
+    }
+
   public:
     // todo: implement this from scratch using a pool allocator
     static void *malloc(size_t size) {
-      state().num_bytes += size;
+      update_peak(state().num_bytes += size);
       #if OCTET_MAC
         void *res = 0;
         posix_memalign(&res, 16, size);
-      #elif OCTET_SSE
+      #elif OCTET_SSE && defined(WIN32)
         void *res = ::_aligned_malloc(size, 16);
       #elif OCTET_VITA
         void *res = ::memalign(size, 16);
@@ -83,7 +90,7 @@ namespace octet { namespace containers {
       //printf("free %p[%d] -> %d\n", ptr, size, state().num_bytes);
       #if OCTET_MAC
         return ::free(ptr);
-      #elif OCTET_SSE
+      #elif OCTET_SSE && defined(WIN32)
         return ::_aligned_free(ptr);
       #else
         return ::free(ptr);
@@ -91,10 +98,10 @@ namespace octet { namespace containers {
     }
 
     static void *realloc(void *ptr, size_t old_size, size_t size) {
-      state().num_bytes += size - old_size;
+      update_peak(state().num_bytes += size - old_size);
       #if OCTET_MAC
         void *res = ::realloc(ptr, size);
-      #elif OCTET_SSE
+      #elif OCTET_SSE && defined(WIN32)
         void *res = ::_aligned_realloc(ptr, size, 16);
       #else
         void *res = ::realloc(ptr, size);
@@ -103,6 +110,21 @@ namespace octet { namespace containers {
       return res;
     }
 
+    /// bytes allocated at the moment.
+    static size_t get_num_bytes() {
+      return state().num_bytes;
+    }
+
+    /// most bytes allocated at once since the last reset_peak_bytes(). Used by the benchmarks.
+    static size_t get_peak_bytes() {
+      return state().peak_bytes;
+    }
+
+    /// start measuring the peak from the current allocation.
+    static void reset_peak_bytes() {
+      state().peak_bytes = state().num_bytes.load();
+    }
+
     // crude check of stack integrity
     static void test(const char *label) {
       printf("test %s\n", label);
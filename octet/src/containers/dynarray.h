@@ -169,6 +169,13 @@ namespace octet { namespace containers {
 
     /// Get a pointer to the first element of the array.
     item_t *data() { return data_; }
+
+    /// Exchange contents with another array without copying.
+    void swap(dynarray &rhs) {
+      item_t *d = data_; data_ = rhs.data_; rhs.data_ = d;
+      int_size_t s = size_; size_ = rhs.size_; rhs.size_ = s;
+      int_size_t c = capacity_; capacity_ = rhs.capacity_; rhs.capacity_ = c;
+    }
   
     /// Resize the array to make it bigger or smaller.
     void resize(size_t new_length) {
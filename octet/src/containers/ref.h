@@ -30,6 +30,138 @@ namespace octet { namespace containers {
   ///       ...
   ///     } // the mesh object will be freed here.
   
+  /// Reference count for classes that are used with ref<>.
+  ///
+  /// When OCTET_ATOMIC_REFS is set, refs to the same object can be copied and freed on any thread.
+  /// A copied object starts with no lives of its own.
+  class ref_counter {
+    #if OCTET_ATOMIC_REFS
+      std::atomic<int> count;
+    #else
+      int count;
+    #endif
+  public:
+    ref_counter() : count(0) {
+    }
+
+    ref_counter(const ref_counter &) : count(0) {
+    }
+
+    ref_counter &operator=(const ref_counter &) {
+      return *this;
+    }
+
+    /// add a life.
+    void add() {
+      #if OCTET_ATOMIC_REFS
+        count.fetch_add(1, std::memory_order_relaxed);
+      #else
+        count++;
+      #endif
+    }
+
+    /// remove a life; returns true if that was the last one.
+    bool remove() {
+      #if OCTET_ATOMIC_REFS
+        // acquire so that the deleting thread sees every other thread's writes.
+        return count.fetch_sub(1, std::memory_order_acq_rel) == 1;
+      #else
+        return --count == 0;
+      #endif
+    }
+
+    /// number of lives, for debugging.
+    int get() const {
+      return count;
+    }
+  };
+
+  /// Deletes objects on the thread that owns the OpenGL context.
+  ///
+  /// If the last ref to an object goes on a worker thread, the object is queued
+  /// and deleted when the owning thread calls flush(), usually at the end of a frame.
+  /// This means that GL resources are always freed on the GL thread.
+  ///
+  /// Example:
+  ///
+  ///     void release() {
+  ///       if (refs.remove()) deferred_release::destroy(this);
+  ///     }
+  class deferred_release {
+    struct entry {
+      void (*destroy)(void *ptr);
+      void *ptr;
+    };
+
+    struct state_t {
+      std::mutex mutex;
+      std::vector<entry> pending;
+      std::thread::id owner;
+    };
+
+    static state_t &state() {
+      static state_t s;
+      return s;
+    }
+
+    template <class item_t> static void destroy_item(void *ptr) {
+      delete (item_t*)ptr;
+    }
+  public:
+    /// Make this thread the owner. app_common does this for the main thread.
+    /// Until there is an owner, objects are deleted on any thread.
+    static void set_owner_thread() {
+      state().owner = std::this_thread::get_id();
+    }
+
+    /// true if objects are deleted immediately on this thread.
+    static bool on_owner_thread() {
+      std::thread::id owner = state().owner;
+      return owner == std::thread::id() || owner == std::this_thread::get_id();
+    }
+
+    /// delete an object now or, on a worker thread, at the next flush().
+    template <class item_t> static void destroy(item_t *item) {
+      #if OCTET_ATOMIC_REFS
+        if (!on_owner_thread()) {
+          state_t &s = state();
+          std::lock_guard<std::mutex> lock(s.mutex);
+          entry e = { &destroy_item<item_t>, (void*)item };
+          s.pending.push_back(e);
+          return;
+        }
+      #endif
+      delete item;
+    }
+
+    /// number of objects waiting for flush().
+    static size_t get_num_pending() {
+      state_t &s = state();
+      std::lock_guard<std::mutex> lock(s.mutex);
+      return s.pending.size();
+    }
+
+    /// delete the queued objects. Call this on the owner thread.
+    static void flush() {
+      #if OCTET_ATOMIC_REFS
+        state_t &s = state();
+        std::vector<entry> work;
+        for (;;) {
+          {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            if (s.pending.empty()) break;
+            work.swap(s.pending);
+          }
+          // destructors may release other objects, so delete outside the lock.
+          for (size_t i = 0; i != work.size(); ++i) {
+            work[i].destroy(work[i].ptr);
+          }
+          work.clear();
+        }
+      #endif
+    }
+  };
+
   template <class item_t, class allocator_t=allocator> class ref {
     // wrapped pointer to the object
     item_t *item;
@@ -90,4 +222,99 @@ namespace octet { namespace containers {
       item = 0;
     }
   };
+
+  #if OCTET_UNIT_TEST
+    class ref_unit_test {
+      struct counted {
+        ref_counter refs;
+        std::atomic<int> *deletes;
+        counted(std::atomic<int> *deletes) : deletes(deletes) {}
+        ~counted() { (*deletes)++; }
+        void add_ref() { refs.add(); }
+        void release() { if (refs.remove()) deferred_release::destroy(this); }
+      };
+    public:
+      ref_unit_test() {
+        deferred_release::set_owner_thread();
+        std::atomic<int> deletes(0);
+        ref<counted> shared = new counted(&deletes);
+        counted *last = new counted(&deletes);
+        last->add_ref();
+
+        // many threads copying and dropping the same refs.
+        std::vector<std::thread> threads;
+        for (int t = 0; t != 4; ++t) {
+          threads.push_back(std::thread([&shared]() {
+            for (int i = 0; i != 100000; ++i) {
+              ref<counted> a = shared;
+              ref<counted> b;
+              b = a;
+            }
+          }));
+        }
+        for (size_t t = 0; t != threads.size(); ++t) threads[t].join();
+        assert(shared->refs.get() == 1);
+        assert(deletes == 0);
+
+        // the last ref goes on a worker, so the delete waits for flush().
+        std::thread([last]() { last->release(); }).join();
+        assert(deletes == (OCTET_ATOMIC_REFS ? 0 : 1));
+        deferred_release::flush();
+        assert(deletes == 1);
+
+        shared = (counted*)0;
+        assert(deletes == 2);
+      }
+    };
+    static ref_unit_test ref_unit_test;
+  #endif
+
+  #if OCTET_BENCHMARK
+    /// Cost of copying a ref over another ref to the same object: one add_ref/release pair.
+    /// Build with -D OCTET_ATOMIC_REFS=0 as well to compare the atomic and plain counts.
+    class ref_benchmark {
+      struct counted {
+        ref_counter refs;
+        void add_ref() { refs.add(); }
+        void release() { if (refs.remove()) delete this; }
+      };
+
+      enum { num_copies = 10000000, num_threads = 4 };
+
+      static void copy_refs(ref<counted> &shared, int n) {
+        ref<counted> copies[8];
+        for (int i = 0; i != n; ++i) {
+          copies[i & 7] = shared;
+        }
+      }
+
+    public:
+      ref_benchmark() {
+        printf("ref_benchmark: OCTET_ATOMIC_REFS=%d, %d copies\n", OCTET_ATOMIC_REFS, num_copies);
+        ref<counted> shared = new counted();
+        {
+          benchmark_timer timer;
+          copy_refs(shared, num_copies);
+          timer.report("ref copy, one thread", num_copies, "copies");
+        }
+
+        // every thread changes the same count. Plain counts would lose changes.
+        #if OCTET_ATOMIC_REFS
+          {
+            benchmark_timer timer;
+            std::vector<std::thread> threads;
+            for (int t = 0; t != num_threads; ++t) {
+              threads.push_back(std::thread([&shared]() { copy_refs(shared, num_copies / num_threads); }));
+            }
+            for (size_t t = 0; t != threads.size(); ++t) threads[t].join();
+            timer.report("ref copy, four threads", num_copies, "copies");
+          }
+        #endif
+        if (shared->refs.get() != 1) {
+          printf("warning: %d refs left\n", shared->refs.get());
+        }
+      }
+    };
+    static ref_benchmark ref_benchmark;
+  #endif
 } }
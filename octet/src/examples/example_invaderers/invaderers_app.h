@@ -28,8 +28,8 @@ namespace octet {
 		// half the height of the sprite
 		float halfHeight;
 
-		// what texture is on our sprite
-		int texture;
+		// where our sprite's image is in the atlas
+		texture_atlas::region texture;
 
 		// true if this sprite is enabled.
 		bool enabled;
@@ -38,7 +38,7 @@ namespace octet {
 		float angle = 0;
 
 		sprite() {
-			texture = 0;
+			texture.texture = 0;
 			enabled = true;
 		}
 
@@ -46,7 +46,11 @@ namespace octet {
 			return modelToWorld.row(3).xy();
 		}
 
-		void init(int _texture, float x, float y, float w, float h) {
+		vec2 get_half_size() const {
+			return vec2(halfWidth, halfHeight);
+		}
+
+		void init(const texture_atlas::region &_texture, float x, float y, float w, float h) {
 			modelToWorld.loadIdentity();
 			modelToWorld.translate(x, y, 0);
 			halfWidth = w * 0.5f;
@@ -55,60 +59,21 @@ namespace octet {
 			enabled = true;
 		}
 
-		void swap_texture(int _texture) {
+		void swap_texture(const texture_atlas::region &_texture) {
 			texture = _texture;
 		}
 
-		void render(texture_shader &shader, mat4t &cameraToWorld) {
+		// add the sprite to the batch, which draws all the sprites together.
+		void render(sprite_batch &batch) {
 			// invisible sprite... used for gameplay.
-			if (!texture) return;
-
-			// build a projection matrix: model -> world -> camera -> projection
-			// the projection space is the cube -1 <= x/w, y/w, z/w <= 1
-			mat4t modelToProjection = mat4t::build_projection_matrix(modelToWorld, cameraToWorld);
-
-			// set up opengl to draw textured triangles using sampler 0 (GL_TEXTURE0)
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, texture);
+			if (!texture.texture) return;
 
-			// use "old skool" rendering
-			//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
-			//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-			shader.render(modelToProjection, 0);
-
-			// this is an array of the positions of the corners of the sprite in 3D
-			// a straight "float" here means this array is being generated here at runtime.
-			float vertices[] = {
-			  -halfWidth, -halfHeight, 0,
-			   halfWidth, -halfHeight, 0,
-			   halfWidth,  halfHeight, 0,
-			  -halfWidth,  halfHeight, 0,
-			};
-
-			// attribute_pos (=0) is position of each corner
-			// each corner has 3 floats (x, y, z)
-			// there is no gap between the 3 floats and hence the stride is 3*sizeof(float)
-			glVertexAttribPointer(attribute_pos, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)vertices);
-			glEnableVertexAttribArray(attribute_pos);
-
-			// this is an array of the positions of the corners of the texture in 2D
-			static const float uvs[] = {
-			   0,  0,
-			   1,  0,
-			   1,  1,
-			   0,  1,
-			};
-
-			// attribute_uv is position in the texture of each corner
-			// each corner (vertex) has 2 floats (x, y)
-			// there is no gap between the 2 floats and hence the stride is 2*sizeof(float)
-			glVertexAttribPointer(attribute_uv, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)uvs);
-			glEnableVertexAttribArray(attribute_uv);
-
-			// finally, draw the sprite (4 vertices)
-			glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+			// the batch wants a position and an angle rather than a matrix.
+			vec2 pos = modelToWorld.row(3).xy();
+			float angle = atan2f(modelToWorld[0][1], modelToWorld[0][0]) * (180.0f / 3.14159265f);
+			batch.add(texture, pos.x(), pos.y(), halfWidth * 2, halfHeight * 2, angle);
 		}
-	
+
 		//Use Emanuel Shader
 		void render(emanuel_shader &shader, mat4t &cameraToWorld, int v_width, int v_height) {
 			mat4t modelToProjection = mat4t::build_projection_matrix(modelToWorld, cameraToWorld);
@@ -194,6 +159,11 @@ namespace octet {
 
 	  // shader to draw a textured triangle
 	  texture_shader texture_shader_;
+
+	  // the sprite images share one texture, so the batch draws every sprite with one call.
+	  texture_atlas atlas;
+	  sprite_batch batch;
+	  texture_atlas::region invaderer_texture;
 	  emanuel_shader emanuel_shader_;
 
 	  enum {
@@ -247,6 +217,10 @@ namespace octet {
 	  // big array of sprites
 	  sprite sprites[num_sprites];
 	  dynarray<sprite> inv_sprites;
+
+	  // live invaderers, so missiles and borders only test the ones nearby.
+	  // the handles are the same as the indices in inv_sprites.
+	  broadphase_2d inv_grid;
 	  sprite background_sprite;
 
 	  // random number generator
@@ -258,6 +232,13 @@ namespace octet {
 	  // information for our text
 	  bitmap_font font;
 
+	  // vertices for the last text we drew; only rebuilt when the text changes
+	  enum { max_text_quads = 32 };
+	  bitmap_font::vertex text_vertices[max_text_quads*4];
+	  uint32_t text_indices[max_text_quads*6];
+	  unsigned text_quads = 0;
+	  string drawn_text;
+
 	  // stores current level
 	  int current_level = 0;
 	  static const int MAX_NR_LVL = 2;
@@ -272,8 +253,7 @@ namespace octet {
 
 	  // missile power ups
 	  int powerup_sprite_no = 0;
-	  GLint powerup_texture[3] = {
-	  };
+	  texture_atlas::region powerup_texture[3];
 
 	  // missile x and y trajectorys
 	  int missile_y = 5;
@@ -295,12 +275,6 @@ namespace octet {
 	  }
 
 	  void update_powerups() {
-		  GLuint missile = resource_dict::get_texture_handle(GL_RGBA, "assets/invaderers/missile.gif");
-		  GLuint second_powerup = resource_dict::get_texture_handle(GL_RGBA, "assets/invaderers/powerup_02.gif");
-		  GLuint first_powerup = resource_dict::get_texture_handle(GL_RGBA, "assets/invaderers/powerup_01.gif");
-		  powerup_texture[0] = missile;
-		  powerup_texture[1] = first_powerup;
-		  powerup_texture[2] = second_powerup;
 		  for (int i = 0; i != num_missiles; ++i) {
 			  // create missiles off-screen
 			  //  sprites[first_missile_sprite + i].swap_texture(first_powerup);
@@ -511,21 +485,23 @@ namespace octet {
         if (missile.is_enabled()) {								                  // if missile object is enabled
           missile.translate(xangle, missile_speed);				                  // move the missile in the angle defined by xangle, and to the speed defined by missile_speed
 		  missile.rotateZ(sprites[first_missile_sprite + i].angle);				  // with the rotation in the z defined by missile_rotation
-          for (int j = 0; j != inv_sprites.size(); ++j) {				          //when there are still invaderers enabled
-            sprite &invaderer = inv_sprites[j];		                              // define a sprite object and assign the invaderers sprite to it 
-            if (invaderer.is_enabled() && missile.collides_with(invaderer)) {     // if invaderer is alive and missile collides
-              invaderer.is_enabled() = false;                                     // turn off / kill invaderer
+          vec2 pos = missile.getxy(), half = missile.get_half_size();
+          int hit = -1;
+          inv_grid.query(pos.x(), pos.y(), half.x(), half.y(), ~0u, [&](int j) { hit = j; return true; });
+          if (hit != -1) {                                                        // if a live invaderer is hit by the missile
+            sprite &invaderer = inv_sprites[hit];
+            invaderer.is_enabled() = false;                                     // turn off / kill invaderer
+            inv_grid.remove(hit);
 			  sprites[explosion_sprite].set_relative(invaderer, 0, 0);            // move explosion sprite relative to invaderer
 			  active = true;                                                      // turn on explosion frame counting switch
 
-              invaderer.translate(20, 0);
-              missile.is_enabled() = false;
+            invaderer.translate(20, 0);
+            missile.is_enabled() = false;
 
-              missile.translate(20, 0);
-              on_hit_invaderer();
+            missile.translate(20, 0);
+            on_hit_invaderer();
 
-              goto next_missile;
-            }
+            goto next_missile;
           }
 
           if (missile.collides_with(sprites[first_border_sprite+1]) || missile.collides_with(sprites[first_border_sprite + 2]) || missile.collides_with(sprites[first_border_sprite + 3])) {
@@ -567,19 +543,16 @@ namespace octet {
         sprite &invaderer = inv_sprites[j];
         if (invaderer.is_enabled()) {
           invaderer.translate(dx, dy);
+          vec2 pos = invaderer.getxy();
+          inv_grid.move(j, pos.x(), pos.y());
         }
       }
     }
 
     // check if any invaders hit the sides.
     bool invaders_collide(sprite &border) {
-      for (int j = 0; j != inv_sprites.size(); ++j) {
-        sprite &invaderer = inv_sprites[j];
-        if (invaderer.is_enabled() && invaderer.collides_with(border)) {
-          return true;
-        }
-      }
-      return false;
+      vec2 pos = border.getxy(), half = border.get_half_size();
+      return inv_grid.query(pos.x(), pos.y(), half.x(), half.y(), ~0u, [](int j) { return true; });
     }
 
 
@@ -597,23 +570,22 @@ namespace octet {
       glScalef(scale, scale, 1);
       glGetFloatv(GL_MODELVIEW_MATRIX, (float*)&tmp);*/
 
-      enum { max_quads = 32 };
-      bitmap_font::vertex vertices[max_quads*4];
-      uint32_t indices[max_quads*6];
-      aabb bb(vec3(0, 0, 0), vec3(256, 256, 0));
-
-      unsigned num_quads = font.build_mesh(bb, vertices, indices, max_quads, text, 0);
+      if (strcmp(drawn_text.c_str(), text)) {
+        aabb bb(vec3(0, 0, 0), vec3(256, 256, 0));
+        text_quads = font.build_mesh(bb, text_vertices, text_indices, max_text_quads, text, 0);
+        drawn_text = text;
+      }
       glActiveTexture(GL_TEXTURE0);
       glBindTexture(GL_TEXTURE_2D, font_texture);
 
       shader.render(modelToProjection, 0);
 
-      glVertexAttribPointer(attribute_pos, 3, GL_FLOAT, GL_FALSE, sizeof(bitmap_font::vertex), (void*)&vertices[0].x );
+      glVertexAttribPointer(attribute_pos, 3, GL_FLOAT, GL_FALSE, sizeof(bitmap_font::vertex), (void*)&text_vertices[0].x );
       glEnableVertexAttribArray(attribute_pos);
-      glVertexAttribPointer(attribute_uv, 3, GL_FLOAT, GL_FALSE, sizeof(bitmap_font::vertex), (void*)&vertices[0].u );
+      glVertexAttribPointer(attribute_uv, 3, GL_FLOAT, GL_FALSE, sizeof(bitmap_font::vertex), (void*)&text_vertices[0].u );
       glEnableVertexAttribArray(attribute_uv);
 
-      glDrawElements(GL_TRIANGLES, num_quads * 6, GL_UNSIGNED_INT, indices);
+      glDrawElements(GL_TRIANGLES, text_quads * 6, GL_UNSIGNED_INT, text_indices);
     }
 
   public:
@@ -627,6 +599,7 @@ namespace octet {
       // set up the shader
       texture_shader_.init();
 	  emanuel_shader_.init();
+      batch.init();
 
       // set up the matrices with a camera 5 units from the origin
       cameraToWorld.loadIdentity();
@@ -635,18 +608,33 @@ namespace octet {
       font_texture = resource_dict::get_texture_handle(GL_RGBA, "assets/big_0.gif");
 
 
-      GLuint ship = resource_dict::get_texture_handle(GL_RGBA, "assets/invaderers/ship.gif");
-      sprites[ship_sprite].init(ship, 0, -2.75f, 0.25f, 0.25f);
+      // pack all the sprite images into the atlas
+      static const uint8_t white_pixel[] = { 0xff, 0xff, 0xff, 0xff };
+      int ship_image = atlas.add("assets/invaderers/ship.gif");
+      int explosion_image = atlas.add("assets/invaderers/explosion.gif");
+      int game_over_image = atlas.add("assets/invaderers/GameOver.gif");
+      int white_image = atlas.add(white_pixel, 1, 1);
+      int bomb_image = atlas.add("assets/invaderers/bomb.gif");
+      int missile_image = atlas.add("assets/invaderers/missile.gif");
+      int first_powerup_image = atlas.add("assets/invaderers/powerup_01.gif");
+      int second_powerup_image = atlas.add("assets/invaderers/powerup_02.gif");
+      int invaderer_image = atlas.add("assets/invaderers/invaderer.gif");
+      atlas.build();
+
+      powerup_texture[0] = atlas.get_region(missile_image);
+      powerup_texture[1] = atlas.get_region(first_powerup_image);
+      powerup_texture[2] = atlas.get_region(second_powerup_image);
+      invaderer_texture = atlas.get_region(invaderer_image);
 
-	  GLuint explosion = resource_dict::get_texture_handle(GL_RGBA, "assets/invaderers/explosion.gif");
-	  sprites[explosion_sprite].init(explosion, -1000, -1000, 0.25f, 0.25f);
+      sprites[ship_sprite].init(atlas.get_region(ship_image), 0, -2.75f, 0.25f, 0.25f);
 
-      GLuint GameOver = resource_dict::get_texture_handle(GL_RGBA, "assets/invaderers/GameOver.gif");
-      sprites[game_over_sprite].init(GameOver, 20, 0, 3, 1.5f);
+	  sprites[explosion_sprite].init(atlas.get_region(explosion_image), -1000, -1000, 0.25f, 0.25f);
+
+      sprites[game_over_sprite].init(atlas.get_region(game_over_image), 20, 0, 3, 1.5f);
 
 
       // set the border to white for clarity
-      GLuint white = resource_dict::get_texture_handle(GL_RGB, "#ffffff");
+      const texture_atlas::region &white = atlas.get_region(white_image);
       sprites[first_border_sprite+0].init(white, 0, -3, 6, 0.2f);
       sprites[first_border_sprite+1].init(white, 0,  3, 6, 0.2f);
       sprites[first_border_sprite+2].init(white, -3, 0, 0.2f, 6);
@@ -655,7 +643,7 @@ namespace octet {
 	
 
       // use the bomb texture
-      GLuint bomb = resource_dict::get_texture_handle(GL_RGBA, "assets/invaderers/bomb.gif");
+      const texture_atlas::region &bomb = atlas.get_region(bomb_image);
       for (int i = 0; i != num_bombs; ++i) {
         // create bombs off-screen
         sprites[first_bomb_sprite+i].init(bomb, 20, 0, 0.0625f, 0.25f);
@@ -663,7 +651,7 @@ namespace octet {
       }
 
 	  // use the missile texture
-	  GLuint missile = resource_dict::get_texture_handle(GL_RGBA, "assets/invaderers/missile.gif");         // create missile sprite from texture library and name it missile
+	  const texture_atlas::region &missile = powerup_texture[0];                                           // the missile image from the atlas
 	  if (powerup_sprite_no == 0) {
 		  for (int i = 0; i != num_missiles; ++i) {																// if th counter does not equal the amount of allowed missiles	
 			  // create missiles off-screen
@@ -751,15 +739,21 @@ namespace octet {
 	  background_sprite.render(emanuel_shader_, cameraToWorld, w, h);
 
 	  // new draw sprites
+	  batch.begin();
 	  for (int i = 0; i < inv_sprites.size(); ++i) {
-		  inv_sprites[i].render(texture_shader_, cameraToWorld);
+		  inv_sprites[i].render(batch);
 	  }
 
       // draw all andy's sprites
       for (int i = 0; i != num_sprites; ++i) {
-        sprites[i].render(texture_shader_, cameraToWorld);
+        sprites[i].render(batch);
       }
 
+      // the sprites are in world space.
+      mat4t worldToWorld;
+      worldToWorld.loadIdentity();
+      batch.render(mat4t::build_projection_matrix(worldToWorld, cameraToWorld));
+
       char score_text[32];
       sprintf(score_text, "score: %d   lives: %d", score, num_lives);
       draw_text(texture_shader_, -1.75f, 2, 1.0f/256, score_text);
@@ -817,12 +811,14 @@ namespace octet {
 		// display invaderer formation
 		read_file();
 		inv_sprites.resize(0);
+		inv_grid.init(-3.5f, -3.5f, 3.5f, 3.5f, 0.5f);
 
-		GLuint invaderer = resource_dict::get_texture_handle(GL_RGBA, "assets/invaderers/invaderer.gif");
 		for (int i = 0; i < inv_formation.size(); ++i) {
 			sprite inv;
-			inv.init(invaderer, -1.5f + 0.66f*inv_formation[i].x, 2 - 0.5f*inv_formation[i].y, 0.25f, 0.25f);
+			inv.init(invaderer_texture, -1.5f + 0.66f*inv_formation[i].x, 2 - 0.5f*inv_formation[i].y, 0.25f, 0.25f);
 			inv_sprites.push_back(inv);
+			vec2 pos = inv.getxy(), half = inv.get_half_size();
+			inv_grid.add(pos.x(), pos.y(), half.x(), half.y());
 		}
 	}
   };
@@ -5,227 +5,114 @@
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
 namespace octet {
-  template <int _Len> float atof(const char (&x)[_Len]) {
-    char tmp[_Len+1];
-    memcpy(tmp, x, _Len);
-    tmp[_Len] = 0;
-    return (float)std::atof(x);
-  }
-
-  /// Scene containing a box with octet.
+  /// Scene containing a molecule drawn as ray traced spheres.
+  ///
+  /// The atoms are loaded with pdb_decoder and sorted into a sphere_bvh.
+  /// The tree and the atoms are stored in float textures and the fragment shader
+  /// traces a ray through the tree for every pixel of a box around the molecule.
+  /// Run with the name of a .pdb, .ent or .cif file to load another molecule.
   class example_molecule : public app {
     // scene for drawing box
     ref<visual_scene> app_scene;
 
-    class molecule : public resource {
-      aabb bbox;
-      std::vector<vec4> pos;
-      std::vector<vec4> bvh;
-    public:
-      molecule(const char *begin, const char *end) {
-        vec3 min, max;
-        bool first = true;
-        for (const char *p = begin; p != end; ) {
-          const char *b = p;
-          while (p != end && *p != '\n') ++p;
-          if (!memcmp(b, "ATOM  ", 6)) {
-            // example: ATOM      1  CA  THR A   5      24.188 -18.763  55.368  1.00 46.05           C  
-            struct fmt {
-              char Record[6-1+1];         //1 - 6 Record name "ATOM "
-              char serial[11-7+1];        //7 - 11 Integer serial Atom serial number.
-              char pad12;
-              char atomname[16-13+1];    //13 - 16 Atom name Atom name.
-              char altloc[17-17+1];      //17 Character altLoc Alternate location indicator.
-              char resname[20-18+1];     //18 - 20 Residue name resName Residue name.
-              char pad21;
-              char chainID[22-22+1];     //22 Character chainID Chain identifier.
-              char resSeq[26-23+1];      //23 - 26 Integer resSeq Residue sequence number.
-              char AChar[27-27+1];       //27 AChar iCode Code for insertion of residues.
-              char pad28_30[30-28+1];
-              char x[38-31+1];           //31 - 38 Real(8.3) x Orthogonal coordinates for X in Angstroms.
-              char y[46-39+1];           //39 - 46 Real(8.3) y Orthogonal coordinates for Y in Angstroms.
-              char z[54-47+1];           //47 - 54 Real(8.3) z Orthogonal coordinates for Z in Angstroms.
-              char occupancy[60-55+1];   //55 - 60 Real(6.2) occupancy Occupancy.
-              char tempFactor[60-55+1];  //61 - 66 Real(6.2) tempFactor Temperature factor.
-              char pad67[76-67+1];
-              char element[78-77+1];     //77 - 78 LString(2) element Element symbol, right-justified.
-              char charge[80-79+1];      //79 - 80 LString(2) charge Charge on the atom.
-            };
-
-            static const struct { char name[3]; uint32_t colour; } colours[] = {
-              {" H", 0xcccccc}, {" C", 0xaaaaaa}, {" O", 0xcc0000}, {" N", 0x0000cc}, {" S", 0xcccc00},
-              {" P", 0x6622cc}, {" F", 0x00cc00}, {"CL", 0x00cc00}, {"BR", 0x882200}, {" I", 0x6600aa},
-              {"FE", 0xcc6600}, {"CA", 0x8888aa}, {"", 0}
-            };
-
-            // Reference: glMol / A. Bondi, J. Phys. Chem., 1964, 68, 441.
-            static const struct { char name[3]; float radius; } radii[] = {
-              {" H", 1.2f}, {"LI", 1.82f}, {"NA", 2.27f}, {" K", 2.75f}, {" C", 1.7f}, {" N", 1.55f}, {" O", 1.52f},
-              {" F", 1.47f}, {" P", 1.80f}, {" S", 1.80f}, {"CL", 1.75f}, {"BR", 1.85f}, {"SE", 1.90f},
-              {"ZN", 1.39f}, {"CU", 1.4f}, {"NI", 1.63f}
-            };
-
-            const fmt *f = (const fmt*)b;
-            float x = atof(f->x);
-            float y = atof(f->y);
-            float z = atof(f->z);
-            vec3 p(x, y, z);
-            if (first) {
-              min = max = p;
-              first = false;
-            } else {
-              min = math::min(min, p);
-              max = math::max(max, p);
-            }
-            vec4 colour(0.5f, 0.5f, 0.5f, 1.0f);
-            for (auto c : colours) {
-              if (c.name[0] == f->element[0] && c.name[1] == f->element[1]) {
-                colour = vec4((c.colour >> 16) * (1.0f/255), ((c.colour >> 8) & 0xff) * (1.0f/255), (c.colour & 0xff) * (1.0f/255), 1.0f);
-                break;
-              }
-            }
-            float radius = 1.0f;
-            for (auto r : radii) {
-              if (r.name[0] == f->element[0] && r.name[1] == f->element[1]) {
-                radius = r.radius;
-                break;
-              }
-            }
-            pos.emplace_back(x, y, z, radius);
-            //pos.emplace_back(colour);
-          }
-          if (p != end) ++p;
-        }
-        bbox = aabb((min+max)*0.5f, (max-min)*0.5f);
-        std::cout << min << "\n";
-        std::cout << max << "\n";
-        std::cout << (int)pos.size() << "\n";
-
-        typedef std::vector<vec4>::iterator it;
-        struct stack_t {
-          it begin;
-          it end;
-          int level;
-          stack_t(it begin, it end, int level) : begin(begin), end(end), level(level) {}
-        };
-        std::deque<stack_t> stack;
-
-        pos.resize(1024+64);
-        int pos_size = (int)pos.size();
-        it start = pos.begin();
-
-        int lg_pos_size = 1;
-        while (1<<(lg_pos_size+1) < pos_size) ++lg_pos_size;
-
-        stack.emplace_back(pos.begin(), pos.end(), 0);
-        while (!stack.empty()) {
-          it begin = stack.back().begin;
-          it end = stack.back().end;
-          int level = stack.back().level;
-          stack.pop_back();
-          aabb bb(begin, end);
-
-          vec3 ha = bb.get_half_extent();
-          vec3 cen = bb.get_center();
-          float r = 0;
-          std::for_each(begin, end, [&r, cen](vec4_in a) { r = std::max(r, math::length(a.xyz() - cen) + a.w()); } );
-
-          bvh.emplace_back(bb.get_center(), r);
-          //fred << bvh.size() << " " << bb.get_min() << " " << bb.get_max() << " " << bvh.back() << " " << end-begin << "\n";
-          char tmp[256];
-          log("%d %s %d\n", (int)bvh.size(), bvh.back().toString(tmp, sizeof(tmp)), end-begin);
-          fflush(log(""));
-
-          if (begin+1 != end) {
-            // sort by the longest dimension.
-            if (ha.x() >= ha.y() && ha.x() >= ha.z()) {
-              std::sort(begin, end, [](vec4_in a, vec4_in b) {return a.x() < b.x();});
-            } else if(ha.y() >= ha.x() && ha.y() >= ha.z()) {
-              std::sort(begin, end, [](vec4_in a, vec4_in b) {return a.y() < b.y();});
-            } else {
-              std::sort(begin, end, [](vec4_in a, vec4_in b) {return a.z() < b.z();});
-            }
-
-            if (level <= lg_pos_size) {
-              // split the atoms into equal sized groups
-              //size_t mid = end - begin == 2 ? 1 : end - begin == 3 ? 2 : (end - begin + 3)/2 & ~1;
-              ptrdiff_t mid = std::min((ptrdiff_t)1 << (lg_pos_size - level), end - begin);
-              if (mid >= 1) {
-                stack.emplace_front(begin, begin + mid, level+1);
-              }
-
-              if (end - (begin + mid) >= 1) {
-                stack.emplace_front(begin + mid, end, level+1);
-              }
-            }
-          }
-        }
-      }
-
-      const std::vector<vec4> &get_pos() const {
-        return pos;
-      }
-
-      const std::vector<vec4> &get_bvh() const {
-        return bvh;
-      }
-
-      // get all spheres in this radius
-      template <class _OutIt> void query(_OutIt dest, vec3_in centre, float radius) {
-        /*int stack[32];
-        int stack_in = 0;
-        int stack_out = 0;
-        stack[stack_in++] = 0;
-        while (stack_out != stack_in) {
-          int i = stack[stack_out++];
-          if (squared(bvh[i].xyz() - centre) <= squared(radius + bvh[i].w)) {
-            //stack[stack_in++] = 
-            //stack[stack_in++] = 
-          }
-        }
-        */
-      }
-    };
-
-    ref<material> custom_mat;
-
-    ref<param_uniform> camera_pos;
-    ref<param_uniform> spheres;
-    ref<param_uniform> num_spheres;
+    ref<material> custom_mat;
+    ref<param_uniform> camera_pos;
+    ref<param_uniform> bvh_size;
+    ref<scene_node> box_node;
+
+    // textures are this wide.
+    enum { texture_width = 2048 };
+
+    const char *url;
+
+    // make a texture_width wide texture from count texels.
+    static image *make_texture(GLint internal_format, GLenum type, const void *data, unsigned texel_size, unsigned count, unsigned &height) {
+      height = std::max(1u, (count + texture_width - 1) / texture_width);
+      dynarray<uint8_t> padded(texture_width * height * texel_size);
+      memset(padded.data(), 0, padded.size());
+      memcpy(padded.data(), data, count * texel_size);
+
+      GLuint texture = 0;
+      glGenTextures(1, &texture);
+      glBindTexture(GL_TEXTURE_2D, texture);
+      glTexImage2D(GL_TEXTURE_2D, 0, internal_format, texture_width, height, 0, GL_RGBA, type, padded.data());
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      return new image(GL_TEXTURE_2D, texture, texture_width, height);
+    }
 
-    ref<molecule> mol;
   public:
     /// this is called when we construct the class before everything is initialised.
     example_molecule(int argc, char **argv) : app(argc, argv) {
+      url = argc > 1 ? argv[1] : "assets/molecules/pdb1fha.ent";
     }
 
     /// this is called once OpenGL is initialized
     void app_init() {
       app_scene =  new visual_scene();
       app_scene->create_default_camera_and_lights();
-      app_scene->get_camera_instance(0)->get_node()->translate(vec3(0, 0, 50));
-      app_scene->get_camera_instance(0)->set_far_plane(400);
-      app_scene->get_camera_instance(0)->set_near_plane(0.1f);
 
       dynarray<uint8_t> buf;
-      app_utils::get_url(buf, "assets/pdb1fha.ent");
-      mol = new molecule((const char*)buf.data(), (const char*)buf.data() + buf.size());
+      app_utils::get_url(buf, url);
+
+      // ferritin is a 24-mer: the BIOMT transforms make the whole shell.
+      pdb_decoder dec;
+      dec.decode((const char*)buf.data(), (const char*)buf.data() + buf.size(), true);
+      const dynarray<vec4> &atoms = dec.get_atoms();
+      if (atoms.size() == 0) {
+        printf("no atoms in %s\n", url);
+        return;
+      }
+
+      sphere_bvh bvh;
+      bvh.build(atoms.data(), atoms.size());
+      const dynarray<vec4> &nodes = bvh.get_nodes();
+      const dynarray<vec4> &spheres = bvh.get_spheres();
+      const dynarray<unsigned> &order = bvh.get_order();
+
+      // atom colours in tree order
+      dynarray<uint32_t> colours(spheres.size());
+      for (unsigned i = 0; i != spheres.size(); ++i) {
+        uint32_t c = pdb_decoder::get_element_colour(dec.get_elements()[order[i]]);
+        colours[i] = 0xff000000 | (c & 0xff) << 16 | (c & 0xff00) | (c >> 16 & 0xff);
+      }
+
+      unsigned node_height = 0, atom_height = 0;
+      image *nodes_image = make_texture(GL_RGBA32F, GL_FLOAT, nodes.data(), sizeof(vec4), nodes.size(), node_height);
+      image *atoms_image = make_texture(GL_RGBA32F, GL_FLOAT, spheres.data(), sizeof(vec4), spheres.size(), atom_height);
+      image *colours_image = make_texture(GL_RGBA, GL_UNSIGNED_BYTE, colours.data(), sizeof(uint32_t), colours.size(), atom_height);
 
       param_shader *shader = new param_shader("shaders/default.vs", "shaders/raycast_molecule.fs");
       custom_mat = new material(vec4(1, 1, 1, 1), shader);
-      atom_t atom_camera_pos = app_utils::get_atom("camera_pos");
-      atom_t atom_spheres = app_utils::get_atom("spheres");
-      atom_t atom_num_spheres = app_utils::get_atom("num_spheres");
-      camera_pos = custom_mat->add_uniform(nullptr, atom_camera_pos, GL_FLOAT_VEC3, 1, param::stage_fragment);
-      spheres = custom_mat->add_uniform(nullptr, atom_spheres, GL_FLOAT_VEC4, 200, param::stage_fragment);
-      num_spheres = custom_mat->add_uniform(nullptr, atom_num_spheres, GL_INT, 1, param::stage_fragment);
+      // a sampler holds the texture it was first used with, so each image needs its own.
+      custom_mat->add_sampler(0, app_utils::get_atom("nodes"), nodes_image, new sampler(GL_NEAREST, GL_NEAREST, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE));
+      custom_mat->add_sampler(1, app_utils::get_atom("atoms"), atoms_image, new sampler(GL_NEAREST, GL_NEAREST, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE));
+      custom_mat->add_sampler(2, app_utils::get_atom("colours"), colours_image, new sampler(GL_NEAREST, GL_NEAREST, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE));
+      camera_pos = custom_mat->add_uniform(nullptr, app_utils::get_atom("camera_pos"), GL_FLOAT_VEC3, 1, param::stage_fragment);
+      vec4 size((float)bvh.get_num_nodes(), 1.0f / texture_width, 1.0f / node_height, 1.0f / atom_height);
+      bvh_size = custom_mat->add_uniform(&size, app_utils::get_atom("bvh_size"), GL_FLOAT_VEC4, 1, param::stage_fragment);
 
-      mesh_box *box = new mesh_box(vec3(20));
-      scene_node *node = new scene_node();
-      app_scene->add_child(node);
-      //app_scene->add_mesh_instance(new mesh_instance(node, box, custom_mat));
+      // the root node is the bounding box of the molecule.
+      vec3 lo = nodes[0].xyz(), hi = nodes[1].xyz();
+      vec3 centre = (lo + hi) * 0.5f;
+      vec3 half_extent = (hi - lo) * 0.5f;
+      mat4t to_centre;
+      to_centre.translate(centre);
+      mesh_box *box = new mesh_box(half_extent, to_centre);
 
-      //mesh *mol = new mesh(
+      // move the molecule to the origin, in front of the camera.
+      box_node = new scene_node();
+      box_node->translate(-centre);
+      app_scene->add_child(box_node);
+      app_scene->add_mesh_instance(new mesh_instance(box_node, box, custom_mat));
+
+      float radius = length(half_extent);
+      camera_instance *camera = app_scene->get_camera_instance(0);
+      camera->get_node()->translate(vec3(0, 0, radius * 2.0f));
+      camera->set_far_plane(radius * 4.0f);
+      camera->set_near_plane(0.1f);
     }
 
     /// this is called to draw the world
@@ -233,43 +120,34 @@ namespace octet {
       int vx = 0, vy = 0;
       get_viewport_size(vx, vy);
       app_scene->begin_render(vx, vy);
+      if (!box_node) return;
 
-      glCullFace(GL_BACK);
-      glFrontFace(GL_CW);
+      // draw the back of the box so that the rays start at the camera, even inside the box.
+      // mesh_box triangles are clockwise.
       glEnable(GL_CULL_FACE);
-
-      /*scene_node *camera_node = app_scene->get_camera_instance(0)->get_node();
-      scene_node *box_node = app_scene->get_mesh_instance(0)->get_node();
+      glFrontFace(GL_CW);
+      glCullFace(GL_FRONT);
 
       // camera position in model space
+      scene_node *camera_node = app_scene->get_camera_instance(0)->get_node();
       vec3 pos = box_node->inverse_transform(camera_node->get_position());
       custom_mat->set_uniform(camera_pos, &pos, sizeof(pos));
 
-      // exp(-r^2*k)=t
-      // -r^2*k=log(t) k = -log(t)/(r^2)
-      //static const vec4 data[] = { vec4(0, 0, 0, -0.3f), vec4(1, 0, 0, 1), vec4(-3, 0, 0, -0.6f), vec4(1, 1, 0, 1), vec4(0, 3, 0, -0.3f), vec4(1, 1, 1, 1), vec4(0, -3, 0, -0.4f), vec4(0, 1, 1, 1) };
-      //custom_mat->set_uniform(spheres, data, sizeof(data));
-      std::vector<vec4> data;
-      for (int y = 0; y != 10; ++y) {
-        for (int x = 0; x != 10; ++x) {
-          data.push_back(vec4((x-4.5f)*1.6f, (y-4.5f)*1.6f, 0, -8.0f));
-          data.push_back(vec4(1, 0, 0, 1));
-        }
-      }
-
-      custom_mat->set_uniform(spheres, data.data(), data.size()*sizeof(data[0]));
-      int ns = 100;
-      custom_mat->set_uniform(num_spheres, &ns, sizeof(ns));
-
       // update matrices. assume 30 fps.
       app_scene->update(1.0f/30);
 
       // draw the scene
       app_scene->render((float)vx / vy);
 
-      // tumble the box  (there is only one mesh instance)
-      box_node->rotate(1, vec3(1, 0, 0));
-      box_node->rotate(1, vec3(0, 1, 0));*/
+      glFrontFace(GL_CCW);
+      glCullFace(GL_BACK);
+      glDisable(GL_CULL_FACE);
+
+      // tumble the molecule about its centre.
+      vec3 centre = box_node->inverse_transform(vec3(0, 0, 0));
+      box_node->translate(centre);
+      box_node->rotate(0.5f, vec3(0, 1, 0));
+      box_node->translate(-centre);
     }
   };
 }
@@ -0,0 +1,473 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Uniform grid for finding overlapping 2D boxes.
+
+namespace octet { namespace helpers {
+  /// Class for finding collisions between many 2D sprites.
+  ///
+  /// Each object is an axis aligned box, given by its centre and half size as in the
+  /// sprite classes of the examples. Boxes are stored in every grid cell they touch,
+  /// so a query only looks at nearby objects and move() only touches the grid when a box
+  /// crosses a cell boundary. Boxes outside the bounds are kept in the edge cells.
+  ///
+  /// Group and mask bits filter pairs as in Bullet: two objects can collide
+  /// if each one's group is in the other's mask.
+  ///
+  /// Example:
+  ///
+  ///     broadphase_2d grid(-4, -4, 4, 4, 0.5f);
+  ///     int alien = grid.add(x, y, 0.25f, 0.25f, 1, 2);
+  ///     int missile = grid.add(x, y, 0.0625f, 0.25f, 2, 1);
+  ///     grid.move(missile, x, y + 0.2f);
+  ///     grid.find_pairs([&](int a, int b) { printf("%d hits %d\n", a, b); });
+  class broadphase_2d {
+    struct object {
+      float x, y, half_width, half_height;
+      int ix0, iy0, ix1, iy1;
+      unsigned group;
+      unsigned mask;
+      int first_entry;
+      bool in_use;
+    };
+
+    // one object in one cell. Entries are linked into the cell's list and the object's list.
+    struct entry {
+      int object;
+      int cell;
+      int prev;
+      int next;
+      int object_next;
+    };
+
+    dynarray<object> objects;
+    dynarray<int> free_objects;
+    dynarray<entry> entries;
+    dynarray<int> free_entries;
+    dynarray<int> cells;
+
+    float min_x, min_y;
+    float inv_cell_size;
+    int num_x, num_y;
+    unsigned num_objects;
+
+    int cell_x(float x) const {
+      float fx = (x - min_x) * inv_cell_size;
+      return fx <= 0 ? 0 : fx >= num_x - 1 ? num_x - 1 : (int)fx;
+    }
+
+    int cell_y(float y) const {
+      float fy = (y - min_y) * inv_cell_size;
+      return fy <= 0 ? 0 : fy >= num_y - 1 ? num_y - 1 : (int)fy;
+    }
+
+    static bool overlaps(const object &a, float x, float y, float half_width, float half_height) {
+      return fabsf(a.x - x) < a.half_width + half_width && fabsf(a.y - y) < a.half_height + half_height;
+    }
+
+    void link(int index) {
+      object &obj = objects[index];
+      obj.ix0 = cell_x(obj.x - obj.half_width);
+      obj.ix1 = cell_x(obj.x + obj.half_width);
+      obj.iy0 = cell_y(obj.y - obj.half_height);
+      obj.iy1 = cell_y(obj.y + obj.half_height);
+      obj.first_entry = -1;
+      for (int iy = obj.iy0; iy <= obj.iy1; ++iy) {
+        for (int ix = obj.ix0; ix <= obj.ix1; ++ix) {
+          int cell = iy * num_x + ix;
+          int e;
+          if (free_entries.size()) {
+            e = free_entries.back();
+            free_entries.pop_back();
+          } else {
+            e = (int)entries.size();
+            entries.resize(e + 1);
+          }
+          entry &ent = entries[e];
+          ent.object = index;
+          ent.cell = cell;
+          ent.prev = -1;
+          ent.next = cells[cell];
+          if (ent.next != -1) entries[ent.next].prev = e;
+          cells[cell] = e;
+          ent.object_next = obj.first_entry;
+          obj.first_entry = e;
+        }
+      }
+    }
+
+    void unlink(int index) {
+      object &obj = objects[index];
+      for (int e = obj.first_entry; e != -1; ) {
+        entry &ent = entries[e];
+        if (ent.prev != -1) entries[ent.prev].next = ent.next; else cells[ent.cell] = ent.next;
+        if (ent.next != -1) entries[ent.next].prev = ent.prev;
+        free_entries.push_back(e);
+        e = ent.object_next;
+      }
+      obj.first_entry = -1;
+    }
+
+  public:
+    /// Make a grid covering (min_x, min_y) to (max_x, max_y) in square cells.
+    /// A cell a little larger than a typical sprite works best.
+    broadphase_2d(float min_x = -1, float min_y = -1, float max_x = 1, float max_y = 1, float cell_size = 0.25f) {
+      init(min_x, min_y, max_x, max_y, cell_size);
+    }
+
+    /// Remove all the objects and resize the grid.
+    void init(float min_x, float min_y, float max_x, float max_y, float cell_size) {
+      this->min_x = min_x;
+      this->min_y = min_y;
+      inv_cell_size = 1.0f / cell_size;
+      num_x = std::max(1, (int)ceilf((max_x - min_x) * inv_cell_size));
+      num_y = std::max(1, (int)ceilf((max_y - min_y) * inv_cell_size));
+      cells.resize(num_x * num_y);
+      reset();
+    }
+
+    /// Remove all the objects.
+    void reset() {
+      for (unsigned i = 0; i != cells.size(); ++i) {
+        cells[i] = -1;
+      }
+      objects.resize(0);
+      free_objects.resize(0);
+      entries.resize(0);
+      free_entries.resize(0);
+      num_objects = 0;
+    }
+
+    /// Add a box. Returns a handle for move(), remove() and the query callbacks.
+    int add(float x, float y, float half_width, float half_height, unsigned group = 1, unsigned mask = ~0u) {
+      int index;
+      if (free_objects.size()) {
+        index = free_objects.back();
+        free_objects.pop_back();
+      } else {
+        index = (int)objects.size();
+        objects.resize(index + 1);
+      }
+      object &obj = objects[index];
+      obj.x = x;
+      obj.y = y;
+      obj.half_width = half_width;
+      obj.half_height = half_height;
+      obj.group = group;
+      obj.mask = mask;
+      obj.in_use = true;
+      link(index);
+      num_objects++;
+      return index;
+    }
+
+    /// Remove a box. Its handle may be given out again by add().
+    void remove(int index) {
+      if (!objects[index].in_use) return;
+      unlink(index);
+      objects[index].in_use = false;
+      free_objects.push_back(index);
+      num_objects--;
+    }
+
+    /// Move a box to a new centre.
+    void move(int index, float x, float y) {
+      object &obj = objects[index];
+      resize(index, x, y, obj.half_width, obj.half_height);
+    }
+
+    /// Move and resize a box. The grid is only updated if the box enters or leaves a cell.
+    void resize(int index, float x, float y, float half_width, float half_height) {
+      object &obj = objects[index];
+      obj.x = x;
+      obj.y = y;
+      obj.half_width = half_width;
+      obj.half_height = half_height;
+      if (
+        cell_x(x - half_width) != obj.ix0 || cell_x(x + half_width) != obj.ix1 ||
+        cell_y(y - half_height) != obj.iy0 || cell_y(y + half_height) != obj.iy1
+      ) {
+        unlink(index);
+        link(index);
+      }
+    }
+
+    /// Change the collision filter of a box. A mask of zero stops it colliding at all.
+    void set_filter(int index, unsigned group, unsigned mask) {
+      objects[index].group = group;
+      objects[index].mask = mask;
+    }
+
+    /// Number of boxes in the grid.
+    unsigned get_num_objects() const {
+      return num_objects;
+    }
+
+    /// Call fn(index) for every box overlapping the given box whose group is in mask.
+    /// If fn returns true, the query stops and query() returns true.
+    template <class fn_t> bool query(float x, float y, float half_width, float half_height, unsigned mask, fn_t fn) const {
+      float x0 = x - half_width, y0 = y - half_height;
+      int ix0 = cell_x(x0), ix1 = cell_x(x + half_width);
+      int iy0 = cell_y(y0), iy1 = cell_y(y + half_height);
+      for (int iy = iy0; iy <= iy1; ++iy) {
+        for (int ix = ix0; ix <= ix1; ++ix) {
+          for (int e = cells[iy * num_x + ix]; e != -1; e = entries[e].next) {
+            int index = entries[e].object;
+            const object &obj = objects[index];
+            if (!(obj.group & mask) || !overlaps(obj, x, y, half_width, half_height)) continue;
+
+            // report each box once, from the cell holding the corner of the overlap.
+            if (cell_x(std::max(x0, obj.x - obj.half_width)) != ix || cell_y(std::max(y0, obj.y - obj.half_height)) != iy) continue;
+            if (fn(index)) return true;
+          }
+        }
+      }
+      return false;
+    }
+
+    /// Call fn(a, b) once for every pair of overlapping boxes that pass the group and mask test.
+    template <class fn_t> void find_pairs(fn_t fn) const {
+      for (int a = 0; a != (int)objects.size(); ++a) {
+        const object &obj_a = objects[a];
+        if (!obj_a.in_use || !obj_a.mask) continue;
+        float ax0 = obj_a.x - obj_a.half_width, ay0 = obj_a.y - obj_a.half_height;
+        for (int ea = obj_a.first_entry; ea != -1; ea = entries[ea].object_next) {
+          int cell = entries[ea].cell;
+          int ix = cell % num_x, iy = cell / num_x;
+          for (int e = cells[cell]; e != -1; e = entries[e].next) {
+            int b = entries[e].object;
+            if (b <= a) continue;
+            const object &obj_b = objects[b];
+            if (!(obj_a.group & obj_b.mask) || !(obj_b.group & obj_a.mask)) continue;
+            if (!overlaps(obj_b, obj_a.x, obj_a.y, obj_a.half_width, obj_a.half_height)) continue;
+            if (cell_x(std::max(ax0, obj_b.x - obj_b.half_width)) != ix || cell_y(std::max(ay0, obj_b.y - obj_b.half_height)) != iy) continue;
+            fn(a, b);
+          }
+        }
+      }
+    }
+  };
+
+  #if OCTET_UNIT_TEST
+    /// Compare find_pairs() and query() with testing every pair of boxes.
+    /// Boxes straddle cells, lie on cell edges and leave the grid, so each pair must be found once only.
+    class broadphase_2d_unit_test {
+      enum { n = 300 };
+
+      struct box {
+        float x, y, half_width, half_height;
+        unsigned group, mask;
+        bool in_use;
+      };
+
+      static bool overlaps(const box &a, const box &b) {
+        return fabsf(a.x - b.x) < a.half_width + b.half_width && fabsf(a.y - b.y) < a.half_height + b.half_height;
+      }
+
+      static void random_box(random &rand, box &b) {
+        // a quarter of the boxes are snapped to the 0.5 cell edges.
+        bool snap = rand.get(0, 4) == 0;
+        b.x = snap ? rand.get(-10, 10) * 0.5f : rand.get(-5.0f, 5.0f);
+        b.y = snap ? rand.get(-10, 10) * 0.5f : rand.get(-5.0f, 5.0f);
+        b.half_width = snap ? rand.get(1, 4) * 0.25f : rand.get(0.01f, rand.get(0, 8) ? 0.3f : 2.0f);
+        b.half_height = snap ? rand.get(1, 4) * 0.25f : rand.get(0.01f, rand.get(0, 8) ? 0.3f : 2.0f);
+      }
+
+      static void check(const broadphase_2d &grid, const box *boxes) {
+        dynarray<uint8_t> found(n * n);
+        memset(found.data(), 0, found.size());
+        grid.find_pairs([&](int a, int b) {
+          assert(a < b && boxes[a].in_use && boxes[b].in_use);
+          found[a * n + b]++;
+        });
+        for (int a = 0; a != n; ++a) {
+          for (int b = a + 1; b != n; ++b) {
+            const box &ba = boxes[a], &bb = boxes[b];
+            bool expected = ba.in_use && bb.in_use && (ba.group & bb.mask) && (bb.group & ba.mask) && overlaps(ba, bb);
+            assert(found[a * n + b] == (expected ? 1 : 0));
+          }
+        }
+
+        random rand;
+        for (int q = 0; q != 100; ++q) {
+          box qb;
+          random_box(rand, qb);
+          unsigned mask = rand.get(0, 2) ? ~0u : 1u;
+          memset(found.data(), 0, n);
+          grid.query(qb.x, qb.y, qb.half_width, qb.half_height, mask, [&](int i) {
+            found[i]++;
+            return false;
+          });
+          for (int i = 0; i != n; ++i) {
+            bool expected = boxes[i].in_use && (boxes[i].group & mask) && overlaps(boxes[i], qb);
+            assert(found[i] == (expected ? 1 : 0));
+          }
+        }
+      }
+
+    public:
+      broadphase_2d_unit_test() {
+        random rand;
+        broadphase_2d grid(-4, -4, 4, 4, 0.5f);
+        box boxes[n];
+        for (int i = 0; i != n; ++i) {
+          box &b = boxes[i];
+          random_box(rand, b);
+          b.group = 1u << rand.get(0, 3);
+          b.mask = rand.get(0, 4) ? ~0u : 1u;
+          b.in_use = true;
+          int handle = grid.add(b.x, b.y, b.half_width, b.half_height, b.group, b.mask);
+          assert(handle == i);
+        }
+        check(grid, boxes);
+
+        // move, resize and remove, then add boxes back into the freed handles.
+        int num_removed = 0;
+        for (int i = 0; i != n; ++i) {
+          box &b = boxes[i];
+          int what = rand.get(0, 4);
+          if (what == 0) {
+            b.x += rand.get(-0.2f, 0.2f);
+            b.y += rand.get(-0.2f, 0.2f);
+            grid.move(i, b.x, b.y);
+          } else if (what == 1) {
+            random_box(rand, b);
+            grid.resize(i, b.x, b.y, b.half_width, b.half_height);
+          } else if (what == 2) {
+            b.in_use = false;
+            grid.remove(i);
+            num_removed++;
+          }
+        }
+        check(grid, boxes);
+
+        for (int i = 0; i != num_removed / 2; ++i) {
+          box b;
+          random_box(rand, b);
+          b.group = 1u << rand.get(0, 3);
+          b.mask = ~0u;
+          b.in_use = true;
+          int handle = grid.add(b.x, b.y, b.half_width, b.half_height, b.group, b.mask);
+          assert(handle >= 0 && handle < n && !boxes[handle].in_use);
+          boxes[handle] = b;
+        }
+        check(grid, boxes);
+      }
+    };
+    static broadphase_2d_unit_test broadphase_2d_unit_test;
+  #endif
+
+  #if OCTET_BENCHMARK
+    /// Enemies and shots bouncing around an 8x8 world with 0.25 cells: shots find the enemies they hit.
+    /// The brute force test of every shot against every enemy is only run for the smaller case.
+    class broadphase_2d_benchmark {
+      enum { num_frames = 10 };
+
+      struct mover {
+        float x, y, vx, vy;
+      };
+
+      static void step(dynarray<mover> &movers) {
+        for (unsigned i = 0; i != movers.size(); ++i) {
+          mover &m = movers[i];
+          m.x += m.vx;
+          m.y += m.vy;
+          if (m.x < -4 || m.x > 4) m.vx = -m.vx;
+          if (m.y < -4 || m.y > 4) m.vy = -m.vy;
+        }
+      }
+
+      static void run(unsigned num_enemies, unsigned num_shots, bool brute_force) {
+        const float enemy_half = 0.05f, shot_half = 0.02f;
+        random rand;
+        dynarray<mover> enemies(num_enemies), shots(num_shots);
+        for (unsigned i = 0; i != num_enemies + num_shots; ++i) {
+          mover &m = i < num_enemies ? enemies[i] : shots[i - num_enemies];
+          m.x = rand.get(-4.0f, 4.0f);
+          m.y = rand.get(-4.0f, 4.0f);
+          m.vx = rand.get(-0.05f, 0.05f);
+          m.vy = rand.get(-0.05f, 0.05f);
+        }
+        printf("broadphase_2d_benchmark: %d enemies, %d shots, %d frames\n", num_enemies, num_shots, num_frames);
+        double count = (double)(num_enemies + num_shots) * num_frames;
+
+        unsigned brute_hits = 0;
+        if (brute_force) {
+          dynarray<mover> e = enemies, s = shots;
+          benchmark_timer timer;
+          for (unsigned f = 0; f != num_frames; ++f) {
+            step(e);
+            step(s);
+            for (unsigned i = 0; i != num_shots; ++i) {
+              for (unsigned j = 0; j != num_enemies; ++j) {
+                brute_hits += fabsf(s[i].x - e[j].x) < enemy_half + shot_half && fabsf(s[i].y - e[j].y) < enemy_half + shot_half;
+              }
+            }
+          }
+          timer.report("brute force", count, "objects");
+        }
+
+        unsigned query_hits = 0;
+        {
+          dynarray<mover> e = enemies, s = shots;
+          benchmark_timer timer;
+          broadphase_2d grid(-4, -4, 4, 4, 0.25f);
+          for (unsigned j = 0; j != num_enemies; ++j) {
+            grid.add(e[j].x, e[j].y, enemy_half, enemy_half);
+          }
+          for (unsigned f = 0; f != num_frames; ++f) {
+            step(e);
+            step(s);
+            for (unsigned j = 0; j != num_enemies; ++j) {
+              grid.move(j, e[j].x, e[j].y);
+            }
+            for (unsigned i = 0; i != num_shots; ++i) {
+              grid.query(s[i].x, s[i].y, shot_half, shot_half, ~0u, [&](int) { query_hits++; return false; });
+            }
+          }
+          timer.report("grid move + query", count, "objects");
+        }
+
+        unsigned pair_hits = 0;
+        {
+          dynarray<mover> e = enemies, s = shots;
+          benchmark_timer timer;
+          broadphase_2d grid(-4, -4, 4, 4, 0.25f);
+          for (unsigned j = 0; j != num_enemies; ++j) {
+            grid.add(e[j].x, e[j].y, enemy_half, enemy_half, 1, 2);
+          }
+          for (unsigned i = 0; i != num_shots; ++i) {
+            grid.add(s[i].x, s[i].y, shot_half, shot_half, 2, 1);
+          }
+          for (unsigned f = 0; f != num_frames; ++f) {
+            step(e);
+            step(s);
+            for (unsigned j = 0; j != num_enemies; ++j) {
+              grid.move(j, e[j].x, e[j].y);
+            }
+            for (unsigned i = 0; i != num_shots; ++i) {
+              grid.move(num_enemies + i, s[i].x, s[i].y);
+            }
+            grid.find_pairs([&](int, int) { pair_hits++; });
+          }
+          timer.report("grid move + find_pairs", count, "objects");
+        }
+
+        if ((brute_force && brute_hits != query_hits) || pair_hits != query_hits) {
+          printf("warning: hits differ: brute force %d, query %d, find_pairs %d\n", brute_hits, query_hits, pair_hits);
+        }
+        printf("%d hits per frame\n", query_hits / num_frames);
+      }
+
+    public:
+      broadphase_2d_benchmark() {
+        run(2000, 5000, true);
+        run(5000, 20000, false);
+      }
+    };
+    static broadphase_2d_benchmark broadphase_2d_benchmark;
+  #endif
+}}
@@ -0,0 +1,333 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Draw many 2D sprites with a few draw calls.
+
+namespace octet { namespace helpers {
+  /// Class for drawing large numbers of 2D sprites.
+  ///
+  /// Add sprites each frame, then call render(). Sprites are sorted by shader and texture,
+  /// their corners are written to one streaming vertex buffer and each run of sprites
+  /// that shares a shader and texture is drawn with one glDrawElements.
+  /// Use a texture_atlas so that most sprites share a texture.
+  ///
+  /// Sprites with the same shader and texture are drawn in the order they were added.
+  ///
+  /// Example:
+  ///
+  ///     batch.begin();
+  ///     for (int i = 0; i != num_aliens; ++i) {
+  ///       batch.add(atlas.get_region(alien), x[i], y[i], 0.25f, 0.25f);
+  ///     }
+  ///     batch.render(worldToProjection);
+  class sprite_batch {
+  public:
+    /// The vertex format in the streaming buffer.
+    struct vertex {
+      float x, y, z;
+      float u, v;
+      uint32_t color;
+    };
+
+  private:
+    struct quad {
+      float x, y, half_width, half_height;
+      float cos_angle, sin_angle;
+      float u0, v0, u1, v1;
+      uint32_t color;
+      unsigned key;
+    };
+
+    // a shader and texture pair. Each frame draws one run per key.
+    struct key_info {
+      sprite_shader *shader;
+      GLuint texture;
+      unsigned count;
+      unsigned start;
+    };
+
+    // sprites are made into vertices on many threads when there are this many.
+    enum { parallel_threshold = 8192, parallel_grain = 4096 };
+
+    dynarray<quad> quads;
+    dynarray<unsigned> order;
+    dynarray<key_info> keys;
+    unsigned last_key;
+
+    sprite_shader default_shader;
+
+    ref<gl_resource> vertices;
+    ref<gl_resource> indices;
+    unsigned max_quads;
+
+    unsigned get_key(sprite_shader *shader, GLuint texture) {
+      if (last_key < keys.size() && keys[last_key].shader == shader && keys[last_key].texture == texture) {
+        return last_key;
+      }
+      for (unsigned i = 0; i != keys.size(); ++i) {
+        if (keys[i].shader == shader && keys[i].texture == texture) {
+          return last_key = i;
+        }
+      }
+      key_info k = { shader, texture, 0, 0 };
+      keys.push_back(k);
+      return last_key = keys.size() - 1;
+    }
+
+    void allocate(unsigned num_quads) {
+      max_quads = num_quads;
+      vertices->allocate(GL_ARRAY_BUFFER, max_quads * 4 * sizeof(vertex), GL_DYNAMIC_DRAW);
+      indices->allocate(GL_ELEMENT_ARRAY_BUFFER, max_quads * 6 * sizeof(uint32_t));
+      gl_resource::wolock idx_lock(indices);
+      uint32_t *idx = idx_lock.u32();
+      for (unsigned i = 0; i != max_quads; ++i) {
+        uint32_t v = i * 4;
+        idx[0] = v; idx[1] = v + 1; idx[2] = v + 2;
+        idx[3] = v; idx[4] = v + 2; idx[5] = v + 3;
+        idx += 6;
+      }
+    }
+
+    // stable counting sort of the quads by key.
+    void sort_quads() {
+      for (unsigned i = 0; i != keys.size(); ++i) {
+        keys[i].count = 0;
+      }
+      for (unsigned i = 0; i != quads.size(); ++i) {
+        keys[quads[i].key].count++;
+      }
+      unsigned start = 0;
+      for (unsigned i = 0; i != keys.size(); ++i) {
+        keys[i].start = start;
+        start += keys[i].count;
+      }
+      order.resize(quads.size());
+      for (unsigned i = 0; i != quads.size(); ++i) {
+        order[keys[quads[i].key].start++] = i;
+      }
+      for (unsigned i = 0; i != keys.size(); ++i) {
+        keys[i].start -= keys[i].count;
+      }
+    }
+
+    // write the corners of sorted quads [begin, end) to dest.
+    void make_vertices(vertex *dest, unsigned begin, unsigned end) const {
+      const quad *q = quads.data();
+      const unsigned *ord = order.data();
+      dest += begin * 4;
+      for (unsigned i = begin; i != end; ++i) {
+        const quad &s = q[ord[i]];
+        float cx = s.cos_angle * s.half_width, sx = s.sin_angle * s.half_width;
+        float cy = s.cos_angle * s.half_height, sy = s.sin_angle * s.half_height;
+        vertex *v = dest;
+        v[0].x = s.x - cx + sy; v[0].y = s.y - sx - cy; v[0].u = s.u0; v[0].v = s.v0;
+        v[1].x = s.x + cx + sy; v[1].y = s.y + sx - cy; v[1].u = s.u1; v[1].v = s.v0;
+        v[2].x = s.x + cx - sy; v[2].y = s.y + sx + cy; v[2].u = s.u1; v[2].v = s.v1;
+        v[3].x = s.x - cx - sy; v[3].y = s.y - sx + cy; v[3].u = s.u0; v[3].v = s.v1;
+        v[0].z = v[1].z = v[2].z = v[3].z = 0;
+        v[0].color = v[1].color = v[2].color = v[3].color = s.color;
+        dest += 4;
+      }
+    }
+
+  public:
+    /// Make an empty batch. Call init() when there is a GL context.
+    sprite_batch() {
+      max_quads = 0;
+      last_key = 0;
+    }
+
+    /// Create the default shader and the buffers.
+    void init(unsigned initial_quads = 1024) {
+      default_shader.init();
+      vertices = new gl_resource();
+      indices = new gl_resource();
+      allocate(initial_quads);
+    }
+
+    /// Remove all the sprites. Call at the start of each frame.
+    void begin() {
+      quads.resize(0);
+    }
+
+    /// Add a sprite centred on (x, y), rotated anticlockwise by angle (in degrees).
+    /// Color is 0xAABBGGRR and multiplies the texture. A null shader uses the default sprite_shader.
+    void add(const texture_atlas::region &region, float x, float y, float width, float height, float angle = 0, uint32_t color = 0xffffffff, sprite_shader *shader = NULL) {
+      add(region.texture, region.u0, region.v0, region.u1, region.v1, x, y, width, height, angle, color, shader);
+    }
+
+    /// Add a sprite that uses part of any texture.
+    void add(GLuint texture, float u0, float v0, float u1, float v1, float x, float y, float width, float height, float angle = 0, uint32_t color = 0xffffffff, sprite_shader *shader = NULL) {
+      quad q;
+      q.x = x;
+      q.y = y;
+      q.half_width = width * 0.5f;
+      q.half_height = height * 0.5f;
+      if (angle == 0) {
+        q.cos_angle = 1;
+        q.sin_angle = 0;
+      } else {
+        float radians = angle * (3.14159265f / 180);
+        q.cos_angle = cosf(radians);
+        q.sin_angle = sinf(radians);
+      }
+      q.u0 = u0; q.v0 = v0; q.u1 = u1; q.v1 = v1;
+      q.color = color;
+      q.key = get_key(shader ? shader : &default_shader, texture);
+      quads.push_back(q);
+    }
+
+    /// Number of sprites added since begin().
+    unsigned get_num_sprites() const {
+      return quads.size();
+    }
+
+    /// Sort the sprites and write their corners to dest, which has room for four vertices per sprite.
+    /// render() does this into the streaming vertex buffer.
+    void build_vertices(vertex *dest) {
+      unsigned num_quads = quads.size();
+      sort_quads();
+      if (num_quads >= parallel_threshold) {
+        job_scheduler::get().parallel_for(0, (int)num_quads, parallel_grain, [this, dest](int begin, int end) {
+          make_vertices(dest, (unsigned)begin, (unsigned)end);
+        });
+      } else {
+        make_vertices(dest, 0, num_quads);
+      }
+    }
+
+    /// Draw all the sprites. Sprites are in world space, so pass the worldToProjection matrix
+    /// (eg. the inverse of cameraToWorld times the camera projection).
+    /// Returns the number of draw calls used.
+    unsigned render(const mat4t &worldToProjection) {
+      unsigned num_quads = quads.size();
+      if (num_quads == 0) return 0;
+
+      if (num_quads > max_quads) {
+        unsigned new_max = max_quads ? max_quads : 1024;
+        while (new_max < num_quads) new_max *= 2;
+        allocate(new_max);
+      }
+
+      build_vertices((vertex*)vertices->lock_write_discard());
+      vertices->unlock_write_only();
+
+      vertices->bind();
+      glVertexAttribPointer(attribute_pos, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)0);
+      glVertexAttribPointer(attribute_uv, 2, GL_FLOAT, GL_FALSE, sizeof(vertex), (void*)(sizeof(float)*3));
+      glVertexAttribPointer(attribute_color, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(vertex), (void*)(sizeof(float)*5));
+      glEnableVertexAttribArray(attribute_pos);
+      glEnableVertexAttribArray(attribute_uv);
+      glEnableVertexAttribArray(attribute_color);
+      indices->bind();
+
+      unsigned num_draws = 0;
+      glActiveTexture(GL_TEXTURE0);
+      for (unsigned i = 0; i != keys.size(); ++i) {
+        const key_info &k = keys[i];
+        if (k.count == 0) continue;
+        k.shader->render(worldToProjection, 0);
+        glBindTexture(GL_TEXTURE_2D, k.texture);
+        glDrawElements(GL_TRIANGLES, k.count * 6, GL_UNSIGNED_INT, (void*)(k.start * 6 * sizeof(uint32_t)));
+        num_draws++;
+      }
+
+      glDisableVertexAttribArray(attribute_pos);
+      glDisableVertexAttribArray(attribute_uv);
+      glDisableVertexAttribArray(attribute_color);
+
+      // leave no buffers bound so that code using client side arrays still works.
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+      return num_draws;
+    }
+  };
+
+  #if OCTET_BENCHMARK
+    /// The CPU cost of drawing 100000 moving, rotating sprites, as invaderers did before the batch
+    /// and with the batch. The old path builds a modelToProjection matrix and a vertex array per sprite
+    /// for its own glDrawArrays; the batch adds, sorts and writes the vertices of every sprite for a few draws.
+    /// Sprites use five atlas images, or five separate textures for the "5 textures" case.
+    /// These blocks run before there is a GL context, so only the CPU side is timed; the difference
+    /// on the GPU side is the number of draw calls given with each result.
+    class sprite_batch_benchmark {
+      enum { num_sprites = 100000, num_frames = 10, num_images = 5 };
+
+      struct moving_sprite {
+        float x, y, angle;
+        unsigned image;
+      };
+
+    public:
+      sprite_batch_benchmark() {
+        printf("sprite_batch_benchmark: %d sprites, %d frames\n", num_sprites, num_frames);
+
+        random rand;
+        dynarray<moving_sprite> sprites(num_sprites);
+        for (unsigned i = 0; i != num_sprites; ++i) {
+          sprites[i].x = rand.get(-3.0f, 3.0f);
+          sprites[i].y = rand.get(-3.0f, 3.0f);
+          sprites[i].angle = rand.get(0.0f, 360.0f);
+          sprites[i].image = i % num_images;
+        }
+
+        mat4t cameraToWorld;
+        cameraToWorld.loadIdentity();
+        cameraToWorld.translate(0, 0, 3);
+        const float half_size = 0.0125f;
+
+        unsigned checksum = 0;
+        {
+          benchmark_timer timer;
+          for (unsigned f = 0; f != num_frames; ++f) {
+            for (unsigned i = 0; i != num_sprites; ++i) {
+              const moving_sprite &s = sprites[i];
+              mat4t modelToWorld;
+              modelToWorld.loadIdentity();
+              modelToWorld.translate(s.x, s.y, 0);
+              modelToWorld.rotateZ(s.angle + f);
+              mat4t modelToProjection = mat4t::build_projection_matrix(modelToWorld, cameraToWorld);
+              float vertices[] = {
+                -half_size, -half_size, 0,
+                 half_size, -half_size, 0,
+                 half_size,  half_size, 0,
+                -half_size,  half_size, 0,
+              };
+              checksum += (unsigned)(modelToProjection[3][0] + vertices[s.image]);
+            }
+          }
+          timer.report("per sprite matrices, 100000 draws", (double)num_sprites * num_frames, "sprites");
+        }
+
+        texture_atlas::region regions[num_images];
+        for (unsigned i = 0; i != num_images; ++i) {
+          texture_atlas::region r = { 1, i * 0.2f, 0, i * 0.2f + 0.2f, 1 };
+          regions[i] = r;
+        }
+
+        dynarray<sprite_batch::vertex> vertices(num_sprites * 4);
+        for (int separate = 0; separate != 2; ++separate) {
+          sprite_batch batch;
+          benchmark_timer timer;
+          for (unsigned f = 0; f != num_frames; ++f) {
+            batch.begin();
+            for (unsigned i = 0; i != num_sprites; ++i) {
+              const moving_sprite &s = sprites[i];
+              texture_atlas::region r = regions[s.image];
+              r.texture += separate * s.image;
+              batch.add(r, s.x, s.y, half_size * 2, half_size * 2, s.angle + f);
+            }
+            batch.build_vertices(vertices.data());
+            checksum += (unsigned)vertices[f].x;
+          }
+          timer.report(separate ? "sprite_batch, 5 textures, 5 draws" : "sprite_batch, atlas, 1 draw", (double)num_sprites * num_frames, "sprites");
+        }
+        if (checksum == 1) printf("\n"); // keep the results
+      }
+    };
+    static sprite_batch_benchmark sprite_batch_benchmark;
+  #endif
+}}
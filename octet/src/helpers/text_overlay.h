@@ -9,11 +9,64 @@
 
 namespace octet { namespace helpers {
   /// Class for managing text overlays.
+  ///
+  /// All the text is copied into one vertex buffer and drawn in a single call.
   class text_overlay : public resource {
+    typedef bitmap_font::vertex vertex;
+
     ref<visual_scene> text_scene;
     ref<bitmap_font> font;
     ref<material> mat;
     ref<scene_node> node;
+
+    // one mesh for all the text
+    ref<mesh> batch;
+    unsigned max_quads;
+
+    // the text blocks and the version of each in the batch
+    dynarray<ref<mesh_text> > texts;
+    dynarray<unsigned> versions;
+
+    void allocate_batch(unsigned num_quads) {
+      max_quads = num_quads;
+      batch->get_vertices()->allocate(GL_ARRAY_BUFFER, max_quads * 4 * sizeof(vertex), GL_DYNAMIC_DRAW);
+      batch->get_indices()->allocate(GL_ELEMENT_ARRAY_BUFFER, max_quads * 6 * sizeof(uint32_t));
+      gl_resource::wolock idx_lock(batch->get_indices());
+      bitmap_font::make_quad_indices(idx_lock.u32(), 0, max_quads);
+    }
+
+    // copy the text into the batch if any of it has changed.
+    void update_batch() {
+      bool changed = false;
+      unsigned num_quads = 0;
+      for (unsigned i = 0; i != texts.size(); ++i) {
+        changed |= texts[i]->get_version() != versions[i];
+        num_quads += texts[i]->get_quads().size() / 4;
+      }
+      if (!changed) return;
+
+      if (num_quads > max_quads) {
+        unsigned new_max = max_quads;
+        while (new_max < num_quads) new_max *= 2;
+        allocate_batch(new_max);
+      }
+
+      if (num_quads) {
+        uint8_t *dest = (uint8_t*)batch->get_vertices()->lock_write_discard();
+        for (unsigned i = 0; i != texts.size(); ++i) {
+          const dynarray<vertex> &quads = texts[i]->get_quads();
+          unsigned bytes = quads.size() * sizeof(vertex);
+          if (bytes) memcpy(dest, quads.data(), bytes);
+          dest += bytes;
+          versions[i] = texts[i]->get_version();
+        }
+        batch->get_vertices()->unlock_write_only();
+      }
+
+      batch->set_num_indices(num_quads * 6);
+      batch->set_num_vertices(num_quads * 4);
+    }
+
   public:
     /// Create an empty text overlay.
     text_overlay() {
@@ -36,18 +89,31 @@ namespace octet { namespace helpers {
       // Make a default node for the scene (no transformation)
       node = text_scene->add_scene_node();
 
+      // Make the mesh that all the text goes into.
+      batch = new mesh();
+      batch->add_attribute(attribute_pos, 3, GL_FLOAT, sizeof(float)*0);
+      batch->add_attribute(attribute_uv, 2, GL_FLOAT, sizeof(float)*3);
+      batch->add_attribute(attribute_color, 4, GL_UNSIGNED_BYTE, sizeof(float)*5);
+      batch->set_params(sizeof(vertex), 0, 0, GL_TRIANGLES, GL_UNSIGNED_INT);
+      allocate_batch(256);
+      text_scene->add_mesh_instance(new mesh_instance(node, batch, mat));
+
       // Create scene defaults.
       text_scene->create_default_camera_and_lights();
     }
 
     /// Add a block of text
     void add_mesh_text(mesh_text *mesh) {
-      mesh_instance *msh_inst = new mesh_instance(node, mesh, mat);
-      text_scene->add_mesh_instance(msh_inst);
+      mesh->set_batched(true);
+      mesh->update();
+      texts.push_back(mesh);
+      versions.push_back(0);
     }
 
     /// Render the text overlay
     void render(int vx, int vy) {
+      update_batch();
+
       camera_instance *cam = text_scene->get_camera_instance(0);
       cam->get_node()->loadIdentity();
       cam->set_ortho((float)vx, (float)vy, 1, -1, 1);
@@ -0,0 +1,270 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Packs many small images into a few large textures.
+
+namespace octet { namespace helpers {
+  /// Class for packing sprite images into atlas pages at load time.
+  ///
+  /// Sprites that share a page can be drawn together by a sprite_batch with one draw call.
+  /// Images are packed on shelves, tallest first, with a one pixel border copied from the
+  /// edge of each image so that bilinear filtering does not bleed in the neighbours.
+  ///
+  /// Example:
+  ///
+  ///     texture_atlas atlas;
+  ///     int ship = atlas.add("assets/invaderers/ship.gif");
+  ///     int bomb = atlas.add("assets/invaderers/bomb.gif");
+  ///     atlas.build();
+  ///     batch.add(atlas.get_region(ship), x, y, 0.25f, 0.25f);
+  class texture_atlas {
+  public:
+    /// Where an image ended up in the atlas.
+    struct region {
+      GLuint texture;
+      float u0, v0, u1, v1;
+    };
+
+  private:
+    struct source {
+      dynarray<uint8_t> rgba;
+      unsigned width;
+      unsigned height;
+      unsigned page;
+      unsigned x;
+      unsigned y;
+      unsigned index;
+    };
+
+    enum { padding = 1 };
+
+    dynarray<source*> sources;
+    dynarray<region> regions;
+    dynarray<GLuint> pages;
+    unsigned max_size;
+
+    static unsigned round_up_pow2(unsigned x) {
+      unsigned r = 1;
+      while (r < x) r <<= 1;
+      return r;
+    }
+
+    // copy one image into a page with its edge pixels repeated in the padding.
+    static void blit(uint8_t *page, unsigned page_width, unsigned page_height, const source *src) {
+      int w = (int)src->width, h = (int)src->height;
+      for (int y = -padding; y < h + padding; ++y) {
+        int dy = (int)src->y + y;
+        if (dy < 0 || dy >= (int)page_height) continue;
+        int sy = y < 0 ? 0 : y >= h ? h - 1 : y;
+        const uint8_t *src_row = &src->rgba[sy * w * 4];
+        uint8_t *dest_row = page + dy * page_width * 4;
+        for (int x = -padding; x < w + padding; ++x) {
+          int dx = (int)src->x + x;
+          if (dx < 0 || dx >= (int)page_width) continue;
+          int sx = x < 0 ? 0 : x >= w ? w - 1 : x;
+          memcpy(dest_row + dx * 4, src_row + sx * 4, 4);
+        }
+      }
+    }
+
+    void upload_page(unsigned page, unsigned page_width, unsigned page_height) {
+      dynarray<uint8_t> pixels(page_width * page_height * 4);
+      memset(pixels.data(), 0, pixels.size());
+      for (unsigned i = 0; i != sources.size(); ++i) {
+        if (sources[i]->page == page) {
+          blit(pixels.data(), page_width, page_height, sources[i]);
+        }
+      }
+
+      GLuint handle = 0;
+      glGenTextures(1, &handle);
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, handle);
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, page_width, page_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, (void*)pixels.data());
+
+      // no mipmaps: the smaller levels would mix neighbouring sprites.
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      pages.push_back(handle);
+
+      for (unsigned i = 0; i != sources.size(); ++i) {
+        source *src = sources[i];
+        if (src->page == page) {
+          region &r = regions[src->index];
+          r.texture = handle;
+          r.u0 = (float)src->x / page_width;
+          r.v0 = (float)src->y / page_height;
+          r.u1 = (float)(src->x + src->width) / page_width;
+          r.v1 = (float)(src->y + src->height) / page_height;
+        }
+      }
+    }
+
+  public:
+    /// Make an empty atlas. Pages are at most max_size pixels square.
+    texture_atlas(unsigned max_size = 2048) {
+      this->max_size = max_size;
+    }
+
+    ~texture_atlas() {
+      reset();
+    }
+
+    /// Delete the images and the textures.
+    void reset() {
+      for (unsigned i = 0; i != sources.size(); ++i) {
+        delete sources[i];
+      }
+      for (unsigned i = 0; i != pages.size(); ++i) {
+        glDeleteTextures(1, &pages[i]);
+      }
+      sources.reset();
+      regions.reset();
+      pages.reset();
+    }
+
+    /// Add an RGBA image. Returns an index for get_region(), or -1 if the image is bigger than a page.
+    int add(const uint8_t *rgba, unsigned width, unsigned height) {
+      if (width + padding * 2 > max_size || height + padding * 2 > max_size) {
+        printf("warning: image %dx%d does not fit in a %d atlas\n", width, height, max_size);
+        return -1;
+      }
+
+      source *src = new source();
+      src->rgba.resize(width * height * 4);
+      memcpy(src->rgba.data(), rgba, width * height * 4);
+      src->width = width;
+      src->height = height;
+      src->page = src->x = src->y = 0;
+      src->index = regions.size();
+      sources.push_back(src);
+      region r = { 0, 0, 0, 1, 1 };
+      regions.push_back(r);
+      return (int)src->index;
+    }
+
+    /// Add a gif, jpeg or tga image from a file. Returns an index for get_region() or -1.
+    int add(const char *url) {
+      dynarray<uint8_t> buffer;
+      dynarray<uint8_t> image;
+      app_utils::get_url(buffer, url);
+      uint16_t format = 0;
+      uint16_t width = 0;
+      uint16_t height = 0;
+      if (buffer.size() < 6) {
+        printf("warning: could not load %s\n", url);
+        return -1;
+      }
+      const unsigned char *src = &buffer[0];
+      const unsigned char *src_max = src + buffer.size();
+      if (!memcmp(&buffer[0], "GIF89a", 6)) {
+        gif_decoder dec;
+        dec.get_image(image, format, width, height, src, src_max);
+      } else if (buffer[0] == 0xff && buffer[1] == 0xd8) {
+        jpeg_decoder dec;
+        dec.get_image(image, format, width, height, src, src_max);
+      } else if (buffer[0] == 0 && buffer[1] == 0 && buffer[2] == 2) {
+        tga_decoder dec;
+        dec.get_image(image, format, width, height, src, src_max);
+      } else {
+        printf("warning: unknown texture format %s\n", url);
+        return -1;
+      }
+
+      if (!width || !height || (format != GL_RGB && format != GL_RGBA)) {
+        return -1;
+      }
+
+      if (format == GL_RGB) {
+        dynarray<uint8_t> rgba(width * height * 4);
+        for (unsigned i = 0; i != (unsigned)width * height; ++i) {
+          rgba[i*4+0] = image[i*3+0];
+          rgba[i*4+1] = image[i*3+1];
+          rgba[i*4+2] = image[i*3+2];
+          rgba[i*4+3] = 0xff;
+        }
+        return add(rgba.data(), width, height);
+      }
+      return add(image.data(), width, height);
+    }
+
+    /// Pack all the images added so far into pages and upload them.
+    /// The source images are then freed; images added later go on new pages.
+    void build() {
+      dynarray<unsigned> order(sources.size());
+      for (unsigned i = 0; i != sources.size(); ++i) {
+        order[i] = i;
+      }
+
+      // tallest first, so each shelf wastes little height.
+      std::stable_sort(order.data(), order.data() + order.size(), [this](unsigned a, unsigned b) {
+        return sources[a]->height > sources[b]->height;
+      });
+
+      unsigned page = pages.size();
+      unsigned x = 0, y = 0, shelf_height = 0;
+      unsigned page_width = 0, page_height = 0;
+      for (unsigned i = 0; i != order.size(); ++i) {
+        source *src = sources[order[i]];
+        unsigned w = src->width + padding * 2;
+        unsigned h = src->height + padding * 2;
+
+        if (x + w > max_size) {
+          y += shelf_height;
+          x = 0;
+          shelf_height = 0;
+        }
+
+        if (y + h > max_size) {
+          upload_page(page++, page_width, page_height);
+          x = y = shelf_height = 0;
+          page_width = page_height = 0;
+        }
+
+        src->page = page;
+        src->x = x + padding;
+        src->y = y + padding;
+        x += w;
+        shelf_height = std::max(shelf_height, h);
+
+        // shrink the last page to fit what is on it.
+        page_width = std::max(page_width, round_up_pow2(x));
+        page_height = std::max(page_height, round_up_pow2(y + shelf_height));
+      }
+
+      if (page_width) {
+        upload_page(page, page_width, page_height);
+      }
+
+      for (unsigned i = 0; i != sources.size(); ++i) {
+        delete sources[i];
+      }
+      sources.reset();
+    }
+
+    /// Get the page texture and uv rectangle of an image.
+    const region &get_region(int index) const {
+      return regions[index];
+    }
+
+    /// Number of images added.
+    unsigned get_num_regions() const {
+      return regions.size();
+    }
+
+    /// Number of textures used by the atlas.
+    unsigned get_num_pages() const {
+      return pages.size();
+    }
+
+    /// Get one of the atlas textures.
+    GLuint get_page(unsigned page) const {
+      return pages[page];
+    }
+  };
+}}
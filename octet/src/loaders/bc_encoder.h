@@ -0,0 +1,386 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+//
+// Block compression encoder: BC1 (DXT1), BC3 (DXT5), BC4 (RGTC1) and BC5 (RGTC2)
+//
+
+namespace octet { namespace loaders {
+  /// Class for compressing 8 bit images into 4x4 blocks for the GPU.
+  ///
+  /// Colour blocks use a cluster fit: the pixels are sorted along the principal axis
+  /// and every split of them into four clusters is tried, solving for the best endpoints
+  /// by least squares. Alpha and single channel blocks use the min/max range.
+  ///
+  /// The encoder works in rows of blocks so that the caller can spread the work over threads.
+  ///
+  /// Example:
+  ///
+  ///     bc_encoder enc;
+  ///     dynarray<uint8_t> result(bc_encoder::level_size(format, w, h));
+  ///     enc.encode_block_rows(result.data(), format, src, w, h, 4, 0, bc_encoder::num_block_rows(h));
+  class bc_encoder {
+  public:
+    enum {
+      COMPRESSED_RGB_S3TC_DXT1_EXT = 0x83F0,
+      COMPRESSED_RGBA_S3TC_DXT1_EXT = 0x83F1,
+      COMPRESSED_RGBA_S3TC_DXT3_EXT = 0x83F2,
+      COMPRESSED_RGBA_S3TC_DXT5_EXT = 0x83F3,
+      COMPRESSED_RED_RGTC1 = 0x8DBB,
+      COMPRESSED_RG_RGTC2 = 0x8DBD,
+    };
+
+  private:
+    // convert a colour in [0,1] to 5:6:5 rounding to the nearest value
+    static unsigned pack565(vec4_in c) {
+      unsigned r = (unsigned)(std::min(std::max(c[0], 0.0f), 1.0f) * 31.0f + 0.5f);
+      unsigned g = (unsigned)(std::min(std::max(c[1], 0.0f), 1.0f) * 63.0f + 0.5f);
+      unsigned b = (unsigned)(std::min(std::max(c[2], 0.0f), 1.0f) * 31.0f + 0.5f);
+      return (r << 11) | (g << 5) | b;
+    }
+
+    static vec4 unpack565(unsigned c) {
+      return vec4(
+        ((c >> 11) & 0x1f) * (1.0f/31),
+        ((c >> 5) & 0x3f) * (1.0f/63),
+        ((c >> 0) & 0x1f) * (1.0f/31),
+        0
+      );
+    }
+
+    // snap a colour to the 5:6:5 grid
+    static vec4 quantize(vec4_in c) {
+      return unpack565(pack565(c));
+    }
+
+    // read a 4x4 block clamping at the edges. Missing components are 0, missing alpha is 255.
+    static void fetch_block(uint8_t block[16][4], const uint8_t *src, unsigned width, unsigned height, unsigned num_comps, unsigned bx, unsigned by) {
+      for (unsigned j = 0; j != 4; ++j) {
+        unsigned y = std::min(by * 4 + j, height - 1);
+        for (unsigned i = 0; i != 4; ++i) {
+          unsigned x = std::min(bx * 4 + i, width - 1);
+          const uint8_t *p = src + (y * width + x) * num_comps;
+          uint8_t *d = block[i + j * 4];
+          d[0] = p[0];
+          d[1] = num_comps > 1 ? p[1] : 0;
+          d[2] = num_comps > 2 ? p[2] : 0;
+          d[3] = num_comps > 3 ? p[3] : 255;
+        }
+      }
+    }
+
+    // 4 colour BC1 block using cluster fit.
+    static void encode_colour(uint8_t *dest, const uint8_t block[16][4]) {
+      vec4 colours[16];
+      vec4 tot(0, 0, 0, 0);
+      for (unsigned i = 0; i != 16; ++i) {
+        colours[i] = vec4(block[i][0], block[i][1], block[i][2], 0) * (1.0f/255);
+        tot += colours[i];
+      }
+      vec4 mean = tot * (1.0f/16);
+
+      // principal axis by the power method on the covariance matrix.
+      mat4t covariance(0);
+      for (unsigned i = 0; i != 16; ++i) {
+        vec4 c = colours[i] - mean;
+        covariance += outer(c, c);
+      }
+      vec4 axis = vec4(1, 1, 1, 0);
+      for (unsigned i = 0; i != 8; ++i) {
+        axis = axis * covariance;
+        float len = axis.length();
+        if (len < 1e-8f) { axis = vec4(1, 1, 1, 0); break; }
+        axis = axis / len;
+      }
+
+      // sort the colours along the axis (insertion sort is fine for 16)
+      float proj[16];
+      unsigned order[16];
+      for (unsigned i = 0; i != 16; ++i) {
+        proj[i] = dot(colours[i], axis);
+        unsigned j = i;
+        for (; j > 0 && proj[order[j-1]] > proj[i]; --j) {
+          order[j] = order[j-1];
+        }
+        order[j] = i;
+      }
+
+      // prefix sums of the sorted colours
+      vec4 sum[17];
+      sum[0] = vec4(0, 0, 0, 0);
+      for (unsigned i = 0; i != 16; ++i) {
+        sum[i+1] = sum[i] + colours[order[i]];
+      }
+      float xx = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        xx += dot(colours[i], colours[i]);
+      }
+
+      // start with a flat block of the mean colour
+      vec4 best_a = quantize(mean), best_b = best_a;
+      float best_error = 1e30f;
+      {
+        vec4 d = best_a;
+        best_error = xx - 2 * dot(d, tot) + 16 * dot(d, d);
+      }
+
+      // try every split into clusters weighted 1, 2/3, 1/3, 0 towards endpoint a.
+      for (unsigned i = 0; i <= 16; ++i) {
+        for (unsigned j = i; j <= 16; ++j) {
+          for (unsigned k = j; k <= 16; ++k) {
+            float n0 = (float)i, n1 = (float)(j - i), n2 = (float)(k - j), n3 = (float)(16 - k);
+            float alpha2 = n0 + n1 * (4.0f/9) + n2 * (1.0f/9);
+            float beta2 = n3 + n2 * (4.0f/9) + n1 * (1.0f/9);
+            float alphabeta = (n1 + n2) * (2.0f/9);
+            float det = alpha2 * beta2 - alphabeta * alphabeta;
+            if (det < 1e-6f) continue;
+
+            vec4 s1 = sum[j] - sum[i], s2 = sum[k] - sum[j], s3 = sum[16] - sum[k];
+            vec4 alphax = sum[i] + s1 * (2.0f/3) + s2 * (1.0f/3);
+            vec4 betax = s3 + s2 * (2.0f/3) + s1 * (1.0f/3);
+
+            float factor = 1.0f / det;
+            vec4 a = quantize((alphax * beta2 - betax * alphabeta) * factor);
+            vec4 b = quantize((betax * alpha2 - alphax * alphabeta) * factor);
+
+            float error =
+              dot(a, a) * alpha2 + dot(b, b) * beta2 + xx +
+              2 * (dot(a, b) * alphabeta - dot(a, alphax) - dot(b, betax))
+            ;
+            if (error < best_error) {
+              best_error = error;
+              best_a = a;
+              best_b = b;
+            }
+          }
+        }
+      }
+
+      unsigned c0 = pack565(best_a), c1 = pack565(best_b);
+      if (c0 < c1) {
+        unsigned t = c0; c0 = c1; c1 = t;
+      }
+
+      // pick the nearest palette entry for each pixel.
+      uint32_t indices = 0;
+      if (c0 != c1) {
+        vec4 p0 = unpack565(c0), p1 = unpack565(c1);
+        vec4 palette[4] = { p0, p1, p0 * (2.0f/3) + p1 * (1.0f/3), p0 * (1.0f/3) + p1 * (2.0f/3) };
+        for (unsigned i = 0; i != 16; ++i) {
+          unsigned best = 0;
+          float best_d = 1e30f;
+          for (unsigned p = 0; p != 4; ++p) {
+            vec4 d = colours[i] - palette[p];
+            float dd = dot(d, d);
+            if (dd < best_d) { best_d = dd; best = p; }
+          }
+          indices |= best << (i * 2);
+        }
+      }
+
+      dest[0] = (uint8_t)(c0 >> 0);
+      dest[1] = (uint8_t)(c0 >> 8);
+      dest[2] = (uint8_t)(c1 >> 0);
+      dest[3] = (uint8_t)(c1 >> 8);
+      dest[4] = (uint8_t)(indices >> 0);
+      dest[5] = (uint8_t)(indices >> 8);
+      dest[6] = (uint8_t)(indices >> 16);
+      dest[7] = (uint8_t)(indices >> 24);
+    }
+
+    // 8 value interpolated block (BC4, BC5 and the alpha of BC3)
+    static void encode_channel(uint8_t *dest, const uint8_t block[16][4], unsigned channel) {
+      unsigned vmin = 255, vmax = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        unsigned v = block[i][channel];
+        vmin = std::min(vmin, v);
+        vmax = std::max(vmax, v);
+      }
+
+      dest[0] = (uint8_t)vmax;
+      dest[1] = (uint8_t)vmin;
+
+      uint64_t indices = 0;
+      if (vmax != vmin) {
+        // palette order is a0, a1, then six steps from a0 to a1.
+        unsigned palette[8] = { vmax, vmin };
+        for (unsigned p = 2; p != 8; ++p) {
+          palette[p] = ((8 - p) * vmax + (p - 1) * vmin + 3) / 7;
+        }
+        for (unsigned i = 0; i != 16; ++i) {
+          int v = block[i][channel];
+          unsigned best = 0;
+          int best_d = 256;
+          for (unsigned p = 0; p != 8; ++p) {
+            int d = std::abs(v - (int)palette[p]);
+            if (d < best_d) { best_d = d; best = p; }
+          }
+          indices |= (uint64_t)best << (i * 3);
+        }
+      }
+
+      for (unsigned i = 0; i != 6; ++i) {
+        dest[2 + i] = (uint8_t)(indices >> (i * 8));
+      }
+    }
+
+  public:
+    /// true if we can encode this format.
+    static bool is_supported(unsigned format) {
+      return
+        format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT5_EXT ||
+        format == COMPRESSED_RED_RGTC1 || format == COMPRESSED_RG_RGTC2
+      ;
+    }
+
+    /// bytes per 4x4 block for a compressed format
+    static unsigned block_bytes(unsigned format) {
+      return
+        format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT ||
+        format == COMPRESSED_RED_RGTC1 ? 8 : 16
+      ;
+    }
+
+    /// number of rows of blocks in an image
+    static unsigned num_block_rows(unsigned height) {
+      return (height + 3) / 4;
+    }
+
+    /// size in bytes of one compressed mip level
+    static size_t level_size(unsigned format, unsigned width, unsigned height) {
+      return (size_t)((width + 3) / 4) * ((height + 3) / 4) * block_bytes(format);
+    }
+
+    /// Compress rows of blocks [by0, by1) of an image with num_comps 8 bit components per pixel.
+    /// dest points to the start of the compressed level.
+    void encode_block_rows(uint8_t *dest, unsigned format, const uint8_t *src, unsigned width, unsigned height, unsigned num_comps, unsigned by0, unsigned by1) const {
+      unsigned bw = (width + 3) / 4;
+      unsigned bytes = block_bytes(format);
+      dest += (size_t)by0 * bw * bytes;
+      uint8_t block[16][4];
+      for (unsigned by = by0; by != by1; ++by) {
+        for (unsigned bx = 0; bx != bw; ++bx) {
+          fetch_block(block, src, width, height, num_comps, bx, by);
+          switch (format) {
+            case COMPRESSED_RGB_S3TC_DXT1_EXT: {
+              encode_colour(dest, block);
+            } break;
+            case COMPRESSED_RGBA_S3TC_DXT5_EXT: {
+              encode_channel(dest, block, 3);
+              encode_colour(dest + 8, block);
+            } break;
+            case COMPRESSED_RED_RGTC1: {
+              encode_channel(dest, block, 0);
+            } break;
+            case COMPRESSED_RG_RGTC2: {
+              encode_channel(dest, block, 0);
+              encode_channel(dest + 8, block, 1);
+            } break;
+          }
+          dest += bytes;
+        }
+      }
+    }
+  };
+
+  #if OCTET_UNIT_TEST
+    /// Encode images as BC1, decode them again and check the error.
+    /// Flat blocks should only lose the 5:6:5 rounding; smooth gradients a little more.
+    class bc_encoder_unit_test {
+      // decode a BC1 block to 4x4 RGB pixels.
+      static void decode_bc1(uint8_t pixels[16][3], const uint8_t *src) {
+        unsigned c[2] = { src[0] | (unsigned)src[1] << 8, src[2] | (unsigned)src[3] << 8 };
+        int palette[4][3];
+        for (int i = 0; i != 2; ++i) {
+          unsigned r = c[i] >> 11 & 0x1f, g = c[i] >> 5 & 0x3f, b = c[i] & 0x1f;
+          palette[i][0] = r << 3 | r >> 2;
+          palette[i][1] = g << 2 | g >> 4;
+          palette[i][2] = b << 3 | b >> 2;
+        }
+        for (int k = 0; k != 3; ++k) {
+          if (c[0] > c[1]) {
+            palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3;
+            palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3;
+          } else {
+            palette[2][k] = (palette[0][k] + palette[1][k]) / 2;
+            palette[3][k] = 0;
+          }
+        }
+        unsigned indices = src[4] | src[5] << 8 | src[6] << 16 | (unsigned)src[7] << 24;
+        for (int i = 0; i != 16; ++i) {
+          const int *p = palette[indices >> (i * 2) & 3];
+          pixels[i][0] = (uint8_t)p[0]; pixels[i][1] = (uint8_t)p[1]; pixels[i][2] = (uint8_t)p[2];
+        }
+      }
+
+      // largest difference of any channel between an RGB image and its BC1 round trip.
+      static int round_trip_error(const uint8_t *image, unsigned width, unsigned height) {
+        bc_encoder enc;
+        unsigned format = bc_encoder::COMPRESSED_RGB_S3TC_DXT1_EXT;
+        dynarray<uint8_t> blocks(bc_encoder::level_size(format, width, height));
+        enc.encode_block_rows(blocks.data(), format, image, width, height, 3, 0, bc_encoder::num_block_rows(height));
+
+        int max_error = 0;
+        unsigned bw = (width + 3) / 4;
+        for (unsigned by = 0; by != bc_encoder::num_block_rows(height); ++by) {
+          for (unsigned bx = 0; bx != bw; ++bx) {
+            uint8_t pixels[16][3];
+            decode_bc1(pixels, &blocks[(by * bw + bx) * 8]);
+            for (unsigned i = 0; i != 16; ++i) {
+              unsigned x = bx * 4 + (i & 3), y = by * 4 + (i >> 2);
+              if (x >= width || y >= height) continue;
+              const uint8_t *p = image + (y * width + x) * 3;
+              for (int k = 0; k != 3; ++k) {
+                max_error = std::max(max_error, abs(pixels[i][k] - p[k]));
+              }
+            }
+          }
+        }
+        return max_error;
+      }
+
+    public:
+      bc_encoder_unit_test() {
+        random rand;
+        enum { w = 32, h = 30 };
+        uint8_t image[w * h * 3];
+
+        // one random colour per block. Expanded 5 bit values are 8 or 9 apart and pack565 rounds before
+        // the expansion, so a channel can be 5 out.
+        uint8_t colours[w / 4 * (h + 3) / 4][3];
+        for (unsigned i = 0; i != sizeof(colours) / 3; ++i) {
+          for (int k = 0; k != 3; ++k) colours[i][k] = (uint8_t)rand.get(0, 256);
+        }
+        for (unsigned y = 0; y != h; ++y) {
+          for (unsigned x = 0; x != w; ++x) {
+            for (int k = 0; k != 3; ++k) image[(y * w + x) * 3 + k] = colours[(y / 4) * (w / 4) + x / 4][k];
+          }
+        }
+        assert(round_trip_error(image, w, h) <= 5);
+
+        // smooth gradients in random directions.
+        for (int pass = 0; pass != 8; ++pass) {
+          float base[3], dx[3], dy[3];
+          for (int k = 0; k != 3; ++k) {
+            base[k] = rand.get(40.0f, 215.0f);
+            dx[k] = rand.get(-3.0f, 3.0f);
+            dy[k] = rand.get(-3.0f, 3.0f);
+          }
+          for (unsigned y = 0; y != h; ++y) {
+            for (unsigned x = 0; x != w; ++x) {
+              for (int k = 0; k != 3; ++k) {
+                float v = base[k] + dx[k] * ((int)x - w / 2) + dy[k] * ((int)y - h / 2);
+                image[(y * w + x) * 3 + k] = (uint8_t)std::min(std::max(v, 0.0f), 255.0f);
+              }
+            }
+          }
+          assert(round_trip_error(image, w, h) <= 12);
+        }
+      }
+    };
+    static bc_encoder_unit_test bc_encoder_unit_test;
+  #endif
+}}
@@ -19,6 +19,11 @@
 // mesh builder class for standard meshes.
 namespace octet { namespace loaders {
   /// Class for loading COLADA files.
+  ///
+  /// Before the xml is parsed, the bodies of large numeric elements (float_array, p, v ...)
+  /// are cut out of the text so that TinyXML only builds a DOM of the small sections.
+  /// The float arrays are converted on all threads and the geometry library is
+  /// assembled in parallel; only the final OpenGL upload happens on the calling thread.
   class collada_builder {
   public:
 
@@ -27,10 +32,103 @@ namespace octet { namespace loaders {
     // 0 = none, 1 = summary, 2 = details
     enum { debug = 0 };
 
+    // element bodies smaller than this stay in the DOM
+    enum { min_payload = 64 };
+
+    // a numeric element body cut out of the xml; the DOM text is "@@index".
+    struct payload {
+      unsigned begin;
+      unsigned end;
+      bool is_float;
+      dynarray<float> *floats;    // converted float_array values
+    };
+
     TiXmlDocument doc;
     string doc_path;
     dictionary<TiXmlElement *, allocator> ids;
     dynarray<float> temp_floats;
+    dynarray<uint8_t> file_text;
+    dynarray<payload> payloads;
+
+    // materials with top down (DDS) textures and the meshes that have had v = 1 - v applied for them.
+    hash_map<material *, int> top_down_materials;
+    hash_map<mesh *, int> flipped_meshes;
+
+    static bool is_space(char c) {
+      return c > 0 && c <= ' ';
+    }
+
+    // Copy the xml without the bodies of large numeric elements, noting where they were.
+    void strip_payloads(dynarray<char> &xml) {
+      static const char *names[] = { "float_array", "int_array", "p", "v", "vcount" };
+      const char *src = (const char*)file_text.data();
+      const char *end = src + file_text.size();
+      const char *copied = src;
+
+      xml.reserve(4096);
+      for (const char *p = src; (p = (const char*)memchr(p, '<', end - p)) != NULL; ) {
+        const char *name = p + 1;
+        int kind = -1;
+        for (int k = 0; k != sizeof(names)/sizeof(names[0]); ++k) {
+          size_t len = strlen(names[k]);
+          if (end - name > (ptrdiff_t)len && !memcmp(name, names[k], len) && (name[len] == '>' || is_space(name[len]))) {
+            kind = k;
+            break;
+          }
+        }
+        if (kind < 0) {
+          p = name;
+          continue;
+        }
+
+        const char *gt = (const char*)memchr(name, '>', end - name);
+        if (!gt) break;
+        const char *body = gt + 1;
+        const char *lt = (const char*)memchr(body, '<', end - body);
+        if (!lt) break;
+
+        if (gt[-1] != '/' && lt - body >= min_payload) {
+          char marker[16];
+          sprintf(marker, "@@%d", (int)payloads.size());
+          append(xml, copied, body);
+          append(xml, marker, marker + strlen(marker));
+          payload pl = { (unsigned)(body - src), (unsigned)(lt - src), kind == 0, 0 };
+          payloads.push_back(pl);
+          copied = lt;
+        }
+        p = lt;
+      }
+      append(xml, copied, end);
+      xml.push_back(0);
+    }
+
+    static void append(dynarray<char> &xml, const char *begin, const char *end) {
+      unsigned size = xml.size();
+      if (size + (end - begin) > xml.capacity()) {
+        xml.reserve((size + (unsigned)(end - begin)) * 2);
+      }
+      xml.resize(size + (unsigned)(end - begin));
+      memcpy(xml.data() + size, begin, end - begin);
+    }
+
+    // index of the payload that replaced the text of an element, or -1
+    int get_payload(const char *text) {
+      if (!text || text[0] != '@' || text[1] != '@') return -1;
+      unsigned index = (unsigned)atoi(text + 2);
+      return index < payloads.size() ? (int)index : -1;
+    }
+
+    // get the floats of an element, without copying if they have already been converted.
+    const float *get_floats(dynarray<float> &tmp, unsigned &count, const char *src) {
+      int index = get_payload(src);
+      if (index >= 0 && payloads[index].floats) {
+        count = payloads[index].floats->size();
+        return payloads[index].floats->data();
+      }
+      atofv(tmp, src);
+      count = tmp.size();
+      return tmp.data();
+    }
 
     // find all the ids in an xml file
     void find_ids(TiXmlElement *parent) {
@@ -47,7 +145,9 @@ namespace octet { namespace loaders {
     TiXmlElement *find_id(const char *source) {
       if (source) {
         if (source[0] == '#') source++;
-        return ids[source];
+        // don't use ids[] here, it adds missing keys and this is called from worker threads.
+        int index = ids.get_index(source);
+        return index >= 0 ? ids.get_value(index) : 0;
       }
       return 0;
     }
@@ -101,48 +201,32 @@ namespace octet { namespace loaders {
     }
 
     // convert a string like "1.2 3.4 43.12" into an array of float values
-    void atofv(dynarray<float> &values, const char *src) {  
+    void atofv(dynarray<float> &values, const char *src) {
       values.resize(0);
       if (!src) return;
 
-      while (*src > 0 && *src <= ' ') ++src;
-      while(*src != 0) {
-        double whole = 0, msign = 1;
-        if (*src == '-') { msign = -1; src++; }
-        if( !(*src >= '0' && *src <= '9') && *src != '.' ) break;
-        while (*src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
-        if (*src == '.') {
-          src++;
-          double frac = 0, v = 1;
-          while (*src >= '0' && *src <= '9') { frac = frac * 10 + (*src++ - '0'); v *= 10; }
-          whole += frac / v;
-        }
-        if (*src == 'e' || *src == 'E') {
-          int esign = 1;
-          src++;
-          if (*src == '-') { esign = -1; src++; }
-          else if (*src == '+') src++;
-          int exp = 0;
-          while (*src >= '0' && *src <= '9') { exp = exp * 10 + (*src++ - '0'); }
-          whole = whole * pow(10.0, exp * esign);
-        }
-        values.push_back((float)(whole * msign));
-        while (*src > 0 && *src <= ' ') ++src;
+      int index = get_payload(src);
+      if (index >= 0 && payloads[index].floats) {
+        const dynarray<float> &floats = *payloads[index].floats;
+        values.resize(floats.size());
+        if (floats.size()) memcpy(values.data(), floats.data(), floats.size() * sizeof(float));
+      } else if (index >= 0) {
+        number_parser::parse_floats(values, (const char*)file_text.data() + payloads[index].begin, (const char*)file_text.data() + payloads[index].end);
+      } else {
+        number_parser::parse_floats(values, src, src + strlen(src));
       }
     }
 
     // convert an ascii sequence of integers like "1 3 9 12 34" to an array of integers
-    void atoiv(dynarray<int> &values, const char *src) {  
+    void atoiv(dynarray<int> &values, const char *src) {
       //values.resize(0);
       if (!src) return;
 
-      while (*src > 0 && *src <= ' ') ++src;
-      while(*src != 0) {
-        int whole = 0, msign = 1;
-        if (*src == '-') { msign = -1; src++; }
-        while (*src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
-        values.push_back(whole * msign);
-        while (*src > 0 && *src <= ' ') ++src;
+      int index = get_payload(src);
+      if (index >= 0) {
+        number_parser::parse_ints(values, (const char*)file_text.data() + payloads[index].begin, (const char*)file_text.data() + payloads[index].end);
+      } else {
+        number_parser::parse_ints(values, src, src + strlen(src));
       }
     }
 
@@ -297,9 +381,11 @@ namespace octet { namespace loaders {
         state.s->add_attribute(attr, size, GL_FLOAT, state.attr_offset * 4);
         state.attr_offset += size;
       } else if (state.pass == 2) {
-        dynarray<float> accessor_floats;
+        dynarray<float> tmp;
+        const float *accessor_floats = 0;
+        unsigned num_accessor_floats = 0;
         if (!strcmp(accessor_source_elem->Value(), "float_array")) {
-          atofv(accessor_floats, accessor_source_elem->GetText());
+          accessor_floats = get_floats(tmp, num_accessor_floats, accessor_source_elem->GetText());
         }
 
         // attribute building pass
@@ -316,7 +402,7 @@ namespace octet { namespace loaders {
             }
 
             if (type == 1) {
-              if (src_idx >= accessor_floats.size()) {
+              if (src_idx >= num_accessor_floats) {
                 printf("src_idx >= accessor_floats.size()\n");
                 return;
               }
@@ -337,13 +423,14 @@ namespace octet { namespace loaders {
             state.skinst->raw_indices[i] = src_idx;
           }
         } else if (!strcmp(semantic, "WEIGHT")) {
-          dynarray<float> accessor_floats;
-          atofv(accessor_floats, accessor_source_elem->GetText());
+          dynarray<float> tmp;
+          unsigned num_accessor_floats = 0;
+          const float *accessor_floats = get_floats(tmp, num_accessor_floats, accessor_source_elem->GetText());
           assert(state.skinst->raw_weights.size() >= num_vertices);
           for (unsigned i = 0; i != num_vertices; ++i) {
             unsigned index = state.p[i * state.input_stride + state.input_offset];
             unsigned src_idx = accessor_offset_int + index * accessor_stride_int;
-            state.skinst->raw_weights[i] = accessor_floats[src_idx];
+            state.skinst->raw_weights[i] = src_idx < num_accessor_floats ? accessor_floats[src_idx] : 0;
           }
         }
       }
@@ -365,6 +452,19 @@ namespace octet { namespace loaders {
       return NULL;
     }
 
+    // get the image of a <texture> element
+    image *get_texture_image(resource_dict &dict, TiXmlElement *profile_COMMON, TiXmlElement *texture) {
+      // todo: handle multiple texcoords
+      const char *texture_name = attr(texture, "texture");
+      TiXmlElement *sampler2D = find_param(profile_COMMON, texture_name, "sampler2D");
+      TiXmlElement *source = child(sampler2D, "source");
+      const char *surface_name = text(source);
+      TiXmlElement *surface = find_param(profile_COMMON, surface_name, "surface");
+      TiXmlElement *init_from = child(surface, "init_from");
+      const char *image_name = text(init_from);
+      return dict.get_image(image_name);
+    }
+
     // get a texture or a solid colour
     param *get_param(param_buffer_info &pbi, GLint &texture_slot, resource_dict &dict, TiXmlElement *shader, TiXmlElement *profile_COMMON, const char *value, const vec4 &deflt) {
       TiXmlElement *section = child(shader, value);
@@ -387,15 +487,7 @@ namespace octet { namespace loaders {
           return resource_dict::get_texture_handle(GL_RGBA, name);
         }*/
       } else if (texture) {
-        // todo: handle multiple texcoords
-        const char *texture_name = attr(texture, "texture");
-        TiXmlElement *sampler2D = find_param(profile_COMMON, texture_name, "sampler2D");
-        TiXmlElement *source = child(sampler2D, "source");
-        const char *surface_name = text(source);
-        TiXmlElement *surface = find_param(profile_COMMON, surface_name, "surface");
-        TiXmlElement *init_from = child(surface, "init_from");
-        const char *image_name = text(init_from);
-        image *img = dict.get_image(image_name);
+        image *img = get_texture_image(dict, profile_COMMON, texture);
         if (img) return new param_sampler(pbi, app_utils::get_atom(value), img, new sampler(), param::stage_fragment);
         /*TiXmlElement *image = find_id(image_name);
         const char *url_attr = text(child(image, "init_from"));
@@ -459,6 +551,11 @@ namespace octet { namespace loaders {
           material *mat = new material(diffuse, ambient, emission, specular, bump, shininess);
           //mat->init(diffuse, ambient, emission, specular, bump, shininess);
           dict.set_resource(attr(mat_elem, "id"), mat);
+
+          image *img = get_texture_image(dict, profile_COMMON, child(child(shader, "diffuse"), "texture"));
+          if (img && img->is_top_down()) {
+            top_down_materials[mat] = 1;
+          }
         } else {
           material *mat = new material(vec4(0.5, 0.5, 0.5, 0));
           dict.set_resource(attr(mat_elem, "id"), mat);
@@ -491,6 +588,12 @@ namespace octet { namespace loaders {
           }
 
           mesh *msh = dict.get_mesh(mesh_url);
+          if (msh && top_down_materials.contains(mat) && !flipped_meshes.contains(msh)) {
+            // DDS textures have row zero at the top.
+            msh->flip_v();
+            flipped_meshes[msh] = 1;
+          }
+
           if (msh) {
             mesh_instance *mi = new mesh_instance(node, msh, mat, skel);
             s.add_mesh_instance(mi);
@@ -636,10 +739,12 @@ namespace octet { namespace loaders {
     }
 
     // add a geometry element to the list of mesh states
+    // the vertices and indices of all the meshes are built in parallel, then uploaded here in order.
     void add_geometry(resource_dict &dict) {
       TiXmlElement *lib_geom = doc.RootElement()->FirstChildElement("library_geometries");
       if (!lib_geom) return;
 
+      dynarray<mesh_build*> builds;
       for (TiXmlElement *geometry = lib_geom->FirstChildElement(); geometry != NULL; geometry = geometry->NextSiblingElement()) {
         TiXmlElement *mesh_elem = child(geometry, "mesh");
         const char *id = geometry->Attribute("id");
@@ -649,11 +754,31 @@ namespace octet { namespace loaders {
           mesh_child = mesh_child->NextSiblingElement()
         ) {
           if (is_mesh_component(mesh_child->Value())) {
-            mesh *msh = new mesh();
-            get_mesh_component(msh, id, mesh_child, NULL, dict);
+            mesh_build *b = new mesh_build();
+            b->msh = new mesh();
+            b->id = id;
+            b->mesh_child = mesh_child;
+            b->ok = false;
+            builds.push_back(b);
           }
         }
       }
+
+      job_scheduler::get().parallel_for(0, (int)builds.size(), 1, [&](int b0, int b1) {
+        for (int i = b0; i != b1; ++i) {
+          mesh_build *b = builds[i];
+          b->state.s = b->msh;
+          b->ok = build_mesh_component(b->state, b->num_indices, b->mesh_child, NULL);
+        }
+      });
+
+      for (unsigned i = 0; i != builds.size(); ++i) {
+        mesh_build *b = builds[i];
+        string url;
+        dict.set_resource(get_component_url(url, b->id, b->mesh_child), b->msh);
+        if (b->ok) finish_mesh_component(b->msh, b->state, b->num_indices);
+        delete b;
+      }
     }
 
     // add a geometry element to the list of mesh states
@@ -740,6 +865,8 @@ namespace octet { namespace loaders {
           string new_path;
           new_path.format("%s%s", doc_path.c_str(), url_attr);
           image *img = new image(new_path);
+          // map DDS files now so that is_top_down() is known when the materials are made.
+          img->map_dds();
           dict.set_resource(attr(elem, "id"), img);
         }
       }
@@ -950,25 +1077,32 @@ namespace octet { namespace loaders {
       return input_stride;
     }
 
-    // get triangles from a trilist or polylist
-    void get_mesh_component(mesh *mesh, const char *id, TiXmlElement *mesh_child, skin_state *skinst, resource_dict &dict) {
-      TiXmlElement *pelem = child(mesh_child, "p");
-
-      if (!pelem) {
-        printf("warning: no <p>\n");
-        return;
-      }
+    // a mesh component being built on a worker thread.
+    struct mesh_build {
+      mesh *msh;
+      const char *id;
+      TiXmlElement *mesh_child;
+      parse_input_state state;
+      unsigned num_indices;
+      bool ok;
+    };
 
-      // a geometry or controller is split up into its material groups
-      // with a name of "geometry+material"
-      // each requires a separate mesh instance to render
+    // a geometry or controller is split up into its material groups
+    // with a name of "geometry+material"
+    // each requires a separate mesh instance to render
+    const char *get_component_url(string &new_url, const char *id, TiXmlElement *mesh_child) {
       const char *symbol = attr(mesh_child, "material");
-      string new_url;
-      const char *mesh_url = id;
       if (symbol) {
         new_url.format("%s+%s", id, symbol);
-        mesh_url = new_url;
+        return new_url.c_str();
       }
+      return id;
+    }
+
+    // get triangles from a trilist or polylist
+    void get_mesh_component(mesh *mesh, const char *id, TiXmlElement *mesh_child, skin_state *skinst, resource_dict &dict) {
+      string new_url;
+      const char *mesh_url = get_component_url(new_url, id, mesh_child);
 
       if (debug > 0 ) {
         log("created mesh %s\n", id);
@@ -978,6 +1112,38 @@ namespace octet { namespace loaders {
 
       parse_input_state state;
       state.s = mesh;
+      unsigned num_indices = 0;
+      if (build_mesh_component(state, num_indices, mesh_child, skinst)) {
+        finish_mesh_component(mesh, state, num_indices);
+      }
+    }
+
+    // upload the vertices and indices of a mesh component. This must be on the OpenGL thread.
+    void finish_mesh_component(mesh *mesh, parse_input_state &state, unsigned num_indices) {
+      unsigned num_vertices = state.p.size() / state.input_stride;
+      unsigned isize = state.indices.size() * sizeof(state.indices[0]);
+      unsigned vsize = state.vertices.size() * sizeof(state.vertices[0]);
+
+      if (debug > 0) {
+        log("mesh component loaded with %d indices and %d floats for vertices\n", state.indices.size(), state.vertices.size());
+      }
+
+      mesh->allocate(vsize, isize);
+      mesh->assign(vsize, isize, (unsigned char*)&state.vertices[0], (unsigned char*)&state.indices[0]);
+      mesh->set_params(state.attr_stride * 4, num_indices, num_vertices, GL_TRIANGLES, GL_UNSIGNED_INT);
+      mesh->calc_aabb();
+      if (debug > 1) mesh->dump(log("mesh\n"));
+    }
+
+    // build the vertices and indices of a mesh component in state. This does no OpenGL calls.
+    bool build_mesh_component(parse_input_state &state, unsigned &num_indices, TiXmlElement *mesh_child, skin_state *skinst) {
+      TiXmlElement *pelem = child(mesh_child, "p");
+
+      if (!pelem) {
+        printf("warning: no <p>\n");
+        return false;
+      }
+
       while (pelem) {
         atoiv(state.p, pelem->GetText());
         pelem = sibling(pelem, "p");
@@ -991,7 +1157,7 @@ namespace octet { namespace loaders {
       unsigned p_size = state.p.size();
       if (p_size % state.input_stride != 0) {
         printf("warning: expected multiple of %d indices\n", state.input_stride);
-        return;
+        return false;
       }
 
       unsigned num_vertices = p_size / state.input_stride;
@@ -1067,7 +1233,7 @@ namespace octet { namespace loaders {
 
       // build an initial index based on the mesh_child value
       // todo: optimise the mesh.
-      unsigned num_indices = 0;
+      num_indices = 0;
       if (vcount_elem) {
         // polygons
         dynarray<int> vcount;
@@ -1081,19 +1247,7 @@ namespace octet { namespace loaders {
           state.indices[i] = i;
         }
       }
-      
-      unsigned isize = state.indices.size() * sizeof(state.indices[0]);
-      unsigned vsize = state.vertices.size() * sizeof(state.vertices[0]);
-
-      if (debug > 0) {
-        log("mesh component loaded with %d indices and %d floats for vertices\n", state.indices.size(), state.vertices.size());
-      }
-
-      mesh->allocate(vsize, isize);
-      mesh->assign(vsize, isize, (unsigned char*)&state.vertices[0], (unsigned char*)&state.indices[0]);
-      mesh->set_params(state.attr_stride * 4, num_indices, num_vertices, GL_TRIANGLES, GL_UNSIGNED_INT);
-      mesh->calc_aabb();
-      if (debug > 1) mesh->dump(log("mesh\n"));
+      return true;
     }
 
     // get blend weights and matrices from a skin
@@ -1213,21 +1367,43 @@ namespace octet { namespace loaders {
     collada_builder() {
     }
 
+    ~collada_builder() {
+      for (unsigned i = 0; i != payloads.size(); ++i) {
+        delete payloads[i].floats;
+      }
+    }
+
     // public function to load a collada file
     bool load_xml(const char *url) {
       doc_path = url;
       doc_path.truncate(doc_path.filename_pos());
-      const char *path = app_utils::get_path(url);
-      char buf[256];
-      getcwd(buf, sizeof(buf));
-      doc.LoadFile(path);
+      app_utils::get_url(file_text, url);
+      if (file_text.size() == 0) {
+        printf("file %s not found\n", url);
+        return false;
+      }
+
+      dynarray<char> xml;
+      strip_payloads(xml);
+      doc.Parse(xml.data());
 
       TiXmlElement *top = doc.RootElement();
       if (!top) {
-        printf("file %s not found\n", path);
+        printf("file %s is not xml\n", url);
         return false;
       }
 
+      // convert all the float arrays at once on all threads.
+      job_scheduler::get().parallel_for(0, (int)payloads.size(), 1, [&](int p0, int p1) {
+        for (int i = p0; i != p1; ++i) {
+          payload &pl = payloads[i];
+          if (pl.is_float) {
+            pl.floats = new dynarray<float>();
+            number_parser::parse_floats(*pl.floats, (const char*)file_text.data() + pl.begin, (const char*)file_text.data() + pl.end);
+          }
+        }
+      });
+
       if (strcmp(top->Value(), "COLLADA")) {
         printf("warning: not a collada file");
         return false;
@@ -1288,4 +1464,171 @@ namespace octet { namespace loaders {
       add_animations(dict);
     }
   };
+
+  #if OCTET_BENCHMARK
+    /// Load a generated 512x512 grid mesh (262144 vertices, 522242 triangles) as Collada.
+    /// The old path parses the whole file with TinyXML and converts each float_array with the
+    /// old digit loop; the new path is load_xml, which strips the payloads and converts them on all threads.
+    /// The index lists are converted later, when the meshes are built, so they are timed on their own.
+    class collada_builder_benchmark {
+      enum { dim = 512 };
+
+      // the conversions collada_builder used before number_parser.
+      static void old_atofv(dynarray<float> &values, const char *src) {
+        values.resize(0);
+        if (!src) return;
+
+        while (*src > 0 && *src <= ' ') ++src;
+        while(*src != 0) {
+          double whole = 0, msign = 1;
+          if (*src == '-') { msign = -1; src++; }
+          if( !(*src >= '0' && *src <= '9') && *src != '.' ) break;
+          while (*src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
+          if (*src == '.') {
+            src++;
+            double frac = 0, v = 1;
+            while (*src >= '0' && *src <= '9') { frac = frac * 10 + (*src++ - '0'); v *= 10; }
+            whole += frac / v;
+          }
+          if (*src == 'e' || *src == 'E') {
+            int esign = 1;
+            src++;
+            if (*src == '-') { esign = -1; src++; }
+            else if (*src == '+') src++;
+            int exp = 0;
+            while (*src >= '0' && *src <= '9') { exp = exp * 10 + (*src++ - '0'); }
+            whole = whole * pow(10.0, exp * esign);
+          }
+          values.push_back((float)(whole * msign));
+          while (*src > 0 && *src <= ' ') ++src;
+        }
+      }
+
+      static void old_atoiv(dynarray<int> &values, const char *src) {
+        if (!src) return;
+
+        while (*src > 0 && *src <= ' ') ++src;
+        while(*src != 0) {
+          int whole = 0, msign = 1;
+          if (*src == '-') { msign = -1; src++; }
+          while (*src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
+          values.push_back(whole * msign);
+          while (*src > 0 && *src <= ' ') ++src;
+        }
+      }
+
+      static void add(dynarray<char> &text, const char *fmt, ...) {
+        char tmp[256];
+        va_list list;
+        va_start(list, fmt);
+        int len = vsnprintf(tmp, sizeof(tmp), fmt, list);
+        va_end(list);
+        unsigned size = text.size();
+        if (size + len > text.capacity()) text.reserve((size + len) * 2);
+        text.resize(size + len);
+        memcpy(text.data() + size, tmp, len);
+      }
+
+      static void add_source(dynarray<char> &text, const char *name, unsigned stride, float (*fn)(unsigned, unsigned, unsigned)) {
+        unsigned count = dim * dim * stride;
+        add(text, "<source id=\"grid-%s\"><float_array id=\"grid-%s-array\" count=\"%d\">", name, name, count);
+        for (unsigned y = 0; y != dim; ++y) {
+          for (unsigned x = 0; x != dim; ++x) {
+            for (unsigned c = 0; c != stride; ++c) {
+              add(text, c ? " %f" : "\n%f", fn(x, y, c));
+            }
+          }
+        }
+        add(text, "</float_array><technique_common><accessor source=\"#grid-%s-array\" count=\"%d\" stride=\"%d\"/></technique_common></source>\n", name, dim * dim, stride);
+      }
+
+      static float pos(unsigned x, unsigned y, unsigned c) { return c == 0 ? x * 0.125f - 32 : c == 1 ? sinf(x * 0.1f) * cosf(y * 0.1f) : y * -0.125f + 32; }
+      static float normal(unsigned x, unsigned y, unsigned c) { return c == 1 ? 0.99503719f : c == 0 ? -0.0995037f * cosf(x * 0.1f) : 0.0f; }
+      static float uv(unsigned x, unsigned y, unsigned c) { return (c ? y : x) * (1.0f / (dim - 1)); }
+
+      // convert the float arrays of a TinyXML DOM
+      static unsigned convert(TiXmlElement *parent, dynarray<float> &values) {
+        unsigned count = 0;
+        for (TiXmlElement *elem = parent->FirstChildElement(); elem; elem = elem->NextSiblingElement()) {
+          if (!strcmp(elem->Value(), "float_array")) {
+            old_atofv(values, elem->GetText());
+            count += values.size();
+          }
+          count += convert(elem, values);
+        }
+        return count;
+      }
+
+    public:
+      collada_builder_benchmark() {
+        dynarray<char> text;
+        add(text, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<COLLADA xmlns=\"http://www.collada.org/2005/11/COLLADASchema\" version=\"1.4.1\">\n");
+        add(text, "<library_geometries><geometry id=\"grid\" name=\"grid\"><mesh>\n");
+        add_source(text, "position", 3, pos);
+        add_source(text, "normal", 3, normal);
+        add_source(text, "uv", 2, uv);
+        add(text, "<vertices id=\"grid-vertices\"><input semantic=\"POSITION\" source=\"#grid-position\"/></vertices>\n");
+        add(text, "<triangles count=\"%d\"><input semantic=\"VERTEX\" source=\"#grid-vertices\" offset=\"0\"/>", (dim - 1) * (dim - 1) * 2);
+        add(text, "<input semantic=\"NORMAL\" source=\"#grid-normal\" offset=\"0\"/><input semantic=\"TEXCOORD\" source=\"#grid-uv\" offset=\"0\" set=\"0\"/><p>");
+        unsigned indices_begin = text.size();
+        for (unsigned y = 0; y != dim - 1; ++y) {
+          for (unsigned x = 0; x != dim - 1; ++x) {
+            unsigned i = y * dim + x;
+            add(text, "%d %d %d %d %d %d\n", i, i + 1, i + dim, i + 1, i + dim + 1, i + dim);
+          }
+        }
+        unsigned indices_end = text.size();
+        add(text, "</p></triangles></mesh></geometry></library_geometries>\n</COLLADA>\n");
+
+        const char *url = "octet_collada_benchmark.dae";
+        string path = app_utils::get_path(url);
+        FILE *fp = fopen(path.c_str(), "wb");
+        if (!fp) return;
+        fwrite(text.data(), 1, text.size(), fp);
+        fclose(fp);
+
+        printf("collada_builder_benchmark: %dx%d grid, %.1fMB of xml\n", dim, dim, text.size() / (1024.0 * 1024.0));
+        unsigned num_floats = dim * dim * 8;
+        {
+          benchmark_timer timer;
+          dynarray<uint8_t> buffer;
+          app_utils::get_url(buffer, url);
+          buffer.push_back(0);
+          TiXmlDocument doc;
+          doc.Parse((const char*)buffer.data());
+          dynarray<float> values;
+          unsigned count = convert(doc.RootElement(), values);
+          timer.report("TinyXML + old atofv (old path)", num_floats, "floats");
+          if (count != num_floats) printf("warning: %d floats\n", count);
+        }
+        {
+          benchmark_timer timer;
+          collada_builder builder;
+          builder.load_xml(url);
+          timer.report("load_xml + number_parser", num_floats, "floats");
+        }
+
+        // the index list, from the text generated above.
+        unsigned indices_size = indices_end - indices_begin;
+        unsigned num_ints = (dim - 1) * (dim - 1) * 6;
+        dynarray<char> p(indices_size + 1);
+        memcpy(p.data(), text.data() + indices_begin, indices_size);
+        p[indices_size] = 0;
+        {
+          benchmark_timer timer;
+          dynarray<int> values;
+          old_atoiv(values, p.data());
+          timer.report("<p> old atoiv", num_ints, "ints");
+        }
+        {
+          benchmark_timer timer;
+          dynarray<int> values;
+          number_parser::parse_ints(values, p.data(), p.data() + indices_size);
+          timer.report("<p> number_parser::parse_ints", num_ints, "ints");
+        }
+        remove(path.c_str());
+      }
+    };
+    static collada_builder_benchmark collada_builder_benchmark;
+  #endif
 }}
@@ -10,6 +10,15 @@
 
 namespace octet { namespace loaders {
   /// Class for loading DDS texture files
+  ///
+  /// Only block compressed 2D textures are supported (BC1-BC7, including DX10 headers).
+  /// The blocks are passed to glCompressedTexImage2D without being decompressed.
+  ///
+  /// DDS files store the top row first, so the image is upside down compared
+  /// with the OpenGL convention. flip_chain() turns BC1-BC5 upside down while copying
+  /// the blocks, by reordering block rows and the rows of indices in each block.
+  /// BC6H and BC7 can't be flipped without decoding them; use v = 1 - v on meshes
+  /// that sample those.
   class dds_decoder {
     // http://en.wikipedia.org/wiki/DirectDraw_Surface
     // http://www.mindcontrol.org/~hplus/graphics/dds-info/
@@ -53,6 +62,47 @@ namespace octet { namespace loaders {
       COMPRESSED_RGBA_S3TC_DXT1_EXT = 0x83F1,
       COMPRESSED_RGBA_S3TC_DXT3_EXT = 0x83F2,
       COMPRESSED_RGBA_S3TC_DXT5_EXT = 0x83F3,
+      COMPRESSED_SRGB_S3TC_DXT1_EXT = 0x8C4C,
+      COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT = 0x8C4D,
+      COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT = 0x8C4E,
+      COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT = 0x8C4F,
+      COMPRESSED_RED_RGTC1 = 0x8DBB,
+      COMPRESSED_SIGNED_RED_RGTC1 = 0x8DBC,
+      COMPRESSED_RG_RGTC2 = 0x8DBD,
+      COMPRESSED_SIGNED_RG_RGTC2 = 0x8DBE,
+      COMPRESSED_RGBA_BPTC_UNORM = 0x8E8C,
+      COMPRESSED_SRGB_ALPHA_BPTC_UNORM = 0x8E8D,
+      COMPRESSED_RGB_BPTC_SIGNED_FLOAT = 0x8E8E,
+      COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT = 0x8E8F,
+
+      // DX10 extended header
+      dxgi_format_bc1_typeless = 70,
+      dxgi_format_bc1_unorm = 71,
+      dxgi_format_bc1_unorm_srgb = 72,
+      dxgi_format_bc2_typeless = 73,
+      dxgi_format_bc2_unorm = 74,
+      dxgi_format_bc2_unorm_srgb = 75,
+      dxgi_format_bc3_typeless = 76,
+      dxgi_format_bc3_unorm = 77,
+      dxgi_format_bc3_unorm_srgb = 78,
+      dxgi_format_bc4_typeless = 79,
+      dxgi_format_bc4_unorm = 80,
+      dxgi_format_bc4_snorm = 81,
+      dxgi_format_bc5_typeless = 82,
+      dxgi_format_bc5_unorm = 83,
+      dxgi_format_bc5_snorm = 84,
+      dxgi_format_bc6h_typeless = 94,
+      dxgi_format_bc6h_uf16 = 95,
+      dxgi_format_bc6h_sf16 = 96,
+      dxgi_format_bc7_typeless = 97,
+      dxgi_format_bc7_unorm = 98,
+      dxgi_format_bc7_unorm_srgb = 99,
+
+      d3d10_resource_dimension_texture2d = 3,
+      d3d10_resource_misc_texturecube = 0x4,
+
+      header_size = 128,
+      dx10_header_size = 20,
     };
 
     struct dds_header {
@@ -89,231 +139,271 @@ namespace octet { namespace loaders {
       uint8_t reserved2[4];
     };
 
-    // read a pair of bytes as a little-endian value
-    // this will work on the PS3 and other big-endian machines
-    int le2( uint8_t val[2] )
-    {
-      return val[0] + val[1] * 0x100;
-    }
+    struct dds_header_dx10 {
+      uint8_t dxgi_format[4];
+      uint8_t resource_dimension[4];
+      uint8_t misc_flag[4];
+      uint8_t array_size[4];
+      uint8_t misc_flags2[4];
+    };
 
     // read four bytes as a little-endian value
     // this will work on the PS3 and other big-endian machines
-    int le4( uint8_t val[4] )
-    {
+    static unsigned le4(const uint8_t val[4]) {
       return val[0] + val[1] * 0x100 + val[2] * 0x10000 + val[3] * 0x1000000;
     }
 
-    // rrrrrggggggbbbbb
-    // rrrrrggggggbbbbb
-    // 0011223344556677
-    // 8899aabbccddeeff
-    void hack_dxt1(uint8_t *dest, const uint8_t *src, unsigned stride, bool always_use_four_colours) {
-      uint16_t color0 = src[0] + src[1] * 256;
-      uint16_t color1 = src[2] + src[3] * 256;
-      src += 4;
-
-      uint8_t r0 = ( ( ( color0 >> 11 ) & 0x1f ) * (0xffff / 0x1f)) >> 8;
-      uint8_t g0 = ( ( ( color0 >> 6 ) & 0x3f ) * (0xffff / 0x3f)) >> 8;
-      uint8_t b0 = ( ( ( color0 >> 0 ) & 0x1f ) * (0xffff / 0x1f)) >> 8;
-      uint8_t r1 = ( ( ( color1 >> 11 ) & 0x1f ) * (0xffff / 0x1f)) >> 8;
-      uint8_t g1 = ( ( ( color1 >> 6 ) & 0x3f ) * (0xffff / 0x3f)) >> 8;
-      uint8_t b1 = ( ( ( color1 >> 0 ) & 0x1f ) * (0xffff / 0x1f)) >> 8;
-
-      // if it were not for the patent, some other code would go here
-      dest[0] = ( r0 + r1 ) >> 1;
-      dest[1] = ( g0 + g1 ) >> 1;
-      dest[2] = ( b0 + b1 ) >> 1;
-      dest[3] = 0xff;
+    static unsigned fourcc(char a, char b, char c, char d) {
+      return (uint8_t)a + (uint8_t)b * 0x100 + (uint8_t)c * 0x10000 + (uint8_t)d * 0x1000000;
     }
 
-    // quantised alpha
-    void hack_dxt3(uint8_t *dest, const uint8_t *src, unsigned stride) {
-      dest[3] = ( src[0] + src[1] ) >> 1;
+    // GL format for a legacy fourcc code
+    static unsigned get_fourcc_format(unsigned code) {
+      if (code == fourcc('D', 'X', 'T', '1')) return COMPRESSED_RGBA_S3TC_DXT1_EXT;
+      if (code == fourcc('D', 'X', 'T', '2')) return COMPRESSED_RGBA_S3TC_DXT3_EXT;
+      if (code == fourcc('D', 'X', 'T', '3')) return COMPRESSED_RGBA_S3TC_DXT3_EXT;
+      if (code == fourcc('D', 'X', 'T', '4')) return COMPRESSED_RGBA_S3TC_DXT5_EXT;
+      if (code == fourcc('D', 'X', 'T', '5')) return COMPRESSED_RGBA_S3TC_DXT5_EXT;
+      if (code == fourcc('A', 'T', 'I', '1')) return COMPRESSED_RED_RGTC1;
+      if (code == fourcc('B', 'C', '4', 'U')) return COMPRESSED_RED_RGTC1;
+      if (code == fourcc('B', 'C', '4', 'S')) return COMPRESSED_SIGNED_RED_RGTC1;
+      if (code == fourcc('A', 'T', 'I', '2')) return COMPRESSED_RG_RGTC2;
+      if (code == fourcc('B', 'C', '5', 'U')) return COMPRESSED_RG_RGTC2;
+      if (code == fourcc('B', 'C', '5', 'S')) return COMPRESSED_SIGNED_RG_RGTC2;
+      return 0;
     }
 
-    // interpolated alpha
-    void hack_dxt5(uint8_t *dest, const uint8_t *src, unsigned stride) {
-      dest[3] = ( src[0] + src[1] ) >> 1;
+    // GL format for a DXGI format from a DX10 header
+    static unsigned get_dxgi_format(unsigned dxgi) {
+      switch (dxgi) {
+        case dxgi_format_bc1_typeless: case dxgi_format_bc1_unorm: return COMPRESSED_RGBA_S3TC_DXT1_EXT;
+        case dxgi_format_bc1_unorm_srgb: return COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT;
+        case dxgi_format_bc2_typeless: case dxgi_format_bc2_unorm: return COMPRESSED_RGBA_S3TC_DXT3_EXT;
+        case dxgi_format_bc2_unorm_srgb: return COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT;
+        case dxgi_format_bc3_typeless: case dxgi_format_bc3_unorm: return COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        case dxgi_format_bc3_unorm_srgb: return COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT;
+        case dxgi_format_bc4_typeless: case dxgi_format_bc4_unorm: return COMPRESSED_RED_RGTC1;
+        case dxgi_format_bc4_snorm: return COMPRESSED_SIGNED_RED_RGTC1;
+        case dxgi_format_bc5_typeless: case dxgi_format_bc5_unorm: return COMPRESSED_RG_RGTC2;
+        case dxgi_format_bc5_snorm: return COMPRESSED_SIGNED_RG_RGTC2;
+        case dxgi_format_bc6h_typeless: case dxgi_format_bc6h_uf16: return COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT;
+        case dxgi_format_bc6h_sf16: return COMPRESSED_RGB_BPTC_SIGNED_FLOAT;
+        case dxgi_format_bc7_typeless: case dxgi_format_bc7_unorm: return COMPRESSED_RGBA_BPTC_UNORM;
+        case dxgi_format_bc7_unorm_srgb: return COMPRESSED_SRGB_ALPHA_BPTC_UNORM;
+      }
+      return 0;
     }
+  public:
+    /// Layout of the texture data in a DDS file.
+    struct dds_info {
+      unsigned format;
+      unsigned width;
+      unsigned height;
+      unsigned mip_levels;
 
-    // see http://www.opengl.org/registry/specs/EXT/texture_compression_s3tc.txt
-    // a s3tc dirty hack.
-    void hack_s3(uint8_t *image, unsigned dxt, unsigned width, unsigned height, const uint8_t *src, const uint8_t *src_max) {
-      unsigned max_bytes = (width) * (height) * 8;
-      if (dxt != 1) max_bytes *= 2;
-      //if (src_max - src > max_bytes) return; // oops
-
-      for (unsigned y = 0; y != height; ++y) {
-        uint8_t *dest = (uint8_t *)( image + y * (width * 4) );
-        for (unsigned x = 0; x != width; ++x) {
-          if (dxt == 1) {
-            hack_dxt1(dest, src+8, width * 4, false);
-            src += 8;
-          } else if (dxt <= 3) {
-            hack_dxt1(dest, src+8, width * 4, true);
-            hack_dxt3(dest, src, width * 4);
-            src += 16;
-          } else {
-            hack_dxt1(dest, src+8, width * 4, true);
-            hack_dxt5(dest, src, width * 4);
-            src += 16;
-          }
-          dest += 4;
-        }
+      /// offset of the first block of the top mip level from the start of the file.
+      size_t data_offset;
+
+      /// bytes of block data for all the mip levels we can use.
+      size_t data_size;
+    };
+
+    /// bytes per 4x4 block
+    static unsigned block_bytes(unsigned format) {
+      switch (format) {
+        case COMPRESSED_RGB_S3TC_DXT1_EXT: case COMPRESSED_RGBA_S3TC_DXT1_EXT:
+        case COMPRESSED_SRGB_S3TC_DXT1_EXT: case COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT:
+        case COMPRESSED_RED_RGTC1: case COMPRESSED_SIGNED_RED_RGTC1:
+          return 8;
       }
+      return 16;
     }
 
-    static void swap(uint32_t &a, uint32_t &b) {
-      uint32_t t = a; a =  b; b = t;
+    /// size in bytes of one mip level
+    static size_t level_size(unsigned format, unsigned width, unsigned height) {
+      return (size_t)((width + 3) / 4) * ((height + 3) / 4) * block_bytes(format);
     }
 
-    static void swap(uint8_t &a, uint8_t &b) {
-      uint8_t t = a; a =  b; b = t;
+  private:
+    // source row for row r of a block with "rows" rows in use.
+    static unsigned flip_row(unsigned r, unsigned rows) {
+      return r < rows ? rows - 1 - r : r;
     }
 
-    static void swap3(uint8_t *p1, uint8_t *p2) {
-      // 00011122 23334445 55666777
-      // 44455566 67770001 11222333
-      unsigned s1 = p1[0] + p1[1] * 0x100 + p1[2] * 0x10000;
-      unsigned s2 = p2[0] + p2[1] * 0x100 + p2[2] * 0x10000;
-      s1 = ( s1 >> 12 ) | ( s1 << 12 );
-      s2 = ( s2 >> 12 ) | ( s2 << 12 );
-      p1[0] = (s2 >> 0) & 0xff;
-      p1[1] = (s2 >> 8) & 0xff;
-      p1[2] = (s2 >> 16) & 0xff;
-      p2[0] = (s1 >> 0) & 0xff;
-      p2[1] = (s1 >> 8) & 0xff;
-      p2[2] = (s1 >> 16) & 0xff;
+    // BC1 colour block: two colours then one byte of 2 bit indices per row.
+    static void flip_colour_block(uint8_t *dest, const uint8_t *src, unsigned rows) {
+      memcpy(dest, src, 4);
+      for (unsigned r = 0; r != 4; ++r) {
+        dest[4 + r] = src[4 + flip_row(r, rows)];
+      }
     }
 
-    void flip_dxt1(dynarray<uint8_t> &image, unsigned width, unsigned height) {
-      unsigned offset = 0;
-      while (width >= 4 && height >= 4) {
-        unsigned xmax = width < 4 ? 1 : width/4;
-        unsigned ymax = height < 4 ? 1 : height/4;
-        if (offset + xmax * ymax * 8 > image.size()) break; 
-        for (unsigned y = 0; y < height/8; y++) {
-          uint8_t *p1 = &image[offset + (y * xmax) * 8];
-          uint8_t *p2 = &image[offset + ((ymax - y - 1) * xmax) * 8];
-          for (unsigned x = 0; x < width/4; x++) {
-            swap((uint32_t&)p1[0], (uint32_t&)p2[0]);
-            swap(p1[4], p2[7]);
-            swap(p1[5], p2[6]);
-            swap(p1[6], p2[5]);
-            swap(p1[7], p2[4]);
-            p1 += 8;
-            p2 += 8;
-          }
-        }
-        width >>= 1;
-        height >>= 1;
-        offset += xmax * ymax * 8;
+    // BC2 alpha: two bytes of 4 bit alphas per row.
+    static void flip_explicit_alpha(uint8_t *dest, const uint8_t *src, unsigned rows) {
+      for (unsigned r = 0; r != 4; ++r) {
+        unsigned s = flip_row(r, rows);
+        dest[r * 2 + 0] = src[s * 2 + 0];
+        dest[r * 2 + 1] = src[s * 2 + 1];
       }
     }
 
-    void flip_dxt3(dynarray<uint8_t> &image, unsigned width, unsigned height) {
-      unsigned offset = 0;
-      while (width >= 4 && height >= 4) {
-        unsigned xmax = width < 4 ? 1 : width/4;
-        unsigned ymax = height < 4 ? 1 : height/4;
-        if (offset + xmax * ymax * 16 > image.size()) break; 
-        for (unsigned y = 0; y < height/8; y++) {
-          uint8_t *p1 = &image[offset + (y * xmax) * 16];
-          uint8_t *p2 = &image[offset + ((ymax - y - 1) * xmax) * 16];
-          for (unsigned x = 0; x < width/4; x++) {
-            swap(p1[0], p2[6]);
-            swap(p1[1], p2[7]);
-            swap(p1[2], p2[4]);
-            swap(p1[3], p2[5]);
-            swap(p1[4], p2[2]);
-            swap(p1[5], p2[3]);
-            swap(p1[6], p2[0]);
-            swap(p1[7], p2[1]);
-            p1 += 8;
-            p2 += 8;
-            swap((uint32_t&)p1[0], (uint32_t&)p2[0]);
-            swap(p1[4], p2[7]);
-            swap(p1[5], p2[6]);
-            swap(p1[6], p2[5]);
-            swap(p1[7], p2[4]);
-            p1 += 8;
-            p2 += 8;
+    // BC3 alpha, BC4 and BC5 channels: two endpoints then 12 bits of 3 bit indices per row.
+    static void flip_interpolated_alpha(uint8_t *dest, const uint8_t *src, unsigned rows) {
+      dest[0] = src[0];
+      dest[1] = src[1];
+      uint64_t bits = 0, result = 0;
+      for (unsigned i = 0; i != 6; ++i) {
+        bits |= (uint64_t)src[2 + i] << (i * 8);
+      }
+      for (unsigned r = 0; r != 4; ++r) {
+        result |= ((bits >> (flip_row(r, rows) * 12)) & 0xfff) << (r * 12);
+      }
+      for (unsigned i = 0; i != 6; ++i) {
+        dest[2 + i] = (uint8_t)(result >> (i * 8));
+      }
+    }
+
+    static void flip_block(unsigned format, uint8_t *dest, const uint8_t *src, unsigned rows) {
+      switch (format) {
+        case COMPRESSED_RGB_S3TC_DXT1_EXT: case COMPRESSED_RGBA_S3TC_DXT1_EXT:
+        case COMPRESSED_SRGB_S3TC_DXT1_EXT: case COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT:
+          flip_colour_block(dest, src, rows);
+          break;
+        case COMPRESSED_RGBA_S3TC_DXT3_EXT: case COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT:
+          flip_explicit_alpha(dest, src, rows);
+          flip_colour_block(dest + 8, src + 8, rows);
+          break;
+        case COMPRESSED_RGBA_S3TC_DXT5_EXT: case COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT:
+          flip_interpolated_alpha(dest, src, rows);
+          flip_colour_block(dest + 8, src + 8, rows);
+          break;
+        case COMPRESSED_RED_RGTC1: case COMPRESSED_SIGNED_RED_RGTC1:
+          flip_interpolated_alpha(dest, src, rows);
+          break;
+        case COMPRESSED_RG_RGTC2: case COMPRESSED_SIGNED_RG_RGTC2:
+          flip_interpolated_alpha(dest, src, rows);
+          flip_interpolated_alpha(dest + 8, src + 8, rows);
+          break;
+      }
+    }
+
+  public:
+    /// True if flip_chain() can turn this file upside down.
+    /// BC6H and BC7 can't be flipped, nor can heights that split rows across blocks.
+    static bool can_flip(unsigned format, unsigned height) {
+      return format < COMPRESSED_RGBA_BPTC_UNORM && (height & (height - 1)) == 0;
+    }
+
+    /// Copy the blocks of every mip level, upside down, so that row zero is the bottom.
+    /// dest and src must not overlap; src points to the first block (see dds_info::data_offset).
+    static void flip_chain(uint8_t *dest, const uint8_t *src, unsigned format, unsigned width, unsigned height, unsigned mip_levels) {
+      unsigned bytes = block_bytes(format);
+      for (unsigned level = 0; level != mip_levels; ++level) {
+        unsigned blocks_x = (width + 3) / 4, blocks_y = (height + 3) / 4;
+        unsigned rows = height < 4 ? height : 4;
+        size_t row_bytes = (size_t)blocks_x * bytes;
+        for (unsigned y = 0; y != blocks_y; ++y) {
+          const uint8_t *s = src + (blocks_y - 1 - y) * row_bytes;
+          uint8_t *d = dest + y * row_bytes;
+          for (unsigned x = 0; x != blocks_x; ++x) {
+            flip_block(format, d + x * bytes, s + x * bytes, rows);
           }
         }
-        width >>= 1;
-        height >>= 1;
-        offset += xmax * ymax * 16;
+        src += row_bytes * blocks_y;
+        dest += row_bytes * blocks_y;
+        width = width > 1 ? width >> 1 : 1;
+        height = height > 1 ? height >> 1 : 1;
       }
     }
 
-    void flip_dxt5(dynarray<uint8_t> &image, unsigned width, unsigned height) {
-      unsigned offset = 0;
-      while (width >= 4 && height >= 4) {
-        unsigned xmax = width < 4 ? 1 : width/4;
-        unsigned ymax = height < 4 ? 1 : height/4;
-        if (offset + xmax * ymax * 16 > image.size()) break; 
-        for (unsigned y = 0; y < height/8; y++) {
-          uint8_t *p1 = &image[offset + (y * xmax) * 16];
-          uint8_t *p2 = &image[offset + ((ymax - y - 1) * xmax) * 16];
-          for (unsigned x = 0; x < width/4; x++) {
-            // swap alphas
-            swap(p1[0], p2[0]);
-            swap(p1[1], p2[1]);
-            // swap 3 bit indices
-            swap3(p1+2, p2+5);
-            swap3(p1+5, p2+2);
-            p1 += 8;
-            p2 += 8;
-            swap((uint32_t&)p1[0], (uint32_t&)p2[0]);
-            swap(p1[4], p2[7]);
-            swap(p1[5], p2[6]);
-            swap(p1[6], p2[5]);
-            swap(p1[7], p2[4]);
-            p1 += 8;
-            p2 += 8;
+    /// Check the headers and find the mip chain without touching the data.
+    /// Returns false (with a warning) if we can't upload this file directly.
+    bool get_info(dds_info &info, const uint8_t *src, const uint8_t *src_max) {
+      if (src_max - src < header_size) return false;
+      const dds_header *header = (const dds_header*)src;
+      if (le4(header->magic) != dds_magic || le4(header->size) != 124 || le4(header->pf.size) != 32) {
+        printf("warning: bad DDS header\n");
+        return false;
+      }
+
+      unsigned flags = le4(header->flags);
+      unsigned caps2 = le4(header->caps.caps2);
+      if (caps2 & (ddscaps2_cubemap | ddscaps2_volume)) {
+        printf("warning: DDS decoder only supports 2D textures\n");
+        return false;
+      }
+
+      info.width = le4(header->width);
+      info.height = le4(header->height);
+      info.mip_levels = (flags & ddsd_mipmapcount) ? le4(header->mipmap_count) : 1;
+      info.data_offset = header_size;
+      info.format = 0;
+      if (info.mip_levels == 0) info.mip_levels = 1;
+      if (info.width == 0 || info.height == 0 || info.width > 0xffff || info.height > 0xffff) {
+        printf("warning: bad DDS dimensions\n");
+        return false;
+      }
+
+      if (le4(header->pf.flags) & ddpf_fourcc) {
+        unsigned code = le4(header->pf.fourcc);
+        if (code == fourcc('D', 'X', '1', '0')) {
+          if (src_max - src < header_size + dx10_header_size) return false;
+          const dds_header_dx10 *dx10 = (const dds_header_dx10*)(src + header_size);
+          info.data_offset += dx10_header_size;
+          if (
+            le4(dx10->resource_dimension) != d3d10_resource_dimension_texture2d ||
+            (le4(dx10->misc_flag) & d3d10_resource_misc_texturecube) || le4(dx10->array_size) > 1
+          ) {
+            printf("warning: DDS decoder only supports 2D textures\n");
+            return false;
           }
+          info.format = get_dxgi_format(le4(dx10->dxgi_format));
+        } else {
+          info.format = get_fourcc_format(code);
         }
-        width >>= 1;
-        height >>= 1;
-        offset += xmax * ymax * 16;
       }
+
+      if (info.format == 0) {
+        printf("warning: DDS decoder only supports BC1-BC7\n");
+        return false;
+      }
+
+      // use as many levels as are actually in the file.
+      size_t avail = (size_t)(src_max - src) - info.data_offset;
+      size_t size = 0;
+      unsigned w = info.width, h = info.height;
+      unsigned level = 0;
+      for (; level != info.mip_levels; ++level) {
+        size_t bytes = level_size(info.format, w, h);
+        if (size + bytes > avail) break;
+        size += bytes;
+        if (w == 1 && h == 1) { ++level; break; }
+        w = w > 1 ? w >> 1 : 1;
+        h = h > 1 ? h >> 1 : 1;
+      }
+
+      if (level == 0) {
+        printf("warning: truncated DDS file\n");
+        return false;
+      }
+      info.mip_levels = level;
+      info.data_size = size;
+      return true;
     }
-  public:
-    // get an opengl texture from a file in memory
+
+    /// get the blocks of a DDS file, bottom row first if can_flip() allows it.
     void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width, uint16_t &height, const uint8_t *src, const uint8_t *src_max) {
-      // convert the data
-      dds_header *header = (dds_header*)src;
-
-      if (le4(header->magic) != dds_magic) return;
-
-      unsigned pf_flags = le4(header->pf.flags);
-
-      if (pf_flags & ddpf_fourcc) {
-        uint8_t *fourcc = header->pf.fourcc;
-        if (fourcc[0] == 'D' && fourcc[1] == 'X' && fourcc[2] == 'T') {
-          width = le4(header->width);
-          height = le4(header->height);
-
-          format =
-            fourcc[3] == '1' ? COMPRESSED_RGB_S3TC_DXT1_EXT :
-            fourcc[3] == '3' ? COMPRESSED_RGBA_S3TC_DXT3_EXT :
-            fourcc[3] == '5' ? COMPRESSED_RGBA_S3TC_DXT5_EXT :
-            0
-          ;
-          unsigned size = (unsigned)(src_max - src - 128);
-          image.resize(size);
-          memcpy(&image[0], src + 128, size);
-
-          // dds textures are upside down, flip them!
-          switch (format) {
-            case COMPRESSED_RGB_S3TC_DXT1_EXT: flip_dxt1(image, width, height); break;
-            case COMPRESSED_RGBA_S3TC_DXT3_EXT: flip_dxt3(image, width, height); break;
-            case COMPRESSED_RGBA_S3TC_DXT5_EXT: flip_dxt5(image, width, height); break;
-          }
-          return;
-        }
+      dds_info info;
+      if (!get_info(info, src, src_max)) return;
+      format = (uint16_t)info.format;
+      width = (uint16_t)info.width;
+      height = (uint16_t)info.height;
+      image.resize(info.data_size);
+      if (can_flip(info.format, info.height)) {
+        flip_chain(&image[0], src + info.data_offset, info.format, info.width, info.height, info.mip_levels);
+      } else {
+        memcpy(&image[0], src + info.data_offset, info.data_size);
       }
-      printf("warning: DDS decoder only supports DXTn\n");
     }
   };
 }}
@@ -34,5 +34,9 @@
   #include "../loaders/tga_decoder.h"
   #include "../loaders/dds_decoder.h"
   #include "../loaders/nifti_decoder.h"
+  #include "../loaders/mip_builder.h"
+  #include "../loaders/bc_encoder.h"
+  #include "../loaders/number_parser.h"
+  #include "../loaders/wav_decoder.h"
 
 #endif
@@ -0,0 +1,253 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+//
+// Gamma correct mipmap generation
+//
+
+namespace octet { namespace loaders {
+  /// Class for making mip levels of 8 bit images.
+  ///
+  /// Colour channels are converted from sRGB to linear before filtering and back again after,
+  /// so that mips do not get darker. Alpha is filtered linearly: it is the second channel of
+  /// two channel (luminance + alpha) images and the fourth channel of RGBA images.
+  ///
+  /// The filter is separable; filter_rows makes the horizontal pass into a float buffer
+  /// and resolve_rows makes the vertical pass. Both work on ranges of rows so that the
+  /// caller can spread the work over threads.
+  ///
+  /// Example:
+  ///
+  ///     mip_builder mb;
+  ///     dynarray<float> tmp(sh * dw * comps);
+  ///     mb.filter_rows(tmp.data(), dw, src, sw, comps, 0, sh);
+  ///     mb.resolve_rows(dest, dw, tmp.data(), sh, comps, 0, dh);
+  class mip_builder {
+  public:
+    enum filter_t {
+      filter_box,      // 2x2 average, the old filter
+      filter_lanczos,  // 3 lobe windowed sinc; sharp
+      filter_kaiser,   // kaiser windowed sinc; fewer ringing artifacts
+    };
+
+  private:
+    filter_t filter;
+    bool srgb;
+
+    float to_linear[256];
+    uint8_t to_srgb[4096];
+
+    // for each destination pixel, the first source pixel and a set of weights.
+    struct filter_table {
+      dynarray<int> first;
+      dynarray<float> weights;
+      int taps;
+    };
+
+    static float sinc(float x) {
+      if (fabsf(x) < 1e-5f) return 1.0f;
+      x *= 3.14159265f;
+      return sinf(x) / x;
+    }
+
+    // zeroth order modified bessel function of the first kind
+    static float bessel_i0(float x) {
+      float sum = 1, term = 1, x2 = x * x * 0.25f;
+      for (int k = 1; k != 16; ++k) {
+        term *= x2 / (float)(k * k);
+        sum += term;
+      }
+      return sum;
+    }
+
+    float get_radius() const {
+      return filter == filter_box ? 0.5f : 3.0f;
+    }
+
+    float kernel(float x) const {
+      float ax = fabsf(x);
+      switch (filter) {
+        case filter_box: return ax <= 0.5f ? 1.0f : 0.0f;
+        case filter_lanczos: return ax < 3.0f ? sinc(x) * sinc(x * (1.0f/3)) : 0.0f;
+        default: {
+          if (ax >= 3.0f) return 0.0f;
+          const float alpha = 4.0f;
+          float t = x * (1.0f/3);
+          return sinc(x) * bessel_i0(alpha * sqrtf(1 - t * t)) / bessel_i0(alpha);
+        }
+      }
+    }
+
+    void make_table(filter_table &table, unsigned src_size, unsigned dest_size) const {
+      float scale = (float)src_size / dest_size;
+      float support = get_radius() * scale;
+      table.taps = (int)ceilf(support * 2) + 1;
+      table.first.resize(dest_size);
+      table.weights.resize(dest_size * table.taps);
+      for (unsigned d = 0; d != dest_size; ++d) {
+        float centre = (d + 0.5f) * scale;
+        int first = (int)floorf(centre - support);
+        float *w = &table.weights[d * table.taps];
+        float total = 0;
+        for (int t = 0; t != table.taps; ++t) {
+          w[t] = kernel((first + t + 0.5f - centre) / scale);
+          total += w[t];
+        }
+        float rtotal = total != 0 ? 1.0f / total : 0;
+        for (int t = 0; t != table.taps; ++t) {
+          w[t] *= rtotal;
+        }
+        table.first[d] = first;
+      }
+    }
+
+    // the channel to filter linearly, or none for one and three channel images.
+    static unsigned alpha_channel(unsigned num_comps) {
+      return num_comps == 2 ? 1 : num_comps == 4 ? 3 : ~0u;
+    }
+
+    // the last table made; the caller makes one level at a time.
+    filter_table htable;
+    filter_table vtable;
+
+  public:
+    mip_builder(filter_t filter = filter_kaiser, bool srgb = true) : filter(filter), srgb(srgb) {
+      for (int i = 0; i != 256; ++i) {
+        float c = i * (1.0f/255);
+        to_linear[i] = !srgb ? c : c <= 0.04045f ? c * (1.0f/12.92f) : powf((c + 0.055f) * (1.0f/1.055f), 2.4f);
+      }
+      for (int i = 0; i != 4096; ++i) {
+        float c = i * (1.0f/4095);
+        float s = !srgb ? c : c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f/2.4f) - 0.055f;
+        to_srgb[i] = (uint8_t)(s * 255 + 0.5f);
+      }
+    }
+
+    /// number of levels in a full mip chain, including the top one.
+    static unsigned num_levels(unsigned width, unsigned height) {
+      unsigned levels = 1;
+      while (width > 1 || height > 1) {
+        width = width > 1 ? width >> 1 : 1;
+        height = height > 1 ? height >> 1 : 1;
+        levels++;
+      }
+      return levels;
+    }
+
+    /// bytes in a full mip chain.
+    static size_t chain_size(unsigned width, unsigned height, unsigned num_comps) {
+      size_t size = 0;
+      for (unsigned i = num_levels(width, height); i != 0; --i) {
+        size += (size_t)width * height * num_comps;
+        width = width > 1 ? width >> 1 : 1;
+        height = height > 1 ? height >> 1 : 1;
+      }
+      return size;
+    }
+
+    /// Set up the filter for one level. Call this before filter_rows and resolve_rows.
+    void begin_level(unsigned src_width, unsigned src_height, unsigned dest_width, unsigned dest_height) {
+      make_table(htable, src_width, dest_width);
+      make_table(vtable, src_height, dest_height);
+    }
+
+    /// Horizontal pass: linearise and filter source rows [y0, y1) into tmp (src_height x dest_width x num_comps floats).
+    void filter_rows(float *tmp, unsigned dest_width, const uint8_t *src, unsigned src_width, unsigned num_comps, unsigned y0, unsigned y1) const {
+      int taps = htable.taps;
+      int max_x = (int)src_width - 1;
+      unsigned alpha = alpha_channel(num_comps);
+      for (unsigned y = y0; y != y1; ++y) {
+        const uint8_t *row = src + (size_t)y * src_width * num_comps;
+        float *dest = tmp + (size_t)y * dest_width * num_comps;
+        for (unsigned x = 0; x != dest_width; ++x) {
+          const float *w = &htable.weights[x * taps];
+          int first = htable.first[x];
+          float acc[4] = { 0, 0, 0, 0 };
+          for (int t = 0; t != taps; ++t) {
+            if (w[t] == 0) continue;
+            int sx = std::min(std::max(first + t, 0), max_x);
+            const uint8_t *p = row + sx * num_comps;
+            for (unsigned c = 0; c != num_comps; ++c) {
+              acc[c] += w[t] * (c == alpha ? p[c] * (1.0f/255) : to_linear[p[c]]);
+            }
+          }
+          for (unsigned c = 0; c != num_comps; ++c) {
+            *dest++ = acc[c];
+          }
+        }
+      }
+    }
+
+    /// Vertical pass: filter tmp into destination rows [y0, y1) and convert back to 8 bits.
+    void resolve_rows(uint8_t *dest, unsigned dest_width, const float *tmp, unsigned src_height, unsigned num_comps, unsigned y0, unsigned y1) const {
+      int taps = vtable.taps;
+      int max_y = (int)src_height - 1;
+      unsigned alpha = alpha_channel(num_comps);
+      size_t row_floats = (size_t)dest_width * num_comps;
+      for (unsigned y = y0; y != y1; ++y) {
+        const float *w = &vtable.weights[y * taps];
+        int first = vtable.first[y];
+        uint8_t *d = dest + (size_t)y * row_floats;
+        for (size_t i = 0; i != row_floats; ++i) {
+          float acc = 0;
+          for (int t = 0; t != taps; ++t) {
+            if (w[t] == 0) continue;
+            int sy = std::min(std::max(first + t, 0), max_y);
+            acc += w[t] * tmp[sy * row_floats + i];
+          }
+          acc = std::min(std::max(acc, 0.0f), 1.0f);
+          d[i] = (i % num_comps) == alpha ? (uint8_t)(acc * 255 + 0.5f) : to_srgb[(int)(acc * 4095 + 0.5f)];
+        }
+      }
+    }
+  };
+
+  #if OCTET_UNIT_TEST
+    /// Reduce 2x2 black and white checkerboards to one pixel.
+    /// Colour averages in linear space, so 0 and 255 make sRGB 188 and not 128. Alpha averages to 128.
+    class mip_builder_unit_test {
+      static void reduce(uint8_t *dest, const uint8_t *src, unsigned num_comps, mip_builder::filter_t filter, bool srgb) {
+        mip_builder mb(filter, srgb);
+        float tmp[2 * 4];
+        mb.begin_level(2, 2, 1, 1);
+        mb.filter_rows(tmp, 1, src, 2, num_comps, 0, 2);
+        mb.resolve_rows(dest, 1, tmp, 2, num_comps, 0, 1);
+      }
+
+      static bool near(int value, int expected) {
+        return value >= expected - 1 && value <= expected + 1;
+      }
+
+    public:
+      mip_builder_unit_test() {
+        static const mip_builder::filter_t filters[] = { mip_builder::filter_box, mip_builder::filter_lanczos, mip_builder::filter_kaiser };
+        for (unsigned f = 0; f != 3; ++f) {
+          // RGBA: white and clear, black and opaque.
+          static const uint8_t rgba[] = { 255, 255, 255, 0,  0, 0, 0, 255,  0, 0, 0, 255,  255, 255, 255, 0 };
+          uint8_t d[4];
+          reduce(d, rgba, 4, filters[f], true);
+          assert(near(d[0], 188) && near(d[1], 188) && near(d[2], 188) && near(d[3], 128));
+          reduce(d, rgba, 4, filters[f], false);
+          assert(near(d[0], 128) && near(d[3], 128));
+
+          // luminance + alpha: the second channel is alpha.
+          static const uint8_t la[] = { 255, 0,  0, 255,  0, 255,  255, 0 };
+          reduce(d, la, 2, filters[f], true);
+          assert(near(d[0], 188) && near(d[1], 128));
+
+          // RGB and luminance have no alpha.
+          static const uint8_t rgb[] = { 0, 255, 0,  255, 0, 255,  255, 0, 255,  0, 255, 0 };
+          reduce(d, rgb, 3, filters[f], true);
+          assert(near(d[0], 188) && near(d[1], 188) && near(d[2], 188));
+          static const uint8_t l[] = { 255, 0, 0, 255 };
+          reduce(d, l, 1, filters[f], true);
+          assert(near(d[0], 188));
+        }
+      }
+    };
+    static mip_builder_unit_test mip_builder_unit_test;
+  #endif
+}}
@@ -7,11 +7,13 @@
 //
 namespace octet { namespace loaders {
   /// NIFTI NMR data decoder. ie. 3d textures.
-  /// This loader only handles very simple NIFTI files.
+  ///
+  /// get_image loads the first frame of a small file into memory.
+  /// For large 4D series, use get_info and read voxels from a file_map (see scene::brick_volume).
   class nifti_decoder {
-    unsigned vox_offset;
-    unsigned layer_stride;
-    unsigned frame_stride;
+    uint64_t vox_offset;
+    uint64_t layer_stride;
+    uint64_t frame_stride;
 
     struct nifti_header {
       int      sizeof_hdr;    /// MUST be 348
@@ -68,43 +70,194 @@ namespace octet { namespace loaders {
     };
 
   public:
+    /// NIFTI datatype codes
+    enum {
+      dt_uint8 = 2,
+      dt_int16 = 4,
+      dt_int32 = 8,
+      dt_float32 = 16,
+      dt_float64 = 64,
+      dt_rgb24 = 128,
+      dt_int8 = 256,
+      dt_uint16 = 512,
+      dt_uint32 = 768,
+      dt_rgba32 = 2304,
+
+      header_size = 348,
+    };
+
+    /// Layout of the voxels in a NIFTI file.
+    struct nifti_info {
+      unsigned width;
+      unsigned height;
+      unsigned depth;
+      unsigned frames;
+      unsigned datatype;
+      unsigned voxel_bytes;
+
+      /// file value * slope + inter gives the real value.
+      float slope;
+      float inter;
+
+      /// display range from the header. cal_max <= cal_min if not set.
+      float cal_min;
+      float cal_max;
+
+      /// voxel spacing in x, y and z
+      float spacing[3];
+
+      /// offset of the first voxel. In a .hdr/.img pair, this is in the .img file.
+      uint64_t vox_offset;
+      uint64_t frame_stride;
+
+      /// true for "ni1" files, where the voxels are in a separate .img file.
+      bool separate_image;
+    };
+
+    /// true for single value per voxel types.
+    static bool is_scalar(unsigned datatype) {
+      switch (datatype) {
+        case dt_uint8: case dt_int8: case dt_uint16: case dt_int16:
+        case dt_uint32: case dt_int32: case dt_float32: case dt_float64:
+          return true;
+      }
+      return false;
+    }
+
+    /// bytes per voxel for a datatype, or zero if we don't support it.
+    static unsigned get_voxel_bytes(unsigned datatype) {
+      switch (datatype) {
+        case dt_uint8: case dt_int8: return 1;
+        case dt_uint16: case dt_int16: return 2;
+        case dt_rgb24: return 3;
+        case dt_uint32: case dt_int32: case dt_float32: case dt_rgba32: return 4;
+        case dt_float64: return 8;
+      }
+      return 0;
+    }
+
+    /// read a scalar voxel and scale it to its real value.
+    static float get_scalar(const nifti_info &info, const uint8_t *p) {
+      float v = 0;
+      switch (info.datatype) {
+        case dt_uint8: v = (float)p[0]; break;
+        case dt_int8: v = (float)(int8_t)p[0]; break;
+        case dt_uint16: { uint16_t x; memcpy(&x, p, 2); v = (float)x; } break;
+        case dt_int16: { int16_t x; memcpy(&x, p, 2); v = (float)x; } break;
+        case dt_uint32: { uint32_t x; memcpy(&x, p, 4); v = (float)x; } break;
+        case dt_int32: { int32_t x; memcpy(&x, p, 4); v = (float)x; } break;
+        case dt_float32: { memcpy(&v, p, 4); } break;
+        case dt_float64: { double x; memcpy(&x, p, 8); v = (float)x; } break;
+      }
+      return v * info.slope + info.inter;
+    }
+
+    /// Read the header. Does not need the voxels, so src_max may be the end of the header.
+    static bool get_info(nifti_info &info, const uint8_t *src, const uint8_t *src_max) {
+      if (src_max - src < header_size) return false;
+      nifti_header header;
+      memcpy(&header, src, sizeof(header));
+
+      if (header.sizeof_hdr != header_size) {
+        log("warning: NIFTI header size wrong (big endian files are not supported)\n");
+        return false;
+      }
+
+      if (memcmp(header.magic, "ni1", 4) && memcmp(header.magic, "n+1", 4)) {
+        log("warning: not a NIFTI file\n");
+        return false;
+      }
+
+      if (header.dim[0] < 3 || header.dim[0] > 4 || header.dim[1] <= 0 || header.dim[2] <= 0 || header.dim[3] <= 0) {
+        log("warning: NIFTI image type not supported (dim[0] = %d)\n", header.dim[0]);
+        return false;
+      }
+
+      info.datatype = (unsigned)(uint16_t)header.datatype;
+      info.voxel_bytes = get_voxel_bytes(info.datatype);
+      if (info.voxel_bytes == 0 || info.voxel_bytes * 8 != (unsigned)header.bitpix) {
+        log("warning: NIFTI datatype %d not supported\n", header.datatype);
+        return false;
+      }
+
+      info.width = header.dim[1];
+      info.height = header.dim[2];
+      info.depth = header.dim[3];
+      info.frames = header.dim[0] == 4 && header.dim[4] > 0 ? header.dim[4] : 1;
+      info.slope = header.scl_slope != 0 && header.scl_slope == header.scl_slope ? header.scl_slope : 1.0f;
+      info.inter = header.scl_slope != 0 && header.scl_inter == header.scl_inter ? header.scl_inter : 0.0f;
+      info.cal_min = header.cal_min;
+      info.cal_max = header.cal_max;
+      for (int i = 0; i != 3; ++i) {
+        info.spacing[i] = header.pixdim[i+1] > 0 ? header.pixdim[i+1] : 1.0f;
+      }
+      info.separate_image = header.magic[1] == 'i';
+      info.vox_offset = (uint64_t)header.vox_offset;
+      info.frame_stride = (uint64_t)info.width * info.height * info.depth * info.voxel_bytes;
+      return true;
+    }
+
     /// get data for a texture in memory.
+    /// Scalar data is scaled to 8 bits using the display range (or the data range if none is given).
     void get_image(dynarray<uint8_t> &bytes, uint16_t &format, uint16_t &width, uint16_t &height, uint16_t &depth, uint32_t &frames, const uint8_t *src, const uint8_t *src_max) {
-      // convert the data
-      nifti_header header = *(nifti_header*)src;
-    
       width = 0;
       height = 0;
       format = 0;
 
-      if (header.dim[0] != 4) {
-        log("warning: NIFTI image type not supported (dim[0] = %d)\n", header.dim[0]);
+      nifti_info info;
+      if (!get_info(info, src, src_max)) {
         return;
       }
 
-      width = header.dim[1];
-      height = header.dim[2];
-      depth = header.dim[3];
-      frames = 1; //header.dim[4];
-      vox_offset = (int)header.vox_offset;
-      layer_stride = width * height * header.bitpix / 8;
-      frame_stride = layer_stride * depth;
-      unsigned size = frame_stride * frames;
+      if (info.separate_image) {
+        log("warning: NIFTI .hdr/.img pairs are not supported here, use brick_volume\n");
+        return;
+      }
+
+      vox_offset = info.vox_offset;
+      layer_stride = (uint64_t)info.width * info.height * info.voxel_bytes;
+      frame_stride = info.frame_stride;
 
-      if ((int)header.vox_offset + (int)size > src_max - src) {
+      if (vox_offset + frame_stride > (uint64_t)(src_max - src)) {
         log("warning: NIFTI image too small\n");
         return;
       }
 
-      format = header.bitpix == 24 ? 0x1907 : 0x1908; // GL_RGB / GL_RGBA
+      width = (uint16_t)info.width;
+      height = (uint16_t)info.height;
+      depth = (uint16_t)info.depth;
+      frames = info.frames;
 
       // get one frame (of 3D data)
-      bytes.resize(frame_stride);
-      memcpy(&bytes[0], src + vox_offset, frame_stride);
+      const uint8_t *vox = src + vox_offset;
+      size_t num_voxels = (size_t)info.width * info.height * info.depth;
+      if (info.datatype == dt_rgb24 || info.datatype == dt_rgba32) {
+        format = info.datatype == dt_rgb24 ? 0x1907 : 0x1908; // GL_RGB / GL_RGBA
+        bytes.resize((size_t)frame_stride);
+        memcpy(&bytes[0], vox, (size_t)frame_stride);
+      } else {
+        float lo = info.cal_min, hi = info.cal_max;
+        if (hi <= lo) {
+          lo = 1e37f; hi = -1e37f;
+          for (size_t i = 0; i != num_voxels; ++i) {
+            float v = get_scalar(info, vox + i * info.voxel_bytes);
+            lo = std::min(lo, v);
+            hi = std::max(hi, v);
+          }
+        }
+        float scale = hi > lo ? 255.0f / (hi - lo) : 0.0f;
+
+        format = 0x1909; // GL_LUMINANCE
+        bytes.resize(num_voxels);
+        for (size_t i = 0; i != num_voxels; ++i) {
+          float v = (get_scalar(info, vox + i * info.voxel_bytes) - lo) * scale;
+          bytes[i] = (uint8_t)std::min(std::max(v + 0.5f, 0.0f), 255.0f);
+        }
+      }
     }
 
     /// get the offset of a specific layer in a specific frame.
-    unsigned get_layer_offset(unsigned layer, unsigned frame) {
+    uint64_t get_layer_offset(unsigned layer, unsigned frame) {
       return vox_offset + layer * layer_stride + frame * frame_stride;
     }
   };
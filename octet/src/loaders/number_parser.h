@@ -0,0 +1,273 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Fast parsing of numbers in text files.
+//
+
+namespace octet { namespace loaders {
+  /// Class for converting long runs of whitespace separated numbers, as in COLLADA and OBJ files.
+  ///
+  /// Runs of eight digits are converted at once by treating them as a 64 bit integer
+  /// and combining pairs of digits with multiplies (SIMD within a register), so long
+  /// mantissas cost a few instructions rather than a loop iteration per digit.
+  ///
+  /// Example:
+  ///
+  ///     dynarray<float> values;
+  ///     number_parser::parse_floats(values, text, text + strlen(text));
+  class number_parser {
+    static bool is_space(char c) {
+      return c > 0 && c <= ' ';
+    }
+
+    static bool is_digit(char c) {
+      return (unsigned)(c - '0') < 10;
+    }
+
+    static bool is_little_endian() {
+      uint16_t x = 1;
+      return *(uint8_t*)&x == 1;
+    }
+
+    static uint64_t load8(const char *p) {
+      uint64_t v;
+      memcpy(&v, p, 8);
+      return v;
+    }
+
+    // true if all eight bytes are '0'..'9'
+    static bool is_eight_digits(uint64_t v) {
+      return (((v & 0xF0F0F0F0F0F0F0F0ull) | (((v + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) >> 4)) == 0x3333333333333333ull);
+    }
+
+    // convert eight ascii digits (first digit in the low byte) to an integer.
+    static uint32_t eight_digits(uint64_t v) {
+      const uint64_t mask = 0x000000FF000000FFull;
+      const uint64_t mul1 = 100 + (1000000ull << 32);
+      const uint64_t mul2 = 1 + (10000ull << 32);
+      v -= 0x3030303030303030ull;
+      v = (v * 10) + (v >> 8);
+      v = (((v & mask) * mul1) + (((v >> 16) & mask) * mul2)) >> 32;
+      return (uint32_t)v;
+    }
+
+    // read digits into the mantissa, counting the ones we had to drop.
+    static const char *parse_digits(const char *p, const char *end, uint64_t &mantissa, int &num_digits, int &dropped) {
+      if (is_little_endian()) {
+        while (end - p >= 8 && num_digits <= 11) {
+          uint64_t v = load8(p);
+          if (!is_eight_digits(v)) break;
+          uint32_t block = eight_digits(v);
+          if (mantissa) {
+            num_digits += 8;
+          } else {
+            // leading zeros are not significant.
+            for (uint32_t b = block; b; b /= 10) num_digits++;
+          }
+          mantissa = mantissa * 100000000 + block;
+          p += 8;
+        }
+      }
+      for (; p != end && is_digit(*p); ++p) {
+        if (num_digits < 19) {
+          mantissa = mantissa * 10 + (*p - '0');
+          num_digits += mantissa != 0;
+        } else {
+          dropped++;
+        }
+      }
+      return p;
+    }
+
+    static double pow10(int e) {
+      static const double table[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+      };
+      if (e >= 0 && e <= 22) return table[e];
+      if (e < 0 && e >= -22) return 1.0 / table[-e];
+      return pow(10.0, e);
+    }
+
+  public:
+    /// parse one number at p; returns p if there is no number there.
+    static const char *parse_double(const char *p, const char *end, double &result) {
+      const char *start = p;
+      bool negative = false;
+      if (p != end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        ++p;
+      }
+
+      uint64_t mantissa = 0;
+      int num_digits = 0, dropped = 0;
+      const char *digits = p;
+      p = parse_digits(p, end, mantissa, num_digits, dropped);
+      int exponent = dropped;
+      bool any = p != digits;
+
+      if (p != end && *p == '.') {
+        ++p;
+        const char *frac = p;
+        int before = dropped;
+        p = parse_digits(p, end, mantissa, num_digits, dropped);
+        exponent -= (int)(p - frac) - (dropped - before);
+        any = any || p != frac;
+      }
+
+      if (!any) {
+        return start;
+      }
+
+      if (p != end && (*p == 'e' || *p == 'E')) {
+        const char *e = p + 1;
+        bool eneg = false;
+        if (e != end && (*e == '-' || *e == '+')) {
+          eneg = *e == '-';
+          ++e;
+        }
+        if (e != end && is_digit(*e)) {
+          int exp = 0;
+          for (; e != end && is_digit(*e); ++e) {
+            if (exp < 10000) exp = exp * 10 + (*e - '0');
+          }
+          exponent += eneg ? -exp : exp;
+          p = e;
+        }
+      }
+
+      double value = (double)mantissa;
+      if (exponent != 0 && mantissa != 0) {
+        // powers of ten up to 1e22 are exact, so divide by them rather than multiply by an inexact reciprocal.
+        if (exponent < 0 && exponent >= -22) {
+          value = value / pow10(-exponent);
+        } else {
+          value = exponent < -300 ? value * pow10(exponent + 300) * 1e-300 : value * pow10(exponent);
+        }
+      }
+      result = negative ? -value : value;
+      return p;
+    }
+
+    /// parse one integer at p; returns p if there is no number there.
+    static const char *parse_int(const char *p, const char *end, int &result) {
+      const char *start = p;
+      bool negative = false;
+      if (p != end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        ++p;
+      }
+
+      const char *digits = p;
+      uint32_t value = 0;
+      if (is_little_endian()) {
+        while (end - p >= 8) {
+          uint64_t v = load8(p);
+          if (!is_eight_digits(v)) break;
+          value = value * 100000000 + eight_digits(v);
+          p += 8;
+        }
+      }
+      for (; p != end && is_digit(*p); ++p) {
+        value = value * 10 + (*p - '0');
+      }
+
+      if (p == digits) {
+        return start;
+      }
+      result = negative ? -(int)value : (int)value;
+      return p;
+    }
+
+    /// append whitespace separated floats to values. Stops at the first thing that is not a number.
+    static void parse_floats(dynarray<float> &values, const char *src, const char *end) {
+      while (src != end && is_space(*src)) ++src;
+      while (src != end) {
+        double v = 0;
+        const char *next = parse_double(src, end, v);
+        if (next == src) break;
+        values.push_back((float)v);
+        src = next;
+        while (src != end && is_space(*src)) ++src;
+      }
+    }
+
+    /// append whitespace separated integers to values. Stops at the first thing that is not a number.
+    static void parse_ints(dynarray<int> &values, const char *src, const char *end) {
+      while (src != end && is_space(*src)) ++src;
+      while (src != end) {
+        int v = 0;
+        const char *next = parse_int(src, end, v);
+        if (next == src) break;
+        values.push_back(v);
+        src = next;
+        while (src != end && is_space(*src)) ++src;
+      }
+    }
+  };
+
+  #if OCTET_UNIT_TEST
+    /// Check parse_double against strtod: the value and where parsing stops.
+    class number_parser_unit_test {
+      static void check(const char *text) {
+        const char *end = text + strlen(text);
+        char *expected_end = 0;
+        double expected = strtod(text, &expected_end);
+        double value = 0;
+        const char *p = number_parser::parse_double(text, end, value);
+        assert(p == expected_end);
+        if (p != text) {
+          // within a couple of units in the last place of a double.
+          assert(fabs(value - expected) <= fabs(expected) * 4e-16);
+          assert((float)value == (float)expected);
+        }
+      }
+
+    public:
+      number_parser_unit_test() {
+        static const char *cases[] = {
+          "0", "-0", "+0", "1", "-1", "+1", "0.5", "-.5", "+.5", "5.", "123.456", "00000000001",
+          "1e10", "1E10", "1e+10", "1e-10", "-2.5e-3", "2.5E+03", "1e0", "7e22", "7e23", "1e-22", "1e-23",
+          "3.14159265358979323846264338327950288", "123456789012345678901234567890", "0.000000000000000000000000001234",
+          "12345678", "123456789", "1234567812345678", "0.12345678", "12345678.12345678",
+          "1e308", "1.7976931348623157e308", "2.2250738585072014e-308", "4.9e-324", "1e-310",
+          "1.5abc", "1e", "1e+", "1e-x", "2.5e3.5", "1..2", "-", "+", ".", "+-1", "-+1", "e5", "abc", "",
+        };
+        for (size_t i = 0; i != sizeof(cases)/sizeof(cases[0]); ++i) {
+          check(cases[i]);
+        }
+
+        // round trips of random doubles, printed at double, float and fixed precision.
+        // two random floats make a full double mantissa, so no value lies on a float rounding boundary.
+        random rand;
+        char text[64];
+        for (int i = 0; i != 10000; ++i) {
+          double v = (rand.get(-1.0f, 1.0f) + rand.get(0.0f, 1.0f) * (1.0 / 16777216)) * pow(10.0, rand.get(-40, 40));
+          snprintf(text, sizeof(text), i & 1 ? "%.17g" : "%.9g", v);
+          check(text);
+          snprintf(text, sizeof(text), "%f", v);
+          check(text);
+        }
+
+        // runs of numbers with junk before, between and after them.
+        static const char floats[] = " \t 1 -2.5e3\n+4 .5  x 6";
+        dynarray<float> fv;
+        number_parser::parse_floats(fv, floats, floats + sizeof(floats) - 1);
+        assert(fv.size() == 4 && fv[0] == 1 && fv[1] == -2500 && fv[2] == 4 && fv[3] == 0.5f);
+
+        static const char ints[] = "12 -34 +5 1234567890 7.5";
+        dynarray<int> iv;
+        number_parser::parse_ints(iv, ints, ints + sizeof(ints) - 1);
+        assert(iv.size() == 5 && iv[0] == 12 && iv[1] == -34 && iv[2] == 5 && iv[3] == 1234567890 && iv[4] == 7);
+
+        fv.resize(0);
+        number_parser::parse_floats(fv, "junk 1", (const char*)"junk 1" + 6);
+        assert(fv.size() == 0);
+      }
+    };
+    static number_parser_unit_test number_parser_unit_test;
+  #endif
+}}
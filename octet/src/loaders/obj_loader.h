@@ -8,245 +8,653 @@
 //
 namespace octet { namespace loaders {
   /// Class for loading OBJ files.
+  ///
+  /// The file is mapped to memory and split into blocks of lines which are parsed on all threads.
+  /// Corners with the same v/vt/vn triple share a vertex; the hash tables are split by key
+  /// between the threads so that the vertex order is the same as a serial loader's.
+  /// Polygons are triangulated as fans and the triangles are grouped by usemtl material.
+  ///
+  /// Files whose faces only use positions, such as 3D scans, skip the hashing and get
+  /// smooth normals made from the triangles.
+  ///
+  /// Example:
+  ///
+  ///     obj_loader loader;
+  ///     loader.load("assets/bunny.obj", dict, app_scene);
   class obj_loader {
   public:
-    obj_loader() {
+    struct material_range {
+      string name;
+      unsigned first_index;
+      unsigned num_indices;
+    };
+
+  private:
+    struct material_switch {
+      unsigned face;
+      const char *name;
+      unsigned len;
+      int index;
+    };
+
+    // the contents of one block of lines.
+    struct block {
+      const char *begin;
+      const char *end;
+      dynarray<vec3p> positions;
+      dynarray<vec3p> normals;
+      dynarray<vec2p> uvs;
+      dynarray<int> corners;        // v, vt, vn of each corner, from zero. -1 if missing or bad.
+      dynarray<unsigned> relative;  // corners that are relative to the start of this block
+      dynarray<unsigned> face_sizes;
+      dynarray<material_switch> switches;
+      dynarray<unsigned> triangle_offsets; // first triangle of each material in this block
+      unsigned first_position, first_uv, first_normal, first_corner;
+      int start_material;
+      bool needs_hash;
+      bool needs_normals;
+    };
+
+    struct hash_entry {
+      int key[3];
+      int corner;
+    };
+
+    enum { block_size = 1 << 20, grain = 1 << 16 };
+
+    // faces with bad indices are skipped
+    static const unsigned dropped_face = 0x80000000;
+
+    dynarray<block*> blocks;
+    dynarray<vec3p> positions;
+    dynarray<vec3p> normals;
+    dynarray<vec2p> uvs;
+    dynarray<int> corners;
+    dynarray<uint8_t> partition;
+    dynarray<unsigned> corner_vertex;
+    dynarray<unsigned> vertex_ids;
+    dynarray<dynarray<hash_entry>*> tables;
+    dynarray<vec3p> face_normals;
+    dynarray<uint8_t> smooth;
+
+    dynarray<mesh::vertex> vertices;
+    dynarray<uint32_t> indices;
+    dynarray<material_range> materials;
+    aabb bounds;
+
+    static bool is_space(char c) {
+      return c == ' ' || c == '\t';
     }
 
-    /// Load an OBJ file
-    /// http://en.wikipedia.org/wiki/Wavefront_.obj_file
-    bool load(const char *url, resource_dict &dict, visual_scene *scene) {
-      dynarray<uint8_t> file;
-      app_utils::get_url(file, url);
-      if (file.size() == 0) return false;
-
-      const uint8_t *eof = file.data() + file.size();
-      this->dict = &dict;
-      material_index = 0;
-      
-      for (const uint8_t *src = file.data(); src != eof; ) {
-        while (*src == ' ' && src != eof) ++src;
-        const uint8_t *begin = src;
-        while (*src != '\n' && *src != '\r' && src != eof) ++src;
-        const uint8_t *end = src;
-        src += src != eof && *src == '\r';
-        src += src != eof && *src == '\n';
-        if (begin != end ) switch (begin[0]) {
-          case '#': {
-            fwrite(begin, 1, end-begin, stdout);
-          } break;
-          case 'o': {
-            flush();
-            fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') obj_name.assign((const char*)begin + 2, (const char*)end);
-            node = new scene_node(mat4t(), atom_);
-          } break;
-          case 'g': {
-            fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') group_name.assign((const char*)begin + 2, (const char*)end);
-          } break;
-          case 'v': {
-            //fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') {
-              atofv(values, begin+2, end);
-              if (values.size() == 3) {
-                src_vertices.push_back(vec3p(values[0], values[1], values[2]));
-              }
-            } else if (begin[1] == 't' && begin[2] == ' ') {
-              atofv(values, begin+3, end);
-              if (values.size() == 2) {
-                src_uvs.push_back(vec2p(values[0], values[1]));
-              }
-            } else if (begin[1] == 'n' && begin[2] == ' ') {
-              atofv(values, begin+3, end);
-              if (values.size() == 3) {
-                src_normals.push_back(vec3p(values[0], values[1], values[2]));
-              }
-            }
-          } break;
-          case 'f': {
-            //fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') {
-              unsigned slashes = 0;
-              mesh::vertex v[6];
-              atoiv(ivalues, slashes, begin + 2, end);
-              size_t num_values = ivalues.size() - slashes;
-              size_t num_comps = ivalues.size() / num_values;
-              size_t num_idx = ivalues.size() / num_comps;
-              if (num_idx > 4 || num_comps > 3) {
-                printf("warning: bad obj file face\n");
-                return false;
-              }
-              mesh::vertex vtx[4];
-              memset(vtx, 0, sizeof(vtx));
-              if (num_comps >= 1) {
-                size_t d = 0;
-                for (size_t i = 0; i < ivalues.size(); i += num_comps) {
-                  int iv = ivalues[i];
-                  vtx[d++].pos = src_vertices[iv < 0 ? src_vertices.size() + iv : iv];
-                }
-              }
-              if (num_comps >= 2) {
-                size_t d = 0;
-                for (size_t i = 1; i < ivalues.size(); i += num_comps) {
-                  int iv = ivalues[i];
-                  vtx[d++].uv = src_uvs[iv < 0 ? src_uvs.size() + iv : iv];
-                }
-              }
-              if (num_comps >= 3) {
-                size_t d = 0;
-                for (size_t i = 2; i < ivalues.size(); i += num_comps) {
-                  int iv = ivalues[i];
-                  vtx[d++].normal = src_normals[iv < 0 ? src_normals.size() + iv : iv];
-                }
-              }
+    static const char *skip_space(const char *p, const char *end) {
+      while (p != end && is_space(*p)) ++p;
+      return p;
+    }
+
+    static const char *next_line(const char *p, const char *end) {
+      const char *nl = p < end ? (const char*)memchr(p, '\n', end - p) : 0;
+      return nl ? nl + 1 : end;
+    }
+
+    // parse up to n floats, leaving the rest as they are.
+    static void parse_floats(float *values, int n, const char *p, const char *end) {
+      for (int i = 0; i != n; ++i) {
+        p = skip_space(p, end);
+        double v = 0;
+        const char *next = number_parser::parse_double(p, end, v);
+        if (next == p) return;
+        values[i] = (float)v;
+        p = next;
+      }
+    }
+
+    // add an OBJ index (1 based or negative) to the corners of a block.
+    static void add_index(block *b, int value, unsigned count) {
+      if (value < 0) {
+        b->relative.push_back(b->corners.size());
+        b->corners.push_back((int)count + value);
+      } else {
+        b->corners.push_back(value - 1);
+      }
+    }
+
+    static void parse_face(block *b, const char *p, const char *end) {
+      unsigned first_corner = b->corners.size();
+      unsigned first_relative = b->relative.size();
+      for (p = skip_space(p, end); p != end; p = skip_space(p, end)) {
+        int v = 0, t = 0, n = 0;
+        const char *next = number_parser::parse_int(p, end, v);
+        if (next == p) break;
+        p = next;
+        if (p != end && *p == '/') {
+          p = number_parser::parse_int(p + 1, end, t);
+          if (p != end && *p == '/') {
+            p = number_parser::parse_int(p + 1, end, n);
+          }
+        }
+        add_index(b, v, b->positions.size());
+        add_index(b, t, b->uvs.size());
+        add_index(b, n, b->normals.size());
+        b->needs_hash |= t != 0 || n != 0;
+      }
+
+      unsigned num_corners = (b->corners.size() - first_corner) / 3;
+      if (num_corners < 3) {
+        b->corners.resize(first_corner);
+        b->relative.resize(first_relative);
+      } else {
+        b->face_sizes.push_back(num_corners);
+      }
+    }
+
+    static void parse_block(block *b) {
+      for (const char *line = b->begin; line != b->end; ) {
+        const char *eol = next_line(line, b->end);
+        const char *end = eol;
+        if (end != line && end[-1] == '\n') --end;
+        if (end != line && end[-1] == '\r') --end;
+        const char *p = skip_space(line, end);
+        line = eol;
+
+        if (end - p < 2) continue;
+        if (p[0] == 'v' && is_space(p[1])) {
+          float xyz[3] = { 0, 0, 0 };
+          parse_floats(xyz, 3, p + 2, end);
+          b->positions.push_back(vec3p(xyz[0], xyz[1], xyz[2]));
+        } else if (p[0] == 'v' && p[1] == 't' && end - p > 2 && is_space(p[2])) {
+          float uv[2] = { 0, 0 };
+          parse_floats(uv, 2, p + 3, end);
+          b->uvs.push_back(vec2p(uv[0], uv[1]));
+        } else if (p[0] == 'v' && p[1] == 'n' && end - p > 2 && is_space(p[2])) {
+          float xyz[3] = { 0, 0, 0 };
+          parse_floats(xyz, 3, p + 3, end);
+          b->normals.push_back(vec3p(xyz[0], xyz[1], xyz[2]));
+        } else if (p[0] == 'f' && is_space(p[1])) {
+          parse_face(b, p + 2, end);
+        } else if (end - p > 7 && !memcmp(p, "usemtl", 6) && is_space(p[6])) {
+          const char *name = skip_space(p + 7, end);
+          material_switch s = { b->face_sizes.size(), name, (unsigned)(end - name), 0 };
+          b->switches.push_back(s);
+        }
+        // comments, objects, groups, smoothing groups and mtllib are ignored.
+      }
+    }
+
+    // find or add a material by name.
+    int get_material_index(const char *name, unsigned len) {
+      for (unsigned i = 0; i != materials.size(); ++i) {
+        if ((unsigned)materials[i].name.size() == len && !memcmp(materials[i].name.c_str(), name, len)) {
+          return (int)i;
+        }
+      }
+      materials.resize(materials.size() + 1);
+      materials.back().name = string(name, len);
+      return (int)materials.size() - 1;
+    }
+
+    // make indices from zero and check them. Count triangles per material.
+    void check_block(block *b) {
+      int *c = corners.data() + b->first_corner * 3;
+      for (unsigned i = 0; i != b->relative.size(); ++i) {
+        unsigned r = b->relative[i];
+        unsigned comp = r % 3;
+        c[r] += comp == 0 ? b->first_position : comp == 1 ? b->first_uv : b->first_normal;
+      }
+
+      int limits[3] = { (int)positions.size(), (int)uvs.size(), (int)normals.size() };
+      unsigned num_materials = materials.size();
+      dynarray<unsigned> &counts = b->triangle_offsets;
+      counts.resize(num_materials);
+      for (unsigned m = 0; m != num_materials; ++m) counts[m] = 0;
+
+      int material = b->start_material;
+      unsigned next_switch = 0;
+      for (unsigned f = 0; f != b->face_sizes.size(); ++f) {
+        while (next_switch != b->switches.size() && b->switches[next_switch].face == f) {
+          material = b->switches[next_switch++].index;
+        }
+        unsigned size = b->face_sizes[f];
+        bool ok = true;
+        for (unsigned i = 0; i != size * 3; ++i) {
+          unsigned comp = i % 3;
+          if (c[i] < 0 || c[i] >= limits[comp]) c[i] = -1;
+          ok &= comp != 0 || c[i] >= 0;
+          b->needs_normals |= comp == 2 && c[i] < 0;
+        }
+        if (ok) {
+          counts[material] += size - 2;
+        } else {
+          for (unsigned i = 0; i != size * 3; i += 3) c[i] = -1;
+          b->face_sizes[f] = size | dropped_face;
+        }
+        c += size * 3;
+      }
+    }
+
+    static uint32_t hash_corner(const int *c) {
+      uint32_t h = (uint32_t)c[0] * 0x9E3779B1u;
+      h = (h ^ (uint32_t)c[1]) * 0x85EBCA77u;
+      h = (h ^ (uint32_t)c[2]) * 0xC2B2AE3Du;
+      return h ^ (h >> 15);
+    }
+
+    // give each distinct v/vt/vn triple in one partition the first corner that used it.
+    void dedup_partition(unsigned p) {
+      dynarray<hash_entry> &table = *tables[p];
+      unsigned num_corners = corners.size() / 3;
+
+      // most corners share a vertex with others, so start at half full and grow if needed.
+      unsigned count = 0;
+      for (unsigned i = 0; i != num_corners; ++i) count += partition[i] == p;
+      unsigned mask = 1023, used = 0;
+      while (mask < count) mask = mask * 2 + 1;
+      table.resize(mask + 1);
+      for (unsigned i = 0; i <= mask; ++i) table[i].corner = -1;
+
+      const int *c = corners.data();
+      for (unsigned i = 0; i != num_corners; ++i) {
+        if (partition[i] != p) continue;
+        const int *key = c + i * 3;
+        unsigned slot = hash_corner(key) & mask;
+        hash_entry *e;
+        for (e = &table[slot]; e->corner >= 0; e = &table[slot = (slot + 1) & mask]) {
+          if (e->key[0] == key[0] && e->key[1] == key[1] && e->key[2] == key[2]) break;
+        }
+        if (e->corner >= 0) {
+          corner_vertex[i] = (unsigned)e->corner;
+          vertex_ids[i] = 0;
+          continue;
+        }
+
+        e->key[0] = key[0];
+        e->key[1] = key[1];
+        e->key[2] = key[2];
+        e->corner = (int)i;
+        corner_vertex[i] = i;
+        vertex_ids[i] = 1;
+        if (++used * 2 > mask) {
+          // grow the table
+          dynarray<hash_entry> old;
+          old.swap(table);
+          mask = mask * 2 + 1;
+          table.resize(mask + 1);
+          for (unsigned j = 0; j <= mask; ++j) table[j].corner = -1;
+          for (unsigned j = 0; j != old.size(); ++j) {
+            if (old[j].corner < 0) continue;
+            unsigned s = hash_corner(old[j].key) & mask;
+            while (table[s].corner >= 0) s = (s + 1) & mask;
+            table[s] = old[j];
+          }
+        }
+      }
+    }
+
+    // turn ones into a running total, starting from zero.
+    static unsigned exclusive_scan(dynarray<unsigned> &values) {
+      job_scheduler &js = job_scheduler::get();
+      int num = (int)values.size();
+      int num_chunks = (num + grain - 1) / grain;
+      dynarray<unsigned> sums(num_chunks + 1);
+      js.parallel_for(0, num_chunks, 1, [&](int begin, int end) {
+        for (int j = begin; j != end; ++j) {
+          unsigned total = 0;
+          for (int i = j * grain, e = std::min(num, i + grain); i != e; ++i) total += values[i];
+          sums[j] = total;
+        }
+      });
+      unsigned total = 0;
+      for (int j = 0; j != num_chunks; ++j) {
+        unsigned s = sums[j];
+        sums[j] = total;
+        total += s;
+      }
+      js.parallel_for(0, num_chunks, 1, [&](int begin, int end) {
+        for (int j = begin; j != end; ++j) {
+          unsigned total = sums[j];
+          for (int i = j * grain, e = std::min(num, i + grain); i != e; ++i) {
+            unsigned v = values[i];
+            values[i] = total;
+            total += v;
+          }
+        }
+      });
+      return total;
+    }
+
+    // make one vertex per distinct v/vt/vn triple in order of first use.
+    void build_hashed_vertices() {
+      job_scheduler &js = job_scheduler::get();
+      int num_corners = (int)corners.size() / 3;
+      unsigned num_partitions = std::min(255u, (unsigned)js.get_num_threads() + 1);
+
+      partition.resize(num_corners);
+      corner_vertex.resize(num_corners);
+      vertex_ids.resize(num_corners);
+      while (tables.size() < num_partitions) tables.push_back(new dynarray<hash_entry>());
+
+      js.parallel_for(0, num_corners, grain, [&](int begin, int end) {
+        for (int i = begin; i != end; ++i) {
+          const int *c = corners.data() + i * 3;
+          partition[i] = c[0] < 0 ? 255 : (uint8_t)(((uint64_t)hash_corner(c) * num_partitions) >> 32);
+          // unused corners do not make vertices.
+          if (c[0] < 0) vertex_ids[i] = 0;
+        }
+      });
 
-              face f;
-              f.vtx[0] = vtx[0];
-              f.vtx[1] = vtx[1];
-              f.vtx[2] = vtx[2];
-              f.material_index = material_index;
-              faces.push_back(f);
-              if (num_idx == 4) {
-                f.vtx[0] = vtx[0];
-                f.vtx[1] = vtx[2];
-                f.vtx[2] = vtx[3];
-                f.material_index = material_index;
-                faces.push_back(f);
+      js.parallel_for(0, num_partitions, 1, [&](int begin, int end) {
+        for (int p = begin; p != end; ++p) dedup_partition(p);
+      });
+
+      unsigned num_vertices = exclusive_scan(vertex_ids);
+      vertices.resize(num_vertices);
+      smooth.resize(num_vertices);
+      js.parallel_for(0, num_corners, grain, [&](int begin, int end) {
+        for (int i = begin; i != end; ++i) {
+          if (partition[i] == 255) continue;
+          unsigned first = corner_vertex[i];
+          unsigned id = vertex_ids[first];
+          corner_vertex[i] = id;
+          if (first == (unsigned)i) {
+            const int *c = corners.data() + i * 3;
+            mesh::vertex &v = vertices[id];
+            v.pos = positions[c[0]];
+            v.uv = c[1] >= 0 ? uvs[c[1]] : vec2p(0, 0);
+            v.normal = c[2] >= 0 ? normals[c[2]] : vec3p(0, 0, 0);
+            smooth[id] = c[2] < 0;
+          }
+        }
+      });
+    }
+
+    // each position is a vertex.
+    void build_position_vertices() {
+      int num_vertices = (int)positions.size();
+      vertices.resize(num_vertices);
+      smooth.resize(num_vertices);
+      job_scheduler::get().parallel_for(0, num_vertices, grain, [&](int begin, int end) {
+        for (int i = begin; i != end; ++i) {
+          mesh::vertex &v = vertices[i];
+          v.pos = positions[i];
+          v.uv = vec2p(0, 0);
+          v.normal = vec3p(0, 0, 0);
+          smooth[i] = 1;
+        }
+      });
+    }
+
+    // fan triangulate the faces of a block into the material ranges.
+    void write_triangles(block *b, bool hashed) {
+      unsigned corner = b->first_corner;
+      int material = b->start_material;
+      unsigned next_switch = 0;
+      for (unsigned f = 0; f != b->face_sizes.size(); ++f) {
+        while (next_switch != b->switches.size() && b->switches[next_switch].face == f) {
+          material = b->switches[next_switch++].index;
+        }
+        unsigned size = b->face_sizes[f];
+        if (size & dropped_face) {
+          corner += size & ~dropped_face;
+          continue;
+        }
+        uint32_t *dest = indices.data() + b->triangle_offsets[material] * 3;
+        b->triangle_offsets[material] += size - 2;
+        uint32_t v0 = hashed ? corner_vertex[corner] : corners[corner * 3];
+        uint32_t prev = hashed ? corner_vertex[corner + 1] : corners[corner * 3 + 3];
+        for (unsigned i = 2; i != size; ++i) {
+          uint32_t v = hashed ? corner_vertex[corner + i] : corners[(corner + i) * 3];
+          dest[0] = v0;
+          dest[1] = prev;
+          dest[2] = v;
+          dest += 3;
+          prev = v;
+        }
+        corner += size;
+      }
+    }
+
+    // area weighted normals for vertices that do not have one.
+    void make_normals() {
+      job_scheduler &js = job_scheduler::get();
+      int num_triangles = (int)indices.size() / 3;
+      face_normals.resize(num_triangles);
+      js.parallel_for(0, num_triangles, grain, [&](int begin, int end) {
+        for (int t = begin; t != end; ++t) {
+          const uint32_t *idx = indices.data() + t * 3;
+          vec3 a = vertices[idx[0]].pos, b = vertices[idx[1]].pos, c = vertices[idx[2]].pos;
+          vec3 n = cross(b - a, c - a);
+          face_normals[t] = vec3p(n.x(), n.y(), n.z());
+        }
+      });
+
+      // each thread owns a range of vertices, so no two threads add to the same one.
+      int num_vertices = (int)vertices.size();
+      int num_ranges = js.get_num_threads() + 1;
+      int range_size = (num_vertices + num_ranges - 1) / num_ranges;
+      js.parallel_for(0, num_ranges, 1, [&](int begin, int end) {
+        for (int r = begin; r != end; ++r) {
+          uint32_t lo = (uint32_t)(r * range_size), size = (uint32_t)range_size;
+          for (int t = 0; t != num_triangles; ++t) {
+            const uint32_t *idx = indices.data() + t * 3;
+            for (int i = 0; i != 3; ++i) {
+              uint32_t v = idx[i];
+              if (v - lo < size && smooth[v]) {
+                vec3 n = (vec3)vertices[v].normal + (vec3)face_normals[t];
+                vertices[v].normal = vec3p(n.x(), n.y(), n.z());
               }
             }
-          } break;
-          default: {
-            fwrite(begin, 1, end-begin, stdout);
-            printf("unknown\n");
-            return false;
-          } break;
-          case 'u': {
-            fwrite(begin, 1, end-begin, stdout);
-            if (begin+7 < end && !memcmp(begin, "usemtl ", 7)) {
-              size_t len = end - (begin+7);
-              size_t i = 0;
-              for (; i != materials.size(); ++i) {
-                if (
-                  materials[i].size() == len &&
-                  !memcmp(materials[i].c_str(), begin+7, len)
-                ) {
-                  break;
-                }
-              }
+          }
+        }
+      });
 
-              if (i == materials.size()) {
-                materials.push_back(string((const char*)begin+7, (unsigned)len));
-              }
+      js.parallel_for(0, num_vertices, grain, [&](int begin, int end) {
+        for (int i = begin; i != end; ++i) {
+          if (!smooth[i]) continue;
+          vec3 n = vertices[i].normal;
+          float len2 = dot(n, n);
+          n = len2 > 0 ? n * (1.0f / sqrtf(len2)) : vec3(0, 0, 1);
+          vertices[i].normal = vec3p(n.x(), n.y(), n.z());
+        }
+      });
+    }
 
-              material_index = (uint32_t)i;
-            }
-          } break;
+    void calc_bounds() {
+      int num = (int)positions.size();
+      if (num == 0) {
+        bounds = aabb();
+        return;
+      }
+      vec3 lo = positions[0], hi = positions[0];
+      std::mutex lock;
+      job_scheduler::get().parallel_for(0, num, grain, [&](int begin, int end) {
+        vec3 l = positions[begin], h = positions[begin];
+        for (int i = begin; i != end; ++i) {
+          vec3 p = positions[i];
+          l = min(l, p);
+          h = max(h, p);
         }
+        std::lock_guard<std::mutex> guard(lock);
+        lo = min(lo, l);
+        hi = max(hi, h);
+      });
+      bounds = aabb((lo + hi) * 0.5f, (hi - lo) * 0.5f);
+    }
+
+    template <class item_t> static void gather(dynarray<item_t> &dest, dynarray<block*> &blocks, dynarray<item_t> block::*member, unsigned block::*first) {
+      unsigned total = 0;
+      for (unsigned i = 0; i != blocks.size(); ++i) {
+        blocks[i]->*first = total;
+        total += (blocks[i]->*member).size();
       }
-      flush();
+      dest.resize(total);
+      job_scheduler::get().parallel_for(0, blocks.size(), 1, [&](int begin, int end) {
+        for (int i = begin; i != end; ++i) {
+          dynarray<item_t> &src = blocks[i]->*member;
+          if (src.size()) memcpy(dest.data() + blocks[i]->*first, src.data(), src.size() * sizeof(item_t));
+        }
+      });
+    }
 
-      return true;
+  public:
+    obj_loader() {
     }
-  private:
-    dynarray<vec3p> src_vertices;
-    dynarray<vec3p> src_normals;
-    dynarray<vec2p> src_uvs;
-    dynarray<uint32_t> src_material;
-    dynarray<string> materials;
 
-    string obj_name;
-    string group_name;
-    resource_dict *dict;
-    scene_node *node;
+    ~obj_loader() {
+      for (unsigned i = 0; i != blocks.size(); ++i) delete blocks[i];
+      for (unsigned i = 0; i != tables.size(); ++i) delete tables[i];
+    }
 
-    struct face {
-      mesh::vertex vtx[3];
-      int material_index;
+    /// Decode an OBJ file in memory into vertices and triangle indices grouped by material.
+    /// http://en.wikipedia.org/wiki/Wavefront_.obj_file
+    bool parse(const char *begin, const char *end) {
+      job_scheduler &js = job_scheduler::get();
+      materials.resize(0);
+      vertices.resize(0);
+      indices.resize(0);
 
-      bool operator <(const face &rhs) {
-        return material_index < rhs.material_index;
+      // split into blocks of lines, keeping the blocks and their arrays from the last file.
+      unsigned num_blocks = 0;
+      for (const char *p = begin; p != end; ++num_blocks) {
+        const char *e = end - p > block_size ? next_line(p + block_size, end) : end;
+        if (num_blocks == blocks.size()) blocks.push_back(new block());
+        block *b = blocks[num_blocks];
+        b->begin = p;
+        b->end = e;
+        b->positions.resize(0);
+        b->normals.resize(0);
+        b->uvs.resize(0);
+        b->corners.resize(0);
+        b->relative.resize(0);
+        b->face_sizes.resize(0);
+        b->switches.resize(0);
+        b->needs_hash = b->needs_normals = false;
+        p = e;
+      }
+      while (blocks.size() > num_blocks) {
+        delete blocks.back();
+        blocks.pop_back();
       }
-    };
 
-    dynarray<face> faces;
-    dynarray<uint32_t> indices;
-    dynarray<float> values;
-    dynarray<int> ivalues;
-    uint32_t material_index;
-
-    // convert an ascii sequence of integers like "1 3 9 12 34" to an array of integers
-    void atoiv(dynarray<int> &values, unsigned &slashes, const uint8_t *src, const uint8_t *end) {
-      values.resize(0);
-      slashes = 0;
-
-      while (src != end && *src > 0 && *src <= ' ') ++src;
-      while(src != end) {
-        int whole = 0, msign = 1;
-        if (src != end && *src == '-') { msign = -1; src++; }
-        while (src != end && *src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
-        values.push_back(whole * msign);
-        while (src != end && *src > 0 && *src <= ' ') ++src;
-        if (src != end && *src == '/') { slashes++; src++; }
-      }
-    }
-
-    void atofv(dynarray<float> &values, const uint8_t *src, const uint8_t *end) {
-      values.resize(0);
-
-      while (*src > 0 && *src <= ' ') ++src;
-      while(src != end) {
-        double whole = 0, msign = 1;
-        if (*src == '-') { msign = -1; src++; }
-        if( !(*src >= '0' && *src <= '9') && *src != '.' ) break;
-        while (*src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
-        if (*src == '.') {
-          src++;
-          double frac = 0, v = 1;
-          while (*src >= '0' && *src <= '9') { frac = frac * 10 + (*src++ - '0'); v *= 10; }
-          whole += frac / v;
-        }
-        if (*src == 'e' || *src == 'E') {
-          int esign = 1;
-          src++;
-          if (*src == '-') { esign = -1; src++; }
-          else if (*src == '+') src++;
-          int exp = 0;
-          while (*src >= '0' && *src <= '9') { exp = exp * 10 + (*src++ - '0'); }
-          whole = whole * pow(10.0, exp * esign);
-        }
-        values.push_back((float)(whole * msign));
-        while (*src > 0 && *src <= ' ') ++src;
-      }
-    }
-
-    void flush() {
-      std::sort(faces.begin(), faces.end());
-      face *f = 0;
-      gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, faces.size() * sizeof(f->vtx));
-
-      {
-        gl_resource::wolock vl(vertices);
-        for (size_t i = 0; i != faces.size(); ++i) {
-          memcpy(vl.u8() + i * sizeof(f->vtx), faces[i].vtx, sizeof(f->vtx));
-        }
-      }
-
-      int prev_mi = -1;
-      for (size_t i = 0; i != faces.size(); ++i) {
-        if (faces[i].material_index != prev_mi) {
-          mesh *msh = new mesh();
-          msh->set_default_attributes();
-          msh->set_vertices(vertices);
-          material *mat = new material(vec4(0.5f, 0.5f, 0.5f, 1));
-          mesh_instance *mi = new mesh_instance(node, msh, mat);
-        }
-      }
-
-      faces.resize(0);
-      src_vertices.resize(0);
-      src_uvs.resize(0);
-      src_normals.resize(0);
+      js.parallel_for(0, num_blocks, 1, [&](int begin, int end) {
+        for (int i = begin; i != end; ++i) parse_block(blocks[i]);
+      });
+
+      // materials carry on from the previous block.
+      int material = -1;
+      bool needs_hash = false;
+      for (unsigned i = 0; i != num_blocks; ++i) {
+        block *b = blocks[i];
+        if (b->face_sizes.size() && (b->switches.size() == 0 || b->switches[0].face != 0) && material == -1) {
+          material = get_material_index("", 0);
+        }
+        b->start_material = material;
+        for (unsigned j = 0; j != b->switches.size(); ++j) {
+          material_switch &s = b->switches[j];
+          material = s.index = get_material_index(s.name, s.len);
+        }
+        needs_hash |= b->needs_hash;
+      }
+
+      gather(positions, blocks, &block::positions, &block::first_position);
+      gather(uvs, blocks, &block::uvs, &block::first_uv);
+      gather(normals, blocks, &block::normals, &block::first_normal);
+      gather(corners, blocks, &block::corners, &block::first_corner);
+      for (unsigned i = 0; i != num_blocks; ++i) blocks[i]->first_corner /= 3;
+
+      js.parallel_for(0, num_blocks, 1, [&](int begin, int end) {
+        for (int i = begin; i != end; ++i) check_block(blocks[i]);
+      });
+
+      // triangles are sorted by material, then by block.
+      unsigned num_triangles = 0;
+      for (unsigned m = 0; m != materials.size(); ++m) {
+        materials[m].first_index = num_triangles * 3;
+        for (unsigned i = 0; i != num_blocks; ++i) {
+          unsigned count = blocks[i]->triangle_offsets[m];
+          blocks[i]->triangle_offsets[m] = num_triangles;
+          num_triangles += count;
+        }
+        materials[m].num_indices = num_triangles * 3 - materials[m].first_index;
+      }
+
+      bool needs_normals = !needs_hash;
+      if (needs_hash) {
+        build_hashed_vertices();
+        for (unsigned i = 0; i != num_blocks; ++i) needs_normals |= blocks[i]->needs_normals;
+      } else {
+        build_position_vertices();
+      }
+
+      indices.resize(num_triangles * 3);
+      js.parallel_for(0, num_blocks, 1, [&](int begin, int end) {
+        for (int i = begin; i != end; ++i) write_triangles(blocks[i], needs_hash);
+      });
+
+      if (needs_normals) make_normals();
+      calc_bounds();
+
+      return num_triangles != 0;
+    }
+
+    /// Load an OBJ file into a scene. Each material gets a mesh; the meshes share one
+    /// vertex buffer and one index buffer.
+    bool load(const char *url, resource_dict &dict, visual_scene *scene) {
+      file_map map(app_utils::get_path(url));
+      if (!map.get_data()) return false;
+      const char *text = (const char*)map.get_data();
+      if (!parse(text, text + map.get_size())) return false;
+
+      gl_resource *vbo = new gl_resource(GL_ARRAY_BUFFER, vertices.size() * sizeof(mesh::vertex));
+      vbo->assign(vertices.data(), 0, vertices.size() * sizeof(mesh::vertex));
+      gl_resource *ibo = new gl_resource(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t));
+      ibo->assign(indices.data(), 0, indices.size() * sizeof(uint32_t));
+
+      scene_node *node = new scene_node();
+      scene->add_child(node);
+      dict.set_resource(url, node);
+
+      for (unsigned m = 0; m != materials.size(); ++m) {
+        const material_range &range = materials[m];
+        if (range.num_indices == 0) continue;
+
+        mesh *msh = new mesh();
+        msh->set_default_attributes();
+        msh->set_vertices(vbo);
+        msh->set_indices(ibo);
+        msh->set_params(sizeof(mesh::vertex), range.num_indices, vertices.size(), GL_TRIANGLES, GL_UNSIGNED_INT);
+        msh->set_first_index(range.first_index);
+        msh->set_aabb(bounds);
+
+        string name;
+        name.format("%s#%s", url, range.name.c_str());
+        material *mat = dict.get_material(range.name.c_str());
+        if (!mat) {
+          mat = new material(vec4(0.5f, 0.5f, 0.5f, 1));
+          if (range.name.c_str()[0]) dict.set_resource(range.name.c_str(), mat);
+        }
+        dict.set_resource(name.c_str(), msh);
+        scene->add_mesh_instance(new mesh_instance(node, msh, mat));
+      }
+      return true;
+    }
+
+    /// vertices made by parse
+    const dynarray<mesh::vertex> &get_vertices() const {
+      return vertices;
+    }
+
+    /// triangle indices made by parse, grouped by material
+    const dynarray<uint32_t> &get_indices() const {
+      return indices;
+    }
+
+    /// usemtl names and their ranges of indices. Faces before the first usemtl have an empty name.
+    const dynarray<material_range> &get_materials() const {
+      return materials;
+    }
+
+    /// bounds of all the positions
+    const aabb &get_aabb() const {
+      return bounds;
     }
   };
 }}
@@ -0,0 +1,441 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Protein Data Bank (PDB and mmCIF) atom decoder
+//
+namespace octet { namespace loaders {
+  /// Decoder for the atoms of PDB and mmCIF molecule files.
+  ///
+  /// The file is split into blocks of lines which are parsed on all threads.
+  /// PDB records are read from their fixed columns without tokenising the line.
+  /// Only the first model of multi-model (NMR) files is kept.
+  ///
+  /// If a PDB file has REMARK 350 BIOMT transforms, the atoms can be copied to make the
+  /// whole biological assembly, for example a complete virus capsid from its asymmetric unit.
+  ///
+  /// Example:
+  ///
+  ///     dynarray<uint8_t> buf;
+  ///     app_utils::get_url(buf, "assets/molecules/pdb1fha.ent");
+  ///     pdb_decoder dec;
+  ///     dec.decode((const char*)buf.data(), (const char*)buf.data() + buf.size(), true);
+  ///     // dec.get_atoms() is x, y, z and van der Waals radius.
+  class pdb_decoder {
+  public:
+    /// elements we know the colour and radius of. Others are element_unknown.
+    enum element {
+      element_unknown,
+      element_H, element_C, element_N, element_O, element_S, element_P, element_F, element_CL,
+      element_BR, element_I, element_FE, element_CA, element_LI, element_NA, element_K, element_SE,
+      element_ZN, element_CU, element_NI, element_MG,
+      num_elements
+    };
+
+  private:
+    struct element_info {
+      char name[3];
+      uint32_t colour;
+      float radius;
+    };
+
+    // colours from the original example. Radii: glMol / A. Bondi, J. Phys. Chem., 1964, 68, 441.
+    static const element_info &get_element_info(unsigned e) {
+      static const element_info info[num_elements] = {
+        {"  ", 0x808080, 1.0f},
+        {" H", 0xcccccc, 1.2f}, {" C", 0xaaaaaa, 1.7f}, {" N", 0x0000cc, 1.55f}, {" O", 0xcc0000, 1.52f},
+        {" S", 0xcccc00, 1.8f}, {" P", 0x6622cc, 1.8f}, {" F", 0x00cc00, 1.47f}, {"CL", 0x00cc00, 1.75f},
+        {"BR", 0x882200, 1.85f}, {" I", 0x6600aa, 1.98f}, {"FE", 0xcc6600, 1.0f}, {"CA", 0x8888aa, 1.0f},
+        {"LI", 0x808080, 1.82f}, {"NA", 0x808080, 2.27f}, {" K", 0x808080, 2.75f}, {"SE", 0x808080, 1.9f},
+        {"ZN", 0x808080, 1.39f}, {"CU", 0x808080, 1.4f}, {"NI", 0x808080, 1.63f}, {"MG", 0x808080, 1.73f},
+      };
+      return info[e];
+    }
+
+    // map two upper case characters (or space) to an element with one table lookup.
+    static unsigned char_index(char c) {
+      if (c >= 'a' && c <= 'z') c -= 'a' - 'A';
+      return c >= 'A' && c <= 'Z' ? c - 'A' + 1 : 0;
+    }
+
+    struct element_table {
+      uint8_t index[27*27];
+
+      element_table() {
+        memset(index, 0, sizeof(index));
+        for (unsigned e = 1; e != num_elements; ++e) {
+          const char *name = get_element_info(e).name;
+          index[char_index(name[0]) * 27 + char_index(name[1])] = (uint8_t)e;
+        }
+      }
+    };
+
+    // called from the parsing threads: the static is constructed exactly once, before any thread reads it.
+    static uint8_t lookup_element(char c0, char c1) {
+      static const element_table table;
+      return table.index[char_index(c0) * 27 + char_index(c1)];
+    }
+
+    // atoms from one block of lines.
+    struct block {
+      const char *begin;
+      const char *end;
+      dynarray<vec4> atoms;
+      dynarray<uint8_t> elements;
+      int end_model;   // number of atoms before the first ENDMDL, or -1
+    };
+
+    dynarray<vec4> atoms;
+    dynarray<uint8_t> elements;
+    dynarray<mat4t> assembly;
+
+    // mmCIF rows are split into at most max_cif_columns tokens.
+    enum { block_size = 1 << 18, max_cif_columns = 64 };
+
+    // parse a fixed width column as a number.
+    static float column(const char *line, const char *end, int first, int last) {
+      const char *p = line + first, *e = line + last + 1;
+      if (e > end) e = end;
+      while (p < e && *p == ' ') ++p;
+      double result = 0;
+      if (p < e) number_parser::parse_double(p, e, result);
+      return (float)result;
+    }
+
+    static const char *next_line(const char *p, const char *end) {
+      const char *nl = p < end ? (const char*)memchr(p, '\n', end - p) : 0;
+      return nl ? nl + 1 : end;
+    }
+
+    static bool starts_with(const char *p, const char *end, const char *str) {
+      size_t len = strlen(str);
+      return (size_t)(end - p) >= len && !memcmp(p, str, len);
+    }
+
+    // split [begin, end) into blocks ending on line boundaries.
+    static void make_blocks(dynarray<block*> &blocks, const char *begin, const char *end) {
+      for (const char *p = begin; p != end; ) {
+        const char *e = end - p > block_size ? next_line(p + block_size, end) : end;
+        block *b = new block();
+        b->begin = p;
+        b->end = e;
+        b->end_model = -1;
+        blocks.push_back(b);
+        p = e;
+      }
+    }
+
+    static void parse_pdb_block(block *b) {
+      for (const char *line = b->begin; line != b->end; ) {
+        const char *eol = next_line(line, b->end);
+        if (starts_with(line, eol, "ATOM  ") || starts_with(line, eol, "HETATM")) {
+          //           1         2         3         4         5         6         7
+          // 01234567890123456789012345678901234567890123456789012345678901234567890123456789
+          // ATOM      1  CA  THR A   5      24.188 -18.763  55.368  1.00 46.05           C
+          float x = column(line, eol, 30, 37);
+          float y = column(line, eol, 38, 45);
+          float z = column(line, eol, 46, 53);
+
+          // element in columns 77-78, or from the atom name on old files.
+          uint8_t e = element_unknown;
+          if (eol - line > 77 && line[77] > ' ') {
+            e = lookup_element(line[76], line[77]);
+          } else if (eol - line > 13) {
+            e = lookup_element(line[12] >= 'A' ? line[12] : ' ', line[13]);
+          }
+
+          b->atoms.push_back(vec4(x, y, z, get_element_info(e).radius));
+          b->elements.push_back(e);
+        } else if (b->end_model == -1 && starts_with(line, eol, "ENDMDL")) {
+          b->end_model = (int)b->atoms.size();
+        }
+        line = eol;
+      }
+    }
+
+    // mmCIF columns we need from the _atom_site loop.
+    struct cif_columns {
+      int x, y, z, type_symbol, model;
+      int num_columns;
+    };
+
+    // split a line into at most max_tokens whitespace separated, possibly quoted tokens.
+    static int tokenise(const char *p, const char *end, const char **tokens, const char **token_ends, int max_tokens) {
+      int n = 0;
+      while (n != max_tokens) {
+        while (p != end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) ++p;
+        if (p == end) break;
+        const char *b = p;
+        if (*p == '\'' || *p == '"') {
+          char q = *p++;
+          b = p;
+          while (p != end && !(*p == q && (p + 1 == end || p[1] <= ' '))) ++p;
+          tokens[n] = b;
+          token_ends[n++] = p;
+          if (p != end) ++p;
+        } else {
+          while (p != end && *p > ' ') ++p;
+          tokens[n] = b;
+          token_ends[n++] = p;
+        }
+      }
+      return n;
+    }
+
+    static void parse_cif_block(block *b, const cif_columns &cols, const char *first_model, size_t first_model_len) {
+      const char *tokens[max_cif_columns], *token_ends[max_cif_columns];
+      int max_tokens = std::min(cols.num_columns, (int)max_cif_columns);
+      assert(cols.x >= 0 && cols.y >= 0 && cols.z >= 0);
+      for (const char *line = b->begin; line != b->end; ) {
+        const char *eol = next_line(line, b->end);
+        int n = tokenise(line, eol, tokens, token_ends, max_tokens);
+        line = eol;
+        if (n != max_tokens) continue;
+
+        if (cols.model >= 0 && b->end_model == -1) {
+          size_t len = token_ends[cols.model] - tokens[cols.model];
+          if (len != first_model_len || memcmp(tokens[cols.model], first_model, len)) {
+            b->end_model = (int)b->atoms.size();
+          }
+        }
+
+        double x = 0, y = 0, z = 0;
+        number_parser::parse_double(tokens[cols.x], token_ends[cols.x], x);
+        number_parser::parse_double(tokens[cols.y], token_ends[cols.y], y);
+        number_parser::parse_double(tokens[cols.z], token_ends[cols.z], z);
+
+        uint8_t e = element_unknown;
+        if (cols.type_symbol >= 0) {
+          const char *s = tokens[cols.type_symbol];
+          size_t len = token_ends[cols.type_symbol] - s;
+          e = len == 1 ? lookup_element(' ', s[0]) : len == 2 ? lookup_element(s[0], s[1]) : element_unknown;
+        }
+        b->atoms.push_back(vec4((float)x, (float)y, (float)z, get_element_info(e).radius));
+        b->elements.push_back(e);
+      }
+    }
+
+    // read REMARK 350 BIOMT records of the first biomolecule.
+    void parse_biomt(const char *begin, const char *end) {
+      int biomolecule = 0;
+      for (const char *line = begin; line != end; ) {
+        const char *eol = next_line(line, end);
+        if (starts_with(line, eol, "ATOM  ") || starts_with(line, eol, "HETATM")) {
+          break;
+        }
+        if (starts_with(line, eol, "REMARK 350 BIOMOLECULE:")) {
+          biomolecule++;
+        } else if (biomolecule <= 1 && starts_with(line, eol, "REMARK 350   BIOMT")) {
+          // REMARK 350   BIOMT1   1  1.000000  0.000000  0.000000        0.00000
+          int row = line[18] - '1';
+          float v[4];
+          const char *p = line + 19;
+          double serial = 0;
+          while (p < eol && *p == ' ') ++p;
+          p = number_parser::parse_double(p, eol, serial);
+          for (int i = 0; i != 4; ++i) {
+            double d = 0;
+            while (p < eol && *p == ' ') ++p;
+            p = number_parser::parse_double(p, eol, d);
+            v[i] = (float)d;
+          }
+          if (row == 0) {
+            mat4t m;
+            m.loadIdentity();
+            assembly.push_back(m);
+          }
+          if (row >= 0 && row < 3 && assembly.size()) {
+            // octet matrices are row vector style: the rotation goes down the columns.
+            mat4t &m = assembly.back();
+            for (int i = 0; i != 3; ++i) m[i][row] = v[i];
+            m[3][row] = v[3];
+          }
+        }
+        line = eol;
+      }
+    }
+
+    // find the _atom_site loop of an mmCIF file. returns the first data line.
+    static const char *find_atom_site(cif_columns &cols, const char *begin, const char *end, const char *&data_end) {
+      cols.x = cols.y = cols.z = cols.type_symbol = cols.model = -1;
+      cols.num_columns = 0;
+      const char *line = begin;
+      while (line != end) {
+        const char *eol = next_line(line, end);
+        if (starts_with(line, eol, "loop_")) {
+          const char *next = eol;
+          if (starts_with(next, end, "_atom_site.")) {
+            line = next;
+            break;
+          }
+        }
+        line = eol;
+      }
+
+      // column names
+      for (; line != end && starts_with(line, end, "_atom_site."); line = next_line(line, end)) {
+        const char *name = line + 11;
+        const char *eol = next_line(line, end);
+        const char *e = name;
+        while (e != eol && *e > ' ') ++e;
+        size_t len = e - name;
+        int index = cols.num_columns++;
+
+        // columns past the tokens we split are treated as missing.
+        if (index >= max_cif_columns) continue;
+        if (len == 7 && !memcmp(name, "Cartn_x", 7)) cols.x = index;
+        if (len == 7 && !memcmp(name, "Cartn_y", 7)) cols.y = index;
+        if (len == 7 && !memcmp(name, "Cartn_z", 7)) cols.z = index;
+        if (len == 11 && !memcmp(name, "type_symbol", 11)) cols.type_symbol = index;
+        if (len == 18 && !memcmp(name, "pdbx_PDB_model_num", 18)) cols.model = index;
+      }
+
+      // data runs until the next loop, category or comment.
+      const char *data = line;
+      for (; line != end; line = next_line(line, end)) {
+        if (*line == '#' || *line == '_' || starts_with(line, end, "loop_")) break;
+      }
+      data_end = line;
+      return data;
+    }
+
+    // concatenate the blocks, stopping at the end of the first model.
+    void gather(dynarray<block*> &blocks) {
+      unsigned total = 0;
+      dynarray<unsigned> start(blocks.size());
+      for (unsigned i = 0; i != blocks.size(); ++i) {
+        start[i] = total;
+        block *b = blocks[i];
+        if (b->end_model != -1) {
+          b->atoms.resize(b->end_model);
+          b->elements.resize(b->end_model);
+          total += b->end_model;
+          for (unsigned j = i + 1; j != blocks.size(); ++j) {
+            blocks[j]->atoms.resize(0);
+            blocks[j]->elements.resize(0);
+            start[j] = total;
+          }
+          break;
+        }
+        total += b->atoms.size();
+      }
+
+      atoms.resize(total);
+      elements.resize(total);
+      job_scheduler::get().parallel_for(0, (int)blocks.size(), 1, [&](int begin, int end) {
+        for (int i = begin; i != end; ++i) {
+          block *b = blocks[i];
+          if (b->atoms.size()) {
+            memcpy(atoms.data() + start[i], b->atoms.data(), b->atoms.size() * sizeof(vec4));
+            memcpy(elements.data() + start[i], b->elements.data(), b->elements.size());
+          }
+        }
+      });
+
+      for (unsigned i = 0; i != blocks.size(); ++i) {
+        delete blocks[i];
+      }
+    }
+
+    // copy the atoms for each transform of the assembly.
+    void expand_assembly() {
+      unsigned num_copies = assembly.size();
+      unsigned n = atoms.size();
+      dynarray<vec4> all(n * num_copies);
+      dynarray<uint8_t> all_elements(n * num_copies);
+      job_scheduler::get().parallel_for(0, (int)num_copies, 1, [&](int begin, int end) {
+        for (int c = begin; c != end; ++c) {
+          const mat4t &m = assembly[c];
+          vec4 *dest = all.data() + c * n;
+          for (unsigned i = 0; i != n; ++i) {
+            vec4 p = vec4(atoms[i].xyz(), 1) * m;
+            dest[i] = vec4(p.xyz(), atoms[i].w());
+          }
+          memcpy(all_elements.data() + c * n, elements.data(), n);
+        }
+      });
+      atoms.swap(all);
+      elements.swap(all_elements);
+    }
+
+  public:
+    pdb_decoder() {
+    }
+
+    /// Decode a PDB or mmCIF file. If make_assembly is set, apply the BIOMT transforms of a PDB file.
+    void decode(const char *begin, const char *end, bool make_assembly = false) {
+      atoms.reset();
+      elements.reset();
+      assembly.reset();
+
+      dynarray<block*> blocks;
+      cif_columns cols;
+      const char *data_end = end;
+      const char *data = begin;
+      bool is_cif = starts_with(begin, end, "data_");
+      if (is_cif) {
+        data = find_atom_site(cols, begin, end, data_end);
+        if (cols.x < 0 || cols.y < 0 || cols.z < 0) return;
+      } else if (make_assembly) {
+        parse_biomt(begin, end);
+      }
+
+      make_blocks(blocks, data, data_end);
+
+      // the model number of the first atom, to find where the first model ends.
+      const char *first_model = "";
+      size_t first_model_len = 0;
+      if (is_cif && cols.model >= 0) {
+        const char *tokens[max_cif_columns], *token_ends[max_cif_columns];
+        int max_tokens = std::min(cols.num_columns, (int)max_cif_columns);
+        if (tokenise(data, next_line(data, data_end), tokens, token_ends, max_tokens) == max_tokens) {
+          first_model = tokens[cols.model];
+          first_model_len = token_ends[cols.model] - first_model;
+        }
+      }
+
+      job_scheduler::get().parallel_for(0, (int)blocks.size(), 1, [&](int b0, int b1) {
+        for (int i = b0; i != b1; ++i) {
+          if (is_cif) {
+            parse_cif_block(blocks[i], cols, first_model, first_model_len);
+          } else {
+            parse_pdb_block(blocks[i]);
+          }
+        }
+      });
+
+      gather(blocks);
+
+      if (assembly.size() > 1) {
+        expand_assembly();
+      }
+    }
+
+    /// Atom positions (xyz) and van der Waals radii (w).
+    const dynarray<vec4> &get_atoms() const {
+      return atoms;
+    }
+
+    /// Element of each atom.
+    const dynarray<uint8_t> &get_elements() const {
+      return elements;
+    }
+
+    /// Number of copies made by the BIOMT transforms (zero or one if none).
+    unsigned get_num_assembly_copies() const {
+      return assembly.size();
+    }
+
+    /// Colour of an element as 0xRRGGBB.
+    static uint32_t get_element_colour(unsigned e) {
+      return get_element_info(e).colour;
+    }
+
+    /// Van der Waals radius of an element in Angstroms.
+    static float get_element_radius(unsigned e) {
+      return get_element_info(e).radius;
+    }
+  };
+}}
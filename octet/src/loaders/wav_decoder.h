@@ -0,0 +1,330 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+//
+// WAV file decoder - PCM and IMA-ADPCM
+//
+
+namespace octet { namespace loaders {
+  /// Class for decoding .wav sound files a block at a time.
+  ///
+  /// Supports 8 and 16 bit PCM and IMA-ADPCM (format 0x11), which is a quarter of the size
+  /// of 16 bit PCM. Decoded samples are always 16 bit, interleaved for stereo.
+  ///
+  /// Example:
+  ///
+  ///     wav_decoder wav;
+  ///     if (wav.decode_header(bytes, num_bytes)) {
+  ///       dynarray<int16_t> pcm(wav.get_block_frames() * wav.get_num_channels());
+  ///       const uint8_t *block = bytes + wav.get_data_offset();
+  ///       unsigned frames = wav.decode_block(pcm.data(), block, wav.get_block_bytes());
+  ///     }
+  class wav_decoder {
+  public:
+    enum {
+      format_pcm = 1,
+      format_ima_adpcm = 0x11,
+    };
+
+  private:
+    unsigned format;
+    unsigned num_channels;
+    unsigned sample_rate;
+    unsigned bits;
+    unsigned block_align;
+    unsigned block_frames;
+    unsigned data_offset;
+    unsigned data_size;
+
+    static unsigned u2(const uint8_t *src) {
+      return src[0] + src[1] * 256;
+    }
+
+    static unsigned u4(const uint8_t *src) {
+      return src[0] + src[1] * 256 + src[2] * 65536 + src[3] * 0x1000000;
+    }
+
+    // one IMA-ADPCM nibble
+    static int16_t ima_step(unsigned nibble, int &predictor, int &index) {
+      static const int16_t step_table[89] = {
+        7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+        50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+        253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+        1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+        3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+        12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+      };
+      static const int8_t index_table[16] = { -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8 };
+
+      int step = step_table[index];
+      int diff = step >> 3;
+      if (nibble & 1) diff += step >> 2;
+      if (nibble & 2) diff += step >> 1;
+      if (nibble & 4) diff += step;
+      predictor += nibble & 8 ? -diff : diff;
+      predictor = predictor < -32768 ? -32768 : predictor > 32767 ? 32767 : predictor;
+      index += index_table[nibble];
+      index = index < 0 ? 0 : index > 88 ? 88 : index;
+      return (int16_t)predictor;
+    }
+
+  public:
+    wav_decoder() {
+      format = 0;
+      num_channels = 0;
+      sample_rate = 0;
+      bits = 0;
+      block_align = 0;
+      block_frames = 0;
+      data_offset = 0;
+      data_size = 0;
+    }
+
+    /// Read the fmt and data chunks. The data itself does not need to be in src.
+    bool decode_header(const uint8_t *src, size_t size) {
+      data_offset = data_size = 0;
+      if (size < 12 || memcmp(src, "RIFF", 4) || memcmp(src + 8, "WAVE", 4)) return false;
+
+      bool found_fmt = false;
+      for (size_t i = 12; i + 8 <= size; i += 8 + ((u4(src + i + 4) + 1) & ~1)) {
+        unsigned chunk_size = u4(src + i + 4);
+        if (!memcmp(src + i, "fmt ", 4)) {
+          // the 16 byte PCM format is the shortest we can use.
+          if (chunk_size < 16 || i + 8 + 16 > size) return false;
+          const uint8_t *fmt = src + i + 8;
+          format = u2(fmt);
+          num_channels = u2(fmt + 2);
+          sample_rate = u4(fmt + 4);
+          block_align = u2(fmt + 12);
+          bits = u2(fmt + 14);
+          found_fmt = true;
+        } else if (!memcmp(src + i, "data", 4)) {
+          data_offset = (unsigned)i + 8;
+          data_size = chunk_size;
+          break;
+        }
+      }
+
+      if (!found_fmt || !data_offset || num_channels < 1 || num_channels > 2) return false;
+
+      if (format == format_pcm && (bits == 8 || bits == 16)) {
+        // decode PCM in blocks of 1024 frames.
+        block_frames = 1024;
+        block_align = block_frames * num_channels * bits / 8;
+      } else if (format == format_ima_adpcm && bits == 4 && block_align > 4 * num_channels) {
+        // a header of one sample per channel, then eight samples per four bytes.
+        block_frames = (block_align - 4 * num_channels) * 2 / num_channels + 1;
+      } else {
+        return false;
+      }
+      return true;
+    }
+
+    /// Decode one block of get_block_bytes() bytes, or less at the end of the data.
+    /// Returns the number of frames written to dest.
+    unsigned decode_block(int16_t *dest, const uint8_t *src, unsigned size) const {
+      if (format == format_pcm) {
+        unsigned frame_bytes = num_channels * bits / 8;
+        unsigned frames = std::min(size, block_align) / frame_bytes;
+        unsigned n = frames * num_channels;
+        if (bits == 16) {
+          for (unsigned i = 0; i != n; ++i) {
+            dest[i] = (int16_t)u2(src + i * 2);
+          }
+        } else {
+          for (unsigned i = 0; i != n; ++i) {
+            dest[i] = (int16_t)((src[i] - 128) * 256);
+          }
+        }
+        return frames;
+      }
+
+      // IMA-ADPCM: a partial last block still has its header.
+      unsigned header_bytes = 4 * num_channels;
+      if (size < header_bytes) return 0;
+      size = std::min(size, block_align);
+      unsigned frames = std::min(block_frames, (size - header_bytes) * 2 / num_channels + 1);
+
+      int predictor[2], index[2];
+      for (unsigned c = 0; c != num_channels; ++c) {
+        predictor[c] = (int16_t)u2(src + c * 4);
+        index[c] = std::min((unsigned)src[c * 4 + 2], 88u);
+        dest[c] = (int16_t)predictor[c];
+      }
+
+      // each channel has four bytes (eight samples) in turn.
+      const uint8_t *p = src + header_bytes;
+      for (unsigned f = 1; f < frames && p + header_bytes <= src + size; f += 8) {
+        for (unsigned c = 0; c != num_channels; ++c) {
+          for (unsigned j = 0; j != 8; ++j) {
+            unsigned nibble = (p[j >> 1] >> ((j & 1) * 4)) & 15;
+            int16_t value = ima_step(nibble, predictor[c], index[c]);
+            if (f + j < frames) dest[(f + j) * num_channels + c] = value;
+          }
+          p += 4;
+        }
+      }
+      return frames;
+    }
+
+    /// wav_decoder::format_pcm or format_ima_adpcm
+    unsigned get_format() const { return format; }
+
+    unsigned get_num_channels() const { return num_channels; }
+
+    unsigned get_sample_rate() const { return sample_rate; }
+
+    /// bytes in a block of compressed data.
+    unsigned get_block_bytes() const { return block_align; }
+
+    /// frames in a whole block.
+    unsigned get_block_frames() const { return block_frames; }
+
+    /// where the sound starts in the file.
+    unsigned get_data_offset() const { return data_offset; }
+
+    unsigned get_data_size() const { return data_size; }
+
+    /// Decode all the data in a file in memory; returns the number of frames.
+    unsigned decode_all(dynarray<int16_t> &pcm, const uint8_t *src, size_t size) const {
+      unsigned end = (unsigned)std::min((size_t)data_offset + data_size, size);
+      unsigned num_blocks = (end - data_offset + block_align - 1) / block_align;
+      pcm.resize(num_blocks * block_frames * num_channels);
+      unsigned frames = 0;
+      for (unsigned pos = data_offset; pos < end; pos += block_align) {
+        frames += decode_block(pcm.data() + frames * num_channels, src + pos, std::min(block_align, end - pos));
+      }
+      pcm.resize(frames * num_channels);
+      return frames;
+    }
+  };
+
+  #if OCTET_UNIT_TEST
+    /// Decode hand made IMA-ADPCM files against samples worked out from the IMA tables,
+    /// and check that decode_header rejects fmt chunks we cannot play.
+    class wav_decoder_unit_test {
+      static void put2(dynarray<uint8_t> &dest, unsigned value) {
+        dest.push_back((uint8_t)value);
+        dest.push_back((uint8_t)(value >> 8));
+      }
+
+      static void put4(dynarray<uint8_t> &dest, unsigned value) {
+        put2(dest, value & 0xffff);
+        put2(dest, value >> 16);
+      }
+
+      static void put_tag(dynarray<uint8_t> &dest, const char *tag) {
+        for (int i = 0; i != 4; ++i) dest.push_back((uint8_t)tag[i]);
+      }
+
+      // a wav file with an fmt chunk of fmt_size bytes (16 for PCM, 20 for IMA-ADPCM).
+      static void make_wav(dynarray<uint8_t> &dest, unsigned format, unsigned channels, unsigned block_align, unsigned bits, unsigned fmt_size, const uint8_t *data, unsigned data_size) {
+        dest.resize(0);
+        put_tag(dest, "RIFF");
+        put4(dest, 4 + 8 + fmt_size + 8 + data_size);
+        put_tag(dest, "WAVE");
+        put_tag(dest, "fmt ");
+        put4(dest, fmt_size);
+        unsigned fmt_start = dest.size();
+        put2(dest, format);
+        put2(dest, channels);
+        put4(dest, 22050);
+        put4(dest, 22050 * block_align);
+        put2(dest, block_align);
+        put2(dest, bits);
+        if (fmt_size >= 20) {
+          put2(dest, 2);
+          put2(dest, (block_align - 4 * channels) * 2 / channels + 1);
+        }
+        while (dest.size() < fmt_start + fmt_size) dest.push_back(0);
+        dest.resize(fmt_start + fmt_size);
+        put_tag(dest, "data");
+        put4(dest, data_size);
+        for (unsigned i = 0; i != data_size; ++i) dest.push_back(data[i]);
+      }
+
+      static bool same(const int16_t *a, const int16_t *b, unsigned n) {
+        for (unsigned i = 0; i != n; ++i) {
+          if (a[i] != b[i]) return false;
+        }
+        return true;
+      }
+
+    public:
+      wav_decoder_unit_test() {
+        dynarray<uint8_t> file;
+        dynarray<int16_t> pcm;
+        wav_decoder wav;
+
+        // mono: a whole block of 17 frames, then a partial block of 9.
+        static const uint8_t mono[] = {
+          0x64, 0x00, 0, 0,  0x74, 0x77, 0x07, 0x19, 0xab, 0x3c, 0x8f, 0x12,
+          0x30, 0xf8, 20, 0,  0x44, 0x9c, 0x70, 0x06,
+        };
+        static const int16_t mono_pcm[] = {
+          100, 107, 123, 157, 233, 398, 421, 357, 415, 292, 211, 79, 202, -41, -75, 82, 167,
+          -2000, -1944, -1877, -1959, -1992, -1982, -1846, -1592, -1558,
+        };
+        make_wav(file, wav_decoder::format_ima_adpcm, 1, 12, 4, 20, mono, sizeof(mono));
+        bool ok = wav.decode_header(file.data(), file.size());
+        assert(ok && wav.get_format() == wav_decoder::format_ima_adpcm && wav.get_num_channels() == 1);
+        assert(wav.get_block_bytes() == 12 && wav.get_block_frames() == 17);
+        unsigned frames = wav.decode_all(pcm, file.data(), file.size());
+        assert(frames == 26 && same(pcm.data(), mono_pcm, 26));
+
+        // stereo: four bytes of each channel in turn. The right channel clamps at -32768.
+        static const uint8_t stereo[] = {
+          0xe8, 0x03, 10, 0,  0x00, 0x83, 5, 0,
+          0x34, 0x56, 0x78, 0x9a,  0xf7, 0xe6, 0xd5, 0xc4,
+          0x11, 0x22, 0x33, 0x44,  0x0f, 0x1e, 0x2d, 0x3c,
+        };
+        static const int16_t left[] = { 1000, 1021, 1039, 1072, 1122, 1116, 1209, 1143, 1107, 1140, 1170, 1215, 1256, 1308, 1354, 1410, 1477 };
+        static const int16_t right[] = {
+          -32000, -31978, -32024, -31936, -32093, -31856, -32203, -31786, -32291,
+          -32768, -32623, -32768, -32065, -32768, -31207, -32768, -30364
+        };
+        make_wav(file, wav_decoder::format_ima_adpcm, 2, 24, 4, 20, stereo, sizeof(stereo));
+        ok = wav.decode_header(file.data(), file.size());
+        assert(ok && wav.get_num_channels() == 2 && wav.get_block_frames() == 17);
+        frames = wav.decode_all(pcm, file.data(), file.size());
+        assert(frames == 17);
+        for (unsigned i = 0; i != 17; ++i) {
+          assert(pcm[i * 2] == left[i] && pcm[i * 2 + 1] == right[i]);
+        }
+
+        // a stereo block cut after the first eight frames of each channel.
+        frames = wav.decode_block(pcm.data(), stereo, 16);
+        assert(frames == 9);
+        for (unsigned i = 0; i != 9; ++i) {
+          assert(pcm[i * 2] == left[i] && pcm[i * 2 + 1] == right[i]);
+        }
+
+        // fmt chunks we cannot use.
+        make_wav(file, wav_decoder::format_ima_adpcm, 1, 12, 4, 14, mono, sizeof(mono));
+        assert(!wav.decode_header(file.data(), file.size()));
+        make_wav(file, wav_decoder::format_ima_adpcm, 1, 12, 4, 20, mono, sizeof(mono));
+        assert(!wav.decode_header(file.data(), 12 + 8 + 10));
+        make_wav(file, 0x55, 1, 12, 4, 20, mono, sizeof(mono));
+        assert(!wav.decode_header(file.data(), file.size()));
+        make_wav(file, wav_decoder::format_ima_adpcm, 1, 12, 8, 20, mono, sizeof(mono));
+        assert(!wav.decode_header(file.data(), file.size()));
+        make_wav(file, wav_decoder::format_ima_adpcm, 3, 24, 4, 20, mono, sizeof(mono));
+        assert(!wav.decode_header(file.data(), file.size()));
+        make_wav(file, wav_decoder::format_ima_adpcm, 2, 8, 4, 20, mono, sizeof(mono));
+        assert(!wav.decode_header(file.data(), file.size()));
+        make_wav(file, wav_decoder::format_pcm, 1, 2, 12, 16, mono, sizeof(mono));
+        assert(!wav.decode_header(file.data(), file.size()));
+
+        // PCM still works and a file without data is rejected.
+        make_wav(file, wav_decoder::format_pcm, 1, 2, 16, 16, mono, sizeof(mono));
+        assert(wav.decode_header(file.data(), file.size()) && wav.get_format() == wav_decoder::format_pcm);
+        make_wav(file, wav_decoder::format_pcm, 1, 2, 16, 16, mono, 0);
+        assert(!wav.decode_header(file.data(), file.size() - 8));
+      }
+    };
+    static wav_decoder_unit_test wav_decoder_unit_test;
+  #endif
+} }
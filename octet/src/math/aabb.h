@@ -212,6 +212,12 @@ namespace octet { namespace math {
       */
     }
 
+    /// Vertices and indices made by get_geometry.
+    void get_geometry_size(int, unsigned &num_vertices, unsigned &num_indices) const {
+      num_vertices = 6 * 4;
+      num_indices = 6 * 6;
+    }
+
 	  template <class sink_t> void get_geometry(sink_t &sink, int) {
       static const float vertices[4 * 6 * 8] = {
         // front
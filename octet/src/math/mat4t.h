@@ -328,9 +328,15 @@ namespace octet { namespace math {
 
     /// Get the 3x3 adjoint matrix, used for generalized 3x3 invert.
     mat4t adjoint3x3() const {
-      vec4 c0 = column(0);
-      vec4 c1 = column(1);
-      vec4 c2 = column(2);
+      #if OCTET_SSE
+        __m128 m0 = v[0].get_m(), m1 = v[1].get_m(), m2 = v[2].get_m(), m3 = _mm_setzero_ps();
+        _MM_TRANSPOSE4_PS(m0, m1, m2, m3);
+        vec4 c0(m0), c1(m1), c2(m2);
+      #else
+        vec4 c0 = column(0);
+        vec4 c1 = column(1);
+        vec4 c2 = column(2);
+      #endif
       return mat4t(
         c1.cross(c2),
         c2.cross(c0),
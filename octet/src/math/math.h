@@ -86,5 +86,9 @@ namespace octet {
 #include "polygon.h"
 #include "zcylinder.h"
 #include "voxel_grid.h"
+#include "sparse_voxel_octree.h"
+
+// batches
+#include "transform_batch.h"
 
 #endif
@@ -0,0 +1,534 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Sparse voxel octree with shared nodes and run length coded bricks
+//
+
+namespace octet { namespace math {
+  /// Sparse voxel octree (strictly, a DAG) for large, mostly empty voxel worlds.
+  ///
+  /// The world is a cube of (1 << log_dim) voxels. Empty space costs nothing and
+  /// 8x8x8 leaf bricks are stored as runs of equal voxels, so memory grows with the
+  /// surface rather than the volume. Identical bricks and nodes are stored once.
+  ///
+  /// Nodes and bricks are never changed: an edit makes new nodes on the path to the root
+  /// (copy on write), so an old root (get_root()) is a snapshot that can be restored with
+  /// set_root() until compact() removes the nodes that are no longer used.
+  ///
+  /// There are no pointers, so get_nodes(), get_brick_starts() and get_runs() can be
+  /// uploaded as buffers. A node is eight child words:
+  ///
+  ///     0                       empty
+  ///     brick_flag | brick      leaf brick: runs get_brick_starts()[brick] to get_brick_starts()[brick+1]
+  ///     anything else           node: child words at get_nodes()[word * 8]
+  ///
+  /// Child i of a node has x = i & 1, y = (i >> 1) & 1, z = i >> 2.
+  /// Runs cover the voxels of a brick in x, then y, then z order.
+  ///
+  /// Example:
+  ///
+  ///     sparse_voxel_octree<uint8_t, traits> world(10); // 1024^3
+  ///     world.set(ivec3(1, 2, 3), 1);
+  ///     uint8_t material = world.get(ivec3(1, 2, 3));
+  template <class elem_t, class elem_traits_t> class sparse_voxel_octree {
+  public:
+    enum {
+      log_brick_dim = 3,
+      brick_dim = 1 << log_brick_dim,
+      brick_size = brick_dim * brick_dim * brick_dim,
+      brick_flag = 0x80000000,
+    };
+
+    /// count voxels of the same value.
+    struct run {
+      uint16_t count;
+      elem_t value;
+    };
+
+  private:
+    int log_dim;
+    uint32_t root;
+
+    // model space position of voxel (0, 0, 0) and size of a voxel.
+    vec3 origin;
+    vec3 voxel_size;
+
+    // node 0 is never used, so that a child word of zero can mean empty.
+    dynarray<uint32_t> nodes;
+    dynarray<uint32_t> brick_starts;
+    dynarray<run> runs;
+
+    // content hash -> index + 1, to share nodes and bricks.
+    hash_map<uint64_t, uint32_t> node_map;
+    hash_map<uint64_t, uint32_t> brick_map;
+
+    static uint64_t hash_word(uint64_t hash, uint32_t value) {
+      return (hash ^ value) * 0x100000001b3ull;
+    }
+
+    static uint64_t hash_run(uint64_t hash, const run &r) {
+      hash = hash_word(hash, r.count);
+      const uint8_t *bytes = (const uint8_t*)&r.value;
+      for (size_t i = 0; i != sizeof(elem_t); ++i) hash = hash_word(hash, bytes[i]);
+      return hash;
+    }
+
+    static int child_index(ivec3_in pos, int level) {
+      return ((pos.x() >> level) & 1) | ((pos.y() >> level) & 1) << 1 | ((pos.z() >> level) & 1) << 2;
+    }
+
+    static int brick_index(ivec3_in pos) {
+      ivec3 p = pos & ivec3(brick_dim - 1);
+      return p.x() + brick_dim * (p.y() + brick_dim * p.z());
+    }
+
+    bool is_empty_brick(const elem_t *dense) const {
+      for (int i = 0; i != brick_size; ++i) {
+        if (!elem_traits_t::is_transparent(dense[i])) return false;
+      }
+      return true;
+    }
+
+    // find or add a brick; returns a child word.
+    uint32_t intern_brick(const elem_t *dense) {
+      if (is_empty_brick(dense)) return 0;
+
+      // encode the runs at the end of the array, then keep them only if they are new.
+      unsigned first = runs.size();
+      uint64_t hash = 0xcbf29ce484222325ull;
+      for (int i = 0; i != brick_size; ) {
+        int j = i + 1;
+        while (j != brick_size && dense[j] == dense[i]) ++j;
+        run r;
+        r.count = (uint16_t)(j - i);
+        r.value = dense[i];
+        runs.push_back(r);
+        hash = hash_run(hash, r);
+        i = j;
+      }
+      unsigned num_runs = runs.size() - first;
+
+      uint32_t &slot = brick_map[hash | 1];
+      if (slot) {
+        unsigned b = slot - 1;
+        unsigned start = brick_starts[b], end = brick_starts[b + 1];
+        bool same = end - start == num_runs;
+        for (unsigned i = 0; same && i != num_runs; ++i) {
+          same = runs[start + i].count == runs[first + i].count && runs[start + i].value == runs[first + i].value;
+        }
+        if (same) {
+          runs.resize(first);
+          return brick_flag | b;
+        }
+      }
+
+      // new brick; if the hash collided, the older brick keeps the slot.
+      unsigned b = brick_starts.size() - 1;
+      brick_starts.push_back(runs.size());
+      if (!slot) slot = b + 1;
+      return brick_flag | b;
+    }
+
+    // find or add a node; returns a child word.
+    uint32_t intern_node(const uint32_t *kids) {
+      uint64_t hash = 0xcbf29ce484222325ull;
+      uint32_t any = 0;
+      for (int i = 0; i != 8; ++i) {
+        hash = hash_word(hash, kids[i]);
+        any |= kids[i];
+      }
+      if (!any) return 0;
+
+      uint32_t &slot = node_map[hash | 1];
+      if (slot && !memcmp(nodes.data() + (slot - 1) * 8, kids, 8 * sizeof(uint32_t))) {
+        return slot - 1;
+      }
+
+      unsigned n = nodes.size() / 8;
+      for (int i = 0; i != 8; ++i) {
+        nodes.push_back(kids[i]);
+      }
+      if (!slot) slot = n + 1;
+      return n;
+    }
+
+    // replace a brick under word at level; dense is null for an empty brick.
+    uint32_t set_brick_rec(uint32_t word, int level, ivec3_in pos, const elem_t *dense) {
+      if (level == log_brick_dim) {
+        return dense ? intern_brick(dense) : 0;
+      }
+      uint32_t kids[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+      if (word) memcpy(kids, nodes.data() + word * 8, sizeof(kids));
+      int i = child_index(pos, level - 1);
+      kids[i] = set_brick_rec(kids[i], level - 1, pos, dense);
+      return intern_node(kids);
+    }
+
+    // copy the nodes reachable from word into another tree.
+    uint32_t copy_rec(sparse_voxel_octree &dest, uint32_t word, hash_map<uint32_t, uint32_t> &copied) const {
+      if (!word) return 0;
+      uint32_t &slot = copied[word];
+      if (slot) return slot - 1;
+
+      uint32_t result;
+      if (word & brick_flag) {
+        elem_t dense[brick_size];
+        decode_brick(dense, word);
+        result = dest.intern_brick(dense);
+      } else {
+        uint32_t kids[8];
+        for (int i = 0; i != 8; ++i) {
+          kids[i] = copy_rec(dest, nodes[word * 8 + i], copied);
+        }
+        result = dest.intern_node(kids);
+      }
+      // copied may have grown, so look up the slot again.
+      copied[word] = result + 1;
+      return result;
+    }
+
+    template <class sink_t> void add_face(sink_t &sink, ivec3_in voxel, int axis, int sign) {
+      int u = axis == 2 ? 0 : axis + 1, v = axis == 0 ? 2 : axis - 1;
+      vec3 du = vec3(0), dv = vec3(0), normal = vec3(0);
+      du[u] = voxel_size[u];
+      dv[v] = voxel_size[v];
+      normal[axis] = (float)sign;
+      vec3 pos = origin + vec3(voxel) * voxel_size;
+      if (sign > 0) {
+        pos[axis] += voxel_size[axis];
+      } else {
+        std::swap(du, dv);
+      }
+      uint32_t v0 = (uint32_t)sink.add_vertex(pos, normal, vec3(0, 0, 0));
+      uint32_t v1 = (uint32_t)sink.add_vertex(pos + du, normal, vec3(1, 0, 0));
+      uint32_t v2 = (uint32_t)sink.add_vertex(pos + du + dv, normal, vec3(1, 1, 0));
+      uint32_t v3 = (uint32_t)sink.add_vertex(pos + dv, normal, vec3(0, 1, 0));
+      sink.add_triangle(v0, v1, v2);
+      sink.add_triangle(v0, v2, v3);
+    }
+
+    // true if the brick is one run of solid voxels.
+    bool is_solid_brick(uint32_t word) const {
+      if (!(word & brick_flag)) return false;
+      unsigned b = word & ~brick_flag;
+      return brick_starts[b + 1] - brick_starts[b] == 1 && !elem_traits_t::is_transparent(runs[brick_starts[b]].value);
+    }
+
+    template <class sink_t> void add_brick_faces(sink_t &sink, uint32_t word, ivec3_in brick_pos) {
+      static const int dirs[6][3] = { { -1, 0, 0 }, { 1, 0, 0 }, { 0, -1, 0 }, { 0, 1, 0 }, { 0, 0, -1 }, { 0, 0, 1 } };
+      uint32_t neighbours[6];
+      bool buried = is_solid_brick(word);
+      for (int d = 0; d != 6; ++d) {
+        neighbours[d] = find_brick(brick_pos + ivec3(dirs[d][0], dirs[d][1], dirs[d][2]) * brick_dim);
+        buried = buried && is_solid_brick(neighbours[d]);
+      }
+      if (buried) return;
+
+      // solid flags with a border of one voxel from the neighbours.
+      enum { pad = brick_dim + 2 };
+      bool solid[pad * pad * pad];
+      memset(solid, 0, sizeof(solid));
+      elem_t dense[brick_size];
+      decode_brick(dense, word);
+      for (int i = 0; i != brick_size; ++i) {
+        int x = i & (brick_dim - 1), y = (i >> log_brick_dim) & (brick_dim - 1), z = i >> (log_brick_dim * 2);
+        solid[(x + 1) + pad * ((y + 1) + pad * (z + 1))] = !elem_traits_t::is_transparent(dense[i]);
+      }
+      for (int d = 0; d != 6; ++d) {
+        if (!neighbours[d]) continue;
+        decode_brick(dense, neighbours[d]);
+        int axis = d >> 1, side = d & 1;
+        for (int i = 0; i != brick_size; ++i) {
+          int p[3] = { (int)(i & (brick_dim - 1)), (int)((i >> log_brick_dim) & (brick_dim - 1)), (int)(i >> (log_brick_dim * 2)) };
+          // only the layer next to this brick.
+          if (p[axis] != (side ? 0 : (int)brick_dim - 1)) continue;
+          p[axis] = side ? (int)brick_dim : -1;
+          solid[(p[0] + 1) + pad * ((p[1] + 1) + pad * (p[2] + 1))] = !elem_traits_t::is_transparent(dense[i]);
+        }
+      }
+
+      static const int step[3] = { 1, pad, pad * pad };
+      for (int z = 0; z != brick_dim; ++z) {
+        for (int y = 0; y != brick_dim; ++y) {
+          for (int x = 0; x != brick_dim; ++x) {
+            int i = (x + 1) + pad * ((y + 1) + pad * (z + 1));
+            if (!solid[i]) continue;
+            for (int d = 0; d != 6; ++d) {
+              int axis = d >> 1, sign = d & 1 ? 1 : -1;
+              if (!solid[i + step[axis] * sign]) {
+                add_face(sink, brick_pos + ivec3(x, y, z), axis, sign);
+              }
+            }
+          }
+        }
+      }
+    }
+
+  public:
+    /// Make an empty world of (1 << log_dim) voxels in each direction.
+    sparse_voxel_octree(int log_dim = log_brick_dim, vec3_in origin = vec3(0, 0, 0), vec3_in voxel_size = vec3(1, 1, 1)) {
+      init(log_dim, origin, voxel_size);
+    }
+
+    /// Clear the world and set its size.
+    void init(int log_dim_, vec3_in origin_, vec3_in voxel_size_) {
+      log_dim = std::max((int)log_brick_dim, log_dim_);
+      origin = origin_;
+      voxel_size = voxel_size_;
+      root = 0;
+      nodes.resize(8);
+      memset(nodes.data(), 0, 8 * sizeof(uint32_t));
+      brick_starts.resize(1);
+      brick_starts[0] = 0;
+      runs.resize(0);
+      node_map.clear();
+      brick_map.clear();
+    }
+
+    /// voxels in each direction are 1 << get_log_dim().
+    int get_log_dim() const {
+      return log_dim;
+    }
+
+    /// Decode a brick (child word with brick_flag) into brick_size voxels.
+    void decode_brick(elem_t *dense, uint32_t word) const {
+      if (!word) {
+        for (int i = 0; i != brick_size; ++i) dense[i] = elem_t();
+        return;
+      }
+      unsigned b = word & ~brick_flag;
+      elem_t *dest = dense;
+      for (unsigned r = brick_starts[b]; r != brick_starts[b + 1]; ++r) {
+        for (unsigned i = 0; i != runs[r].count; ++i) *dest++ = runs[r].value;
+      }
+    }
+
+    /// Find the brick containing a voxel; zero if it is empty.
+    uint32_t find_brick(ivec3_in pos) const {
+      unsigned limit = 1u << log_dim;
+      if ((unsigned)pos.x() >= limit || (unsigned)pos.y() >= limit || (unsigned)pos.z() >= limit) return 0;
+      uint32_t word = root;
+      for (int level = log_dim; word && level != log_brick_dim; --level) {
+        word = nodes[word * 8 + child_index(pos, level - 1)];
+      }
+      return word;
+    }
+
+    /// Get a voxel. Empty voxels and voxels outside the world are elem_t().
+    elem_t get(ivec3_in pos) const {
+      uint32_t word = find_brick(pos);
+      if (!word) return elem_t();
+      unsigned b = word & ~brick_flag;
+      int i = brick_index(pos);
+      for (unsigned r = brick_starts[b]; ; ++r) {
+        if (i < runs[r].count) return runs[r].value;
+        i -= runs[r].count;
+      }
+    }
+
+    /// Set a voxel. Changes only the nodes on the path to the root.
+    void set(ivec3_in pos, const elem_t &value) {
+      unsigned limit = 1u << log_dim;
+      if ((unsigned)pos.x() >= limit || (unsigned)pos.y() >= limit || (unsigned)pos.z() >= limit) return;
+      uint32_t word = find_brick(pos);
+      elem_t dense[brick_size];
+      decode_brick(dense, word);
+      int i = brick_index(pos);
+      if (dense[i] == value) return;
+      dense[i] = value;
+      root = set_brick_rec(root, log_dim, pos, dense);
+    }
+
+    /// Replace the 8x8x8 brick containing pos; dense is in x, then y, then z order.
+    void set_brick(ivec3_in pos, const elem_t *dense) {
+      unsigned limit = 1u << log_dim;
+      if ((unsigned)pos.x() >= limit || (unsigned)pos.y() >= limit || (unsigned)pos.z() >= limit) return;
+      root = set_brick_rec(root, log_dim, pos, dense);
+    }
+
+    /// Copy a dense array of dim voxels (x, then y, then z order) into the world at pos.
+    void set_dense(ivec3_in pos, ivec3_in dim, const elem_t *elems) {
+      elem_t dense[brick_size];
+      ivec3 lo = pos & ivec3(~(brick_dim - 1));
+      ivec3 hi = pos + dim;
+      for (int bz = lo.z(); bz < hi.z(); bz += brick_dim) {
+        for (int by = lo.y(); by < hi.y(); by += brick_dim) {
+          for (int bx = lo.x(); bx < hi.x(); bx += brick_dim) {
+            ivec3 brick_pos(bx, by, bz);
+            // keep the voxels outside the dense array.
+            decode_brick(dense, find_brick(brick_pos));
+            for (int z = 0; z != brick_dim; ++z) {
+              for (int y = 0; y != brick_dim; ++y) {
+                for (int x = 0; x != brick_dim; ++x) {
+                  ivec3 src = brick_pos + ivec3(x, y, z) - pos;
+                  if ((unsigned)src.x() < (unsigned)dim.x() && (unsigned)src.y() < (unsigned)dim.y() && (unsigned)src.z() < (unsigned)dim.z()) {
+                    dense[x + brick_dim * (y + brick_dim * z)] = elems[src.x() + dim.x() * (src.y() + dim.y() * src.z())];
+                  }
+                }
+              }
+            }
+            set_brick(brick_pos, dense);
+          }
+        }
+      }
+    }
+
+    /// The root child word. Keep it to undo edits.
+    uint32_t get_root() const {
+      return root;
+    }
+
+    /// Go back to an earlier root (not valid after compact()).
+    void set_root(uint32_t new_root) {
+      root = new_root;
+    }
+
+    /// Remove the nodes and bricks that edits have left behind.
+    void compact() {
+      sparse_voxel_octree result(log_dim, origin, voxel_size);
+      hash_map<uint32_t, uint32_t> copied;
+      result.root = copy_rec(result, root, copied);
+      std::swap(root, result.root);
+      nodes.swap(result.nodes);
+      brick_starts.swap(result.brick_starts);
+      runs.swap(result.runs);
+      node_map.clear();
+      brick_map.clear();
+      // rebuild the sharing maps for later edits.
+      for (unsigned n = 1; n != nodes.size() / 8; ++n) {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (int i = 0; i != 8; ++i) hash = hash_word(hash, nodes[n * 8 + i]);
+        uint32_t &slot = node_map[hash | 1];
+        if (!slot) slot = n + 1;
+      }
+      for (unsigned b = 0; b + 1 < brick_starts.size(); ++b) {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (unsigned r = brick_starts[b]; r != brick_starts[b + 1]; ++r) {
+          hash = hash_run(hash, runs[r]);
+        }
+        uint32_t &slot = brick_map[hash | 1];
+        if (!slot) slot = b + 1;
+      }
+    }
+
+    /// Interior nodes, eight child words each.
+    const dynarray<uint32_t> &get_nodes() const {
+      return nodes;
+    }
+
+    /// First run of each brick, with one extra entry for the end.
+    const dynarray<uint32_t> &get_brick_starts() const {
+      return brick_starts;
+    }
+
+    /// Runs of voxels for all bricks.
+    const dynarray<run> &get_runs() const {
+      return runs;
+    }
+
+    unsigned get_num_bricks() const {
+      return brick_starts.size() - 1;
+    }
+
+    /// bytes used by the buffers.
+    size_t get_memory_size() const {
+      return nodes.size() * sizeof(uint32_t) + brick_starts.size() * sizeof(uint32_t) + runs.size() * sizeof(run);
+    }
+
+    /// Add faces between solid and transparent voxels, skipping empty space and buried bricks.
+    template <class sink_t> void get_geometry(sink_t &sink, int) {
+      struct item { uint32_t word; int level; ivec3 pos; };
+      dynarray<item> stack;
+      item top = { root, log_dim, ivec3(0, 0, 0) };
+      if (root) stack.push_back(top);
+      while (!stack.empty()) {
+        item it = stack.back();
+        stack.pop_back();
+        if (it.level == log_brick_dim) {
+          add_brick_faces(sink, it.word, it.pos);
+        } else {
+          int half = 1 << (it.level - 1);
+          for (int i = 7; i >= 0; --i) {
+            uint32_t kid = nodes[it.word * 8 + i];
+            if (kid) {
+              item k = { kid, it.level - 1, it.pos + ivec3(i & 1, (i >> 1) & 1, i >> 2) * half };
+              stack.push_back(k);
+            }
+          }
+        }
+      }
+    }
+  };
+
+  #if OCTET_UNIT_TEST
+    class sparse_voxel_octree_unit_test {
+      struct traits {
+        static bool is_transparent(uint8_t value) { return value == 0; }
+      };
+
+      struct face_counter {
+        unsigned num_vertices, num_triangles;
+        face_counter() { num_vertices = num_triangles = 0; }
+        size_t add_vertex(vec3_in, vec3_in, vec3_in) { return num_vertices++; }
+        void add_triangle(uint32_t, uint32_t, uint32_t) { num_triangles++; }
+      };
+
+    public:
+      sparse_voxel_octree_unit_test() {
+        // a 1024^3 world with a floor and a box.
+        sparse_voxel_octree<uint8_t, traits> svo(10);
+        for (int z = 0; z != 1024; z += 8) {
+          for (int x = 0; x != 1024; x += 8) {
+            uint8_t dense[512];
+            memset(dense, 1, sizeof(dense));
+            svo.set_brick(ivec3(x, 0, z), dense);
+          }
+        }
+        // the floor is made of one brick shared by all the nodes.
+        assert(svo.get_num_bricks() == 1);
+        svo.compact();
+        size_t floor_size = svo.get_memory_size();
+        assert(floor_size < 4096);
+
+        uint32_t before = svo.get_root();
+        for (int z = 100; z != 110; ++z) {
+          for (int y = 8; y != 12; ++y) {
+            for (int x = 100; x != 103; ++x) {
+              svo.set(ivec3(x, y, z), 2);
+            }
+          }
+        }
+        assert(svo.get(ivec3(101, 9, 105)) == 2 && svo.get(ivec3(101, 12, 105)) == 0 && svo.get(ivec3(500, 3, 7)) == 1);
+
+        // undo, then redo and compact.
+        uint32_t after = svo.get_root();
+        svo.set_root(before);
+        assert(svo.get(ivec3(101, 9, 105)) == 0);
+        svo.set_root(after);
+        svo.compact();
+        assert(svo.get(ivec3(101, 9, 105)) == 2 && svo.get(ivec3(1023, 7, 1023)) == 1 && svo.get(ivec3(0, 8, 0)) == 0);
+
+        // box of 3x4x10 on the floor: 2*(3*4 + 4*10) + 3*10 faces, plus the floor top and the outside of the floor.
+        face_counter count;
+        svo.get_geometry(count, 0);
+        unsigned box_faces = 2 * (3 * 4 + 4 * 10) + 3 * 10;
+        unsigned floor_faces = 1024 * 1024 * 2 - 3 * 10 + 4 * 1024 * 8;
+        assert(count.num_triangles == (box_faces + floor_faces) * 2);
+
+        // dense copy matches.
+        sparse_voxel_octree<uint8_t, traits> small(4);
+        uint8_t elems[5 * 6 * 7];
+        for (int i = 0; i != 5 * 6 * 7; ++i) elems[i] = (uint8_t)(i % 3);
+        small.set_dense(ivec3(3, 2, 1), ivec3(5, 6, 7), elems);
+        for (int i = 0; i != 5 * 6 * 7; ++i) {
+          assert(small.get(ivec3(3 + i % 5, 2 + (i / 5) % 6, 1 + i / 30)) == elems[i]);
+        }
+        assert(small.get(ivec3(2, 2, 1)) == 0 && small.get(ivec3(8, 2, 1)) == 0);
+      }
+    };
+    static sparse_voxel_octree_unit_test sparse_voxel_octree_unit_test;
+  #endif
+} }
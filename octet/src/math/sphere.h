@@ -70,7 +70,15 @@ namespace octet { namespace math {
     }
 
 
-    template <class sink_t> void get_geometry(sink_t &sink, int max_level) const {
+    /// Vertices and indices made by get_geometry.
+    void get_geometry_size(int max_level, unsigned &num_vertices, unsigned &num_indices) const {
+      num_vertices = 12 + 20 * vertices_per_triangle(max_level);
+      num_indices = 20 * indices_per_triangle(max_level);
+    }
+
+    /// Make an icosphere. Each of the 20 faces of the icosahedron is split max_level times,
+    /// in parallel if the sink supports it.
+    template <class sink_t> void get_geometry(sink_t &sink, int max_level) const {
       static const float phi = 1.61803f;
       static const float icosahedron[] = {
         0, +1, +phi,    0, -1, +phi,    0, +1, -phi,    0, -1, -phi,
@@ -89,8 +97,17 @@ namespace octet { namespace math {
     }
 
   private:
-    template <class sink_t> void add_triangle(sink_t &sink, int a, int b, int c, int level, int max_level) const {
-      //log("add_triangle %d %d %d %d\n", a, b, c, level);
+    // new vertices made by splitting one triangle max_level times: 3 + 12 + 48...
+    static unsigned vertices_per_triangle(int max_level) {
+      return (1u << (max_level * 2)) - 1;
+    }
+
+    static unsigned indices_per_triangle(int max_level) {
+      return 3u << (max_level * 2);
+    }
+
+    // positions are passed down so that the sink never has to be read.
+    template <class sink_t> void add_triangle(sink_t &sink, int a, int b, int c, vec3_in na, vec3_in nb, vec3_in nc, int level, int max_level) const {
       if (level == max_level) {
         sink.add_triangle(a, b, c);
       } else {
@@ -99,22 +116,18 @@ namespace octet { namespace math {
         //    /__\
         //   /_\/_\
         // c        b
-        vec3 pa = sink.get_vertex(a).pos;
-        vec3 pb = sink.get_vertex(b).pos;
-        vec3 pc = sink.get_vertex(c).pos;
-
-        vec3 ab = normalize((pa + pb) * 0.5f);
-        vec3 bc = normalize((pb + pc) * 0.5f);
-        vec3 ca = normalize((pc + pa) * 0.5f);
+        vec3 ab = normalize(na + nb);
+        vec3 bc = normalize(nb + nc);
+        vec3 ca = normalize(nc + na);
 
         int nab = (int)sink.add_vertex(pos(ab), ab, uv(ab));
         int nbc = (int)sink.add_vertex(pos(bc), bc, uv(bc));
         int nca = (int)sink.add_vertex(pos(ca), ca, uv(ca));
 
-        add_triangle(sink, a, nab, nca, level+1, max_level);
-        add_triangle(sink, b, nbc, nab, level+1, max_level);
-        add_triangle(sink, c, nca, nbc, level+1, max_level);
-        add_triangle(sink, nab, nbc, nca, level+1, max_level);
+        add_triangle(sink, a, nab, nca, na, ab, ca, level+1, max_level);
+        add_triangle(sink, b, nbc, nab, nb, bc, ab, level+1, max_level);
+        add_triangle(sink, c, nca, nbc, nc, ca, bc, level+1, max_level);
+        add_triangle(sink, nab, nbc, nca, ab, bc, ca, level+1, max_level);
       }
     }
 
@@ -128,25 +141,20 @@ namespace octet { namespace math {
     }
 
     template <class sink_t> void add_shape(sink_t &sink, const float *vertices, unsigned nv, const uint8_t *indices, unsigned ni, int max_level) const {
-      unsigned tot_ni = 3*ni << (max_level*2);
-      unsigned tot_nv = nv;
-      for (int i = 0; i < max_level; ++i) {
-        tot_nv += (ni*3) << (i*2);
-      }
+      sink.reserve(nv + ni * vertices_per_triangle(max_level), ni * indices_per_triangle(max_level));
 
-      sink.reserve(tot_nv, tot_ni);
-
-      int ix = 0, vx = 0;
+      vec3 normals[12];
       for (unsigned i = 0; i != nv; ++i) {
-        vec3 n = normalize(vec3(vertices[0], vertices[1], vertices[2]));
-        sink.add_vertex(pos(n), n, uv(n));
+        normals[i] = normalize(vec3(vertices[0], vertices[1], vertices[2]));
+        sink.add_vertex(pos(normals[i]), normals[i], uv(normals[i]));
         vertices += 3;
       }
 
-      for (unsigned i = 0; i != ni; ++i) {
-        add_triangle(sink, indices[0], indices[1], indices[2], 0, max_level);
-        indices += 3;
-      }
+      // every face makes the same number of vertices and indices, so faces can be done at the same time.
+      sink.add_parts(ni, vertices_per_triangle(max_level), indices_per_triangle(max_level), [&](sink_t &part, unsigned i) {
+        const uint8_t *tri = indices + i * 3;
+        add_triangle(part, tri[0], tri[1], tri[2], normals[tri[0]], normals[tri[1]], normals[tri[2]], 0, max_level);
+      });
     }
 
   };
@@ -0,0 +1,417 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Transform arrays of points, boxes and matrices
+//
+
+namespace octet { namespace math {
+  /// Transform many points, boxes or matrices in one call.
+  ///
+  /// Uses SSE where OCTET_SSE is set. When the CPU has AVX2 and FMA, 256 bit versions are
+  /// chosen the first time the class is used. The destination may be the same as a source.
+  ///
+  /// Example:
+  ///
+  ///     transform_batch::points(world_pos, model_pos, num_vertices, modelToWorld);
+  ///     transform_batch::matrices(bone_to_camera, bone_to_model, num_bones, modelToCamera);
+  class transform_batch {
+    struct kernels {
+      void (*points3)(vec3p *dest, const vec3p *src, size_t n, const mat4t &m);
+      void (*points4)(vec4 *dest, const vec4 *src, size_t n, const mat4t &m);
+      void (*aabbs)(aabb *dest, const aabb *src, size_t n, const mat4t &m);
+      void (*matrices)(mat4t *dest, const mat4t *lhs, size_t n, const mat4t &rhs);
+      void (*matrix_pairs)(mat4t *dest, const mat4t *lhs, const mat4t *rhs, size_t n);
+      bool avx;
+    };
+
+    ////////////////////////////////////////////////////////////////////////////////
+    //
+    // scalar and SSE
+    //
+
+    static void points3_sse(vec3p *dest, const vec3p *src, size_t n, const mat4t &m) {
+      #if OCTET_SSE
+        __m128 r0 = m[0].get_m(), r1 = m[1].get_m(), r2 = m[2].get_m(), r3 = m[3].get_m();
+        const float *s = (const float*)src;
+        float *d = (float*)dest;
+        size_t i = 0;
+
+        // four points are three aligned vectors: x0y0z0x1 y1z1x2y2 z2x3y3z3
+        for (; i + 4 <= n; i += 4, s += 12, d += 12) {
+          __m128 a = _mm_loadu_ps(s), b = _mm_loadu_ps(s + 4), c = _mm_loadu_ps(s + 8);
+          #define OCTET_POINT(X, XS, Y, YS, Z, ZS) \
+            _mm_add_ps( \
+              _mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(X, X, _MM_SHUFFLE(XS,XS,XS,XS)), r0), _mm_mul_ps(_mm_shuffle_ps(Y, Y, _MM_SHUFFLE(YS,YS,YS,YS)), r1)), \
+              _mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(Z, Z, _MM_SHUFFLE(ZS,ZS,ZS,ZS)), r2), r3) \
+            )
+          __m128 p0 = OCTET_POINT(a, 0, a, 1, a, 2);
+          __m128 p1 = OCTET_POINT(a, 3, b, 0, b, 1);
+          __m128 p2 = OCTET_POINT(b, 2, b, 3, c, 0);
+          __m128 p3 = OCTET_POINT(c, 1, c, 2, c, 3);
+          #undef OCTET_POINT
+          __m128 t01 = _mm_shuffle_ps(p0, p1, _MM_SHUFFLE(0,0,2,2));
+          __m128 t23 = _mm_shuffle_ps(p2, p3, _MM_SHUFFLE(0,0,2,2));
+          _mm_storeu_ps(d, _mm_shuffle_ps(p0, t01, _MM_SHUFFLE(2,0,1,0)));
+          _mm_storeu_ps(d + 4, _mm_shuffle_ps(p1, p2, _MM_SHUFFLE(1,0,2,1)));
+          _mm_storeu_ps(d + 8, _mm_shuffle_ps(t23, p3, _MM_SHUFFLE(2,1,2,0)));
+        }
+
+        // one at a time without reading or writing past the end.
+        for (; i != n; ++i, s += 3, d += 3) {
+          __m128 xy = _mm_loadl_pi(_mm_setzero_ps(), (const __m64*)s);
+          __m128 z = _mm_load_ss(s + 2);
+          __m128 p = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(xy, xy, _MM_SHUFFLE(0,0,0,0)), r0), _mm_mul_ps(_mm_shuffle_ps(xy, xy, _MM_SHUFFLE(1,1,1,1)), r1)),
+            _mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(z, z, _MM_SHUFFLE(0,0,0,0)), r2), r3)
+          );
+          _mm_storel_pi((__m64*)d, p);
+          _mm_store_ss(d + 2, _mm_movehl_ps(p, p));
+        }
+      #else
+        for (size_t i = 0; i != n; ++i) {
+          dest[i] = vec3(src[i]) * m;
+        }
+      #endif
+    }
+
+    static void points4_sse(vec4 *dest, const vec4 *src, size_t n, const mat4t &m) {
+      for (size_t i = 0; i != n; ++i) {
+        dest[i] = m.lmul(src[i]);
+      }
+    }
+
+    static void aabbs_sse(aabb *dest, const aabb *src, size_t n, const mat4t &m) {
+      // the absolute rows are the same for every box.
+      vec3 a0 = abs(m[0].xyz()), a1 = abs(m[1].xyz()), a2 = abs(m[2].xyz());
+      for (size_t i = 0; i != n; ++i) {
+        vec3 center = src[i].get_center(), half = src[i].get_half_extent();
+        dest[i] = aabb(center * m, half.x() * a0 + half.y() * a1 + half.z() * a2);
+      }
+    }
+
+    static void matrices_sse(mat4t *dest, const mat4t *lhs, size_t n, const mat4t &rhs) {
+      for (size_t i = 0; i != n; ++i) {
+        dest[i] = lhs[i] * rhs;
+      }
+    }
+
+    static void matrix_pairs_sse(mat4t *dest, const mat4t *lhs, const mat4t *rhs, size_t n) {
+      for (size_t i = 0; i != n; ++i) {
+        dest[i] = lhs[i] * rhs[i];
+      }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////
+    //
+    // AVX2 and FMA: two vec4s in each register
+    //
+
+    #if OCTET_AVX
+      // rows 0-1 or 2-3 of a matrix times the rows of another.
+      __attribute__((target("avx2,fma"))) static __m256 mul_rows_avx(__m256 l, __m256 r0, __m256 r1, __m256 r2, __m256 r3) {
+        __m256 res = _mm256_mul_ps(_mm256_permute_ps(l, 0xff), r3);
+        res = _mm256_fmadd_ps(_mm256_permute_ps(l, 0xaa), r2, res);
+        res = _mm256_fmadd_ps(_mm256_permute_ps(l, 0x55), r1, res);
+        return _mm256_fmadd_ps(_mm256_permute_ps(l, 0x00), r0, res);
+      }
+
+      __attribute__((target("avx2,fma"))) static void points3_avx(vec3p *dest, const vec3p *src, size_t n, const mat4t &m) {
+        __m128 r0 = m[0].get_m(), r1 = m[1].get_m(), r2 = m[2].get_m(), r3 = m[3].get_m();
+        const float *s = (const float*)src;
+        float *d = (float*)dest;
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4, s += 12, d += 12) {
+          __m128 a = _mm_loadu_ps(s), b = _mm_loadu_ps(s + 4), c = _mm_loadu_ps(s + 8);
+          #define OCTET_POINT(X, XS, Y, YS, Z, ZS) \
+            _mm_fmadd_ps(_mm_permute_ps(X, _MM_SHUFFLE(XS,XS,XS,XS)), r0, \
+              _mm_fmadd_ps(_mm_permute_ps(Y, _MM_SHUFFLE(YS,YS,YS,YS)), r1, \
+                _mm_fmadd_ps(_mm_permute_ps(Z, _MM_SHUFFLE(ZS,ZS,ZS,ZS)), r2, r3)))
+          __m128 p0 = OCTET_POINT(a, 0, a, 1, a, 2);
+          __m128 p1 = OCTET_POINT(a, 3, b, 0, b, 1);
+          __m128 p2 = OCTET_POINT(b, 2, b, 3, c, 0);
+          __m128 p3 = OCTET_POINT(c, 1, c, 2, c, 3);
+          #undef OCTET_POINT
+          __m128 t01 = _mm_shuffle_ps(p0, p1, _MM_SHUFFLE(0,0,2,2));
+          __m128 t23 = _mm_shuffle_ps(p2, p3, _MM_SHUFFLE(0,0,2,2));
+          _mm_storeu_ps(d, _mm_shuffle_ps(p0, t01, _MM_SHUFFLE(2,0,1,0)));
+          _mm_storeu_ps(d + 4, _mm_shuffle_ps(p1, p2, _MM_SHUFFLE(1,0,2,1)));
+          _mm_storeu_ps(d + 8, _mm_shuffle_ps(t23, p3, _MM_SHUFFLE(2,1,2,0)));
+        }
+        points3_sse(dest + i, src + i, n - i, m);
+      }
+
+      __attribute__((target("avx2,fma"))) static void points4_avx(vec4 *dest, const vec4 *src, size_t n, const mat4t &m) {
+        __m256 r0 = _mm256_broadcast_ps((const __m128*)&m[0]), r1 = _mm256_broadcast_ps((const __m128*)&m[1]);
+        __m256 r2 = _mm256_broadcast_ps((const __m128*)&m[2]), r3 = _mm256_broadcast_ps((const __m128*)&m[3]);
+        size_t i = 0;
+        for (; i + 2 <= n; i += 2) {
+          __m256 p = _mm256_loadu_ps((const float*)(src + i));
+          _mm256_storeu_ps((float*)(dest + i), mul_rows_avx(p, r0, r1, r2, r3));
+        }
+        points4_sse(dest + i, src + i, n - i, m);
+      }
+
+      __attribute__((target("avx2,fma"))) static void aabbs_avx(aabb *dest, const aabb *src, size_t n, const mat4t &m) {
+        static const u_m128_i4 abs_mask = { 0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff };
+        __m256 mask = _mm256_broadcast_ps(&abs_mask.m);
+        __m256 r0 = _mm256_broadcast_ps((const __m128*)&m[0]), r1 = _mm256_broadcast_ps((const __m128*)&m[1]);
+        __m256 r2 = _mm256_broadcast_ps((const __m128*)&m[2]), r3 = _mm256_broadcast_ps((const __m128*)&m[3]);
+        __m256 a0 = _mm256_and_ps(r0, mask), a1 = _mm256_and_ps(r1, mask), a2 = _mm256_and_ps(r2, mask);
+        // an aabb is a center and a half extent, so each box fills a register.
+        for (size_t i = 0; i != n; ++i) {
+          __m256 box = _mm256_loadu_ps((const float*)(src + i));
+          __m256 c = _mm256_fmadd_ps(_mm256_permute_ps(box, 0x00), r0,
+            _mm256_fmadd_ps(_mm256_permute_ps(box, 0x55), r1,
+              _mm256_fmadd_ps(_mm256_permute_ps(box, 0xaa), r2, r3)));
+          __m256 h = _mm256_fmadd_ps(_mm256_permute_ps(box, 0x00), a0,
+            _mm256_fmadd_ps(_mm256_permute_ps(box, 0x55), a1,
+              _mm256_mul_ps(_mm256_permute_ps(box, 0xaa), a2)));
+          // center from the low half of c, extent from the high half of h.
+          _mm256_storeu_ps((float*)(dest + i), _mm256_blend_ps(c, h, 0xf0));
+        }
+      }
+
+      __attribute__((target("avx2,fma"))) static void matrices_avx(mat4t *dest, const mat4t *lhs, size_t n, const mat4t &rhs) {
+        __m256 r0 = _mm256_broadcast_ps((const __m128*)&rhs[0]), r1 = _mm256_broadcast_ps((const __m128*)&rhs[1]);
+        __m256 r2 = _mm256_broadcast_ps((const __m128*)&rhs[2]), r3 = _mm256_broadcast_ps((const __m128*)&rhs[3]);
+        for (size_t i = 0; i != n; ++i) {
+          const float *l = (const float*)(lhs + i);
+          __m256 l01 = _mm256_loadu_ps(l), l23 = _mm256_loadu_ps(l + 8);
+          float *d = (float*)(dest + i);
+          _mm256_storeu_ps(d, mul_rows_avx(l01, r0, r1, r2, r3));
+          _mm256_storeu_ps(d + 8, mul_rows_avx(l23, r0, r1, r2, r3));
+        }
+      }
+
+      __attribute__((target("avx2,fma"))) static void matrix_pairs_avx(mat4t *dest, const mat4t *lhs, const mat4t *rhs, size_t n) {
+        for (size_t i = 0; i != n; ++i) {
+          __m256 r0 = _mm256_broadcast_ps((const __m128*)&rhs[i][0]), r1 = _mm256_broadcast_ps((const __m128*)&rhs[i][1]);
+          __m256 r2 = _mm256_broadcast_ps((const __m128*)&rhs[i][2]), r3 = _mm256_broadcast_ps((const __m128*)&rhs[i][3]);
+          const float *l = (const float*)(lhs + i);
+          __m256 l01 = _mm256_loadu_ps(l), l23 = _mm256_loadu_ps(l + 8);
+          float *d = (float*)(dest + i);
+          _mm256_storeu_ps(d, mul_rows_avx(l01, r0, r1, r2, r3));
+          _mm256_storeu_ps(d + 8, mul_rows_avx(l23, r0, r1, r2, r3));
+        }
+      }
+    #endif
+
+    static kernels choose(bool allow_avx) {
+      kernels k = { points3_sse, points4_sse, aabbs_sse, matrices_sse, matrix_pairs_sse, false };
+      #if OCTET_AVX
+        if (allow_avx && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+          kernels a = { points3_avx, points4_avx, aabbs_avx, matrices_avx, matrix_pairs_avx, true };
+          k = a;
+        }
+      #else
+        (void)allow_avx;
+      #endif
+      return k;
+    }
+
+    static kernels &get() {
+      static kernels k = choose(true);
+      return k;
+    }
+  public:
+    /// dest[i] = src[i] * m, with w = 1.
+    static void points(vec3p *dest, const vec3p *src, size_t n, const mat4t &m) {
+      get().points3(dest, src, n, m);
+    }
+
+    /// dest[i] = src[i] * m
+    static void points(vec4 *dest, const vec4 *src, size_t n, const mat4t &m) {
+      get().points4(dest, src, n, m);
+    }
+
+    /// dest[i] = src[i].get_transform(m)
+    static void aabbs(aabb *dest, const aabb *src, size_t n, const mat4t &m) {
+      get().aabbs(dest, src, n, m);
+    }
+
+    /// dest[i] = lhs[i] * rhs; eg. boneToModel[i] * modelToWorld.
+    static void matrices(mat4t *dest, const mat4t *lhs, size_t n, const mat4t &rhs) {
+      get().matrices(dest, lhs, n, rhs);
+    }
+
+    /// dest[i] = lhs[i] * rhs[i]
+    static void matrices(mat4t *dest, const mat4t *lhs, const mat4t *rhs, size_t n) {
+      get().matrix_pairs(dest, lhs, rhs, n);
+    }
+
+    /// True if the AVX2 versions are in use.
+    static bool using_avx() {
+      return get().avx;
+    }
+
+    /// Turn the AVX2 versions off or back on, eg. to compare them.
+    static void enable_avx(bool value) {
+      get() = choose(value);
+    }
+  };
+
+  #if OCTET_UNIT_TEST
+    class transform_batch_unit_test {
+      static bool near(const vec4 &a, const vec4 &b) {
+        return (a - b).abs().sum() <= 1e-4f * (1 + b.abs().sum());
+      }
+    public:
+      transform_batch_unit_test() {
+        random rand;
+        mat4t m;
+        m.rotate(33, 0.36f, 0.48f, 0.8f);
+        m.translate(1, -2, 3);
+        m[0] = m[0] * 1.5f;
+
+        for (int pass = 0; pass != 2; ++pass) {
+          transform_batch::enable_avx(pass == 0);
+          for (size_t n = 0; n != 11; ++n) {
+            dynarray<vec3p> p3(n + 1);
+            dynarray<vec4> p4(n + 1);
+            dynarray<aabb> boxes(n + 1);
+            dynarray<mat4t> mats(n + 1);
+            for (size_t i = 0; i != n + 1; ++i) {
+              vec3 v(rand.get(-10.0f, 10.0f), rand.get(-10.0f, 10.0f), rand.get(-10.0f, 10.0f));
+              p3[i] = v;
+              p4[i] = vec4(v, rand.get(-1.0f, 1.0f));
+              boxes[i] = aabb(v, abs(v) * 0.25f);
+              mats[i] = m;
+              mats[i].translate(v);
+            }
+            vec3p guard = p3[n];
+
+            dynarray<vec3p> r3(n + 1);
+            r3[n] = guard;
+            transform_batch::points(r3.data(), p3.data(), n, m);
+            for (size_t i = 0; i != n; ++i) assert(near(vec3(r3[i]).xyz0(), (vec3(p3[i]) * m).xyz0()));
+            assert(near(vec3(r3[n]).xyz0(), vec3(guard).xyz0()));
+
+            dynarray<vec4> r4(n);
+            transform_batch::points(r4.data(), p4.data(), n, m);
+            for (size_t i = 0; i != n; ++i) assert(near(r4[i], p4[i] * m));
+
+            dynarray<aabb> rb(n);
+            transform_batch::aabbs(rb.data(), boxes.data(), n, m);
+            for (size_t i = 0; i != n; ++i) {
+              aabb b = boxes[i].get_transform(m);
+              assert(near(rb[i].get_center().xyz0(), b.get_center().xyz0()));
+              assert(near(rb[i].get_half_extent().xyz0(), b.get_half_extent().xyz0()));
+            }
+
+            dynarray<mat4t> rm(n);
+            transform_batch::matrices(rm.data(), mats.data(), n, m);
+            for (size_t i = 0; i != n; ++i) {
+              mat4t e = mats[i] * m;
+              for (int j = 0; j != 4; ++j) assert(near(rm[i][j], e[j]));
+            }
+            transform_batch::matrices(rm.data(), mats.data(), mats.data() + 1, n);
+            for (size_t i = 0; i != n; ++i) {
+              mat4t e = mats[i] * mats[i+1];
+              for (int j = 0; j != 4; ++j) assert(near(rm[i][j], e[j]));
+            }
+          }
+        }
+        transform_batch::enable_avx(true);
+      }
+    };
+    static transform_batch_unit_test transform_batch_unit_test;
+  #endif
+
+  #if OCTET_BENCHMARK
+    /// Millions of operations per second for the math in this file.
+    /// The batch calls are timed with AVX2 (when the CPU has it) and SSE, against a loop over the
+    /// single item operators. Those use SSE unless octet is built with -D OCTET_SSE=0,
+    /// so run both builds to compare SSE with scalar.
+    class transform_batch_benchmark {
+      enum { n = 4096, passes = 256 };
+
+      // row-major product in plain C for reference.
+      static void mul_plain(float *dest, const float *lhs, const float *rhs) {
+        for (int i = 0; i != 4; ++i) {
+          for (int j = 0; j != 4; ++j) {
+            dest[i*4+j] = lhs[i*4+0] * rhs[0*4+j] + lhs[i*4+1] * rhs[1*4+j] + lhs[i*4+2] * rhs[2*4+j] + lhs[i*4+3] * rhs[3*4+j];
+          }
+        }
+      }
+
+      template <class fn_t> static void time(const char *name, fn_t fn) {
+        benchmark_timer timer;
+        for (int p = 0; p != passes; ++p) {
+          fn();
+        }
+        timer.report(name, (double)n * passes, "ops");
+      }
+
+      static void time_batches(const char *kind, const dynarray<vec3p> &p3, const dynarray<vec4> &p4, const dynarray<aabb> &boxes, const dynarray<mat4t> &mats, const mat4t &m) {
+        dynarray<vec3p> r3(n);
+        dynarray<vec4> r4(n);
+        dynarray<aabb> rb(n);
+        dynarray<mat4t> rm(n);
+        char name[64];
+        snprintf(name, sizeof(name), "points(vec3p), %s", kind);
+        time(name, [&]() { transform_batch::points(r3.data(), p3.data(), n, m); });
+        snprintf(name, sizeof(name), "points(vec4), %s", kind);
+        time(name, [&]() { transform_batch::points(r4.data(), p4.data(), n, m); });
+        snprintf(name, sizeof(name), "aabbs, %s", kind);
+        time(name, [&]() { transform_batch::aabbs(rb.data(), boxes.data(), n, m); });
+        snprintf(name, sizeof(name), "matrices, %s", kind);
+        time(name, [&]() { transform_batch::matrices(rm.data(), mats.data(), n, m); });
+        snprintf(name, sizeof(name), "matrices(pairs), %s", kind);
+        time(name, [&]() { transform_batch::matrices(rm.data(), mats.data(), mats.data(), n); });
+      }
+    public:
+      transform_batch_benchmark() {
+        const char *kind = OCTET_SSE ? "SSE" : "scalar";
+        printf("transform_batch_benchmark: %d items, single items are %s\n", n, kind);
+
+        random rand;
+        mat4t m;
+        m.rotate(33, 0.36f, 0.48f, 0.8f);
+        m.translate(1, -2, 3);
+        dynarray<vec3p> p3(n);
+        dynarray<vec4> p4(n);
+        dynarray<aabb> boxes(n);
+        dynarray<mat4t> mats(n);
+        for (int i = 0; i != n; ++i) {
+          vec3 v(rand.get(-10.0f, 10.0f), rand.get(-10.0f, 10.0f), rand.get(-10.0f, 10.0f));
+          p3[i] = v;
+          p4[i] = vec4(v, 1.0f);
+          boxes[i] = aabb(v, abs(v) * 0.25f);
+          mats[i] = m;
+          mats[i].translate(v);
+        }
+
+        dynarray<vec4> r4(n);
+        dynarray<mat4t> rm(n);
+        char name[64];
+        snprintf(name, sizeof(name), "mat4t * mat4t, %s", kind);
+        time(name, [&]() { for (int i = 0; i != n; ++i) rm[i] = mats[i] * m; });
+        time("mat4t * mat4t, plain C", [&]() { for (int i = 0; i != n; ++i) mul_plain(rm[i].get(), mats[i].get(), m.get()); });
+        snprintf(name, sizeof(name), "mat4t::inverse3x4, %s", kind);
+        time(name, [&]() { for (int i = 0; i != n; ++i) rm[i] = mats[i].inverse3x4(); });
+        snprintf(name, sizeof(name), "vec4::cross, %s", kind);
+        time(name, [&]() { for (int i = 0; i != n; ++i) r4[i] = p4[i].cross(p4[n-1-i]); });
+
+        // the loops that the batch calls replace.
+        dynarray<vec3p> r3(n);
+        dynarray<aabb> rb(n);
+        snprintf(name, sizeof(name), "vec3 * mat4t loop, %s", kind);
+        time(name, [&]() { for (int i = 0; i != n; ++i) r3[i] = vec3(p3[i]) * m; });
+        snprintf(name, sizeof(name), "aabb::get_transform loop, %s", kind);
+        time(name, [&]() { for (int i = 0; i != n; ++i) rb[i] = boxes[i].get_transform(m); });
+
+        bool avx = transform_batch::using_avx();
+        if (avx) {
+          time_batches("AVX2", p3, p4, boxes, mats, m);
+        }
+        transform_batch::enable_avx(false);
+        time_batches(kind, p3, p4, boxes, mats, m);
+        transform_batch::enable_avx(avx);
+      }
+    };
+    static transform_batch_benchmark transform_batch_benchmark;
+  #endif
+} }
@@ -144,12 +144,20 @@ namespace octet { namespace math {
 
     // cross product
     OCTET_HOT vec4 cross(const vec4 &r) const {
-      return vec4(
-        v[1] * r.v[2] - v[2] * r.v[1],
-	      v[2] * r.v[0] - v[0] * r.v[2],
-	      v[0] * r.v[1] - v[1] * r.v[0],
-	      0.0f
-	    );
+      #if OCTET_SSE
+        // (a * b.yzx - a.yzx * b).yzx with three shuffles; the w terms cancel.
+        __m128 a_yzx = _mm_shuffle_ps(m, m, _MM_SHUFFLE(3,0,2,1));
+        __m128 b_yzx = _mm_shuffle_ps(r.m, r.m, _MM_SHUFFLE(3,0,2,1));
+        __m128 c = _mm_sub_ps(_mm_mul_ps(m, b_yzx), _mm_mul_ps(a_yzx, r.m));
+        return vec4(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3,0,2,1)));
+      #else
+        return vec4(
+          v[1] * r.v[2] - v[2] * r.v[1],
+	        v[2] * r.v[0] - v[0] * r.v[2],
+	        v[0] * r.v[1] - v[1] * r.v[0],
+	        0.0f
+	      );
+      #endif
     }
 
     // positive cross product (for box tests)
@@ -202,7 +210,7 @@ namespace octet { namespace math {
       #if OCTET_SSE
         return vec4(_mm_div_ps(m, r.m));
       #else
-        return vec4(v[0]*r.v[0], v[1]*r.v[1], v[2]*r.v[2], v[3]*r.v[3]);
+        return vec4(v[0]/r.v[0], v[1]/r.v[1], v[2]/r.v[2], v[3]/r.v[3]);
       #endif
     }
 
@@ -369,6 +377,10 @@ namespace octet { namespace math {
       return v[3];
     }
 
+    #if OCTET_SSE
+      OCTET_HOT __m128 get_m() const { return m; }
+    #endif
+
     // quaternion multiply
     OCTET_HOT vec4 qmul(const vec4 &r) const {
       return vec4(
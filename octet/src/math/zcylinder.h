@@ -42,6 +42,12 @@ namespace octet { namespace math {
       return dest;
     }
 
+    /// Vertices and indices made by get_geometry.
+    void get_geometry_size(int steps, unsigned &num_vertices, unsigned &num_indices) const {
+      num_vertices = steps * 4;
+      num_indices = steps * 6 + (steps - 2) * 6;
+    }
+
     template <class sink_t> void get_geometry(sink_t &sink, int steps) const {
       sink.reserve(steps * 4, steps * 6 + (steps - 2) * 6);
 
@@ -144,11 +144,16 @@
   #include "helpers/mouse_look.h"
   #include "helpers/http_server.h"
   #include "helpers/text_overlay.h"
+  #include "helpers/texture_atlas.h"
+  #include "helpers/sprite_batch.h"
+  #include "helpers/broadphase_2d.h"
   #include "helpers/object_picker.h"
   #include "helpers/helper_fps_controller.h"
 
   // asset loaders
   #include "loaders/collada_builder.h"
+  #include "loaders/pdb_decoder.h"
+  #include "loaders/obj_loader.h"
 
   // forward references
   #include "resources/resources.inl"
@@ -136,233 +136,990 @@ namespace octet {
     AL_EXPONENT_DISTANCE_CLAMPED = 0xD006,
   };
 
+  /// Sound data for the software mixer.
+  ///
+  /// Samples are converted to float, one array per channel, when the data is set.
+  /// Each channel ends with two zeros so that the resampler can read past the last sample.
+  /// As in OpenAL, do not set the data of a buffer that is playing.
   class ALbuffer {
-    unsigned ref_cnt;
+    ref_counter ref_cnt;
 
-    dynarray<uint8_t> data;
+    dynarray<float> samples;
+    unsigned num_channels;
+    unsigned num_frames;
     unsigned format;
     unsigned freq;
+    unsigned size;
   public:
 
     ALbuffer() {
-      ref_cnt = 0;
+      num_channels = 1;
+      num_frames = 0;
+      format = AL_FORMAT_MONO16;
+      freq = 44100;
+      size = 0;
+      samples.resize(2);
+      samples[0] = samples[1] = 0;
     }
 
     void add_ref() {
-      ref_cnt++;
+      ref_cnt.add();
     }
 
+    // buffers may be released on the mixer thread; they have no GL state.
     void release() {
-      if (!--ref_cnt) {
+      if (ref_cnt.remove()) {
         delete this;
       }
     }
 
     void set_data(const void *new_data, unsigned size, unsigned format, unsigned freq) {
-      data.resize(size);
-      memcpy(&data[0], new_data, size);
+      bool is_16 = format == AL_FORMAT_MONO16 || format == AL_FORMAT_STEREO16;
+      num_channels = format == AL_FORMAT_STEREO8 || format == AL_FORMAT_STEREO16 ? 2 : 1;
+      num_frames = size / (num_channels * (is_16 ? 2 : 1));
       this->format = format;
-      this->freq = freq;
-    }
-
-    unsigned get_max_samples() {
-      if (format == AL_FORMAT_MONO16) {
-        return data.size() / 2;
+      this->freq = freq ? freq : 44100;
+      this->size = size;
+
+      samples.resize((num_frames + 2) * num_channels);
+      for (unsigned c = 0; c != num_channels; ++c) {
+        float *dest = &samples[c * (num_frames + 2)];
+        if (is_16) {
+          const uint8_t *src = (const uint8_t*)new_data + c * 2;
+          for (unsigned i = 0; i != num_frames; ++i) {
+            dest[i] = (int16_t)(src[0] + src[1] * 256) * (1.0f/32768);
+            src += num_channels * 2;
+          }
+        } else {
+          const uint8_t *src = (const uint8_t*)new_data + c;
+          for (unsigned i = 0; i != num_frames; ++i) {
+            dest[i] = (*src - 128) * (1.0f/128);
+            src += num_channels;
+          }
+        }
+        dest[num_frames] = dest[num_frames + 1] = 0;
       }
-      return 0;
     }
 
-    void render(float *mixer, unsigned start, unsigned num_samples, unsigned num_channels, float gain) {
-      unsigned max_samples = get_max_samples();
-      if (format == AL_FORMAT_MONO16) {
-        int16_t *sp = (int16_t *)&data[0] + start;
-        float scale = gain * (1.0f/16384);
-        for (unsigned i = 0; i != num_samples; ++i) {
-          float delta = *sp++ * scale;
-          mixer[0] += delta;
-          mixer[1] += delta;
-          mixer += 2;
-        }
-      }
+    const float *get_channel(unsigned channel) const {
+      return samples.data() + channel * (num_frames + 2);
     }
+
+    unsigned get_num_channels() const { return num_channels; }
+    unsigned get_num_frames() const { return num_frames; }
+    unsigned get_freq() const { return freq; }
+    unsigned get_format() const { return format; }
+    unsigned get_size() const { return size; }
   };
 
-  class ALsource {
-    unsigned ref_cnt;
-    unsigned buffer;
-    unsigned sample;
+  /// The AL thread's view of a source. The mixer has its own copy in ALvoice.
+  struct ALsource {
+    // written by the mixer after each block.
+    std::atomic<unsigned> mixed_state;
+    std::atomic<unsigned> mixed_offset;
+    std::atomic<unsigned> applied;
+
+    // play, stop, pause and rewind commands sent and the state we expect after them.
+    unsigned issued;
     unsigned state;
-    unsigned looping;
-    float gain;
 
-    void *access(unsigned param) {
-      if (param == AL_SOURCE_STATE) {
-        return &state;
-      } else if (param == AL_SAMPLE_OFFSET) {
-        return &sample;
-      } else if (param == AL_BUFFER) {
-        return &buffer;
-      } else if (param == AL_LOOPING) {
-        return &looping;
-      } else if (param == AL_GAIN) {
-        return &gain;
-      } else {
-        return 0;
-      }
+    bool in_use;
+    unsigned buffer;
+    dynarray<unsigned> queued;
+    unsigned unqueued;
+    int looping;
+    int relative;
+    float gain;
+    float pitch;
+    float ref_distance;
+    float rolloff;
+    float max_distance;
+    float min_gain;
+    float max_gain;
+    float position[3];
+
+    // buffers unqueued by the mixer (high 16 bits) and buffers played (low 16 bits).
+    std::atomic<unsigned> mixed_queue;
+
+    ALsource() : mixed_state(AL_INITIAL), mixed_offset(0), applied(0), mixed_queue(0) {
+      issued = 0;
+      unqueued = 0;
+      reset();
     }
 
-  public:
-
-    ALsource() {
-      ref_cnt = 0;
-      state = AL_STOPPED;
-      sample = 0;
-      looping = 0;
+    void reset() {
+      state = AL_INITIAL;
+      in_use = false;
       buffer = 0;
+      queued.resize(0);
+      looping = 0;
+      relative = 0;
       gain = 1;
+      pitch = 1;
+      ref_distance = 1;
+      rolloff = 1;
+      max_distance = 1e30f;
+      min_gain = 0;
+      max_gain = 1;
+      position[0] = position[1] = position[2] = 0;
     }
 
-    void add_ref() {
-      ref_cnt++;
+    /// state from the mixer, unless it has commands still to apply.
+    unsigned get_state() const {
+      return applied.load(std::memory_order_acquire) == issued ? mixed_state.load(std::memory_order_relaxed) : state;
     }
 
-    void release() {
-      if (!--ref_cnt) {
-        delete this;
-      }
+    /// queued buffers that have been played and can be unqueued.
+    unsigned get_processed() const {
+      unsigned packed = mixed_queue.load(std::memory_order_acquire);
+      unsigned pending = (unqueued - (packed >> 16)) & 0xffff;
+      int processed = (int)(packed & 0xffff) - (int)pending;
+      return processed < 0 ? 0 : std::min((unsigned)processed, (unsigned)queued.size());
     }
+  };
+
+  /// The mixer thread's copy of a source.
+  struct ALvoice {
+    enum { max_queued = 16 };
+
+    // buffer = queue[current]; the buffers before current have been played.
+    ALbuffer *buffer;
+    ALbuffer *queue[max_queued];
+    unsigned num_queued;
+    unsigned current;
+    unsigned unqueued;
 
-    void seti(unsigned param, unsigned value) {
-      unsigned *ptr = (unsigned*)access(param);
-      *ptr = value;
+    unsigned state;
+    unsigned applied;
+    bool looping;
+    bool relative;
+    double position;
+    float gain;
+    float pitch;
+    float ref_distance;
+    float rolloff;
+    float max_distance;
+    float min_gain;
+    float max_gain;
+    float pos[3];
+
+    // left and right gains at the end of the last block and the end of this one.
+    float cur[2];
+    float target[2];
+  };
+
+  /// A change to a source or the listener, sent from the AL thread to the mixer.
+  struct ALcommand {
+    enum {
+      op_sourcef,
+      op_source3f,
+      op_sourcei,
+      op_buffer,
+      op_queue,
+      op_unqueue,
+      op_play,
+      op_stop,
+      op_pause,
+      op_rewind,
+      op_delete,
+      op_listenerf,
+      op_listenerfv,
+      op_distance_model,
+    };
+
+    unsigned op;
+    unsigned sid;
+    unsigned param;
+    int i;
+    float f[6];
+    ALbuffer *buffer;
+  };
+
+  /// Lock free queue with one thread pushing and one popping.
+  template <class item_t, unsigned size> class ALring {
+    item_t items[size];
+    std::atomic<unsigned> head;
+    std::atomic<unsigned> tail;
+  public:
+    ALring() : head(0), tail(0) {
     }
 
-    void setf(unsigned param, float value) {
-      float *ptr = (float*)access(param);
-      *ptr = value;
+    /// returns false if the queue is full.
+    bool push(const item_t &item) {
+      unsigned h = head.load(std::memory_order_relaxed);
+      if (h - tail.load(std::memory_order_acquire) == size) return false;
+      items[h % size] = item;
+      head.store(h + 1, std::memory_order_release);
+      return true;
     }
 
-    unsigned geti(unsigned param) {
-      unsigned *ptr = (unsigned*)access(param);
-      return *ptr;
+    /// returns false if the queue is empty.
+    bool pop(item_t &item) {
+      unsigned t = tail.load(std::memory_order_relaxed);
+      if (t == head.load(std::memory_order_acquire)) return false;
+      item = items[t % size];
+      tail.store(t + 1, std::memory_order_release);
+      return true;
     }
+  };
 
-    float getf(unsigned param) {
-      float *ptr = (float*)access(param);
-      return *ptr;
+  /// Where the mixed sound goes: 16 bit interleaved stereo.
+  class ALsink {
+  public:
+    virtual ~ALsink() {
     }
 
-    void render(ALbuffer *buffer, float *mixer, unsigned num_samples, unsigned num_channels) {
-      if (state == AL_STOPPED || state == AL_PAUSED) return;
+    /// true for sound devices, which pace the mixer. Other sinks are paced by the clock.
+    virtual bool is_device() {
+      return false;
+    }
 
-      while (num_samples) {
-        unsigned max_samples = buffer->get_max_samples();
-        if (sample >= max_samples) {
-          if (looping && max_samples != 0) {
-            sample = 0;
-          } else {
-            state = AL_STOPPED;
-            break;
-          }
-        }
-        unsigned segment = num_samples < max_samples ? num_samples : max_samples;
-        buffer->render(mixer, sample, segment, num_channels, gain);
-        sample += segment;
-        num_samples -= segment;
-      }
+    /// true if write() will not have to wait.
+    virtual bool ready() {
+      return true;
     }
+
+    virtual void write(const int16_t *samples, unsigned num_frames) = 0;
   };
 
-  struct ALCdevice {
+  /// Throws the sound away; for servers and tests.
+  class ALnull_sink : public ALsink {
+  public:
+    void write(const int16_t *samples, unsigned num_frames) {
+    }
   };
 
-  class ALCcontext {
-    enum { ring_size = 8 };
-    dynarray<ref<ALbuffer> > buffers;
-    dynarray<ref<ALsource> > sources;
-    dynarray<float> mixer;
-    dynarray<int16_t> mixer_bin;
+  /// Writes the sound to a .wav file.
+  class ALwav_sink : public ALsink {
+    FILE *file;
     unsigned rate;
-    unsigned num_channels;
-    unsigned samples;
-    FILE *log;
-
-    void fill_buffer(int16_t *dest) {
-      memset(&mixer[0], 0, mixer.size() * sizeof(mixer[0]));
-
-      for (unsigned i = 0; i != sources.size(); ++i) {
-        ALsource *src = sources[i];
-        if (src) {
-          // fill mixer
-          ALbuffer *buffer = get_buffer(src->geti(AL_BUFFER));
-          if (buffer) {
-            //fprintf(log, "i=%d b=%p b=%d ST=%04x s=%d\n", i, buffer, src->geti(AL_BUFFER), src->geti(AL_SOURCE_STATE), src->geti(AL_SAMPLE_OFFSET));
-            src->render(buffer, &mixer[0], mixer.size() / num_channels, num_channels);
-          }
-        }
+    unsigned bytes;
+
+    static void put4(uint8_t *dest, unsigned value) {
+      dest[0] = (uint8_t)value; dest[1] = (uint8_t)(value >> 8); dest[2] = (uint8_t)(value >> 16); dest[3] = (uint8_t)(value >> 24);
+    }
+
+    void write_header() {
+      uint8_t hdr[44];
+      memcpy(hdr, "RIFF\0\0\0\0WAVEfmt \x10\0\0\0\x01\0\x02\0\0\0\0\0\0\0\0\0\x04\0\x10\0data\0\0\0\0", 44);
+      put4(hdr + 4, 36 + bytes);
+      put4(hdr + 24, rate);
+      put4(hdr + 28, rate * 4);
+      put4(hdr + 40, bytes);
+      fseek(file, 0, SEEK_SET);
+      fwrite(hdr, 1, sizeof(hdr), file);
+      fseek(file, 0, SEEK_END);
+    }
+  public:
+    ALwav_sink(const char *filename, unsigned rate) {
+      this->rate = rate;
+      bytes = 0;
+      file = fopen(filename, "wb");
+      if (file) write_header();
+    }
+
+    ~ALwav_sink() {
+      if (file) {
+        write_header();
+        fclose(file);
       }
+    }
 
-      const float *ps = &mixer[0];
-      for (unsigned i = 0; i != mixer.size(); ++i) {
-        int value = (int)(*ps++ * 32767 + 32768.5f);
-        if (value < 0) value = 0; else if (value > 65535) value = 65535;
-        *dest++ = (int16_t)(value) - 32768;
+    void write(const int16_t *samples, unsigned num_frames) {
+      if (!file) return;
+      uint8_t tmp[1024];
+      for (unsigned i = 0; i < num_frames * 2; i += 512) {
+        unsigned n = std::min(num_frames * 2 - i, 512u);
+        for (unsigned j = 0; j != n; ++j) {
+          tmp[j*2] = (uint8_t)samples[i+j];
+          tmp[j*2+1] = (uint8_t)(samples[i+j] >> 8);
+        }
+        fwrite(tmp, 2, n, file);
       }
+      bytes += num_frames * 4;
     }
+  };
 
-    #ifdef WIN32
+  #ifdef WIN32
+    /// Plays the sound on the default windows wave out device.
+    class ALwaveout_sink : public ALsink {
+      enum { ring_size = 8 };
       HWAVEOUT waveout;
       WAVEHDR headers[ring_size];
+      dynarray<int16_t> ring;
       unsigned ring_ptr;
-    #endif
-  public:
-    ALCcontext() {
-      //log = fopen("c:/tmp/al.txt", "wb");
-      rate = 44100;
-      num_channels = 2;
-      samples = 0;
-
-      buffers.resize(1);
-      sources.resize(1);
-
-      mixer.resize(1024);
-      mixer_bin.resize(mixer.size() * ring_size);
-
-      #ifdef WIN32
+    public:
+      ALwaveout_sink(unsigned rate, unsigned block_frames) {
         WAVEFORMATEX fmt;
-        fmt.nSamplesPerSec = 44100;
+        fmt.nSamplesPerSec = rate;
         fmt.wBitsPerSample = 16;
-        fmt.nChannels = num_channels;
+        fmt.nChannels = 2;
         fmt.cbSize = 0;
         fmt.wFormatTag = WAVE_FORMAT_PCM;
-        fmt.nBlockAlign = fmt.wBitsPerSample/8 * num_channels;
+        fmt.nBlockAlign = fmt.wBitsPerSample/8 * fmt.nChannels;
         fmt.nAvgBytesPerSec = fmt.nBlockAlign * fmt.nSamplesPerSec;
         waveout = 0;
+        ring_ptr = 0;
 
         if (waveOutOpen(&waveout, WAVE_MAPPER, &fmt, (DWORD_PTR)0, (DWORD_PTR)0, CALLBACK_NULL)) {
           printf("warning: failed to open windows wave out\n");
+          waveout = 0;
         }
 
+        ring.resize(block_frames * 2 * ring_size);
         memset(&headers, 0, sizeof(headers));
-        memset(&mixer_bin[0], 0, mixer_bin.size() * sizeof(mixer_bin[0]));
+        memset(&ring[0], 0, ring.size() * sizeof(ring[0]));
         for (unsigned i = 0; i != ring_size; ++i) {
           WAVEHDR *hdr = headers + i;
-          hdr->lpData = (LPSTR)&mixer_bin[mixer.size() * i];
-          hdr->dwBufferLength = mixer.size() * sizeof(int16_t);
-          waveOutPrepareHeader(waveout, hdr, sizeof(*hdr));
+          hdr->lpData = (LPSTR)&ring[block_frames * 2 * i];
+          hdr->dwBufferLength = block_frames * 4;
+          if (waveout) waveOutPrepareHeader(waveout, hdr, sizeof(*hdr));
+        }
+      }
+
+      ~ALwaveout_sink() {
+        if (waveout) {
+          waveOutReset(waveout);
+          for (unsigned i = 0; i != ring_size; ++i) {
+            waveOutUnprepareHeader(waveout, headers + i, sizeof(headers[i]));
+          }
+          waveOutClose(waveout);
+        }
+      }
+
+      bool is_device() {
+        return waveout != 0;
+      }
+
+      bool ready() {
+        return !waveout || !(headers[ring_ptr % ring_size].dwFlags & WHDR_INQUEUE);
+      }
+
+      void write(const int16_t *samples, unsigned num_frames) {
+        if (!waveout) return;
+        WAVEHDR *hdr = headers + ring_ptr++ % ring_size;
+        memcpy(hdr->lpData, samples, std::min((unsigned)hdr->dwBufferLength, num_frames * 4));
+        waveOutWrite(waveout, hdr, sizeof(*hdr));
+      }
+    };
+  #endif
+
+  /// Device name: NULL for the default, "null" for no sound or "wav:filename" to record.
+  struct ALCdevice {
+    string name;
+  };
+
+  /// Software mixer behind the OpenAL calls.
+  ///
+  /// AL calls send commands through a lock free queue to a mixer thread, which
+  /// resamples and mixes the playing sources with SSE in blocks of block_frames.
+  /// Sources that are too quiet, or quieter than the loudest max_voices, are virtual:
+  /// they keep their place in the sound but are not mixed.
+  ///
+  /// Make AL calls from one thread. With the ALC_SYNC attribute there is no
+  /// mixer thread and render() mixes on the calling thread, eg. for tests:
+  ///
+  ///     ALCint attrs[] = { ALC_SYNC, 1, 0 };
+  ///     ALCcontext *ctx = alcCreateContext(alcOpenDevice("wav:out.wav"), attrs);
+  ///     alcMakeContextCurrent(ctx);
+  ///     ...
+  ///     ctx->render(44100 / ALCcontext::block_frames);
+  ///     printf("%f us per block\n", ctx->get_stats().average_us);
+  class ALCcontext {
+  public:
+    enum {
+      block_frames = 256,
+      max_sources = 1024,
+      queue_size = 4096,
+    };
+
+    struct mix_stats {
+      unsigned blocks;          // blocks mixed so far
+      float last_us;            // time to mix the last block
+      float average_us;
+      float max_us;
+      unsigned mixed_voices;    // voices mixed in the last block
+      unsigned virtual_voices;  // playing voices that were not mixed
+    };
+
+  private:
+    // AL thread
+    dynarray<ref<ALbuffer> > buffers;
+    ALsource *sources;
+    unsigned num_sources;
+    dynarray<unsigned> free_sources;
+    float listener_gain;
+    float listener_position[3];
+    float listener_orientation[6];
+    unsigned distance_model;
+
+    ALring<ALcommand, queue_size> commands;
+
+    // mixer thread
+    ALvoice *voices;
+    unsigned num_voices;
+    float mix_gain;
+    float mix_position[3];
+    float mix_right[3];
+    unsigned mix_model;
+    dynarray<float> mixer_l;
+    dynarray<float> mixer_r;
+    dynarray<int16_t> mixer_bin;
+    dynarray<unsigned> playing;
+    unsigned max_voices;
+    unsigned rate;
+    ALsink *sink;
+
+    std::thread thread;
+    std::atomic<bool> quitting;
+    bool sync;
+
+    std::atomic<unsigned> stat_blocks;
+    std::atomic<unsigned> stat_last_ns;
+    std::atomic<unsigned> stat_max_ns;
+    std::atomic<uint64_t> stat_total_ns;
+    std::atomic<unsigned> stat_mixed;
+    std::atomic<unsigned> stat_virtual;
+
+    static ALsink *open_sink(ALCdevice *device, unsigned rate) {
+      const char *name = device ? device->name.c_str() : "";
+      if (!strncmp(name, "wav:", 4)) {
+        return new ALwav_sink(name + 4, rate);
+      } else if (!strcmp(name, "null")) {
+        return new ALnull_sink();
+      }
+      #ifdef WIN32
+        return new ALwaveout_sink(rate, block_frames);
+      #else
+        return new ALnull_sink();
+      #endif
+    }
+
+    void send(const ALcommand &cmd) {
+      while (!commands.push(cmd)) {
+        if (sync) {
+          process_commands();
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    }
+
+    ALcommand command(unsigned op, unsigned sid = 0, unsigned param = 0) {
+      ALcommand cmd;
+      memset(&cmd, 0, sizeof(cmd));
+      cmd.op = op;
+      cmd.sid = sid;
+      cmd.param = param;
+      return cmd;
+    }
+
+    static void cross(float *dest, const float *a, const float *b) {
+      dest[0] = a[1] * b[2] - a[2] * b[1];
+      dest[1] = a[2] * b[0] - a[0] * b[2];
+      dest[2] = a[0] * b[1] - a[1] * b[0];
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////
+    //
+    // mixer thread
+    //
+
+    void apply(const ALcommand &cmd) {
+      ALvoice *v = cmd.sid < num_voices ? voices + cmd.sid : 0;
+      switch (cmd.op) {
+        case ALcommand::op_sourcef: {
+          if (!v) break;
+          float value = cmd.f[0];
+          switch (cmd.param) {
+            case AL_GAIN: v->gain = value; break;
+            case AL_PITCH: v->pitch = value; break;
+            case AL_REFERENCE_DISTANCE: v->ref_distance = value; break;
+            case AL_ROLLOFF_FACTOR: v->rolloff = value; break;
+            case AL_MAX_DISTANCE: v->max_distance = value; break;
+            case AL_MIN_GAIN: v->min_gain = value; break;
+            case AL_MAX_GAIN: v->max_gain = value; break;
+            case AL_SEC_OFFSET: if (v->buffer) v->position = value * v->buffer->get_freq(); break;
+            case AL_SAMPLE_OFFSET: v->position = value; break;
+          }
+          break;
+        }
+        case ALcommand::op_source3f: {
+          if (v && cmd.param == AL_POSITION) {
+            v->pos[0] = cmd.f[0]; v->pos[1] = cmd.f[1]; v->pos[2] = cmd.f[2];
+          }
+          break;
+        }
+        case ALcommand::op_sourcei: {
+          if (!v) break;
+          if (cmd.param == AL_LOOPING) v->looping = cmd.i != 0;
+          else if (cmd.param == AL_SOURCE_RELATIVE) v->relative = cmd.i != 0;
+          break;
+        }
+        case ALcommand::op_buffer: {
+          // the AL thread added a ref for us.
+          if (v) {
+            clear_queue(v);
+            if (cmd.buffer) v->queue[v->num_queued++] = cmd.buffer;
+            set_current(v, 0);
+          } else if (cmd.buffer) {
+            cmd.buffer->release();
+          }
+          break;
+        }
+        case ALcommand::op_queue: {
+          if (v && v->num_queued != ALvoice::max_queued) {
+            v->queue[v->num_queued++] = cmd.buffer;
+            if (!v->buffer && v->state != AL_STOPPED) set_current(v, v->current);
+          } else if (cmd.buffer) {
+            cmd.buffer->release();
+          }
+          break;
+        }
+        case ALcommand::op_unqueue: {
+          if (!v) break;
+          // count them even if they have gone, so that the AL thread's count stays in step.
+          v->unqueued += cmd.i;
+          unsigned n = std::min((unsigned)cmd.i, v->current);
+          for (unsigned i = 0; i != n; ++i) v->queue[i]->release();
+          for (unsigned i = n; i != v->num_queued; ++i) v->queue[i - n] = v->queue[i];
+          v->num_queued -= n;
+          v->current -= n;
+          break;
+        }
+        case ALcommand::op_play: {
+          if (!v) break;
+          if (v->state != AL_PAUSED) {
+            set_current(v, 0);
+            v->cur[0] = v->cur[1] = 0;
+          }
+          v->state = AL_PLAYING;
+          v->applied = cmd.i;
+          break;
+        }
+        case ALcommand::op_stop: {
+          if (!v) break;
+          if (v->state != AL_INITIAL) {
+            // stopping marks all the queued buffers as played.
+            v->state = AL_STOPPED;
+            set_current(v, v->num_queued);
+          }
+          v->applied = cmd.i;
+          break;
+        }
+        case ALcommand::op_pause: {
+          if (!v) break;
+          if (v->state == AL_PLAYING) v->state = AL_PAUSED;
+          v->applied = cmd.i;
+          break;
+        }
+        case ALcommand::op_rewind: {
+          if (!v) break;
+          v->state = AL_INITIAL;
+          set_current(v, 0);
+          v->applied = cmd.i;
+          break;
+        }
+        case ALcommand::op_delete: {
+          if (!v) break;
+          clear_queue(v);
+          unsigned unqueued = v->unqueued;
+          init_voice(v);
+          v->unqueued = unqueued;
+          v->applied = cmd.i;
+          break;
+        }
+        case ALcommand::op_listenerf: {
+          if (cmd.param == AL_GAIN) mix_gain = cmd.f[0];
+          break;
+        }
+        case ALcommand::op_listenerfv: {
+          if (cmd.param == AL_POSITION) {
+            mix_position[0] = cmd.f[0]; mix_position[1] = cmd.f[1]; mix_position[2] = cmd.f[2];
+          } else if (cmd.param == AL_ORIENTATION) {
+            // right = at x up
+            cross(mix_right, cmd.f, cmd.f + 3);
+            float len2 = mix_right[0] * mix_right[0] + mix_right[1] * mix_right[1] + mix_right[2] * mix_right[2];
+            float rlen = len2 > 0 ? 1.0f / sqrtf(len2) : 0;
+            for (int i = 0; i != 3; ++i) mix_right[i] *= rlen;
+          }
+          break;
+        }
+        case ALcommand::op_distance_model: {
+          mix_model = cmd.i;
+          break;
+        }
+      }
+    }
+
+    void process_commands() {
+      ALcommand cmd;
+      while (commands.pop(cmd)) {
+        apply(cmd);
+      }
+    }
+
+    // start playing queued buffer i from the beginning.
+    static void set_current(ALvoice *v, unsigned i) {
+      v->current = i;
+      v->buffer = i < v->num_queued ? v->queue[i] : 0;
+      v->position = 0;
+    }
+
+    static void clear_queue(ALvoice *v) {
+      for (unsigned i = 0; i != v->num_queued; ++i) v->queue[i]->release();
+      v->num_queued = 0;
+      set_current(v, 0);
+    }
+
+    static void init_voice(ALvoice *v) {
+      v->buffer = 0;
+      v->num_queued = 0;
+      v->current = 0;
+      v->unqueued = 0;
+      v->state = AL_INITIAL;
+      v->applied = 0;
+      v->looping = false;
+      v->relative = false;
+      v->position = 0;
+      v->gain = 1;
+      v->pitch = 1;
+      v->ref_distance = 1;
+      v->rolloff = 1;
+      v->max_distance = 1e30f;
+      v->min_gain = 0;
+      v->max_gain = 1;
+      v->pos[0] = v->pos[1] = v->pos[2] = 0;
+      v->cur[0] = v->cur[1] = 0;
+      v->target[0] = v->target[1] = 0;
+    }
+
+    // distance gain for the current model, see the OpenAL 1.1 spec.
+    float attenuation(const ALvoice *v, float distance) const {
+      float ref = v->ref_distance, roll = v->rolloff, max = v->max_distance;
+      switch (mix_model) {
+        case AL_NONE: return 1;
+        case AL_INVERSE_DISTANCE_CLAMPED: distance = std::max(ref, std::min(distance, max)); // fall through
+        case AL_INVERSE_DISTANCE: {
+          float denom = ref + roll * (distance - ref);
+          return denom > 0 ? ref / denom : 1;
+        }
+        case AL_LINEAR_DISTANCE_CLAMPED: distance = std::max(ref, std::min(distance, max)); // fall through
+        case AL_LINEAR_DISTANCE: {
+          return max > ref ? std::max(0.0f, 1 - roll * (distance - ref) / (max - ref)) : 1;
+        }
+        case AL_EXPONENT_DISTANCE_CLAMPED: distance = std::max(ref, std::min(distance, max)); // fall through
+        case AL_EXPONENT_DISTANCE: {
+          return distance > 0 && ref > 0 ? powf(distance / ref, -roll) : 1;
+        }
+      }
+      return 1;
+    }
+
+    // left and right gains for the end of this block.
+    void spatialize(ALvoice *v) {
+      float g = v->gain, pan = 0;
+      if (v->buffer->get_num_channels() == 1) {
+        float d[3];
+        for (int i = 0; i != 3; ++i) {
+          d[i] = v->relative ? v->pos[i] : v->pos[i] - mix_position[i];
+        }
+        float distance = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+        g *= attenuation(v, distance);
+        if (distance > 0) {
+          pan = (d[0] * mix_right[0] + d[1] * mix_right[1] + d[2] * mix_right[2]) / distance;
+        }
+      }
+      g = std::max(v->min_gain, std::min(g, v->max_gain)) * mix_gain;
+      // balance: full volume in the middle, fading the far side to the edges.
+      v->target[0] = g * std::min(1.0f, 1 - pan);
+      v->target[1] = g * std::min(1.0f, 1 + pan);
+    }
+
+    // the SSE code can be turned off to compare it with the scalar code.
+    static std::atomic<bool> &sse_enabled() {
+      static std::atomic<bool> value(true);
+      return value;
+    }
+
+    // left[i] += gl[i] * src[frac + i * step], interpolating between samples and ramping the gains.
+    static void mix_segment(float *left, float *right, const float *src, float frac, float step, unsigned n, float gl, float dgl, float gr, float dgr) {
+      unsigned i = 0;
+      #if OCTET_SSE
+        if (sse_enabled()) {
+          __m128 k = _mm_setr_ps(0, 1, 2, 3);
+          __m128 vgl = _mm_set1_ps(gl), vdgl = _mm_set1_ps(dgl);
+          __m128 vgr = _mm_set1_ps(gr), vdgr = _mm_set1_ps(dgr);
+          if (frac == 0 && step == 1) {
+            for (; i + 4 <= n; i += 4) {
+              __m128 fi = _mm_add_ps(_mm_set1_ps((float)i), k);
+              __m128 s = _mm_loadu_ps(src + i);
+              __m128 l = _mm_mul_ps(s, _mm_add_ps(vgl, _mm_mul_ps(fi, vdgl)));
+              __m128 r = _mm_mul_ps(s, _mm_add_ps(vgr, _mm_mul_ps(fi, vdgr)));
+              _mm_storeu_ps(left + i, _mm_add_ps(_mm_loadu_ps(left + i), l));
+              _mm_storeu_ps(right + i, _mm_add_ps(_mm_loadu_ps(right + i), r));
+            }
+          } else {
+            __m128 vfrac = _mm_set1_ps(frac), vstep = _mm_set1_ps(step);
+            int idx[4];
+            for (; i + 4 <= n; i += 4) {
+              __m128 fi = _mm_add_ps(_mm_set1_ps((float)i), k);
+              __m128 p = _mm_add_ps(vfrac, _mm_mul_ps(fi, vstep));
+              __m128i ip = _mm_cvttps_epi32(p);
+              __m128 t = _mm_sub_ps(p, _mm_cvtepi32_ps(ip));
+              _mm_storeu_si128((__m128i*)idx, ip);
+              __m128 a = _mm_setr_ps(src[idx[0]], src[idx[1]], src[idx[2]], src[idx[3]]);
+              __m128 b = _mm_setr_ps(src[idx[0]+1], src[idx[1]+1], src[idx[2]+1], src[idx[3]+1]);
+              __m128 s = _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a)));
+              __m128 l = _mm_mul_ps(s, _mm_add_ps(vgl, _mm_mul_ps(fi, vdgl)));
+              __m128 r = _mm_mul_ps(s, _mm_add_ps(vgr, _mm_mul_ps(fi, vdgr)));
+              _mm_storeu_ps(left + i, _mm_add_ps(_mm_loadu_ps(left + i), l));
+              _mm_storeu_ps(right + i, _mm_add_ps(_mm_loadu_ps(right + i), r));
+            }
+          }
         }
       #endif
+      for (; i != n; ++i) {
+        float p = frac + i * step;
+        int ip = (int)p;
+        float t = p - ip;
+        float s = src[ip] + t * (src[ip+1] - src[ip]);
+        left[i] += s * (gl + i * dgl);
+        right[i] += s * (gr + i * dgr);
+      }
     }
 
-    ~ALCcontext() {
-      #ifdef WIN32
-        for (unsigned i = 0; i != ring_size; ++i) {
-          WAVEHDR *hdr = headers + i;
-          waveOutUnprepareHeader(waveout, hdr, sizeof(*hdr));
+    // mix or just advance a voice by one block.
+    void render_voice(ALvoice *v, bool mix) {
+      float scale = 1.0f / block_frames;
+      float dl = (v->target[0] - v->cur[0]) * scale, dr = (v->target[1] - v->cur[1]) * scale;
+      unsigned done = 0;
+      // an empty buffer in a queue can not stop us forever.
+      for (unsigned empty = 0; done != block_frames && empty <= v->num_queued; ) {
+        ALbuffer *buffer = v->buffer;
+        unsigned len = buffer ? buffer->get_num_frames() : 0;
+        double step = buffer ? (double)std::max(v->pitch, 0.0f) * buffer->get_freq() / rate : 0;
+        if (buffer && step <= 0) break;
+
+        if (v->position >= len) {
+          empty += len == 0;
+          double over = len ? v->position - len : 0;
+          if (v->current + 1 < v->num_queued) {
+            set_current(v, v->current + 1);
+          } else if (v->looping && v->num_queued) {
+            set_current(v, 0);
+          } else {
+            v->state = AL_STOPPED;
+            set_current(v, v->num_queued);
+            break;
+          }
+          v->position = v->num_queued == 1 && len ? fmod(over, (double)len) : over;
+          continue;
+        }
+
+        // frames before we run out of samples.
+        unsigned n = block_frames - done;
+        double avail = ceil((len - v->position) / step);
+        if (avail < n) n = std::max(1u, (unsigned)avail);
+
+        if (mix) {
+          unsigned base = (unsigned)v->position;
+          float frac = (float)(v->position - base);
+          float gl = v->cur[0] + dl * done, gr = v->cur[1] + dr * done;
+          float *left = mixer_l.data() + done, *right = mixer_r.data() + done;
+          if (buffer->get_num_channels() == 1) {
+            mix_segment(left, right, buffer->get_channel(0) + base, frac, (float)step, n, gl, dl, gr, dr);
+          } else {
+            // stereo buffers are not positioned.
+            mix_segment(left, right, buffer->get_channel(0) + base, frac, (float)step, n, gl, dl, 0, 0);
+            mix_segment(left, right, buffer->get_channel(1) + base, frac, (float)step, n, 0, 0, gr, dr);
+          }
+        }
+        v->position += n * step;
+        done += n;
+      }
+      v->cur[0] = mix ? v->target[0] : 0;
+      v->cur[1] = mix ? v->target[1] : 0;
+    }
+
+    // float to 16 bit stereo
+    void convert(int16_t *dest) {
+      const float *left = mixer_l.data(), *right = mixer_r.data();
+      unsigned i = 0;
+      #if OCTET_SSE
+        if (sse_enabled()) {
+          __m128 scale = _mm_set1_ps(32767), lo = _mm_set1_ps(-32768), hi = _mm_set1_ps(32767);
+          for (; i + 4 <= block_frames; i += 4) {
+            __m128 l = _mm_mul_ps(_mm_loadu_ps(left + i), scale);
+            __m128 r = _mm_mul_ps(_mm_loadu_ps(right + i), scale);
+            __m128 a = _mm_max_ps(lo, _mm_min_ps(hi, _mm_unpacklo_ps(l, r)));
+            __m128 b = _mm_max_ps(lo, _mm_min_ps(hi, _mm_unpackhi_ps(l, r)));
+            _mm_storeu_si128((__m128i*)(dest + i * 2), _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+          }
         }
-        waveOutClose(waveout);
-        waveout = 0;
       #endif
+      for (; i != block_frames; ++i) {
+        float l = std::max(-32768.0f, std::min(left[i] * 32767, 32767.0f));
+        float r = std::max(-32768.0f, std::min(right[i] * 32767, 32767.0f));
+        dest[i*2] = (int16_t)(l < 0 ? l - 0.5f : l + 0.5f);
+        dest[i*2+1] = (int16_t)(r < 0 ? r - 0.5f : r + 0.5f);
+      }
+    }
+
+    struct louder {
+      const ALvoice *voices;
+      bool operator()(unsigned a, unsigned b) const {
+        return std::max(voices[a].target[0], voices[a].target[1]) > std::max(voices[b].target[0], voices[b].target[1]);
+      }
+    };
+
+    // mix one block of sound into dest.
+    void mix_block(int16_t *dest) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+      process_commands();
+      memset(mixer_l.data(), 0, block_frames * sizeof(float));
+      memset(mixer_r.data(), 0, block_frames * sizeof(float));
+
+      // which voices can be heard?
+      const float silent = 1.0f / 4096;
+      playing.resize(0);
+      unsigned num_virtual = 0;
+      for (unsigned i = 1; i != num_voices; ++i) {
+        ALvoice *v = voices + i;
+        if (v->state != AL_PLAYING) continue;
+        if (!v->buffer) {
+          v->state = AL_STOPPED;
+          continue;
+        }
+        spatialize(v);
+        if (std::max(v->target[0], v->target[1]) >= silent) {
+          playing.push_back(i);
+        } else {
+          // fade out anything that was being mixed.
+          bool fade = v->cur[0] + v->cur[1] > 0;
+          v->target[0] = v->target[1] = 0;
+          render_voice(v, fade);
+          num_virtual++;
+        }
+      }
+
+      // only mix the loudest voices.
+      unsigned num_mixed = playing.size();
+      if (num_mixed > max_voices) {
+        louder cmp = { voices };
+        std::nth_element(playing.data(), playing.data() + max_voices, playing.data() + num_mixed, cmp);
+        for (unsigned j = max_voices; j != num_mixed; ++j) {
+          ALvoice *v = voices + playing[j];
+          // fade out anything that was being mixed.
+          bool fade = v->cur[0] + v->cur[1] > 0;
+          v->target[0] = v->target[1] = 0;
+          render_voice(v, fade);
+        }
+        num_virtual += num_mixed - max_voices;
+        num_mixed = max_voices;
+      }
+
+      for (unsigned j = 0; j != num_mixed; ++j) {
+        render_voice(voices + playing[j], true);
+      }
+
+      convert(dest);
+
+      // tell the AL thread.
+      for (unsigned i = 1; i != num_voices; ++i) {
+        const ALvoice *v = voices + i;
+        sources[i].mixed_state.store(v->state, std::memory_order_relaxed);
+        sources[i].mixed_offset.store((unsigned)v->position, std::memory_order_relaxed);
+        sources[i].mixed_queue.store((v->unqueued & 0xffff) << 16 | v->current, std::memory_order_relaxed);
+        sources[i].applied.store(v->applied, std::memory_order_release);
+      }
+
+      unsigned ns = (unsigned)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+      stat_last_ns = ns;
+      if (ns > stat_max_ns) stat_max_ns = ns;
+      stat_total_ns += ns;
+      stat_mixed = num_mixed;
+      stat_virtual = num_virtual;
+      stat_blocks++;
+    }
+
+    void mixer_thread() {
+      std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+      std::chrono::nanoseconds block_time((uint64_t)block_frames * 1000000000 / rate);
+      while (!quitting) {
+        if (sink->is_device()) {
+          if (!sink->ready()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+          }
+        } else {
+          std::this_thread::sleep_until(next);
+          next += block_time;
+        }
+        mix_block(mixer_bin.data());
+        sink->write(mixer_bin.data(), block_frames);
+      }
+    }
+
+  public:
+    ALCcontext(ALCdevice *device = 0, const ALCint *attrlist = 0) : quitting(false) {
+      rate = 44100;
+      sync = false;
+      unsigned num = max_sources;
+      for (const ALCint *attr = attrlist; attr && attr[0]; attr += 2) {
+        if (attr[0] == ALC_FREQUENCY && attr[1] > 0) rate = attr[1];
+        else if (attr[0] == ALC_SYNC) sync = attr[1] != 0;
+        else if (attr[0] == ALC_MONO_SOURCES && attr[1] > 0) num = attr[1] + 1;
+      }
+
+      buffers.resize(1);
+      sources = new ALsource[num];
+      num_sources = 1;
+      listener_gain = 1;
+      listener_position[0] = listener_position[1] = listener_position[2] = 0;
+      listener_orientation[0] = 0; listener_orientation[1] = 0; listener_orientation[2] = -1;
+      listener_orientation[3] = 0; listener_orientation[4] = 1; listener_orientation[5] = 0;
+      distance_model = AL_INVERSE_DISTANCE_CLAMPED;
+
+      voices = new ALvoice[num];
+      num_voices = num;
+      for (unsigned i = 0; i != num; ++i) init_voice(voices + i);
+      mix_gain = 1;
+      mix_position[0] = mix_position[1] = mix_position[2] = 0;
+      mix_right[0] = 1; mix_right[1] = 0; mix_right[2] = 0;
+      mix_model = AL_INVERSE_DISTANCE_CLAMPED;
+      max_voices = 256;
+      mixer_l.resize(block_frames);
+      mixer_r.resize(block_frames);
+      mixer_bin.resize(block_frames * 2);
+      playing.reserve(num);
+
+      stat_blocks = 0;
+      stat_last_ns = stat_max_ns = 0;
+      stat_total_ns = 0;
+      stat_mixed = stat_virtual = 0;
+
+      sink = open_sink(device, rate);
+      if (!sync) {
+        thread = std::thread(&ALCcontext::mixer_thread, this);
+      }
+    }
+
+    ~ALCcontext() {
+      quitting = true;
+      if (thread.joinable()) thread.join();
+      for (unsigned i = 0; i != num_voices; ++i) {
+        clear_queue(voices + i);
+      }
+      // buffers sent but not applied.
+      ALcommand cmd;
+      while (commands.pop(cmd)) {
+        if ((cmd.op == ALcommand::op_buffer || cmd.op == ALcommand::op_queue) && cmd.buffer) cmd.buffer->release();
+      }
+      delete[] voices;
+      delete[] sources;
+      delete sink;
     }
 
     unsigned gen_buffer() {
@@ -371,10 +1128,9 @@ namespace octet {
       return res;
     }
 
-    unsigned gen_source() {
-      unsigned res = sources.size();
-      sources.resize(res + 1);
-      return res;
+    void delete_buffer(unsigned i) {
+      // sources using the buffer keep it alive.
+      if (i && i < buffers.size()) buffers[i] = (ALbuffer*)0;
     }
 
     ALbuffer *get_buffer(unsigned i ) {
@@ -385,36 +1141,257 @@ namespace octet {
       return buffers[i];
     }
 
-    ALsource *get_source(unsigned i ) {
-      if (i >= sources.size()) return 0;
-      if (!sources[i]) {
-        sources[i] = new ALsource();
+    unsigned gen_source() {
+      unsigned res = 0;
+      if (free_sources.size()) {
+        res = free_sources.back();
+        free_sources.pop_back();
+      } else if (num_sources < num_voices) {
+        res = num_sources++;
       }
-      return sources[i];
+      if (res) sources[res].in_use = true;
+      return res;
     }
 
-    // render the sound
-    void update() {
-      #ifdef WIN32
-        //fprintf(log, "update\n"); 
-        for(;;) {
-          unsigned i = ring_ptr++ % ring_size;
-          WAVEHDR *hdr = headers + i;
-          //fprintf(log, "%08x\n", hdr->dwFlags);
-          if (hdr->dwFlags & WHDR_INQUEUE) {
-            break;
-          }
+    void delete_source(unsigned sid) {
+      ALsource *src = get_source(sid);
+      if (!src) return;
+      ALcommand cmd = command(ALcommand::op_delete, sid);
+      cmd.i = ++src->issued;
+      src->reset();
+      send(cmd);
+      free_sources.push_back(sid);
+    }
 
-          fill_buffer((int16_t*)hdr->lpData);
-          unsigned z = 0;
-          for (unsigned i = 0; i != hdr->dwBufferLength; ++i) {
-            if (hdr->lpData[i]) z++;
-          }
+    ALsource *get_source(unsigned sid) {
+      return sid && sid < num_sources && sources[sid].in_use ? sources + sid : 0;
+    }
+
+    void source_f(unsigned sid, unsigned param, float value) {
+      ALsource *src = get_source(sid);
+      if (!src) return;
+      switch (param) {
+        case AL_GAIN: src->gain = value; break;
+        case AL_PITCH: src->pitch = value; break;
+        case AL_REFERENCE_DISTANCE: src->ref_distance = value; break;
+        case AL_ROLLOFF_FACTOR: src->rolloff = value; break;
+        case AL_MAX_DISTANCE: src->max_distance = value; break;
+        case AL_MIN_GAIN: src->min_gain = value; break;
+        case AL_MAX_GAIN: src->max_gain = value; break;
+        case AL_SEC_OFFSET: case AL_SAMPLE_OFFSET: break;
+        default: return;
+      }
+      ALcommand cmd = command(ALcommand::op_sourcef, sid, param);
+      cmd.f[0] = value;
+      send(cmd);
+    }
+
+    void source_3f(unsigned sid, unsigned param, float x, float y, float z) {
+      ALsource *src = get_source(sid);
+      if (!src || param != AL_POSITION) return;
+      src->position[0] = x; src->position[1] = y; src->position[2] = z;
+      ALcommand cmd = command(ALcommand::op_source3f, sid, param);
+      cmd.f[0] = x; cmd.f[1] = y; cmd.f[2] = z;
+      send(cmd);
+    }
+
+    void source_i(unsigned sid, unsigned param, int value) {
+      ALsource *src = get_source(sid);
+      if (!src) return;
+      if (param == AL_BUFFER) {
+        ALbuffer *buffer = value ? get_buffer(value) : 0;
+        src->buffer = buffer ? value : 0;
+        src->queued.resize(0);
+        if (buffer) src->queued.push_back(value);
+        ALcommand cmd = command(ALcommand::op_buffer, sid, param);
+        cmd.buffer = buffer;
+        if (buffer) buffer->add_ref();
+        send(cmd);
+      } else if (param == AL_LOOPING || param == AL_SOURCE_RELATIVE) {
+        (param == AL_LOOPING ? src->looping : src->relative) = value;
+        ALcommand cmd = command(ALcommand::op_sourcei, sid, param);
+        cmd.i = value;
+        send(cmd);
+      } else if (param == AL_SAMPLE_OFFSET || param == AL_SEC_OFFSET) {
+        source_f(sid, param, (float)value);
+      } else if (param == AL_GAIN || param == AL_PITCH || param == AL_REFERENCE_DISTANCE || param == AL_ROLLOFF_FACTOR || param == AL_MAX_DISTANCE) {
+        source_f(sid, param, (float)value);
+      }
+    }
+
+    /// add buffers to the end of a source's queue.
+    void queue_buffers(unsigned sid, unsigned num, const unsigned *bids) {
+      ALsource *src = get_source(sid);
+      if (!src) return;
+      // a queue replaces a static buffer.
+      if (src->buffer) source_i(sid, AL_BUFFER, 0);
+      for (unsigned i = 0; i != num; ++i) {
+        ALbuffer *buffer = get_buffer(bids[i]);
+        if (!buffer || src->queued.size() == ALvoice::max_queued) continue;
+        src->queued.push_back(bids[i]);
+        ALcommand cmd = command(ALcommand::op_queue, sid);
+        cmd.buffer = buffer;
+        buffer->add_ref();
+        send(cmd);
+      }
+    }
+
+    /// remove played buffers from the front of a source's queue.
+    unsigned unqueue_buffers(unsigned sid, unsigned num, unsigned *bids) {
+      ALsource *src = get_source(sid);
+      if (!src) return 0;
+      unsigned n = std::min(num, src->get_processed());
+      for (unsigned i = 0; i != n; ++i) bids[i] = src->queued[i];
+      for (unsigned i = n; i != src->queued.size(); ++i) src->queued[i - n] = src->queued[i];
+      src->queued.resize(src->queued.size() - n);
+      src->unqueued += n;
+      if (n) {
+        ALcommand cmd = command(ALcommand::op_unqueue, sid);
+        cmd.i = n;
+        send(cmd);
+      }
+      return n;
+    }
 
-          MMRESULT res = waveOutWrite(waveout, hdr, sizeof(*hdr));
-          //fprintf(log, "  wr %d %d\n", res, z);
+    /// play, stop, pause or rewind
+    void source_state(unsigned sid, unsigned op) {
+      ALsource *src = get_source(sid);
+      if (!src) return;
+      unsigned state = src->get_state();
+      switch (op) {
+        case ALcommand::op_play: state = AL_PLAYING; break;
+        case ALcommand::op_stop: state = state == AL_INITIAL ? AL_INITIAL : AL_STOPPED; break;
+        case ALcommand::op_pause: state = state == AL_PLAYING ? AL_PAUSED : state; break;
+        case ALcommand::op_rewind: state = AL_INITIAL; break;
+      }
+      src->state = state;
+      ALcommand cmd = command(op, sid);
+      cmd.i = ++src->issued;
+      send(cmd);
+    }
+
+    int get_source_i(unsigned sid, unsigned param) {
+      ALsource *src = get_source(sid);
+      if (!src) return 0;
+      switch (param) {
+        case AL_SOURCE_STATE: return src->get_state();
+        case AL_SAMPLE_OFFSET: return src->get_state() == AL_INITIAL ? 0 : src->mixed_offset.load(std::memory_order_relaxed);
+        case AL_BUFFER: return src->buffer;
+        case AL_LOOPING: return src->looping;
+        case AL_SOURCE_RELATIVE: return src->relative;
+        case AL_SOURCE_TYPE: return src->buffer ? AL_STATIC : src->queued.size() ? AL_STREAMING : AL_UNDETERMINED;
+        case AL_BUFFERS_QUEUED: return src->queued.size();
+        case AL_BUFFERS_PROCESSED: return src->get_processed();
+      }
+      return (int)get_source_f(sid, param);
+    }
+
+    float get_source_f(unsigned sid, unsigned param) {
+      ALsource *src = get_source(sid);
+      if (!src) return 0;
+      switch (param) {
+        case AL_GAIN: return src->gain;
+        case AL_PITCH: return src->pitch;
+        case AL_REFERENCE_DISTANCE: return src->ref_distance;
+        case AL_ROLLOFF_FACTOR: return src->rolloff;
+        case AL_MAX_DISTANCE: return src->max_distance;
+        case AL_MIN_GAIN: return src->min_gain;
+        case AL_MAX_GAIN: return src->max_gain;
+        case AL_SAMPLE_OFFSET: return (float)get_source_i(sid, param);
+        case AL_SEC_OFFSET: {
+          ALbuffer *buffer = src->buffer ? get_buffer(src->buffer) : 0;
+          return buffer ? (float)get_source_i(sid, AL_SAMPLE_OFFSET) / buffer->get_freq() : 0;
         }
-      #endif
+      }
+      return 0;
+    }
+
+    const float *get_source_position(unsigned sid) {
+      ALsource *src = get_source(sid);
+      return src ? src->position : 0;
+    }
+
+    void listener_f(unsigned param, float value) {
+      if (param != AL_GAIN) return;
+      listener_gain = value;
+      ALcommand cmd = command(ALcommand::op_listenerf, 0, param);
+      cmd.f[0] = value;
+      send(cmd);
+    }
+
+    void listener_fv(unsigned param, const float *values) {
+      unsigned n = param == AL_POSITION ? 3 : param == AL_ORIENTATION ? 6 : 0;
+      if (!n) return;
+      float *dest = param == AL_POSITION ? listener_position : listener_orientation;
+      ALcommand cmd = command(ALcommand::op_listenerfv, 0, param);
+      for (unsigned i = 0; i != n; ++i) {
+        dest[i] = cmd.f[i] = values[i];
+      }
+      send(cmd);
+    }
+
+    /// AL_GAIN, AL_POSITION or AL_ORIENTATION
+    const float *get_listener(unsigned param) {
+      return param == AL_GAIN ? &listener_gain : param == AL_POSITION ? listener_position : param == AL_ORIENTATION ? listener_orientation : 0;
+    }
+
+    void set_distance_model(unsigned model) {
+      distance_model = model;
+      ALcommand cmd = command(ALcommand::op_distance_model);
+      cmd.i = model;
+      send(cmd);
+    }
+
+    unsigned get_distance_model() const {
+      return distance_model;
+    }
+
+    /// Mix at most this many voices; the rest are virtual. Call before making sounds.
+    void set_max_voices(unsigned value) {
+      max_voices = value;
+    }
+
+    /// With ALC_SYNC, mix some blocks on this thread and write them to the device.
+    void render(unsigned num_blocks) {
+      if (!sync) return;
+      for (unsigned i = 0; i != num_blocks; ++i) {
+        mix_block(mixer_bin.data());
+        sink->write(mixer_bin.data(), block_frames);
+      }
+    }
+
+    /// With ALC_SYNC, mix one block into memory (block_frames * 2 samples) instead of the device.
+    void mix(int16_t *dest) {
+      if (sync) mix_block(dest);
+    }
+
+    /// Called once a frame. With ALC_SYNC, keeps a sound device fed.
+    void update() {
+      if (!sync) return;
+      while (sink->is_device() && sink->ready()) {
+        render(1);
+      }
+    }
+
+    /// Mixing time per block and the number of voices.
+    mix_stats get_stats() const {
+      mix_stats s;
+      s.blocks = stat_blocks;
+      s.last_us = stat_last_ns * 1e-3f;
+      s.max_us = stat_max_ns * 1e-3f;
+      s.average_us = s.blocks ? (float)(stat_total_ns * 1e-3 / s.blocks) : 0;
+      s.mixed_voices = stat_mixed;
+      s.virtual_voices = stat_virtual;
+      return s;
+    }
+
+    unsigned get_rate() const {
+      return rate;
+    }
+
+    /// Turn the SSE mixing off or back on, eg. to compare it with the scalar code.
+    static void enable_sse(bool value) {
+      sse_enabled() = value;
     }
   };
 
@@ -464,7 +1441,7 @@ namespace octet {
 
 
   inline ALint alGetInteger( ALenum param ) {
-    return 0;
+    return param == AL_DISTANCE_MODEL ? Fake_AL_context()->get_distance_model() : 0;
   }
 
 
@@ -499,14 +1476,22 @@ namespace octet {
 
 
   inline void alListenerf( ALenum param, ALfloat value ) {
+    Fake_AL_context()->listener_f(param, value);
   }
 
 
   inline void alListener3f( ALenum param, ALfloat value1, ALfloat value2, ALfloat value3 ) {
+    ALfloat values[3] = { value1, value2, value3 };
+    Fake_AL_context()->listener_fv(param, values);
   }
 
 
   inline void alListenerfv( ALenum param, const ALfloat* values ) {
+    if (param == AL_GAIN) {
+      Fake_AL_context()->listener_f(param, values[0]);
+    } else {
+      Fake_AL_context()->listener_fv(param, values);
+    }
   }
  
 
@@ -523,14 +1508,23 @@ namespace octet {
 
 
   inline void alGetListenerf( ALenum param, ALfloat* value ) {
+    const float *src = Fake_AL_context()->get_listener(param);
+    if (src) *value = src[0];
   }
 
 
   inline void alGetListener3f( ALenum param, ALfloat *value1, ALfloat *value2, ALfloat *value3 ) {
+    const float *src = Fake_AL_context()->get_listener(param);
+    if (src && param != AL_GAIN) {
+      *value1 = src[0]; *value2 = src[1]; *value3 = src[2];
+    }
   }
 
 
   inline void alGetListenerfv( ALenum param, ALfloat* values ) {
+    const float *src = Fake_AL_context()->get_listener(param);
+    unsigned n = param == AL_GAIN ? 1 : param == AL_POSITION ? 3 : 6;
+    for (unsigned i = 0; src && i != n; ++i) values[i] = src[i];
   }
 
 
@@ -555,124 +1549,144 @@ namespace octet {
  
 
   inline void alDeleteSources( ALsizei n, const ALuint* sources ) {
+    ALCcontext *ctxt = Fake_AL_context();
+    for (ALsizei i = 0; i != n; ++i) {
+      ctxt->delete_source(sources[i]);
+    }
   }
 
 
   inline ALboolean alIsSource( ALuint sid ) {
-    return 0;
+    return Fake_AL_context()->get_source(sid) != 0;
   }
  
 
   inline void alSourcef( ALuint sid, ALenum param, ALfloat value ) {
-    ALCcontext *ctxt = Fake_AL_context();
-    ALsource *src = ctxt->get_source(sid);
-    src->setf(param, value);
+    Fake_AL_context()->source_f(sid, param, value);
   }
  
 
   inline void alSource3f( ALuint sid, ALenum param, ALfloat value1, ALfloat value2, ALfloat value3 ) {
+    Fake_AL_context()->source_3f(sid, param, value1, value2, value3);
   }
 
 
   inline void alSourcefv( ALuint sid, ALenum param, const ALfloat* values ) {
+    if (param == AL_POSITION) {
+      Fake_AL_context()->source_3f(sid, param, values[0], values[1], values[2]);
+    } else {
+      Fake_AL_context()->source_f(sid, param, values[0]);
+    }
   }
  
 
   inline void alSourcei( ALuint sid, ALenum param, ALint value ) {
-    ALCcontext *ctxt = Fake_AL_context();
-    ALsource *src = ctxt->get_source(sid);
-    src->seti(param, value);
+    Fake_AL_context()->source_i(sid, param, value);
   }
  
 
   inline void alSource3i( ALuint sid, ALenum param, ALint value1, ALint value2, ALint value3 ) {
+    Fake_AL_context()->source_3f(sid, param, (float)value1, (float)value2, (float)value3);
   }
 
 
   inline void alSourceiv( ALuint sid, ALenum param, const ALint* values ) {
+    if (param == AL_POSITION) {
+      alSource3i(sid, param, values[0], values[1], values[2]);
+    } else {
+      alSourcei(sid, param, values[0]);
+    }
   }
 
 
   inline void alGetSourcef( ALuint sid, ALenum param, ALfloat* value ) {
+    *value = Fake_AL_context()->get_source_f(sid, param);
   }
 
 
   inline void alGetSource3f( ALuint sid, ALenum param, ALfloat* value1, ALfloat* value2, ALfloat* value3) {
+    const float *pos = param == AL_POSITION ? Fake_AL_context()->get_source_position(sid) : 0;
+    if (pos) {
+      *value1 = pos[0]; *value2 = pos[1]; *value3 = pos[2];
+    }
   }
 
 
   inline void alGetSourcefv( ALuint sid, ALenum param, ALfloat* values ) {
+    if (param == AL_POSITION) {
+      alGetSource3f(sid, param, values, values + 1, values + 2);
+    } else {
+      alGetSourcef(sid, param, values);
+    }
   }
 
 
   inline void alGetSourcei( ALuint sid,  ALenum param, ALint* value ) {
+    *value = Fake_AL_context()->get_source_i(sid, param);
   }
 
 
   inline void alGetSource3i( ALuint sid, ALenum param, ALint* value1, ALint* value2, ALint* value3) {
+    ALfloat v[3] = { 0, 0, 0 };
+    alGetSource3f(sid, param, v, v + 1, v + 2);
+    *value1 = (ALint)v[0]; *value2 = (ALint)v[1]; *value3 = (ALint)v[2];
   }
 
 
   inline void alGetSourceiv( ALuint sid,  ALenum param, ALint* values ) {
+    if (param == AL_POSITION) {
+      alGetSource3i(sid, param, values, values + 1, values + 2);
+    } else {
+      alGetSourcei(sid, param, values);
+    }
+  }
+
+  inline void alSourcePlay( ALuint sid ) {
+    Fake_AL_context()->source_state(sid, ALcommand::op_play);
+  }
+
+  inline void alSourceStop( ALuint sid ) {
+    Fake_AL_context()->source_state(sid, ALcommand::op_stop);
+  }
+
+
+  inline void alSourceRewind( ALuint sid ) {
+    Fake_AL_context()->source_state(sid, ALcommand::op_rewind);
+  }
+
+
+  inline void alSourcePause( ALuint sid ) {
+    Fake_AL_context()->source_state(sid, ALcommand::op_pause);
   }
 
 
   inline void alSourcePlayv( ALsizei ns, const ALuint *sids ) {
+    for (ALsizei i = 0; i != ns; ++i) alSourcePlay(sids[i]);
   }
 
 
   inline void alSourceStopv( ALsizei ns, const ALuint *sids ) {
+    for (ALsizei i = 0; i != ns; ++i) alSourceStop(sids[i]);
   }
 
 
   inline void alSourceRewindv( ALsizei ns, const ALuint *sids ) {
+    for (ALsizei i = 0; i != ns; ++i) alSourceRewind(sids[i]);
   }
 
 
   inline void alSourcePausev( ALsizei ns, const ALuint *sids ) {
-  }
-
-  inline void alSourcePlay( ALuint sid ) {
-    ALCcontext *ctxt = Fake_AL_context();
-    ALsource *src = ctxt->get_source(sid);
-    if (src) {
-      src->seti(AL_SAMPLE_OFFSET, 0);
-      src->seti(AL_SOURCE_STATE, AL_PLAYING);
-    }
-  }
-
-  inline void alSourceStop( ALuint sid ) {
-    ALCcontext *ctxt = Fake_AL_context();
-    ALsource *src = ctxt->get_source(sid);
-    if (src) {
-      src->seti(AL_SOURCE_STATE, AL_STOPPED);
-    }
-  }
-
-
-  inline void alSourceRewind( ALuint sid ) {
-    ALCcontext *ctxt = Fake_AL_context();
-    ALsource *src = ctxt->get_source(sid);
-    if (src) {
-      src->seti(AL_SAMPLE_OFFSET, 0);
-    }
-  }
-
-
-  inline void alSourcePause( ALuint sid ) {
-    ALCcontext *ctxt = Fake_AL_context();
-    ALsource *src = ctxt->get_source(sid);
-    if (src) {
-      src->seti(AL_SOURCE_STATE, AL_PAUSED);
-    }
+    for (ALsizei i = 0; i != ns; ++i) alSourcePause(sids[i]);
   }
 
 
   inline void alSourceQueueBuffers( ALuint sid, ALsizei numEntries, const ALuint *bids ) {
+    Fake_AL_context()->queue_buffers(sid, numEntries, bids);
   }
 
 
   inline void alSourceUnqueueBuffers( ALuint sid, ALsizei numEntries, ALuint *bids ) {
+    Fake_AL_context()->unqueue_buffers(sid, numEntries, bids);
   }
 
 
@@ -685,6 +1699,10 @@ namespace octet {
 
 
   inline void alDeleteBuffers( ALsizei n, const ALuint* buffers ) {
+    ALCcontext *ctxt = Fake_AL_context();
+    for (ALsizei i = 0; i != n; ++i) {
+      ctxt->delete_buffer(buffers[i]);
+    }
   }
 
 
@@ -739,6 +1757,14 @@ namespace octet {
 
 
   inline void alGetBufferi( ALuint bid, ALenum param, ALint* value ) {
+    ALbuffer *buf = Fake_AL_context()->get_buffer(bid);
+    if (!buf) return;
+    switch (param) {
+      case AL_FREQUENCY: *value = buf->get_freq(); break;
+      case AL_CHANNELS: *value = buf->get_num_channels(); break;
+      case AL_BITS: *value = buf->get_format() == AL_FORMAT_MONO8 || buf->get_format() == AL_FORMAT_STEREO8 ? 8 : 16; break;
+      case AL_SIZE: *value = buf->get_size(); break;
+    }
   }
 
 
@@ -763,11 +1789,13 @@ namespace octet {
 
 
   inline void alDistanceModel( ALenum distanceModel ) {
+    Fake_AL_context()->set_distance_model(distanceModel);
   }
 
 
+  /// attributes: ALC_FREQUENCY, ALC_MONO_SOURCES and ALC_SYNC to mix on the calling thread.
   inline ALCcontext * alcCreateContext( ALCdevice *device, const ALCint* attrlist ) {
-    return new ALCcontext();
+    return new ALCcontext(device, attrlist);
   }
 
 
@@ -798,8 +1826,11 @@ namespace octet {
     return 0;
   }
 
+  /// NULL for the default device, "null" for silence or "wav:filename" to record.
   inline ALCdevice * alcOpenDevice( const ALCchar *devicename ) {
-    return new ALCdevice();
+    ALCdevice *device = new ALCdevice();
+    if (devicename) device->name = devicename;
+    return device;
   }
 
 
@@ -853,4 +1884,81 @@ namespace octet {
 
   inline void alcCaptureSamples( ALCdevice *device, ALCvoid *buffer, ALCsizei samples ) {
   }
+
+  #if OCTET_UNIT_TEST
+    /// Mix a few hundred looping sources on the calling thread with ALC_SYNC.
+    /// Checks the voice counts and that the SSE and scalar mixers give the same samples.
+    class ALCcontext_unit_test {
+      enum { num_sources = 300, max_voices = 64, num_frames = 4410, num_blocks = 20 };
+
+      // every third source is too far away to hear.
+      static ALCcontext *make_context(ALCdevice *device, ALuint *sources) {
+        ALCint attrs[] = { ALC_SYNC, 1, 0 };
+        ALCcontext *ctx = alcCreateContext(device, attrs);
+        alcMakeContextCurrent(ctx);
+        ctx->set_max_voices(max_voices);
+
+        // 44 cycles of a 440Hz tone, so that it loops cleanly.
+        dynarray<int16_t> samples(num_frames);
+        for (int i = 0; i != num_frames; ++i) {
+          samples[i] = (int16_t)(sinf(i * (2 * 3.14159265f * 440 / 44100)) * 16000);
+        }
+        ALuint buffer = 0;
+        alGenBuffers(1, &buffer);
+        alBufferData(buffer, AL_FORMAT_MONO16, samples.data(), num_frames * sizeof(int16_t), 44100);
+
+        alGenSources(num_sources, sources);
+        for (int i = 0; i != num_sources; ++i) {
+          float distance = i % 3 == 2 ? 10000.0f : 1.0f + i % 50;
+          alSourcei(sources[i], AL_BUFFER, buffer);
+          alSourcei(sources[i], AL_LOOPING, AL_TRUE);
+          alSourcef(sources[i], AL_PITCH, 0.5f + (i % 7) * 0.25f);
+          alSourcef(sources[i], AL_GAIN, 0.05f);
+          alSource3f(sources[i], AL_POSITION, cosf((float)i) * distance, 0, sinf((float)i) * distance);
+          alSourcePlay(sources[i]);
+        }
+        return ctx;
+      }
+
+    public:
+      ALCcontext_unit_test() {
+        ALCdevice *device = alcOpenDevice("null");
+        ALuint sources[num_sources];
+        ALCcontext *ctx_sse = make_context(device, sources);
+        ALCcontext *ctx_scalar = make_context(device, sources);
+
+        int16_t out_sse[ALCcontext::block_frames * 2];
+        int16_t out_scalar[ALCcontext::block_frames * 2];
+        bool any_sound = false;
+        for (int b = 0; b != num_blocks; ++b) {
+          ALCcontext::enable_sse(true);
+          ctx_sse->mix(out_sse);
+          ALCcontext::enable_sse(false);
+          ctx_scalar->mix(out_scalar);
+          assert(!memcmp(out_sse, out_scalar, sizeof(out_sse)));
+          for (int i = 0; i != ALCcontext::block_frames * 2; ++i) {
+            any_sound |= out_sse[i] != 0;
+          }
+        }
+        ALCcontext::enable_sse(true);
+        assert(any_sound);
+
+        // the loudest max_voices are mixed; the quiet ones and the rest are virtual.
+        ALCcontext::mix_stats stats = ctx_sse->get_stats();
+        assert(stats.blocks == num_blocks);
+        assert(stats.mixed_voices == max_voices);
+        assert(stats.virtual_voices == num_sources - max_voices);
+
+        // looping sources keep playing, virtual or not.
+        ALint state = 0;
+        alGetSourcei(sources[num_sources - 1], AL_SOURCE_STATE, &state);
+        assert(state == AL_PLAYING);
+
+        alcDestroyContext(ctx_sse);
+        alcDestroyContext(ctx_scalar);
+        alcCloseDevice(device);
+      }
+    };
+    static ALCcontext_unit_test ALCcontext_unit_test;
+  #endif
 }
@@ -93,6 +93,8 @@ namespace octet {
       mouse_abs_x = mouse_abs_y = 0;
       is_gles3 = false;
       frame_number = 0;
+      // resources released on other threads are deleted on this one.
+      deferred_release::set_owner_thread();
     }
 
     virtual ~app_common() {
@@ -106,6 +108,7 @@ namespace octet {
 
     void end_frame() {
       prev_keys = keys;
+      deferred_release::flush();
     }
 
     virtual void draw_world(int x, int y, int w, int h) = 0;
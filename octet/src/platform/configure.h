@@ -26,6 +26,17 @@
   #define OCTET_OPENCL 0
 #endif
 
+// ref<> counts are atomic so that loaders and jobs can share resources.
+// Build with -D OCTET_ATOMIC_REFS=0 for plain counts on single threaded apps.
+#ifndef OCTET_ATOMIC_REFS
+  #define OCTET_ATOMIC_REFS 1
+#endif
+
+// Build with -D OCTET_BENCHMARK=1 to time the heavy kernels at startup (see the *_benchmark classes).
+#ifndef OCTET_BENCHMARK
+  #define OCTET_BENCHMARK 0
+#endif
+
 #if defined(WIN32)
   #define OCTET_SSE 1
   #pragma warning(disable : 4996)
@@ -36,6 +47,16 @@
   #define GL_UNIFORM_BUFFER 0
 #endif
 
+// x86-64 always has SSE2. Build with -D OCTET_SSE=0 to test the scalar math.
+#if defined(OCTET_LINUX) && !defined(OCTET_SSE) && (defined(__x86_64__) || defined(__SSE2__))
+  #define OCTET_SSE 1
+#endif
+
+// AVX2 and FMA versions of the batch math are compiled in and chosen at startup.
+#if OCTET_SSE && !defined(OCTET_AVX) && (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+  #define OCTET_AVX 1
+#endif
+
 // use <> to include from standard directories
 // use "" to include from our own project
 #include <stdio.h>
@@ -54,6 +75,18 @@
 #include <numeric>
 #include <iostream>
 #include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#if OCTET_SSE
+  #include <emmintrin.h>
+#endif
+#if OCTET_AVX
+  #include <immintrin.h>
+#endif
 
 #if defined(WIN32)
   #include <direct.h>
@@ -71,5 +104,40 @@ namespace octet {
     //fflush(file);
     return file;
   }
+
+  /// Wall clock timer for the OCTET_BENCHMARK blocks.
+  ///
+  /// Example:
+  ///
+  ///     benchmark_timer timer;
+  ///     for (int i = 0; i != n; ++i) do_something();
+  ///     timer.report("do_something", n, "calls"); // prints the time and millions of calls per second
+  class benchmark_timer {
+    std::chrono::steady_clock::time_point start;
+  public:
+    benchmark_timer() {
+      reset();
+    }
+
+    void reset() {
+      start = std::chrono::steady_clock::now();
+    }
+
+    /// seconds since construction or reset()
+    double get_seconds() const {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    /// print the time taken and the rate. Returns the time in seconds.
+    double report(const char *name, double count = 0, const char *units = "items") const {
+      double seconds = get_seconds();
+      if (count > 0 && seconds > 0) {
+        printf("%-40s %10.3fms %10.2fM %s/s\n", name, seconds * 1e3, count / seconds * 1e-6, units);
+      } else {
+        printf("%-40s %10.3fms\n", name, seconds * 1e3);
+      }
+      return seconds;
+    }
+  };
 }
 
@@ -111,6 +111,7 @@ namespace octet {
       get_viewport_size(vx, vy);
       draw_world(0, 0, vx, vy);
       inc_frame_number();
+      deferred_release::flush();
     }
 
     ~app() {
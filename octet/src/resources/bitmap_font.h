@@ -9,6 +9,10 @@
 
 namespace octet { namespace resources {
   /// Bitmap font class. Uses the Angelcode BMFont .fnt file format
+  ///
+  /// Glyphs are kept in a table indexed by code point, ready to be added to the pen position.
+  /// Layouts of short strings are cached, so drawing the same label in the same box again
+  /// is a copy of its vertices.
   class bitmap_font : public resource {
     // Angelcode BMFont .fnt file format
 
@@ -69,11 +73,30 @@ namespace octet { namespace resources {
     float uscale;
     float vscale;
 
+    // a character ready to draw: the corners relative to the pen and the texture coordinates.
+    struct glyph {
+      float x0, y0, x1, y1;
+      float u0, v0, u1, v1;
+      int xadvance;
+      bool valid;
+    };
+
+    enum {
+      // code points below this use the glyph table directly
+      max_dense = 0x10000,
+
+      // limits on the layout cache
+      max_cached_layouts = 1024,
+      max_cached_bytes = 256,
+    };
+
     // transient info, built by update()
     const info *finfo;
     const common *fcommon;
     const kern *fkern;
-    hash_map<unsigned, const char_info *> char_map;
+    dynarray<glyph> glyphs;
+    unsigned dense_size;
+    hash_map<unsigned, unsigned> sparse_glyphs;
 
 public:
     /// Output vertex format used by the mesh generator.
@@ -84,15 +107,56 @@ public:
     };
 
 private:
-    // add a new vertex to the buffer
-    vertex *add_vertex(vertex *vtx, int xdraw, int ydraw, int x, int y, unsigned color) {
-      vtx->x = (float)xdraw;
-      vtx->y = (float)ydraw;
-      vtx->z = 0;
-      vtx->u = x * uscale;
-      vtx->v = 1.0f - y * vscale;
-      vtx->color = color;
-      return vtx + 1;
+    // a string laid out in a box, relative to the top left corner
+    struct layout {
+      string text;
+      int width;
+      int height;
+      dynarray<vertex> vertices;
+    };
+
+    hash_map<uint64_t, layout*> layouts;
+    unsigned num_layouts;
+
+    // code points of the string being laid out
+    dynarray<unsigned> decoded;
+
+    // layout of strings too long to cache
+    dynarray<vertex> scratch;
+
+    const glyph *get_glyph(unsigned chr) {
+      if (chr < dense_size) {
+        return glyphs[chr].valid ? &glyphs[chr] : 0;
+      }
+      int index = sparse_glyphs.get_index(chr);
+      return index >= 0 && sparse_glyphs.get_key(index) == chr ? &glyphs[sparse_glyphs.get_value(index)] : 0;
+    }
+
+    void make_glyph(glyph &g, const char_info *ci) {
+      int x = u2(ci->x);
+      int y = u2(ci->y);
+      int width = u2(ci->width);
+      int height = u2(ci->height);
+      int xoffset = s2(ci->xoffset);
+      int yoffset = s2(ci->yoffset);
+      g.x0 = (float)xoffset;
+      g.y0 = (float)-yoffset;
+      g.x1 = (float)(xoffset + width);
+      g.y1 = (float)(-yoffset - height);
+      g.u0 = x * uscale;
+      g.v0 = 1.0f - y * vscale;
+      g.u1 = (x + width) * uscale;
+      g.v1 = 1.0f - (y + height) * vscale;
+      g.xadvance = s2(ci->xadvance);
+      g.valid = true;
+    }
+
+    void flush_layouts() {
+      for (unsigned i = 0; i != layouts.size(); ++i) {
+        if (layouts.get_key(i)) delete layouts.get_value(i);
+      }
+      layouts.clear();
+      num_layouts = 0;
     }
 
     // read little endian bytes on any machine
@@ -123,7 +187,7 @@ private:
     }
 
     // find the next space or hyphen
-    const char *find_word_end(const char *src, const char *src_max) {
+    static const unsigned *find_word_end(const unsigned *src, const unsigned *src_max) {
       // a space or hyphen on its own is a word
       if (src < src_max && (*src == ' ' || *src == '-')) {
         src++;
@@ -136,17 +200,11 @@ private:
     }
 
     // find how many pixels we move if we render this string
-    int find_escapement(const char *src, const char *src_max) {
+    int find_escapement(const unsigned *src, const unsigned *src_max) {
       int result = 0;
-      while (src < src_max) {
-        unsigned chr = decode_utf8(src);
-        int index = char_map.get_index(chr);
-        if (index >= 0) {
-          const char_info *ci = char_map.get_value(index);
-          if (ci) {
-            result += s2(ci->xadvance);
-          }
-        }
+      for (; src < src_max; ++src) {
+        const glyph *g = get_glyph(*src);
+        if (g) result += g->xadvance;
       }
       return result;
     }
@@ -165,7 +223,10 @@ private:
 
       ptr += 4;
 
-      char_map.clear();
+      glyphs.reset();
+      sparse_glyphs.clear();
+      dense_size = 0;
+      flush_layouts();
 
       while (ptr < ptr_max) {
         unsigned size = u4(ptr+1);
@@ -179,12 +240,23 @@ private:
           // pages
         } else if (*ptr == 4) {
           const char_info *chars = (const char_info*)(ptr + 5);
-          for (unsigned i = 0; i < size; i += sizeof(char_info)) {
-            char_map[u4(chars->id)] = chars++;
+          unsigned num_chars = size / sizeof(char_info);
+          for (unsigned i = 0; i != num_chars; ++i) {
+            unsigned id = u4(chars[i].id);
+            if (id < max_dense && id >= dense_size) dense_size = id + 1;
+          }
+          glyphs.resize(dense_size);
+          memset(glyphs.data(), 0, dense_size * sizeof(glyph));
+          for (unsigned i = 0; i != num_chars; ++i) {
+            unsigned id = u4(chars[i].id);
+            if (id < max_dense) {
+              make_glyph(glyphs[id], &chars[i]);
+            } else {
+              sparse_glyphs[id] = glyphs.size();
+              glyphs.resize(glyphs.size() + 1);
+              make_glyph(glyphs.back(), &chars[i]);
+            }
           }
-          /*for (unsigned i = 0; i != char_map.size(); ++i) {
-            log("%d %08x %p %d\n", i, char_map.key(i), char_map.value(i), char_map.get_index(char_map.key(i)));
-          }*/
         } else if (*ptr == 5) {
           fkern = (const kern*)(ptr + 5);
         }
@@ -192,95 +264,38 @@ private:
       }
     }
 
-    // draw a word by creating a serues of quads.
-    unsigned render_chars(unsigned num_quads, int xdraw, int ydraw, vertex *vtx, uint32_t *idx, const char *src, const char *src_max, bool left_to_right, unsigned &color) {
-      vtx += num_quads * 4;
-      idx += num_quads * 6;
-      while (src < src_max) {
-        unsigned chr = decode_utf8(src);
-
-        int index = char_map.get_index(chr);
-        if (index >= 0) {
-          const char_info *ci = char_map.get_value(index);
-          if (ci) {
-            unsigned x = u2(ci->x);
-            unsigned y = u2(ci->y);
-            unsigned width = u2(ci->width);
-            unsigned height = u2(ci->height);
-            int xoffset = s2(ci->xoffset);
-            int yoffset = s2(ci->yoffset);
-            int xadvance = s2(ci->xadvance);
-
-            if (!left_to_right) xdraw -= xadvance;
-
-            // 0 1
-            // 2 3
-            idx[0] = num_quads * 4 + 0;
-            idx[1] = num_quads * 4 + 1;
-            idx[2] = num_quads * 4 + 2;
-            idx[3] = num_quads * 4 + 2;
-            idx[4] = num_quads * 4 + 1;
-            idx[5] = num_quads * 4 + 3;
-            idx += 6;
-
-            vtx = add_vertex(vtx, xdraw + xoffset, ydraw - yoffset, x, y, color);
-            vtx = add_vertex(vtx, xdraw + xoffset + width, ydraw - yoffset, x + width, y, color);
-            vtx = add_vertex(vtx, xdraw + xoffset, ydraw - yoffset - height, x, y + height, color);
-            vtx = add_vertex(vtx, xdraw + xoffset + width, ydraw - yoffset - height, x + width, y + height, color);
-
-            num_quads++;
-
-            if (left_to_right) xdraw += xadvance;
-          }
-        }
+    // draw a word by adding four vertices for each character.
+    void render_chars(dynarray<vertex> &vertices, int xdraw, int ydraw, const unsigned *src, const unsigned *src_max, bool left_to_right, unsigned color) {
+      for (; src < src_max; ++src) {
+        const glyph *g = get_glyph(*src);
+        if (!g) continue;
+
+        if (!left_to_right) xdraw -= g->xadvance;
+
+        // 0 1
+        // 2 3
+        float x = (float)xdraw, y = (float)ydraw;
+        unsigned size = vertices.size();
+        vertices.resize(size + 4);
+        vertex *vtx = &vertices[size];
+        vtx[0].x = x + g->x0; vtx[0].y = y + g->y0; vtx[0].z = 0; vtx[0].u = g->u0; vtx[0].v = g->v0; vtx[0].color = color;
+        vtx[1].x = x + g->x1; vtx[1].y = y + g->y0; vtx[1].z = 0; vtx[1].u = g->u1; vtx[1].v = g->v0; vtx[1].color = color;
+        vtx[2].x = x + g->x0; vtx[2].y = y + g->y1; vtx[2].z = 0; vtx[2].u = g->u0; vtx[2].v = g->v1; vtx[2].color = color;
+        vtx[3].x = x + g->x1; vtx[3].y = y + g->y1; vtx[3].z = 0; vtx[3].u = g->u1; vtx[3].v = g->v1; vtx[3].color = color;
+
+        if (left_to_right) xdraw += g->xadvance;
       }
-      return num_quads;
     }
 
-
-  public:
-    RESOURCE_META(bitmap_font)
-
-    /// Create new bitmap font info object given the URL of a .fnt file
-    bitmap_font(int page_width=1, int page_height=1, const char *fnt_file = 0) {
-      finfo = 0;
-      fcommon = 0;
-      fkern = 0;
-
-      uscale = 1.0f / page_width;
-      vscale = 1.0f / page_height;
-      if (fnt_file) {
-        app_utils::get_url(font_info, fnt_file);
-        update();
-      }
-    }
-
-    /// Serialize this object.
-    void visit(visitor &v) {
-      v.visit(font_info, atom_font_info);
-      v.visit(uscale, atom_uscale);
-      v.visit(vscale, atom_vscale);
-      if (v.is_reader()) update();
-    }
-
-    /// Build a mesh by combining the string with the bitmap font info.
-    unsigned build_mesh(const aabb &bb, vertex *vtx, uint32_t *idx, unsigned max_quads, const char *text, const char *max_text) {
-      // defensive coding
-      if (!idx || !vtx) return 0;
-      if (!text) return 0;
-      if (!fcommon) return 0;
-
-      if (!max_text) max_text = text + strlen(text);
-
-      int xmin = (int)bb.get_min().x();
-      int ymin = (int)bb.get_min().y();
-      int xmax = (int)bb.get_max().x();
-      int ymax = (int)bb.get_max().y();
+    // word wrap the decoded string into a box with its top left corner at the origin.
+    void layout_decoded(dynarray<vertex> &vertices, int width, int height) {
+      int xmin = 0;
+      int ymin = -height;
+      int xmax = width;
+      int ymax = 0;
 
       int line_height = u2(fcommon->lineHeight);
 
-      unsigned num_quads = 0;
-
       //char arabic_text[] = "أخبار الوطن العربي";
 
       unsigned color = 0xffffffff;
@@ -290,12 +305,19 @@ private:
       int xdraw = left_to_right ? xmin : xmax;
       int ydraw = ymax - line_height + base;
 
-      int index = char_map.get_index(' ');
-      const char_info *ci = index >= 0 ? char_map.get_value(index) : 0;
-      int space_size = ci ? s2(ci->xadvance) : line_height / 2;
+      const glyph *space = get_glyph(' ');
+      int space_size = space ? space->xadvance : line_height / 2;
 
-      for (const char *src = text; src < max_text && *src && num_quads < max_quads; ) {
-        const char *word_end = find_word_end(src, max_text);
+      const unsigned *max_text = decoded.data() + decoded.size();
+      for (const unsigned *src = decoded.data(); src < max_text; ) {
+        if (*src == '\n') {
+          src++;
+          xdraw = left_to_right ? xmin : xmax;
+          ydraw -= line_height;
+          continue;
+        }
+
+        const unsigned *word_end = find_word_end(src, max_text);
         if (word_end == src) break; // avoid infinite loops
 
         int escapement = find_escapement(src, word_end);
@@ -330,7 +352,7 @@ private:
           break;
         }
 
-        num_quads = render_chars(num_quads, xdraw, ydraw, vtx, idx, src, word_end, left_to_right, color);
+        render_chars(vertices, xdraw, ydraw, src, word_end, left_to_right, color);
 
         src = word_end;
 
@@ -340,17 +362,144 @@ private:
           xdraw += left_to_right ? space_size : -space_size;
           src++;
         }
-        if (src < max_text && *src == '\n') {
-          src++;
-          if (left_to_right) {
-            xdraw = xmin;
-            ydraw -= line_height;
-          } else {
-            xdraw = xmax;
-            ydraw -= line_height;
+      }
+    }
+
+  public:
+    RESOURCE_META(bitmap_font)
+
+    /// Create new bitmap font info object given the URL of a .fnt file
+    bitmap_font(int page_width=1, int page_height=1, const char *fnt_file = 0) {
+      finfo = 0;
+      fcommon = 0;
+      fkern = 0;
+      dense_size = 0;
+      num_layouts = 0;
+
+      uscale = 1.0f / page_width;
+      vscale = 1.0f / page_height;
+      if (fnt_file) {
+        app_utils::get_url(font_info, fnt_file);
+        update();
+      }
+    }
+
+    ~bitmap_font() {
+      flush_layouts();
+    }
+
+    /// Serialize this object.
+    void visit(visitor &v) {
+      v.visit(font_info, atom_font_info);
+      v.visit(uscale, atom_uscale);
+      v.visit(vscale, atom_vscale);
+      if (v.is_reader()) update();
+    }
+
+    /// Lay out text in a box, adding four vertices for each character drawn.
+    /// Short strings are cached, so laying out the same string in the same box again is a copy.
+    void layout_text(dynarray<vertex> &vertices, const aabb &bb, const char *text, const char *max_text = 0) {
+      if (!text) return;
+      if (!fcommon) return;
+
+      if (!max_text) max_text = text + strlen(text);
+      const char *end = (const char*)memchr(text, 0, max_text - text);
+      if (end) max_text = end;
+      unsigned bytes = (unsigned)(max_text - text);
+
+      // the layout only depends on the size of the box, so labels of the same size share it.
+      int xmin = (int)bb.get_min().x();
+      int ymin = (int)bb.get_min().y();
+      int xmax = (int)bb.get_max().x();
+      int ymax = (int)bb.get_max().y();
+      int width = xmax - xmin;
+      int height = ymax - ymin;
+
+      uint64_t key = 0xcbf29ce484222325ull;
+      for (const char *p = text; p != max_text; ++p) {
+        key = (key ^ (uint8_t)*p) * 0x100000001b3ull;
+      }
+      key = (key ^ (uint32_t)width) * 0x100000001b3ull;
+      key = (key ^ (uint32_t)height) * 0x100000001b3ull;
+      key += key == 0;
+
+      layout *cached = 0;
+      if (bytes <= max_cached_bytes) {
+        int index = layouts.get_index(key);
+        cached = index >= 0 && layouts.get_key(index) == key ? layouts.get_value(index) : 0;
+        if (cached && (cached->width != width || cached->height != height || cached->text.size() != (int)bytes || memcmp(cached->text.c_str(), text, bytes))) {
+          cached = 0;
+        }
+      }
+
+      dynarray<vertex> *src = &scratch;
+      if (cached) {
+        src = &cached->vertices;
+      } else {
+        // decode the UTF-8 once and wrap the words
+        decoded.resize(0);
+        for (const char *p = text; p < max_text; ) {
+          decoded.push_back(decode_utf8(p));
+        }
+
+        if (bytes <= max_cached_bytes) {
+          if (num_layouts >= max_cached_layouts) {
+            flush_layouts();
           }
+          layout *&slot = layouts[key];
+          if (!slot) {
+            slot = new layout();
+            num_layouts++;
+          }
+          slot->text.set(text, bytes);
+          slot->width = width;
+          slot->height = height;
+          src = &slot->vertices;
         }
+        src->resize(0);
+        layout_decoded(*src, width, height);
+      }
+
+      // move the layout to the box.
+      float dx = (float)xmin, dy = (float)ymax;
+      unsigned size = vertices.size();
+      unsigned num = src->size();
+      vertices.resize(size + num);
+      vertex *vtx = vertices.data() + size;
+      const vertex *svtx = src->data();
+      for (unsigned i = 0; i != num; ++i) {
+        vtx[i] = svtx[i];
+        vtx[i].x += dx;
+        vtx[i].y += dy;
+      }
+    }
+
+    /// Write indices for quads made of four vertices: 0 1 2, 2 1 3.
+    static void make_quad_indices(uint32_t *idx, unsigned first_quad, unsigned num_quads) {
+      for (unsigned q = first_quad; q != first_quad + num_quads; ++q) {
+        idx[0] = q * 4 + 0;
+        idx[1] = q * 4 + 1;
+        idx[2] = q * 4 + 2;
+        idx[3] = q * 4 + 2;
+        idx[4] = q * 4 + 1;
+        idx[5] = q * 4 + 3;
+        idx += 6;
       }
+    }
+
+    /// Build a mesh by combining the string with the bitmap font info.
+    unsigned build_mesh(const aabb &bb, vertex *vtx, uint32_t *idx, unsigned max_quads, const char *text, const char *max_text) {
+      // defensive coding
+      if (!idx || !vtx) return 0;
+      if (!text) return 0;
+      if (!fcommon) return 0;
+
+      dynarray<vertex> vertices;
+      layout_text(vertices, bb, text, max_text);
+
+      unsigned num_quads = std::min(vertices.size() / 4, max_quads);
+      if (num_quads) memcpy(vtx, vertices.data(), num_quads * 4 * sizeof(vertex));
+      make_quad_indices(idx, 0, num_quads);
       return num_quads;
     }
   };
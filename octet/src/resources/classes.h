@@ -30,10 +30,12 @@ OCTET_CLASS(scene, mesh_box)
 OCTET_CLASS(scene, mesh_sphere)
 OCTET_CLASS(scene, mesh_particle_system)
 OCTET_CLASS(scene, mesh_voxel_grid)
+OCTET_CLASS(scene, mesh_isosurface)
 #ifdef OCTET_VOXEL_TEST
   OCTET_CLASS(scene, mesh_voxels)
   OCTET_CLASS(scene, mesh_voxel_subcube)
 #endif
 OCTET_CLASS(scene, mesh_points)
 OCTET_CLASS(scene, mesh_cylinder)
+OCTET_CLASS(scene, mesh_soft_body)
 //OCTET_CLASS(scene, value)
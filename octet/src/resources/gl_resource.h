@@ -171,7 +171,7 @@ namespace octet { namespace resources {
           void *res = glMapBuffer(target, GL_READ_WRITE);
           return res;
         #else
-          return glMapBufferRange(target, 0, size, GL_MAP_WRITE_BIT|GL_MAP_WRITE_BIT);
+          return glMapBufferRange(target, 0, size, GL_MAP_READ_BIT|GL_MAP_WRITE_BIT);
         #endif
       #endif
     }
@@ -214,6 +214,23 @@ namespace octet { namespace resources {
       #endif
     }
 
+    /// get a write-only lock on this buffer, throwing away the old contents.
+    /// The driver can give us fresh memory instead of waiting for draws that use the old data.
+    void *lock_write_discard() const {
+      #ifdef OCTET_GLES2
+        return (void*)&bytes[0];
+      #else
+        glBindBuffer(target, buffer);
+        #ifdef __APPLE__
+          // OSX does not support glMapBufferRange 
+          glBufferData(target, size, NULL, GL_DYNAMIC_DRAW);
+          return glMapBuffer(target, GL_WRITE_ONLY);
+        #else
+          return glMapBufferRange(target, 0, size, GL_MAP_WRITE_BIT|GL_MAP_INVALIDATE_BUFFER_BIT);
+        #endif
+      #endif
+    }
+
     /// bind the resource to the target
     void bind() const {
       glBindBuffer(target, buffer);
@@ -4,52 +4,179 @@
 //
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
-// work in progress
+// Background jobs and a simple worker thread pool.
+//
+// Jobs must not make OpenGL calls; do the CPU work in kernel() and
+// upload the results on the main thread once is_done() returns true.
+//
 
 namespace octet { namespace resources {
+  /// A unit of work that can be run on a worker thread.
+  ///
+  /// The scheduler does not own jobs. Keep the job alive (eg. in a ref<>)
+  /// until is_done() returns true.
+  ///
+  /// Example:
+  ///
+  ///     struct my_job : job { void kernel() { ... } };
+  ///     ref<my_job> jb = new my_job();
+  ///     job_scheduler::get().add(jb);
+  ///     ...
+  ///     if (jb->is_done()) { upload results }
   class job : public resource {
-    ref<job> next;
+    friend class job_scheduler;
 
-    enum state_t {
-      state_waiting,
-      state_running,
-    };
+    // number of times this job is queued or running.
+    std::atomic<int> pending;
+  public:
+    job() {
+      pending = 0;
+    }
+
+    virtual ~job() {
+    }
+
+    /// override this to do the work.
+    virtual void kernel() = 0;
 
-    state_t state;
+    /// true if the job is not queued or running.
+    bool is_done() const {
+      return pending.load(std::memory_order_acquire) == 0;
+    }
+  };
+
+  /// Pool of worker threads that runs jobs in FIFO order.
+  class job_scheduler {
+    std::vector<std::thread> threads;
+    std::deque<job*> queue;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    bool quitting;
 
-    class scheduler {
-      job *waiting;
-      job *running;
-    public:
-      scheduler() {
-        waiting = 0;
-        running = 0;
+    // run jobs until we are told to quit.
+    void worker() {
+      for (;;) {
+        job *jb = 0;
+        {
+          std::unique_lock<std::mutex> lock(queue_mutex);
+          while (!quitting && queue.empty()) {
+            queue_cv.wait(lock);
+          }
+          if (quitting) return;
+          jb = queue.front();
+          queue.pop_front();
+        }
+        run(jb);
       }
+    }
+
+    void run(job *jb) {
+      jb->kernel();
+      jb->pending.fetch_sub(1, std::memory_order_release);
+    }
 
-      void add_to_waiting(job *jb) {
-        jb->next = waiting;
-        waiting = this;
+    // helper for parallel_for: each copy of the job grabs blocks of the range until it is used up.
+    template <class fn_t> struct range_job : job {
+      fn_t &fn;
+      std::atomic<int> next;
+      int end;
+      int grain;
+
+      range_job(fn_t &fn, int begin, int end, int grain) : fn(fn), end(end), grain(grain) {
+        next = begin;
+      }
+
+      void kernel() {
+        for (;;) {
+          int i = next.fetch_add(grain);
+          if (i >= end) return;
+          fn(i, std::min(i + grain, end));
+        }
       }
     };
 
-    scheduler *get_scheduler() {
-      static scheduler sch;
-      return &sch;
-    }
   public:
-    job() {
-      scheduler *sch = get_scheduler();
-      sch->add_to_waiting(this);
+    /// Start num_threads workers. Zero means one per core, less one for the main thread.
+    job_scheduler(int num_threads = 0) {
+      quitting = false;
+      if (num_threads <= 0) {
+        num_threads = (int)std::thread::hardware_concurrency() - 1;
+        if (num_threads < 1) num_threads = 1;
+      }
+      for (int i = 0; i != num_threads; ++i) {
+        threads.push_back(std::thread(&job_scheduler::worker, this));
+      }
     }
 
-    virtual ~job() {
+    /// stop the workers; any jobs still in the queue are not run.
+    ~job_scheduler() {
+      {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        quitting = true;
+      }
+      queue_cv.notify_all();
+      for (size_t i = 0; i != threads.size(); ++i) {
+        threads[i].join();
+      }
     }
 
-    virtual void kernel() = 0;
-    virtual bool is_ready() = 0;
+    /// the shared scheduler used by the framework.
+    static job_scheduler &get() {
+      static job_scheduler instance;
+      return instance;
+    }
+
+    /// how many worker threads are there?
+    int get_num_threads() const {
+      return (int)threads.size();
+    }
 
-    state_t get_state() {
-      return state;
+    /// queue a job to run on a worker thread.
+    void add(job *jb) {
+      jb->pending.fetch_add(1, std::memory_order_relaxed);
+      {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        queue.push_back(jb);
+      }
+      queue_cv.notify_one();
+    }
+
+    /// run one queued job on this thread. returns false if there was nothing to do.
+    bool run_one() {
+      job *jb = 0;
+      {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        if (queue.empty()) return false;
+        jb = queue.front();
+        queue.pop_front();
+      }
+      run(jb);
+      return true;
+    }
+
+    /// wait for a job to finish, helping out with other jobs in the meantime.
+    void wait(job *jb) {
+      while (!jb->is_done()) {
+        if (!run_one()) std::this_thread::yield();
+      }
+    }
+
+    /// call fn(begin, end) for sub-ranges of [begin, end) of about grain items, on all threads.
+    /// returns when the whole range is done. Safe to call from inside a job.
+    template <class fn_t> void parallel_for(int begin, int end, int grain, fn_t fn) {
+      if (grain < 1) grain = 1;
+      if (end - begin <= grain) {
+        if (begin < end) fn(begin, end);
+        return;
+      }
+
+      range_job<fn_t> jb(fn, begin, end, grain);
+      int copies = std::min(get_num_threads(), (end - begin + grain - 1) / grain - 1);
+      for (int i = 0; i < copies; ++i) {
+        add(&jb);
+      }
+      jb.kernel();
+      wait(&jb);
     }
   };
 } }
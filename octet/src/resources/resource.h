@@ -19,13 +19,12 @@ namespace octet { namespace resources {
   /// Base class for resources; provides aligned allocation and reference counting.
   class resource {
     // how many lives do we have?
-    int ref_count;
+    ref_counter ref_count;
 
   public:
     /// Make a new resource with no lives.
     /// Adding it to a ref<> will give it a life.
     resource() {
-      ref_count = 0;
     }
 
     /// factory for making new resources of various kinds
@@ -55,16 +54,22 @@ namespace octet { namespace resources {
 
     /// Give this resource an extra life; see the %ref class.
     void add_ref() {
-      ref_count++;
+      ref_count.add();
     }
 
     /// Remove a life from this resource and delete it if it is dead; see the %ref class.
+    /// If the last life goes on a worker thread, the delete waits for deferred_release::flush().
     void release() {
-      if (--ref_count == 0) {
-        delete this;
+      if (ref_count.remove()) {
+        deferred_release::destroy(this);
       }
     }
 
+    /// number of lives, for debugging.
+    int get_ref_count() const {
+      return ref_count.get();
+    }
+
     /// use the allocator to allocate this resource and its child classes
     void *operator new (size_t size) {
       return allocator::malloc(size);
@@ -43,7 +43,17 @@ namespace octet { namespace resources {
       } else {
         dynarray<unsigned char> buffer;
         app_utils::get_url(buffer, name);
-        if (buffer.size() >= 6 && !memcmp(&buffer[0], "RIFF", 4)) {
+        bool is_wav = buffer.size() >= 6 && !memcmp(&buffer[0], "RIFF", 4);
+        wav_decoder wav;
+        if (is_wav && wav.decode_header(buffer.data(), buffer.size()) && wav.get_format() == wav_decoder::format_ima_adpcm) {
+          // compressed sounds are decoded when they are loaded; use sound_stream for music.
+          dynarray<int16_t> pcm;
+          unsigned frames = wav.decode_all(pcm, buffer.data(), buffer.size());
+          ALuint id = 0;
+          alGenBuffers(1, &id);
+          alBufferData(id, wav.get_num_channels() == 2 ? AL_FORMAT_STEREO16 : AL_FORMAT_MONO16, pcm.data(), frames * wav.get_num_channels() * 2, wav.get_sample_rate());
+          return id;
+        } else if (is_wav) {
           unsigned offset = 0;
           unsigned samples = 44100;
           unsigned char *src = &buffer[0];
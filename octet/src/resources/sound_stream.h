@@ -0,0 +1,282 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Streaming sound: decode a little at a time instead of the whole file.
+//
+
+namespace octet { namespace resources {
+  /// A long sound, such as music, decoded a chunk at a time on a worker thread.
+  ///
+  /// Only a few chunks of decoded sound are in memory at once, so a compressed (IMA-ADPCM)
+  /// file stays compressed until just before it is played.
+  /// Call update() every frame to keep the OpenAL queue full.
+  ///
+  /// Example:
+  ///
+  ///     ref<sound_stream> music = new sound_stream("assets/music.wav", true);
+  ///     music->play();
+  ///     ...
+  ///     music->update(); // every frame
+  class sound_stream : public resource {
+    enum {
+      chunk_frames = 8192,
+      num_chunks = 6,
+      num_buffers = 4,
+      max_header_bytes = 65536,
+    };
+
+    struct decode_job : job {
+      sound_stream *owner;
+
+      decode_job(sound_stream *owner) : owner(owner) {
+      }
+
+      void kernel() {
+        owner->decode_some();
+      }
+    };
+
+    loaders::wav_decoder wav;
+    unsigned data_end;
+    bool looping;
+
+    // the file is read a block at a time, unless it came from a zip file.
+    FILE *file;
+    dynarray<uint8_t> memory;
+    dynarray<uint8_t> block;
+
+    // used only by the decoder (or the main thread when the decoder is idle).
+    unsigned read_pos;
+    std::atomic<bool> finished;
+
+    // ring of decoded chunks; the decoder adds at produced, the main thread takes at consumed.
+    unsigned frames_per_chunk;
+    dynarray<int16_t> pcm;
+    unsigned chunk_size[num_chunks];
+    std::atomic<unsigned> produced;
+    std::atomic<unsigned> consumed;
+
+    ref<decode_job> decoder;
+
+    ALuint buffers[num_buffers];
+    dynarray<ALuint> free_buffers;
+    ALuint source;
+    bool playing;
+
+    // decode whole blocks into the next free chunk. false at the end of the sound.
+    bool decode_chunk() {
+      unsigned slot = produced.load(std::memory_order_relaxed) % num_chunks;
+      unsigned channels = wav.get_num_channels();
+      int16_t *dest = pcm.data() + slot * frames_per_chunk * channels;
+      unsigned frames = 0;
+      while (frames + wav.get_block_frames() <= frames_per_chunk) {
+        if (read_pos >= data_end) {
+          if (!looping || data_end <= wav.get_data_offset()) break;
+          read_pos = wav.get_data_offset();
+        }
+
+        unsigned bytes = std::min(wav.get_block_bytes(), data_end - read_pos);
+        const uint8_t *src = memory.data() + read_pos;
+        if (file) {
+          fseek(file, read_pos, SEEK_SET);
+          bytes = (unsigned)fread(block.data(), 1, bytes, file);
+          src = block.data();
+        }
+        if (bytes == 0) {
+          read_pos = data_end;
+          break;
+        }
+        read_pos += wav.get_block_bytes();
+        frames += wav.decode_block(dest + frames * channels, src, bytes);
+      }
+
+      if (frames == 0) return false;
+      chunk_size[slot] = frames;
+      produced.fetch_add(1, std::memory_order_release);
+      return true;
+    }
+
+    // called on a worker thread: fill the ring.
+    void decode_some() {
+      while (!finished && produced.load(std::memory_order_relaxed) - consumed.load(std::memory_order_acquire) < num_chunks) {
+        if (!decode_chunk()) finished = true;
+      }
+    }
+
+    void wait_for_decoder() {
+      while (!decoder->is_done()) {
+        if (!job_scheduler::get().run_one()) std::this_thread::yield();
+      }
+    }
+
+    // give decoded chunks to OpenAL.
+    void queue_chunks() {
+      unsigned channels = wav.get_num_channels();
+      ALenum format = channels == 2 ? AL_FORMAT_STEREO16 : AL_FORMAT_MONO16;
+      while (free_buffers.size() && consumed.load(std::memory_order_relaxed) != produced.load(std::memory_order_acquire)) {
+        unsigned slot = consumed.load(std::memory_order_relaxed) % num_chunks;
+        ALuint buffer = free_buffers.back();
+        free_buffers.pop_back();
+        const int16_t *src = pcm.data() + slot * frames_per_chunk * channels;
+        alBufferData(buffer, format, src, chunk_size[slot] * channels * 2, wav.get_sample_rate());
+        alSourceQueueBuffers(source, 1, &buffer);
+        consumed.fetch_add(1, std::memory_order_release);
+      }
+    }
+
+    void unqueue_all() {
+      ALint queued = 0;
+      alGetSourcei(source, AL_BUFFERS_QUEUED, &queued);
+      while (queued-- > 0) {
+        ALuint buffer = 0;
+        alSourceUnqueueBuffers(source, 1, &buffer);
+      }
+      free_buffers.resize(0);
+      for (unsigned i = 0; i != num_buffers; ++i) {
+        free_buffers.push_back(buffers[i]);
+      }
+    }
+
+  public:
+    /// Open a .wav file (PCM or IMA-ADPCM). Loop it forever if loop is true.
+    sound_stream(const char *url, bool loop = false) {
+      file = 0;
+      data_end = 0;
+      looping = loop;
+      read_pos = 0;
+      finished = true;
+      frames_per_chunk = 0;
+      produced = 0;
+      consumed = 0;
+      source = 0;
+      playing = false;
+      decoder = new decode_job(this);
+
+      // zip files are read into memory; plain files stay on disk.
+      dynarray<uint8_t> header;
+      unsigned file_size = 0;
+      if (!strncmp(url, "zip://", 6) || !strncmp(url, "http://", 7)) {
+        app_utils::get_url(memory, url);
+        file_size = memory.size();
+        header.resize(std::min(file_size, (unsigned)max_header_bytes));
+        if (header.size()) memcpy(header.data(), memory.data(), header.size());
+      } else {
+        file = fopen(app_utils::get_path(url), "rb");
+        if (file) {
+          fseek(file, 0, SEEK_END);
+          file_size = (unsigned)ftell(file);
+          fseek(file, 0, SEEK_SET);
+          header.resize(std::min(file_size, (unsigned)max_header_bytes));
+          header.resize((unsigned)fread(header.data(), 1, header.size(), file));
+        }
+      }
+
+      if (!header.size() || !wav.decode_header(header.data(), header.size())) {
+        log("sound_stream: can't play %s\n", url);
+        if (file) fclose(file);
+        file = 0;
+        memory.resize(0);
+        return;
+      }
+
+      data_end = std::min(wav.get_data_offset() + wav.get_data_size(), file_size);
+      block.resize(wav.get_block_bytes());
+      frames_per_chunk = std::max(1u, (unsigned)chunk_frames / wav.get_block_frames()) * wav.get_block_frames();
+      pcm.resize(frames_per_chunk * num_chunks * wav.get_num_channels());
+
+      alGenBuffers(num_buffers, buffers);
+      alGenSources(1, &source);
+      unqueue_all();
+    }
+
+    ~sound_stream() {
+      wait_for_decoder();
+      if (source) {
+        alSourceStop(source);
+        unqueue_all();
+        alDeleteSources(1, &source);
+        alDeleteBuffers(num_buffers, buffers);
+      }
+      if (file) fclose(file);
+    }
+
+    /// Start playing from the beginning.
+    void play() {
+      if (!source) return;
+      stop();
+
+      read_pos = wav.get_data_offset();
+      produced = 0;
+      consumed = 0;
+      finished = false;
+
+      // decode the first chunk now so that the sound starts this frame.
+      if (!decode_chunk()) {
+        finished = true;
+        return;
+      }
+      queue_chunks();
+      alSourcePlay(source);
+      playing = true;
+      job_scheduler::get().add(decoder);
+    }
+
+    /// Stop playing and discard anything already decoded.
+    void stop() {
+      if (!source) return;
+      wait_for_decoder();
+      alSourceStop(source);
+      unqueue_all();
+      playing = false;
+    }
+
+    /// Keep the queue full. Call this every frame on the main thread.
+    void update() {
+      if (!playing) return;
+
+      ALint processed = 0;
+      alGetSourcei(source, AL_BUFFERS_PROCESSED, &processed);
+      while (processed-- > 0) {
+        ALuint buffer = 0;
+        alSourceUnqueueBuffers(source, 1, &buffer);
+        free_buffers.push_back(buffer);
+      }
+
+      queue_chunks();
+
+      ALint state = 0, queued = 0;
+      alGetSourcei(source, AL_SOURCE_STATE, &state);
+      alGetSourcei(source, AL_BUFFERS_QUEUED, &queued);
+      if (state != AL_PLAYING) {
+        if (queued) {
+          // the decoder fell behind; carry on.
+          alSourcePlay(source);
+        } else if (finished && decoder->is_done() && consumed == produced) {
+          playing = false;
+        }
+      }
+
+      if (!finished && decoder->is_done() && produced - consumed < num_chunks) {
+        job_scheduler::get().add(decoder);
+      }
+    }
+
+    /// True until the last chunk has been played (never, for a looping sound).
+    bool is_playing() const {
+      return playing;
+    }
+
+    /// The OpenAL source, for setting the gain, position etc.
+    ALuint get_source() const {
+      return source;
+    }
+
+    /// Sample rate and channels of the file.
+    const loaders::wav_decoder &get_format() const {
+      return wav;
+    }
+  };
+} }
@@ -10,7 +10,7 @@ namespace octet { namespace resources {
   /// Zip files are smaller and faster than regular files.
   /// They make updates easier and work will over the internet.
   class zip_file {
-    int ref_cnt;
+    ref_counter ref_cnt;
     FILE *the_file;
 
     struct dir_entry {
@@ -44,7 +44,6 @@ namespace octet { namespace resources {
   public:
     /// Open a zip file for reading
     zip_file(const char *filename) {
-      ref_cnt = 0;
       the_file = fopen(filename, "rb");
       if (!the_file) {
         printf("file %s not found\n", filename);
@@ -95,13 +94,13 @@ namespace octet { namespace resources {
 
     /// allow ref<zip_file>
     void add_ref() {
-      ref_cnt++;
+      ref_cnt.add();
     }
 
     /// allow ref<zip_file>
     void release() {
-      if (--ref_cnt) {
-        delete this;
+      if (ref_cnt.remove()) {
+        deferred_release::destroy(this);
       }
     }
 
@@ -0,0 +1,567 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Out of core volume data in bricks, streamed from a NIFTI file.
+//
+
+namespace octet { namespace scene {
+  /// Large (4D) NIFTI volume split into bricks that are streamed into a 3D texture atlas.
+  ///
+  /// The .nii file is memory mapped, so only the pages of the bricks we use are ever read,
+  /// and stepping through the time dimension with set_frame does not reload anything.
+  /// Bricks are gathered and converted to 8 bits on worker threads and uploaded in update().
+  ///
+  /// Every brick has a min/max range per frame, found when the brick is first gathered.
+  /// Until then a brick counts as not empty. Bricks whose maximum is at or below the
+  /// empty threshold are not kept or loaded again. The index texture has one texel per brick:
+  /// rgb is the slot of the brick in the atlas and alpha is 0 for empty, 128 for not loaded
+  /// yet and 255 for resident. The range texture has the normalised min and max of each brick
+  /// (luminance, alpha), or 0 and 1 if it is not known yet, so that a ray marcher can skip
+  /// bricks outside its transfer function.
+  ///
+  /// Atlas slots have a one voxel apron so that linear filtering works across bricks.
+  ///
+  /// Example:
+  ///
+  ///     the_volume = new brick_volume("assets/fmri.nii");
+  ///     ...
+  ///     // every frame, focus in voxel coordinates
+  ///     the_volume->update(focus);
+  ///     glBindTexture(GL_TEXTURE_3D, the_volume->get_atlas_texture());
+  class brick_volume : public resource {
+    // gathers the voxels of one brick on a worker thread.
+    struct brick_job : job {
+      const brick_volume *owner;
+      uint64_t key;
+      dynarray<uint8_t> voxels;
+      float min;            // range of the brick without its apron
+      float max;
+
+      void kernel() {
+        owner->gather(*this);
+      }
+    };
+
+    // a place for a brick in the atlas.
+    struct slot {
+      uint64_t key;         // frame and brick resident in this slot, or zero
+      float distance;       // from the focus at the last update, for eviction
+      ref<brick_job> pending;
+    };
+
+    struct brick_range {
+      float min;
+      float max;
+    };
+
+    file_map *map;
+    nifti_decoder::nifti_info info;
+    const uint8_t *voxels;
+
+    unsigned brick_size;    // voxels along the edge of a brick
+    unsigned slot_size;     // brick_size plus the apron
+    unsigned bricks[3];     // number of bricks in x, y and z
+    unsigned num_bricks;
+    unsigned atlas_slots[3];
+    unsigned frame;
+    unsigned max_jobs;
+
+    float window_min;       // value that maps to 0
+    float window_max;       // value that maps to 255
+    float empty_threshold;
+
+    dynarray<brick_range> ranges;     // frames x bricks
+    dynarray<uint8_t> range_known;    // frames x bricks, set when a brick has been gathered
+    dynarray<slot> slots;
+    dynarray<int> brick_slot;         // slot for each brick of the current frame, or -1
+    dynarray<uint8_t> index_data;     // RGBA per brick
+    dynarray<uint8_t> range_data;     // luminance alpha per brick
+    dynarray<int> candidates;
+    bool index_dirty;
+    bool range_dirty;
+
+    GLuint atlas_texture;
+    GLuint index_texture;
+    GLuint range_texture;
+
+    uint64_t make_key(unsigned f, unsigned brick) const {
+      return (uint64_t)f * num_bricks + brick + 1;
+    }
+
+    unsigned key_frame(uint64_t key) const { return (unsigned)((key - 1) / num_bricks); }
+    unsigned key_brick(uint64_t key) const { return (unsigned)((key - 1) % num_bricks); }
+
+    const uint8_t *get_voxel_ptr(unsigned f, unsigned x, unsigned y, unsigned z) const {
+      return voxels + info.frame_stride * f + (((uint64_t)z * info.height + y) * info.width + x) * info.voxel_bytes;
+    }
+
+    void get_brick_origin(unsigned brick, unsigned &x, unsigned &y, unsigned &z) const {
+      x = (brick % bricks[0]) * brick_size;
+      y = (brick / bricks[0] % bricks[1]) * brick_size;
+      z = (brick / (bricks[0] * bricks[1])) * brick_size;
+    }
+
+    // distance from a point in voxels to the nearest point of a brick.
+    float brick_distance(vec3_in focus, unsigned brick) const {
+      unsigned x, y, z;
+      get_brick_origin(brick, x, y, z);
+      vec3 lo((float)x, (float)y, (float)z);
+      vec3 hi = lo + vec3((float)brick_size);
+      vec3 d = max(max(lo - focus, focus - hi), vec3(0));
+      return d.length();
+    }
+
+    // bricks we have not gathered yet may have something in them.
+    bool is_empty(unsigned brick) const {
+      unsigned i = frame * num_bricks + brick;
+      return range_known[i] && ranges[i].max <= empty_threshold;
+    }
+
+    // the display range from a coarse grid of voxels in the first frame; all of them would be the whole frame.
+    void sample_window() {
+      enum { max_samples = 64 };
+      unsigned sx = std::max(1u, info.width / max_samples);
+      unsigned sy = std::max(1u, info.height / max_samples);
+      unsigned sz = std::max(1u, info.depth / max_samples);
+      window_min = 1e37f;
+      window_max = -1e37f;
+      for (unsigned z = 0; z < info.depth; z += sz) {
+        for (unsigned y = 0; y < info.height; y += sy) {
+          for (unsigned x = 0; x < info.width; x += sx) {
+            float v = nifti_decoder::get_scalar(info, get_voxel_ptr(0, x, y, z));
+            window_min = std::min(window_min, v);
+            window_max = std::max(window_max, v);
+          }
+        }
+      }
+    }
+
+    // called on a worker thread: copy a brick and its apron, converting to 8 bits.
+    // The range of the brick comes for free.
+    void gather(brick_job &jb) const {
+      unsigned f = key_frame(jb.key);
+      unsigned x0, y0, z0;
+      get_brick_origin(key_brick(jb.key), x0, y0, z0);
+      float scale = window_max > window_min ? 255.0f / (window_max - window_min) : 0.0f;
+
+      jb.voxels.resize(slot_size * slot_size * slot_size);
+      uint8_t *dest = jb.voxels.data();
+      float lo = 1e37f, hi = -1e37f;
+      for (unsigned k = 0; k != slot_size; ++k) {
+        unsigned z = (unsigned)std::min(std::max((int)(z0 + k) - 1, 0), (int)info.depth - 1);
+        bool inside_z = k - 1 < brick_size;
+        for (unsigned j = 0; j != slot_size; ++j) {
+          unsigned y = (unsigned)std::min(std::max((int)(y0 + j) - 1, 0), (int)info.height - 1);
+          bool inside_yz = inside_z && j - 1 < brick_size;
+          for (unsigned i = 0; i != slot_size; ++i) {
+            unsigned x = (unsigned)std::min(std::max((int)(x0 + i) - 1, 0), (int)info.width - 1);
+            float value = nifti_decoder::get_scalar(info, get_voxel_ptr(f, x, y, z));
+            if (inside_yz && i - 1 < brick_size) {
+              lo = std::min(lo, value);
+              hi = std::max(hi, value);
+            }
+            float v = (value - window_min) * scale;
+            *dest++ = (uint8_t)std::min(std::max(v + 0.5f, 0.0f), 255.0f);
+          }
+        }
+      }
+      jb.min = lo;
+      jb.max = hi;
+    }
+
+    uint8_t normalise(float v) const {
+      float scale = window_max > window_min ? 255.0f / (window_max - window_min) : 0.0f;
+      return (uint8_t)std::min(std::max((v - window_min) * scale + 0.5f, 0.0f), 255.0f);
+    }
+
+    // an unknown range covers everything.
+    void set_range_data(unsigned brick) {
+      unsigned i = frame * num_bricks + brick;
+      range_data[brick * 2 + 0] = range_known[i] ? normalise(ranges[i].min) : 0;
+      range_data[brick * 2 + 1] = range_known[i] ? normalise(ranges[i].max) : 255;
+      range_dirty = true;
+    }
+
+    // rebuild the brick table and the index after a change of frame or window.
+    void rebuild_index() {
+      for (unsigned b = 0; b != num_bricks; ++b) {
+        brick_slot[b] = -1;
+        uint8_t *idx = &index_data[b * 4];
+        idx[0] = idx[1] = idx[2] = 0;
+        idx[3] = is_empty(b) ? 0 : 128;
+        set_range_data(b);
+      }
+      for (unsigned s = 0; s != slots.size(); ++s) {
+        uint64_t key = slots[s].key;
+        if (key && key_frame(key) == frame) {
+          set_resident(key_brick(key), s);
+        }
+      }
+      index_dirty = range_dirty = true;
+    }
+
+    void set_resident(unsigned brick, unsigned s) {
+      brick_slot[brick] = (int)s;
+      uint8_t *idx = &index_data[brick * 4];
+      idx[0] = (uint8_t)(s % atlas_slots[0]);
+      idx[1] = (uint8_t)(s / atlas_slots[0] % atlas_slots[1]);
+      idx[2] = (uint8_t)(s / (atlas_slots[0] * atlas_slots[1]));
+      idx[3] = 255;
+      index_dirty = true;
+    }
+
+    void evict(slot &sl) {
+      if (sl.key && key_frame(sl.key) == frame) {
+        unsigned b = key_brick(sl.key);
+        brick_slot[b] = -1;
+        index_data[b * 4 + 3] = 128;
+        index_dirty = true;
+      }
+      sl.key = 0;
+    }
+
+    bool is_pending(uint64_t key) const {
+      for (unsigned s = 0; s != slots.size(); ++s) {
+        if (slots[s].pending && slots[s].pending->key == key) return true;
+      }
+      return false;
+    }
+
+    void wait_for_jobs() {
+      for (unsigned s = 0; s != slots.size(); ++s) {
+        if (slots[s].pending) {
+          job_scheduler::get().wait(slots[s].pending);
+          slots[s].pending = 0;
+        }
+      }
+    }
+
+    static GLuint make_texture(GLenum format, GLenum filter, unsigned w, unsigned h, unsigned d) {
+      GLuint tex = 0;
+      glGenTextures(1, &tex);
+      glBindTexture(GL_TEXTURE_3D, tex);
+      glTexImage3D(GL_TEXTURE_3D, 0, format, w, h, d, 0, format, GL_UNSIGNED_BYTE, 0);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, filter);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, filter);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+      return tex;
+    }
+
+    void open(const char *url) {
+      map = new file_map(app_utils::get_path(url));
+      if (map->get_error() || map->get_size() < nifti_decoder::header_size) {
+        log("warning: could not map %s\n", url);
+        return;
+      }
+
+      const uint8_t *src = map->get_data();
+      if (!nifti_decoder::get_info(info, src, src + map->get_size())) {
+        return;
+      }
+
+      if (!nifti_decoder::is_scalar(info.datatype)) {
+        log("warning: brick_volume only supports scalar data, use image for RGB volumes\n");
+        return;
+      }
+
+      // the voxels of a .hdr/.img pair are in the .img file.
+      if (info.separate_image) {
+        string img_url = url;
+        const char *dot = strrchr(url, '.');
+        if (dot) img_url.set(url, (unsigned)(dot - url));
+        img_url += ".img";
+        delete map;
+        map = new file_map(app_utils::get_path(img_url.c_str()));
+        if (map->get_error()) {
+          log("warning: could not map %s\n", img_url.c_str());
+          return;
+        }
+      }
+
+      // use as many frames as there are in the file.
+      uint64_t avail = map->get_size() > info.vox_offset ? map->get_size() - info.vox_offset : 0;
+      if (avail / info.frame_stride < info.frames) {
+        log("warning: NIFTI file is truncated\n");
+        info.frames = (unsigned)(avail / info.frame_stride);
+      }
+      if (info.frames == 0) {
+        return;
+      }
+
+      voxels = map->get_data() + info.vox_offset;
+      bricks[0] = (info.width + brick_size - 1) / brick_size;
+      bricks[1] = (info.height + brick_size - 1) / brick_size;
+      bricks[2] = (info.depth + brick_size - 1) / brick_size;
+      num_bricks = bricks[0] * bricks[1] * bricks[2];
+    }
+
+  public:
+    /// Map a .nii file (or .hdr with its .img) and split it into bricks.
+    /// At most max_resident bricks are in the atlas at once.
+    brick_volume(const char *url, unsigned brick_size = 32, unsigned max_resident = 512) : brick_size(brick_size) {
+      map = 0;
+      voxels = 0;
+      memset(&info, 0, sizeof(info));
+      slot_size = brick_size + 2;
+      bricks[0] = bricks[1] = bricks[2] = 0;
+      num_bricks = 0;
+      frame = 0;
+      max_jobs = job_scheduler::get().get_num_threads() * 2;
+      index_dirty = range_dirty = false;
+      atlas_texture = index_texture = range_texture = 0;
+
+      open(url);
+      if (!voxels) return;
+
+      // a roughly cubic atlas with at most 255 slots along each axis.
+      unsigned n = 1;
+      while (n * n * n < max_resident && n < 255) n++;
+      atlas_slots[0] = n;
+      atlas_slots[1] = n;
+      atlas_slots[2] = std::max(1u, std::min(255u, (max_resident + n * n - 1) / (n * n)));
+      slots.resize(atlas_slots[0] * atlas_slots[1] * atlas_slots[2]);
+      for (unsigned s = 0; s != slots.size(); ++s) {
+        slots[s].key = 0;
+        slots[s].distance = 0;
+      }
+
+      ranges.resize(info.frames * num_bricks);
+      range_known.resize(info.frames * num_bricks);
+      memset(range_known.data(), 0, range_known.size());
+      brick_slot.resize(num_bricks);
+      index_data.resize(num_bricks * 4);
+      range_data.resize(num_bricks * 2);
+
+      // use the display range from the header, or a sample of the first frame.
+      window_min = info.cal_min;
+      window_max = info.cal_max;
+      if (window_max <= window_min) {
+        sample_window();
+      }
+      empty_threshold = window_min;
+      rebuild_index();
+      map->prefetch(info.vox_offset + info.frame_stride, info.frame_stride);
+    }
+
+    /// wait for bricks being gathered; they refer to the mapped file.
+    ~brick_volume() {
+      wait_for_jobs();
+      if (atlas_texture) {
+        glDeleteTextures(1, &atlas_texture);
+        glDeleteTextures(1, &index_texture);
+        glDeleteTextures(1, &range_texture);
+      }
+      delete map;
+    }
+
+    /// true if the file was mapped and has scalar data.
+    bool is_valid() const {
+      return voxels != 0;
+    }
+
+    /// Show a different time step. Bricks of other frames stay in the atlas until they are needed.
+    void set_frame(unsigned value) {
+      if (!voxels || value >= info.frames || value == frame) return;
+      frame = value;
+      rebuild_index();
+      if (frame + 1 < info.frames) {
+        map->prefetch(info.vox_offset + info.frame_stride * (frame + 1), info.frame_stride);
+      }
+    }
+
+    /// Change the range of values that maps to 0..255. This reloads all the bricks.
+    /// The brick ranges are real values, so they stay.
+    void set_window(float lo, float hi) {
+      wait_for_jobs();
+      window_min = lo;
+      window_max = hi;
+      for (unsigned s = 0; s != slots.size(); ++s) {
+        slots[s].key = 0;
+      }
+      rebuild_index();
+    }
+
+    /// Bricks with no values above this are not kept. Defaults to the bottom of the window.
+    void set_empty_threshold(float value) {
+      empty_threshold = value;
+      rebuild_index();
+    }
+
+    /// Call once per frame on the OpenGL thread with a point of interest (in voxels).
+    /// Bricks near the focus are loaded first and bricks far from it are evicted first.
+    void update(vec3_in focus) {
+      if (!voxels) return;
+
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+      if (!atlas_texture) {
+        atlas_texture = make_texture(GL_LUMINANCE, GL_LINEAR, atlas_slots[0] * slot_size, atlas_slots[1] * slot_size, atlas_slots[2] * slot_size);
+        index_texture = make_texture(GL_RGBA, GL_NEAREST, bricks[0], bricks[1], bricks[2]);
+        range_texture = make_texture(GL_LUMINANCE_ALPHA, GL_NEAREST, bricks[0], bricks[1], bricks[2]);
+      }
+
+      // record the ranges of finished bricks and upload the ones that are not empty.
+      for (unsigned s = 0; s != slots.size(); ++s) {
+        slot &sl = slots[s];
+        if (sl.pending && sl.pending->is_done()) {
+          uint64_t key = sl.pending->key;
+          unsigned b = key_brick(key);
+          ranges[key - 1].min = sl.pending->min;
+          ranges[key - 1].max = sl.pending->max;
+          range_known[key - 1] = 1;
+          if (key_frame(key) == frame) {
+            set_range_data(b);
+          }
+          if (sl.pending->max <= empty_threshold) {
+            sl.pending = 0;
+            if (key_frame(key) == frame) {
+              index_data[b * 4 + 3] = 0;
+              index_dirty = true;
+            }
+            continue;
+          }
+
+          unsigned x = s % atlas_slots[0], y = s / atlas_slots[0] % atlas_slots[1], z = s / (atlas_slots[0] * atlas_slots[1]);
+          glBindTexture(GL_TEXTURE_3D, atlas_texture);
+          glTexSubImage3D(
+            GL_TEXTURE_3D, 0, x * slot_size, y * slot_size, z * slot_size,
+            slot_size, slot_size, slot_size, GL_LUMINANCE, GL_UNSIGNED_BYTE, sl.pending->voxels.data()
+          );
+          sl.key = key;
+          sl.pending = 0;
+          if (key_frame(key) == frame) {
+            set_resident(b, s);
+          }
+        }
+      }
+
+      // score the resident bricks; bricks of other frames go first.
+      unsigned num_jobs = 0;
+      for (unsigned s = 0; s != slots.size(); ++s) {
+        slot &sl = slots[s];
+        if (sl.pending) num_jobs++;
+        sl.distance = !sl.key ? -1.0f : key_frame(sl.key) != frame ? 1e37f : brick_distance(focus, key_brick(sl.key));
+      }
+
+      // load missing bricks, nearest first, evicting further ones if we must.
+      candidates.resize(0);
+      for (unsigned b = 0; b != num_bricks; ++b) {
+        if (brick_slot[b] < 0 && !is_empty(b)) {
+          candidates.push_back(b);
+        }
+      }
+      std::sort(candidates.data(), candidates.data() + candidates.size(), [&](int a, int b) {
+        return brick_distance(focus, a) < brick_distance(focus, b);
+      });
+
+      for (unsigned i = 0; i != candidates.size() && num_jobs < max_jobs; ++i) {
+        uint64_t key = make_key(frame, candidates[i]);
+        if (is_pending(key)) continue;
+
+        float d = brick_distance(focus, candidates[i]);
+        // a free slot, or the furthest brick that is further away than this one.
+        int victim = -1;
+        float victim_distance = d;
+        for (unsigned s = 0; s != slots.size(); ++s) {
+          if (slots[s].pending) continue;
+          if (!slots[s].key) {
+            victim = s;
+            break;
+          }
+          if (slots[s].distance > victim_distance) {
+            victim = s;
+            victim_distance = slots[s].distance;
+          }
+        }
+        if (victim < 0) break;
+
+        slot &sl = slots[victim];
+        evict(sl);
+        sl.distance = -1.0f;
+        sl.pending = new brick_job();
+        sl.pending->owner = this;
+        sl.pending->key = key;
+        job_scheduler::get().add(sl.pending);
+        num_jobs++;
+      }
+
+      if (index_dirty) {
+        glBindTexture(GL_TEXTURE_3D, index_texture);
+        glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, bricks[0], bricks[1], bricks[2], GL_RGBA, GL_UNSIGNED_BYTE, index_data.data());
+        index_dirty = false;
+      }
+
+      if (range_dirty) {
+        glBindTexture(GL_TEXTURE_3D, range_texture);
+        glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, bricks[0], bricks[1], bricks[2], GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, range_data.data());
+        range_dirty = false;
+      }
+    }
+
+    /// read one voxel of the current frame, scaled to its real value.
+    float get_voxel(unsigned x, unsigned y, unsigned z) const {
+      if (!voxels || x >= info.width || y >= info.height || z >= info.depth) return 0;
+      return nifti_decoder::get_scalar(info, get_voxel_ptr(frame, x, y, z));
+    }
+
+    /// min and max of a brick in the current frame. False if the brick has not been gathered yet.
+    bool get_brick_range(unsigned bx, unsigned by, unsigned bz, float &lo, float &hi) const {
+      unsigned i = frame * num_bricks + (bz * bricks[1] + by) * bricks[0] + bx;
+      lo = ranges[i].min;
+      hi = ranges[i].max;
+      return range_known[i] != 0;
+    }
+
+    /// number of bricks in the current frame that have not been loaded yet.
+    unsigned get_num_missing_bricks() const {
+      unsigned result = 0;
+      for (unsigned b = 0; b != num_bricks; ++b) {
+        if (brick_slot[b] < 0 && !is_empty(b)) result++;
+      }
+      return result;
+    }
+
+    /// number of bricks that are skipped because they are empty.
+    unsigned get_num_empty_bricks() const {
+      unsigned result = 0;
+      for (unsigned b = 0; b != num_bricks; ++b) {
+        if (is_empty(b)) result++;
+      }
+      return result;
+    }
+
+    unsigned get_width() const { return info.width; }
+    unsigned get_height() const { return info.height; }
+    unsigned get_depth() const { return info.depth; }
+    unsigned get_frames() const { return info.frames; }
+    unsigned get_frame() const { return frame; }
+
+    /// voxel spacing (from pixdim)
+    vec3 get_spacing() const {
+      return vec3(info.spacing[0], info.spacing[1], info.spacing[2]);
+    }
+
+    /// voxels along the edge of a brick, and of a slot in the atlas (with the apron).
+    unsigned get_brick_size() const { return brick_size; }
+    unsigned get_slot_size() const { return slot_size; }
+
+    /// number of bricks along one axis
+    unsigned get_num_bricks(unsigned axis) const { return bricks[axis]; }
+
+    /// number of atlas slots along one axis
+    unsigned get_atlas_slots(unsigned axis) const { return atlas_slots[axis]; }
+
+    /// 8 bit 3D texture of resident bricks
+    GLuint get_atlas_texture() const { return atlas_texture; }
+
+    /// RGBA 3D texture, one texel per brick: atlas slot and residency
+    GLuint get_index_texture() const { return index_texture; }
+
+    /// luminance alpha 3D texture, one texel per brick: normalised min and max
+    GLuint get_range_texture() const { return range_texture; }
+  };
+}}
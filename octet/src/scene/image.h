@@ -31,6 +31,14 @@ namespace octet { namespace scene {
     uint8_t mip_levels;
     uint8_t cube_faces;
 
+    // true if the first row is the top of the image (eg. DDS files)
+    bool top_down;
+
+    // DDS files on disk are mapped and uploaded straight from the mapping.
+    file_map *mapped;
+    size_t mapped_offset;
+    size_t mapped_size;
+
     // derived attributes (not for saving)
     // todo: use gl_resource
     GLuint gl_texture;
@@ -47,6 +55,10 @@ namespace octet { namespace scene {
       mip_levels = 1;
       cube_faces = is_cubemap ? 6 : 1;
       format = 0;
+      frames = 1;
+      top_down = false;
+      mapped = 0;
+      mapped_offset = mapped_size = 0;
     }
 
     // these are here to avoid including glext.h which may be platform dependent.
@@ -62,155 +74,189 @@ namespace octet { namespace scene {
       COMPRESSED_RGBA_S3TC_DXT1_EXT = 0x83F1,
       COMPRESSED_RGBA_S3TC_DXT3_EXT = 0x83F2,
       COMPRESSED_RGBA_S3TC_DXT5_EXT = 0x83F3,
+      COMPRESSED_SRGB_S3TC_DXT1_EXT = 0x8C4C,
+      COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT = 0x8C4D,
+      COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT = 0x8C4E,
+      COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT = 0x8C4F,
+      COMPRESSED_RED_RGTC1 = 0x8DBB,
+      COMPRESSED_SIGNED_RED_RGTC1 = 0x8DBC,
+      COMPRESSED_RG_RGTC2 = 0x8DBD,
+      COMPRESSED_SIGNED_RG_RGTC2 = 0x8DBE,
+      COMPRESSED_RGBA_BPTC_UNORM = 0x8E8C,
+      COMPRESSED_SRGB_ALPHA_BPTC_UNORM = 0x8E8D,
+      COMPRESSED_RGB_BPTC_SIGNED_FLOAT = 0x8E8E,
+      COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT = 0x8E8F,
+
+      // disk cache file header
+      cache_magic = 0x43544f4f, // OOTC
+      cache_version = 2,        // 2: luminance images have mips
     };
 
-    /// Make mipmaps for this image.
-    void make_mipmaps() {
-      if (format != RGB && format != RGBA) return;
+  public:
+    /// Texture pipeline settings shared by all images.
+    struct pipeline_settings {
+      /// block compress textures after loading (BC1 for RGB, BC3 for RGBA)
+      bool compress;
 
-      bytes.resize(bytes.size() * 4 / 3);
+      /// filter mips in linear space
+      bool srgb_mips;
 
-      unsigned num_comps = format == RGB ? 3 : 4;
-      uint8_t *src = &bytes[0];
-      uint8_t *dest = &bytes[width * height * num_comps];
-      unsigned w = width;
-      unsigned h = height;
-      unsigned stride = w * num_comps;
-      mip_levels = 0;
-      while (w > 1 && h > 1) {
-        for (unsigned y = 0; y < h/2; ++y) {
-          for (unsigned x = 0; x < w/2; ++x) {
-            // this is a rather dreadful box filter, it is simple to make, but introduces
-            // artifacts. We can do better than this.
-            for (unsigned i = 0; i != num_comps; ++i) {
-              *dest++ = ( src[0] + src[num_comps] + src[stride] + src[stride+num_comps] + 3 ) >> 2;
-              src++;
-            }
-            src += num_comps;
-          }
-          src += stride;
-        }
-        w >>= 1;
-        h >>= 1;
-        stride >>= 1;
-        mip_levels++;
+      /// filter used for mips
+      mip_builder::filter_t mip_filter;
+
+      /// if not empty, an existing directory to keep processed textures in, keyed by a hash of the source.
+      string cache_dir;
+
+      /// DDS files are uploaded straight from the mapped file with row zero at the top,
+      /// so meshes use v = 1 - v for them (see is_top_down() and mesh::flip_v()).
+      /// Set this to turn them the right way up for OpenGL instead, at the cost of a copy.
+      bool flip_dds;
+    };
+
+    /// Change these before loading images.
+    static pipeline_settings &get_pipeline_settings() {
+      static pipeline_settings settings = { false, true, mip_builder::filter_kaiser, string(), false };
+      return settings;
+    }
+
+  private:
+
+    /// Make a full chain of mipmaps for this image, filtering in linear space.
+    void make_mipmaps() {
+      if (format != RGB && format != RGBA && format != LUMINANCE && format != LUMINANCE_ALPHA) return;
+      if (gl_target != GL_TEXTURE_2D || cube_faces != 1) return;
+
+      const pipeline_settings &settings = get_pipeline_settings();
+      mip_builder mb(settings.mip_filter, settings.srgb_mips);
+      unsigned num_comps = get_num_comps();
+      unsigned w = width, h = height;
+      mip_levels = (uint8_t)mip_builder::num_levels(w, h);
+      bytes.resize(mip_builder::chain_size(w, h, num_comps));
+
+      job_scheduler &sch = job_scheduler::get();
+      dynarray<float> tmp;
+      size_t offset = 0;
+      for (unsigned level = 1; level != mip_levels; ++level) {
+        unsigned dw = w > 1 ? w >> 1 : 1, dh = h > 1 ? h >> 1 : 1;
+        const uint8_t *src = &bytes[offset];
+        uint8_t *dest = &bytes[offset + w * h * num_comps];
+        float *t = (tmp.resize(h * dw * num_comps), tmp.data());
+
+        mb.begin_level(w, h, dw, dh);
+        sch.parallel_for(0, h, 16, [&](int y0, int y1) {
+          mb.filter_rows(t, dw, src, w, num_comps, y0, y1);
+        });
+        sch.parallel_for(0, dh, 16, [&](int y0, int y1) {
+          mb.resolve_rows(dest, dw, t, h, num_comps, y0, y1);
+        });
+
+        offset += w * h * num_comps;
+        w = dw;
+        h = dh;
       }
-      assert(dest - &bytes[0] < (int)bytes.size());
-      //printf("%d %d\n", dest - &bytes[0], bytes.size());
     }
 
-    /// DXT encode the image, making it smaller and grainier.
-    /// Todo: do standard error-diffusion and other improvements.
-    void dxt_encode() {
+    /// Block compress the image and its mips (BC1, BC3, BC4 or BC5).
+    /// new_format 0 picks BC1 for RGB and BC3 for RGBA.
+    void compress(unsigned new_format=0) {
       if (format != RGB && format != RGBA) return;
+      if (gl_target != GL_TEXTURE_2D || cube_faces != 1) return;
 
       unsigned num_comps = format == RGB ? 3 : 4;
-      dynarray<uint8_t> result;
-      result.resize(bytes.size() / num_comps);
-      uint8_t *src = &bytes[0];
+      if (new_format == 0) {
+        new_format = format == RGB ? COMPRESSED_RGB_S3TC_DXT1_EXT : COMPRESSED_RGBA_S3TC_DXT5_EXT;
+      }
+      if (!bc_encoder::is_supported(new_format)) return;
+
+      // size of the compressed chain
+      size_t size = 0;
+      unsigned w = width, h = height;
+      for (unsigned level = 0; level != mip_levels; ++level) {
+        size += bc_encoder::level_size(new_format, w, h);
+        w = w > 1 ? w >> 1 : 1;
+        h = h > 1 ? h >> 1 : 1;
+      }
+
+      dynarray<uint8_t> result(size);
+      bc_encoder enc;
+      job_scheduler &sch = job_scheduler::get();
+      const uint8_t *src = &bytes[0];
       uint8_t *dest = &result[0];
-      unsigned w = width;
-      unsigned h = height;
-      unsigned stride = w * num_comps;
-      unsigned new_mip_levels = 0;
-      while (w > 4 && h > 4 && new_mip_levels < mip_levels) {
-        for (unsigned y = 0; y < h/4; ++y) {
-          log("w=%d y=%d src=%08x\n", w, y, src - &bytes[0]);
-          for (unsigned x = 0; x < w/4; ++x) {
-            // ye olde covariance method http://en.wikipedia.org/wiki/Linear_discriminant_analysis
-            vec4 tot(0, 0, 0, 0);
-            vec4 colours[16];
-            for (unsigned j = 0; j != 4; ++j) {
-              for (unsigned i = 0; i != 4; ++i) {
-                //vec4 colour(src[0] * (1.0f/255), src[1] * (1.0f/255), src[2] * (1.0f/255), (num_comps == 4 ? src[3] * (1.0f/255) : 1.0f));
-                vec4 colour(src[0] * (1.0f/255), src[1] * (1.0f/255), src[2] * (1.0f/255), 1.0f);
-                colours[i+j*4] = colour;
-                tot += colour;
-                src += num_comps;
-              }
-              src += ( w - 4 ) * num_comps;
-            }
-            src -= ( w - 1 ) * 4 * num_comps;
-
-            // calculate the covariance matrix
-            vec4 mean = tot * 0.0625f;
-            mat4t covariance(0);
-            for (unsigned i = 0; i != 16; ++i) {
-              vec4 colour = colours[i] -= mean;
-              covariance += outer(colour, colour);
-            }
-
-            // power method to find largest eigenvector (axis)
-            vec4 axis = covariance.trace();
-            for (unsigned i = 0; i != 4; ++i) {
-              axis = axis * covariance;
-            }
-            float len = axis.length();
-            if (abs(len) >= 0.001f) axis = axis / len;
-            //if (y == 27) log("%s %s %s\n", mean.toString(), axis.toString(), covariance.toString(tmp, sizeof(tmp)));
-
-            // our colours all have to live on the axis.
-            // in practice, we can ignore "odd man out" colours
-            // for better compression. But for now, do all the colours.
-            float pmin = dot(colours[0], axis);
-            float pmax = pmin;
-            float projs[16];
-            projs[0] = pmin;
-            for (unsigned i = 1; i != 16; ++i) {
-              float proj = dot(colours[i], axis);
-              projs[i] = proj;
-              pmin = pmin < proj ? pmin : proj;
-              pmax = pmax > proj ? pmax : proj;
-            }
-            vec4 cmin = mean + axis * pmin;
-            vec4 cmax = mean + axis * pmax;
-            //if (y == 27) log("%s -> %s\n", cmin.toString(), cmax.toString(tmp, sizeof(tmp)));
-            cmin = min(max(cmin, vec4(0, 0, 0, 0)), vec4(1, 1, 1, 1));
-            cmax = min(max(cmax, vec4(0, 0, 0, 0)), vec4(1, 1, 1, 1));
-
-            unsigned c0 =
-              ( (unsigned)(cmin.x() * 31.999f) << 11 ) |
-              ( (unsigned)(cmin.y() * 63.999f) << 5 ) |
-              ( (unsigned)(cmin.z() * 31.999f) << 0 )
-            ;
-            unsigned c1 =
-              ( (unsigned)(cmax.x() * 31.999f) << 11 ) |
-              ( (unsigned)(cmax.y() * 63.999f) << 5 ) |
-              ( (unsigned)(cmax.z() * 31.999f) << 0 )
-            ;
-
-            if (c0 < c1) {
-              unsigned t = c0; c0 = c1; c1 = t;
-              float p = pmin; pmin = pmax; pmax = p;
-            }
-
-            float pscale = abs(pmax - pmin) > 0.001f ? 3.999f / (pmax - pmin) : 0;
-            uint8_t pal[16];
-            for (unsigned i = 0; i != 16; ++i) {
-              pal[i] = (unsigned)( ( projs[i] - pmin ) * pscale );
-            }
-
-            dest[0] = ( c0 >> 0 ) & 0xff;
-            dest[1] = ( c0 >> 8 ) & 0xff;
-            dest[2] = ( c1 >> 0 ) & 0xff;
-            dest[3] = ( c1 >> 8 ) & 0xff;
-            for (int i = 0; i != 4; ++i) {
-              dest[i+4] = pal[i*4+0] + pal[i*4+1] * 4 + pal[i*4+2] * 16 + pal[i*4+3] * 64;
-            }
-            dest += 8;
-          }
-          src += stride * 3;
-        }
-        w >>= 1;
-        h >>= 1;
-        stride >>= 1;
-        new_mip_levels++;
+      w = width;
+      h = height;
+      for (unsigned level = 0; level != mip_levels; ++level) {
+        sch.parallel_for(0, bc_encoder::num_block_rows(h), 1, [&](int by0, int by1) {
+          enc.encode_block_rows(dest, new_format, src, w, h, num_comps, by0, by1);
+        });
+        src += w * h * num_comps;
+        dest += bc_encoder::level_size(new_format, w, h);
+        w = w > 1 ? w >> 1 : 1;
+        h = h > 1 ? h >> 1 : 1;
       }
-      assert(dest - &result[0] < (int)result.size());
-      bytes.resize((int)(dest - &result[0]));
-      memcpy(&bytes[0], &result[0], dest - &result[0]);
-      format = COMPRESSED_RGB_S3TC_DXT1_EXT;
-      mip_levels = new_mip_levels;
+
+      bytes.resize(size);
+      memcpy(&bytes[0], &result[0], size);
+      format = new_format;
+    }
+
+    /// DXT1 encode the image, making it smaller and grainier.
+    void dxt_encode() {
+      compress(COMPRESSED_RGB_S3TC_DXT1_EXT);
+    }
+
+    // 64 bit FNV-1a hash of the source file and the settings that change the result.
+    static uint64_t get_cache_key(const dynarray<uint8_t> &buffer, const pipeline_settings &settings) {
+      uint64_t hash = 0xcbf29ce484222325ull;
+      for (unsigned i = 0; i != buffer.size(); ++i) {
+        hash = (hash ^ buffer[i]) * 0x100000001b3ull;
+      }
+      uint8_t options[4] = { cache_version, settings.compress, settings.srgb_mips, (uint8_t)settings.mip_filter };
+      for (unsigned i = 0; i != sizeof(options); ++i) {
+        hash = (hash ^ options[i]) * 0x100000001b3ull;
+      }
+      return hash;
+    }
+
+    void get_cache_path(string &path, uint64_t key) {
+      path.format("%s/%08x%08x.tex", get_pipeline_settings().cache_dir.c_str(), (unsigned)(key >> 32), (unsigned)key);
+    }
+
+    // try to load a processed image from the disk cache.
+    bool read_cache(uint64_t key) {
+      string path;
+      get_cache_path(path, key);
+      FILE *file = fopen(app_utils::get_path(path.c_str()), "rb");
+      if (!file) return false;
+
+      uint32_t header[7] = { 0 };
+      bool ok = fread(header, sizeof(header), 1, file) == 1 && header[0] == cache_magic && header[1] == cache_version;
+      if (ok) {
+        format = (uint16_t)header[2];
+        width = (uint16_t)header[3];
+        height = (uint16_t)header[4];
+        mip_levels = (uint8_t)header[5];
+        bytes.resize(header[6]);
+        ok = bytes.size() != 0 && fread(&bytes[0], bytes.size(), 1, file) == 1;
+      }
+      fclose(file);
+      return ok;
+    }
+
+    // save a processed image to the disk cache.
+    void write_cache(uint64_t key) {
+      string path;
+      get_cache_path(path, key);
+      FILE *file = fopen(app_utils::get_path(path.c_str()), "wb");
+      if (!file) return;
+
+      uint32_t header[7] = { cache_magic, cache_version, format, width, height, mip_levels, bytes.size() };
+      fwrite(header, sizeof(header), 1, file);
+      fwrite(&bytes[0], bytes.size(), 1, file);
+      fclose(file);
+    }
+
+    unsigned get_num_comps() const {
+      return format == RGBA ? 4 : format == LUMINANCE_ALPHA ? 2 : format == LUMINANCE || format == ALPHA ? 1 : 3;
     }
 
     void add_texture() {
@@ -222,10 +268,11 @@ namespace octet { namespace scene {
           // this may not work on very old systems, comment it out.
           glGenerateMipmap(gl_target);
         } else if (gl_target == GL_TEXTURE_3D) {
-          glTexImage3D(gl_target, 0, format, width, height, 1, 0, format, GL_UNSIGNED_BYTE, (void*)&bytes[0]);
-          printf("err=%08x\n", glGetError());
+          glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+          // the first frame of a volume, which may be a time series.
+          glTexImage3D(gl_target, 0, format, width, height, depth, 0, format, GL_UNSIGNED_BYTE, (void*)&bytes[0]);
         } else if (gl_target == GL_TEXTURE_CUBE_MAP) {
-          unsigned num_comps = format == RGBA ? 4 : 3;
+          unsigned num_comps = get_num_comps();
           for (int i = 0; i != 6; ++i) {
             size_t offset = width * height * num_comps * i;
             glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, (void*)&bytes[offset]);
@@ -235,16 +282,16 @@ namespace octet { namespace scene {
           glGenerateMipmap(gl_target);
         }
       } else if (gl_target == GL_TEXTURE_2D) {
-        unsigned num_comps = format == RGBA ? 4 : 3;
+        unsigned num_comps = get_num_comps();
         unsigned w = width;
         unsigned h = height;
         uint8_t *src = &bytes[0];
-        unsigned level = 0;
-        while (w != 0 && h != 0) {
-          glTexImage2D(gl_target, level++, format, w, h, 0, format, GL_UNSIGNED_BYTE, (void*)src);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (unsigned level = 0; level != mip_levels; ++level) {
+          glTexImage2D(gl_target, level, format, w, h, 0, format, GL_UNSIGNED_BYTE, (void*)src);
           src += w * h * num_comps;
-          w >>= 1;
-          h >>= 1;
+          w = w > 1 ? w >> 1 : 1;
+          h = h > 1 ? h >> 1 : 1;
         }
       }
     }
@@ -269,10 +316,27 @@ namespace octet { namespace scene {
       width = _width;
       height = _height;
       depth = _depth; // for 3D textures
+      top_down = false;
+      mapped = 0;
+      mapped_offset = mapped_size = 0;
     }
 
     /// release resources.
     ~image() {
+      delete mapped;
+    }
+
+    /// true if the bytes are in a block compressed format.
+    bool is_compressed() const {
+      return
+        format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT ||
+        format == COMPRESSED_RGBA_S3TC_DXT3_EXT || format == COMPRESSED_RGBA_S3TC_DXT5_EXT ||
+        format == COMPRESSED_SRGB_S3TC_DXT1_EXT || format == COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT ||
+        format == COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT || format == COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT ||
+        format == COMPRESSED_RED_RGTC1 || format == COMPRESSED_SIGNED_RED_RGTC1 ||
+        format == COMPRESSED_RG_RGTC2 || format == COMPRESSED_SIGNED_RG_RGTC2 ||
+        (format >= COMPRESSED_RGBA_BPTC_UNORM && format <= COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT)
+      ;
     }
 
     /// width in pixels
@@ -295,6 +359,19 @@ namespace octet { namespace scene {
       return gl_target;
     }
 
+    /// true if row zero is the top of the image, so meshes should use v = 1 - v.
+    /// This is true for DDS files unless pipeline_settings::flip_dds is set;
+    /// BC6H and BC7 files are always top down.
+    bool is_top_down() const {
+      return top_down;
+    }
+
+    /// The block data of a compressed image, from the mapped file or from memory.
+    const uint8_t *get_blocks(size_t &size) const {
+      size = mapped ? mapped_size : bytes.size();
+      return mapped ? mapped->get_data() + mapped_offset : bytes.data();
+    }
+
     /// animated textures have multiple frames. eg. MPEG file. return ~0 for infinite.
     unsigned get_frames() const {
       return frames;
@@ -330,13 +407,90 @@ namespace octet { namespace scene {
         load_part(x.c_str());
       } else {
         bytes.resize(0);
-        load_part(url.c_str());
+        if (map_dds()) {
+          return;
+        }
+
+        dynarray<uint8_t> buffer;
+        app_utils::get_url(buffer, url.c_str());
+
+        const pipeline_settings &settings = get_pipeline_settings();
+        // DDS files are already in their final form.
+        bool is_dds = buffer.size() >= 4 && !memcmp(&buffer[0], "DDS ", 4);
+        bool use_cache = settings.cache_dir.c_str()[0] != 0 && buffer.size() != 0 && !is_dds;
+        uint64_t key = use_cache ? get_cache_key(buffer, settings) : 0;
+        if (use_cache && read_cache(key)) {
+          return;
+        }
+
+        decode(buffer);
+        make_mipmaps();
+        if (settings.compress) {
+          compress();
+        }
+
+        if (use_cache && bytes.size()) {
+          write_cache(key);
+        }
+      }
+    }
+
+    /// Map a .dds file from disk rather than reading it. Returns false for other files.
+    /// The blocks are either copied once, flipped, or uploaded from the mapping later.
+    bool map_dds() {
+      const char *name = url.c_str();
+      size_t len = strlen(name);
+      const char *ext = name + (len < 4 ? 0 : len - 4);
+      bool is_dds = len >= 4 && ext[0] == '.' && (ext[1] | 0x20) == 'd' && (ext[2] | 0x20) == 'd' && (ext[3] | 0x20) == 's';
+      if (!is_dds || !strncmp(name, "zip://", 6) || !strncmp(name, "http://", 7)) {
+        return false;
+      }
+
+      file_map *map = new file_map(app_utils::get_path(name));
+      const uint8_t *src = map->get_data();
+      dds_decoder dec;
+      dds_decoder::dds_info info;
+      if (!src || !dec.get_info(info, src, src + map->get_size())) {
+        delete map;
+        return false;
+      }
+
+      set_dds(info, src);
+      if (top_down) {
+        // upload from the mapping in get_gl_texture()
+        delete mapped;
+        mapped = map;
+        mapped_offset = info.data_offset;
+        mapped_size = info.data_size;
+      } else {
+        delete map;
+      }
+      return true;
+    }
+
+    /// Set the format from a DDS header. Unless the blocks are to be uploaded as they are,
+    /// copy them to bytes, upside down.
+    void set_dds(const dds_decoder::dds_info &info, const uint8_t *src) {
+      format = (uint16_t)info.format;
+      width = (uint16_t)info.width;
+      height = (uint16_t)info.height;
+      mip_levels = (uint8_t)info.mip_levels;
+      top_down = !get_pipeline_settings().flip_dds || !dds_decoder::can_flip(info.format, info.height);
+      if (!top_down) {
+        bytes.resize(info.data_size);
+        dds_decoder::flip_chain(bytes.data(), src + info.data_offset, info.format, info.width, info.height, info.mip_levels);
       }
     }
 
     void load_part(const char *_url) {
       dynarray<uint8_t> buffer;
       app_utils::get_url(buffer, _url);
+      decode(buffer);
+    }
+
+    /// decode a file in memory; sets the format, dimensions and bytes.
+    void decode(const dynarray<uint8_t> &buffer) {
+      if (buffer.size() == 0) return;
       const unsigned char *src = &buffer[0];
       const unsigned char *src_max = src + buffer.size();
       if (buffer.size() >= 6 && !memcmp(&buffer[0], "GIF89a", 6)) {
@@ -350,7 +504,15 @@ namespace octet { namespace scene {
         dec.get_image(bytes, format, width, height, src, src_max);
       } else if (buffer.size() >= 4 && buffer[0] == 'D' && buffer[1] == 'D' && buffer[2] == 'S' && buffer[3] == ' ') {
         dds_decoder dec;
-        dec.get_image(bytes, format, width, height, src, src_max);
+        dds_decoder::dds_info info;
+        if (dec.get_info(info, src, src_max)) {
+          set_dds(info, src);
+          if (top_down) {
+            // files from zips and urls can't be mapped, so keep a copy.
+            bytes.resize(info.data_size);
+            memcpy(bytes.data(), src + info.data_offset, info.data_size);
+          }
+        }
       } else if (buffer.size() >= 348 && (!memcmp(&buffer[344], "ni1", 4) || !memcmp(&buffer[344], "n+1", 4))) {
         nifti_decoder dec;
         gl_target = GL_TEXTURE_3D;
@@ -359,15 +521,12 @@ namespace octet { namespace scene {
         printf("warning: unknown texture format\n");
         return;
       }
-
-      make_mipmaps();
-      //dxt_encode();
     }
 
     /// get the OpenGL texture handle for this image.
     GLuint get_gl_texture() {
       if (!gl_texture) {
-        if (bytes.size() == 0 || width == 0 || height == 0) {
+        if ((bytes.size() == 0 && !mapped) || width == 0 || height == 0) {
           load();
         }
 
@@ -376,29 +535,34 @@ namespace octet { namespace scene {
         glActiveTexture(GL_TEXTURE0);
 
         // todo: handle compressed textures
-        if (format == GL_RGB || format == GL_RGBA) {
+        // NIfTI volumes are 8 bit luminance.
+        if (format == GL_RGB || format == GL_RGBA || format == GL_LUMINANCE) {
           add_texture();
-        } else if (format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT3_EXT || format == COMPRESSED_RGBA_S3TC_DXT5_EXT) {
+        } else if (is_compressed()) {
           glBindTexture(gl_target, gl_texture);
           unsigned w = width;
           unsigned h = height;
-          uint8_t *src = &bytes[0];
+          size_t blocks_size = 0;
+          const uint8_t *src = get_blocks(blocks_size);
+          const uint8_t *src_max = src + blocks_size;
           unsigned level = 0;
-          unsigned shift = ( format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT ) ? 1 : 0;
-          while (w != 0 && h != 0) {
-            unsigned wmin = w < 4 ? 4 : w;
-            unsigned hmin = h < 4 ? 4 : h;
-            unsigned size = ( wmin * hmin ) >> shift;
-            glCompressedTexImage2D(gl_target, level++, format, w, h, 0, size, (void*)src);
-            //printf("%d\n", glGetError());
+          while (level != mip_levels) {
+            size_t size = dds_decoder::level_size(format, w, h);
+            if (src + size > src_max) break;
+            glCompressedTexImage2D(gl_target, level++, format, w, h, 0, (GLsizei)size, (void*)src);
             src += size;
-            w >>= 1;
-            h >>= 1;
+            if (w == 1 && h == 1) break;
+            w = w > 1 ? w >> 1 : 1;
+            h = h > 1 ? h >> 1 : 1;
           }
-          //printf("%d %d\n", src - image_, size);
+          #ifndef OCTET_GLES2
+            // files without a full mip chain are still complete textures.
+            glTexParameteri(gl_target, GL_TEXTURE_MAX_LEVEL, level ? level - 1 : 0);
+          #endif
         }
 
-        glTexParameteri(gl_target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        // 3D textures have no mip chain.
+        glTexParameteri(gl_target, GL_TEXTURE_MIN_FILTER, gl_target == GL_TEXTURE_3D ? GL_LINEAR : GL_LINEAR_MIPMAP_LINEAR);
         glTexParameteri(gl_target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
       }
       return gl_texture;
@@ -417,5 +581,106 @@ namespace octet { namespace scene {
       glTexSubImage2D(gl_target, 0, 0, 0, width, height, format, type, pixels);
     }
   };
+
+  #if OCTET_BENCHMARK
+    /// Load time and peak heap for a 4096x4096 DXT5 file with all its mips.
+    /// The old path reads the whole file and then makes a flipped copy of the blocks.
+    /// The mapped paths make a flipped copy from the mapping, or keep the mapping for the upload.
+    /// Reading every cache line of the blocks stands in for glCompressedTexImage2D.
+    class image_dds_benchmark {
+      static unsigned touch(const uint8_t *src, size_t size) {
+        unsigned sum = 0;
+        for (size_t i = 0; i < size; i += 64) {
+          sum += src[i];
+        }
+        return sum;
+      }
+
+      static void put4(uint8_t *dest, unsigned value) {
+        dest[0] = (uint8_t)value;
+        dest[1] = (uint8_t)(value >> 8);
+        dest[2] = (uint8_t)(value >> 16);
+        dest[3] = (uint8_t)(value >> 24);
+      }
+
+      static void report_peak(size_t base) {
+        printf("%-40s %10.1fMB peak heap\n", "", (allocator::get_peak_bytes() - base) / (1024.0 * 1024.0));
+      }
+    public:
+      image_dds_benchmark() {
+        enum { dim = 4096, levels = 13, dxt5 = 0x83F3 };
+
+        // a DDS header followed by pseudo random blocks
+        size_t data_size = 0;
+        for (unsigned i = 0; i != levels; ++i) {
+          data_size += dds_decoder::level_size(dxt5, dim >> i, dim >> i);
+        }
+        dynarray<uint8_t> file(128 + data_size);
+        memset(file.data(), 0, 128);
+        put4(&file[0], 0x20534444);
+        put4(&file[4], 124);
+        put4(&file[8], 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000);
+        put4(&file[12], dim);
+        put4(&file[16], dim);
+        put4(&file[28], levels);
+        put4(&file[76], 32);
+        put4(&file[80], 0x4);
+        memcpy(&file[84], "DXT5", 4);
+        put4(&file[108], 0x1000 | 0x8 | 0x400000);
+        unsigned seed = 0x9e3779b9;
+        for (size_t i = 128; i != file.size(); ++i) {
+          seed = seed * 1664525 + 1013904223;
+          file[i] = (uint8_t)(seed >> 24);
+        }
+
+        const char *url = "octet_dds_benchmark.dds";
+        string path = app_utils::get_path(url);
+        FILE *fp = fopen(path.c_str(), "wb");
+        if (!fp) return;
+        fwrite(file.data(), 1, file.size(), fp);
+        fclose(fp);
+        file.reset();
+
+        printf("image_dds_benchmark: %dx%d DXT5, %d levels, %.1fMB of blocks\n", dim, dim, levels, data_size / (1024.0 * 1024.0));
+        unsigned sum = 0;
+        {
+          size_t base = allocator::get_num_bytes();
+          allocator::reset_peak_bytes();
+          benchmark_timer timer;
+          dynarray<uint8_t> buffer;
+          app_utils::get_url(buffer, url);
+          dynarray<uint8_t> bytes;
+          uint16_t format = 0, width = 0, height = 0;
+          dds_decoder dec;
+          dec.get_image(bytes, format, width, height, buffer.data(), buffer.data() + buffer.size());
+          buffer.reset();
+          sum += touch(bytes.data(), bytes.size());
+          timer.report("read file, flipped copy (old path)");
+          report_peak(base);
+        }
+
+        image::pipeline_settings &settings = image::get_pipeline_settings();
+        bool flip_dds = settings.flip_dds;
+        for (int flip = 1; flip >= 0; --flip) {
+          settings.flip_dds = flip != 0;
+          size_t base = allocator::get_num_bytes();
+          allocator::reset_peak_bytes();
+          benchmark_timer timer;
+          ref<image> img = new image(url);
+          img->load();
+          size_t size = 0;
+          const uint8_t *blocks = img->get_blocks(size);
+          sum += touch(blocks, size);
+          timer.report(flip ? "mapped, flipped copy" : "mapped, no copy (flip_dds = false)");
+          report_peak(base);
+        }
+        settings.flip_dds = flip_dds;
+
+        remove(path.c_str());
+        if (sum == 1) printf("\n"); // keep the reads
+      }
+    };
+    static image_dds_benchmark image_dds_benchmark;
+  #endif
 }}
 
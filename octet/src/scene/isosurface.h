@@ -0,0 +1,459 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Isosurface extraction from implicit fields
+//
+
+namespace octet { namespace scene {
+  /// Surface of an implicit field (metaballs, signed distance fields) as triangles.
+  ///
+  /// The field is sampled on a grid of cells inside an aabb. Negative values are inside.
+  /// Each cell that the surface passes through gets one vertex at the average of its edge
+  /// crossings and every crossed grid edge makes a quad from the four cells around it
+  /// (surface nets, a simple form of dual contouring). So a vertex is shared by all the
+  /// quads around it and there are no cracks.
+  ///
+  /// The grid is split into blocks of 16x16x16 cells which are polygonized in parallel.
+  /// Blocks keep their triangles, so after an edit only the blocks from mark_dirty()
+  /// are done again. Blocks with no sign change are skipped after sampling.
+  ///
+  /// Fields are sampled a row at a time so that field_source::get_row can use SIMD.
+  ///
+  /// Example:
+  ///
+  ///     isosurface::metaball_field balls;
+  ///     balls.add_ball(vec3(0, 0, 0), -0.3f);
+  ///     isosurface surface(aabb(vec3(0), vec3(5)), ivec3(128, 128, 128), balls);
+  ///     mesh::set_shape<isosurface, mesh::vertex>(surface, mat4t(), 1);
+  class isosurface {
+  public:
+    /// Override this to make a field.
+    struct field_source {
+      /// Set dest[i] to the value at (xs[i], y, z) for n points. Negative is inside.
+      /// Called on many threads at once.
+      virtual void get_row(float *dest, const float *xs, float y, float z, int n) = 0;
+    };
+
+    /// Sum of gaussian blobs, like shaders/raycast_meta.fs: inside where the sum is above threshold.
+    class metaball_field : public field_source {
+      dynarray<vec4> balls;
+      float threshold;
+
+      #if OCTET_SSE
+        // e^x for x <= 0: 2^n times a polynomial for 2^f.
+        static __m128 exp_sse(__m128 x) {
+          __m128 t = _mm_mul_ps(_mm_max_ps(x, _mm_set1_ps(-87.0f)), _mm_set1_ps(1.44269504f));
+          __m128 n = _mm_cvtepi32_ps(_mm_cvttps_epi32(t));
+          n = _mm_sub_ps(n, _mm_and_ps(_mm_cmpgt_ps(n, t), _mm_set1_ps(1.0f)));
+          __m128 f = _mm_sub_ps(t, n);
+          __m128 p = _mm_set1_ps(1.5252734e-5f);
+          p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.5403530e-4f));
+          p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.3333558e-3f));
+          p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.6181291e-3f));
+          p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.5504109e-2f));
+          p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.4022651e-1f));
+          p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.9314718e-1f));
+          p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+          __m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(n), _mm_set1_epi32(127)), 23);
+          return _mm_mul_ps(p, _mm_castsi128_ps(e));
+        }
+      #endif
+
+    public:
+      metaball_field(float threshold = 0.5f) : threshold(threshold) {
+      }
+
+      /// Add a ball. falloff is negative; the blob is exp(falloff * distance^2).
+      void add_ball(vec3_in center, float falloff) {
+        balls.push_back(vec4(center, falloff));
+      }
+
+      /// Move a ball. Mark the old and new places dirty in the isosurface.
+      void set_ball(unsigned i, vec3_in center, float falloff) {
+        balls[i] = vec4(center, falloff);
+      }
+
+      unsigned get_num_balls() const {
+        return balls.size();
+      }
+
+      void get_row(float *dest, const float *xs, float y, float z, int n) {
+        const vec4 *b = balls.data();
+        unsigned num_balls = balls.size();
+        #if OCTET_SSE
+          for (int i = 0; i < n; i += 4) {
+            // repeat the last x at the end of the row so that every value is done the same way.
+            float x4[4], v4[4];
+            int m = std::min(4, n - i);
+            for (int k = 0; k != 4; ++k) x4[k] = xs[i + std::min(k, m - 1)];
+            __m128 x = _mm_loadu_ps(x4);
+            __m128 sum = _mm_setzero_ps();
+            for (unsigned j = 0; j != num_balls; ++j) {
+              float dy = y - b[j][1], dz = z - b[j][2];
+              __m128 dx = _mm_sub_ps(x, _mm_set1_ps(b[j][0]));
+              __m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_set1_ps(dy * dy + dz * dz));
+              sum = _mm_add_ps(sum, exp_sse(_mm_mul_ps(d2, _mm_set1_ps(b[j][3]))));
+            }
+            _mm_storeu_ps(v4, _mm_sub_ps(_mm_set1_ps(threshold), sum));
+            for (int k = 0; k != m; ++k) dest[i + k] = v4[k];
+          }
+        #else
+          for (int i = 0; i != n; ++i) {
+            float sum = 0;
+            for (unsigned j = 0; j != num_balls; ++j) {
+              float dx = xs[i] - b[j][0], dy = y - b[j][1], dz = z - b[j][2];
+              sum += expf((dx * dx + dy * dy + dz * dz) * b[j][3]);
+            }
+            dest[i] = threshold - sum;
+          }
+        #endif
+      }
+    };
+
+    enum {
+      log_block_cells = 4,
+      block_cells = 1 << log_block_cells,
+      block_samples = block_cells + 2,
+    };
+
+  private:
+    struct block_vertex {
+      vec3p pos;
+      vec3p normal;
+      vec3p uvw;
+    };
+
+    // triangles of one block, indices are local to the block.
+    struct block {
+      dynarray<block_vertex> vertices;
+      dynarray<uint32_t> indices;
+      bool dirty;
+    };
+
+    field_source *source;
+    aabb bb;
+    ivec3 dims;
+    ivec3 num_blocks;
+    vec3 cell_size;
+    dynarray<block> blocks;
+
+    // make the vertex of a cell from its eight corners.
+    void make_vertex(block &out, const float *corners, ivec3_in cell) const {
+      static const uint8_t edges[12][2] = {
+        { 0, 1 }, { 2, 3 }, { 4, 5 }, { 6, 7 },
+        { 0, 2 }, { 1, 3 }, { 4, 6 }, { 5, 7 },
+        { 0, 4 }, { 1, 5 }, { 2, 6 }, { 3, 7 },
+      };
+      vec3 sum(0, 0, 0);
+      float count = 0;
+      for (int e = 0; e != 12; ++e) {
+        int a = edges[e][0], b = edges[e][1];
+        float va = corners[a], vb = corners[b];
+        if ((va < 0) != (vb < 0)) {
+          float t = va / (va - vb);
+          vec3 pa((float)(a & 1), (float)((a >> 1) & 1), (float)(a >> 2));
+          vec3 pb((float)(b & 1), (float)((b >> 1) & 1), (float)(b >> 2));
+          sum += pa + (pb - pa) * t;
+          count += 1;
+        }
+      }
+
+      // the field increases outwards, so its gradient is the normal.
+      vec3 gradient(
+        (corners[1] + corners[3] + corners[5] + corners[7]) - (corners[0] + corners[2] + corners[4] + corners[6]),
+        (corners[2] + corners[3] + corners[6] + corners[7]) - (corners[0] + corners[1] + corners[4] + corners[5]),
+        (corners[4] + corners[5] + corners[6] + corners[7]) - (corners[0] + corners[1] + corners[2] + corners[3])
+      );
+      gradient = gradient / cell_size;
+      float len2 = dot(gradient, gradient);
+
+      vec3 grid_pos = vec3(cell) + sum / count;
+      block_vertex v;
+      v.pos = bb.get_min() + grid_pos * cell_size;
+      v.normal = len2 > 0 ? gradient / sqrtf(len2) : vec3(0, 1, 0);
+      v.uvw = grid_pos / vec3(dims);
+      out.vertices.push_back(v);
+    }
+
+    // sample the field and make the triangles of one block.
+    void polygonize_block(int b) {
+      block &out = blocks[b];
+      out.vertices.resize(0);
+      out.indices.resize(0);
+      out.dirty = false;
+
+      ivec3 bpos(b % num_blocks.x(), b / num_blocks.x() % num_blocks.y(), b / (num_blocks.x() * num_blocks.y()));
+      ivec3 origin = bpos * block_cells;
+      ivec3 n = (dims - origin).min(ivec3(block_cells));
+
+      // samples from one before the block to its far corner, so that the block can
+      // make the quads on its low sides using the cells of the blocks below.
+      enum { ss = block_samples };
+      float samples[ss * ss * ss];
+      float xs[ss];
+      vec3 bb_min = bb.get_min();
+      for (int i = 0; i <= n.x() + 1; ++i) {
+        xs[i] = bb_min.x() + (float)(origin.x() - 1 + i) * cell_size.x();
+      }
+      int num_inside = 0, num_samples = 0;
+      for (int k = 0; k <= n.z() + 1; ++k) {
+        float z = bb_min.z() + (float)(origin.z() - 1 + k) * cell_size.z();
+        for (int j = 0; j <= n.y() + 1; ++j) {
+          float y = bb_min.y() + (float)(origin.y() - 1 + j) * cell_size.y();
+          float *row = samples + (k * ss + j) * ss;
+          source->get_row(row, xs, y, z, n.x() + 2);
+          for (int i = 0; i <= n.x() + 1; ++i) num_inside += row[i] < 0;
+          num_samples += n.x() + 2;
+        }
+      }
+      if (num_inside == 0 || num_inside == num_samples) return;
+
+      // vertex of each cell from -1 to n - 1, made when first used.
+      enum { cs = block_cells + 1 };
+      int cell_vertex[cs * cs * cs];
+      for (int i = 0; i != cs * cs * cs; ++i) cell_vertex[i] = -1;
+
+      for (int k = 0; k != n.z(); ++k) {
+        for (int j = 0; j != n.y(); ++j) {
+          for (int i = 0; i != n.x(); ++i) {
+            int p[3] = { i, j, k };
+            float v0 = samples[((k + 1) * ss + j + 1) * ss + i + 1];
+            for (int axis = 0; axis != 3; ++axis) {
+              int u = axis == 2 ? 0 : axis + 1, v = axis == 0 ? 2 : axis - 1;
+              // the four cells around this edge must be in the grid.
+              if (origin[u] + p[u] == 0 || origin[v] + p[v] == 0) continue;
+              int q[3] = { i + 1, j + 1, k + 1 };
+              q[axis]++;
+              float v1 = samples[(q[2] * ss + q[1]) * ss + q[0]];
+              if ((v0 < 0) == (v1 < 0)) continue;
+
+              // cells a = p - u - v, b = p - v, c = p, d = p - u go anticlockwise around +axis.
+              uint32_t quad[4];
+              static const int du[4] = { 1, 0, 0, 1 }, dv[4] = { 1, 1, 0, 0 };
+              for (int c = 0; c != 4; ++c) {
+                int cell[3] = { i, j, k };
+                cell[u] -= du[c];
+                cell[v] -= dv[c];
+                int &idx = cell_vertex[((cell[2] + 1) * cs + cell[1] + 1) * cs + cell[0] + 1];
+                if (idx < 0) {
+                  float corners[8];
+                  for (int corner = 0; corner != 8; ++corner) {
+                    int x = cell[0] + 1 + (corner & 1), y = cell[1] + 1 + ((corner >> 1) & 1), z = cell[2] + 1 + (corner >> 2);
+                    corners[corner] = samples[(z * ss + y) * ss + x];
+                  }
+                  idx = (int)out.vertices.size();
+                  make_vertex(out, corners, origin + ivec3(cell[0], cell[1], cell[2]));
+                }
+                quad[c] = (uint32_t)idx;
+              }
+
+              // inside at p means the surface faces +axis.
+              if (v0 < 0) {
+                out.indices.push_back(quad[0]); out.indices.push_back(quad[1]); out.indices.push_back(quad[2]);
+                out.indices.push_back(quad[0]); out.indices.push_back(quad[2]); out.indices.push_back(quad[3]);
+              } else {
+                out.indices.push_back(quad[0]); out.indices.push_back(quad[2]); out.indices.push_back(quad[1]);
+                out.indices.push_back(quad[0]); out.indices.push_back(quad[3]); out.indices.push_back(quad[2]);
+              }
+            }
+          }
+        }
+      }
+    }
+
+  public:
+    /// Sample source on dims cells inside bb.
+    isosurface(aabb_in bb, ivec3_in dims, field_source &source) {
+      init(bb, dims, source);
+    }
+
+    void init(aabb_in bb_, ivec3_in dims_, field_source &source_) {
+      source = &source_;
+      bb = bb_;
+      dims = dims_.max(ivec3(1));
+      cell_size = bb.get_half_extent() * 2.0f / vec3(dims);
+      num_blocks = (dims + (block_cells - 1)) >> ivec3(log_block_cells);
+      blocks.resize(0);
+      blocks.resize(num_blocks.x() * num_blocks.y() * num_blocks.z());
+      mark_dirty();
+    }
+
+    /// Polygonize everything again at the next update.
+    void mark_dirty() {
+      for (unsigned b = 0; b != blocks.size(); ++b) {
+        blocks[b].dirty = true;
+      }
+    }
+
+    /// Polygonize the part of the surface inside region again.
+    void mark_dirty(aabb_in region) {
+      // a cell vertex is used by quads of the blocks above it too, so grow the region by a cell.
+      vec3 lo = (region.get_min() - bb.get_min()) / cell_size - vec3(1);
+      vec3 hi = (region.get_max() - bb.get_min()) / cell_size + vec3(1);
+      // clamp before converting so that huge regions do not overflow.
+      lo = max(lo, vec3(-1.0f));
+      hi = min(hi, vec3(dims));
+      ivec3 b0 = (ivec3((int)floorf(lo.x()), (int)floorf(lo.y()), (int)floorf(lo.z())) >> ivec3(log_block_cells)).max(ivec3(0));
+      ivec3 b1 = (ivec3((int)floorf(hi.x()), (int)floorf(hi.y()), (int)floorf(hi.z())) >> ivec3(log_block_cells)).min(num_blocks - 1);
+      for (int z = b0.z(); z <= b1.z(); ++z) {
+        for (int y = b0.y(); y <= b1.y(); ++y) {
+          for (int x = b0.x(); x <= b1.x(); ++x) {
+            blocks[x + num_blocks.x() * (y + num_blocks.y() * z)].dirty = true;
+          }
+        }
+      }
+    }
+
+    /// Polygonize the dirty blocks on all threads.
+    void polygonize() {
+      dynarray<int> dirty;
+      for (unsigned b = 0; b != blocks.size(); ++b) {
+        if (blocks[b].dirty) dirty.push_back((int)b);
+      }
+      job_scheduler::get().parallel_for(0, (int)dirty.size(), 1, [&](int begin, int end) {
+        for (int i = begin; i != end; ++i) {
+          polygonize_block(dirty[i]);
+        }
+      });
+    }
+
+    /// number of cells in each direction.
+    ivec3 get_dims() const {
+      return dims;
+    }
+
+    aabb get_aabb() const {
+      return bb;
+    }
+
+    /// Polygonize the dirty blocks and add the triangles of all blocks to a mesh sink.
+    template <class sink_t> void get_geometry(sink_t &sink, int) {
+      polygonize();
+      dynarray<uint32_t> remap;
+      for (unsigned b = 0; b != blocks.size(); ++b) {
+        const block &blk = blocks[b];
+        remap.resize(blk.vertices.size());
+        for (unsigned i = 0; i != blk.vertices.size(); ++i) {
+          const block_vertex &v = blk.vertices[i];
+          remap[i] = (uint32_t)sink.add_vertex(v.pos, v.normal, v.uvw);
+        }
+        for (unsigned i = 0; i + 3 <= blk.indices.size(); i += 3) {
+          sink.add_triangle(remap[blk.indices[i]], remap[blk.indices[i+1]], remap[blk.indices[i+2]]);
+        }
+      }
+    }
+  };
+
+  #if OCTET_UNIT_TEST
+    class isosurface_unit_test {
+      // signed distance to a sphere of radius 3.
+      struct sphere_field : isosurface::field_source {
+        void get_row(float *dest, const float *xs, float y, float z, int n) {
+          for (int i = 0; i != n; ++i) dest[i] = sqrtf(xs[i] * xs[i] + y * y + z * z) - 3.0f;
+        }
+      };
+
+      struct checker {
+        dynarray<vec3> pos, normal;
+        unsigned num_triangles, num_facing;
+        checker() { num_triangles = num_facing = 0; }
+        size_t add_vertex(vec3_in p, vec3_in n, vec3_in) { pos.push_back(p); normal.push_back(n); return pos.size() - 1; }
+        void add_triangle(uint32_t a, uint32_t b, uint32_t c) {
+          vec3 face = cross(pos[b] - pos[a], pos[c] - pos[a]);
+          num_triangles++;
+          num_facing += dot(face, normal[a] + normal[b] + normal[c]) > 0;
+        }
+      };
+
+    public:
+      isosurface_unit_test() {
+        sphere_field sphere;
+        isosurface surface(aabb(vec3(0), vec3(4)), ivec3(40, 40, 40), sphere);
+        checker first;
+        surface.get_geometry(first, 1);
+        assert(first.num_triangles > 1000 && first.num_facing == first.num_triangles);
+        for (unsigned i = 0; i != first.pos.size(); ++i) {
+          assert(fabsf(first.pos[i].length() - 3.0f) < 0.1f);
+          assert(dot(first.normal[i], first.pos[i]) > 0);
+        }
+
+        // doing part of it again makes the same triangles.
+        surface.mark_dirty(aabb(vec3(3, 0, 0), vec3(0.5f)));
+        checker second;
+        surface.get_geometry(second, 1);
+        assert(second.num_triangles == first.num_triangles && second.pos.size() == first.pos.size());
+
+        // metaballs in SIMD match the shader's exp().
+        isosurface::metaball_field balls;
+        balls.add_ball(vec3(0, 0, 0), -0.3f);
+        balls.add_ball(vec3(-3, 0, 0), -0.6f);
+        float xs[7] = { -4, -3, -1.5f, 0, 0.5f, 2, 6 }, values[7];
+        balls.get_row(values, xs, 0.5f, -0.25f, 7);
+        for (int i = 0; i != 7; ++i) {
+          float d0 = xs[i] * xs[i] + 0.3125f, d1 = (xs[i] + 3) * (xs[i] + 3) + 0.3125f;
+          float expected = 0.5f - expf(d0 * -0.3f) - expf(d1 * -0.6f);
+          assert(fabsf(values[i] - expected) < 1e-5f);
+        }
+      }
+    };
+    static isosurface_unit_test isosurface_unit_test;
+  #endif
+
+  #if OCTET_BENCHMARK
+    /// Millions of cells per second polygonizing a 256x256x256 grid on all threads,
+    /// for a sphere distance field and for eight metaballs, then for a small edit.
+    class isosurface_benchmark {
+      enum { dim = 256 };
+
+      // signed distance to a sphere of radius 3.
+      struct sphere_field : isosurface::field_source {
+        void get_row(float *dest, const float *xs, float y, float z, int n) {
+          for (int i = 0; i != n; ++i) dest[i] = sqrtf(xs[i] * xs[i] + y * y + z * z) - 3.0f;
+        }
+      };
+
+      struct counter {
+        unsigned num_triangles;
+        counter() : num_triangles(0) {}
+        size_t add_vertex(vec3_in, vec3_in, vec3_in) { return 0; }
+        void add_triangle(uint32_t, uint32_t, uint32_t) { num_triangles++; }
+      };
+
+      static void time_field(const char *name, isosurface::field_source &field) {
+        double num_cells = (double)dim * dim * dim;
+        char text[64];
+        isosurface surface(aabb(vec3(0), vec3(4)), ivec3(dim, dim, dim), field);
+        benchmark_timer timer;
+        surface.polygonize();
+        timer.report(name, num_cells, "cells");
+
+        counter count;
+        surface.get_geometry(count, 1);
+        printf("%-40s %10u\n", "triangles", count.num_triangles);
+
+        surface.mark_dirty(aabb(vec3(3, 0, 0), vec3(0.25f)));
+        timer.reset();
+        surface.polygonize();
+        snprintf(text, sizeof(text), "%s, small edit", name);
+        timer.report(text);
+      }
+    public:
+      isosurface_benchmark() {
+        printf("isosurface_benchmark: %dx%dx%d cells\n", dim, dim, dim);
+        sphere_field sphere;
+        time_field("sphere", sphere);
+
+        isosurface::metaball_field balls;
+        for (int i = 0; i != 8; ++i) {
+          float a = i * (3.14159265f / 4);
+          balls.add_ball(vec3(cosf(a) * 2, sinf(a * 2) * 0.5f, sinf(a) * 2), -0.8f);
+        }
+        time_field("8 metaballs", balls);
+      }
+    };
+    static isosurface_benchmark isosurface_benchmark;
+  #endif
+} }
@@ -24,6 +24,19 @@ namespace octet { namespace scene {
     //dynarray<uint8_t> static_buffer;
     dynarray<uint8_t> buffer;
 
+    // the program the params were last bound to
+    GLuint bound_program;
+
+    // find the uniforms in the shader's current program
+    void bind_params() {
+      param_bind_info pbind;
+      pbind.program = custom_shader->get_program();
+      for (unsigned i = 0; i != params.size(); ++i) {
+        params[i]->bind(pbind);
+      }
+      bound_program = pbind.program;
+    }
+
     // create the parameters that change frequently such as the matrices and lighting
     void create_dynamic_params() {
       buffer.reserve(0x200);
@@ -53,10 +66,13 @@ namespace octet { namespace scene {
 
     /// Default constructor makes a blank material.
     material() {
+      bound_program = 0;
     }
 
     /// Alternative constructor.
     material(const vec4 &color, param_shader *shader = NULL) {
+      bound_program = 0;
+
       // materials are constructed from parameters which build the final shader.
       // this allows us to use OpenGLES2 (uniforms) and 3 (buffers) as well as new shader features.
       params.reserve(16);
@@ -76,6 +92,7 @@ namespace octet { namespace scene {
 
     /// create a material from an existing image
     material(image *img, sampler *smpl = NULL, param_shader *shader = NULL) {
+      bound_program = 0;
       if (!smpl) smpl = new sampler();
 
       params.reserve(16);
@@ -94,6 +111,7 @@ namespace octet { namespace scene {
     }
 
     material(param *diffuse, param *ambient, param *emission, param *specular, param *bump, param *shininess) {
+      bound_program = 0;
     }
 
     /// Serialize.
@@ -107,6 +125,13 @@ namespace octet { namespace scene {
       log("lu[1] = %s\n", light_uniforms[1].toString(tmp, sizeof(tmp)));
       log("lu[2] = %s\n", light_uniforms[2].toString(tmp, sizeof(tmp)));
       log("lu[3] = %s\n", light_uniforms[3].toString(tmp, sizeof(tmp)));*/
+
+      // the shader may have finished compiling since we bound the params
+      custom_shader->is_ready();
+      if (custom_shader->get_program() != bound_program) {
+        bind_params();
+      }
+
       {
         // matrices and lighting go in the dynamic uniform buffer
         param_uniform *modelToProjection_param = get_param_uniform(atom_modelToProjection);
@@ -763,6 +763,20 @@ namespace octet { namespace scene {
       }
     }
 
+    /// Use v = 1 - v in the texture coordinates.
+    /// For textures with row zero at the top, such as DDS files (see image::is_top_down).
+    void flip_v() {
+      unsigned slot = get_slot(attribute_uv);
+      if (slot == ~0u || get_kind(slot) != GL_FLOAT || get_size(slot) < 2) return;
+
+      gl_resource::rwlock vtx_lock(get_vertices());
+      uint8_t *src = vtx_lock.u8() + get_offset(slot) + sizeof(float);
+      for (unsigned i = 0; i != num_vertices; ++i) {
+        float &v = *(float*)(src + i * stride);
+        v = 1 - v;
+      }
+    }
+
     /// Convert from GL_TRIANGLES to GL_LINES.
     /// Double the number of indices.
     void make_wireframe() {
@@ -957,18 +971,58 @@ namespace octet { namespace scene {
       return true;
     }
 
+    // vertices waiting to be transformed together by a sink.
+    template <class vertex_t> struct vertex_batch {
+      enum { max_vertices = 64 };
+      vec3p pos[max_vertices];
+      vec3p normal[max_vertices];
+      vec3p uvw[max_vertices];
+      unsigned size;
+
+      vertex_batch() : size(0) {
+      }
+
+      void add(vec3_in pos_, vec3_in normal_, vec3_in uvw_) {
+        pos[size] = pos_;
+        normal[size] = normal_;
+        uvw[size] = uvw_;
+        size++;
+      }
+
+      // transform the positions and normals with SIMD and write the vertices to dest.
+      void flush(vertex_t *dest, const mat4t &transform, const mat4t &rotation) {
+        transform_batch::points(pos, pos, size, transform);
+        transform_batch::points(normal, normal, size, rotation);
+        for (unsigned i = 0; i != size; ++i) {
+          dest[i] = vertex_t(pos[i], normal[i], uvw[i]);
+        }
+        size = 0;
+      }
+    };
+
+    // the transform without its translation, for normals.
+    static mat4t normal_transform(mat4t_in transform) {
+      mat4t rotation = transform;
+      rotation[3] = vec4(0, 0, 0, 1);
+      return rotation;
+    }
+
+    /// Sink for shapes that can't count their vertices: the arrays grow and are copied to the mesh at the end.
     template <class vertex_t> struct sink {
       mesh *mesh_;
       dynarray<vertex_t> vertices;
       dynarray<uint32_t> indices;
       mat4t transform;
+      mat4t rotation;
+      vertex_batch<vertex_t> batch;
 
       sink(mesh *mesh_, mat4t_in transform) :
-        mesh_(mesh_), transform(transform)
+        mesh_(mesh_), transform(transform), rotation(normal_transform(transform))
       {
       }
 
       ~sink() {
+        flush();
         mesh_->allocate(sizeof(vertex_t) * vertices.size(), sizeof(uint32_t) * indices.size());
         mesh_->get_vertices()->assign(vertices.data(), 0, sizeof(vertex_t) * vertices.size());
         mesh_->get_indices()->assign(indices.data(), 0, sizeof(uint32_t) * indices.size());
@@ -976,17 +1030,22 @@ namespace octet { namespace scene {
         mesh_->set_num_indices(indices.size());
       }
 
+      void flush() {
+        if (!batch.size) return;
+        unsigned first = vertices.size();
+        vertices.resize(first + batch.size);
+        batch.flush(&vertices[first], transform, rotation);
+      }
+
       void reserve(uint32_t num_vertices, uint32_t num_indices) {
         vertices.reserve(num_vertices);
         indices.reserve(num_indices);
       }
 
       size_t add_vertex(vec3_in pos, vec3_in normal, vec3_in uvw) {
-        vec3 tpos = pos * transform;
-        vec3 tnormal = normal.x() * transform.x().xyz() + normal.y() * transform.y().xyz() + normal.z() * transform.z().xyz();
-        size_t index = vertices.size();
-        vertices.push_back(vertex_t(tpos, tnormal, uvw));
-        return index;
+        if (batch.size == batch.max_vertices) flush();
+        batch.add(pos, normal, uvw);
+        return vertices.size() + batch.size - 1;
       }
 
       void add_triangle(uint32_t a, uint32_t b, uint32_t c) {
@@ -995,14 +1054,204 @@ namespace octet { namespace scene {
         indices.push_back(c);
       }
 
-      const vertex_t &get_vertex(size_t index) const {
-        return vertices[index];
+      /// Call fn(sink, i) for n parts that each add the same number of vertices and indices.
+      template <class fn_t> void add_parts(unsigned n, unsigned, unsigned, fn_t fn) {
+        for (unsigned i = 0; i != n; ++i) {
+          fn(*this, i);
+        }
       }
     };
 
+    /// Sink for shapes with get_geometry_size: vertices go straight into a mapped buffer.
+    ///
+    /// Parts from add_parts are made on all threads, each with its own fill_sink
+    /// writing to its own range of the buffers.
+    template <class vertex_t> struct fill_sink {
+      vertex_t *vertices;
+      uint32_t *indices;
+      uint32_t next_vertex, end_vertex;
+      uint32_t next_index, end_index;
+      mat4t transform;
+      mat4t rotation;
+      vertex_batch<vertex_t> batch;
+
+      fill_sink(vertex_t *vertices, uint32_t *indices, mat4t_in transform, mat4t_in rotation, uint32_t first_vertex, uint32_t num_vertices, uint32_t first_index, uint32_t num_indices) :
+        vertices(vertices), indices(indices), transform(transform), rotation(rotation)
+      {
+        next_vertex = first_vertex;
+        end_vertex = first_vertex + num_vertices;
+        next_index = first_index;
+        end_index = first_index + num_indices;
+      }
+
+      ~fill_sink() {
+        flush();
+      }
+
+      void flush() {
+        if (!batch.size) return;
+        batch.flush(vertices + next_vertex - batch.size, transform, rotation);
+      }
+
+      /// the space has already been counted.
+      void reserve(uint32_t, uint32_t) {
+      }
+
+      size_t add_vertex(vec3_in pos, vec3_in normal, vec3_in uvw) {
+        assert(next_vertex < end_vertex && "fill_sink: more vertices than get_geometry_size said");
+        if (batch.size == batch.max_vertices) flush();
+        batch.add(pos, normal, uvw);
+        return next_vertex++;
+      }
+
+      void add_triangle(uint32_t a, uint32_t b, uint32_t c) {
+        assert(next_index + 3 <= end_index && "fill_sink: more indices than get_geometry_size said");
+        uint32_t *dest = indices + next_index;
+        dest[0] = a;
+        dest[1] = b;
+        dest[2] = c;
+        next_index += 3;
+      }
+
+      /// Call fn(sink, i) for n parts that each add the same number of vertices and indices.
+      template <class fn_t> void add_parts(unsigned n, unsigned vertices_per_part, unsigned indices_per_part, fn_t fn) {
+        flush();
+        uint32_t first_vertex = next_vertex, first_index = next_index;
+        next_vertex += n * vertices_per_part;
+        next_index += n * indices_per_part;
+        assert(next_vertex <= end_vertex && next_index <= end_index);
+        job_scheduler::get().parallel_for(0, (int)n, 1, [&](int begin, int end) {
+          for (int i = begin; i != end; ++i) {
+            fill_sink part(vertices, indices, transform, rotation, first_vertex + i * vertices_per_part, vertices_per_part, first_index + i * indices_per_part, indices_per_part);
+            fn(part, (unsigned)i);
+          }
+        });
+      }
+
+      bool is_full() const {
+        return next_vertex == end_vertex && next_index == end_index;
+      }
+    };
+
+    // use shape.get_geometry_size if the shape has one.
+    template <class shape_t> static auto geometry_size(shape_t &shape, int steps, unsigned &num_vertices, unsigned &num_indices, int)
+      -> decltype(shape.get_geometry_size(steps, num_vertices, num_indices), true)
+    {
+      shape.get_geometry_size(steps, num_vertices, num_indices);
+      return true;
+    }
+
+    template <class shape_t> static bool geometry_size(shape_t &, int, unsigned &, unsigned &, long) {
+      return false;
+    }
+
+    /// Generate the mesh from a shape such as a sphere or aabb.
+    ///
+    /// Shapes that have get_geometry_size are counted first and then written
+    /// straight into the vertex and index buffers.
     template <class shape_t, class vertex_t> void set_shape(shape_t &shape, mat4t_in transform, int steps) {
-      sink<vertex_t> sink_(this, transform);
-      shape.get_geometry(sink_, steps);
+      unsigned num_vertices = 0, num_indices = 0;
+      if (!geometry_size(shape, steps, num_vertices, num_indices, 0)) {
+        sink<vertex_t> sink_(this, transform);
+        shape.get_geometry(sink_, steps);
+        return;
+      }
+
+      allocate(sizeof(vertex_t) * num_vertices, sizeof(uint32_t) * num_indices);
+      if (num_vertices && num_indices) {
+        gl_resource::wolock vlock(get_vertices());
+        gl_resource::wolock ilock(get_indices());
+        fill_sink<vertex_t> sink_((vertex_t*)vlock.u8(), ilock.u32(), transform, normal_transform(transform), 0, num_vertices, 0, num_indices);
+        shape.get_geometry(sink_, steps);
+        assert(sink_.is_full() && "fill_sink: fewer vertices or indices than get_geometry_size said");
+      }
+      set_num_vertices(num_vertices);
+      set_num_indices(num_indices);
     }
   };
+  #if OCTET_BENCHMARK
+    /// Triangles per second for icospheres made the way set_shape makes them, into plain memory
+    /// rather than a mapped buffer, against a sink that transforms one vertex at a time
+    /// and grows its arrays.
+    class mesh_sphere_benchmark {
+      typedef mesh::vertex vertex;
+
+      struct growing_sink {
+        dynarray<vertex> vertices;
+        dynarray<uint32_t> indices;
+        mat4t transform;
+
+        void reserve(uint32_t, uint32_t) {
+        }
+
+        size_t add_vertex(vec3_in pos, vec3_in normal, vec3_in uvw) {
+          vec3 tpos = pos * transform;
+          vec3 tnormal = normal.x() * transform.x().xyz() + normal.y() * transform.y().xyz() + normal.z() * transform.z().xyz();
+          vertices.push_back(vertex(tpos, tnormal, uvw));
+          return vertices.size() - 1;
+        }
+
+        void add_triangle(uint32_t a, uint32_t b, uint32_t c) {
+          indices.push_back(a);
+          indices.push_back(b);
+          indices.push_back(c);
+        }
+
+        template <class fn_t> void add_parts(unsigned n, unsigned, unsigned, fn_t fn) {
+          for (unsigned i = 0; i != n; ++i) {
+            fn(*this, i);
+          }
+        }
+      };
+    public:
+      mesh_sphere_benchmark() {
+        sphere shape(vec3(0), 2);
+        mat4t transform;
+        transform.translate(1, 2, 3);
+        transform.rotateY(30);
+        printf("mesh_sphere_benchmark\n");
+
+        for (int level = 5; level <= 9; level += 2) {
+          unsigned num_vertices = 0, num_indices = 0;
+          shape.get_geometry_size(level, num_vertices, num_indices);
+          unsigned passes = 1 << (2 * (9 - level));
+          double num_triangles = (double)passes * num_indices / 3;
+          char name[64];
+
+          growing_sink grow;
+          grow.transform = transform;
+          {
+            benchmark_timer timer;
+            for (unsigned p = 0; p != passes; ++p) {
+              grow.vertices.resize(0);
+              grow.indices.resize(0);
+              shape.get_geometry(grow, level);
+            }
+            snprintf(name, sizeof(name), "level %d, one vertex at a time", level);
+            timer.report(name, num_triangles, "triangles");
+          }
+
+          dynarray<vertex> vertices(num_vertices);
+          dynarray<uint32_t> indices(num_indices);
+          {
+            benchmark_timer timer;
+            for (unsigned p = 0; p != passes; ++p) {
+              mesh::fill_sink<vertex> fill(vertices.data(), indices.data(), transform, mesh::normal_transform(transform), 0, num_vertices, 0, num_indices);
+              shape.get_geometry(fill, level);
+            }
+            snprintf(name, sizeof(name), "level %d, count then fill", level);
+            timer.report(name, num_triangles, "triangles");
+          }
+
+          float max_error = 0;
+          for (unsigned i = 0; i != num_vertices; ++i) {
+            max_error = std::max(max_error, (vec3(grow.vertices[i].pos) - vec3(vertices[i].pos)).length());
+          }
+          bool same = grow.indices.size() == num_indices && !memcmp(grow.indices.data(), indices.data(), num_indices * sizeof(uint32_t));
+          printf("%-40s %10g%s\n", "largest position difference", max_error, same ? "" : ", indices differ");
+        }
+      }
+    };
+    static mesh_sphere_benchmark mesh_sphere_benchmark;
+  #endif
 }}
@@ -131,7 +131,7 @@ namespace octet { namespace scene {
     float get_max_draw_distance() const { return max_draw_distance; }
 
     /// Set the transformation for this instance.
-    void set_node(scene_node *value) { node = value; }
+    void set_node(scene_node *value) { node = value; scene_node::enable_generation()++; }
 
     /// Set the mesh for this instance.
     void set_mesh(mesh *value) { msh = value; }
@@ -143,7 +143,10 @@ namespace octet { namespace scene {
     void set_skeleton(skeleton *value) { skel = value; }
 
     /// Set the flags for this instance.
-    void set_flags(unsigned value) { flags = value; }
+    void set_flags(unsigned value) {
+      if ((flags ^ value) & flag_enabled) scene_node::enable_generation()++;
+      flags = value;
+    }
 
     /// Set the flags for this instance.
     void set_min_draw_distance(float value) { min_draw_distance = value; }
@@ -0,0 +1,62 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Mesh of an implicit surface
+//
+
+namespace octet { namespace scene {
+  /// Isosurface mesh. Generate triangles where a field is zero.
+  ///
+  /// Example:
+  ///
+  ///     isosurface::metaball_field balls;
+  ///     balls.add_ball(vec3(0, 0, 0), -0.3f);
+  ///     mesh_isosurface *blobs = new mesh_isosurface(aabb(vec3(0), vec3(5)), ivec3(128, 128, 128), balls);
+  ///     ...
+  ///     balls.set_ball(0, vec3(1, 0, 0), -0.3f);
+  ///     blobs->get_surface().mark_dirty();
+  ///     blobs->update();
+  class mesh_isosurface : public mesh {
+    isosurface surface;
+    mat4t transform;
+
+  public:
+    RESOURCE_META(mesh_isosurface)
+
+    /// Default constructor: nothing to draw.
+    mesh_isosurface() : surface(aabb(), ivec3(1, 1, 1), empty_field()) {
+      set_default_attributes();
+    }
+
+    /// Polygonize source with dims cells inside bb. The source must last as long as the mesh.
+    mesh_isosurface(aabb_in bb, ivec3_in dims, isosurface::field_source &source) : surface(bb, dims, source) {
+      set_default_attributes();
+      set_aabb(bb);
+      update();
+    }
+
+    /// Mark parts of this dirty after changing the field, then call update().
+    isosurface &get_surface() {
+      return surface;
+    }
+
+    /// Polygonize the dirty blocks and rebuild the mesh.
+    virtual void update() {
+      mesh::set_shape<isosurface, mesh::vertex>(surface, transform, 1);
+    }
+
+  private:
+    // a field with nothing inside it.
+    static isosurface::field_source &empty_field() {
+      static struct : isosurface::field_source {
+        void get_row(float *dest, const float *, float, float, int n) {
+          for (int i = 0; i != n; ++i) dest[i] = 1.0f;
+        }
+      } empty;
+      return empty;
+    }
+  };
+}}
@@ -0,0 +1,570 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+namespace octet { namespace scene {
+  /// Soft body mesh simulated with XPBD (extended position based dynamics).
+  ///
+  /// Particles are linked by distance constraints (springs) and tetrahedral volume constraints.
+  /// Each step is split into substeps with one constraint iteration each, which converges better
+  /// than many iterations of one big step. Stiffness is given as compliance, the inverse of the
+  /// spring constant, so zero compliance is perfectly stiff.
+  ///
+  /// Particles are stored as separate x, y and z arrays. Constraints are graph coloured when the
+  /// body is built so that no two constraints of a colour share a particle: each colour is solved
+  /// in parallel across threads with no locks or atomics, and four at a time with SSE.
+  ///
+  /// update() writes positions and normals straight into the vertex buffer for drawing.
+  ///
+  /// Example:
+  ///
+  ///     mesh_soft_body *body = new mesh_soft_body();
+  ///     int a = body->add_particle(vec3(0, 0, 0), 0);
+  ///     int b = body->add_particle(vec3(1, 0, 0), 1);
+  ///     ...
+  ///     body->add_tetra(a, b, c, d, 1e-4f, 0);
+  ///     body->add_face(a, b, c);
+  ///     body->build();
+  ///     ...
+  ///     body->simulate(1.0f/30, 10);
+  ///     body->update();
+  class mesh_soft_body : public mesh {
+    // particles
+    dynarray<float> px, py, pz;
+    dynarray<float> prev_x, prev_y, prev_z;
+    dynarray<float> vel_x, vel_y, vel_z;
+    dynarray<float> inv_mass;
+    dynarray<vec2p> uvs;
+
+    // distance constraints, sorted by colour after build().
+    struct distance {
+      int p[2];
+      float rest_length;
+      float compliance;
+    };
+    dynarray<distance> distances;
+    dynarray<unsigned> distance_colours;
+
+    // volume constraints, sorted by colour after build().
+    struct volume {
+      int p[4];
+      float rest_volume;
+      float compliance;
+    };
+    dynarray<volume> volumes;
+    dynarray<unsigned> volume_colours;
+
+    // faces to draw and, for each particle, the faces around it.
+    dynarray<uint32_t> faces;
+    dynarray<vec3p> face_normals;
+    dynarray<unsigned> particle_face_start;
+    dynarray<unsigned> particle_faces;
+
+    vec3 gravity;
+    float damping;
+    bool coloured;
+    bool built;
+
+    // colours with fewer constraints than this are solved on one thread.
+    enum { parallel_grain = 4096, max_colours = 64 };
+
+    // greedy graph colouring; returns the start of each colour in start[] and sorts the constraints.
+    template <class constraint_t, int num_points> static void colour_constraints(dynarray<constraint_t> &constraints, dynarray<unsigned> &start, unsigned num_particles) {
+      dynarray<uint64_t> used(num_particles);
+      memset(used.data(), 0, num_particles * sizeof(uint64_t));
+      dynarray<unsigned> colour(constraints.size());
+      dynarray<unsigned> count(max_colours + 1);
+      memset(count.data(), 0, count.size() * sizeof(unsigned));
+
+      for (unsigned i = 0; i != constraints.size(); ++i) {
+        const int *p = constraints[i].p;
+        uint64_t mask = 0;
+        for (int j = 0; j != num_points; ++j) mask |= used[p[j]];
+
+        // constraints that do not fit in 64 colours go in a last colour solved in serial.
+        unsigned c = max_colours;
+        if (mask != ~(uint64_t)0) {
+          c = 0;
+          while (mask & ((uint64_t)1 << c)) ++c;
+          for (int j = 0; j != num_points; ++j) used[p[j]] |= (uint64_t)1 << c;
+        }
+        colour[i] = c;
+        count[c]++;
+      }
+
+      start.resize(max_colours + 2);
+      start[0] = 0;
+      for (unsigned c = 0; c <= max_colours; ++c) {
+        start[c+1] = start[c] + count[c];
+      }
+
+      dynarray<constraint_t> sorted(constraints.size());
+      dynarray<unsigned> next(max_colours + 1);
+      for (unsigned c = 0; c <= max_colours; ++c) next[c] = start[c];
+      for (unsigned i = 0; i != constraints.size(); ++i) {
+        sorted[next[colour[i]]++] = constraints[i];
+      }
+      constraints.swap(sorted);
+    }
+
+    // call fn(begin, end) for each colour in turn, splitting big colours across threads.
+    template <class fn_t> static void for_each_colour(const dynarray<unsigned> &start, fn_t fn) {
+      for (unsigned c = 0; c + 1 < start.size(); ++c) {
+        unsigned begin = start[c], end = start[c+1];
+        if (begin == end) continue;
+        if (c != max_colours && end - begin > parallel_grain) {
+          job_scheduler::get().parallel_for((int)begin, (int)end, parallel_grain, fn);
+        } else {
+          fn((int)begin, (int)end);
+        }
+      }
+    }
+
+    #if OCTET_SSE
+      // four floats from scattered particles, and back again.
+      static __m128 gather(const float *src, const int *index) {
+        return _mm_setr_ps(src[index[0]], src[index[1]], src[index[2]], src[index[3]]);
+      }
+
+      static void scatter(float *dest, const int *index, __m128 value) {
+        float tmp[4];
+        _mm_storeu_ps(tmp, value);
+        dest[index[0]] = tmp[0]; dest[index[1]] = tmp[1]; dest[index[2]] = tmp[2]; dest[index[3]] = tmp[3];
+      }
+    #endif
+
+    // solve distance constraints [begin, end); none of them share a particle.
+    void solve_distances(int begin, int end, float inv_dt2) {
+      float *x = px.data(), *y = py.data(), *z = pz.data();
+      const float *w = inv_mass.data();
+      const distance *d = distances.data();
+      int i = begin;
+      #if OCTET_SSE
+        // four constraints in the lanes of each register. They share no particles, so the scatters
+        // do not overlap.
+        __m128 inv_dt2_4 = _mm_set1_ps(inv_dt2), min_len2 = _mm_set1_ps(1e-12f), zero = _mm_setzero_ps();
+        for (; i + 4 <= end; i += 4) {
+          const distance *c = d + i;
+          int i0[4] = { c[0].p[0], c[1].p[0], c[2].p[0], c[3].p[0] };
+          int i1[4] = { c[0].p[1], c[1].p[1], c[2].p[1], c[3].p[1] };
+          __m128 x0 = gather(x, i0), y0 = gather(y, i0), z0 = gather(z, i0);
+          __m128 x1 = gather(x, i1), y1 = gather(y, i1), z1 = gather(z, i1);
+          __m128 dx = _mm_sub_ps(x1, x0), dy = _mm_sub_ps(y1, y0), dz = _mm_sub_ps(z1, z0);
+          __m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+          __m128 w0 = gather(w, i0), w1 = gather(w, i1);
+          __m128 compliance = _mm_setr_ps(c[0].compliance, c[1].compliance, c[2].compliance, c[3].compliance);
+          __m128 rest_length = _mm_setr_ps(c[0].rest_length, c[1].rest_length, c[2].rest_length, c[3].rest_length);
+          __m128 denom = _mm_add_ps(_mm_add_ps(w0, w1), _mm_mul_ps(compliance, inv_dt2_4));
+          __m128 len = _mm_sqrt_ps(len2);
+          __m128 valid = _mm_and_ps(_mm_cmpge_ps(len2, min_len2), _mm_cmpneq_ps(denom, zero));
+          __m128 s = _mm_and_ps(valid, _mm_div_ps(_mm_sub_ps(rest_length, len), _mm_mul_ps(denom, len)));
+          __m128 s0 = _mm_mul_ps(s, w0), s1 = _mm_mul_ps(s, w1);
+          scatter(x, i0, _mm_sub_ps(x0, _mm_mul_ps(s0, dx)));
+          scatter(y, i0, _mm_sub_ps(y0, _mm_mul_ps(s0, dy)));
+          scatter(z, i0, _mm_sub_ps(z0, _mm_mul_ps(s0, dz)));
+          scatter(x, i1, _mm_add_ps(x1, _mm_mul_ps(s1, dx)));
+          scatter(y, i1, _mm_add_ps(y1, _mm_mul_ps(s1, dy)));
+          scatter(z, i1, _mm_add_ps(z1, _mm_mul_ps(s1, dz)));
+        }
+      #endif
+      for (; i != end; ++i) {
+        int p0 = d[i].p[0], p1 = d[i].p[1];
+        float dx = x[p1] - x[p0], dy = y[p1] - y[p0], dz = z[p1] - z[p0];
+        float len2 = dx * dx + dy * dy + dz * dz;
+        float w0 = w[p0], w1 = w[p1];
+        float denom = w0 + w1 + d[i].compliance * inv_dt2;
+        if (len2 < 1e-12f || denom == 0) continue;
+        float len = sqrtf(len2);
+        float s = (d[i].rest_length - len) / (denom * len);
+        x[p0] -= s * w0 * dx; y[p0] -= s * w0 * dy; z[p0] -= s * w0 * dz;
+        x[p1] += s * w1 * dx; y[p1] += s * w1 * dy; z[p1] += s * w1 * dz;
+      }
+    }
+
+    // solve volume constraints [begin, end); none of them share a particle.
+    void solve_volumes(int begin, int end, float inv_dt2) {
+      // the gradient for point j is the cross product of the edges of the opposite face.
+      static const int opposite[4][3] = { { 1, 3, 2 }, { 0, 2, 3 }, { 0, 3, 1 }, { 0, 1, 2 } };
+      float *x = px.data(), *y = py.data(), *z = pz.data();
+      const float *w = inv_mass.data();
+      const volume *v = volumes.data();
+      int i = begin;
+      #if OCTET_SSE
+        // four tetrahedra at a time, as for the distances.
+        __m128 inv_dt2_4 = _mm_set1_ps(inv_dt2), sixth = _mm_set1_ps(1.0f / 6), zero = _mm_setzero_ps();
+        for (; i + 4 <= end; i += 4) {
+          const volume *c = v + i;
+          int index[4][4];
+          __m128 qx[4], qy[4], qz[4], qw[4];
+          for (int j = 0; j != 4; ++j) {
+            for (int k = 0; k != 4; ++k) index[j][k] = c[k].p[j];
+            qx[j] = gather(x, index[j]); qy[j] = gather(y, index[j]); qz[j] = gather(z, index[j]);
+            qw[j] = gather(w, index[j]);
+          }
+
+          __m128 gx[4], gy[4], gz[4], volume_x6 = zero;
+          __m128 denom = _mm_mul_ps(_mm_setr_ps(c[0].compliance, c[1].compliance, c[2].compliance, c[3].compliance), inv_dt2_4);
+          for (int j = 0; j != 4; ++j) {
+            const int *o = opposite[j];
+            __m128 ax = _mm_sub_ps(qx[o[1]], qx[o[0]]), ay = _mm_sub_ps(qy[o[1]], qy[o[0]]), az = _mm_sub_ps(qz[o[1]], qz[o[0]]);
+            __m128 bx = _mm_sub_ps(qx[o[2]], qx[o[0]]), by = _mm_sub_ps(qy[o[2]], qy[o[0]]), bz = _mm_sub_ps(qz[o[2]], qz[o[0]]);
+            __m128 cx = _mm_sub_ps(_mm_mul_ps(ay, bz), _mm_mul_ps(az, by));
+            __m128 cy = _mm_sub_ps(_mm_mul_ps(az, bx), _mm_mul_ps(ax, bz));
+            __m128 cz = _mm_sub_ps(_mm_mul_ps(ax, by), _mm_mul_ps(ay, bx));
+            if (j == 3) {
+              // the face opposite point 3 is (0, 1, 2), so this is also the volume's cross product.
+              __m128 ex = _mm_sub_ps(qx[3], qx[0]), ey = _mm_sub_ps(qy[3], qy[0]), ez = _mm_sub_ps(qz[3], qz[0]);
+              volume_x6 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, ex), _mm_mul_ps(cy, ey)), _mm_mul_ps(cz, ez));
+            }
+            gx[j] = _mm_mul_ps(cx, sixth); gy[j] = _mm_mul_ps(cy, sixth); gz[j] = _mm_mul_ps(cz, sixth);
+            __m128 g2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(gx[j], gx[j]), _mm_mul_ps(gy[j], gy[j])), _mm_mul_ps(gz[j], gz[j]));
+            denom = _mm_add_ps(denom, _mm_mul_ps(qw[j], g2));
+          }
+
+          __m128 rest_volume = _mm_setr_ps(c[0].rest_volume, c[1].rest_volume, c[2].rest_volume, c[3].rest_volume);
+          __m128 lambda = _mm_div_ps(_mm_sub_ps(rest_volume, _mm_mul_ps(volume_x6, sixth)), denom);
+          lambda = _mm_and_ps(_mm_cmpneq_ps(denom, zero), lambda);
+          for (int j = 0; j != 4; ++j) {
+            __m128 s = _mm_mul_ps(lambda, qw[j]);
+            scatter(x, index[j], _mm_add_ps(qx[j], _mm_mul_ps(s, gx[j])));
+            scatter(y, index[j], _mm_add_ps(qy[j], _mm_mul_ps(s, gy[j])));
+            scatter(z, index[j], _mm_add_ps(qz[j], _mm_mul_ps(s, gz[j])));
+          }
+        }
+      #endif
+      for (; i != end; ++i) {
+        const int *p = v[i].p;
+        vec3 pos[4];
+        for (int j = 0; j != 4; ++j) pos[j] = vec3(x[p[j]], y[p[j]], z[p[j]]);
+
+        vec3 grad[4];
+        float denom = v[i].compliance * inv_dt2;
+        for (int j = 0; j != 4; ++j) {
+          const int *o = opposite[j];
+          grad[j] = cross(pos[o[1]] - pos[o[0]], pos[o[2]] - pos[o[0]]) * (1.0f / 6);
+          denom += w[p[j]] * grad[j].squared();
+        }
+        if (denom == 0) continue;
+
+        float lambda = (v[i].rest_volume - tetra_volume(pos[0], pos[1], pos[2], pos[3])) / denom;
+        for (int j = 0; j != 4; ++j) {
+          float s = lambda * w[p[j]];
+          x[p[j]] += s * grad[j].x(); y[p[j]] += s * grad[j].y(); z[p[j]] += s * grad[j].z();
+        }
+      }
+    }
+
+    static float tetra_volume(vec3_in p0, vec3_in p1, vec3_in p2, vec3_in p3) {
+      return dot(cross(p1 - p0, p2 - p0), p3 - p0) * (1.0f / 6);
+    }
+
+    vec3 get_pos(int i) const {
+      return vec3(px[i], py[i], pz[i]);
+    }
+
+  public:
+    RESOURCE_META(mesh_soft_body)
+
+    /// Make an empty soft body.
+    mesh_soft_body() {
+      gravity = vec3(0, -9.8f, 0);
+      damping = 0;
+      coloured = false;
+      built = false;
+    }
+
+    /// Add a particle. An inverse mass of zero pins it in place. Returns the particle index.
+    int add_particle(vec3_in pos, float inv_mass, vec2_in uv = vec2(0, 0)) {
+      px.push_back(pos.x());
+      py.push_back(pos.y());
+      pz.push_back(pos.z());
+      this->inv_mass.push_back(inv_mass);
+      uvs.push_back(uv);
+      coloured = built = false;
+      return (int)px.size() - 1;
+    }
+
+    /// Add a distance constraint (a spring) at the current distance between two particles.
+    void add_distance(int p0, int p1, float compliance = 0) {
+      assert(p0 != p1);
+      distance d;
+      d.p[0] = std::min(p0, p1);
+      d.p[1] = std::max(p0, p1);
+      d.rest_length = (get_pos(p0) - get_pos(p1)).length();
+      d.compliance = compliance;
+      distances.push_back(d);
+      coloured = built = false;
+    }
+
+    /// Add a constraint that keeps the volume of a tetrahedron.
+    void add_volume(int p0, int p1, int p2, int p3, float compliance = 0) {
+      volume v;
+      v.p[0] = p0; v.p[1] = p1; v.p[2] = p2; v.p[3] = p3;
+      v.rest_volume = tetra_volume(get_pos(p0), get_pos(p1), get_pos(p2), get_pos(p3));
+      v.compliance = compliance;
+      volumes.push_back(v);
+      coloured = built = false;
+    }
+
+    /// Add a tetrahedron: six edges and a volume constraint. Shared edges are merged by build().
+    void add_tetra(int p0, int p1, int p2, int p3, float edge_compliance, float volume_compliance) {
+      add_distance(p0, p1, edge_compliance);
+      add_distance(p0, p2, edge_compliance);
+      add_distance(p0, p3, edge_compliance);
+      add_distance(p1, p2, edge_compliance);
+      add_distance(p1, p3, edge_compliance);
+      add_distance(p2, p3, edge_compliance);
+      add_volume(p0, p1, p2, p3, volume_compliance);
+    }
+
+    /// Add a triangle to draw.
+    void add_face(int p0, int p1, int p2) {
+      faces.push_back(p0);
+      faces.push_back(p1);
+      faces.push_back(p2);
+      coloured = built = false;
+    }
+
+    /// Set the acceleration due to gravity.
+    void set_gravity(vec3_in value) {
+      gravity = value;
+    }
+
+    /// Set the fraction of velocity lost per second.
+    void set_damping(float value) {
+      damping = value;
+    }
+
+    /// Colour the constraints without making render buffers, so that the body can be simulated
+    /// without a GL context. build() does this too.
+    void build_constraints() {
+      unsigned num_particles = px.size();
+      prev_x.resize(num_particles);
+      prev_y.resize(num_particles);
+      prev_z.resize(num_particles);
+      vel_x.resize(num_particles);
+      vel_y.resize(num_particles);
+      vel_z.resize(num_particles);
+      memset(vel_x.data(), 0, num_particles * sizeof(float));
+      memset(vel_y.data(), 0, num_particles * sizeof(float));
+      memset(vel_z.data(), 0, num_particles * sizeof(float));
+
+      // shared edges of neighbouring tetrahedra.
+      std::sort(distances.data(), distances.data() + distances.size(), [](const distance &a, const distance &b) {
+        return a.p[0] == b.p[0] ? a.p[1] < b.p[1] : a.p[0] < b.p[0];
+      });
+      distance *last = std::unique(distances.data(), distances.data() + distances.size(), [](const distance &a, const distance &b) {
+        return a.p[0] == b.p[0] && a.p[1] == b.p[1];
+      });
+      distances.resize((unsigned)(last - distances.data()));
+
+      colour_constraints<distance, 2>(distances, distance_colours, num_particles);
+      colour_constraints<volume, 4>(volumes, volume_colours, num_particles);
+
+      // faces around each particle, for normals.
+      unsigned num_faces = faces.size() / 3;
+      particle_face_start.resize(num_particles + 1);
+      memset(particle_face_start.data(), 0, particle_face_start.size() * sizeof(unsigned));
+      for (unsigned i = 0; i != faces.size(); ++i) {
+        particle_face_start[faces[i] + 1]++;
+      }
+      for (unsigned i = 0; i != num_particles; ++i) {
+        particle_face_start[i+1] += particle_face_start[i];
+      }
+      particle_faces.resize(faces.size());
+      dynarray<unsigned> next = particle_face_start;
+      for (unsigned i = 0; i != faces.size(); ++i) {
+        particle_faces[next[faces[i]]++] = i / 3;
+      }
+      face_normals.resize(num_faces);
+      coloured = true;
+    }
+
+    /// Colour the constraints and make the render buffers. Call after adding everything.
+    void build() {
+      build_constraints();
+
+      unsigned num_particles = px.size();
+      clear_attributes();
+      set_default_attributes();
+      set_params(sizeof(vertex), faces.size(), num_particles, GL_TRIANGLES, GL_UNSIGNED_INT);
+      get_vertices()->allocate(GL_ARRAY_BUFFER, num_particles * sizeof(vertex), GL_DYNAMIC_DRAW);
+      get_indices()->allocate(GL_ELEMENT_ARRAY_BUFFER, faces.size() * sizeof(uint32_t));
+      if (faces.size()) {
+        get_indices()->assign(faces.data(), 0, faces.size() * sizeof(uint32_t));
+      }
+      built = true;
+      update();
+    }
+
+    /// Number of particles.
+    unsigned get_num_particles() const {
+      return px.size();
+    }
+
+    /// Number of distance constraints (after build(), without duplicates).
+    unsigned get_num_distances() const {
+      return distances.size();
+    }
+
+    /// Number of volume constraints.
+    unsigned get_num_volumes() const {
+      return volumes.size();
+    }
+
+    /// Number of colours used by the distance and volume constraints.
+    unsigned get_num_colours() const {
+      unsigned n = 0;
+      for (unsigned c = 0; c + 1 < distance_colours.size(); ++c) n += distance_colours[c] != distance_colours[c+1];
+      for (unsigned c = 0; c + 1 < volume_colours.size(); ++c) n += volume_colours[c] != volume_colours[c+1];
+      return n;
+    }
+
+    /// Get the position of a particle.
+    vec3 get_particle_pos(int i) const {
+      return get_pos(i);
+    }
+
+    /// Move a particle, for example one that is pinned.
+    void set_particle_pos(int i, vec3_in pos) {
+      px[i] = pos.x(); py[i] = pos.y(); pz[i] = pos.z();
+    }
+
+    /// Advance the simulation by delta_t seconds.
+    void simulate(float delta_t, int num_substeps = 10) {
+      if (!coloured) build();
+
+      unsigned num_particles = px.size();
+      float dt = delta_t / num_substeps;
+      float inv_dt = 1.0f / dt;
+      float inv_dt2 = inv_dt * inv_dt;
+      float keep = std::max(0.0f, 1.0f - damping * dt);
+      float gx = gravity.x() * dt, gy = gravity.y() * dt, gz = gravity.z() * dt;
+
+      for (int step = 0; step != num_substeps; ++step) {
+        // predict positions from velocity.
+        for (unsigned i = 0; i != num_particles; ++i) {
+          prev_x[i] = px[i]; prev_y[i] = py[i]; prev_z[i] = pz[i];
+          if (inv_mass[i] == 0) continue;
+          vel_x[i] = (vel_x[i] + gx) * keep;
+          vel_y[i] = (vel_y[i] + gy) * keep;
+          vel_z[i] = (vel_z[i] + gz) * keep;
+          px[i] += vel_x[i] * dt;
+          py[i] += vel_y[i] * dt;
+          pz[i] += vel_z[i] * dt;
+        }
+
+        for_each_colour(distance_colours, [this, inv_dt2](int begin, int end) { solve_distances(begin, end, inv_dt2); });
+        for_each_colour(volume_colours, [this, inv_dt2](int begin, int end) { solve_volumes(begin, end, inv_dt2); });
+
+        // the velocity is whatever moved the particles.
+        for (unsigned i = 0; i != num_particles; ++i) {
+          vel_x[i] = (px[i] - prev_x[i]) * inv_dt;
+          vel_y[i] = (py[i] - prev_y[i]) * inv_dt;
+          vel_z[i] = (pz[i] - prev_z[i]) * inv_dt;
+        }
+      }
+    }
+
+    /// Write positions and normals to the vertex buffer.
+    virtual void update() {
+      unsigned num_particles = px.size();
+      unsigned num_faces = faces.size() / 3;
+      if (!built || !num_particles) return;
+
+      const uint32_t *f = faces.data();
+      vec3p *fn = face_normals.data();
+      job_scheduler::get().parallel_for(0, (int)num_faces, parallel_grain, [this, f, fn](int begin, int end) {
+        for (int i = begin; i != end; ++i) {
+          vec3 p0 = get_pos(f[i*3+0]), p1 = get_pos(f[i*3+1]), p2 = get_pos(f[i*3+2]);
+          fn[i] = cross(p1 - p0, p2 - p0);
+        }
+      });
+
+      vertex *dest = (vertex*)get_vertices()->lock_write_discard();
+      job_scheduler::get().parallel_for(0, (int)num_particles, parallel_grain, [this, fn, dest](int begin, int end) {
+        for (int i = begin; i != end; ++i) {
+          vec3 normal(0, 0, 0);
+          for (unsigned j = particle_face_start[i]; j != particle_face_start[i+1]; ++j) {
+            normal += (vec3)fn[particle_faces[j]];
+          }
+          vertex &v = dest[i];
+          v.pos = get_pos(i);
+          v.normal = normal.squared() < 1e-12f ? vec3(1, 0, 0) : normalize(normal);
+          v.uv = uvs[i];
+        }
+      });
+      get_vertices()->unlock_write_only();
+
+      vec3 vmin = get_pos(0), vmax = vmin;
+      for (unsigned i = 1; i != num_particles; ++i) {
+        vec3 pos = get_pos(i);
+        vmin = min(vmin, pos);
+        vmax = max(vmax, pos);
+      }
+      set_aabb(aabb((vmax + vmin) * 0.5f, (vmax - vmin) * 0.5f));
+    }
+  };
+
+  #if OCTET_BENCHMARK
+    /// Constraints per second for a block of 44x44x44 cubes, five tetrahedra each, hanging from its top face.
+    /// About a million constraints in total. Only the solver is timed: build_constraints() needs no GL context.
+    class mesh_soft_body_benchmark {
+      enum { n = 44, num_substeps = 10 };
+
+      static int corner(int i, int j, int k) {
+        return (k * (n + 1) + j) * (n + 1) + i;
+      }
+
+    public:
+      mesh_soft_body_benchmark() {
+        // the corners of each cube are numbered x + 2y + 4z. The even corners make the middle tetrahedron,
+        // each odd corner a tetrahedron with its three neighbours. Every other cube is mirrored so the faces match.
+        static const int tetras[5][4] = { { 0, 3, 5, 6 }, { 1, 0, 3, 5 }, { 2, 0, 3, 6 }, { 4, 0, 5, 6 }, { 7, 3, 5, 6 } };
+
+        ref<mesh_soft_body> body = new mesh_soft_body();
+        for (int k = 0; k <= n; ++k) {
+          for (int j = 0; j <= n; ++j) {
+            for (int i = 0; i <= n; ++i) {
+              body->add_particle(vec3((float)i, (float)j, (float)k) * 0.1f, j == n ? 0.0f : 1.0f);
+            }
+          }
+        }
+        for (int k = 0; k != n; ++k) {
+          for (int j = 0; j != n; ++j) {
+            for (int i = 0; i != n; ++i) {
+              int flip = (i + j + k) & 1;
+              for (int t = 0; t != 5; ++t) {
+                int p[4];
+                for (int c = 0; c != 4; ++c) {
+                  int bits = tetras[t][c] ^ flip;
+                  p[c] = corner(i + (bits & 1), j + (bits >> 1 & 1), k + (bits >> 2 & 1));
+                }
+                body->add_tetra(p[0], p[1], p[2], p[3], 1e-6f, 0);
+              }
+            }
+          }
+        }
+
+        benchmark_timer build_timer;
+        body->build_constraints();
+        double num_constraints = (double)body->get_num_distances() + body->get_num_volumes();
+        printf(
+          "mesh_soft_body_benchmark: %d particles, %d distances, %d volumes, %d colours\n",
+          body->get_num_particles(), body->get_num_distances(), body->get_num_volumes(), body->get_num_colours()
+        );
+        build_timer.report("build_constraints", num_constraints, "constraints");
+
+        benchmark_timer timer;
+        body->simulate(num_substeps / 60.0f, num_substeps);
+        timer.report("simulate, 10 substeps", num_constraints * num_substeps, "constraints");
+
+        // the bottom corner sags under gravity; the same with and without SSE.
+        printf("%-40s %10.6f\n", "bottom corner y", body->get_particle_pos(corner(0, 0, 0)).y());
+      }
+    };
+    static mesh_soft_body_benchmark mesh_soft_body_benchmark;
+  #endif
+}}
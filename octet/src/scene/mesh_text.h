@@ -15,6 +15,15 @@ namespace octet { namespace scene {
     int max_quads;
     string text;
     aabb bb;
+
+    // four vertices for each character, from the font's layout cache
+    dynarray<vertex> quads;
+
+    // incremented by update() so that batches know when to copy the quads again
+    unsigned version;
+
+    // if true, a text_overlay draws the quads and we don't need our own vertex buffer
+    bool batched;
   public:
     RESOURCE_META(mesh_text)
 
@@ -24,6 +33,8 @@ namespace octet { namespace scene {
       text = text_;
       bb = bb_ ? *bb_ : aabb(vec3(0, 0, 0), vec3(64, 64, 0));
       max_quads = 0;
+      version = 0;
+      batched = false;
 
 	    add_attribute(attribute_pos, 3, GL_FLOAT, sizeof(float)*0);
 	    add_attribute(attribute_uv, 2, GL_FLOAT, sizeof(float)*3);
@@ -48,29 +59,50 @@ namespace octet { namespace scene {
     void update() {
       if (!font) return;
 
-      if (text.size() > max_quads) {
-        max_quads = std::max(32, (text.size() + 15) & ~15); // round up to 16
+      quads.resize(0);
+      font->layout_text(quads, bb, text.c_str(), text.c_str() + text.size());
+      version++;
+
+      if (batched) return;
+
+      int num_quads = (int)quads.size() / 4;
+      if (num_quads > max_quads) {
+        max_quads = std::max(32, (num_quads + 15) & ~15); // round up to 16
 	      unsigned max_vertices = max_quads * 4;
 	      unsigned max_indices = max_quads * 6;
 	      unsigned vsize = sizeof(vertex) * max_vertices;
 	      unsigned isize = sizeof(uint32_t) * max_indices;
 	      allocate(vsize, isize);
-      }
 
-      vertex *vtx = (vertex *)get_vertices()->lock();
-      uint32_t *idx = (uint32_t *)get_indices()->lock();
+        // the indices are the same for every string
+        gl_resource::wolock idx_lock(get_indices());
+        bitmap_font::make_quad_indices(idx_lock.u32(), 0, max_quads);
+      }
 
-      unsigned num_quads = font->build_mesh(
-        bb, vtx, idx, max_quads,
-        text.c_str(), text.c_str() + text.size()
-      );
+      if (num_quads) {
+        gl_resource::wolock vtx_lock(get_vertices());
+        memcpy(vtx_lock.u8(), quads.data(), num_quads * 4 * sizeof(vertex));
+      }
 
-      get_vertices()->unlock();
-      get_indices()->unlock();
       set_num_indices(num_quads * 6);
       set_num_vertices(num_quads * 4);
     }
 
+    /// The vertices of the text, four for each character. Valid after update().
+    const dynarray<vertex> &get_quads() const {
+      return quads;
+    }
+
+    /// Changes every time update() is called.
+    unsigned get_version() const {
+      return version;
+    }
+
+    /// If true, the text is drawn by a text_overlay and update() does not fill the vertex buffer.
+    void set_batched(bool value) {
+      batched = value;
+    }
+
     /// Serialize.
     void visit(visitor &v) {
       mesh::visit(v);
@@ -4,21 +4,34 @@
 //
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
-// Mesh smooth modifier. Work in progress.
+// Voxel mesh from a sparse voxel octree.
 //
 
 namespace octet { namespace scene {
-  /// Box mesh. Generate triangles for an AABB.
+  /// Voxel mesh. Generate faces for the surface of a sparse voxel world.
+  ///
+  /// Example:
+  ///
+  ///     mesh_voxel_grid *grid = new mesh_voxel_grid(aabb(vec3(0), vec3(16)), ivec3(256, 256, 256));
+  ///     grid->set_voxel(ivec3(1, 2, 3), 1);
+  ///     grid->update();
   class mesh_voxel_grid : public mesh {
     struct uint8_traits_t {
       static bool is_transparent(uint8_t value) {
         return value == 0;
       }
     };
-    voxel_grid<uint8_t, uint8_traits_t> shape;
+    typedef sparse_voxel_octree<uint8_t, uint8_traits_t> shape_t;
+    shape_t shape;
     mat4t transform;
 
-    void init(aabb_in size, ivec3 dim) {
+    void init(aabb_in size, ivec3_in dim) {
+      // the octree is a power of two in size; dim voxels fill the aabb.
+      int max_dim = std::max(1, std::max(dim.x(), std::max(dim.y(), dim.z())));
+      int log_dim = 0;
+      while ((1 << log_dim) < max_dim) ++log_dim;
+      vec3 voxel_size = size.get_half_extent() * 2.0f / vec3(std::max(1, dim.x()), std::max(1, dim.y()), std::max(1, dim.z()));
+      shape.init(log_dim, size.get_min(), voxel_size);
       set_default_attributes();
       set_aabb(size);
       update();
@@ -36,11 +49,23 @@ namespace octet { namespace scene {
       init(bb, dim);
     }
 
+    /// Set one voxel (0 is empty). Call update() after a batch of changes.
+    void set_voxel(ivec3_in pos, uint8_t value) {
+      shape.set(pos, value);
+    }
+
+    uint8_t get_voxel(ivec3_in pos) const {
+      return shape.get(pos);
+    }
+
+    /// The voxels, for bulk edits, undo and uploading to the GPU.
+    shape_t &get_shape() {
+      return shape;
+    }
+
     /// Generate mesh from parameters.
     virtual void update() {
-      aabb aabb_ = get_aabb();
-      mesh::set_shape<voxel_grid<uint8_t, uint8_traits_t>, mesh::vertex>(shape, transform, 1);
+      mesh::set_shape<shape_t, mesh::vertex>(shape, transform, 1);
     }
   };
 }}
-
@@ -0,0 +1,660 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Ray, sweep and overlap queries for voxel worlds
+//
+
+namespace octet { namespace scene {
+  /// Result of a voxel ray cast.
+  struct voxel_hit {
+    /// true if the ray hit a voxel.
+    bool found;
+
+    /// the voxel that was hit, counting from the corner of the world.
+    ivec3 voxel;
+
+    /// model space normal of the face that was hit; zero if the ray started inside a voxel.
+    vec3 normal;
+
+    /// distance along the ray in units of the direction vector.
+    float distance;
+  };
+
+  /// Queries against a mesh_voxels world.
+  ///
+  /// All queries skip empty space using the subcube LODs and a coarse pyramid over the subcubes.
+  /// Rays walk each row of 32 voxels with a single mask and bit scan, rather than a voxel at a time.
+  /// Queries are in the model space of the mesh; transform rays and boxes into it first.
+  ///
+  /// Call update() after changing the world (and after mesh_voxels::update_lod()).
+  ///
+  /// Example:
+  ///
+  ///     mesh_voxel_query query(world);
+  ///     voxel_hit hit;
+  ///     if (query.ray_cast(hit, origin, direction, 100.0f)) {
+  ///       log("hit voxel at %f\n", hit.distance);
+  ///     }
+  ///     vec3 move = query.sweep_aabb(player_box, velocity * dt);
+  class mesh_voxel_query {
+    enum {
+      log_subcube_dim = 5,
+      subcube_dim = 1 << log_subcube_dim,
+      max_levels = 32,
+
+      // overlap() splits the work into at least this many pairs of nodes for the threads.
+      min_parallel_pairs = 256,
+    };
+
+    // not owned: the world must outlive the query.
+    mesh_voxels *voxels;
+
+    // size of the world in voxels.
+    ivec3 dims;
+    float voxel_size;
+    vec3 corner;
+
+    // one byte per node for levels above the subcubes (log_subcube_dim and up).
+    dynarray<uint8_t> pyramid;
+    unsigned level_offset[max_levels];
+    ivec3 level_size[max_levels];
+    int top_level;
+
+    // a pair of nodes from two worlds for overlap().
+    struct node_pair {
+      ivec3 pos[2];
+      int level[2];
+    };
+
+    static uint32_t row_mask(int lo, int hi) {
+      // bits lo to hi inclusive
+      return (0xffffffffu >> (31 - hi)) & (0xffffffffu << lo);
+    }
+
+    static int lowest_bit(uint32_t bits) {
+      return 31 - clz(bits & (0u - bits));
+    }
+
+    static int highest_bit(uint32_t bits) {
+      return 31 - clz(bits);
+    }
+
+    // 0 <= pos < size
+    static bool inside(ivec3_in pos, ivec3_in size) {
+      return
+        (unsigned)pos.x() < (unsigned)size.x() &&
+        (unsigned)pos.y() < (unsigned)size.y() &&
+        (unsigned)pos.z() < (unsigned)size.z()
+      ;
+    }
+
+    mesh_voxel_subcube *get_subcube(ivec3_in voxel) const {
+      return voxels->get_subcube(voxel >> log_subcube_dim);
+    }
+
+    /// is there any solid voxel in the node at pos (in units of 1 << level voxels)?
+    bool node_any(ivec3_in pos, int level) const {
+      if (level >= log_subcube_dim) {
+        if (level > top_level) return (pos.x() | pos.y() | pos.z()) == 0;
+        ivec3 sz = level_size[level];
+        if (!inside(pos, sz)) return false;
+        return pyramid[level_offset[level] + pos.x() + sz.x() * (pos.y() + sz.y() * pos.z())] != 0;
+      } else {
+        int shift = log_subcube_dim - level;
+        ivec3 cube = pos >> shift;
+        if (!inside(cube, level_size[log_subcube_dim])) return false;
+        mesh_voxel_subcube *subcube = voxels->get_subcube(cube);
+        return subcube && subcube->is_any(pos & ivec3((1 << shift) - 1), level) != 0;
+      }
+    }
+
+    // for ray casts: the time at which a ray leaves the box of voxels [lo, hi) and the axis it leaves by.
+    static float exit_box(int &axis, ivec3_in lo, ivec3_in hi, vec3_in start, vec3_in dir, vec3_in inv_dir) {
+      float t = 1e30f;
+      axis = 0;
+      for (int i = 0; i != 3; ++i) {
+        if (dir[i] != 0) {
+          float ti = ((dir[i] > 0 ? hi[i] : lo[i]) - start[i]) * inv_dir[i];
+          if (ti < t) { t = ti; axis = i; }
+        }
+      }
+      return t;
+    }
+
+    // the voxel a ray enters when it leaves [lo, hi) by axis at time t.
+    static ivec3 next_voxel(int axis, float t, ivec3_in lo, ivec3_in hi, vec3_in start, vec3_in dir) {
+      ivec3 result;
+      for (int i = 0; i != 3; ++i) {
+        if (i == axis) {
+          result[i] = dir[i] > 0 ? hi[i] : lo[i] - 1;
+        } else {
+          int v = (int)floorf(start[i] + dir[i] * t);
+          result[i] = std::max(lo[i], std::min(v, hi[i] - 1));
+        }
+      }
+      return result;
+    }
+
+    // test the box of a node against another node with spheres, then boxes.
+    bool nodes_overlap(const mesh_voxel_query &b, const node_pair &p, mat4t_in mxa, mat4t_in mxb) const {
+      const mesh_voxel_query *q[2] = { this, &b };
+      vec3 center[2], half[2];
+      vec3 world_center[2];
+      float radius[2];
+      for (int i = 0; i != 2; ++i) {
+        float node_size = q[i]->voxel_size * (1 << p.level[i]);
+        center[i] = q[i]->corner + (vec3(p.pos[i]) + 0.5f) * node_size;
+        half[i] = vec3(node_size * 0.5f);
+        world_center[i] = (center[i].xyz1() * (i ? mxb : mxa)).xyz();
+        radius[i] = node_size * 0.8660254f;
+      }
+
+      if (squared(world_center[0] - world_center[1]) > squared(radius[0] + radius[1])) return false;
+
+      obb box_a(center[0], half[0], mxa);
+      obb box_b(center[1], half[1], mxb);
+      return box_a.intersects(box_b);
+    }
+
+    // add the pairs of non-empty children of a pair of nodes that overlap; split the bigger node.
+    void split_pair(dynarray<node_pair> &result, const mesh_voxel_query &b, const node_pair &p, mat4t_in mxa, mat4t_in mxb) const {
+      const mesh_voxel_query *q[2] = { this, &b };
+      float size_a = voxel_size * (1 << p.level[0]);
+      float size_b = b.voxel_size * (1 << p.level[1]);
+      int side = p.level[0] == 0 || (p.level[1] != 0 && size_b > size_a) ? 1 : 0;
+      for (int i = 0; i != 8; ++i) {
+        node_pair child = p;
+        child.level[side]--;
+        child.pos[side] = p.pos[side] * 2 + ivec3(i & 1, (i >> 1) & 1, (i >> 2) & 1);
+        if (q[side]->node_any(child.pos[side], child.level[side]) && nodes_overlap(b, child, mxa, mxb)) {
+          result.push_back(child);
+        }
+      }
+    }
+
+    // depth first search from one pair of nodes.
+    bool overlap_pair(const mesh_voxel_query &b, const node_pair &root, mat4t_in mxa, mat4t_in mxb, std::atomic<bool> &found) const {
+      dynarray<node_pair> stack;
+      stack.reserve(64);
+      stack.push_back(root);
+      while (!stack.empty()) {
+        if (found.load(std::memory_order_relaxed)) return true;
+        node_pair p = stack.back();
+        stack.pop_back();
+        if (p.level[0] == 0 && p.level[1] == 0) return true;
+        split_pair(stack, b, p, mxa, mxb);
+      }
+      return false;
+    }
+
+  public:
+    /// Make queries for a world. The world must have its LODs up to date.
+    mesh_voxel_query(mesh_voxels *voxels_in = 0) {
+      voxels = 0;
+      top_level = 0;
+      voxel_size = 1;
+      if (voxels_in) init(voxels_in);
+    }
+
+    void init(mesh_voxels *voxels_in) {
+      voxels = voxels_in;
+      update();
+    }
+
+    /// Rebuild the pyramid of empty space after changing the world.
+    void update() {
+      ivec3 size = voxels->get_size();
+      dims = size * subcube_dim;
+      voxel_size = voxels->get_voxel_size();
+      corner = vec3(size) * (voxel_size * (-0.5f * subcube_dim));
+
+      // count the levels: one node per subcube, up to a single node.
+      unsigned total = 0;
+      int level = log_subcube_dim;
+      for (ivec3 sz = size; ; sz = (sz + 1) >> 1) {
+        level_offset[level] = total;
+        level_size[level] = sz;
+        total += sz.x() * sz.y() * sz.z();
+        top_level = level;
+        if ((sz.x() == 1 && sz.y() == 1 && sz.z() == 1) || level == max_levels - 1) break;
+        level++;
+      }
+      pyramid.resize(total);
+
+      // subcubes
+      uint8_t *dest = pyramid.data();
+      for (int z = 0; z != size.z(); ++z) {
+        for (int y = 0; y != size.y(); ++y) {
+          for (int x = 0; x != size.x(); ++x) {
+            mesh_voxel_subcube *subcube = voxels->get_subcube(ivec3(x, y, z));
+            *dest++ = subcube && subcube->is_any(ivec3(0, 0, 0), log_subcube_dim) ? 1 : 0;
+          }
+        }
+      }
+
+      // each node is the OR of up to eight nodes below.
+      for (int level = log_subcube_dim + 1; level <= top_level; ++level) {
+        ivec3 sz = level_size[level], below = level_size[level-1];
+        const uint8_t *src = pyramid.data() + level_offset[level-1];
+        for (int z = 0; z != sz.z(); ++z) {
+          for (int y = 0; y != sz.y(); ++y) {
+            for (int x = 0; x != sz.x(); ++x) {
+              uint8_t any = 0;
+              for (int i = 0; i != 8; ++i) {
+                ivec3 pos = ivec3(x*2 + (i & 1), y*2 + ((i >> 1) & 1), z*2 + (i >> 2));
+                if (inside(pos, below)) {
+                  any |= src[pos.x() + below.x() * (pos.y() + below.y() * pos.z())];
+                }
+              }
+              *dest++ = any;
+            }
+          }
+        }
+      }
+    }
+
+    /// size of the world in voxels.
+    ivec3 get_dims() const {
+      return dims;
+    }
+
+    /// Is voxel pos solid? Voxels outside the world are empty.
+    bool is_solid(ivec3_in pos) const {
+      if (!inside(pos, dims)) return false;
+      ivec3 local = pos & ivec3(subcube_dim - 1);
+      return (get_subcube(pos)->get_row(local.y(), local.z()) >> local.x()) & 1;
+    }
+
+    /// Are any voxels in the box [min, max) solid?
+    bool any_solid(ivec3_in min_in, ivec3_in max_in) const {
+      ivec3 lo = min_in.max(ivec3(0, 0, 0));
+      ivec3 hi = max_in.min(dims);
+      if (lo.x() >= hi.x() || lo.y() >= hi.y() || lo.z() >= hi.z()) return false;
+
+      ivec3 cube_lo = lo >> log_subcube_dim;
+      ivec3 cube_hi = (hi + (subcube_dim - 1)) >> log_subcube_dim;
+      for (int cz = cube_lo.z(); cz != cube_hi.z(); ++cz) {
+        for (int cy = cube_lo.y(); cy != cube_hi.y(); ++cy) {
+          for (int cx = cube_lo.x(); cx != cube_hi.x(); ++cx) {
+            ivec3 cube(cx, cy, cz);
+            if (!node_any(cube, log_subcube_dim)) continue;
+
+            // the part of the box in this subcube, then 32 voxels at a time in x.
+            ivec3 base = cube * subcube_dim;
+            ivec3 a = lo.max(base) - base;
+            ivec3 b = hi.min(base + subcube_dim) - base;
+            uint32_t mask = row_mask(a.x(), b.x() - 1);
+            mesh_voxel_subcube *subcube = voxels->get_subcube(cube);
+            for (int z = a.z(); z != b.z(); ++z) {
+              for (int y = a.y(); y != b.y(); ++y) {
+                if (subcube->get_row(y, z) & mask) return true;
+              }
+            }
+          }
+        }
+      }
+      return false;
+    }
+
+    /// Find the first solid voxel along a ray from origin in direction, up to max_distance * length(direction).
+    bool ray_cast(voxel_hit &hit, vec3_in origin, vec3_in direction, float max_distance) const {
+      hit.found = false;
+      hit.distance = max_distance;
+
+      // in voxel units from the corner of the world.
+      float inv_size = 1.0f / voxel_size;
+      vec3 start = (origin - corner) * inv_size;
+      vec3 dir = direction * inv_size;
+      vec3 inv_dir;
+
+      // clip the ray to the world.
+      float t = 0, t_end = max_distance;
+      int axis = -1;
+      for (int i = 0; i != 3; ++i) {
+        if (dir[i] == 0) {
+          if (start[i] < 0 || start[i] >= dims[i]) return false;
+          inv_dir[i] = 0;
+        } else {
+          inv_dir[i] = 1.0f / dir[i];
+          float t0 = (0 - start[i]) * inv_dir[i];
+          float t1 = (dims[i] - start[i]) * inv_dir[i];
+          if (t0 > t1) std::swap(t0, t1);
+          if (t0 > t) { t = t0; axis = i; }
+          t_end = std::min(t_end, t1);
+        }
+      }
+      if (t > t_end) return false;
+
+      ivec3 voxel;
+      for (int i = 0; i != 3; ++i) {
+        int v = i == axis ? (dir[i] > 0 ? 0 : dims[i] - 1) : (int)floorf(start[i] + dir[i] * t);
+        voxel[i] = std::max(0, std::min(v, dims[i] - 1));
+      }
+
+      while (t <= t_end && inside(voxel, dims)) {
+        // skip the biggest empty node we are in.
+        int level = top_level;
+        while (level != 0 && node_any(voxel >> level, level)) {
+          level--;
+        }
+
+        if (level != 0) {
+          ivec3 lo = (voxel >> level) << level;
+          ivec3 hi = lo + (1 << level);
+          float t_exit = exit_box(axis, lo, hi, start, dir, inv_dir);
+          t = std::max(t, t_exit);
+          voxel = next_voxel(axis, t, lo, hi, start, dir);
+          continue;
+        }
+
+        // a row of 32 voxels in x: find the voxels the ray passes in this row and scan their bits.
+        ivec3 lo(voxel.x() & ~(subcube_dim - 1), voxel.y(), voxel.z());
+        ivec3 hi(lo.x() + subcube_dim, voxel.y() + 1, voxel.z() + 1);
+        int exit_axis;
+        float t_exit = std::max(t, exit_box(exit_axis, lo, hi, start, dir, inv_dir));
+
+        int last_x = voxel.x();
+        if (exit_axis == 0) {
+          last_x = dir.x() > 0 ? hi.x() - 1 : lo.x();
+        } else if (dir.x() > 0) {
+          last_x = std::max(voxel.x(), std::min((int)ceilf(start.x() + dir.x() * t_exit) - 1, hi.x() - 1));
+        } else if (dir.x() < 0) {
+          last_x = std::min(voxel.x(), std::max((int)floorf(start.x() + dir.x() * t_exit), lo.x()));
+        }
+
+        int first = voxel.x() - lo.x(), last = last_x - lo.x();
+        uint32_t bits = get_subcube(voxel)->get_row(voxel.y() & (subcube_dim - 1), voxel.z() & (subcube_dim - 1));
+        bits &= row_mask(std::min(first, last), std::max(first, last));
+        if (bits) {
+          int x = dir.x() >= 0 ? lowest_bit(bits) : highest_bit(bits);
+          if (x != first) {
+            // entered the voxel through its x face.
+            t = ((dir.x() > 0 ? x : x + 1) + lo.x() - start.x()) * inv_dir.x();
+            axis = 0;
+          }
+          if (t > t_end) return false;
+          hit.found = true;
+          hit.voxel = ivec3(x + lo.x(), voxel.y(), voxel.z());
+          hit.distance = t;
+          hit.normal = vec3(0, 0, 0);
+          if (axis != -1) hit.normal[axis] = dir[axis] > 0 ? -1.0f : 1.0f;
+          return true;
+        }
+
+        t = t_exit;
+        axis = exit_axis;
+        voxel = next_voxel(axis, t, lo, hi, start, dir);
+      }
+      return false;
+    }
+
+    /// Cast many rays on all the cores. Returns the number of rays that hit.
+    unsigned ray_cast(voxel_hit *hits, const vec3p *origins, const vec3p *directions, unsigned num_rays, float max_distance) const {
+      std::atomic<unsigned> num_hits(0);
+      job_scheduler::get().parallel_for(0, (int)num_rays, 1024, [&](int begin, int end) {
+        unsigned n = 0;
+        for (int i = begin; i != end; ++i) {
+          n += ray_cast(hits[i], vec3(origins[i]), vec3(directions[i]), max_distance);
+        }
+        num_hits.fetch_add(n, std::memory_order_relaxed);
+      });
+      return num_hits;
+    }
+
+    /// Move a box through the world, stopping at solid voxels.
+    ///
+    /// The box moves in x, then y, then z so that it slides along walls and floors like a
+    /// character controller. Returns the distance moved; blocked_axes gets 1, 2 and 4 for x, y and z.
+    /// The box should start clear of solid voxels.
+    vec3 sweep_aabb(const aabb &box, vec3_in motion, unsigned *blocked_axes = 0) const {
+      float inv_size = 1.0f / voxel_size;
+      vec3 lo = (box.get_min() - corner) * inv_size;
+      vec3 hi = (box.get_max() - corner) * inv_size;
+      vec3 move = motion * inv_size;
+      unsigned blocked = 0;
+
+      for (int axis = 0; axis != 3; ++axis) {
+        float m = move[axis];
+        if (m == 0) continue;
+
+        // voxels covered by the other two axes.
+        ivec3 vlo, vhi;
+        for (int i = 0; i != 3; ++i) {
+          vlo[i] = (int)floorf(lo[i]);
+          vhi[i] = (int)ceilf(hi[i]);
+        }
+
+        // the layers of voxels that the leading face passes through.
+        int first, last, step;
+        if (m > 0) {
+          first = (int)ceilf(hi[axis]);
+          last = (int)ceilf(hi[axis] + m) - 1;
+          step = 1;
+        } else {
+          first = (int)floorf(lo[axis]) - 1;
+          last = (int)floorf(lo[axis] + m);
+          step = -1;
+        }
+
+        if ((last - first) * step >= 0) {
+          // check the whole swept box first.
+          ivec3 slo = vlo, shi = vhi;
+          slo[axis] = std::min(first, last);
+          shi[axis] = std::max(first, last) + 1;
+          if (any_solid(slo, shi)) {
+            for (int k = first; ; k += step) {
+              slo[axis] = k;
+              shi[axis] = k + 1;
+              if (any_solid(slo, shi)) {
+                m = m > 0 ? std::max(0.0f, k - hi[axis]) : std::min(0.0f, (k + 1) - lo[axis]);
+                blocked |= 1 << axis;
+                break;
+              }
+              if (k == last) break;
+            }
+          }
+        }
+
+        move[axis] = m;
+        lo[axis] += m;
+        hi[axis] += m;
+      }
+
+      if (blocked_axes) *blocked_axes = blocked;
+      return move * voxel_size;
+    }
+
+    /// Do two voxel worlds with model to world matrices mxa and mxb touch?
+    ///
+    /// Nodes are tested with bounding spheres, then boxes. The pairs near the top of the tree
+    /// are shared between the job_scheduler threads. The matrices should not scale.
+    bool overlaps(const mesh_voxel_query &b, mat4t_in mxa, mat4t_in mxb) const {
+      node_pair root;
+      root.pos[0] = root.pos[1] = ivec3(0, 0, 0);
+      root.level[0] = top_level;
+      root.level[1] = b.top_level;
+      if (!node_any(root.pos[0], root.level[0]) || !b.node_any(root.pos[1], root.level[1])) return false;
+      if (!nodes_overlap(b, root, mxa, mxb)) return false;
+
+      // split the tree breadth first until there is work for all the threads.
+      dynarray<node_pair> pairs, next;
+      pairs.push_back(root);
+      while (pairs.size() && pairs.size() < min_parallel_pairs) {
+        next.resize(0);
+        for (unsigned i = 0; i != pairs.size(); ++i) {
+          const node_pair &p = pairs[i];
+          if (p.level[0] == 0 && p.level[1] == 0) return true;
+          split_pair(next, b, p, mxa, mxb);
+        }
+        pairs.swap(next);
+      }
+
+      std::atomic<bool> found(false);
+      job_scheduler::get().parallel_for(0, (int)pairs.size(), 4, [&](int begin, int end) {
+        for (int i = begin; i != end && !found.load(std::memory_order_relaxed); ++i) {
+          if (overlap_pair(b, pairs[i], mxa, mxb, found)) {
+            found.store(true, std::memory_order_relaxed);
+          }
+        }
+      });
+      return found;
+    }
+  };
+
+  inline bool mesh_voxels::intersects(const mesh_voxels &b, const mat4t &mxa, const mat4t &mxb) const {
+    mesh_voxel_query qa(const_cast<mesh_voxels*>(this));
+    mesh_voxel_query qb(const_cast<mesh_voxels*>(&b));
+    return qa.overlaps(qb, mxa, mxb);
+  }
+
+  #if OCTET_UNIT_TEST
+    class mesh_voxel_query_unit_test {
+    public:
+      mesh_voxel_query_unit_test() {
+        // a 64x64x64 world with a floor at y = 10 and a single voxel at (40, 30, 20).
+        ref<mesh_voxels> world = new mesh_voxels(1.0f, ivec3(2, 2, 2));
+        for (int z = 0; z != 64; ++z) {
+          for (int x = 0; x != 2; ++x) {
+            world->get_subcube(ivec3(x, 0, z >> 5))->set_row(10, z & 31, 0xffffffff);
+          }
+        }
+        world->get_subcube(ivec3(1, 0, 0))->set_row(30, 20, 1 << 8);
+        world->update_lod();
+        mesh_voxel_query query(world);
+
+        // model space is centred on the world.
+        vec3 corner(-32, -32, -32);
+        voxel_hit hit;
+        assert(query.ray_cast(hit, corner + vec3(5.5f, 40, 5.5f), vec3(0, -1, 0), 100));
+        assert(all(hit.voxel == ivec3(5, 10, 5)) && all(hit.normal == vec3(0, 1, 0)) && fabsf(hit.distance - 29) < 1e-4f);
+        assert(!query.ray_cast(hit, corner + vec3(5.5f, 40, 5.5f), vec3(0, -1, 0), 28));
+
+        // diagonal ray to the single voxel from outside the world.
+        vec3 target = corner + vec3(40.5f, 30.5f, 20.5f);
+        vec3 from = target + vec3(-50, 30, 40);
+        assert(query.ray_cast(hit, from, target - from, 2));
+        assert(all(hit.voxel == ivec3(40, 30, 20)));
+
+        // compare with ray-box tests against every solid voxel.
+        octet::random r;
+        for (int i = 0; i != 200; ++i) {
+          vec3 o(r.get(-42.0f, 42.0f), r.get(-42.0f, 42.0f), r.get(-42.0f, 42.0f));
+          vec3 d = normalize(vec3(r.get(-1.0f, 1.0f), r.get(-1.0f, 1.0f), r.get(-1.0f, 1.0f)));
+          bool found = query.ray_cast(hit, o, d, 200);
+          float nearest = 200;
+          bool slow_found = false;
+          for (int z = 0; z != 64; ++z) {
+            for (int y = 0; y != 64; ++y) {
+              for (int x = 0; x != 64; ++x) {
+                if (!query.is_solid(ivec3(x, y, z))) continue;
+                vec3 t0 = (corner + vec3(x, y, z) - o) / d;
+                vec3 t1 = (corner + vec3(x + 1, y + 1, z + 1) - o) / d;
+                vec3 tmin = min(t0, t1), tmax = max(t0, t1);
+                float t_in = std::max(0.0f, std::max(tmin.x(), std::max(tmin.y(), tmin.z())));
+                float t_out = std::min(tmax.x(), std::min(tmax.y(), tmax.z()));
+                if (t_in <= t_out && t_in <= nearest) { nearest = t_in; slow_found = true; }
+              }
+            }
+          }
+          assert(found == slow_found);
+          assert(!found || fabsf(hit.distance - nearest) < 1e-3f);
+        }
+
+        // walk a 1x2x1 box into the single voxel and fall onto the floor.
+        aabb box(corner + vec3(38.5f, 30.5f, 20.5f), vec3(0.5f, 1.0f, 0.5f));
+        unsigned blocked = 0;
+        vec3 move = query.sweep_aabb(box, vec3(5, 0, 0), &blocked);
+        assert(blocked == 1 && all(move == vec3(1, 0, 0)));
+        move = query.sweep_aabb(box, vec3(0, -30, 0), &blocked);
+        assert(blocked == 2 && all(move == vec3(0, -18.5f, 0)));
+
+        // two floors overlap unless one is moved up by more than a voxel.
+        mat4t mxa, mxb;
+        assert(query.overlaps(query, mxa, mxb));
+        mxb.translate(0, 1.5f, 0);
+        assert(!query.overlaps(query, mxa, mxb));
+      }
+    };
+    static mesh_voxel_query_unit_test mesh_voxel_query_unit_test;
+  #endif
+
+  #if OCTET_BENCHMARK
+    /// Rays per second against a 1024x1024x1024 voxel terrain: steep rays that hit the
+    /// ground quickly and shallow rays that cross much of the world over the hills.
+    class mesh_voxel_query_benchmark {
+      enum { world_dim = 1024, num_rays = 1 << 16 };
+
+      static float height(int x, int z) {
+        return 300.0f + 120.0f * sinf(x * 0.007f) * cosf(z * 0.009f) + 40.0f * sinf(x * 0.05f + z * 0.03f);
+      }
+
+      // solid below the height, 32 voxels in x at a time.
+      static void make_terrain(mesh_voxels *world) {
+        int cubes = world_dim / 32;
+        for (int z = 0; z != world_dim; ++z) {
+          for (int cx = 0; cx != cubes; ++cx) {
+            int h[32], lo = world_dim, hi = 0;
+            for (int i = 0; i != 32; ++i) {
+              h[i] = (int)height(cx * 32 + i, z);
+              lo = std::min(lo, h[i]);
+              hi = std::max(hi, h[i]);
+            }
+            for (int y = 0; y < hi; ++y) {
+              uint32_t bits = 0xffffffff;
+              if (y >= lo) {
+                bits = 0;
+                for (int i = 0; i != 32; ++i) bits |= (uint32_t)(y < h[i]) << i;
+              }
+              world->get_subcube(ivec3(cx, y / 32, z / 32))->set_row(y & 31, z & 31, bits);
+            }
+          }
+        }
+        world->update_lod();
+      }
+
+      static void time_rays(const mesh_voxel_query &query, const char *name, float origin_y, float dir_y) {
+        random rand;
+        dynarray<vec3p> origins(num_rays);
+        dynarray<vec3p> directions(num_rays);
+        for (int i = 0; i != num_rays; ++i) {
+          origins[i] = vec3(rand.get(-500.0f, 500.0f), origin_y, rand.get(-500.0f, 500.0f));
+          directions[i] = normalize(vec3(rand.get(-1.0f, 1.0f), dir_y, rand.get(-1.0f, 1.0f)));
+        }
+        dynarray<voxel_hit> hits(num_rays);
+
+        unsigned num_hits = 0;
+        benchmark_timer timer;
+        for (int i = 0; i != num_rays; ++i) {
+          num_hits += query.ray_cast(hits[i], vec3(origins[i]), vec3(directions[i]), 2000.0f);
+        }
+        char text[64];
+        snprintf(text, sizeof(text), "%s, one thread", name);
+        timer.report(text, num_rays, "rays");
+
+        timer.reset();
+        unsigned num_batch_hits = query.ray_cast(hits.data(), origins.data(), directions.data(), num_rays, 2000.0f);
+        snprintf(text, sizeof(text), "%s, all threads", name);
+        timer.report(text, num_rays, "rays");
+        printf("%-40s %10.1f%%%s\n", "hits", num_hits * 100.0f / num_rays, num_hits == num_batch_hits ? "" : ", batch differs");
+      }
+    public:
+      mesh_voxel_query_benchmark() {
+        int cubes = world_dim / 32;
+        benchmark_timer timer;
+        ref<mesh_voxels> world = new mesh_voxels(1.0f, ivec3(cubes, cubes, cubes));
+        make_terrain(world);
+        mesh_voxel_query query(world);
+        printf("mesh_voxel_query_benchmark: %d^3 voxels, %d rays\n", world_dim, num_rays);
+        timer.report("make the terrain and the query");
+
+        // the hills are between y = -372 and -52.
+        time_rays(query, "steep rays", 400.0f, -2.0f);
+        time_rays(query, "shallow rays", -60.0f, -0.05f);
+      }
+    };
+    static mesh_voxel_query_benchmark mesh_voxel_query_benchmark;
+  #endif
+}}
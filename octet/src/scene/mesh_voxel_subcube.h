@@ -263,6 +263,16 @@ namespace octet { namespace scene {
       assert(any - any_opaque == num_lod);
     }
 
+    /// one bit for each voxel in a row of 32 in x.
+    uint32_t get_row(int y, int z) const {
+      return opaque[z*dim+y];
+    }
+
+    /// set a row of 32 voxels; call update_lod() when done.
+    void set_row(int y, int z, uint32_t bits) {
+      opaque[z*dim+y] = bits;
+    }
+
     void count_faces(mesh_iterate_faces<face_counter, dim> &count) {
       count.iterate(opaque);
     }
@@ -8,23 +8,6 @@
 //
 
 namespace octet { namespace scene {
-  class entry {
-  public:
-    ivec3 pos;
-    int level;
-    bool finished;
-
-    entry() {}
-
-    entry(int level_, ivec3 pos_, bool finished_) {
-      level = level_;
-      pos = pos_;
-      finished = finished_;
-    }
-  };
-
-  typedef pair<entry, entry> entries;
-
   /// Experimental Voxel world mesh, uses subcubes to create a voxel world.
   class mesh_voxels : public mesh {
     ivec3 size;
@@ -34,13 +17,6 @@ namespace octet { namespace scene {
 
     dynarray<ref<mesh_voxel_subcube> > subcubes;
 
-    struct kd_node {
-      int axis;
-      int kids[2];
-    };
-
-    dynarray<kd_node> kd_tree;
-
     unsigned is_all(ivec3_in pos, int level) const {
       if ((1<<level) <= subcube_dim) {
         return all(pos >= ivec3(0, 0, 0)) && all(pos < size) ? 1 : 0;
@@ -50,20 +26,6 @@ namespace octet { namespace scene {
       }
     }
 
-    static const ivec3 &delta(int i) {
-      static const ivec3 d[] = {
-        ivec3(0, 0, 0),
-        ivec3(1, 0, 0),
-        ivec3(0, 1, 0),
-        ivec3(1, 1, 0),
-        ivec3(0, 0, 1),
-        ivec3(1, 0, 1),
-        ivec3(0, 1, 1),
-        ivec3(1, 1, 1)
-      };
-      return d[i];
-    }
-
     void update_mesh() {
       mesh_iterate_faces<face_counter, subcube_dim> count;
       for (unsigned i = 0; i != subcubes.size(); ++i) {
@@ -225,6 +187,16 @@ namespace octet { namespace scene {
       mesh::dump(fp);
     }
 
+    /// number of subcubes in each direction.
+    ivec3 get_size() const {
+      return size;
+    }
+
+    /// size of one voxel in model space.
+    float get_voxel_size() const {
+      return voxel_size;
+    }
+
     /// get a subcube of 32x32x32 voxels.
     mesh_voxel_subcube *get_subcube(ivec3_in pos) const {
       assert(all(pos < size));
@@ -247,73 +219,8 @@ namespace octet { namespace scene {
       }
     }
 
-    /// Experimental: collide two orientated voxel meshes.
-    bool intersects(const mesh_voxels &b, const mat4t &mxa, const mat4t &mxb) const {
-      const mesh_voxels &a = *this;
-      vec3 corner_a(vec3(a.size) * (a.voxel_size * (-0.5f * subcube_dim)));
-      vec3 corner_b(vec3(b.size) * (b.voxel_size * (-0.5f * subcube_dim)));
-
-      //mat4t atob = inverse3x4(mxa) * mxb;
-      int levela = ilog2(a.size.x() * subcube_dim) + 1;
-      int levelb = ilog2(b.size.x() * subcube_dim) + 1;
-
-      dynarray<entries> stack;
-      stack.reserve(64);
-      stack.push_back(entries(
-        entry(levela, ivec3(0, 0, 0), false),
-        entry(levelb, ivec3(0, 0, 0), false)
-      ));
-
-      if (
-        !a.is_any(ivec3(0, 0, 0), levela) ||
-        !b.is_any(ivec3(0, 0, 0), levelb)
-      ) {
-        return false;
-      }
-
-      while(!stack.is_empty()) {
-        entry ta = stack.back().first;
-        entry tb = stack.back().second;
-        stack.pop_back();
-
-        ivec3 npa = ta.pos * 2;
-        ivec3 npb = tb.pos * 2;
-        int lev_a = ta.level - 1;
-        int lev_b = tb.level - 1;
-        float scale_a = a.voxel_size * (1 << lev_a);
-        float scale_b = b.voxel_size * (1 << lev_b);
-
-        log("%3d ta: %2d %2d %2d @%d   tb: %2d %2d %2d @%d scale=%f,%f\n", stack.size(), ta.pos.x(), ta.pos.y(), ta.pos.z(), ta.level, tb.pos.x(), tb.pos.y(), tb.pos.z(), tb.level, scale_a, scale_b);
-
-        for (unsigned i = 0; i != 8; ++i) {
-          ivec3 posa = npa + delta(i);
-          if (is_any(posa, lev_a)) {
-            obb bounds_a(corner_a + vec3(posa) * scale_a + (scale_a * 0.5f), scale_a * 0.5f, mxa);
-            for (unsigned j = 0; j != 8; ++j) {
-              ivec3 posb = npb + delta(j);
-              if (is_any(posb, lev_b)) {
-                obb bounds_b(corner_b + vec3(posb) * scale_b + (scale_b * 0.5f), scale_b * 0.5f, mxb);
-                if (bounds_a.intersects(bounds_b)) {
-                  char buf[512];
-                  log("  bounds_a=%s\n", bounds_a.toString(buf, sizeof(buf)));
-                  log("  bounds_b=%s\n", bounds_b.toString(buf, sizeof(buf)));
-                  log("  a: %2d %2d %2d @%d   b: %2d %2d %2d @%d\n", posa.x(), posa.y(), posa.z(), lev_a, posb.x(), posb.y(), posb.z(), lev_b);
-                  if (lev_a == 0 || lev_b == 0) {
-                    char b[2][128];
-                    log("success @ %s/%s\n", posa.toString(b[0], sizeof(b[0])), posb.toString(b[1], sizeof(b[1])));
-                    return true;
-                  }
-
-                  stack.push_back(entries(entry(lev_a, posa, false), entry(lev_b, posb, false)));
-                }
-              }
-            }
-          }
-        }
-      }
-      log("fail\n");
-      return false;
-    }
+    /// Do two orientated voxel meshes touch? See mesh_voxel_query::overlaps.
+    bool intersects(const mesh_voxels &b, const mat4t &mxa, const mat4t &mxb) const;
   };
 
   #if OCTET_UNIT_TEST
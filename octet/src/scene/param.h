@@ -318,8 +318,10 @@ namespace octet { namespace scene {
       fragment_shader.assign((const char*)fs.data(), (const char*)(fs.data() + fs.size()));
     }
 
+    /// Start compiling the shader and bind the params to it.
+    /// The program changes when the compile finishes, so the params must be bound again (see material::render).
     void init(dynarray<ref<param> > &params) {
-      shader::init(vertex_shader.data(), fragment_shader.data());
+      shader::init_async(vertex_shader.c_str(), fragment_shader.c_str());
 
       param_bind_info pbi;
       pbi.program = get_program();
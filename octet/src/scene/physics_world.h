@@ -0,0 +1,237 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Bullet physics world and motion state for scene nodes
+//
+
+#ifdef OCTET_BULLET
+namespace octet { namespace scene {
+  /// Motion state that connects a rigid body to a scene_node.
+  ///
+  /// Bullet calls setWorldTransform only for bodies that are awake, so static and sleeping
+  /// bodies cost nothing each frame. Kinematic bodies read their transform from the node.
+  class scene_node_motion_state : public btMotionState {
+    scene_node *node;
+  public:
+    scene_node_motion_state(scene_node *node) {
+      this->node = node;
+    }
+
+    void getWorldTransform(btTransform &trans) const {
+      trans.setFromOpenGLMatrix(node->get_nodeToParent().get());
+    }
+
+    void setWorldTransform(const btTransform &trans) {
+      trans.getOpenGLMatrix(node->access_nodeToParent().get());
+    }
+  };
+
+  /// Bullet dynamics world that can use the job_scheduler.
+  ///
+  /// When multithreading is on, the simulation islands are solved on all threads, each
+  /// thread with its own constraint solver, and bodies are integrated in parallel.
+  /// Islands that touch kinematic bodies are solved afterwards on the calling thread
+  /// as the solver writes to every non-static body it sees.
+  class physics_world : public btDiscreteDynamicsWorld {
+    // a batch of islands that is solved in one call.
+    struct island_group {
+      int first_body, num_bodies;
+      int first_manifold, num_manifolds;
+      int first_constraint, num_constraints;
+      bool serial;
+    };
+
+    struct island_collector : public btSimulationIslandManager::IslandCallback {
+      physics_world *world;
+      void processIsland(btCollisionObject **bodies, int num_bodies, btPersistentManifold **manifolds, int num_manifolds, int island_id) {
+        world->add_island(bodies, num_bodies, manifolds, num_manifolds, island_id);
+      }
+    };
+
+    enum { integrate_grain = 256 };
+
+    bool multithreaded;
+
+    dynarray<btCollisionObject*> island_bodies;
+    dynarray<btPersistentManifold*> island_manifolds;
+    dynarray<btTypedConstraint*> island_constraints;
+    dynarray<island_group> groups;
+    dynarray<btSequentialImpulseConstraintSolver*> solvers;
+    int constraint_cursor;
+
+    static bool is_kinematic(const btCollisionObject *obj) {
+      return obj && obj->isKinematicObject();
+    }
+
+    void open_group() {
+      island_group g = {
+        (int)island_bodies.size(), 0, (int)island_manifolds.size(), 0, (int)island_constraints.size(), 0, false
+      };
+      groups.push_back(g);
+    }
+
+    // called by the island manager in order of island id.
+    void add_island(btCollisionObject **bodies, int num_bodies, btPersistentManifold **manifolds, int num_manifolds, int island_id) {
+      if (groups.size() == 0) open_group();
+      island_group *g = &groups.back();
+
+      for (int i = 0; i != num_bodies; ++i) {
+        island_bodies.push_back(bodies[i]);
+      }
+      for (int i = 0; i != num_manifolds; ++i) {
+        island_manifolds.push_back(manifolds[i]);
+        g->serial |= is_kinematic(manifolds[i]->getBody0()) || is_kinematic(manifolds[i]->getBody1());
+      }
+
+      // the sorted constraints of this island. island_id is -1 if islands are not split.
+      int num_constraints = m_sortedConstraints.size();
+      while (island_id >= 0 && constraint_cursor != num_constraints && btGetConstraintIslandId(m_sortedConstraints[constraint_cursor]) < island_id) {
+        constraint_cursor++;
+      }
+      for (; constraint_cursor != num_constraints; ++constraint_cursor) {
+        btTypedConstraint *c = m_sortedConstraints[constraint_cursor];
+        if (island_id >= 0 && btGetConstraintIslandId(c) != island_id) break;
+        island_constraints.push_back(c);
+        g->serial |= is_kinematic(&c->getRigidBodyA()) || is_kinematic(&c->getRigidBodyB());
+      }
+
+      g->num_bodies = island_bodies.size() - g->first_body;
+      g->num_manifolds = island_manifolds.size() - g->first_manifold;
+      g->num_constraints = island_constraints.size() - g->first_constraint;
+      g->serial |= island_id < 0;
+
+      // small islands are batched as in btDiscreteDynamicsWorld.
+      if (g->num_manifolds + g->num_constraints > m_solverInfo.m_minimumSolverBatchSize) {
+        open_group();
+      }
+    }
+
+    void solve_group(btConstraintSolver *solver, const island_group &g, btContactSolverInfo &info) {
+      if (g.num_bodies == 0 && g.num_manifolds == 0 && g.num_constraints == 0) return;
+      solver->solveGroup(
+        g.num_bodies ? &island_bodies[g.first_body] : 0, g.num_bodies,
+        g.num_manifolds ? &island_manifolds[g.first_manifold] : 0, g.num_manifolds,
+        g.num_constraints ? &island_constraints[g.first_constraint] : 0, g.num_constraints,
+        info, m_debugDrawer, m_dispatcher1
+      );
+    }
+
+  protected:
+    /// Solve the islands on all threads.
+    void solveConstraints(btContactSolverInfo &info) {
+      job_scheduler &js = job_scheduler::get();
+      // the calling thread works too.
+      int num_threads = js.get_num_threads() + 1;
+      if (!multithreaded) {
+        btDiscreteDynamicsWorld::solveConstraints(info);
+        return;
+      }
+
+      m_sortedConstraints.resize(m_constraints.size());
+      for (int i = 0; i != m_constraints.size(); ++i) {
+        m_sortedConstraints[i] = m_constraints[i];
+      }
+      m_sortedConstraints.quickSort(btSortConstraintOnIslandPredicate());
+
+      island_bodies.resize(0);
+      island_manifolds.resize(0);
+      island_constraints.resize(0);
+      groups.resize(0);
+      constraint_cursor = 0;
+
+      island_collector collector;
+      collector.world = this;
+      m_constraintSolver->prepareSolve(getNumCollisionObjects(), m_dispatcher1->getNumManifolds());
+      m_islandManager->buildAndProcessIslands(m_dispatcher1, this, &collector);
+
+      // share the parallel groups between the threads, largest first.
+      while ((int)solvers.size() < num_threads) {
+        solvers.push_back(new btSequentialImpulseConstraintSolver());
+      }
+      dynarray<int> order;
+      for (unsigned i = 0; i != groups.size(); ++i) {
+        if (!groups[i].serial) order.push_back((int)i);
+      }
+      std::sort(order.data(), order.data() + order.size(), [this](int a, int b) {
+        return groups[a].num_manifolds + groups[a].num_constraints > groups[b].num_manifolds + groups[b].num_constraints;
+      });
+      dynarray<int> thread_of_group(groups.size());
+      dynarray<int> thread_cost(num_threads);
+      for (int t = 0; t != num_threads; ++t) thread_cost[t] = 0;
+      for (unsigned i = 0; i != order.size(); ++i) {
+        int best = 0;
+        for (int t = 1; t != num_threads; ++t) {
+          if (thread_cost[t] < thread_cost[best]) best = t;
+        }
+        const island_group &g = groups[order[i]];
+        thread_cost[best] += g.num_manifolds + g.num_constraints + 1;
+        thread_of_group[order[i]] = best;
+      }
+
+      js.parallel_for(0, num_threads, 1, [&](int begin, int end) {
+        for (int t = begin; t != end; ++t) {
+          for (unsigned i = 0; i != groups.size(); ++i) {
+            if (!groups[i].serial && thread_of_group[i] == t) {
+              solve_group(solvers[t], groups[i], info);
+            }
+          }
+        }
+      });
+
+      for (unsigned i = 0; i != groups.size(); ++i) {
+        if (groups[i].serial) {
+          solve_group(m_constraintSolver, groups[i], info);
+        }
+      }
+
+      m_constraintSolver->allSolved(info, m_debugDrawer);
+    }
+
+    /// Apply damping and predict the transforms of the bodies on all threads.
+    void predictUnconstraintMotion(btScalar time_step) {
+      int num_bodies = m_nonStaticRigidBodies.size();
+      if (!multithreaded || num_bodies < integrate_grain * 2) {
+        btDiscreteDynamicsWorld::predictUnconstraintMotion(time_step);
+        return;
+      }
+      btRigidBody **bodies = &m_nonStaticRigidBodies[0];
+      job_scheduler::get().parallel_for(0, num_bodies, integrate_grain, [=](int begin, int end) {
+        for (int i = begin; i != end; ++i) {
+          btRigidBody *body = bodies[i];
+          if (!body->isStaticOrKinematicObject()) {
+            body->applyDamping(time_step);
+            body->predictIntegratedTransform(time_step, body->getInterpolationWorldTransform());
+          }
+        }
+      });
+    }
+
+  public:
+    physics_world(btDispatcher *dispatcher, btBroadphaseInterface *broadphase, btConstraintSolver *solver, btCollisionConfiguration *config) :
+      btDiscreteDynamicsWorld(dispatcher, broadphase, solver, config)
+    {
+      multithreaded = false;
+      constraint_cursor = 0;
+    }
+
+    ~physics_world() {
+      for (unsigned i = 0; i != solvers.size(); ++i) {
+        delete solvers[i];
+      }
+    }
+
+    /// Solve islands and integrate bodies on the job_scheduler threads.
+    void set_multithreaded(bool value) {
+      multithreaded = value;
+    }
+
+    /// True if the job_scheduler threads are used.
+    bool get_multithreaded() const {
+      return multithreaded;
+    }
+  };
+}}
+#endif
@@ -24,6 +24,7 @@
 #include "../scene/light_instance.h"
 #include "../scene/mesh_instance.h"
 #include "../scene/animation_instance.h"
+#include "../scene/physics_world.h"
 #include "../scene/visual_scene.h"
 #include "../scene/displacement_map.h"
 #include "../scene/indexer.h"
@@ -33,14 +34,21 @@
 #include "../scene/mesh_cylinder.h"
 #include "../scene/mesh_sphere.h"
 #include "../scene/mesh_particle_system.h"
+#include "../scene/mesh_soft_body.h"
 #include "../scene/mesh_terrain.h"
+#include "../scene/terrain.h"
+#include "../scene/brick_volume.h"
+#include "../scene/sphere_bvh.h"
 #ifdef OCTET_VOXEL_TEST
   #include "../scene/mesh_voxel_subcube.h"
   #include "../scene/mesh_voxels.h"
+  #include "../scene/mesh_voxel_query.h"
 #endif
 #include "../scene/mesh_points.h"
 #include "../scene/wireframe.h"
 #include "../scene/mesh_voxel_grid.h"
+#include "../scene/isosurface.h"
+#include "../scene/mesh_isosurface.h"
 
 namespace octet {
   using namespace scene;
@@ -27,6 +27,26 @@ namespace octet { namespace scene {
     // is this node and all its children renderable?
     bool enabled;
 
+    // cached: are this node and all its parents enabled?
+    bool effective_enabled;
+
+    // set the cached flag over the subtree, stopping at children that are disabled themselves.
+    void propagate_enabled(bool value) {
+      if (effective_enabled == value) return;
+      dynarray<scene_node*> stack;
+      stack.push_back(this);
+      while (!stack.empty()) {
+        scene_node *node = stack.back();
+        stack.pop_back();
+        node->effective_enabled = value;
+        for (int i = 0; i != node->children.size(); ++i) {
+          scene_node *child = node->children[i];
+          if (child->enabled && child->effective_enabled != value) stack.push_back(child);
+        }
+      }
+      enable_generation()++;
+    }
+
   public:
     RESOURCE_META(scene_node)
 
@@ -35,6 +55,7 @@ namespace octet { namespace scene {
       nodeToParent.loadIdentity();
       sid = atom_;
       enabled = true;
+      effective_enabled = true;
       if (parent) {
         parent->add_child(this);
       }
@@ -45,6 +66,7 @@ namespace octet { namespace scene {
       this->nodeToParent = nodeToParent;
       this->sid = sid;
       enabled = true;
+      effective_enabled = true;
     }
 
     /// the virtual add_ref on animation_target gets passed to here and we pass iton (delegate it) to the resource
@@ -80,6 +102,7 @@ namespace octet { namespace scene {
     void add_child(scene_node *new_node) {
       new_node->parent = this;
       children.push_back(new_node);
+      new_node->propagate_enabled(new_node->enabled && effective_enabled);
     }
 
     /// Get the parent node of this node.
@@ -106,12 +129,16 @@ namespace octet { namespace scene {
       return result;
     }
 
-    // calculate whether this node is enabled (recursively)
-    bool calcEnabled() {
-      for (scene_node *p = this; p != NULL; p = p->parent) {
-        if (!p->enabled) return false;
-      }
-      return true;
+    /// Are this node and all its parents enabled? This is cached, so it costs nothing.
+    bool calcEnabled() const {
+      return effective_enabled;
+    }
+
+    /// Changes whenever any node or mesh instance changes whether it is drawn.
+    /// Scenes compare this with their last value to see if their active list is stale.
+    static unsigned &enable_generation() {
+      static unsigned value;
+      return value;
     }
 
     /// transform a point from model space to world space
@@ -163,9 +190,11 @@ namespace octet { namespace scene {
       return enabled;
     }
 
-    /// set enabled state
+    /// set enabled state. Disabling a node hides all its children in one pass.
     void set_enabled(bool value) {
+      if (enabled == value) return;
       enabled = value;
+      propagate_enabled(value && (!parent || parent->effective_enabled));
     }
 
     /// reset the matrix
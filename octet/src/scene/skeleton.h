@@ -20,6 +20,7 @@ namespace octet { namespace scene {
     // cached skin components
     dynarray<mat4t> result;  /// uniforms to shader
     dynarray<int> indices;   /// map skeleton to skin indices
+    dynarray<mat4t> skinToSkeleton; /// modelToBind * bindToModel, rebuilt with indices
   public:
     RESOURCE_META(skeleton)
 
@@ -80,26 +81,27 @@ namespace octet { namespace scene {
       }
 
       unsigned num_joints = skn->get_num_joints();
-      if (result.size() < num_joints) {
+      if (result.size() < num_joints || skinToSkeleton.size() < num_joints) {
         result.resize(num_joints);
         indices.resize(num_joints);
+        skinToSkeleton.resize(num_joints);
         for (int i = 0; i != num_joints; ++i) {
           // skin -> bind space -> skeleton -> parent -> parent -> world -> camera
           indices[i] = find_joint(skn->get_joint(i));
+          if (indices[i] != -1) {
+            skinToSkeleton[i] = skn->get_modelToBind() * skn->get_bindToModel(i);
+          } else {
+            skinToSkeleton[i].loadIdentity();
+          }
         }
       }
 
-      // premultiply by skin matrices
+      // gather the bones, then premultiply by the skin matrices in one batch
       for (int i = 0; i != num_joints; ++i) {
-        // skin -> bind space -> skeleton -> parent -> parent -> world -> camera
         int index = indices[i];
-        if (index != -1) {
-          result[i] = skn->get_modelToBind() * skn->get_bindToModel(i) * boneToNode[index];
-        } else {
-          result[i] = worldToCamera;
-        }
-        //if (first_frame) log("%d %d [%s]\n", i, index, result[i].toString());
+        result[i] = index != -1 ? boneToNode[index] : worldToCamera;
       }
+      transform_batch::matrices(result.data(), skinToSkeleton.data(), result.data(), num_joints);
 
       return &result[0];
     }
@@ -4,225 +4,390 @@
 //
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
-// Mesh smooth modifier. Work in progress.
+// Mesh smooth modifier: Loop subdivision.
 //
 
 namespace octet { namespace scene {
-  class smooth : public mesh {
-    // source mesh. Provides underlying geometry.
-    ref<mesh> src;
+  /// Loop subdivision of a triangle mesh.
+  ///
+  /// The topology of every level (edges, neighbours of each vertex and the new triangles)
+  /// is built once by set_topology. After that, evaluate only does arithmetic, on all threads,
+  /// so a skinned or animated cage can be subdivided again every frame.
+  ///
+  /// Vertices are arrays of floats. Positions and normals use the Loop weights, everything
+  /// else (uvs etc.) is interpolated linearly so that textures do not swim.
+  /// Edges with only one triangle are creases, so seams with split vertices stay closed.
+  ///
+  /// Example:
+  ///
+  ///     subdivision sub;
+  ///     sub.set_topology(indices.data(), indices.size(), num_vertices, 2);
+  ///     sub.evaluate(vertices.data(), 8, 0, 3, 2);
+  ///     // sub.get_vertices(), sub.get_indices(2)
+  class subdivision {
+  public:
+    enum { max_depth = 4 };
+
+  private:
+    // ends a, b and the opposite vertices c, d. d is ~0 on a boundary.
+    struct edge {
+      uint32_t a, b, c, d;
+    };
+
+    // one step: the edges and rings of the coarse mesh and the triangles of the fine mesh.
+    struct level {
+      unsigned num_vertices;
+      dynarray<edge> edges;
+      dynarray<uint32_t> ring_start;
+      dynarray<uint32_t> ring;
+      dynarray<uint8_t> boundary;
+      dynarray<uint32_t> fine_indices;
+    };
+
+    enum { parallel_grain = 4096 };
+
+    dynarray<uint32_t> base_indices;
+    unsigned base_vertices;
+    int num_levels;
+    level levels[max_depth];
+
+    // vertices of the last evaluation, and a level being built.
+    dynarray<float> vertices;
+    dynarray<float> scratch;
+    unsigned num_vertices;
+
+    // find the edges and neighbours of a mesh and make its four times larger child.
+    static void build_level(level &lev, const uint32_t *indices, unsigned num_indices, unsigned num_vertices) {
+      lev.num_vertices = num_vertices;
+      lev.edges.resize(0);
+      hash_map<uint64_t, unsigned> edge_map;
+      dynarray<uint32_t> tri_edges(num_indices);
+      for (unsigned i = 0; i + 2 < num_indices; i += 3) {
+        for (unsigned j = 0; j != 3; ++j) {
+          uint32_t a = indices[i + j], b = indices[i + (j + 1) % 3], c = indices[i + (j + 2) % 3];
+          // scramble the pair (an odd multiply is reversible) so that hash_map spreads the keys.
+          uint64_t key = (a < b ? ((uint64_t)b << 32) | a : ((uint64_t)a << 32) | b) * 0x9E3779B97F4A7C15ull;
+          unsigned &e = edge_map[key];
+          if (!e) {
+            edge new_edge = { a, b, c, ~0u };
+            lev.edges.push_back(new_edge);
+            e = lev.edges.size();
+          } else if (lev.edges[e - 1].d == ~0u) {
+            lev.edges[e - 1].d = c;
+          }
+          tri_edges[i + j] = num_vertices + e - 1;
+        }
+      }
 
-    // view dependent parameters
-    vec3 view_pos;
-    vec3 view_dir;
+      // boundary vertices only use their boundary neighbours.
+      lev.boundary.resize(num_vertices);
+      memset(lev.boundary.data(), 0, num_vertices);
+      for (unsigned e = 0; e != lev.edges.size(); ++e) {
+        const edge &ed = lev.edges[e];
+        if (ed.d == ~0u) lev.boundary[ed.a] = lev.boundary[ed.b] = 1;
+      }
 
-    // working params
-    unsigned num_dest_vertices;
+      lev.ring_start.resize(num_vertices + 1);
+      memset(lev.ring_start.data(), 0, (num_vertices + 1) * sizeof(uint32_t));
+      for (unsigned e = 0; e != lev.edges.size(); ++e) {
+        const edge &ed = lev.edges[e];
+        bool use = ed.d == ~0u;
+        if (use || !lev.boundary[ed.a]) lev.ring_start[ed.a + 1]++;
+        if (use || !lev.boundary[ed.b]) lev.ring_start[ed.b + 1]++;
+      }
+      for (unsigned v = 0; v != num_vertices; ++v) {
+        lev.ring_start[v + 1] += lev.ring_start[v];
+      }
+      lev.ring.resize(lev.ring_start[num_vertices]);
+      dynarray<uint32_t> fill(num_vertices);
+      memcpy(fill.data(), lev.ring_start.data(), num_vertices * sizeof(uint32_t));
+      for (unsigned e = 0; e != lev.edges.size(); ++e) {
+        const edge &ed = lev.edges[e];
+        bool use = ed.d == ~0u;
+        if (use || !lev.boundary[ed.a]) lev.ring[fill[ed.a]++] = ed.b;
+        if (use || !lev.boundary[ed.b]) lev.ring[fill[ed.b]++] = ed.a;
+      }
 
-    dynarray<uint32_t> dest_indices;
-    hash_map<uint64_t, unsigned> edges;
-    dynarray<uint8_t> dest_vertices;
-    unsigned pos_offset;
-    unsigned normal_offset;
-    unsigned uv_offset;
-    int depth;
+      //        a
+      //      ca  ab
+      //    c   bc   b
+      lev.fine_indices.resize(num_indices / 3 * 12);
+      uint32_t *dest = lev.fine_indices.data();
+      for (unsigned i = 0; i + 2 < num_indices; i += 3) {
+        uint32_t a = indices[i], b = indices[i + 1], c = indices[i + 2];
+        uint32_t ab = tri_edges[i], bc = tri_edges[i + 1], ca = tri_edges[i + 2];
+        *dest++ = a; *dest++ = ab; *dest++ = ca;
+        *dest++ = ab; *dest++ = b; *dest++ = bc;
+        *dest++ = ca; *dest++ = bc; *dest++ = c;
+        *dest++ = ab; *dest++ = bc; *dest++ = ca;
+      }
+    }
 
-    bool split_edge(uint8_t *dest, const uint8_t *src0, const uint8_t *src1, unsigned stride) {
-      const vec3p &pos0 = (const vec3p&)src0[pos_offset];
-      const vec3p &pos1 = (const vec3p&)src1[pos_offset];
-      const vec3p &n0 = (const vec3p&)src0[normal_offset];
-      const vec3p &n1 = (const vec3p&)src1[normal_offset];
-      //const vec3 &uv0 = (const vec3&)src0[uv_offset];
-      //const vec3 &uv1 = (const vec3&)src1[uv_offset];
+    // one level of subdivision from src to dest, on all threads.
+    static void subdivide(float *dest, const float *src, const level &lev, unsigned floats, unsigned pos, unsigned normal) {
+      job_scheduler &js = job_scheduler::get();
+      unsigned nv = lev.num_vertices;
+
+      // move the old vertices
+      js.parallel_for(0, (int)nv, parallel_grain, [&](int begin, int end) {
+        for (int v = begin; v != end; ++v) {
+          const float *s = src + v * floats;
+          float *d = dest + v * floats;
+          memcpy(d, s, floats * sizeof(float));
+          unsigned first = lev.ring_start[v], n = lev.ring_start[v + 1] - first;
+          float beta;
+          if (lev.boundary[v]) {
+            // crease: a cubic b-spline along the boundary. Corners do not move.
+            if (n != 2) continue;
+            beta = 1.0f / 8;
+          } else {
+            if (n < 3) continue;
+            beta = n == 3 ? 3.0f / 16 : 3.0f / (8 * n);
+          }
+          float self = 1.0f - n * beta;
+          vec3 p = vec3(s[pos], s[pos+1], s[pos+2]) * self;
+          vec3 nrm = vec3(s[normal], s[normal+1], s[normal+2]) * self;
+          for (unsigned i = 0; i != n; ++i) {
+            const float *r = src + lev.ring[first + i] * floats;
+            p += vec3(r[pos], r[pos+1], r[pos+2]) * beta;
+            nrm += vec3(r[normal], r[normal+1], r[normal+2]) * beta;
+          }
+          nrm = nrm.normalize();
+          d[pos] = p.x(); d[pos+1] = p.y(); d[pos+2] = p.z();
+          d[normal] = nrm.x(); d[normal+1] = nrm.y(); d[normal+2] = nrm.z();
+        }
+      });
+
+      // a new vertex on each edge
+      js.parallel_for(0, (int)lev.edges.size(), parallel_grain, [&](int begin, int end) {
+        for (int e = begin; e != end; ++e) {
+          const edge &ed = lev.edges[e];
+          const float *sa = src + ed.a * floats, *sb = src + ed.b * floats;
+          float *d = dest + (nv + e) * floats;
+          for (unsigned i = 0; i != floats; ++i) {
+            d[i] = (sa[i] + sb[i]) * 0.5f;
+          }
+          if (ed.d != ~0u) {
+            const float *sc = src + ed.c * floats, *sd = src + ed.d * floats;
+            vec3 p = (vec3(sa[pos], sa[pos+1], sa[pos+2]) + vec3(sb[pos], sb[pos+1], sb[pos+2])) * (3.0f / 8)
+              + (vec3(sc[pos], sc[pos+1], sc[pos+2]) + vec3(sd[pos], sd[pos+1], sd[pos+2])) * (1.0f / 8);
+            d[pos] = p.x(); d[pos+1] = p.y(); d[pos+2] = p.z();
+          }
+          vec3 nrm = vec3(d[normal], d[normal+1], d[normal+2]).normalize();
+          d[normal] = nrm.x(); d[normal+1] = nrm.y(); d[normal+2] = nrm.z();
+        }
+      });
+    }
 
-      if (is_smooth(n0, n1, depth)) {
-        return false;
-      }
+  public:
+    subdivision() {
+      base_vertices = 0;
+      num_levels = 0;
+      num_vertices = 0;
+    }
 
-      // Catmul-Rom spline
-      vec3 diff = (vec3)pos1 - (vec3)pos0;
-      vec3 t0 = cross(cross(n0, diff), n0); // bezier tangent * 3
-      vec3 t1 = cross(cross(n1, diff), n1); // bezier tangent * 3
+    /// Set the triangles of the cage and build the tables for up to depth levels.
+    void set_topology(const uint32_t *indices, unsigned num_indices, unsigned num_cage_vertices, int depth) {
+      base_indices.resize(num_indices - num_indices % 3);
+      if (base_indices.size()) memcpy(base_indices.data(), indices, base_indices.size() * sizeof(uint32_t));
+      base_vertices = num_cage_vertices;
+      num_levels = 0;
+      build_levels(depth);
+    }
 
-      for (unsigned i = 0; i < stride/sizeof(float); ++i) {
-        ((float*)dest)[i] = (((float*)src0)[i] + ((float*)src1)[i]) * 0.5f;
+    /// Make sure the tables for depth levels exist. Does nothing if they do.
+    void build_levels(int depth) {
+      depth = std::min(depth, (int)max_depth);
+      for (; num_levels < depth; ++num_levels) {
+        const level *prev = num_levels ? &levels[num_levels - 1] : 0;
+        const dynarray<uint32_t> &indices = prev ? prev->fine_indices : base_indices;
+        unsigned nv = prev ? prev->num_vertices + prev->edges.size() : base_vertices;
+        build_level(levels[num_levels], indices.data(), indices.size(), nv);
       }
+    }
 
-      vec3p &pos = (vec3p&)dest[pos_offset];
-      vec3p &normal = (vec3p&)dest[normal_offset];
-
-      pos = ((vec3)pos0 + (vec3)pos1) * 0.5f + (t0 - t1) * 0.125; // (3/8)/3 = 1/8
-      normal = normalize(normal);
+    /// Subdivide cage vertices of floats_per_vertex floats depth times.
+    /// pos and normal are the float offsets of the position and normal.
+    void evaluate(const float *cage, unsigned floats_per_vertex, unsigned pos, unsigned normal, int depth) {
+      build_levels(depth);
+      depth = std::min(depth, num_levels);
+      unsigned floats = floats_per_vertex;
+
+      num_vertices = base_vertices;
+      vertices.resize(num_vertices * floats);
+      if (vertices.size()) memcpy(vertices.data(), cage, vertices.size() * sizeof(float));
+      for (int l = 0; l != depth; ++l) {
+        const level &lev = levels[l];
+        unsigned fine_vertices = lev.num_vertices + lev.edges.size();
+        scratch.resize(fine_vertices * floats);
+        subdivide(scratch.data(), vertices.data(), lev, floats, pos, normal);
+        vertices.swap(scratch);
+        num_vertices = fine_vertices;
+      }
+    }
 
-      return true;
+    /// Vertices from the last evaluate().
+    const dynarray<float> &get_vertices() const {
+      return vertices;
     }
 
-    unsigned add_edge(int i0, int i1) {
-      if (i0 > i1) { std::swap(i0, i1); }
+    unsigned get_num_vertices() const {
+      return num_vertices;
+    }
 
-      unsigned &e = edges[((uint64_t)i1 << 32) | i0];
+    /// Triangles after depth levels of subdivision.
+    const dynarray<uint32_t> &get_indices(int depth) const {
+      depth = std::min(depth, num_levels);
+      return depth ? levels[depth - 1].fine_indices : base_indices;
+    }
 
-      if (e == ~0) return 0;
+    /// Levels with tables built.
+    int get_num_levels() const {
+      return num_levels;
+    }
+  };
 
-      if (e != 0) return e;
+  /// Smoothed version of a triangle mesh using Loop subdivision.
+  ///
+  /// The depth of subdivision depends on the distance from the view to the mesh and
+  /// is zero if the mesh is behind the view. Call set_view every frame; the mesh is
+  /// only rebuilt when the depth changes. For an animated source mesh, change its vertices
+  /// and call update_positions, which keeps the topology.
+  ///
+  /// Example:
+  ///
+  ///     smooth *smoothed = new smooth(new mesh_sphere(vec3(0), 1, 1), 3);
+  ///     ...
+  ///     smoothed->set_view(camera_pos_in_model_space, camera_dir_in_model_space);
+  class smooth : public mesh {
+    // source mesh. Provides underlying geometry.
+    ref<mesh> src;
 
-      unsigned stride = get_stride();
+    // view dependent parameters
+    vec3 view_pos;
+    vec3 view_dir;
 
-      dest_vertices.resize((num_dest_vertices + 1) * stride);
+    // full depth closer than this, one less at twice the distance etc.
+    float detail_distance;
+    int max_depth;
+    int depth;
 
-      log("%*se%d %d %d\n", depth*2, "", num_dest_vertices, i0, i1);
-      bool split = split_edge(
-        &dest_vertices[num_dest_vertices * stride],
-        &dest_vertices[i0 * stride],
-        &dest_vertices[i1 * stride],
-        stride
-      );
+    // copy of the source vertices and the offsets in floats of position and normal.
+    dynarray<float> cage;
+    unsigned floats_per_vertex;
+    unsigned pos_offset;
+    unsigned normal_offset;
+    subdivision sub;
+    bool valid;
+
+    // read the source vertex buffer.
+    bool read_cage() {
+      unsigned pos_slot = src->get_slot(attribute_pos);
+      unsigned normal_slot = src->get_slot(attribute_normal);
+      if (pos_slot == ~0 || normal_slot == ~0) return false;
+      if (src->get_kind(pos_slot) != GL_FLOAT || src->get_kind(normal_slot) != GL_FLOAT) return false;
+      if (src->get_stride() % sizeof(float) || !src->get_vertices()) return false;
+
+      floats_per_vertex = src->get_stride() / sizeof(float);
+      pos_offset = src->get_offset(pos_slot) / sizeof(float);
+      normal_offset = src->get_offset(normal_slot) / sizeof(float);
+      cage.resize(src->get_num_vertices() * floats_per_vertex);
+      if (cage.size()) {
+        const void *sp = src->get_vertices()->lock_read_only();
+        memcpy(cage.data(), sp, cage.size() * sizeof(float));
+        src->get_vertices()->unlock_read_only();
+      }
+      return true;
+    }
 
-      if (split) {
-        e = num_dest_vertices++;
-        return e;
-      } else {
-        // unable to split. Don't test again.
-        e = ~0;
-        return 0;
+    // subdivide and upload.
+    void rebuild() {
+      if (!valid) return;
+      sub.evaluate(cage.data(), floats_per_vertex, pos_offset, normal_offset, depth);
+      const dynarray<float> &vertices = sub.get_vertices();
+      const dynarray<uint32_t> &indices = sub.get_indices(depth);
+      unsigned isize = indices.size() * sizeof(uint32_t);
+      unsigned vsize = vertices.size() * sizeof(float);
+      // never write to the buffers of the source mesh.
+      if (!get_vertices() || get_vertices() == src->get_vertices() || get_vertices()->get_size() != vsize) {
+        set_vertices(new gl_resource(GL_ARRAY_BUFFER, vsize));
+      }
+      if (!get_indices() || get_indices() == src->get_indices() || get_indices()->get_size() != isize) {
+        set_indices(new gl_resource(GL_ELEMENT_ARRAY_BUFFER, isize));
       }
+      get_vertices()->assign(vertices.data(), 0, vsize);
+      get_indices()->assign(indices.data(), 0, isize);
+      set_num_vertices(sub.get_num_vertices());
+      set_num_indices(indices.size());
     }
 
-    void add_triangle(unsigned i0, unsigned i1, unsigned i2) {
-      unsigned i3 = add_edge(i0, i1);
-      unsigned i4 = add_edge(i1, i2);
-      unsigned i5 = add_edge(i2, i0);
-
-      depth++;
-
-      log("%*sat: %d %d %d %d %d %d\n", depth*2, "", i0, i1, i2, i3, i4, i5);
-
-      switch( (i3 != 0) + (i4 != 0)*2 + (i5 != 0)*4 ) {
-        case 0: {
-          unsigned disize = dest_indices.size();
-          dest_indices.resize(disize+3);
-          dest_indices[disize+0] = i0;
-          dest_indices[disize+1] = i1;
-          dest_indices[disize+2] = i2;
-        } break;
-        case 1: {
-          //    1
-          //   3 
-          //  0   2
-          add_triangle(i3, i1, i2);
-          add_triangle(i3, i2, i0);
-        } break;
-        case 2: {
-          //    1
-          //     4 
-          //  0   2
-          add_triangle(i4, i0, i1);
-          add_triangle(i4, i2, i0);
-        } break;
-        case 3: {
-          //    1
-          //   3 4
-          //  0   2
-          add_triangle(i3, i1, i4);
-          add_triangle(i3, i4, i0);
-          add_triangle(i4, i2, i0);
-        } break;
-        case 4: {
-          //    1
-          //      
-          //  0 5 2
-          add_triangle(i5, i0, i1);
-          add_triangle(i5, i1, i2);
-        } break;
-        case 5: {
-          //    1
-          //   3  
-          //  0 5 2
-          add_triangle(i5, i0, i3);
-          add_triangle(i5, i3, i2);
-          add_triangle(i3, i1, i2);
-        } break;
-        case 6: {
-          //    1
-          //     4
-          //  0 5 2
-          add_triangle(i4, i2, i5);
-          add_triangle(i5, i0, i4);
-          add_triangle(i4, i0, i1);
-        } break;
-        case 7: {
-          //    1
-          //   3 4
-          //  0 5 2
-          add_triangle(i1, i4, i3);
-          add_triangle(i3, i4, i5);
-          add_triangle(i3, i5, i0);
-          add_triangle(i4, i2, i5);
-        } break;
-      }
-      depth--;
-    }
-          
   public:
     RESOURCE_META(smooth)
 
-    smooth(mesh *src=0) {
+    /// Smooth src by up to max_depth levels (at most subdivision::max_depth).
+    smooth(mesh *src=0, int max_depth=2) {
       this->src = src;
+      this->max_depth = max_depth;
       view_pos = vec3(0, 0, 0);
+      view_dir = vec3(0, 0, 0);
+      detail_distance = 0;
+      depth = max_depth;
+      valid = false;
       update();
     }
 
+    /// Read the source mesh and build the topology tables.
     void update() {
+      valid = false;
       if (!src) return;
       if (src->get_mode() != GL_TRIANGLES) return;
       if (src->get_index_type() != GL_UNSIGNED_INT) return;
 
       *(mesh*)this = *(mesh*)src;
+      if (!read_cage()) return;
 
-      unsigned pos_slot = get_slot(attribute_pos);
-      unsigned normal_slot = get_slot(attribute_normal);
-      unsigned uv_slot = get_slot(attribute_uv);
+      // the source indices are read once; set_view and update_positions reuse the tables.
+      const void *sip = src->get_indices()->lock_read_only();
+      sub.set_topology((const uint32_t*)sip + src->get_first_index(), src->get_num_indices(), src->get_num_vertices(), depth);
+      src->get_indices()->unlock_read_only();
+      set_first_index(0);
+      valid = true;
+      rebuild();
+    }
 
-      // needs pos, normal and uv map
-      if (pos_slot == ~0 || normal_slot == ~0 || uv_slot == ~0) {
+    /// The source vertices have moved (eg. a skinned cage): subdivide them with the same topology.
+    void update_positions() {
+      if (!valid || src->get_num_vertices() * floats_per_vertex != cage.size()) {
+        update();
         return;
       }
+      read_cage();
+      rebuild();
+    }
 
-      pos_offset = get_offset(pos_slot);
-      normal_offset = get_offset(normal_slot);
-      uv_offset = get_offset(uv_slot);
-
-      dest_indices.reserve(get_num_indices() * 4);
-      dest_vertices.reserve(get_num_vertices() * get_stride() * 4);
-      dest_vertices.resize(get_num_vertices() * get_stride());
-
-      // copy vertices for existing triangles
-      const void *sp = src->get_vertices()->lock_read_only();
-      memcpy(&dest_vertices[0], sp, get_num_vertices() * get_stride());
-      src->get_vertices()->unlock_read_only();
-      num_dest_vertices = get_num_vertices();
-
-      const void *sip = src->get_indices()->lock_read_only();
-      depth = 0;
-      for (unsigned i = 0; i+2 < get_num_indices(); i += 3) {
-        uint32_t *tp = ((uint32_t*)sip) + i;
-        add_triangle(tp[0], tp[1], tp[2]);
+    /// Set the viewpoint in model space and change the depth if needed.
+    void set_view(vec3_in pos, vec3_in dir) {
+      view_pos = pos;
+      view_dir = dir;
+      int new_depth = std::max(0, std::min(choose_depth(), max_depth));
+      if (new_depth != depth) {
+        depth = new_depth;
+        rebuild();
       }
-      src->get_indices()->unlock_read_only();
+    }
 
-      unsigned isize = dest_indices.size() * sizeof(dest_indices[0]);
-      unsigned vsize = dest_vertices.size() * sizeof(dest_vertices[0]);
-      gl_resource *indices = new gl_resource(GL_ELEMENT_ARRAY_BUFFER, isize);
-      gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, vsize);
-      indices->assign(&dest_indices[0], 0, isize);
-      vertices->assign(&dest_vertices[0], 0, vsize);
+    /// Distance within which the full depth is used. Zero means four times the size of the mesh.
+    void set_detail_distance(float value) {
+      detail_distance = value;
+    }
 
-      set_indices(indices);
-      set_vertices(vertices);
-      set_num_vertices(num_dest_vertices);
-      set_num_indices(dest_indices.size());
+    void set_max_depth(int value) {
+      max_depth = std::min(value, (int)subdivision::max_depth);
+    }
 
-      dump(log("dump"));
+    /// Current number of levels of subdivision.
+    int get_depth() const {
+      return depth;
     }
 
     void visit(visitor &v) {
@@ -231,11 +396,76 @@ namespace octet { namespace scene {
       v.visit(view_pos, atom_view_pos);
     }
 
-    virtual bool is_smooth(const vec3 &n0, const vec3 &n1, int depth) {
-      return true;
-      float dotp = dot(n0, n1);
-      log("%*s  dotp=%f\n", depth*2, "", dotp);
-      return (dotp >= 0.9f) || depth >= 4;
+    /// Override this to choose the depth from the view.
+    virtual int choose_depth() {
+      aabb bb = get_aabb();
+      vec3 center = bb.get_center();
+      float radius = bb.get_half_extent().length();
+
+      // behind the view: don't bother.
+      vec3 to_mesh = center - view_pos;
+      if (dot(view_dir, view_dir) > 0 && dot(to_mesh, view_dir.normalize()) < -radius) {
+        return 0;
+      }
+
+      float full = detail_distance > 0 ? detail_distance : radius * 4;
+      float distance = to_mesh.length() - radius;
+      int level = max_depth;
+      for (float d = full; distance > d && level > 0; d *= 2) {
+        level--;
+      }
+      return level;
     }
   };
+
+  #if OCTET_UNIT_TEST
+    class subdivision_unit_test {
+    public:
+      subdivision_unit_test() {
+        // octahedron with pos, normal, uv
+        static const uint32_t indices[] = {
+          0, 2, 4,  2, 1, 4,  1, 3, 4,  3, 0, 4,
+          2, 0, 5,  1, 2, 5,  3, 1, 5,  0, 3, 5,
+        };
+        dynarray<float> cage;
+        static const float dirs[6][3] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+        for (int v = 0; v != 6; ++v) {
+          for (int j = 0; j != 2; ++j) {
+            for (int k = 0; k != 3; ++k) cage.push_back(dirs[v][k]);
+          }
+          cage.push_back(0.5f); cage.push_back((float)v);
+        }
+
+        subdivision sub;
+        sub.set_topology(indices, 24, 6, 3);
+        sub.evaluate(cage.data(), 8, 0, 3, 3);
+
+        // V' = V + E, F' = 4F, and the octahedron stays closed.
+        assert(sub.get_num_levels() == 3);
+        assert(sub.get_indices(1).size() == 24 * 4 && sub.get_indices(3).size() == 24 * 64);
+        unsigned v1 = 6 + 12, v2 = v1 + 12 * 2 + 8 * 3, v3 = v2 + 48 * 2 + 32 * 3;
+        assert(sub.get_num_vertices() == v3);
+
+        // the limit surface is inside the cage and outside the inscribed sphere.
+        const dynarray<float> &vtx = sub.get_vertices();
+        for (unsigned i = 0; i != sub.get_num_vertices(); ++i) {
+          const float *p = &vtx[i * 8];
+          vec3 pos(p[0], p[1], p[2]);
+          float r = pos.length();
+          assert(r < 1.0f && r > 0.4f);
+          assert(dot(pos, vec3(p[3], p[4], p[5])) > 0);
+          assert(p[6] == 0.5f);
+        }
+
+        // moving the cage reuses the tables.
+        for (unsigned i = 0; i != cage.size(); i += 8) cage[i] *= 2;
+        sub.evaluate(cage.data(), 8, 0, 3, 2);
+        assert(sub.get_num_vertices() == v2 && sub.get_num_levels() == 3);
+        float max_x = 0;
+        for (unsigned i = 0; i != sub.get_num_vertices(); ++i) max_x = std::max(max_x, sub.get_vertices()[i * 8]);
+        assert(max_x > 1.0f && max_x < 2.0f);
+      }
+    };
+    static subdivision_unit_test subdivision_unit_test;
+  #endif
 }}
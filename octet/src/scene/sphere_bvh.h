@@ -0,0 +1,386 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Linear bounding volume hierarchy of spheres
+//
+
+namespace octet { namespace scene {
+  /// Bounding volume hierarchy for millions of spheres (eg. atoms).
+  ///
+  /// The tree is a linear BVH built on all threads: spheres are sorted by the Morton code
+  /// of their centres and the tree is made from the sorted codes (T. Karras, "Maximizing
+  /// Parallelism in the Construction of BVHs, Octrees, and k-d Trees", HPG 2012).
+  ///
+  /// Nodes are stored depth first in two vec4s:
+  ///
+  ///     (min.x, min.y, min.z, escape or -count) (max.x, max.y, max.z, first sphere)
+  ///
+  /// An interior node stores the index of the node after its subtree; a leaf stores minus
+  /// its number of spheres. This allows a traversal without a stack (for example in a shader):
+  /// go to the next node if the ray hits the box, otherwise go to the escape node.
+  ///
+  /// The indices are floats so that the nodes can go in a float texture. Floats hold integers
+  /// exactly up to 2^24 and there are up to 2n nodes, so a tree holds at most max_spheres (2^23).
+  ///
+  /// Example:
+  ///
+  ///     sphere_bvh bvh;
+  ///     bvh.build(dec.get_atoms().data(), dec.get_atoms().size());
+  ///     int hit = bvh.ray_cast(origin, direction, distance);
+  ///     if (hit != -1) printf("hit atom %d\n", bvh.get_order()[hit]);
+  class sphere_bvh {
+  public:
+    enum { max_leaf_spheres = 4, max_spheres = 1 << 23 };
+
+  private:
+    // built tree: sorted leaves and n-1 interior nodes.
+    struct build_node {
+      int left, right;     // child nodes, leaves are (n - 1) + sphere
+      int first, last;     // range of sorted spheres
+      vec3p min, max;
+    };
+
+    enum { grain = 8192 };
+
+    dynarray<vec4> spheres;
+    dynarray<unsigned> order;
+    dynarray<vec4> nodes;
+
+    // spread ten bits out to every third bit.
+    static uint32_t expand_bits(uint32_t v) {
+      v = (v * 0x00010001u) & 0xFF0000FFu;
+      v = (v * 0x00000101u) & 0x0F00F00Fu;
+      v = (v * 0x00000011u) & 0xC30C30C3u;
+      v = (v * 0x00000005u) & 0x49249249u;
+      return v;
+    }
+
+    static int count_leading_zeros(uint32_t v) {
+      #if defined(_MSC_VER)
+        unsigned long bit;
+        return _BitScanReverse(&bit, v) ? 31 - (int)bit : 32;
+      #elif defined(__GNUC__)
+        return v ? __builtin_clz(v) : 32;
+      #else
+        int n = 0;
+        if (!(v & 0xffff0000u)) { n += 16; v <<= 16; }
+        if (!(v & 0xff000000u)) { n += 8; v <<= 8; }
+        if (!(v & 0xf0000000u)) { n += 4; v <<= 4; }
+        if (!(v & 0xc0000000u)) { n += 2; v <<= 2; }
+        if (!(v & 0x80000000u)) { n += 1; }
+        return v ? n : 32;
+      #endif
+    }
+
+    // length of the common prefix of sorted codes i and j. Equal codes are split by index.
+    static int delta(const uint32_t *codes, int n, int i, int j) {
+      if (j < 0 || j >= n) return -1;
+      uint32_t a = codes[i], b = codes[j];
+      return a != b ? count_leading_zeros(a ^ b) : 32 + count_leading_zeros((uint32_t)i ^ (uint32_t)j);
+    }
+
+    // sort (code, index) pairs by code, eight bits at a time.
+    static void radix_sort(dynarray<uint32_t> &codes, dynarray<unsigned> &index) {
+      int n = (int)codes.size();
+      job_scheduler &js = job_scheduler::get();
+      int num_blocks = (n + grain - 1) / grain;
+      dynarray<uint32_t> tmp_codes(n);
+      dynarray<unsigned> tmp_index(n);
+      dynarray<unsigned> counts(num_blocks * 256);
+
+      for (int shift = 0; shift != 32; shift += 8) {
+        const uint32_t *src = codes.data();
+        const unsigned *src_index = index.data();
+        uint32_t *dest = tmp_codes.data();
+        unsigned *dest_index = tmp_index.data();
+        unsigned *cnt = counts.data();
+
+        // histogram of each block
+        js.parallel_for(0, num_blocks, 1, [=](int b0, int b1) {
+          for (int b = b0; b != b1; ++b) {
+            unsigned *c = cnt + b * 256;
+            memset(c, 0, 256 * sizeof(unsigned));
+            int end = std::min(n, (b + 1) * grain);
+            for (int i = b * grain; i != end; ++i) {
+              c[(src[i] >> shift) & 0xff]++;
+            }
+          }
+        });
+
+        // start of each digit in each block
+        unsigned total = 0;
+        for (int d = 0; d != 256; ++d) {
+          for (int b = 0; b != num_blocks; ++b) {
+            unsigned c = cnt[b * 256 + d];
+            cnt[b * 256 + d] = total;
+            total += c;
+          }
+        }
+
+        // stable scatter
+        js.parallel_for(0, num_blocks, 1, [=](int b0, int b1) {
+          for (int b = b0; b != b1; ++b) {
+            unsigned *c = cnt + b * 256;
+            int end = std::min(n, (b + 1) * grain);
+            for (int i = b * grain; i != end; ++i) {
+              unsigned pos = c[(src[i] >> shift) & 0xff]++;
+              dest[pos] = src[i];
+              dest_index[pos] = src_index[i];
+            }
+          }
+        });
+
+        codes.swap(tmp_codes);
+        index.swap(tmp_index);
+      }
+    }
+
+    // make the interior node i of the Karras tree.
+    static void make_node(build_node *tree, int *parent, const uint32_t *codes, int n, int i) {
+      // direction of the range
+      int d = delta(codes, n, i, i + 1) - delta(codes, n, i, i - 1) >= 0 ? 1 : -1;
+      int delta_min = delta(codes, n, i, i - d);
+
+      // upper bound of the length of the range
+      int l_max = 2;
+      while (delta(codes, n, i, i + l_max * d) > delta_min) l_max *= 2;
+
+      // find the other end by binary search
+      int l = 0;
+      for (int t = l_max / 2; t >= 1; t /= 2) {
+        if (delta(codes, n, i, i + (l + t) * d) > delta_min) l += t;
+      }
+      int j = i + l * d;
+
+      // find the split position by binary search
+      int delta_node = delta(codes, n, i, j);
+      int s = 0;
+      for (int t = (l + 1) / 2; ; t = (t + 1) / 2) {
+        if (delta(codes, n, i, i + (s + t) * d) > delta_node) s += t;
+        if (t == 1) break;
+      }
+      int split = i + s * d + std::min(d, 0);
+
+      build_node &node = tree[i];
+      node.first = std::min(i, j);
+      node.last = std::max(i, j);
+      node.left = node.first == split ? (n - 1) + split : split;
+      node.right = node.last == split + 1 ? (n - 1) + split + 1 : split + 1;
+      parent[node.left] = i;
+      parent[node.right] = i;
+    }
+
+    // write the tree depth first. A node's escape is the next node on the stack when it is written.
+    void flatten(const build_node *tree, int n) {
+      struct stack_t { int node; int id; };
+      dynarray<stack_t> stack;
+      dynarray<int> id_index;   // node index of each stack entry
+      dynarray<int> escape_id;  // stack entry each node escapes to
+      nodes.reserve(n * 4);
+      escape_id.reserve(n * 2);
+      id_index.reserve(n * 2);
+      stack.reserve(64);
+      stack_t root = { 0, 0 };
+      stack.push_back(root);
+      id_index.push_back(0);
+      while (stack.size()) {
+        stack_t s = stack.back();
+        stack.pop_back();
+
+        int index = (int)nodes.size() / 2;
+        id_index[s.id] = index;
+        escape_id.push_back(stack.size() ? stack.back().id : -1);
+
+        const build_node &b = tree[s.node];
+        bool leaf = s.node >= n - 1 || b.last - b.first < max_leaf_spheres;
+        int count = b.last - b.first + 1;
+        nodes.push_back(vec4(b.min, leaf ? (float)-count : 0.0f));
+        nodes.push_back(vec4(b.max, (float)b.first));
+
+        if (!leaf) {
+          stack_t right = { b.right, (int)id_index.size() };
+          stack_t left = { b.left, (int)id_index.size() + 1 };
+          id_index.push_back(0);
+          id_index.push_back(0);
+          stack.push_back(right);
+          stack.push_back(left);
+        }
+      }
+
+      int num_nodes = (int)nodes.size() / 2;
+      for (int i = 0; i != num_nodes; ++i) {
+        if (nodes[i * 2][3] == 0) {
+          nodes[i * 2][3] = (float)(escape_id[i] == -1 ? num_nodes : id_index[escape_id[i]]);
+        }
+      }
+    }
+
+    static bool ray_box(vec3_in origin, vec3_in inv_dir, const vec4 &min, const vec4 &max, float max_t) {
+      vec3 t0 = (min.xyz() - origin) * inv_dir;
+      vec3 t1 = (max.xyz() - origin) * inv_dir;
+      vec3 tmin = math::min(t0, t1), tmax = math::max(t0, t1);
+      float enter = std::max(std::max(tmin.x(), tmin.y()), std::max(tmin.z(), 0.0f));
+      float leave = std::min(std::min(tmax.x(), tmax.y()), std::min(tmax.z(), max_t));
+      return enter <= leave;
+    }
+
+  public:
+    sphere_bvh() {
+    }
+
+    /// Build the tree from spheres: xyz is the centre and w the radius.
+    void build(const vec4 *src, unsigned num_spheres) {
+      assert(num_spheres <= max_spheres && "sphere_bvh: node indices would not fit in a float");
+      spheres.resize(num_spheres);
+      order.resize(num_spheres);
+      nodes.resize(0);
+      if (num_spheres == 0) return;
+
+      job_scheduler &js = job_scheduler::get();
+      int n = (int)num_spheres;
+
+      // bounds of the centres
+      int num_blocks = (n + grain - 1) / grain;
+      dynarray<vec3p> block_min(num_blocks), block_max(num_blocks);
+      js.parallel_for(0, num_blocks, 1, [&](int b0, int b1) {
+        for (int b = b0; b != b1; ++b) {
+          vec3 lo = src[b * grain].xyz(), hi = lo;
+          int end = std::min(n, (b + 1) * grain);
+          for (int i = b * grain; i != end; ++i) {
+            lo = math::min(lo, src[i].xyz());
+            hi = math::max(hi, src[i].xyz());
+          }
+          block_min[b] = lo;
+          block_max[b] = hi;
+        }
+      });
+      vec3 lo = block_min[0], hi = block_max[0];
+      for (int b = 1; b != num_blocks; ++b) {
+        lo = math::min(lo, (vec3)block_min[b]);
+        hi = math::max(hi, (vec3)block_max[b]);
+      }
+
+      // Morton codes of the centres
+      vec3 extent = hi - lo;
+      float scale = 1023.0f / std::max(std::max(extent.x(), extent.y()), std::max(extent.z(), 1e-6f));
+      dynarray<uint32_t> codes(n);
+      js.parallel_for(0, n, grain, [&](int begin, int end) {
+        for (int i = begin; i != end; ++i) {
+          vec3 p = (src[i].xyz() - lo) * scale;
+          codes[i] = expand_bits((uint32_t)p.x()) << 2 | expand_bits((uint32_t)p.y()) << 1 | expand_bits((uint32_t)p.z());
+          order[i] = (unsigned)i;
+        }
+      });
+
+      radix_sort(codes, order);
+
+      js.parallel_for(0, n, grain, [&](int begin, int end) {
+        for (int i = begin; i != end; ++i) {
+          spheres[i] = src[order[i]];
+        }
+      });
+
+      if (n == 1) {
+        nodes.push_back(vec4(spheres[0].xyz() - spheres[0].w(), -1.0f));
+        nodes.push_back(vec4(spheres[0].xyz() + spheres[0].w(), 0.0f));
+        return;
+      }
+
+      // interior nodes 0..n-2 followed by leaves n-1..2n-2
+      dynarray<build_node> tree(2 * n - 1);
+      dynarray<int> parent(2 * n - 1);
+      build_node *t = tree.data();
+      int *par = parent.data();
+      const uint32_t *c = codes.data();
+      parent[0] = -1;
+      js.parallel_for(0, n - 1, grain, [=](int begin, int end) {
+        for (int i = begin; i != end; ++i) {
+          make_node(t, par, c, n, i);
+        }
+      });
+
+      // bounds from the leaves up. The second child to arrive at a node does its parent.
+      std::atomic<int> *visits = new std::atomic<int>[n - 1];
+      for (int i = 0; i != n - 1; ++i) visits[i] = 0;
+      const vec4 *s = spheres.data();
+      js.parallel_for(0, n, grain, [=](int begin, int end) {
+        for (int i = begin; i != end; ++i) {
+          build_node &leaf = t[(n - 1) + i];
+          leaf.min = s[i].xyz() - s[i].w();
+          leaf.max = s[i].xyz() + s[i].w();
+          leaf.first = leaf.last = i;
+          for (int p = par[(n - 1) + i]; p != -1; p = par[p]) {
+            if (visits[p].fetch_add(1) == 0) break;
+            build_node &node = t[p];
+            node.min = math::min((vec3)t[node.left].min, (vec3)t[node.right].min);
+            node.max = math::max((vec3)t[node.left].max, (vec3)t[node.right].max);
+          }
+        }
+      });
+      delete [] visits;
+
+      flatten(t, n);
+    }
+
+    /// Spheres in tree order.
+    const dynarray<vec4> &get_spheres() const {
+      return spheres;
+    }
+
+    /// Index in the source array of each sphere in tree order.
+    const dynarray<unsigned> &get_order() const {
+      return order;
+    }
+
+    /// Nodes as pairs of vec4s (see above).
+    const dynarray<vec4> &get_nodes() const {
+      return nodes;
+    }
+
+    /// Number of nodes. get_nodes().size() is twice this.
+    unsigned get_num_nodes() const {
+      return nodes.size() / 2;
+    }
+
+    /// Find the closest sphere hit by a ray. Returns the sphere (in tree order) or -1.
+    /// distance is the maximum distance on entry and the distance to the hit on exit.
+    int ray_cast(vec3_in origin, vec3_in direction, float &distance) const {
+      vec3 dir = normalize(direction);
+      vec3 inv_dir = vec3(1.0f / dir.x(), 1.0f / dir.y(), 1.0f / dir.z());
+      int num_nodes = (int)nodes.size() / 2;
+      int result = -1;
+      for (int i = 0; i < num_nodes; ) {
+        const vec4 &min = nodes[i * 2];
+        const vec4 &max = nodes[i * 2 + 1];
+        if (ray_box(origin, inv_dir, min, max, distance)) {
+          if (min.w() < 0) {
+            int first = (int)max.w();
+            int count = (int)-min.w();
+            for (int j = first; j != first + count; ++j) {
+              // ray/sphere: |o + t d - c|^2 = r^2. Measure the miss distance directly
+              // as b * b - c loses precision when the sphere is far away.
+              vec3 oc = origin - spheres[j].xyz();
+              float b = dot(oc, dir);
+              vec3 miss = oc - dir * b;
+              float disc = spheres[j].w() * spheres[j].w() - dot(miss, miss);
+              if (disc >= 0) {
+                float t = -b - sqrtf(disc);
+                if (t >= 0 && t < distance) {
+                  distance = t;
+                  result = j;
+                }
+              }
+            }
+          }
+          ++i;
+        } else {
+          i = min.w() < 0 ? i + 1 : (int)min.w();
+        }
+      }
+      return result;
+    }
+  };
+}}
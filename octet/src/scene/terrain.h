@@ -0,0 +1,484 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Streaming, chunked terrain with distance based LOD.
+//
+
+namespace octet { namespace scene {
+  /// Streaming quadtree terrain made of fixed size chunks.
+  ///
+  /// Every chunk has the same number of quads, so a chunk at LOD level n covers
+  /// 2^n times the ground of a level 0 chunk and all chunks share a single index buffer.
+  /// Chunks are chosen each frame by distance from the camera (like CDLOD) and
+  /// generated on worker threads, so the geometry_source must be thread safe.
+  ///
+  /// Only the chunks near the camera are resident and there is a fixed pool of them,
+  /// so memory use depends on max_chunks and not on the size of the terrain.
+  ///
+  /// Vertices near the far edge of each LOD band are morphed towards the next coarser level
+  /// and every chunk has a skirt, so there are no cracks or pops between levels.
+  /// While a chunk is being generated, the chunks it replaces are drawn instead. A finer chunk
+  /// inside one of these is hidden until then, so two levels are never drawn in the same place.
+  ///
+  /// Example:
+  ///
+  ///     the_terrain = new terrain(app_scene, new material(new image("assets/grass.jpg")), source, vec3(16384, 0, 16384));
+  ///     ...
+  ///     // every frame, before rendering
+  ///     the_terrain->update(the_camera->get_node()->get_position());
+  class terrain : public resource {
+  public:
+    typedef mesh_terrain::geometry_source geometry_source;
+
+  private:
+    // generates the vertices of one chunk on a worker thread.
+    struct chunk_job : job {
+      const terrain *owner;
+      int lod;
+      int x;
+      int z;
+      vec3 camera_pos;
+      dynarray<mesh::vertex> vertices;
+      aabb bounds;
+
+      void kernel() {
+        owner->generate(*this);
+      }
+    };
+
+    // a slot in the pool of resident chunks.
+    struct chunk {
+      uint64_t key;       // zero if this slot is free
+      int lod;
+      int x;
+      int z;
+      bool ready;         // the vertex buffer holds this chunk
+      vec3 camera_pos;    // camera position at the last generation (for morphing)
+      ref<mesh> msh;
+      ref<scene_node> node;
+      ref<mesh_instance> inst;
+      ref<chunk_job> pending;
+    };
+
+    ref<visual_scene> scene;
+    geometry_source &source;
+
+    // all positions are relative to this, the corner of the terrain
+    vec3 origin;
+    vec3 size;
+
+    float chunk_size;       // size of a LOD 0 chunk
+    int chunk_quads;        // quads along the edge of every chunk (even)
+    int num_lods;
+    float lod_distance;     // a chunk at level n is used up to lod_distance * its size from the camera
+    float morph_ratio;      // morphing starts at this fraction of the LOD range
+    float uv_scale;         // texture repeats per unit
+    int max_jobs;           // generation jobs in flight
+
+    dynarray<chunk> chunks;
+    ref<gl_resource> shared_indices;
+    unsigned num_indices;
+    unsigned num_vertices;
+
+    // desired chunk keys for this frame -> slot index + 1 (or 0 if not resident)
+    hash_map<uint64_t, int> desired;
+    dynarray<int> missing;  // desired chunks that are not ready yet (key order as in desired_keys)
+    dynarray<uint64_t> desired_keys;
+
+    // keys of the ready chunks, to find the ones inside a coarser ready chunk.
+    hash_map<uint64_t, int> ready_keys;
+
+    static uint64_t make_key(int lod, int x, int z) {
+      return ((uint64_t)(lod + 1) << 48) | ((uint64_t)(x & 0xffffff) << 24) | (uint64_t)(z & 0xffffff);
+    }
+
+    static int key_lod(uint64_t key) { return (int)(key >> 48) - 1; }
+    static int key_x(uint64_t key) { return (int)(key >> 24) & 0xffffff; }
+    static int key_z(uint64_t key) { return (int)key & 0xffffff; }
+
+    float get_chunk_size(int lod) const {
+      return chunk_size * (float)(1 << lod);
+    }
+
+    float get_lod_range(int lod) const {
+      return get_chunk_size(lod) * lod_distance;
+    }
+
+    // distance in the xz plane from the camera to a chunk.
+    float chunk_distance(vec3_in cam, int lod, int x, int z) const {
+      float s = get_chunk_size(lod);
+      float dx = std::max(0.0f, std::max(x * s - cam.x(), cam.x() - (x + 1) * s));
+      float dz = std::max(0.0f, std::max(z * s - cam.z(), cam.z() - (z + 1) * s));
+      return sqrtf(dx * dx + dz * dz + cam.y() * cam.y());
+    }
+
+    // recursive quadtree walk: subdivide chunks that are in range of the finer level.
+    void select(vec3_in cam, int lod, int x, int z) {
+      float s = get_chunk_size(lod);
+      if (x * s >= size.x() || z * s >= size.z()) return;
+
+      float d = chunk_distance(cam, lod, x, z);
+      if (lod == num_lods - 1 && d > get_lod_range(lod)) return;
+
+      if (lod != 0 && d < get_lod_range(lod - 1)) {
+        for (int i = 0; i != 4; ++i) {
+          select(cam, lod - 1, x * 2 + (i & 1), z * 2 + (i >> 1));
+        }
+      } else {
+        uint64_t key = make_key(lod, x, z);
+        desired[key] = 0;
+        desired_keys.push_back(key);
+      }
+    }
+
+    // called on a worker thread: sample the source and morph odd vertices.
+    void generate(chunk_job &jb) const {
+      int n = chunk_quads, stride = n + 1;
+      float s = get_chunk_size(jb.lod);
+      float step = s / n;
+      vec3 chunk_min = vec3(jb.x * s, 0, jb.z * s);
+      vec3 chunk_origin = origin + chunk_min;
+      vec3 uv_min = vec3(0);
+      vec3 uv_delta = vec3(uv_scale, uv_scale, 0);
+
+      jb.vertices.resize(num_vertices);
+      mesh::vertex *vtx = jb.vertices.data();
+      for (int j = 0; j <= n; ++j) {
+        for (int i = 0; i <= n; ++i) {
+          mesh::vertex v = source.vertex(origin, uv_min, uv_delta, chunk_min + vec3(i * step, 0, j * step));
+          v.pos = (vec3)v.pos - chunk_origin;
+          vtx[i + j * stride] = v;
+        }
+      }
+
+      // geomorph: blend odd vertices towards the edge of the coarser triangle they lie on.
+      float morph_end = get_lod_range(jb.lod);
+      float morph_start = morph_end * morph_ratio;
+      vec3 cam = jb.camera_pos - chunk_origin;
+      for (int j = 0; j <= n; ++j) {
+        for (int i = (j & 1) ? 0 : 1; i <= n; i += (j & 1) ? 1 : 2) {
+          mesh::vertex &v = vtx[i + j * stride];
+          vec3 pos = v.pos;
+          vec3 cp = pos - cam;
+          float k = (sqrtf(cp.x() * cp.x() + cp.z() * cp.z() + cam.y() * cam.y()) - morph_start) / (morph_end - morph_start);
+          if (k <= 0) continue;
+          if (k > 1) k = 1;
+
+          const mesh::vertex *a, *b;
+          if (!(j & 1)) {
+            a = &vtx[(i - 1) + j * stride]; b = &vtx[(i + 1) + j * stride];
+          } else if (!(i & 1)) {
+            a = &vtx[i + (j - 1) * stride]; b = &vtx[i + (j + 1) * stride];
+          } else {
+            a = &vtx[(i - 1) + (j + 1) * stride]; b = &vtx[(i + 1) + (j - 1) * stride];
+          }
+          vec3 target_pos = ((vec3)a->pos + (vec3)b->pos) * 0.5f;
+          vec3 target_normal = ((vec3)a->normal + (vec3)b->normal) * 0.5f;
+          v.pos = pos + (target_pos - pos) * k;
+          v.normal = normalize((vec3)v.normal + (target_normal - (vec3)v.normal) * k);
+        }
+      }
+
+      // skirts: a copy of the boundary, dropped down, in the same order as the skirt indices.
+      float skirt_depth = step * 2;
+      mesh::vertex *skirt = vtx + stride * stride;
+      for (int e = 0; e != 4; ++e) {
+        for (int i = 0; i <= n; ++i) {
+          *skirt = vtx[boundary_index(e, i)];
+          skirt->pos = (vec3)skirt->pos - vec3(0, skirt_depth, 0);
+          skirt++;
+        }
+      }
+
+      vec3 vmin = (vec3)vtx[0].pos, vmax = vmin;
+      for (unsigned i = 1; i != num_vertices; ++i) {
+        vmin = min(vmin, (vec3)vtx[i].pos);
+        vmax = max(vmax, (vec3)vtx[i].pos);
+      }
+      jb.bounds = aabb((vmin + vmax) * 0.5f, (vmax - vmin) * 0.5f);
+    }
+
+    // walk the boundary of the grid in a loop so that skirts all face outwards.
+    int boundary_index(int edge, int i) const {
+      int n = chunk_quads, stride = n + 1;
+      switch (edge) {
+        case 0: return i;                           // z = 0, +x
+        case 1: return n + i * stride;              // x = n, +z
+        case 2: return (n - i) + n * stride;        // z = n, -x
+        default: return (n - i) * stride;           // x = 0, -z
+      }
+    }
+
+    // every chunk uses the same topology, so we only need one index buffer.
+    void build_indices() {
+      int n = chunk_quads, stride = n + 1;
+      dynarray<uint32_t> indices;
+      indices.reserve(n * n * 6 + n * 4 * 6);
+
+      for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < n; ++i) {
+          // 01 11
+          // 00 10
+          indices.push_back((i+0) + (j+0)*stride);
+          indices.push_back((i+0) + (j+1)*stride);
+          indices.push_back((i+1) + (j+0)*stride);
+          indices.push_back((i+1) + (j+0)*stride);
+          indices.push_back((i+0) + (j+1)*stride);
+          indices.push_back((i+1) + (j+1)*stride);
+        }
+      }
+
+      uint32_t skirt_base = stride * stride;
+      for (int e = 0; e != 4; ++e) {
+        for (int i = 0; i < n; ++i) {
+          uint32_t t0 = boundary_index(e, i), t1 = boundary_index(e, i + 1);
+          uint32_t b0 = skirt_base + e * stride + i, b1 = b0 + 1;
+          indices.push_back(t0);
+          indices.push_back(t1);
+          indices.push_back(b0);
+          indices.push_back(t1);
+          indices.push_back(b1);
+          indices.push_back(b0);
+        }
+      }
+
+      num_indices = indices.size();
+      num_vertices = stride * stride + 4 * stride;
+      shared_indices = new gl_resource(GL_ELEMENT_ARRAY_BUFFER, num_indices * sizeof(uint32_t));
+      shared_indices->assign(indices.data(), 0, num_indices * sizeof(uint32_t));
+    }
+
+    void start_job(chunk &c, vec3_in camera_pos) {
+      chunk_job *jb = new chunk_job();
+      jb->owner = this;
+      jb->lod = c.lod;
+      jb->x = c.x;
+      jb->z = c.z;
+      jb->camera_pos = camera_pos;
+      c.pending = jb;
+      c.camera_pos = camera_pos;
+      job_scheduler::get().add(jb);
+    }
+
+    int num_jobs_in_flight() const {
+      int result = 0;
+      for (unsigned i = 0; i != chunks.size(); ++i) {
+        if (chunks[i].pending) result++;
+      }
+      return result;
+    }
+
+    // true if a chunk overlaps one that we want but have not got yet.
+    bool covers_missing(const chunk &c) const {
+      float s = get_chunk_size(c.lod);
+      for (unsigned i = 0; i != missing.size(); ++i) {
+        uint64_t key = desired_keys[missing[i]];
+        float ms = get_chunk_size(key_lod(key));
+        float mx = key_x(key) * ms, mz = key_z(key) * ms;
+        if (mx < (c.x + 1) * s && c.x * s < mx + ms && mz < (c.z + 1) * s && c.z * s < mz + ms) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // draw only the coarsest of the ready chunks in any place. Chunks are aligned to the quadtree,
+    // so two that overlap are one inside the other and the coarser one covers the finer one.
+    void hide_covered_chunks() {
+      ready_keys.clear();
+      for (unsigned i = 0; i != chunks.size(); ++i) {
+        if (chunks[i].ready) ready_keys[chunks[i].key] = 1;
+      }
+
+      for (unsigned i = 0; i != chunks.size(); ++i) {
+        chunk &c = chunks[i];
+        if (!c.ready) continue;
+        bool covered = false;
+        for (int lod = c.lod + 1; lod < num_lods && !covered; ++lod) {
+          int shift = lod - c.lod;
+          covered = ready_keys.contains(make_key(lod, c.x >> shift, c.z >> shift));
+        }
+        unsigned flags = c.inst->get_flags() & ~mesh_instance::flag_enabled;
+        c.inst->set_flags(covered ? flags : flags | mesh_instance::flag_enabled);
+      }
+    }
+
+    // sort missing chunks by distance from the camera.
+    struct missing_order_cmp {
+      const terrain *t;
+      vec3 cam;
+      float distance(int i) const {
+        uint64_t key = t->desired_keys[i];
+        return t->chunk_distance(cam, key_lod(key), key_x(key), key_z(key));
+      }
+      bool operator()(int a, int b) const { return distance(a) < distance(b); }
+    };
+
+    void free_chunk(chunk &c) {
+      c.key = 0;
+      c.ready = false;
+      c.inst->set_flags(c.inst->get_flags() & ~mesh_instance::flag_enabled);
+    }
+
+  public:
+    /// Make a terrain of a certain size in the xz plane, starting at the origin, and add its chunks to a scene.
+    terrain(
+      visual_scene *scene, material *mat, geometry_source &source, vec3_in size,
+      float chunk_size=64.0f, int chunk_quads=32, int num_lods=8, int max_chunks=512
+    ) : scene(scene), source(source), size(size), chunk_size(chunk_size), chunk_quads(chunk_quads & ~1), num_lods(num_lods) {
+      origin = vec3(0);
+      lod_distance = 2.0f;
+      morph_ratio = 0.7f;
+      uv_scale = 0.3f;
+      max_jobs = job_scheduler::get().get_num_threads() * 2;
+
+      build_indices();
+
+      chunks.resize(max_chunks);
+      for (int i = 0; i != max_chunks; ++i) {
+        chunk &c = chunks[i];
+        c.key = 0;
+        c.lod = c.x = c.z = 0;
+        c.ready = false;
+        c.msh = new mesh();
+        c.msh->set_default_attributes();
+        c.msh->get_vertices()->allocate(GL_ARRAY_BUFFER, num_vertices * sizeof(mesh::vertex));
+        c.msh->set_indices(shared_indices);
+        c.msh->set_params(sizeof(mesh::vertex), num_indices, num_vertices, GL_TRIANGLES, GL_UNSIGNED_INT);
+        c.node = scene->add_scene_node();
+        c.inst = new mesh_instance(c.node, c.msh, mat);
+        c.inst->set_flags(0);
+        scene->add_mesh_instance(c.inst);
+      }
+    }
+
+    /// wait for any chunks still being generated; they refer to us.
+    ~terrain() {
+      for (unsigned i = 0; i != chunks.size(); ++i) {
+        if (chunks[i].pending) job_scheduler::get().wait(chunks[i].pending);
+      }
+    }
+
+    /// move the terrain so that its corner is not at the origin.
+    void set_origin(vec3_in value) {
+      origin = value;
+    }
+
+    /// set the distance, in chunk sizes, at which to switch to a coarser LOD.
+    void set_lod_distance(float value) {
+      lod_distance = value;
+    }
+
+    /// set the texture repeat rate.
+    void set_uv_scale(float value) {
+      uv_scale = value;
+    }
+
+    /// how many chunks are visible at the moment?
+    int get_num_ready_chunks() const {
+      int result = 0;
+      for (unsigned i = 0; i != chunks.size(); ++i) {
+        if (chunks[i].ready) result++;
+      }
+      return result;
+    }
+
+    /// Call once per frame with the camera position to stream chunks in and out.
+    /// This must be called on the OpenGL thread.
+    void update(vec3_in camera_pos) {
+      vec3 cam = camera_pos - origin;
+
+      // collect finished chunks.
+      for (unsigned i = 0; i != chunks.size(); ++i) {
+        chunk &c = chunks[i];
+        if (c.pending && c.pending->is_done()) {
+          chunk_job *jb = c.pending;
+          if (c.key == make_key(jb->lod, jb->x, jb->z)) {
+            c.msh->get_vertices()->assign(jb->vertices.data(), 0, num_vertices * sizeof(mesh::vertex));
+            c.msh->set_aabb(jb->bounds);
+            mat4t &mat = c.node->access_nodeToParent();
+            mat.loadIdentity();
+            mat.translate(origin.x() + jb->x * get_chunk_size(jb->lod), origin.y(), origin.z() + jb->z * get_chunk_size(jb->lod));
+            c.ready = true;
+          }
+          c.pending = 0;
+        }
+      }
+
+      // walk the quadtree from the roots in range.
+      desired.clear();
+      desired_keys.resize(0);
+      int top = num_lods - 1;
+      float root_size = get_chunk_size(top);
+      float range = get_lod_range(top);
+      int x0 = std::max(0, (int)floorf((cam.x() - range) / root_size));
+      int z0 = std::max(0, (int)floorf((cam.z() - range) / root_size));
+      int x1 = (int)floorf((cam.x() + range) / root_size);
+      int z1 = (int)floorf((cam.z() + range) / root_size);
+      for (int z = z0; z <= z1; ++z) {
+        for (int x = x0; x <= x1; ++x) {
+          select(cam, top, x, z);
+        }
+      }
+
+      // match resident chunks with desired ones.
+      for (unsigned i = 0; i != chunks.size(); ++i) {
+        if (chunks[i].key && desired.contains(chunks[i].key)) {
+          desired[chunks[i].key] = i + 1;
+        }
+      }
+
+      missing.resize(0);
+      for (unsigned i = 0; i != desired_keys.size(); ++i) {
+        int slot = desired[desired_keys[i]];
+        if (!slot || !chunks[slot - 1].ready) missing.push_back(i);
+      }
+
+      // evict chunks we no longer want, unless they are filling a gap.
+      for (unsigned i = 0; i != chunks.size(); ++i) {
+        chunk &c = chunks[i];
+        if (c.key && !desired.contains(c.key) && !(c.ready && covers_missing(c))) {
+          free_chunk(c);
+        }
+      }
+      hide_covered_chunks();
+
+      // start generating missing chunks, nearest first.
+      missing_order_cmp cmp = { this, cam };
+      std::sort(missing.data(), missing.data() + missing.size(), cmp);
+
+      int jobs = num_jobs_in_flight();
+      unsigned free_slot = 0;
+      for (unsigned i = 0; i != missing.size() && jobs < max_jobs; ++i) {
+        uint64_t key = desired_keys[missing[i]];
+        if (desired[key]) continue;
+
+        while (free_slot != chunks.size() && (chunks[free_slot].key || chunks[free_slot].pending)) {
+          free_slot++;
+        }
+        if (free_slot == chunks.size()) break;
+
+        chunk &c = chunks[free_slot];
+        c.key = key;
+        c.lod = key_lod(key);
+        c.x = key_x(key);
+        c.z = key_z(key);
+        desired[key] = free_slot + 1;
+        start_job(c, camera_pos);
+        jobs++;
+      }
+
+      // refresh the morph of chunks the camera has moved a long way from.
+      for (unsigned i = 0; i != chunks.size() && jobs < max_jobs; ++i) {
+        chunk &c = chunks[i];
+        if (c.ready && !c.pending && length(camera_pos - c.camera_pos) > get_chunk_size(c.lod) * 0.25f) {
+          start_job(c, camera_pos);
+          jobs++;
+        }
+      }
+    }
+  };
+}}
@@ -18,6 +18,11 @@ namespace octet { namespace scene {
     /// each of these is a set of (scene_node, mesh, material)
     dynarray<ref<mesh_instance> > mesh_instances;
 
+    /// the enabled subset of mesh_instances, rebuilt only when something is enabled or disabled
+    dynarray<mesh_instance*> active_mesh_instances;
+    unsigned active_generation;
+    bool active_dirty;
+
     /// animations playing at the moment
     dynarray<ref<animation_instance> > animation_instances;
 
@@ -52,7 +57,9 @@ namespace octet { namespace scene {
       btCollisionDispatcher *dispatcher;            /// handler for collisions between objects
       btDbvtBroadphase *broadphase;                 /// handler for broadphase (rough) collision
       btSequentialImpulseConstraintSolver *solver;  /// handler to resolve collisions
-      btDiscreteDynamicsWorld *world;             /// physics world, contains rigid bodies
+      physics_world *world;                         /// physics world, contains rigid bodies
+      float physics_fixed_time_step;                /// zero to step by the frame time
+      int physics_max_substeps;                     /// maximum number of fixed steps per update
       typedef btCollisionShape collison_shape_t;
     #else
       typedef void collison_shape_t;
@@ -181,6 +188,19 @@ namespace octet { namespace scene {
       }
     }
 
+    void update_active_mesh_instances() {
+      if (!active_dirty && active_generation == scene_node::enable_generation()) return;
+      active_mesh_instances.resize(0);
+      for (unsigned i = 0; i != mesh_instances.size(); ++i) {
+        mesh_instance *mi = mesh_instances[i];
+        if ((mi->get_flags() & mesh_instance::flag_enabled) && mi->get_node()->calcEnabled()) {
+          active_mesh_instances.push_back(mi);
+        }
+      }
+      active_generation = scene_node::enable_generation();
+      active_dirty = false;
+    }
+
     void render_impl(bump_shader &object_shader, bump_shader &skin_shader, camera_instance &cam, float aspect_ratio) {
       mat4t cameraToWorld = cam.get_node()->calcModelToWorld();
 
@@ -194,17 +214,14 @@ namespace octet { namespace scene {
 
       draw_debug_data(cam);
 
-      for (unsigned mesh_index = 0; mesh_index != mesh_instances.size(); ++mesh_index) {
-        mesh_instance *mi = mesh_instances[mesh_index];
+      update_active_mesh_instances();
+
+      for (unsigned mesh_index = 0; mesh_index != active_mesh_instances.size(); ++mesh_index) {
+        mesh_instance *mi = active_mesh_instances[mesh_index];
 
         scene_node *node = mi->get_node();
         unsigned flags = mi->get_flags();
 
-        if (
-          !(flags & mesh_instance::flag_enabled) ||
-          !node->calcEnabled()
-        ) continue;
-
         mesh *msh = mi->get_mesh();
         skin *skn = msh->get_skin();
         skeleton *skel = mi->get_skeleton();
@@ -268,6 +285,8 @@ namespace octet { namespace scene {
     /// Create an empty visual_scene; Use add_* functions to add components to the scene.
     visual_scene() {
       frame_number = 0;
+      active_generation = 0;
+      active_dirty = true;
       num_light_uniforms = 0;
       num_lights = 0;
       render_aabbs = false;
@@ -283,7 +302,9 @@ namespace octet { namespace scene {
         dispatcher = new btCollisionDispatcher(&config);
         broadphase = new btDbvtBroadphase();
         solver = new btSequentialImpulseConstraintSolver();
-        world = new btDiscreteDynamicsWorld(dispatcher, broadphase, solver, &config);
+        world = new physics_world(dispatcher, broadphase, solver, &config);
+        physics_fixed_time_step = 0;
+        physics_max_substeps = 1;
       #endif
     }
 
@@ -308,17 +329,13 @@ namespace octet { namespace scene {
       }
 
       #ifdef OCTET_BULLET
-        btMatrix3x3 matrix(get_btMatrix3x3(mat));
-        btVector3 pos(get_btVector3(mat[3].xyz()));
-
         if (shape == NULL) {
           shape = is_dynamic ? msh->get_bullet_shape() : msh->get_static_bullet_shape();
         }
 
         if (shape) {
-          btTransform transform(matrix, pos);
-
-          btDefaultMotionState *motionState = new btDefaultMotionState(transform);
+          // the motion state reads the initial transform from the node.
+          scene_node_motion_state *motionState = new scene_node_motion_state(node);
           btVector3 inertiaTensor;
 
           if (!is_dynamic) mass = 0;
@@ -338,6 +355,7 @@ namespace octet { namespace scene {
     void visit(visitor &v) {
       scene_node::visit(v);
       v.visit(mesh_instances, atom_mesh_instances);
+      active_dirty = true;
       v.visit(animation_instances, atom_animation_instances);
       v.visit(camera_instances, atom_camera_instances);
       v.visit(light_instances, atom_light_instances);
@@ -346,6 +364,8 @@ namespace octet { namespace scene {
     /// reset the scene.
     void reset() {
       mesh_instances.reset();
+      active_mesh_instances.reset();
+      active_dirty = true;
       animation_instances.reset();
       camera_instances.reset();
       light_instances.reset();
@@ -443,6 +463,7 @@ namespace octet { namespace scene {
 
     mesh_instance *add_mesh_instance(mesh_instance *inst=0) {
       mesh_instances.push_back(inst);
+      active_dirty = true;
       return inst;
     }
 
@@ -511,6 +532,20 @@ namespace octet { namespace scene {
       dump_vertices = value;
     }
 
+    #ifdef OCTET_BULLET
+      /// Step physics in fixed steps of fixed_time_step, at most max_substeps per update.
+      /// Bodies are drawn between steps. A time step of zero steps once by the frame time.
+      void set_physics_step(float fixed_time_step, int max_substeps = 4) {
+        physics_fixed_time_step = fixed_time_step;
+        physics_max_substeps = max_substeps;
+      }
+
+      /// Solve the physics islands on the job_scheduler threads.
+      void set_physics_multithreaded(bool value) {
+        world->set_multithreaded(value);
+      }
+    #endif
+
     /// access camera_instance information
     camera_instance *get_camera_instance(int index) {
       return camera_instances[index];
@@ -530,16 +565,11 @@ namespace octet { namespace scene {
     /// note that we want to update before rendering or doing physics and AI actions.
     void update(float delta_time) {
       #ifdef OCTET_BULLET
-        world->stepSimulation(delta_time, 1, delta_time);
-        btCollisionObjectArray &array = world->getCollisionObjectArray();
-        for (int i = 0; i != array.size(); ++i) {
-          btCollisionObject *co = array[i];
-          scene_node *node = (scene_node *)co->getUserPointer();
-          if (node) {
-            mat4t &mat = node->access_nodeToParent();
-            co->getWorldTransform().getOpenGLMatrix(mat.get());
-            //printf("%d %f\n", i, mat.w().y());
-          }
+        // the motion states write the transforms of moving bodies to their nodes.
+        if (physics_fixed_time_step > 0) {
+          world->stepSimulation(delta_time, physics_max_substeps, physics_fixed_time_step);
+        } else {
+          world->stepSimulation(delta_time, 1, delta_time);
         }
       #endif
 
@@ -19,9 +19,17 @@ namespace octet { namespace shaders {
 
     void init_uniforms(const char *vertex_shader, const char *fragment_shader) {
       // use the common shader code to compile and link the shaders
-      // the result is a shader program
-      shader::init(vertex_shader, fragment_shader);
+      // the result is a shader program, which may still be compiling in the background
+      shader::init_async(vertex_shader, fragment_shader);
+      get_uniform_locations();
+    }
+
+    // the program changes when the background compile finishes
+    void on_ready() {
+      get_uniform_locations();
+    }
 
+    void get_uniform_locations() {
       // extract the indices of the uniforms to use later
       modelToProjection_index = glGetUniformLocation(program(), "modelToProjection");
       cameraToProjection_index = glGetUniformLocation(program(), "cameraToProjection");
@@ -0,0 +1,249 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Compute shader that runs on the CPU cores
+
+namespace octet { namespace shaders {
+  /// A compute shader for machines without GPU compute.
+  ///
+  /// The kernel is compiled to vector code by compiler::cpp_kernel. Buffers are plain memory
+  /// and the work groups are shared between the job_scheduler threads.
+  ///
+  /// Example:
+  ///
+  ///     ref<cpu_compute_shader> compute = new cpu_compute_shader("shaders/helix.cs");
+  ///     compute->set_uniform("num_steps", 320);
+  ///     compute->set_buffer(0, vertices, sizeof(vertices));
+  ///     compute->dispatch((320 + 63) / 64);
+  class cpu_compute_shader : public resource {
+    typedef compiler::cpp_kernel::lane_reg lane_reg;
+    typedef compiler::cpp_kernel::buffer_binding buffer_binding;
+
+    compiler::cpp_kernel kernel;
+    bool compiled;
+
+    // constants and uniforms, copied to each thread's registers.
+    dynarray<lane_reg> image;
+    dynarray<buffer_binding> buffers;
+
+    void set_uniform_bits(const char *name, const void *bits, unsigned size) {
+      const compiler::cpp_kernel::uniform_info *info = kernel.get_uniform(name);
+      if (!info) return;
+      for (unsigned i = 0; i != size && i != info->size; ++i) {
+        uint32_t value;
+        memcpy(&value, (const uint32_t*)bits + i, 4);
+        for (int l = 0; l != compiler::cpp_kernel::lanes; ++l) {
+          image[info->reg + i].u[l] = value;
+        }
+      }
+    }
+
+  public:
+    cpu_compute_shader() {
+      compiled = false;
+    }
+
+    /// Load and compile a kernel such as shaders/helix.cs, with optional "NAME=value" defines.
+    cpu_compute_shader(const char *url, const char *const *defines = nullptr, unsigned num_defines = 0) {
+      compiled = false;
+      init(url, defines, num_defines);
+    }
+
+    bool init(const char *url, const char *const *defines = nullptr, unsigned num_defines = 0) {
+      dynarray<uint8_t> text;
+      app_utils::get_url(text, url);
+      text.push_back(0);
+      return init_source((const char*)text.data(), url, defines, num_defines);
+    }
+
+    /// Compile a kernel from memory.
+    bool init_source(const char *source, const char *name = "kernel.cs", const char *const *defines = nullptr, unsigned num_defines = 0) {
+      compiled = kernel.compile(source, name, defines, num_defines);
+      if (!compiled) {
+        log("CPU compute shader %s did not compile: %s\n", name, kernel.get_error());
+        return false;
+      }
+
+      const dynarray<lane_reg> &src = kernel.get_image();
+      image.resize(src.size());
+      memcpy(image.data(), src.data(), src.size() * sizeof(lane_reg));
+
+      buffers.resize(kernel.get_num_buffers());
+      for (unsigned i = 0; i != buffers.size(); ++i) {
+        buffers[i].data = nullptr;
+        buffers[i].num_words = 0;
+      }
+      return true;
+    }
+
+    /// True if the kernel compiled.
+    bool is_compiled() const {
+      return compiled;
+    }
+
+    void set_uniform(const char *name, float value) {
+      set_uniform_bits(name, &value, 1);
+    }
+
+    void set_uniform(const char *name, int value) {
+      set_uniform_bits(name, &value, 1);
+    }
+
+    void set_uniform(const char *name, unsigned value) {
+      set_uniform_bits(name, &value, 1);
+    }
+
+    void set_uniform(const char *name, const vec4 &value) {
+      float v[4] = { value[0], value[1], value[2], value[3] };
+      set_uniform_bits(name, v, 4);
+    }
+
+    /// Use memory for the buffer with layout(binding = n). Reads and writes outside the memory are ignored.
+    void set_buffer(unsigned binding, void *data, size_t bytes) {
+      for (unsigned i = 0; i != buffers.size(); ++i) {
+        if (kernel.get_buffer_binding(i) == binding) {
+          buffers[i].data = (uint32_t*)data;
+          buffers[i].num_words = (uint32_t)(bytes / 4);
+        }
+      }
+    }
+
+    /// Run x * y * z work groups on all the cores and wait for them to finish.
+    void dispatch(unsigned x, unsigned y = 1, unsigned z = 1) {
+      unsigned num_groups[3] = { x, y, z };
+      unsigned total = x * y * z;
+      if (!compiled || total == 0) return;
+
+      kernel.update_image(image.data());
+
+      job_scheduler &js = job_scheduler::get();
+      // the calling thread works too.
+      int num_threads = (int)std::min((unsigned)js.get_num_threads() + 1, total);
+      // take a few groups at a time so that the threads finish together.
+      unsigned batch = std::max(1u, total / (num_threads * 16));
+      std::atomic<unsigned> next(0);
+      unsigned frame_size = kernel.get_frame_size();
+
+      js.parallel_for(0, num_threads, 1, [&](int, int) {
+        dynarray<lane_reg> frame(frame_size);
+        kernel.init_frame(frame.data(), image.data());
+        for (;;) {
+          unsigned first = next.fetch_add(batch);
+          if (first >= total) break;
+          unsigned last = std::min(first + batch, total);
+          for (unsigned g = first; g != last; ++g) {
+            unsigned group_id[3] = { g % x, (g / x) % y, g / (x * y) };
+            kernel.run_group(frame.data(), buffers.data(), group_id, num_groups);
+          }
+        }
+      });
+    }
+
+    /// The compiled kernel.
+    const compiler::cpp_kernel &get_kernel() const {
+      return kernel;
+    }
+  };
+  #if OCTET_BENCHMARK
+    /// Vertices per second from shaders/helix.cs on one core, against the same loop in C++.
+    /// dispatch() shares the work groups between all the job_scheduler threads as well.
+    class cpu_compute_shader_benchmark {
+      typedef compiler::cpp_kernel::lane_reg lane_reg;
+      typedef compiler::cpp_kernel::buffer_binding buffer_binding;
+
+      static void run_kernel(const compiler::cpp_kernel &kernel, const lane_reg *image, dynarray<float> &out, unsigned passes, const char *name) {
+        dynarray<lane_reg> frame(kernel.get_frame_size());
+        kernel.init_frame(frame.data(), image);
+        buffer_binding buffer = { (uint32_t*)out.data(), out.size() };
+        unsigned num_groups[3] = { out.size() / 16 / kernel.get_local_size()[0], 1, 1 };
+        benchmark_timer timer;
+        for (unsigned p = 0; p != passes; ++p) {
+          for (unsigned g = 0; g != num_groups[0]; ++g) {
+            unsigned group_id[3] = { g, 0, 0 };
+            kernel.run_group(frame.data(), &buffer, group_id, num_groups);
+          }
+        }
+        timer.report(name, (double)passes * out.size() / 8, "vertices");
+      }
+    public:
+      cpu_compute_shader_benchmark() {
+        static const char source[] =
+          "struct my_vertex { vec4 pos; vec4 color; };\n"
+          "uniform float radius1 = 1.0f;\n"
+          "uniform float radius2 = 7.0f;\n"
+          "uniform float height = 24.0f;\n"
+          "uniform float num_twists = 4.0f;\n"
+          "uniform int num_steps = 320;\n"
+          "layout(std140, binding = 0) buffer dest_buf { my_vertex data[]; } out_buf;\n"
+          "layout (local_size_x = 64, local_size_y = 1, local_size_z = 1) in;\n"
+          "void main() {\n"
+          "  uint i = uint(gl_GlobalInvocationID.x);\n"
+          "  float r = 1.0f, g = float(i) * (1.0f / float(num_steps)), b = 0.0f;\n"
+          "  float y = float(i) * (height / float(num_steps)) - height * 0.5f;\n"
+          "  float angle = float(i) * (num_twists * 2.0f * 3.14159265f / float(num_steps));\n"
+          "  if (i <= num_steps) {\n"
+          "    out_buf.data[i*2+0].pos = vec4(cos(angle) * radius1, y, sin(angle) * radius1, 1);\n"
+          "    out_buf.data[i*2+0].color = vec4(r, g, b, 1);\n"
+          "    out_buf.data[i*2+1].pos = vec4(cos(angle) * radius2, y, sin(angle) * radius2, 1);\n"
+          "    out_buf.data[i*2+1].color = vec4(r, g, b, 1);\n"
+          "  }\n"
+          "}\n"
+        ;
+        enum { num_steps = 1 << 14, passes = 32 };
+
+        compiler::cpp_kernel kernel;
+        if (!kernel.compile(source, "helix.cs")) {
+          printf("cpu_compute_shader_benchmark: %s", kernel.get_error());
+          return;
+        }
+        dynarray<lane_reg> image(kernel.get_image().size());
+        memcpy(image.data(), kernel.get_image().data(), image.size() * sizeof(lane_reg));
+        const compiler::cpp_kernel::uniform_info *info = kernel.get_uniform("num_steps");
+        for (int l = 0; l != compiler::cpp_kernel::lanes; ++l) {
+          image[info->reg].i[l] = num_steps - 1;
+        }
+        kernel.update_image(image.data());
+
+        printf("cpu_compute_shader_benchmark: helix.cs, %d vertices, %d instructions\n", num_steps * 2, kernel.get_num_instructions());
+
+        // the same sums in C++, one invocation at a time.
+        dynarray<float> expected(num_steps * 16);
+        {
+          float radius1 = 1.0f, radius2 = 7.0f, height = 24.0f, num_twists = 4.0f;
+          float steps = (float)(num_steps - 1);
+          benchmark_timer timer;
+          for (unsigned p = 0; p != passes; ++p) {
+            for (unsigned i = 0; i != num_steps; ++i) {
+              float g = (float)i * (1.0f / steps);
+              float y = (float)i * (height / steps) - height * 0.5f;
+              float angle = (float)i * (num_twists * 2.0f * 3.14159265f / steps);
+              float c = cosf(angle), s = sinf(angle);
+              float v[16] = { c * radius1, y, s * radius1, 1, 1, g, 0, 1, c * radius2, y, s * radius2, 1, 1, g, 0, 1 };
+              memcpy(&expected[i * 16], v, sizeof(v));
+            }
+          }
+          timer.report("helix in C++", (double)passes * num_steps * 2, "vertices");
+        }
+
+        dynarray<float> out(num_steps * 16);
+        bool avx = compiler::cpp_kernel::using_avx();
+        if (avx) {
+          run_kernel(kernel, image.data(), out, passes, "helix.cs kernel, AVX2");
+        }
+        compiler::cpp_kernel::enable_avx(false);
+        run_kernel(kernel, image.data(), out, passes, OCTET_SSE ? "helix.cs kernel, SSE" : "helix.cs kernel, scalar");
+        compiler::cpp_kernel::enable_avx(avx);
+
+        float max_error = 0;
+        for (unsigned i = 0; i != out.size(); ++i) {
+          max_error = std::max(max_error, fabsf(out[i] - expected[i]));
+        }
+        printf("%-40s %10g\n", "largest difference from C++", max_error);
+      }
+    };
+    static cpu_compute_shader_benchmark cpu_compute_shader_benchmark;
+  #endif
+}}
@@ -0,0 +1,359 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Cache of compiled and linked shader programs
+
+namespace octet { namespace shaders {
+  /// Cache of linked shader programs, shared by all shaders.
+  ///
+  /// Programs are keyed by a hash of the vertex and fragment source (including any #defines),
+  /// so materials that use the same shader files share one GL program.
+  ///
+  /// Linked programs are saved to a file with glGetProgramBinary and reloaded with glProgramBinary
+  /// on the next run. The file is thrown away if the GL driver changes.
+  ///
+  /// If the driver has KHR_parallel_shader_compile, asynchronous requests return straight away
+  /// and poll() reports when the driver has finished. Until then, use get_fallback().
+  ///
+  /// Example:
+  ///
+  ///     program_cache::entry *e = program_cache::get().get_program(vs, fs, true);
+  ///     GLuint program = program_cache::get().poll(e) ? e->program : program_cache::get().get_fallback()->program;
+  class program_cache {
+  public:
+    enum {
+      COMPLETION_STATUS_KHR = 0x91B1,
+      PROGRAM_BINARY_RETRIEVABLE_HINT = 0x8257,
+      PROGRAM_BINARY_LENGTH = 0x8741,
+      NUM_PROGRAM_BINARY_FORMATS = 0x87FE,
+    };
+
+    /// One program, shared by all shaders with the same source.
+    struct entry {
+      uint64_t key;
+      GLuint program;
+      GLuint vertex_shader;
+      GLuint fragment_shader;
+      bool pending;   // the driver is still compiling
+      bool ok;        // linked without errors
+    };
+
+  private:
+    enum { file_magic = 0x3143504f }; // "OPC1"
+
+    hash_map<uint64_t, entry*> entries;
+
+    // binaries read from the cache file: key -> offset of the record in file_data
+    hash_map<uint64_t, unsigned> binaries;
+    dynarray<uint8_t> file_data;
+
+    string path;
+    uint64_t driver_key;
+    bool initialized;
+    bool parallel;
+    bool use_binaries;
+    bool file_valid;
+    entry *fallback;
+
+    static uint64_t fnv1a(uint64_t hash, const char *str) {
+      for (; *str; ++str) {
+        hash = (hash ^ (uint8_t)*str) * 0x100000001b3ull;
+      }
+      return (hash ^ 0xff) * 0x100000001b3ull;
+    }
+
+    static bool has_extension(const char *name) {
+      const char *extensions = (const char*)glGetString(GL_EXTENSIONS);
+      size_t len = strlen(name);
+      for (const char *p = extensions; p && (p = strstr(p, name)) != NULL; p += len) {
+        if ((p == extensions || p[-1] == ' ') && (p[len] == ' ' || p[len] == 0)) return true;
+      }
+      return false;
+    }
+
+    static uint32_t read_u32(const uint8_t *p) {
+      return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    static uint64_t read_u64(const uint8_t *p) {
+      return read_u32(p) | ((uint64_t)read_u32(p + 4) << 32);
+    }
+
+    // called on the first request, when we know there is a GL context.
+    void init() {
+      initialized = true;
+      parallel = has_extension("GL_KHR_parallel_shader_compile") || has_extension("GL_ARB_parallel_shader_compile");
+
+      const char *strings[] = {
+        (const char*)glGetString(GL_VENDOR), (const char*)glGetString(GL_RENDERER), (const char*)glGetString(GL_VERSION)
+      };
+      driver_key = 0xcbf29ce484222325ull;
+      for (unsigned i = 0; i != 3; ++i) {
+        driver_key = fnv1a(driver_key, strings[i] ? strings[i] : "");
+      }
+
+      use_binaries = false;
+      #if !defined(__APPLE__) && !OCTET_VITA
+        // ES2 drivers don't know this enum; the value stays at zero.
+        GLint num_formats = 0;
+        glGetIntegerv(NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+        while (glGetError() != GL_NO_ERROR) {}
+        use_binaries = num_formats > 0 && path.size() != 0;
+      #endif
+
+      if (use_binaries) {
+        load_file();
+      }
+    }
+
+    // read the cache file and index the records.
+    // file: magic, driver key, then records of key, format, length, binary
+    void load_file() {
+      file_valid = false;
+      FILE *file = fopen(path.c_str(), "rb");
+      if (!file) return;
+      fseek(file, 0, SEEK_END);
+      long size = ftell(file);
+      fseek(file, 0, SEEK_SET);
+      file_data.resize(size > 0 ? (unsigned)size : 0);
+      size_t bytes = file_data.size() ? fread(file_data.data(), 1, file_data.size(), file) : 0;
+      fclose(file);
+
+      const uint8_t *src = file_data.data();
+      if (bytes != file_data.size() || bytes < 12 || read_u32(src) != file_magic || read_u64(src + 4) != driver_key) {
+        file_data.reset();
+        return;
+      }
+
+      file_valid = true;
+      unsigned offset = 12;
+      while (offset + 16 <= bytes) {
+        uint32_t length = read_u32(src + offset + 12);
+        if (offset + 16 + length > bytes) break;
+        binaries[read_u64(src + offset)] = offset;
+        offset += 16 + length;
+      }
+    }
+
+    // append a program binary to the cache file, starting a new file if the driver has changed.
+    void save_binary(entry *e) {
+      GLint length = 0;
+      glGetProgramiv(e->program, PROGRAM_BINARY_LENGTH, &length);
+      if (length <= 0) return;
+
+      dynarray<uint8_t> record(16 + length);
+      GLenum format = 0;
+      GLsizei written = 0;
+      glGetProgramBinary(e->program, length, &written, &format, record.data() + 16);
+      if (written <= 0) return;
+
+      uint32_t header[4] = { (uint32_t)e->key, (uint32_t)(e->key >> 32), format, (uint32_t)written };
+      memcpy(record.data(), header, sizeof(header));
+
+      FILE *file = fopen(path.c_str(), file_valid ? "ab" : "wb");
+      if (!file) return;
+      if (!file_valid) {
+        uint32_t file_header[3] = { file_magic, (uint32_t)driver_key, (uint32_t)(driver_key >> 32) };
+        fwrite(file_header, 1, sizeof(file_header), file);
+        file_valid = true;
+      }
+      fwrite(record.data(), 1, 16 + written, file);
+      fclose(file);
+    }
+
+    // try to make the program from a binary in the cache file.
+    bool load_binary(entry *e) {
+      int index = binaries.get_index(e->key);
+      if (index < 0 || binaries.get_key(index) != e->key) return false;
+
+      #if !defined(__APPLE__) && !OCTET_VITA
+        const uint8_t *record = file_data.data() + binaries.get_value(index);
+        e->program = glCreateProgram();
+        glProgramBinary(e->program, read_u32(record + 8), record + 16, read_u32(record + 12));
+        GLint status = 0;
+        glGetProgramiv(e->program, GL_LINK_STATUS, &status);
+        if (status) {
+          e->ok = true;
+          return true;
+        }
+        // the driver may reject old binaries; compile from source instead.
+        glDeleteProgram(e->program);
+        e->program = 0;
+      #endif
+      return false;
+    }
+
+    GLuint compile(GLenum kind, const char *src) {
+      GLuint shader = glCreateShader(kind);
+      glShaderSource(shader, 1, &src, NULL);
+      glCompileShader(shader);
+      return shader;
+    }
+
+    // log a shader's errors, if it has any.
+    void log_shader(GLuint shader, const char *kind) {
+      GLint length = 0;
+      glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+      if (length > 1) {
+        dynarray<char> buf(length);
+        glGetShaderInfoLog(shader, length, NULL, buf.data());
+        GLint src_length = 0;
+        glGetShaderiv(shader, GL_SHADER_SOURCE_LENGTH, &src_length);
+        dynarray<char> src(src_length + 1);
+        src[0] = 0;
+        glGetShaderSource(shader, src_length + 1, NULL, src.data());
+        log("%s shader error:\n%s\n%s\n\n\n\n", kind, buf.data(), src.data());
+      }
+    }
+
+    // check the link result and tidy up. On a parallel compiler, this is called once the driver has finished.
+    void finish(entry *e) {
+      e->pending = false;
+      GLint status = 0;
+      glGetProgramiv(e->program, GL_LINK_STATUS, &status);
+      e->ok = status != 0;
+
+      GLint length = 0;
+      glGetProgramiv(e->program, GL_INFO_LOG_LENGTH, &length);
+      if (!e->ok) {
+        log_shader(e->vertex_shader, "Vertex");
+        log_shader(e->fragment_shader, "Fragment");
+      }
+      if (length > 1) {
+        dynarray<char> buf(length);
+        glGetProgramInfoLog(e->program, length, NULL, buf.data());
+        fputs(buf.data(), log("program errors during linking\n"));
+        printf("program errors during linking: check log\n");
+      } else {
+        printf("linked ok\n");
+      }
+
+      glDetachShader(e->program, e->vertex_shader);
+      glDetachShader(e->program, e->fragment_shader);
+      glDeleteShader(e->vertex_shader);
+      glDeleteShader(e->fragment_shader);
+      e->vertex_shader = e->fragment_shader = 0;
+
+      #if !defined(__APPLE__) && !OCTET_VITA
+        if (e->ok && use_binaries) {
+          save_binary(e);
+        }
+      #endif
+    }
+
+  public:
+    program_cache() {
+      path = "shader_cache.bin";
+      driver_key = 0;
+      initialized = false;
+      parallel = false;
+      use_binaries = false;
+      file_valid = false;
+      fallback = 0;
+    }
+
+    /// the cache used by all shaders
+    static program_cache &get() {
+      static program_cache instance;
+      return instance;
+    }
+
+    /// Set the file to save program binaries to. Use "" to disable. Call this before making any shaders.
+    void set_path(const char *new_path) {
+      path = new_path;
+    }
+
+    /// true if programs can compile in the background
+    bool is_parallel() {
+      if (!initialized) init();
+      return parallel;
+    }
+
+    /// Get a program for this source, compiling it if we have not seen it before.
+    /// If async is true and the driver compiles in parallel, the result may still be pending.
+    entry *get_program(const char *vs, const char *fs, bool async) {
+      if (!initialized) init();
+
+      uint64_t key = fnv1a(fnv1a(0xcbf29ce484222325ull, vs), fs);
+      key += key == 0;
+
+      entry *&e = entries[key];
+      if (e) return e;
+
+      e = new entry();
+      e->key = key;
+      e->program = 0;
+      e->vertex_shader = e->fragment_shader = 0;
+      e->pending = false;
+      e->ok = false;
+
+      if (use_binaries && load_binary(e)) {
+        return e;
+      }
+
+      e->vertex_shader = compile(GL_VERTEX_SHADER, vs);
+      e->fragment_shader = compile(GL_FRAGMENT_SHADER, fs);
+
+      // assemble the program for use by glUseProgram
+      GLuint program = glCreateProgram();
+      glAttachShader(program, e->vertex_shader);
+      glAttachShader(program, e->fragment_shader);
+
+      // standardize the attribute slots (in NVidia's CG you can do this in the shader)
+      glBindAttribLocation(program, attribute_pos, "pos");
+      glBindAttribLocation(program, attribute_normal, "normal");
+      glBindAttribLocation(program, attribute_tangent, "tangent");
+      glBindAttribLocation(program, attribute_bitangent, "bitangent");
+      glBindAttribLocation(program, attribute_blendweight, "blendweight");
+      glBindAttribLocation(program, attribute_blendindices, "blendindices");
+      glBindAttribLocation(program, attribute_color, "color");
+      glBindAttribLocation(program, attribute_uv, "uv");
+
+      #if !defined(__APPLE__) && !OCTET_VITA
+        if (use_binaries) {
+          glProgramParameteri(program, PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        }
+      #endif
+
+      glLinkProgram(program);
+      e->program = program;
+
+      if (async && parallel) {
+        // don't ask about the status; that would wait for the compiler.
+        e->pending = true;
+      } else {
+        finish(e);
+      }
+      return e;
+    }
+
+    /// Returns true if the program has finished compiling. Does not wait.
+    bool poll(entry *e) {
+      if (e->pending) {
+        GLint done = 0;
+        glGetProgramiv(e->program, COMPLETION_STATUS_KHR, &done);
+        if (done) finish(e);
+      }
+      return !e->pending;
+    }
+
+    /// A plain grey program to draw with while other programs compile.
+    entry *get_fallback() {
+      if (!fallback) {
+        const char *vs =
+          "attribute vec4 pos;\n"
+          "uniform mat4 modelToProjection;\n"
+          "void main() { gl_Position = modelToProjection * pos; }\n"
+        ;
+        const char *fs =
+          "void main() { gl_FragColor = vec4(0.5, 0.5, 0.5, 1.0); }\n"
+        ;
+        fallback = get_program(vs, fs, false);
+      }
+      return fallback;
+    }
+  };
+}}
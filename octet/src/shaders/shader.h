@@ -11,8 +11,10 @@
 #define SHADER_STR(X) #X
 
 namespace octet { namespace shaders {
+  /// Base class for shaders. Programs come from the program_cache, so identical shaders are only compiled once.
   class shader : public resource {
     GLuint program_;
+    program_cache::entry *entry_;
 
     void link(GLuint vertex_shader, GLuint fragment_shader) {
           // assemble the program for use by glUseProgram
@@ -32,46 +34,52 @@ namespace octet { namespace shaders {
       glLinkProgram(program);
 
       program_ = program;
-      GLsizei length;
-      char buf[0x10000];
-      glGetProgramInfoLog(program, sizeof(buf), &length, buf);
-      if (length) {
-        fputs(buf, log("program errors during linking\n"));
+      GLint length = 0;
+      glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+      if (length > 1) {
+        dynarray<char> buf(length);
+        glGetProgramInfoLog(program, length, NULL, buf.data());
+        fputs(buf.data(), log("program errors during linking\n"));
         printf("program errors during linking: check log\n");
       } else {
         printf("linked ok\n");
       }
     }
+
+  protected:
+    /// called when an asynchronous compile finishes and program() changes. Get uniform locations here.
+    virtual void on_ready() {
+    }
+
   public:
     shader() {
+      program_ = 0;
+      entry_ = 0;
     }
 
     GLuint program() { return program_; }
   
+    /// compile and link a program, waiting for the result.
     void init(const char *vs, const char *fs) {
-      //printf("creating shader program\n");
-
-      GLsizei length;
-      char buf[0x10000];
-      // create our vertex shader and compile it
-      GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-      glShaderSource(vertex_shader, 1, &vs, NULL);
-      glCompileShader(vertex_shader);
-      glGetShaderInfoLog(vertex_shader, sizeof(buf), &length, buf);
-      if (length) {
-        log("Vertex shader error:\n%s\n%s\n\n\n\n", buf, vs);
-      }
-    
-      // create our fragment shader and compile it
-      GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-      glShaderSource(fragment_shader, 1, &fs, NULL);
-      glCompileShader(fragment_shader);
-      glGetShaderInfoLog(fragment_shader, sizeof(buf), &length, buf);
-      if (length) {
-        log("Fragment shader error:\n%s\n%s\n\n\n\n", buf, fs);
-      }
+      entry_ = program_cache::get().get_program(vs, fs, false);
+      program_ = entry_->program;
+    }
 
-      link(vertex_shader, fragment_shader);
+    /// Start compiling a program without waiting for it.
+    /// Until it is ready, program() is a plain fallback program; on_ready() is called when it changes.
+    void init_async(const char *vs, const char *fs) {
+      program_cache &cache = program_cache::get();
+      entry_ = cache.get_program(vs, fs, true);
+      program_ = cache.poll(entry_) ? entry_->program : cache.get_fallback()->program;
+    }
+
+    /// true if the real program is available. Does not wait for the compiler.
+    bool is_ready() {
+      if (entry_ && program_ != entry_->program && program_cache::get().poll(entry_)) {
+        program_ = entry_->program;
+        on_ready();
+      }
+      return !entry_ || program_ == entry_->program;
     }
 
     /// create a program from pre-compiled binary code. (ie. PS Vita)  
@@ -85,12 +93,14 @@ namespace octet { namespace shaders {
         GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
         glShaderBinary(1, &fragment_shader, 0, fs, 0);
 
+        entry_ = 0;
         link(vertex_shader, fragment_shader);
       #endif
     }
 
     // use the program we have compiled in init()
     void render() {
+      is_ready();
       glUseProgram(program_);
     }
 
@@ -26,12 +26,15 @@
 #define OCTET_SHADERS_INCLUDED
 
   // shaders
+  #include "../shaders/program_cache.h"
   #include "../shaders/shader.h"
   #include "../shaders/color_shader.h"
   #include "../shaders/texture_shader.h"
+  #include "../shaders/sprite_shader.h"
   #include "../shaders/phong_shader.h"
   #include "../shaders/bump_shader.h"
   #include "../shaders/compute_shader.h"
+  #include "../shaders/cpu_compute_shader.h"
   #include "Emanuel_Shader.h"
 
 #endif
@@ -0,0 +1,57 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Texture shader with a per vertex tint for batched sprites
+
+namespace octet { namespace shaders {
+  /// Shader used by sprite_batch. Derive from this to draw batched sprites with other effects.
+  class sprite_shader : public shader {
+    // index for world space to projection space matrix
+    GLuint worldToProjectionIndex_;
+
+    // index for texture sampler
+    GLuint samplerIndex_;
+  public:
+    void init() {
+      // sprite vertices are already in world space, so there is no modelToWorld.
+      const char vertex_shader[] = SHADER_STR(
+        varying vec2 uv_;
+        varying vec4 color_;
+
+        attribute vec4 pos;
+        attribute vec2 uv;
+        attribute vec4 color;
+
+        uniform mat4 worldToProjection;
+
+        void main() { gl_Position = worldToProjection * pos; uv_ = uv; color_ = color; }
+      );
+
+      const char fragment_shader[] = SHADER_STR(
+        varying vec2 uv_;
+        varying vec4 color_;
+        uniform sampler2D sampler;
+        void main() { gl_FragColor = texture2D(sampler, uv_) * color_; }
+      );
+
+      init(vertex_shader, fragment_shader);
+    }
+
+    /// compile a derived sprite shader; it must use the pos, uv and color attributes.
+    void init(const char *vertex_shader, const char *fragment_shader) {
+      shader::init(vertex_shader, fragment_shader);
+      worldToProjectionIndex_ = glGetUniformLocation(program(), "worldToProjection");
+      samplerIndex_ = glGetUniformLocation(program(), "sampler");
+    }
+
+    /// called by sprite_batch before each run of sprites that use this shader.
+    virtual void render(const mat4t &worldToProjection, int sampler) {
+      shader::render();
+      glUniform1i(samplerIndex_, sampler);
+      glUniformMatrix4fv(worldToProjectionIndex_, 1, GL_FALSE, worldToProjection.get());
+    }
+  };
+}}